@@ -73,46 +73,93 @@ static void cmac_generate_subkey(const uint8_t *key, uint8_t *subkey) {
   subkey[AES_BLOCK_SIZE - 1] ^= 0x87 >> (8 - (carry * 8));
 }
 
-int aes_cmac_encrypt(aes_cmac_context_t *ctx, const uint8_t *message,
-                     const uint32_t message_len, uint8_t *mac) {
-
-  uint8_t M[AES_BLOCK_SIZE] = {0};
-  const uint8_t *ptr = message;
+// Number of blocks encrypted by one call while the message is processed
+#define CMAC_CHUNK_BLOCKS 16
 
-  memcpy(mac, zero, AES_BLOCK_SIZE);
+void aes_cmac_start(aes_cmac_context_t *ctx) {
+  memcpy(ctx->mac, zero, AES_BLOCK_SIZE);
+  insecure_memzero(ctx->block, AES_BLOCK_SIZE);
+  ctx->block_len = 0;
+}
 
-  uint8_t n_blocks;
-  if (message_len == 0)
-    n_blocks = 0;
-  else
-    n_blocks = (message_len + (AES_BLOCK_SIZE - 1)) / AES_BLOCK_SIZE - 1;
+static int cmac_process(aes_cmac_context_t *ctx, const uint8_t *in, uint32_t in_len) {
+  uint8_t out[CMAC_CHUNK_BLOCKS * AES_BLOCK_SIZE];
+  uint32_t out_len = sizeof(out);
+  int rc = aes_cbc_encrypt(in, in_len, out, &out_len, ctx->mac, AES_BLOCK_SIZE, ctx->aes_ctx);
+  if (rc == 0) {
+    memcpy(ctx->mac, out + in_len - AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+  }
+  insecure_memzero(out, in_len);
+  return rc;
+}
 
-  uint32_t out_len = AES_BLOCK_SIZE;
-  for (uint8_t i = 0; i < n_blocks; i++) {
-    int rc = aes_cbc_encrypt(ptr, AES_BLOCK_SIZE, mac, &out_len, mac, AES_BLOCK_SIZE, ctx->aes_ctx);
-    if (rc) {
-      return rc;
+int aes_cmac_update(aes_cmac_context_t *ctx, const uint8_t *data,
+                    uint32_t data_len) {
+  while (data_len > 0) {
+    // The last block is treated differently by aes_cmac_final, so a full block is only processed once more data follows
+    if (ctx->block_len == AES_BLOCK_SIZE) {
+      int rc = cmac_process(ctx, ctx->block, AES_BLOCK_SIZE);
+      if (rc) {
+        return rc;
+      }
+      ctx->block_len = 0;
+    }
+    if (ctx->block_len == 0 && data_len > AES_BLOCK_SIZE) {
+      // Process whole blocks in place, keeping at least one byte for the last block
+      uint32_t n = (data_len - 1) / AES_BLOCK_SIZE;
+      if (n > CMAC_CHUNK_BLOCKS) {
+        n = CMAC_CHUNK_BLOCKS;
+      }
+      int rc = cmac_process(ctx, data, n * AES_BLOCK_SIZE);
+      if (rc) {
+        return rc;
+      }
+      data += n * AES_BLOCK_SIZE;
+      data_len -= n * AES_BLOCK_SIZE;
+      continue;
     }
-    ptr += AES_BLOCK_SIZE;
+    uint32_t n = AES_BLOCK_SIZE - ctx->block_len;
+    if (n > data_len) {
+      n = data_len;
+    }
+    memcpy(ctx->block + ctx->block_len, data, n);
+    ctx->block_len += n;
+    data += n;
+    data_len -= n;
   }
+  return 0;
+}
 
-  uint8_t remaining_bytes = (message_len % AES_BLOCK_SIZE);
+int aes_cmac_final(aes_cmac_context_t *ctx, uint8_t *mac) {
 
-  if (remaining_bytes == 0) {
-    if (message != NULL && message_len != 0) {
-      memcpy(M, ptr, AES_BLOCK_SIZE);
-      do_xor(ctx->k1, M);
-    } else {
-      do_pad(M, 0);
-      do_xor(ctx->k2, M);
-    }
+  uint8_t M[AES_BLOCK_SIZE] = {0};
+
+  if (ctx->block_len == AES_BLOCK_SIZE) {
+    memcpy(M, ctx->block, AES_BLOCK_SIZE);
+    do_xor(ctx->k1, M);
   } else {
-    memcpy(M, ptr, remaining_bytes);
-    do_pad(M, remaining_bytes);
+    memcpy(M, ctx->block, ctx->block_len);
+    do_pad(M, ctx->block_len);
     do_xor(ctx->k2, M);
   }
 
-  return aes_cbc_encrypt(M, AES_BLOCK_SIZE, mac, &out_len, mac, AES_BLOCK_SIZE, ctx->aes_ctx);
+  uint32_t out_len = AES_BLOCK_SIZE;
+  int rc = aes_cbc_encrypt(M, AES_BLOCK_SIZE, mac, &out_len, ctx->mac, AES_BLOCK_SIZE, ctx->aes_ctx);
+  insecure_memzero(M, sizeof(M));
+  aes_cmac_start(ctx);
+  return rc;
+}
+
+int aes_cmac_encrypt(aes_cmac_context_t *ctx, const uint8_t *message,
+                     const uint32_t message_len, uint8_t *mac) {
+
+  aes_cmac_start(ctx);
+  int rc = aes_cmac_update(ctx, message, message_len);
+  if (rc) {
+    aes_cmac_start(ctx);
+    return rc;
+  }
+  return aes_cmac_final(ctx, mac);
 }
 
 int aes_cmac_init(aes_context *aes_ctx, aes_cmac_context_t *ctx) {
@@ -129,6 +176,7 @@ int aes_cmac_init(aes_context *aes_ctx, aes_cmac_context_t *ctx) {
 
   cmac_generate_subkey(L, ctx->k1);
   cmac_generate_subkey(ctx->k1, ctx->k2);
+  aes_cmac_start(ctx);
 
   return 0;
 }
@@ -37,6 +37,9 @@ typedef struct {
     aes_context *aes_ctx;
     uint8_t k1[AES_BLOCK_SIZE];
     uint8_t k2[AES_BLOCK_SIZE];
+    uint8_t mac[AES_BLOCK_SIZE];   // Chaining value of the message being processed
+    uint8_t block[AES_BLOCK_SIZE]; // Last block of the message so far, only processed once more data follows
+    uint8_t block_len;             // 0 until the first byte of the message
 } aes_cmac_context_t;
 
 #ifndef _WIN32
@@ -49,6 +52,12 @@ int YH_INTERNAL aes_cmac_init(aes_context *aes_ctx, aes_cmac_context_t *ctx);
 int YH_INTERNAL aes_cmac_encrypt(aes_cmac_context_t *ctx,
                                  const uint8_t *message,
                                  const uint32_t message_len, uint8_t *mac);
+// Computes a MAC over data given in several parts, without concatenating them.
+// aes_cmac_start begins a new message with a context set up by aes_cmac_init.
+void YH_INTERNAL aes_cmac_start(aes_cmac_context_t *ctx);
+int YH_INTERNAL aes_cmac_update(aes_cmac_context_t *ctx, const uint8_t *data,
+                                uint32_t data_len);
+int YH_INTERNAL aes_cmac_final(aes_cmac_context_t *ctx, uint8_t *mac);
 void YH_INTERNAL aes_cmac_destroy(aes_cmac_context_t *ctx);
 
 #endif //YUBICO_PIV_TOOL_AES_CMAC_H
@@ -38,6 +38,7 @@ option(GENERATE_MAN_PAGES "Generate man pages for the command line tool" ON)
 option(OPENSSL_STATIC_LINK "Statically link to OpenSSL" OFF)
 option(ENABLE_COVERAGE "Enable/disable codecov evaluation" OFF)
 option(ENABLE_CERT_COMPRESS "Enable/disable compression of certificate" ON)
+option(ENABLE_CCID "Enable/disable direct access to the CCID interface of YubiKeys through libusb" OFF)
 
 set(YKCS11_DBG "0" CACHE STRING "Enable/disable YKCS11 debug messages. Possible values is 0 through 9")
 set(BACKEND "check" CACHE STRING "use specific backend/linkage; 'pcsc', 'macscard' or'winscard'")
@@ -115,6 +115,10 @@ EC_KEY *EVP_PKEY_get0_EC_KEY(const EVP_PKEY *pkey) {
   return pkey->pkey.ec;
 }
 
+int EVP_PKEY_up_ref(EVP_PKEY *pkey) {
+  return CRYPTO_add(&pkey->references, 1, CRYPTO_LOCK_EVP_PKEY) > 1;
+}
+
 int BN_bn2binpad(const BIGNUM *a, unsigned char *to, int tolen) {
 
   unsigned char buf[1024] = {0};
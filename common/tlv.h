@@ -0,0 +1,254 @@
+ /*
+ * Copyright (c) 2025 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef YUBICO_PIV_TOOL_TLV_H
+#define YUBICO_PIV_TOOL_TLV_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Reading and writing of the TLV encoding used by PIV and DER: single byte tags, and lengths
+ * encoded in one to three bytes (up to 0xffff). Values are never copied when reading, a view
+ * points into the buffer being parsed. Every element is checked to fit within the buffer.
+ */
+
+typedef struct {
+  uint8_t tag;
+  const uint8_t *value;
+  size_t length;
+} tlv_view;
+
+typedef struct {
+  const uint8_t *ptr;
+  const uint8_t *end;
+  bool error; // Set once an element doesn't fit within the buffer, after which nothing more is read
+} tlv_reader;
+
+typedef struct {
+  uint8_t *ptr;
+  uint8_t *end;
+  bool error; // Set once an element doesn't fit within the buffer, after which nothing more is written
+} tlv_writer;
+
+// Decoder for an element whose encoding arrives in parts, for example in several responses
+typedef struct {
+  uint8_t header[4];
+  size_t header_len;
+  bool complete; // The tag and length have been received
+  bool error;    // The length encoding is invalid
+  uint8_t tag;
+  size_t length;
+  size_t remaining; // Value bytes not received yet
+} tlv_stream;
+
+static inline size_t tlv_length_size(size_t length) {
+  if(length < 0x80) {
+    return 1;
+  } else if(length < 0x100) {
+    return 2;
+  } else {
+    return 3;
+  }
+}
+
+// Size of an element with a value of the given length
+static inline size_t tlv_size(size_t length) {
+  return 1 + tlv_length_size(length) + length;
+}
+
+// Encodes the length into buffer, which must hold tlv_length_size(length) bytes
+static inline size_t tlv_put_length(uint8_t *buffer, size_t length) {
+  if(length < 0x80) {
+    buffer[0] = (uint8_t)length;
+    return 1;
+  } else if(length < 0x100) {
+    buffer[0] = 0x81;
+    buffer[1] = (uint8_t)length;
+    return 2;
+  } else {
+    buffer[0] = 0x82;
+    buffer[1] = (length >> 8) & 0xff;
+    buffer[2] = length & 0xff;
+    return 3;
+  }
+}
+
+// Decodes the length at buffer, returns the number of length bytes, or 0 if the length or the value doesn't fit before end
+static inline size_t tlv_get_length(const uint8_t *buffer, const uint8_t *end, size_t *length) {
+  if(buffer + 1 <= end && buffer[0] < 0x80) {
+    *length = buffer[0];
+    return (size_t)(end - buffer) - 1 >= *length ? 1 : 0;
+  } else if(buffer + 2 <= end && buffer[0] == 0x81) {
+    *length = buffer[1];
+    return (size_t)(end - buffer) - 2 >= *length ? 2 : 0;
+  } else if(buffer + 3 <= end && buffer[0] == 0x82) {
+    *length = ((size_t)buffer[1] << 8) + buffer[2];
+    return (size_t)(end - buffer) - 3 >= *length ? 3 : 0;
+  }
+  *length = 0;
+  return 0;
+}
+
+static inline void tlv_reader_init(tlv_reader *reader, const uint8_t *buffer, size_t length) {
+  reader->ptr = buffer;
+  reader->end = buffer + length;
+  reader->error = false;
+}
+
+// Reads the elements contained in the value of tlv
+static inline void tlv_reader_enter(tlv_reader *reader, const tlv_view *tlv) {
+  tlv_reader_init(reader, tlv->value, tlv->length);
+}
+
+static inline bool tlv_more(const tlv_reader *reader) {
+  return !reader->error && reader->ptr < reader->end;
+}
+
+// Reads the next element, returns false at the end of the buffer or if the element is malformed
+static inline bool tlv_next(tlv_reader *reader, tlv_view *tlv) {
+  if(!tlv_more(reader)) {
+    return false;
+  }
+  size_t offs = tlv_get_length(reader->ptr + 1, reader->end, &tlv->length);
+  if(!offs) {
+    reader->error = true;
+    return false;
+  }
+  tlv->tag = reader->ptr[0];
+  tlv->value = reader->ptr + 1 + offs;
+  reader->ptr = tlv->value + tlv->length;
+  return true;
+}
+
+// Reads the next element, which must have the given tag
+static inline bool tlv_expect(tlv_reader *reader, uint8_t tag, tlv_view *tlv) {
+  if(tlv_next(reader, tlv) && tlv->tag == tag) {
+    return true;
+  }
+  reader->error = true;
+  return false;
+}
+
+// Skips elements up to and including the first one with the given tag
+static inline bool tlv_find(tlv_reader *reader, uint8_t tag, tlv_view *tlv) {
+  while(tlv_next(reader, tlv)) {
+    if(tlv->tag == tag) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static inline void tlv_stream_init(tlv_stream *stream) {
+  memset(stream, 0, sizeof(*stream));
+}
+
+// Collects the tag and length of an element received in parts, consuming them from *data.
+// Returns true once both are complete, with *data and *len left at the value bytes that follow.
+static inline bool tlv_stream_header(tlv_stream *stream, const uint8_t **data, size_t *len) {
+  while(!stream->complete) {
+    if(stream->error || *len == 0) {
+      return false;
+    }
+    stream->header[stream->header_len++] = *(*data)++;
+    (*len)--;
+    if(stream->header_len < 2) {
+      continue;
+    }
+    uint8_t first = stream->header[1];
+    size_t need = first < 0x80 ? 2 : first == 0x81 ? 3 : first == 0x82 ? 4 : 0;
+    if(!need) {
+      stream->error = true;
+      return false;
+    }
+    if(stream->header_len == need) {
+      stream->tag = stream->header[0];
+      if(need == 2) {
+        stream->length = first;
+      } else if(need == 3) {
+        stream->length = stream->header[2];
+      } else {
+        stream->length = ((size_t)stream->header[2] << 8) + stream->header[3];
+      }
+      stream->remaining = stream->length;
+      stream->complete = true;
+    }
+  }
+  return true;
+}
+
+// Takes as many of the value bytes still expected as *data holds, and returns where they start
+static inline const uint8_t *tlv_stream_value(tlv_stream *stream, const uint8_t **data, size_t *len, size_t *value_len) {
+  const uint8_t *value = *data;
+  *value_len = *len < stream->remaining ? *len : stream->remaining;
+  *data += *value_len;
+  *len -= *value_len;
+  stream->remaining -= *value_len;
+  return value;
+}
+
+static inline void tlv_writer_init(tlv_writer *writer, uint8_t *buffer, size_t length) {
+  writer->ptr = buffer;
+  writer->end = buffer + length;
+  writer->error = false;
+}
+
+// Writes the tag and length, and returns where the value is to be written in place, or NULL if it doesn't fit
+static inline uint8_t *tlv_put_header(tlv_writer *writer, uint8_t tag, size_t length) {
+  if(writer->error || (size_t)(writer->end - writer->ptr) < tlv_size(length)) {
+    writer->error = true;
+    return NULL;
+  }
+  uint8_t *value = writer->ptr + 1 + tlv_length_size(length);
+  writer->ptr[0] = tag;
+  tlv_put_length(writer->ptr + 1, length);
+  writer->ptr = value + length;
+  return value;
+}
+
+// Writes an element, value may overlap with the buffer being written
+static inline bool tlv_put(tlv_writer *writer, uint8_t tag, const void *value, size_t length) {
+  if(writer->error || (size_t)(writer->end - writer->ptr) < tlv_size(length)) {
+    writer->error = true;
+    return false;
+  }
+  // Move the value before writing the header, which it may occupy
+  uint8_t *dst = writer->ptr + 1 + tlv_length_size(length);
+  if(length && dst != value) {
+    memmove(dst, value, length);
+  }
+  tlv_put_header(writer, tag, length);
+  return true;
+}
+
+#endif
@@ -46,6 +46,7 @@
 #include "ykpiv.h"
 
 #include "util.h"
+#include "tlv.h"
 
 FILE *open_file(const char *file_name, enum file_mode mode) {
   FILE *file;
@@ -281,45 +282,18 @@ void dump_data(const unsigned char *buf, unsigned int len, FILE *output, bool sp
 }
 
 unsigned long get_length_size(unsigned long length) {
-  if (length < 0x80) {
-    return 1;
-  } else if (length < 0x100) {
-    return 2;
-  } else {
-    return 3;
-  }
+  return (unsigned long)tlv_length_size(length);
 }
 
 unsigned long set_length(unsigned char *buffer, unsigned long length) {
-  if(length < 0x80) {
-    *buffer++ = length;
-    return 1;
-  } else if(length < 0x100) {
-    *buffer++ = 0x81;
-    *buffer++ = length;
-    return 2;
-  } else {
-    *buffer++ = 0x82;
-    *buffer++ = (length >> 8) & 0xff;
-    *buffer++ = length & 0xff;
-    return 3;
-  }
+  return (unsigned long)tlv_put_length(buffer, length);
 }
 
 unsigned long get_length(const unsigned char *buffer, const unsigned char *end, unsigned long *len) {
-  if(buffer + 1 <= end && buffer[0] < 0x80) {
-    *len = buffer[0];
-    return buffer + 1 + *len <= end ? 1 : 0;
-  } else if(buffer + 2 <= end && buffer[0] == 0x81) {
-    *len = buffer[1];
-    return buffer + 2 + *len <= end ? 2 : 0;
-  } else if(buffer + 3 <= end && buffer[0] == 0x82) {
-    size_t tmp = buffer[1];
-    *len = (tmp << 8) + buffer[2];
-    return buffer + 3 + *len <= end ? 3 : 0;
-  }
-  *len = 0;
-  return 0;
+  size_t length = 0;
+  size_t offs = tlv_get_length(buffer, end, &length);
+  *len = (unsigned long)length;
+  return (unsigned long)offs;
 }
 
 int get_curve_name(int key_algorithm) {
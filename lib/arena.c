@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2025 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "ykpiv.h"
+
+#define YKPIV_ARENA_ALIGN 16
+#define YKPIV_ARENA_BLOCK_SIZE 65536
+
+// Each allocation is preceded by its size, so that it can be grown in place or given back when it is the last one
+typedef union {
+  size_t size;
+  unsigned char align[YKPIV_ARENA_ALIGN];
+} ykpiv_arena_header;
+
+typedef struct ykpiv_arena_block {
+  struct ykpiv_arena_block *next;
+  size_t size;
+  size_t used;
+  unsigned char *last; // Most recent allocation in this block
+  unsigned char data[];
+} ykpiv_arena_block;
+
+struct ykpiv_arena {
+  size_t block_size;
+  ykpiv_arena_block *blocks;
+  ykpiv_arena_block *current;
+  ykpiv_arena_stats stats;
+};
+
+static size_t _arena_round(size_t size) {
+  return (size + YKPIV_ARENA_ALIGN - 1) & ~(size_t)(YKPIV_ARENA_ALIGN - 1);
+}
+
+static ykpiv_arena_header *_arena_header(void *address) {
+  return (ykpiv_arena_header*)address - 1;
+}
+
+static void *_arena_alloc(void *data, size_t size) {
+  ykpiv_arena *arena = data;
+  ykpiv_arena_block *block = arena->current;
+  size_t need = sizeof(ykpiv_arena_header) + _arena_round(size);
+
+  if (_arena_round(size) < size) {
+    return NULL;
+  }
+
+  // Blocks after the current one are empty, they are kept from before the last reset
+  while (block && block->size - block->used < need) {
+    block = block->next;
+  }
+  if (!block) {
+    size_t cb = need > arena->block_size ? need : arena->block_size;
+    if (!(block = calloc(1, sizeof(ykpiv_arena_block) + cb))) {
+      return NULL;
+    }
+    block->size = cb;
+    if (arena->current) {
+      block->next = arena->current->next;
+      arena->current->next = block;
+    } else {
+      arena->blocks = block;
+    }
+    arena->stats.blocks++;
+    arena->stats.block_allocations++;
+    arena->stats.capacity += cb;
+  }
+  arena->current = block;
+
+  ykpiv_arena_header *header = (ykpiv_arena_header*)(block->data + block->used);
+  header->size = size;
+  block->last = (unsigned char*)(header + 1);
+  block->used += need;
+
+  arena->stats.allocations++;
+  arena->stats.bytes += need;
+  if (arena->stats.bytes > arena->stats.peak_bytes) {
+    arena->stats.peak_bytes = arena->stats.bytes;
+  }
+  return block->last;
+}
+
+static void _arena_free(void *data, void *address) {
+  ykpiv_arena *arena = data;
+  ykpiv_arena_block *block = arena->current;
+
+  // Only the most recent allocation is given back, the rest is released by ykpiv_arena_reset()
+  if (address && block && block->last == address) {
+    size_t cb = sizeof(ykpiv_arena_header) + _arena_round(_arena_header(address)->size);
+    yc_memzero(_arena_header(address), cb);
+    block->used -= cb;
+    block->last = NULL;
+    arena->stats.bytes -= cb;
+  }
+}
+
+static void *_arena_realloc(void *data, void *address, size_t size) {
+  ykpiv_arena *arena = data;
+  ykpiv_arena_block *block = arena->current;
+
+  if (!address) {
+    return _arena_alloc(data, size);
+  }
+
+  ykpiv_arena_header *header = _arena_header(address);
+  size_t old = _arena_round(header->size);
+  size_t cb = _arena_round(size);
+  if (cb < size) {
+    return NULL;
+  }
+
+  // The most recent allocation grows or shrinks in place when the block has room
+  if (block && block->last == address && block->size - (block->used - old) >= cb) {
+    if (cb < old) {
+      yc_memzero((unsigned char*)address + cb, old - cb);
+    }
+    block->used = block->used - old + cb;
+    arena->stats.bytes = arena->stats.bytes - old + cb;
+    if (arena->stats.bytes > arena->stats.peak_bytes) {
+      arena->stats.peak_bytes = arena->stats.bytes;
+    }
+    header->size = size;
+    return address;
+  }
+
+  void *p = _arena_alloc(data, size);
+  if (p) {
+    memcpy(p, address, header->size < size ? header->size : size);
+  }
+  return p;
+}
+
+ykpiv_rc ykpiv_arena_init(ykpiv_arena **arena, size_t block_size) {
+  if (!arena) {
+    return YKPIV_ARGUMENT_ERROR;
+  }
+  if (!(*arena = calloc(1, sizeof(ykpiv_arena)))) {
+    return YKPIV_MEMORY_ERROR;
+  }
+  (*arena)->block_size = block_size ? block_size : YKPIV_ARENA_BLOCK_SIZE;
+  return YKPIV_OK;
+}
+
+ykpiv_rc ykpiv_arena_done(ykpiv_arena *arena) {
+  if (!arena) {
+    return YKPIV_ARGUMENT_ERROR;
+  }
+  ykpiv_arena_block *block = arena->blocks;
+  while (block) {
+    ykpiv_arena_block *next = block->next;
+    yc_memzero(block->data, block->used);
+    free(block);
+    block = next;
+  }
+  free(arena);
+  return YKPIV_OK;
+}
+
+ykpiv_rc ykpiv_arena_reset(ykpiv_arena *arena) {
+  if (!arena) {
+    return YKPIV_ARGUMENT_ERROR;
+  }
+  // Blocks are wiped and kept, so that the same work after a reset doesn't allocate memory again
+  for (ykpiv_arena_block *block = arena->blocks; block; block = block->next) {
+    yc_memzero(block->data, block->used);
+    block->used = 0;
+    block->last = NULL;
+  }
+  arena->current = arena->blocks;
+  arena->stats.bytes = 0;
+  arena->stats.resets++;
+  return YKPIV_OK;
+}
+
+ykpiv_rc ykpiv_arena_get_allocator(ykpiv_arena *arena, ykpiv_allocator *allocator) {
+  if (!arena || !allocator) {
+    return YKPIV_ARGUMENT_ERROR;
+  }
+  allocator->pfn_alloc = _arena_alloc;
+  allocator->pfn_realloc = _arena_realloc;
+  allocator->pfn_free = _arena_free;
+  allocator->alloc_data = arena;
+  return YKPIV_OK;
+}
+
+ykpiv_rc ykpiv_arena_get_stats(ykpiv_arena *arena, ykpiv_arena_stats *stats) {
+  if (!arena || !stats) {
+    return YKPIV_ARGUMENT_ERROR;
+  }
+  *stats = arena->stats;
+  return YKPIV_OK;
+}
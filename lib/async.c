@@ -0,0 +1,372 @@
+/*
+ * Copyright (c) 2025 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "internal.h"
+#include "ykpiv.h"
+#include "threads.h"
+
+typedef struct ykpiv_request {
+  struct ykpiv_request *next;
+  ykpiv_queue *queue;
+  bool sign;
+  const unsigned char *in;
+  size_t in_len;
+  unsigned char *out;
+  size_t out_len;
+  unsigned char algorithm;
+  unsigned char key;
+  ykpiv_async_cb callback;
+  void *ctx;
+  ykpiv_rc res;
+} ykpiv_request;
+
+typedef struct {
+  ykpiv_request *head;
+  ykpiv_request *tail;
+} ykpiv_request_list;
+
+struct ykpiv_worker {
+  ykpiv_state *state;
+  yc_thread thread;
+  yc_mutex mutex;
+  yc_cond cond;
+  ykpiv_request_list requests; // Submitted, not yet run
+  size_t pending;              // Submitted, not yet completed
+  bool stop;
+};
+
+// State run by the worker of this thread, which may use it while requests are pending
+static YKPIV_THREAD_LOCAL const ykpiv_state *worker_state;
+
+struct ykpiv_queue {
+  yc_mutex mutex;
+  yc_cond cond;
+  ykpiv_request_list completed;
+#ifdef _WIN32
+  HANDLE event;
+#else
+  int fds[2]; // Pipe with one byte per completed request
+#endif
+};
+
+static void _list_push(ykpiv_request_list *list, ykpiv_request *req) {
+  req->next = NULL;
+  if(list->tail) {
+    list->tail->next = req;
+  } else {
+    list->head = req;
+  }
+  list->tail = req;
+}
+
+static ykpiv_request *_list_take(ykpiv_request_list *list) {
+  ykpiv_request *head = list->head;
+  list->head = list->tail = NULL;
+  return head;
+}
+
+static void _queue_complete(ykpiv_queue *queue, ykpiv_request *req) {
+  yc_mutex_lock(&queue->mutex);
+  _list_push(&queue->completed, req);
+#ifdef _WIN32
+  SetEvent(queue->event);
+#else
+  // The pipe only signals readiness, a full pipe is already readable
+  if(write(queue->fds[1], "", 1) < 0) {
+    DBG("Failed to signal completion");
+  }
+#endif
+  yc_cond_broadcast(&queue->cond);
+  yc_mutex_unlock(&queue->mutex);
+}
+
+static void _worker_main(void *arg) {
+  struct ykpiv_worker *worker = arg;
+  ykpiv_state *state = worker->state;
+
+  worker_state = state;
+  yc_mutex_lock(&worker->mutex);
+  for(;;) {
+    ykpiv_request *req = _list_take(&worker->requests);
+    if(!req) {
+      if(worker->stop) {
+        break;
+      }
+      yc_cond_wait(&worker->cond, &worker->mutex);
+      continue;
+    }
+    yc_mutex_unlock(&worker->mutex);
+
+    while(req) {
+      ykpiv_request *next = req->next;
+      if(req->sign) {
+        req->res = ykpiv_sign_data(state, req->in, req->in_len, req->out, &req->out_len, req->algorithm, req->key);
+      } else {
+        req->res = ykpiv_decipher_data(state, req->in, req->in_len, req->out, &req->out_len, req->algorithm, req->key);
+      }
+      if(req->res != YKPIV_OK) {
+        req->out_len = 0;
+      }
+      yc_mutex_lock(&worker->mutex);
+      worker->pending--;
+      yc_mutex_unlock(&worker->mutex);
+      _queue_complete(req->queue, req);
+      req = next;
+    }
+
+    yc_mutex_lock(&worker->mutex);
+  }
+  yc_mutex_unlock(&worker->mutex);
+}
+
+static ykpiv_rc _start_worker(ykpiv_state *state) {
+  struct ykpiv_worker *worker = calloc(1, sizeof(struct ykpiv_worker));
+  if(!worker) {
+    DBG("Failed to allocate memory for worker");
+    return YKPIV_MEMORY_ERROR;
+  }
+  worker->state = state;
+  if(!yc_mutex_init(&worker->mutex)) {
+    free(worker);
+    return YKPIV_GENERIC_ERROR;
+  }
+  if(!yc_cond_init(&worker->cond)) {
+    yc_mutex_destroy(&worker->mutex);
+    free(worker);
+    return YKPIV_GENERIC_ERROR;
+  }
+  if(!yc_thread_start(&worker->thread, _worker_main, worker)) {
+    DBG("Failed to start worker thread");
+    yc_cond_destroy(&worker->cond);
+    yc_mutex_destroy(&worker->mutex);
+    free(worker);
+    return YKPIV_GENERIC_ERROR;
+  }
+  state->worker = worker;
+  return YKPIV_OK;
+}
+
+void _ykpiv_stop_worker(ykpiv_state *state) {
+  struct ykpiv_worker *worker = state->worker;
+  if(!worker) {
+    return;
+  }
+  // Requests already submitted are run before the worker exits
+  yc_mutex_lock(&worker->mutex);
+  worker->stop = true;
+  yc_cond_broadcast(&worker->cond);
+  yc_mutex_unlock(&worker->mutex);
+  yc_thread_join(worker->thread);
+  yc_cond_destroy(&worker->cond);
+  yc_mutex_destroy(&worker->mutex);
+  free(worker);
+  state->worker = NULL;
+}
+
+bool _ykpiv_worker_busy(ykpiv_state *state) {
+  struct ykpiv_worker *worker = state->worker;
+  bool busy;
+
+  if(!worker || worker_state == state) {
+    return false;
+  }
+  yc_mutex_lock(&worker->mutex);
+  busy = worker->pending != 0;
+  yc_mutex_unlock(&worker->mutex);
+  return busy;
+}
+
+static ykpiv_rc _submit(ykpiv_state *state, ykpiv_queue *queue, bool sign, const unsigned char *in, size_t in_len,
+                        unsigned char *out, size_t out_len, unsigned char algorithm, unsigned char key,
+                        ykpiv_async_cb callback, void *ctx) {
+  ykpiv_rc res;
+
+  if(!state || !queue || !in || !out || !callback) {
+    return YKPIV_ARGUMENT_ERROR;
+  }
+
+  ykpiv_request *req = calloc(1, sizeof(ykpiv_request));
+  if(!req) {
+    DBG("Failed to allocate memory for request");
+    return YKPIV_MEMORY_ERROR;
+  }
+  req->queue = queue;
+  req->sign = sign;
+  req->in = in;
+  req->in_len = in_len;
+  req->out = out;
+  req->out_len = out_len;
+  req->algorithm = algorithm;
+  req->key = key;
+  req->callback = callback;
+  req->ctx = ctx;
+
+  if(!state->worker && (res = _start_worker(state)) != YKPIV_OK) {
+    free(req);
+    return res;
+  }
+
+  struct ykpiv_worker *worker = state->worker;
+  yc_mutex_lock(&worker->mutex);
+  _list_push(&worker->requests, req);
+  worker->pending++;
+  yc_cond_broadcast(&worker->cond);
+  yc_mutex_unlock(&worker->mutex);
+  return YKPIV_OK;
+}
+
+ykpiv_rc ykpiv_sign_data_async(ykpiv_state *state, ykpiv_queue *queue, const unsigned char *sign_in,
+                               size_t in_len, unsigned char *sign_out, size_t out_len,
+                               unsigned char algorithm, unsigned char key, ykpiv_async_cb callback, void *ctx) {
+  return _submit(state, queue, true, sign_in, in_len, sign_out, out_len, algorithm, key, callback, ctx);
+}
+
+ykpiv_rc ykpiv_decipher_data_async(ykpiv_state *state, ykpiv_queue *queue, const unsigned char *enc_in,
+                                   size_t in_len, unsigned char *enc_out, size_t out_len,
+                                   unsigned char algorithm, unsigned char key, ykpiv_async_cb callback, void *ctx) {
+  return _submit(state, queue, false, enc_in, in_len, enc_out, out_len, algorithm, key, callback, ctx);
+}
+
+ykpiv_rc ykpiv_queue_init(ykpiv_queue **queue) {
+  if(!queue) {
+    return YKPIV_ARGUMENT_ERROR;
+  }
+  ykpiv_queue *q = calloc(1, sizeof(ykpiv_queue));
+  if(!q) {
+    DBG("Failed to allocate memory for queue");
+    return YKPIV_MEMORY_ERROR;
+  }
+  if(!yc_mutex_init(&q->mutex)) {
+    free(q);
+    return YKPIV_GENERIC_ERROR;
+  }
+  if(!yc_cond_init(&q->cond)) {
+    yc_mutex_destroy(&q->mutex);
+    free(q);
+    return YKPIV_GENERIC_ERROR;
+  }
+#ifdef _WIN32
+  if(!(q->event = CreateEvent(NULL, TRUE, FALSE, NULL))) {
+#else
+  if(pipe(q->fds)) {
+#endif
+    DBG("Failed to create completion notification");
+    yc_cond_destroy(&q->cond);
+    yc_mutex_destroy(&q->mutex);
+    free(q);
+    return YKPIV_GENERIC_ERROR;
+  }
+#ifndef _WIN32
+  for(int i = 0; i < 2; i++) {
+    fcntl(q->fds[i], F_SETFL, fcntl(q->fds[i], F_GETFL) | O_NONBLOCK);
+    fcntl(q->fds[i], F_SETFD, FD_CLOEXEC);
+  }
+#endif
+  *queue = q;
+  return YKPIV_OK;
+}
+
+ykpiv_rc ykpiv_queue_done(ykpiv_queue *queue) {
+  if(!queue) {
+    return YKPIV_ARGUMENT_ERROR;
+  }
+  ykpiv_request *req = _list_take(&queue->completed);
+  while(req) {
+    ykpiv_request *next = req->next;
+    free(req);
+    req = next;
+  }
+#ifdef _WIN32
+  CloseHandle(queue->event);
+#else
+  close(queue->fds[0]);
+  close(queue->fds[1]);
+#endif
+  yc_cond_destroy(&queue->cond);
+  yc_mutex_destroy(&queue->mutex);
+  free(queue);
+  return YKPIV_OK;
+}
+
+ykpiv_rc ykpiv_queue_poll(ykpiv_queue *queue, uint32_t timeout_ms, size_t *completed) {
+  size_t n = 0;
+
+  if(!queue) {
+    return YKPIV_ARGUMENT_ERROR;
+  }
+
+  yc_mutex_lock(&queue->mutex);
+  if(!queue->completed.head && timeout_ms) {
+    yc_cond_timedwait(&queue->cond, &queue->mutex, timeout_ms);
+  }
+  ykpiv_request *req = _list_take(&queue->completed);
+#ifdef _WIN32
+  ResetEvent(queue->event);
+#else
+  char buf[64];
+  while(read(queue->fds[0], buf, sizeof(buf)) > 0);
+#endif
+  yc_mutex_unlock(&queue->mutex);
+
+  // Callbacks run without the lock, so they can submit new requests
+  while(req) {
+    ykpiv_request *next = req->next;
+    req->callback(req->ctx, req->res, req->out, req->out_len);
+    free(req);
+    req = next;
+    n++;
+  }
+
+  if(completed) {
+    *completed = n;
+  }
+  return YKPIV_OK;
+}
+
+intptr_t ykpiv_queue_get_fd(ykpiv_queue *queue) {
+  if(!queue) {
+    return -1;
+  }
+#ifdef _WIN32
+  return (intptr_t)queue->event;
+#else
+  return queue->fds[0];
+#endif
+}
@@ -0,0 +1,521 @@
+/*
+ * Copyright (c) 2025 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // For struct ucred
+#endif
+
+// A broker owns the connection to a card and exchanges the APDUs of other processes with it, so that they
+// share one PC/SC connection, and recovering from resets happens in one place. Clients send one request at a
+// time over a Unix socket, and wait for its response:
+//   request:  operation (1 byte), length (4 bytes, big endian), payload
+//   response: ykpiv_rc (4 bytes, big endian), length (4 bytes, big endian), payload
+// The APDUs of a transaction are sent between BEGIN and END, meanwhile the other clients are left waiting.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#endif
+
+#include "internal.h"
+#include "broker.h"
+
+#ifndef _WIN32
+
+#define BROKER_OP_BEGIN 0x01
+#define BROKER_OP_END 0x02
+#define BROKER_OP_TRANSMIT 0x03
+
+#define BROKER_REQUEST_HEADER_LEN 5
+#define BROKER_RESPONSE_HEADER_LEN 8
+// Large enough for an extended APDU, and for a response with its status word
+#define BROKER_MSG_MAX (65536 + 16)
+#define BROKER_MAX_CLIENTS 64
+// For how long the PC/SC transaction is kept from other applications while clients are waiting
+#define BROKER_HOLD_MS 200
+// A client keeping the card without sending anything for this long is disconnected
+#define BROKER_IDLE_MS 30000
+// How often the stop flag is checked
+#define BROKER_POLL_MS 250
+// A client that is this slow to send the rest of a request or to take its response is disconnected
+#define BROKER_IO_MS 1000
+
+#ifdef MSG_NOSIGNAL
+#define BROKER_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define BROKER_SEND_FLAGS 0
+#endif
+
+typedef struct {
+  int fd;
+  unsigned char buf[BROKER_RESPONSE_HEADER_LEN + BROKER_MSG_MAX];
+} broker_conn;
+
+typedef struct {
+  int fd;
+  uint64_t last_ms; // When the client last sent a request
+} broker_client;
+
+typedef struct {
+  ykpiv_state *state;
+  broker_client clients[BROKER_MAX_CLIENTS];
+  size_t n_clients;
+  bool owned;   // A client is between BEGIN and END
+  size_t owner; // Index of that client
+  size_t next;  // Client served first once the card is free, so that all get their turn
+  bool held;    // The PC/SC transaction is held
+  uint64_t held_since_ms;
+  unsigned char in[BROKER_MSG_MAX];
+  unsigned char out[BROKER_RESPONSE_HEADER_LEN + BROKER_MSG_MAX];
+} broker_server;
+
+static uint64_t broker_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void broker_put32(unsigned char *p, uint32_t v) {
+  p[0] = (v >> 24) & 0xff;
+  p[1] = (v >> 16) & 0xff;
+  p[2] = (v >> 8) & 0xff;
+  p[3] = v & 0xff;
+}
+
+static uint32_t broker_get32(const unsigned char *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static bool broker_read(int fd, unsigned char *buf, size_t len) {
+  while (len) {
+    ssize_t n = recv(fd, buf, len, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    buf += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+static bool broker_write(int fd, const unsigned char *buf, size_t len) {
+  while (len) {
+    ssize_t n = send(fd, buf, len, BROKER_SEND_FLAGS);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    buf += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+// Writes to a client that went away fail instead of raising SIGPIPE, where MSG_NOSIGNAL is missing
+static void broker_nosigpipe(int fd) {
+#ifdef SO_NOSIGPIPE
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#else
+  (void)fd;
+#endif
+}
+
+// Bounds for how long a client can keep the others waiting in the middle of a request
+static void broker_timeouts(int fd) {
+  struct timeval tv = {BROKER_IO_MS / 1000, (BROKER_IO_MS % 1000) * 1000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// Only the user running the broker and root may use the card, even where the socket permissions are ignored
+static bool broker_peer_allowed(int fd) {
+  uid_t uid;
+#ifdef SO_PEERCRED
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+    DBG("Unable to get the credentials of a client: %s", strerror(errno));
+    return false;
+  }
+  uid = cred.uid;
+#else
+  gid_t gid;
+  if (getpeereid(fd, &uid, &gid)) {
+    DBG("Unable to get the credentials of a client: %s", strerror(errno));
+    return false;
+  }
+#endif
+  if (uid != 0 && uid != geteuid()) {
+    DBG("Refusing client of user %u", (unsigned)uid);
+    return false;
+  }
+  return true;
+}
+
+static bool broker_address(const char *path, struct sockaddr_un *addr) {
+  size_t len = strlen(path);
+  if (len >= sizeof(addr->sun_path)) {
+    DBG("Broker socket path %s is too long", path);
+    return false;
+  }
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  memcpy(addr->sun_path, path, len + 1);
+  return true;
+}
+
+static ykpiv_rc broker_call(broker_conn *conn, uint8_t op, const unsigned char *data, size_t len,
+                            unsigned char *out, size_t *out_len) {
+  if (conn->fd < 0) {
+    return YKPIV_PCSC_ERROR;
+  }
+  if (len > BROKER_MSG_MAX - BROKER_REQUEST_HEADER_LEN) {
+    return YKPIV_SIZE_ERROR;
+  }
+  conn->buf[0] = op;
+  broker_put32(conn->buf + 1, (uint32_t)len);
+  if (len) {
+    memcpy(conn->buf + BROKER_REQUEST_HEADER_LEN, data, len);
+  }
+  if (!broker_write(conn->fd, conn->buf, BROKER_REQUEST_HEADER_LEN + len) ||
+      !broker_read(conn->fd, conn->buf, BROKER_RESPONSE_HEADER_LEN)) {
+    goto Lost;
+  }
+  ykpiv_rc res = (ykpiv_rc)(int32_t)broker_get32(conn->buf);
+  size_t resp_len = broker_get32(conn->buf + 4);
+  if (resp_len > BROKER_MSG_MAX || !broker_read(conn->fd, conn->buf, resp_len)) {
+    goto Lost;
+  }
+  if (out) {
+    if (resp_len > *out_len) {
+      return YKPIV_SIZE_ERROR;
+    }
+    memcpy(out, conn->buf, resp_len);
+    *out_len = resp_len;
+  }
+  return res;
+
+Lost:
+  // Out of step with the broker, so every later call fails as well
+  DBG("Lost the connection to the broker");
+  close(conn->fd);
+  conn->fd = -1;
+  return YKPIV_PCSC_ERROR;
+}
+
+static ykpiv_rc broker_transmit(void *ctx, const unsigned char *send, size_t send_len, unsigned char *recv,
+                                size_t *recv_len) {
+  return broker_call(ctx, BROKER_OP_TRANSMIT, send, send_len, recv, recv_len);
+}
+
+static ykpiv_rc broker_begin(void *ctx) {
+  return broker_call(ctx, BROKER_OP_BEGIN, NULL, 0, NULL, NULL);
+}
+
+static void broker_end(void *ctx) {
+  broker_call(ctx, BROKER_OP_END, NULL, 0, NULL, NULL);
+}
+
+static void broker_close(void *ctx) {
+  broker_conn *conn = ctx;
+  if (conn->fd >= 0) {
+    close(conn->fd);
+  }
+  free(conn);
+}
+
+ykpiv_rc _ykpiv_broker_open(const char *path, ykpiv_transport *transport) {
+  struct sockaddr_un addr;
+  broker_conn *conn;
+
+  if (!broker_address(path, &addr)) {
+    return YKPIV_SIZE_ERROR;
+  }
+  if (!(conn = malloc(sizeof(broker_conn)))) {
+    return YKPIV_MEMORY_ERROR;
+  }
+  if ((conn->fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || connect(conn->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    DBG("Unable to connect to the broker at %s: %s", path, strerror(errno));
+    broker_close(conn);
+    return YKPIV_PCSC_ERROR;
+  }
+  broker_nosigpipe(conn->fd);
+
+  memset(transport, 0, sizeof(*transport));
+  transport->ctx = conn;
+  transport->transmit = broker_transmit;
+  transport->begin_transaction = broker_begin;
+  transport->end_transaction = broker_end;
+  transport->close = broker_close;
+  return YKPIV_OK;
+}
+
+// Whether a client other than the owner has sent a request that is waiting
+static bool broker_pending(broker_server *srv) {
+  struct pollfd fds[BROKER_MAX_CLIENTS];
+  nfds_t n = 0;
+  for (size_t i = 0; i < srv->n_clients; i++) {
+    if (!srv->owned || i != srv->owner) {
+      fds[n].fd = srv->clients[i].fd;
+      fds[n].events = POLLIN;
+      fds[n++].revents = 0;
+    }
+  }
+  return n && poll(fds, n, 0) > 0;
+}
+
+static ykpiv_rc broker_acquire(broker_server *srv) {
+  ykpiv_rc res;
+  if (!srv->held) {
+    if ((res = _ykpiv_begin_transaction(srv->state)) != YKPIV_OK) {
+      return res;
+    }
+    srv->held = true;
+    srv->held_since_ms = broker_now_ms();
+  }
+  return YKPIV_OK;
+}
+
+// Keeps the PC/SC transaction for waiting clients, unless other applications have been kept out for long enough
+static void broker_release(broker_server *srv) {
+  if (srv->held && !srv->owned &&
+      (!broker_pending(srv) || broker_now_ms() - srv->held_since_ms >= BROKER_HOLD_MS)) {
+    _ykpiv_end_transaction(srv->state);
+    srv->held = false;
+  }
+}
+
+static void broker_drop(broker_server *srv, size_t i) {
+  size_t last = --srv->n_clients;
+  close(srv->clients[i].fd);
+  srv->clients[i] = srv->clients[last];
+  if (srv->owned && srv->owner == i) {
+    DBG("Client holding '%s' went away", srv->state->reader);
+    srv->owned = false;
+  } else if (srv->owned && srv->owner == last) {
+    srv->owner = i; // Moved into the gap
+  }
+  broker_release(srv);
+}
+
+// Returns false if the client must be disconnected
+static bool broker_serve_request(broker_server *srv, size_t i) {
+  broker_client *client = srv->clients + i;
+  unsigned char header[BROKER_REQUEST_HEADER_LEN];
+  size_t len, out_len = 0;
+  ykpiv_rc res = YKPIV_OK;
+  bool owner;
+
+  if (!broker_read(client->fd, header, sizeof(header)) || (len = broker_get32(header + 1)) > sizeof(srv->in) ||
+      !broker_read(client->fd, srv->in, len)) {
+    return false;
+  }
+  client->last_ms = broker_now_ms();
+  owner = srv->owned && srv->owner == i;
+
+  switch (header[0]) {
+    case BROKER_OP_BEGIN:
+      if (!owner && (res = broker_acquire(srv)) == YKPIV_OK) {
+        srv->owned = true;
+        srv->owner = i;
+      }
+      break;
+    case BROKER_OP_END:
+      if (owner) {
+        srv->owned = false;
+        broker_release(srv);
+      }
+      break;
+    case BROKER_OP_TRANSMIT:
+      // A command outside of a transaction gets one of its own
+      if (!owner && (res = broker_acquire(srv)) != YKPIV_OK) {
+        break;
+      }
+      out_len = BROKER_MSG_MAX;
+      res = _ykpiv_transmit_raw(srv->state, srv->in, len, srv->out + BROKER_RESPONSE_HEADER_LEN, &out_len);
+      if (!owner) {
+        broker_release(srv);
+      }
+      break;
+    default:
+      DBG("Unknown broker request %02x", header[0]);
+      res = YKPIV_NOT_SUPPORTED;
+      break;
+  }
+
+  broker_put32(srv->out, (uint32_t)res);
+  broker_put32(srv->out + 4, (uint32_t)out_len);
+  return broker_write(client->fd, srv->out, BROKER_RESPONSE_HEADER_LEN + out_len);
+}
+
+ykpiv_rc ykpiv_broker_serve(ykpiv_state *state, const char *path, const volatile int *stop) {
+  struct sockaddr_un addr;
+  struct stat st;
+  broker_server *srv;
+  int listen_fd;
+  ykpiv_rc res = YKPIV_OK;
+
+  if (!state || !path || state->scp11_state.security_level) {
+    return YKPIV_ARGUMENT_ERROR;
+  }
+  if (!broker_address(path, &addr)) {
+    return YKPIV_SIZE_ERROR;
+  }
+  if (!(srv = calloc(1, sizeof(broker_server)))) {
+    return YKPIV_MEMORY_ERROR;
+  }
+  srv->state = state;
+
+  // Left behind by an earlier broker
+  if (!lstat(path, &st) && S_ISSOCK(st.st_mode)) {
+    unlink(path);
+  }
+  if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      chmod(path, S_IRUSR | S_IWUSR) || listen(listen_fd, SOMAXCONN)) {
+    DBG("Unable to listen on %s: %s", path, strerror(errno));
+    if (listen_fd >= 0) {
+      close(listen_fd);
+    }
+    free(srv);
+    return YKPIV_GENERIC_ERROR;
+  }
+  DBG("Serving '%s' on %s", state->reader, path);
+
+  while (!stop || !*stop) {
+    struct pollfd fds[1 + BROKER_MAX_CLIENTS];
+    size_t index[1 + BROKER_MAX_CLIENTS];
+    nfds_t n = 1;
+
+    // While a client has the card, the requests of the others wait in their sockets
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+    for (size_t k = 0; k < srv->n_clients; k++) {
+      size_t i = (srv->next + k) % srv->n_clients;
+      if (!srv->owned || srv->owner == i) {
+        fds[n].fd = srv->clients[i].fd;
+        fds[n].events = POLLIN;
+        index[n++] = i;
+      }
+    }
+    for (nfds_t j = 0; j < n; j++) {
+      fds[j].revents = 0;
+    }
+
+    if (poll(fds, n, BROKER_POLL_MS) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      DBG("Waiting for broker clients failed: %s", strerror(errno));
+      res = YKPIV_GENERIC_ERROR;
+      break;
+    }
+
+    if (srv->owned && broker_now_ms() - srv->clients[srv->owner].last_ms >= BROKER_IDLE_MS) {
+      DBG("Disconnecting client that kept '%s' for too long", state->reader);
+      broker_drop(srv, srv->owner);
+      continue;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int fd = accept(listen_fd, NULL, NULL);
+      if (fd >= 0 && !broker_peer_allowed(fd)) {
+        close(fd);
+      } else if (fd >= 0 && srv->n_clients < BROKER_MAX_CLIENTS) {
+        broker_nosigpipe(fd);
+        broker_timeouts(fd);
+        srv->clients[srv->n_clients].fd = fd;
+        srv->clients[srv->n_clients++].last_ms = broker_now_ms();
+      } else if (fd >= 0) {
+        DBG("Already serving %d clients", BROKER_MAX_CLIENTS);
+        close(fd);
+      }
+    }
+
+    // One request per round, the indexes change when a client is dropped
+    for (nfds_t j = 1; j < n; j++) {
+      if (fds[j].revents & (POLLIN | POLLHUP | POLLERR)) {
+        size_t i = index[j];
+        srv->next = i + 1;
+        if (!broker_serve_request(srv, i)) {
+          broker_drop(srv, i);
+        }
+        break;
+      }
+    }
+
+    // Clients that were waiting may have gone away instead
+    broker_release(srv);
+  }
+
+  while (srv->n_clients) {
+    broker_drop(srv, srv->n_clients - 1);
+  }
+  if (srv->held) {
+    _ykpiv_end_transaction(state);
+  }
+  close(listen_fd);
+  unlink(path);
+  free(srv);
+  return res;
+}
+
+#else
+
+ykpiv_rc _ykpiv_broker_open(const char *path, ykpiv_transport *transport) {
+  (void)transport;
+  DBG("Brokers are not supported on Windows, can't connect to %s", path);
+  return YKPIV_NOT_SUPPORTED;
+}
+
+ykpiv_rc ykpiv_broker_serve(ykpiv_state *state, const char *path, const volatile int *stop) {
+  (void)state;
+  (void)path;
+  (void)stop;
+  DBG("Brokers are not supported on Windows");
+  return YKPIV_NOT_SUPPORTED;
+}
+
+#endif
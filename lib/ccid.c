@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) 2025 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+// CCID over USB through libusb, for hosts where the YubiKey is reserved to one process and the
+// round trips through pcscd are worth saving. The interface is claimed for as long as the
+// transport is open, so pcscd (and every other process) can't use the YubiKey meanwhile.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libusb.h>
+
+#include "internal.h"
+#include "ccid.h"
+
+#define CCID_VENDOR_YUBICO 0x1050
+#define CCID_DESCRIPTOR_TYPE 0x21
+#define CCID_DESCRIPTOR_LEN 54
+#define CCID_HEADER_LEN 10
+// Large enough for an extended APDU response with its status word
+#define CCID_BUF_MAX (CCID_HEADER_LEN + 65536 + 2)
+#define CCID_TIMEOUT_MS 5000
+
+#define CCID_PC_TO_RDR_ICC_POWER_ON 0x62
+#define CCID_PC_TO_RDR_ICC_POWER_OFF 0x63
+#define CCID_PC_TO_RDR_XFR_BLOCK 0x6f
+#define CCID_RDR_TO_PC_DATA_BLOCK 0x80
+#define CCID_RDR_TO_PC_SLOT_STATUS 0x81
+
+#define CCID_STATUS_MASK 0xc0
+#define CCID_STATUS_FAILED 0x40
+#define CCID_STATUS_TIME_EXTENSION 0x80
+
+typedef struct {
+  libusb_context *usb;
+  libusb_device_handle *handle;
+  int interface;
+  bool claimed;
+  unsigned char ep_in;
+  unsigned char ep_out;
+  uint8_t seq;
+  size_t max_message;
+  unsigned char buf[CCID_BUF_MAX];
+} ccid_device;
+
+static uint32_t ccid_get32(const unsigned char *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Finds the smart card interface and its bulk endpoints
+static bool ccid_find_interface(libusb_device *dev, int *interface, unsigned char *ep_in, unsigned char *ep_out,
+                                size_t *max_message) {
+  struct libusb_device_descriptor desc;
+  struct libusb_config_descriptor *config = NULL;
+  bool found = false;
+
+  if (libusb_get_device_descriptor(dev, &desc) != LIBUSB_SUCCESS || desc.idVendor != CCID_VENDOR_YUBICO) {
+    return false;
+  }
+  if (libusb_get_active_config_descriptor(dev, &config) != LIBUSB_SUCCESS) {
+    return false;
+  }
+  for (int i = 0; i < config->bNumInterfaces && !found; i++) {
+    const struct libusb_interface_descriptor *alt = config->interface[i].altsetting;
+    if (config->interface[i].num_altsetting < 1 || alt->bInterfaceClass != LIBUSB_CLASS_SMART_CARD) {
+      continue;
+    }
+    *ep_in = *ep_out = 0;
+    for (int j = 0; j < alt->bNumEndpoints; j++) {
+      const struct libusb_endpoint_descriptor *ep = alt->endpoint + j;
+      if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != LIBUSB_TRANSFER_TYPE_BULK) {
+        continue;
+      }
+      if ((ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN) {
+        *ep_in = ep->bEndpointAddress;
+      } else {
+        *ep_out = ep->bEndpointAddress;
+      }
+    }
+    // dwMaxCCIDMessageLength of the class descriptor, or the smallest allowed
+    *max_message = CCID_HEADER_LEN + 261;
+    if (alt->extra_length >= CCID_DESCRIPTOR_LEN && alt->extra[1] == CCID_DESCRIPTOR_TYPE) {
+      *max_message = ccid_get32(alt->extra + 44);
+    }
+    if (*ep_in && *ep_out) {
+      *interface = alt->bInterfaceNumber;
+      found = true;
+    }
+  }
+  libusb_free_config_descriptor(config);
+  return found;
+}
+
+// Reader names resemble the ones pcsc-lite uses, with the bus and address instead of its indexes
+static void ccid_reader_name(libusb_device *dev, libusb_device_handle *handle, char *name, size_t len) {
+  struct libusb_device_descriptor desc;
+  unsigned char product[128] = "Yubico YubiKey";
+
+  if (libusb_get_device_descriptor(dev, &desc) == LIBUSB_SUCCESS && desc.iProduct) {
+    if (libusb_get_string_descriptor_ascii(handle, desc.iProduct, product, sizeof(product)) <= 0) {
+      strcpy((char *)product, "Yubico YubiKey");
+    }
+  }
+  snprintf(name, len, "%s%s %02x %02x", YKPIV_USB_READER_PREFIX, product, libusb_get_bus_number(dev),
+           libusb_get_device_address(dev));
+}
+
+static ykpiv_rc ccid_usb_error(const char *what, int rc) {
+  DBG("%s failed: %s", what, libusb_error_name(rc));
+  switch (rc) {
+    case LIBUSB_ERROR_NO_DEVICE:
+    case LIBUSB_ERROR_IO:
+      return YKPIV_PCSC_ERROR;
+    case LIBUSB_ERROR_BUSY:
+      return YKPIV_PCSC_SERVICE_ERROR;
+    default:
+      return YKPIV_GENERIC_ERROR;
+  }
+}
+
+// Sends one CCID message and receives its response, waiting out time extension requests
+static ykpiv_rc ccid_message(ccid_device *dev, uint8_t type, const unsigned char *data, size_t len,
+                             unsigned char *out, size_t *out_len) {
+  int rc, sent = 0, got = 0;
+  uint8_t seq = dev->seq++;
+
+  if (CCID_HEADER_LEN + len > dev->max_message) {
+    DBG("Message of %zu bytes exceeds the maximum of %zu", len, dev->max_message);
+    return YKPIV_SIZE_ERROR;
+  }
+  dev->buf[0] = type;
+  dev->buf[1] = (unsigned char)len;
+  dev->buf[2] = (unsigned char)(len >> 8);
+  dev->buf[3] = (unsigned char)(len >> 16);
+  dev->buf[4] = (unsigned char)(len >> 24);
+  dev->buf[5] = 0; // bSlot
+  dev->buf[6] = seq;
+  memset(dev->buf + 7, 0, 3); // Automatic voltage for power on, no level parameter for transfers
+  if (len) {
+    memcpy(dev->buf + CCID_HEADER_LEN, data, len);
+  }
+  if ((rc = libusb_bulk_transfer(dev->handle, dev->ep_out, dev->buf, (int)(CCID_HEADER_LEN + len), &sent,
+                                 CCID_TIMEOUT_MS)) != LIBUSB_SUCCESS) {
+    return ccid_usb_error("libusb_bulk_transfer", rc);
+  }
+
+  for (;;) {
+    if ((rc = libusb_bulk_transfer(dev->handle, dev->ep_in, dev->buf, sizeof(dev->buf), &got, CCID_TIMEOUT_MS)) !=
+        LIBUSB_SUCCESS) {
+      return ccid_usb_error("libusb_bulk_transfer", rc);
+    }
+    if (got < CCID_HEADER_LEN) {
+      DBG("Short CCID response of %d bytes", got);
+      return YKPIV_PCSC_ERROR;
+    }
+    if (dev->buf[6] != seq) {
+      DBG("Skipping CCID response to message %u", dev->buf[6]);
+      continue;
+    }
+    if ((dev->buf[7] & CCID_STATUS_MASK) == CCID_STATUS_TIME_EXTENSION) {
+      DBG2("Time extension requested");
+      continue;
+    }
+    break;
+  }
+  if ((dev->buf[7] & CCID_STATUS_MASK) == CCID_STATUS_FAILED) {
+    DBG("CCID message %02x failed, bStatus=%02x bError=%02x", type, dev->buf[7], dev->buf[8]);
+    return YKPIV_PCSC_ERROR;
+  }
+  if (dev->buf[0] != CCID_RDR_TO_PC_DATA_BLOCK && dev->buf[0] != CCID_RDR_TO_PC_SLOT_STATUS) {
+    DBG("Unexpected CCID response %02x", dev->buf[0]);
+    return YKPIV_PCSC_ERROR;
+  }
+
+  size_t msg_len = ccid_get32(dev->buf + 1);
+  if (msg_len > (size_t)got - CCID_HEADER_LEN) {
+    DBG("Truncated CCID response of %d bytes, expected %zu", got, msg_len + CCID_HEADER_LEN);
+    return YKPIV_PCSC_ERROR;
+  }
+  if (out) {
+    if (msg_len > *out_len) {
+      return YKPIV_SIZE_ERROR;
+    }
+    memcpy(out, dev->buf + CCID_HEADER_LEN, msg_len);
+    *out_len = msg_len;
+  }
+  return YKPIV_OK;
+}
+
+static ykpiv_rc ccid_transmit(void *ctx, const unsigned char *send, size_t send_len, unsigned char *recv,
+                              size_t *recv_len) {
+  return ccid_message(ctx, CCID_PC_TO_RDR_XFR_BLOCK, send, send_len, recv, recv_len);
+}
+
+static void ccid_close(void *ctx) {
+  ccid_device *dev = ctx;
+  if (dev->claimed) {
+    ccid_message(dev, CCID_PC_TO_RDR_ICC_POWER_OFF, NULL, 0, NULL, NULL);
+    libusb_release_interface(dev->handle, dev->interface);
+  }
+  if (dev->handle) {
+    libusb_close(dev->handle);
+  }
+  if (dev->usb) {
+    libusb_exit(dev->usb);
+  }
+  free(dev);
+}
+
+ykpiv_rc _ykpiv_ccid_list_readers(char *readers, size_t *len) {
+  libusb_context *usb = NULL;
+  libusb_device **list = NULL;
+  size_t used = 0;
+  ykpiv_rc res = YKPIV_OK;
+  int rc;
+
+  if ((rc = libusb_init(&usb)) != LIBUSB_SUCCESS) {
+    return ccid_usb_error("libusb_init", rc);
+  }
+  ssize_t n = libusb_get_device_list(usb, &list);
+  for (ssize_t i = 0; i < n; i++) {
+    libusb_device_handle *handle = NULL;
+    char name[256];
+    int interface;
+    unsigned char ep_in, ep_out;
+    size_t max_message;
+
+    if (!ccid_find_interface(list[i], &interface, &ep_in, &ep_out, &max_message)) {
+      continue;
+    }
+    if ((rc = libusb_open(list[i], &handle)) != LIBUSB_SUCCESS) {
+      DBG("libusb_open failed: %s", libusb_error_name(rc));
+      continue;
+    }
+    ccid_reader_name(list[i], handle, name, sizeof(name));
+    libusb_close(handle);
+    size_t name_len = strlen(name) + 1;
+    if (used + name_len + 1 > *len) {
+      res = YKPIV_SIZE_ERROR;
+      break;
+    }
+    memcpy(readers + used, name, name_len);
+    used += name_len;
+  }
+  if (n > 0) {
+    libusb_free_device_list(list, 1);
+  }
+  libusb_exit(usb);
+  if (res == YKPIV_OK) {
+    // Terminated by an empty name, even when there are none
+    if (used + 1 > *len) {
+      return YKPIV_SIZE_ERROR;
+    }
+    readers[used++] = 0;
+    *len = used;
+  }
+  return res;
+}
+
+ykpiv_rc _ykpiv_ccid_open(const char *reader, ykpiv_transport *transport) {
+  ccid_device *dev = calloc(1, sizeof(ccid_device));
+  libusb_device **list = NULL;
+  unsigned char atr[64];
+  size_t atr_len = sizeof(atr);
+  ykpiv_rc res = YKPIV_GENERIC_ERROR;
+  int rc;
+
+  if (!dev) {
+    return YKPIV_MEMORY_ERROR;
+  }
+  if ((rc = libusb_init(&dev->usb)) != LIBUSB_SUCCESS) {
+    dev->usb = NULL;
+    res = ccid_usb_error("libusb_init", rc);
+    goto Cleanup;
+  }
+  ssize_t n = libusb_get_device_list(dev->usb, &list);
+  for (ssize_t i = 0; i < n && !dev->handle; i++) {
+    char name[256];
+    if (!ccid_find_interface(list[i], &dev->interface, &dev->ep_in, &dev->ep_out, &dev->max_message) ||
+        libusb_open(list[i], &dev->handle) != LIBUSB_SUCCESS) {
+      continue;
+    }
+    ccid_reader_name(list[i], dev->handle, name, sizeof(name));
+    if (strcmp(name, reader)) {
+      libusb_close(dev->handle);
+      dev->handle = NULL;
+    }
+  }
+  if (n > 0) {
+    libusb_free_device_list(list, 1);
+  }
+  if (!dev->handle) {
+    DBG("No USB device '%s'", reader);
+    res = YKPIV_PCSC_ERROR;
+    goto Cleanup;
+  }
+
+  libusb_set_auto_detach_kernel_driver(dev->handle, 1);
+  if ((rc = libusb_claim_interface(dev->handle, dev->interface)) != LIBUSB_SUCCESS) {
+    // Typically because pcscd has it
+    res = ccid_usb_error("libusb_claim_interface", rc);
+    goto Cleanup;
+  }
+  dev->claimed = true;
+  if ((res = ccid_message(dev, CCID_PC_TO_RDR_ICC_POWER_ON, NULL, 0, atr, &atr_len)) != YKPIV_OK) {
+    goto Cleanup;
+  }
+  DBG("Powered on '%s', ATR of %zu bytes", reader, atr_len);
+
+  memset(transport, 0, sizeof(*transport));
+  transport->ctx = dev;
+  transport->transmit = ccid_transmit;
+  transport->close = ccid_close;
+  return YKPIV_OK;
+
+Cleanup:
+  ccid_close(dev);
+  return res;
+}
@@ -36,6 +36,9 @@
 
 #include <stdbool.h>
 
+#include "../aes_cmac/aes_cmac.h"
+#include "../common/tlv.h"
+
 #ifdef BACKEND_PCSC
 #ifdef HAVE_PCSC_WINSCARD_H
 # include <PCSC/wintypes.h>
@@ -71,10 +74,17 @@ extern "C"
 #define CB_OBJ_MAX_YK4      (CB_BUF_MAX_YK4 - 9)
 #define CB_OBJ_MAX          CB_OBJ_MAX_YK4
 
+// Largest certificate accepted when decompressing one read from the device
+#define CB_CERT_INFLATED_MAX (CB_OBJ_MAX * 10)
+
 #define CB_BUF_MAX_NEO      2048
 #define CB_BUF_MAX_YK4      3072
 #define CB_BUF_MAX          CB_BUF_MAX_YK4
 
+// Max command data in one extended length APDU, before and after YubiKey 4.3
+#define CB_EXT_DATA_MAX_YK4   (CB_BUF_MAX_NEO - 10)
+#define CB_EXT_DATA_MAX       (CB_BUF_MAX_YK4 - 10)
+
 #define CB_ATR_MAX          33
 
 #define CHREF_ACT_CHANGE_PIN 0
@@ -134,6 +144,7 @@ extern "C"
 #define SCP11_KEY_TYPE 0x88
 #define SCP11_CERTIFICATE_STORE_TAG 0xBF21
 #define SCP11_ePK_SD_ECKA_TAG 0x5F49
+#define SCP11_SD_PUBKEY_LEN 65 // Uncompressed P-256 point of PK.SD.ECKA
 
 typedef enum {
     PKCS5_OK = 0,
@@ -154,12 +165,35 @@ typedef struct _ykpiv_version_t {
 typedef struct _ykpiv_scp11_state {
   uint8_t security_level;
   uint32_t enc_counter;
-  uint8_t senc[SCP11_SESSION_KEY_LEN];
-  uint8_t smac[SCP11_SESSION_KEY_LEN];
-  uint8_t srmac[SCP11_SESSION_KEY_LEN];
   uint8_t mac_chain[SCP11_MAC_LEN];
+  // Session keys, set up once by scp11_session_init and kept until scp11_session_destroy
+  aes_context senc;
+  aes_context smac;
+  aes_context srmac;
+  aes_cmac_context_t smac_cmac;
+  aes_cmac_context_t srmac_cmac;
 } ykpiv_scp11_state;
 
+typedef struct _ykpiv_reader_watch {
+  char names[2048];
+  SCARD_READERSTATE states[MAX_READERS + 1]; // Known readers, followed by the PnP notification reader if supported
+  pcsc_word n_states;
+  bool pnp;
+} ykpiv_reader_watch;
+
+typedef struct _ykpiv_mgm_cache {
+  bool enabled; // Set with ykpiv_util_set_mgm_cache
+  uint32_t serial; // Card the cached values were read from
+  bool has_salt;
+  uint8_t salt[CB_ADMIN_SALT];
+  bool has_derived;
+  uint8_t pin[CB_PIN_MAX]; // PIN the derived key was computed from
+  size_t pin_len;
+  ykpiv_mgm derived;
+  bool has_protected;
+  ykpiv_mgm protected_mgm;
+} ykpiv_mgm_cache;
+
 struct ykpiv_state {
   SCARDCONTEXT context;
   SCARDHANDLE card;
@@ -170,10 +204,27 @@ struct ykpiv_state {
   uint8_t *mgm_key;
   uint32_t mgm_len;
   ykpiv_allocator allocator;
+  ykpiv_allocator util_allocator; // Used for buffers returned by ykpiv_util functions when pfn_alloc is set
   uint32_t model;
   ykpiv_version_t ver;
   uint32_t serial;
+  uint32_t max_ext_len; // Max command data in one extended length APDU, 0 to use command chaining
   ykpiv_scp11_state scp11_state;
+  ykpiv_transport transport; // Used instead of PC/SC when transmit is set
+  ykpiv_reader_watch *watch; // Allocated by the first call to ykpiv_wait_for_change
+  struct ykpiv_worker *worker; // Started by the first asynchronous request
+  uint32_t batch_depth; // Nesting level of ykpiv_begin_batch, transactions are held while non-zero
+  uint32_t batch_hold_ms; // Longest time to hold the transaction of a batch, 0 for no limit
+  uint64_t batch_since_ms; // When the transaction of the batch was acquired
+  bool batch_selected; // Application selection confirmed within the transaction of the batch
+  ykpiv_stats stats;
+  ykpiv_ins_stats *stats_cur; // Entry of the command being transferred
+  uint32_t stats_apdus; // Command APDUs sent for the command being transferred
+  unsigned char *scratch; // Workspace of scratch_count buffers of YKPIV_OBJ_MAX_SIZE, see _ykpiv_scratch_get
+  uint32_t scratch_count;
+  uint32_t scratch_busy; // Bit per borrowed buffer
+  bool scratch_owned; // Allocated with the allocator of the state, rather than given by ykpiv_set_workspace
+  ykpiv_mgm_cache mgm_cache;
 };
 
 union u_APDU {
@@ -198,6 +249,12 @@ ykpiv_rc _ykpiv_begin_transaction(ykpiv_state *state);
 ykpiv_rc _ykpiv_end_transaction(ykpiv_state *state);
 ykpiv_rc _ykpiv_ensure_application_selected(ykpiv_state *state, bool scp11);
 ykpiv_rc _ykpiv_select_application(ykpiv_state *state, bool scp11);
+void _ykpiv_stop_worker(ykpiv_state *state);
+bool _ykpiv_worker_busy(ykpiv_state *state);
+void _ykpiv_clear_mgm_cache(ykpiv_state *state);
+bool _ykpiv_sd_cache_get(uint32_t serial, uint8_t kvn, uint8_t *pubkey);
+void _ykpiv_sd_cache_put(uint32_t serial, uint8_t kvn, const uint8_t *pubkey);
+void _ykpiv_sd_cache_drop(uint32_t serial, uint8_t kvn);
 size_t _ykpiv_get_length_size(size_t length);
 size_t _ykpiv_set_length(unsigned char *buffer, size_t length);
 size_t _ykpiv_get_length(const unsigned char *buffer, const unsigned char* end, size_t *len);
@@ -205,9 +262,18 @@ size_t _ykpiv_get_length(const unsigned char *buffer, const unsigned char* end,
 void* _ykpiv_alloc(ykpiv_state *state, size_t size);
 void* _ykpiv_realloc(ykpiv_state *state, void *address, size_t size);
 void _ykpiv_free(ykpiv_state *state, void *data);
+unsigned char *_ykpiv_scratch_get(ykpiv_state *state, size_t size);
+void _ykpiv_scratch_put(ykpiv_state *state, unsigned char *buf, size_t used);
 ykpiv_rc _ykpiv_save_object(ykpiv_state *state, int object_id, unsigned char *indata, size_t len);
 ykpiv_rc _ykpiv_fetch_object(ykpiv_state *state, int object_id, unsigned char *data, unsigned long *len);
+ykpiv_rc _ykpiv_fetch_object_view(ykpiv_state *state, int object_id, unsigned char *buf, unsigned long buf_len,
+    unsigned char **data, unsigned long *len);
+ykpiv_rc _ykpiv_fetch_object_stream(ykpiv_state *state, int object_id, ykpiv_pfn_chunk pfn_chunk, void *chunk_data);
 ykpiv_rc _ykpiv_send_apdu(ykpiv_state *state, APDU *apdu, unsigned char *data, unsigned long *recv_len, int *sw);
+// Exchanges one APDU as is, without chaining, GET RESPONSE or SCP11, the response includes the status word
+ykpiv_rc _ykpiv_transmit_raw(ykpiv_state *state, const unsigned char *send_data, size_t send_len,
+    unsigned char *recv_data, size_t *recv_len);
+ykpiv_rc _ykpiv_get_metadata(ykpiv_state *state, const unsigned char key, unsigned char *data, unsigned long *data_len);
 ykpiv_rc _ykpiv_transfer_data(
     ykpiv_state *state,
     const unsigned char *templ,
@@ -0,0 +1,344 @@
+/*
+ * Copyright (c) 2025 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "internal.h"
+#include "ykpiv.h"
+#include "threads.h"
+
+#define YKPIV_POOL_RETRY_SECONDS 5
+
+typedef struct {
+  ykpiv_state *state;
+  char reader[2048];
+  bool busy;         // In use by a request
+  bool healthy;      // Last request did not fail because of the device
+  time_t retry_at;   // Earliest time to reconnect an unhealthy device
+  uint64_t requests; // Requests served
+} ykpiv_pool_device;
+
+struct ykpiv_pool {
+  yc_mutex mutex;
+  yc_cond idle;
+  size_t n_devices;
+  ykpiv_pool_device *devices;
+};
+
+// Device last used by this thread, preferred as long as it is idle
+static YKPIV_THREAD_LOCAL const ykpiv_pool *affinity_pool;
+static YKPIV_THREAD_LOCAL size_t affinity_device;
+
+typedef ykpiv_rc (*ykpiv_pool_op)(ykpiv_state *state, const unsigned char *in, size_t in_len,
+                                  unsigned char *out, size_t *out_len, unsigned char algorithm, unsigned char key);
+
+static bool _pool_device_error(ykpiv_rc res) {
+  return res == YKPIV_PCSC_ERROR || res == YKPIV_PCSC_SERVICE_ERROR;
+}
+
+// Take the best device for a request, waiting for one to become idle if all usable devices are busy
+static ykpiv_pool_device *_pool_acquire(ykpiv_pool *pool) {
+  ykpiv_pool_device *dev = NULL;
+
+  yc_mutex_lock(&pool->mutex);
+  for(;;) {
+    time_t now = time(NULL);
+    bool busy = false;
+
+    if(affinity_pool == pool && affinity_device < pool->n_devices) {
+      ykpiv_pool_device *d = pool->devices + affinity_device;
+      if(!d->busy && d->healthy) {
+        dev = d;
+      }
+    }
+    for(size_t i = 0; !dev && i < pool->n_devices; i++) {
+      ykpiv_pool_device *d = pool->devices + i;
+      busy |= d->busy;
+      if(!d->busy && d->healthy && (!dev || d->requests < dev->requests)) {
+        dev = d;
+      }
+    }
+    // Only fall back to reconnecting a failed device when no healthy one is idle
+    for(size_t i = 0; !dev && i < pool->n_devices; i++) {
+      ykpiv_pool_device *d = pool->devices + i;
+      if(!d->busy && !d->healthy && now >= d->retry_at) {
+        dev = d;
+      }
+    }
+    if(dev || !busy) {
+      break;
+    }
+    yc_cond_wait(&pool->idle, &pool->mutex);
+  }
+  if(dev) {
+    dev->busy = true;
+  }
+  yc_mutex_unlock(&pool->mutex);
+
+  return dev;
+}
+
+static void _pool_release(ykpiv_pool *pool, ykpiv_pool_device *dev, ykpiv_rc res) {
+  yc_mutex_lock(&pool->mutex);
+  dev->busy = false;
+  dev->healthy = !_pool_device_error(res);
+  if(dev->healthy) {
+    dev->requests++;
+  } else {
+    dev->retry_at = time(NULL) + YKPIV_POOL_RETRY_SECONDS;
+  }
+  yc_cond_broadcast(&pool->idle);
+  yc_mutex_unlock(&pool->mutex);
+}
+
+static ykpiv_rc _pool_reconnect(ykpiv_pool_device *dev) {
+  ykpiv_state *state = dev->state;
+  ykpiv_rc res;
+  char wanted[sizeof(dev->reader) + 1] = {0};
+
+  if(ykpiv_validate(state, dev->reader) == YKPIV_OK) {
+    return YKPIV_OK;
+  }
+
+  DBG("Reconnecting '%s'", dev->reader);
+  ykpiv_disconnect(state);
+  snprintf(wanted, sizeof(wanted), "@%s", dev->reader);
+  if((res = ykpiv_connect(state, wanted)) != YKPIV_OK) {
+    DBG("Failed to reconnect '%s': %s", dev->reader, ykpiv_strerror(res));
+    return res;
+  }
+  // The PIN from ykpiv_pool_verify() is kept by the state
+  if(state->pin && (res = ykpiv_verify(state, state->pin, NULL)) != YKPIV_OK) {
+    DBG("Failed to verify PIN on '%s': %s", dev->reader, ykpiv_strerror(res));
+    if(res == YKPIV_WRONG_PIN || res == YKPIV_PIN_LOCKED) {
+      // Retrying the rejected PIN on every reconnect would use up the remaining attempts
+      if(state->pin) {
+        yc_memzero(state->pin, strlen(state->pin));
+        _ykpiv_free(state, state->pin);
+        state->pin = NULL;
+      }
+      return res;
+    }
+    return _pool_device_error(res) ? res : YKPIV_PCSC_ERROR;
+  }
+  return YKPIV_OK;
+}
+
+static ykpiv_rc _pool_run(ykpiv_pool *pool, ykpiv_pool_op op, const unsigned char *in, size_t in_len,
+                          unsigned char *out, size_t *out_len, unsigned char algorithm, unsigned char key) {
+  ykpiv_rc res = YKPIV_PCSC_ERROR;
+
+  if(!pool || !in || !out || !out_len) {
+    return YKPIV_ARGUMENT_ERROR;
+  }
+
+  // Each device is tried at most once, healthy devices first
+  for(size_t attempt = 0; attempt < pool->n_devices; attempt++) {
+    ykpiv_pool_device *dev = _pool_acquire(pool);
+    if(!dev) {
+      DBG("No usable device in pool");
+      break;
+    }
+
+    size_t len = *out_len;
+    if(dev->healthy || (res = _pool_reconnect(dev)) == YKPIV_OK) {
+      res = op(dev->state, in, in_len, out, &len, algorithm, key);
+    }
+    _pool_release(pool, dev, res);
+
+    if(!_pool_device_error(res)) {
+      affinity_pool = pool;
+      affinity_device = dev - pool->devices;
+      *out_len = len;
+      return res;
+    }
+    DBG("Request failed on '%s': %s", dev->reader, ykpiv_strerror(res));
+  }
+
+  return res;
+}
+
+ykpiv_rc ykpiv_pool_init(ykpiv_pool **pool, const char *wanted, int verbose) {
+  ykpiv_state *state = NULL;
+  ykpiv_pool *p = NULL;
+  char readers[2048] = {0};
+  size_t len = sizeof(readers);
+  size_t n_readers = 0;
+  ykpiv_rc res;
+
+  if(!pool) {
+    return YKPIV_ARGUMENT_ERROR;
+  }
+
+  if((res = ykpiv_init(&state, verbose)) != YKPIV_OK) {
+    return res;
+  }
+  res = ykpiv_list_readers(state, readers, &len);
+  ykpiv_done(state);
+  if(res != YKPIV_OK) {
+    return res;
+  }
+
+  for(const char *reader = readers; *reader; reader += strlen(reader) + 1) {
+    n_readers++;
+  }
+  if(n_readers == 0) {
+    DBG("No readers found");
+    return YKPIV_PCSC_ERROR;
+  }
+
+  if(!(p = calloc(1, sizeof(ykpiv_pool))) || !(p->devices = calloc(n_readers, sizeof(ykpiv_pool_device)))) {
+    DBG("Failed to allocate memory for pool");
+    free(p);
+    return YKPIV_MEMORY_ERROR;
+  }
+  if(!yc_mutex_init(&p->mutex)) {
+    free(p->devices);
+    free(p);
+    return YKPIV_GENERIC_ERROR;
+  }
+  if(!yc_cond_init(&p->idle)) {
+    yc_mutex_destroy(&p->mutex);
+    free(p->devices);
+    free(p);
+    return YKPIV_GENERIC_ERROR;
+  }
+
+  for(const char *reader = readers; *reader; reader += strlen(reader) + 1) {
+    if(!ykpiv_reader_matches(reader, wanted)) {
+      DBG("Skipping reader '%s' since it doesn't match '%s'.", reader, wanted);
+      continue;
+    }
+    ykpiv_pool_device *dev = p->devices + p->n_devices;
+    char at[sizeof(dev->reader) + 1] = {0};
+    if((res = ykpiv_init(&dev->state, verbose)) != YKPIV_OK) {
+      ykpiv_pool_done(p);
+      return res;
+    }
+    snprintf(at, sizeof(at), "@%s", reader);
+    if((res = ykpiv_connect(dev->state, at)) != YKPIV_OK) {
+      DBG("Skipping reader '%s': %s", reader, ykpiv_strerror(res));
+      ykpiv_done(dev->state);
+      dev->state = NULL;
+      continue;
+    }
+    snprintf(dev->reader, sizeof(dev->reader), "%s", reader);
+    dev->healthy = true;
+    p->n_devices++;
+  }
+
+  if(p->n_devices == 0) {
+    DBG("No usable reader found matching '%s'.", wanted);
+    ykpiv_pool_done(p);
+    return YKPIV_PCSC_ERROR;
+  }
+
+  DBG("Pool has %zu devices", p->n_devices);
+  *pool = p;
+  return YKPIV_OK;
+}
+
+ykpiv_rc ykpiv_pool_done(ykpiv_pool *pool) {
+  if(!pool) {
+    return YKPIV_ARGUMENT_ERROR;
+  }
+  for(size_t i = 0; i < pool->n_devices; i++) {
+    ykpiv_done(pool->devices[i].state);
+  }
+  yc_cond_destroy(&pool->idle);
+  yc_mutex_destroy(&pool->mutex);
+  free(pool->devices);
+  free(pool);
+  return YKPIV_OK;
+}
+
+ykpiv_rc ykpiv_pool_verify(ykpiv_pool *pool, const char *pin, int *tries) {
+  ykpiv_rc res = YKPIV_OK;
+
+  if(!pool || !pin) {
+    return YKPIV_ARGUMENT_ERROR;
+  }
+
+  for(size_t i = 0; i < pool->n_devices; i++) {
+    ykpiv_pool_device *dev = pool->devices + i;
+    yc_mutex_lock(&pool->mutex);
+    while(dev->busy) {
+      yc_cond_wait(&pool->idle, &pool->mutex);
+    }
+    dev->busy = true;
+    yc_mutex_unlock(&pool->mutex);
+
+    if(dev->healthy || (res = _pool_reconnect(dev)) == YKPIV_OK) {
+      res = ykpiv_verify(dev->state, pin, tries);
+    }
+    _pool_release(pool, dev, res);
+
+    // Devices that are gone are verified when they are reconnected
+    if(res != YKPIV_OK && !_pool_device_error(res)) {
+      DBG("PIN verification failed on '%s': %s", dev->reader, ykpiv_strerror(res));
+      return res;
+    }
+  }
+
+  return YKPIV_OK;
+}
+
+ykpiv_rc ykpiv_pool_sign_data(ykpiv_pool *pool, const unsigned char *sign_in,
+                              size_t in_len, unsigned char *sign_out, size_t *out_len,
+                              unsigned char algorithm, unsigned char key) {
+  return _pool_run(pool, ykpiv_sign_data, sign_in, in_len, sign_out, out_len, algorithm, key);
+}
+
+ykpiv_rc ykpiv_pool_decipher_data(ykpiv_pool *pool, const unsigned char *enc_in,
+                                  size_t in_len, unsigned char *enc_out, size_t *out_len,
+                                  unsigned char algorithm, unsigned char key) {
+  return _pool_run(pool, ykpiv_decipher_data, enc_in, in_len, enc_out, out_len, algorithm, key);
+}
+
+ykpiv_rc ykpiv_pool_get_status(ykpiv_pool *pool, size_t *devices, size_t *healthy) {
+  if(!pool) {
+    return YKPIV_ARGUMENT_ERROR;
+  }
+  yc_mutex_lock(&pool->mutex);
+  if(devices) {
+    *devices = pool->n_devices;
+  }
+  if(healthy) {
+    *healthy = 0;
+    for(size_t i = 0; i < pool->n_devices; i++) {
+      *healthy += pool->devices[i].healthy;
+    }
+  }
+  yc_mutex_unlock(&pool->mutex);
+  return YKPIV_OK;
+}
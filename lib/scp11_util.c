@@ -28,6 +28,7 @@
 *
 */
 
+#include <stdlib.h>
 #include <string.h>
 
 #include "internal.h"
@@ -41,66 +42,109 @@
 #include <arpa/inet.h>
 #endif
 
-static ykpiv_rc compute_full_mac_ex(const uint8_t *data, uint32_t data_len,
-                                 aes_context *aes_ctx, uint8_t *mac) {
+// MACs the MAC chain, if any, followed by the data and the trailer, without concatenating them
+static ykpiv_rc compute_full_mac_ex(aes_cmac_context_t *ctx, const uint8_t *mac_chain,
+                                    const uint8_t *data, uint32_t data_len,
+                                    const uint8_t *trailer, uint32_t trailer_len, uint8_t *mac) {
 
-  aes_cmac_context_t ctx = {0};
-
-  if (aes_cmac_init(aes_ctx, &ctx)) {
-    DBG("aes_cmac_init failed");
+  aes_cmac_start(ctx);
+  int drc = 0;
+  if (mac_chain) {
+    drc = aes_cmac_update(ctx, mac_chain, SCP11_MAC_LEN);
+  }
+  if (!drc) {
+    drc = aes_cmac_update(ctx, data, data_len);
+  }
+  if (!drc) {
+    drc = aes_cmac_update(ctx, trailer, trailer_len);
+  }
+  if (!drc) {
+    drc = aes_cmac_final(ctx, mac);
+  } else {
+    aes_cmac_start(ctx);
+  }
+  if (drc) {
+    DBG("%s: aes_cmac: %d", ykpiv_strerror(YKPIV_AUTHENTICATION_ERROR), drc);
     return YKPIV_AUTHENTICATION_ERROR;
   }
+  return YKPIV_OK;
+}
 
-  int drc = aes_cmac_encrypt(&ctx, data, data_len, mac);
+static ykpiv_rc set_mac_key(const uint8_t *key, aes_context *aes_ctx, aes_cmac_context_t *ctx) {
+  int drc = aes_set_key(key, SCP11_SESSION_KEY_LEN, YKPIV_ALGO_AES128, aes_ctx);
   if (drc) {
-    DBG("%s: aes_cmac_encrypt: %d", ykpiv_strerror(YKPIV_AUTHENTICATION_ERROR), drc);
-    aes_cmac_destroy(&ctx);
+    DBG("%s: aes_set_key: %d", ykpiv_strerror(YKPIV_KEY_ERROR), drc);
+    return YKPIV_KEY_ERROR;
+  }
+  if (aes_cmac_init(aes_ctx, ctx)) {
+    DBG("aes_cmac_init failed");
     return YKPIV_AUTHENTICATION_ERROR;
   }
-
-  aes_cmac_destroy(&ctx);
   return YKPIV_OK;
 }
 
-static ykpiv_rc compute_full_mac(const uint8_t *data, uint32_t data_len,
-                              const uint8_t *key, uint32_t key_len,
-                              uint8_t *mac) {
+ykpiv_rc scp11_session_init(ykpiv_scp11_state *state, const uint8_t *senc, const uint8_t *smac, const uint8_t *srmac) {
+  ykpiv_rc rc;
 
-  aes_context aes_ctx = {0};
-  int drc = aes_set_key(key, key_len, YKPIV_ALGO_AES128, &aes_ctx);
+  int drc = aes_set_key(senc, SCP11_SESSION_KEY_LEN, YKPIV_ALGO_AES128, &state->senc);
   if (drc) {
     DBG("%s: aes_set_key: %d", ykpiv_strerror(YKPIV_KEY_ERROR), drc);
-    return YKPIV_KEY_ERROR;
+    rc = YKPIV_KEY_ERROR;
+    goto init_clean;
   }
+  if ((rc = set_mac_key(smac, &state->smac, &state->smac_cmac)) != YKPIV_OK) {
+    goto init_clean;
+  }
+  if ((rc = set_mac_key(srmac, &state->srmac, &state->srmac_cmac)) != YKPIV_OK) {
+    goto init_clean;
+  }
+  return YKPIV_OK;
 
-  ykpiv_rc rc = compute_full_mac_ex(data, data_len, &aes_ctx, mac);
-  aes_destroy(&aes_ctx);
+init_clean:
+  scp11_session_destroy(state);
   return rc;
 }
 
+void scp11_session_destroy(ykpiv_scp11_state *state) {
+  aes_cmac_destroy(&state->smac_cmac);
+  aes_cmac_destroy(&state->srmac_cmac);
+  aes_destroy(&state->senc);
+  aes_destroy(&state->smac);
+  aes_destroy(&state->srmac);
+  yc_memzero(state->mac_chain, sizeof(state->mac_chain));
+  state->enc_counter = 0;
+  state->security_level = 0;
+}
+
+ykpiv_rc scp11_mac_data_ex(aes_cmac_context_t *ctx, uint8_t *mac_chain, uint8_t *data, uint32_t data_len,
+                           uint8_t *mac_out) {
+  return compute_full_mac_ex(ctx, mac_chain, data, data_len, NULL, 0, mac_out);
+}
+
 ykpiv_rc scp11_mac_data(uint8_t *key, uint8_t *mac_chain, uint8_t *data, uint32_t data_len, uint8_t *mac_out) {
-  int res;
-  if(mac_chain) {
-    uint8_t buf[YKPIV_OBJ_MAX_SIZE] = {0};
-    memcpy(buf, mac_chain, SCP11_MAC_LEN);
-    memcpy(buf + SCP11_MAC_LEN, data, data_len);
-    size_t buf_len = SCP11_MAC_LEN + data_len;
-    res = compute_full_mac(buf, buf_len, key, AES_BLOCK_SIZE, mac_out);
-  } else {
-    res = compute_full_mac(data, data_len, key, AES_BLOCK_SIZE, mac_out);
+  aes_context aes_ctx = {0};
+  aes_cmac_context_t ctx = {0};
+
+  ykpiv_rc rc = set_mac_key(key, &aes_ctx, &ctx);
+  if (rc == YKPIV_OK) {
+    rc = scp11_mac_data_ex(&ctx, mac_chain, data, data_len, mac_out);
   }
-  return res;
+  aes_cmac_destroy(&ctx);
+  aes_destroy(&aes_ctx);
+  return rc;
 }
 
-ykpiv_rc scp11_unmac_data(uint8_t *key, uint8_t *mac_chain, uint8_t *data, uint32_t data_len, uint16_t sw) {
-
-  uint8_t resp[YKPIV_OBJ_MAX_SIZE] = {0};
-  memcpy(resp, data, (data_len - SCP11_HALF_MAC_LEN));
-  resp[data_len - SCP11_HALF_MAC_LEN] = sw >> 8;
-  resp[data_len - SCP11_HALF_MAC_LEN + 1] = sw & 0xff;
+ykpiv_rc scp11_unmac_data_ex(aes_cmac_context_t *ctx, uint8_t *mac_chain, uint8_t *data, uint32_t data_len,
+                             uint16_t sw) {
+  if (data_len < SCP11_HALF_MAC_LEN) {
+    DBG("Response too short to hold a MAC: %u bytes", data_len);
+    return YKPIV_AUTHENTICATION_ERROR;
+  }
 
+  // The R-MAC covers the MAC chain, the response data and the status word
+  uint8_t sw_bytes[2] = {sw >> 8, sw & 0xff};
   uint8_t rmac[SCP11_MAC_LEN] = {0};
-  ykpiv_rc rc = scp11_mac_data(key, mac_chain, resp, data_len - SCP11_HALF_MAC_LEN + 2, rmac);
+  ykpiv_rc rc = compute_full_mac_ex(ctx, mac_chain, data, data_len - SCP11_HALF_MAC_LEN, sw_bytes, sizeof(sw_bytes), rmac);
   if (rc != YKPIV_OK) {
     DBG("Failed to calculate rmac");
     return rc;
@@ -113,6 +157,19 @@ ykpiv_rc scp11_unmac_data(uint8_t *key, uint8_t *mac_chain, uint8_t *data, uint3
   return YKPIV_OK;
 }
 
+ykpiv_rc scp11_unmac_data(uint8_t *key, uint8_t *mac_chain, uint8_t *data, uint32_t data_len, uint16_t sw) {
+  aes_context aes_ctx = {0};
+  aes_cmac_context_t ctx = {0};
+
+  ykpiv_rc rc = set_mac_key(key, &aes_ctx, &ctx);
+  if (rc == YKPIV_OK) {
+    rc = scp11_unmac_data_ex(&ctx, mac_chain, data, data_len, sw);
+  }
+  aes_cmac_destroy(&ctx);
+  aes_destroy(&aes_ctx);
+  return rc;
+}
+
 static ykpiv_rc get_iv(aes_context *key, uint32_t counter, uint8_t *iv, bool decrypt) {
   uint8_t iv_data[AES_BLOCK_SIZE] = {0};
   if (decrypt) {
@@ -130,45 +187,56 @@ static ykpiv_rc get_iv(aes_context *key, uint32_t counter, uint8_t *iv, bool dec
   return YKPIV_OK;
 }
 
-ykpiv_rc
-scp11_encrypt_data(uint8_t *key, uint32_t counter, const uint8_t *data, uint32_t data_len, uint8_t *enc, uint32_t *enc_len) {
+ykpiv_rc scp11_encrypt_data_ex(aes_context *key, uint32_t counter, const uint8_t *data, uint32_t data_len,
+                               uint8_t *enc, uint32_t *enc_len) {
   ykpiv_rc rc;
-  aes_context enc_key = {0};
-  int drc = aes_set_key(key, SCP11_SESSION_KEY_LEN, YKPIV_ALGO_AES128, &enc_key);
-  if (drc) {
-    DBG("%s: cipher_import_key: %d", ykpiv_strerror(YKPIV_KEY_ERROR), drc);
-    rc = YKPIV_KEY_ERROR;
-    goto enc_clean;
-  }
+  int drc;
 
   uint8_t iv[AES_BLOCK_SIZE] = {0};
-  if ((rc = get_iv(&enc_key, counter, iv, false)) != YKPIV_OK) {
+  if ((rc = get_iv(key, counter, iv, false)) != YKPIV_OK) {
     DBG("Failed to calculate encryption IV");
-    goto enc_clean;
+    return rc;
   }
 
+  // Padded and encrypted in place in the output buffer
   size_t pad_len = AES_BLOCK_SIZE - (data_len % AES_BLOCK_SIZE);
-  uint8_t padded[YKPIV_OBJ_MAX_SIZE] = {0};
-  memcpy(padded, data, data_len);
-  if((drc = aes_add_padding(padded, data_len + pad_len, &data_len)) != 0) {
+  if (data_len + pad_len > *enc_len) {
+    DBG("Data too long to encrypt: %u bytes", data_len);
+    return YKPIV_SIZE_ERROR;
+  }
+  memmove(enc, data, data_len);
+  if((drc = aes_add_padding(enc, (uint32_t)(data_len + pad_len), &data_len)) != 0) {
     DBG("%s: aes_add_padding: %d", ykpiv_strerror(YKPIV_MEMORY_ERROR), drc);
-    rc = YKPIV_MEMORY_ERROR;
-    goto enc_clean;
+    return YKPIV_MEMORY_ERROR;
   }
 
-  if ((drc = aes_cbc_encrypt(padded, data_len, enc, enc_len, iv, AES_BLOCK_SIZE, &enc_key)) != 0) {
+  if ((drc = aes_cbc_encrypt(enc, data_len, enc, enc_len, iv, AES_BLOCK_SIZE, key)) != 0) {
     DBG("%s: cipher_encrypt: %d", ykpiv_strerror(YKPIV_KEY_ERROR), drc);
+    return YKPIV_KEY_ERROR;
+  }
+  return YKPIV_OK;
+}
+
+ykpiv_rc
+scp11_encrypt_data(uint8_t *key, uint32_t counter, const uint8_t *data, uint32_t data_len, uint8_t *enc, uint32_t *enc_len) {
+  ykpiv_rc rc;
+  aes_context enc_key = {0};
+  int drc = aes_set_key(key, SCP11_SESSION_KEY_LEN, YKPIV_ALGO_AES128, &enc_key);
+  if (drc) {
+    DBG("%s: cipher_import_key: %d", ykpiv_strerror(YKPIV_KEY_ERROR), drc);
     rc = YKPIV_KEY_ERROR;
     goto enc_clean;
   }
 
+  rc = scp11_encrypt_data_ex(&enc_key, counter, data, data_len, enc, enc_len);
+
 enc_clean:
   aes_destroy(&enc_key);
   return rc;
 }
 
-ykpiv_rc
-scp11_decrypt_data(uint8_t *key, uint32_t counter, uint8_t *enc, uint32_t enc_len, uint8_t *data, uint32_t *data_len) {
+ykpiv_rc scp11_decrypt_data_ex(aes_context *key, uint32_t counter, uint8_t *enc, uint32_t enc_len, uint8_t *data,
+                               uint32_t *data_len) {
   if(enc_len <= 0) {
     DBG("No data to decrypt");
     *data_len = 0;
@@ -176,31 +244,43 @@ scp11_decrypt_data(uint8_t *key, uint32_t counter, uint8_t *enc, uint32_t enc_le
   }
 
   ykpiv_rc rc;
-  aes_context dec_key = {0};
-  int drc = aes_set_key(key, SCP11_SESSION_KEY_LEN, YKPIV_ALGO_AES128, &dec_key);
-  if (drc) {
-    DBG("%s: cipher_import_key: %d", ykpiv_strerror(YKPIV_KEY_ERROR), drc);
-    rc = YKPIV_KEY_ERROR;
-    goto aes_dec_clean;
-  }
-
   uint8_t iv[AES_BLOCK_SIZE] = {0};
-  if ((rc = get_iv(&dec_key, counter, iv, true)) != YKPIV_OK) {
+  if ((rc = get_iv(key, counter, iv, true)) != YKPIV_OK) {
     DBG("Failed to calculate decryption IV");
-    goto aes_dec_clean;
+    return rc;
   }
 
-  drc = aes_cbc_decrypt(enc, enc_len, data, data_len, iv, AES_BLOCK_SIZE, &dec_key);
+  int drc = aes_cbc_decrypt(enc, enc_len, data, data_len, iv, AES_BLOCK_SIZE, key);
   if (drc) {
     DBG("%s: cipher_decrypt: %d", ykpiv_strerror(YKPIV_KEY_ERROR), drc);
+    return YKPIV_KEY_ERROR;
+  }
+
+  aes_remove_padding(data, data_len);
+  return YKPIV_OK;
+}
+
+ykpiv_rc
+scp11_decrypt_data(uint8_t *key, uint32_t counter, uint8_t *enc, uint32_t enc_len, uint8_t *data, uint32_t *data_len) {
+  if(enc_len <= 0) {
+    DBG("No data to decrypt");
+    *data_len = 0;
+    return YKPIV_OK;
+  }
+
+  ykpiv_rc rc;
+  aes_context dec_key = {0};
+  int drc = aes_set_key(key, SCP11_SESSION_KEY_LEN, YKPIV_ALGO_AES128, &dec_key);
+  if (drc) {
+    DBG("%s: cipher_import_key: %d", ykpiv_strerror(YKPIV_KEY_ERROR), drc);
     rc = YKPIV_KEY_ERROR;
     goto aes_dec_clean;
   }
 
-  aes_remove_padding(data, data_len);
+  rc = scp11_decrypt_data_ex(&dec_key, counter, enc, enc_len, data, data_len);
 
 aes_dec_clean:
   aes_destroy(&dec_key);
 
   return rc;
-}
\ No newline at end of file
+}
@@ -32,6 +32,7 @@
 #define YUBICO_PIV_TOOL_AES_UTIL_H
 
 #include "ykpiv.h"
+#include "internal.h"
 
 ykpiv_rc scp11_mac_data(uint8_t *key, uint8_t *mac_chain, uint8_t *data, uint32_t data_len, uint8_t *mac_out);
 
@@ -43,5 +44,21 @@ scp11_encrypt_data(uint8_t *key, uint32_t counter, const uint8_t *data, uint32_t
 ykpiv_rc
 scp11_decrypt_data(uint8_t *key, uint32_t counter, uint8_t *enc, uint32_t enc_len, uint8_t *data, uint32_t *data_len);
 
+ykpiv_rc scp11_session_init(ykpiv_scp11_state *state, const uint8_t *senc, const uint8_t *smac, const uint8_t *srmac);
+
+void scp11_session_destroy(ykpiv_scp11_state *state);
+
+ykpiv_rc scp11_mac_data_ex(aes_cmac_context_t *ctx, uint8_t *mac_chain, uint8_t *data, uint32_t data_len,
+                           uint8_t *mac_out);
+
+ykpiv_rc scp11_unmac_data_ex(aes_cmac_context_t *ctx, uint8_t *mac_chain, uint8_t *data, uint32_t data_len,
+                             uint16_t sw);
+
+ykpiv_rc scp11_encrypt_data_ex(aes_context *key, uint32_t counter, const uint8_t *data, uint32_t data_len,
+                               uint8_t *enc, uint32_t *enc_len);
+
+ykpiv_rc scp11_decrypt_data_ex(aes_context *key, uint32_t counter, uint8_t *enc, uint32_t enc_len, uint8_t *data,
+                               uint32_t *data_len);
+
 
 #endif //YUBICO_PIV_TOOL_AES_UTIL_H
@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2025 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sched.h>
+#endif
+
+#include "internal.h"
+#include "ykpiv.h"
+
+#ifdef _MSC_VER
+#define sd_cache_cas(ptr, old, new) (InterlockedCompareExchange((ptr), (new), (old)) == (old))
+#define sd_cache_release(ptr) InterlockedExchange((ptr), 0)
+#define sd_cache_yield() SwitchToThread()
+#else
+#define sd_cache_cas(ptr, old, new) __sync_bool_compare_and_swap((ptr), (old), (new))
+#define sd_cache_release(ptr) __sync_lock_release((ptr))
+#define sd_cache_yield() sched_yield()
+#endif
+
+#define SD_CACHE_ENTRIES 32
+
+typedef struct {
+  uint32_t serial; // 0 for an unused entry
+  uint8_t kvn;
+  uint8_t pubkey[SCP11_SD_PUBKEY_LEN];
+  uint64_t used; // Value of sd_cache_clock when last looked up or stored, the least recent entry is replaced
+} sd_cache_entry;
+
+// Process-wide, as the key of the security domain doesn't depend on the state handle
+static volatile long sd_cache_lock;
+static sd_cache_entry sd_cache[SD_CACHE_ENTRIES];
+static uint64_t sd_cache_clock;
+static char sd_cache_path[1024];
+static bool sd_cache_loaded; // Path read from YKPIV_SD_CACHE, or the file read
+
+static void _sd_cache_lock(void) {
+  // Only held for table updates and small file accesses
+  while(!sd_cache_cas(&sd_cache_lock, 0, 1)) {
+    sd_cache_yield();
+  }
+}
+
+static void _sd_cache_unlock(void) {
+  sd_cache_release(&sd_cache_lock);
+}
+
+static sd_cache_entry *_sd_cache_find(uint32_t serial, uint8_t kvn) {
+  for(size_t i = 0; i < SD_CACHE_ENTRIES; i++) {
+    if(sd_cache[i].serial == serial && sd_cache[i].kvn == kvn) {
+      return sd_cache + i;
+    }
+  }
+  return NULL;
+}
+
+static sd_cache_entry *_sd_cache_add(uint32_t serial, uint8_t kvn) {
+  sd_cache_entry *entry = _sd_cache_find(serial, kvn);
+  if(!entry) {
+    entry = sd_cache;
+    for(size_t i = 1; i < SD_CACHE_ENTRIES && entry->serial; i++) {
+      if(!sd_cache[i].serial || sd_cache[i].used < entry->used) {
+        entry = sd_cache + i;
+      }
+    }
+    entry->serial = serial;
+    entry->kvn = kvn;
+  }
+  entry->used = ++sd_cache_clock;
+  return entry;
+}
+
+// One line per key: serial number, key version number and public key, all in hex
+static void _sd_cache_read_file(void) {
+  char line[2 * SCP11_SD_PUBKEY_LEN + 32];
+  FILE *f = fopen(sd_cache_path, "r");
+  if(!f) {
+    return;
+  }
+  while(fgets(line, sizeof(line), f)) {
+    unsigned int serial = 0, kvn = 0;
+    char hex[2 * SCP11_SD_PUBKEY_LEN + 1] = {0};
+    uint8_t pubkey[SCP11_SD_PUBKEY_LEN];
+    size_t len = sizeof(pubkey);
+    if(sscanf(line, "%x %x %130s", &serial, &kvn, hex) != 3 || !serial || kvn > 0xff ||
+       ykpiv_hex_decode(hex, strlen(hex), pubkey, &len) != YKPIV_OK || len != sizeof(pubkey)) {
+      DBG("Ignoring invalid line in SD public key cache %s", sd_cache_path);
+      continue;
+    }
+    memcpy(_sd_cache_add(serial, (uint8_t)kvn)->pubkey, pubkey, sizeof(pubkey));
+  }
+  fclose(f);
+}
+
+static void _sd_cache_write_file(void) {
+  char tmp[sizeof(sd_cache_path) + 4];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", sd_cache_path);
+  FILE *f = fopen(tmp, "w");
+  if(!f) {
+    DBG("Unable to write SD public key cache %s", tmp);
+    return;
+  }
+  for(size_t i = 0; i < SD_CACHE_ENTRIES; i++) {
+    if(sd_cache[i].serial) {
+      fprintf(f, "%08x %02x ", sd_cache[i].serial, sd_cache[i].kvn);
+      for(size_t j = 0; j < SCP11_SD_PUBKEY_LEN; j++) {
+        fprintf(f, "%02x", sd_cache[i].pubkey[j]);
+      }
+      fputc('\n', f);
+    }
+  }
+  if(fclose(f)) {
+    remove(tmp);
+    return;
+  }
+#ifdef _WIN32
+  if(!MoveFileExA(tmp, sd_cache_path, MOVEFILE_REPLACE_EXISTING)) {
+#else
+  if(rename(tmp, sd_cache_path)) {
+#endif
+    DBG("Unable to replace SD public key cache %s", sd_cache_path);
+    remove(tmp);
+  }
+}
+
+// Must be called with the lock held
+static void _sd_cache_load(void) {
+  if(!sd_cache_loaded) {
+    sd_cache_loaded = true;
+    const char *path = getenv("YKPIV_SD_CACHE");
+    if(path && *path && !*sd_cache_path) {
+      snprintf(sd_cache_path, sizeof(sd_cache_path), "%s", path);
+    }
+    if(*sd_cache_path) {
+      _sd_cache_read_file();
+    }
+  }
+}
+
+ykpiv_rc ykpiv_set_sd_cache_file(const char *path) {
+  if(path && strlen(path) >= sizeof(sd_cache_path)) {
+    return YKPIV_SIZE_ERROR;
+  }
+  _sd_cache_lock();
+  snprintf(sd_cache_path, sizeof(sd_cache_path), "%s", path ? path : "");
+  // Keys already cached are kept, and written along with the next new key
+  sd_cache_loaded = true;
+  if(*sd_cache_path) {
+    _sd_cache_read_file();
+  }
+  _sd_cache_unlock();
+  return YKPIV_OK;
+}
+
+bool _ykpiv_sd_cache_get(uint32_t serial, uint8_t kvn, uint8_t *pubkey) {
+  bool found = false;
+  if(!serial) {
+    return false;
+  }
+  _sd_cache_lock();
+  _sd_cache_load();
+  sd_cache_entry *entry = _sd_cache_find(serial, kvn);
+  if(entry) {
+    memcpy(pubkey, entry->pubkey, SCP11_SD_PUBKEY_LEN);
+    entry->used = ++sd_cache_clock;
+    found = true;
+  }
+  _sd_cache_unlock();
+  return found;
+}
+
+void _ykpiv_sd_cache_put(uint32_t serial, uint8_t kvn, const uint8_t *pubkey) {
+  if(!serial) {
+    return;
+  }
+  _sd_cache_lock();
+  _sd_cache_load();
+  memcpy(_sd_cache_add(serial, kvn)->pubkey, pubkey, SCP11_SD_PUBKEY_LEN);
+  if(*sd_cache_path) {
+    _sd_cache_write_file();
+  }
+  _sd_cache_unlock();
+}
+
+void _ykpiv_sd_cache_drop(uint32_t serial, uint8_t kvn) {
+  _sd_cache_lock();
+  sd_cache_entry *entry = _sd_cache_find(serial, kvn);
+  if(entry) {
+    memset(entry, 0, sizeof(*entry));
+    if(*sd_cache_path) {
+      _sd_cache_write_file();
+    }
+  }
+  _sd_cache_unlock();
+}
@@ -31,6 +31,7 @@
 #include <check.h>
 
 #include "../scp11_util.h"
+#include "../../aes_cmac/aes_cmac.h"
 
 struct enc_test_data {
     uint8_t enc_key[16];
@@ -142,6 +143,80 @@ START_TEST(test_mac) {
 
 END_TEST
 
+START_TEST(test_session) {
+  ykpiv_scp11_state state = {0};
+  ykpiv_rc rc = scp11_session_init(&state, enc_data[_i].enc_key, mac_data[_i].mac_key, mac_data[_i].mac_key);
+  ck_assert_int_eq(rc, YKPIV_OK);
+
+  // The prepared contexts must give the same result as the one-shot functions, every time they are used
+  for (int n = 0; n < 2; n++) {
+    uint8_t e[255] = {0};
+    uint32_t e_len = sizeof(e);
+    rc = scp11_encrypt_data_ex(&state.senc, enc_data[_i].counter, enc_data[_i].plain_text,
+                               sizeof(enc_data[_i].plain_text), e, &e_len);
+    ck_assert_int_eq(rc, YKPIV_OK);
+    ck_assert_int_eq(e_len, sizeof(enc_data[_i].enc_text));
+    ck_assert(memcmp(e, enc_data[_i].enc_text, e_len) == 0);
+
+    uint8_t m[16] = {0};
+    rc = scp11_mac_data_ex(&state.smac_cmac, mac_data[_i].mac_chain, mac_data[_i].input_text,
+                           sizeof(mac_data[_i].input_text), m);
+    ck_assert_int_eq(rc, YKPIV_OK);
+    ck_assert(memcmp(m, mac_data[_i].mac, sizeof(m)) == 0);
+  }
+
+  scp11_session_destroy(&state);
+}
+
+END_TEST
+
+START_TEST(test_cmac_parts) {
+  // RFC 4493 example key and message
+  const uint8_t key[16] = {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c};
+  const uint8_t msg[64] = {0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+                           0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+                           0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+                           0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10};
+  const struct {
+    uint32_t len;
+    uint8_t mac[16];
+  } vectors[] = {
+    {0, {0xbb, 0x1d, 0x69, 0x29, 0xe9, 0x59, 0x37, 0x28, 0x7f, 0xa3, 0x7d, 0x12, 0x9b, 0x75, 0x67, 0x46}},
+    {16, {0x07, 0x0a, 0x16, 0xb4, 0x6b, 0x4d, 0x41, 0x44, 0xf7, 0x9b, 0xdd, 0x9d, 0xd0, 0x4a, 0x28, 0x7c}},
+    {40, {0xdf, 0xa6, 0x67, 0x47, 0xde, 0x9a, 0xe6, 0x30, 0x30, 0xca, 0x32, 0x61, 0x14, 0x97, 0xc8, 0x27}},
+    {64, {0x51, 0xf0, 0xbe, 0xbf, 0x7e, 0x3b, 0x9d, 0x92, 0xfc, 0x49, 0x74, 0x17, 0x79, 0x36, 0x3c, 0xfe}},
+  };
+  aes_context aes = {0};
+  aes_cmac_context_t ctx = {0};
+  uint8_t mac[16] = {0};
+
+  ck_assert_int_eq(aes_set_key(key, sizeof(key), YKPIV_ALGO_AES128, &aes), 0);
+  ck_assert_int_eq(aes_cmac_init(&aes, &ctx), 0);
+
+  for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+    uint32_t len = vectors[i].len;
+    ck_assert_int_eq(aes_cmac_encrypt(&ctx, msg, len, mac), 0);
+    ck_assert(memcmp(mac, vectors[i].mac, sizeof(mac)) == 0);
+
+    // Every way of splitting the message in three parts gives the same MAC
+    for (uint32_t a = 0; a <= len; a++) {
+      for (uint32_t b = a; b <= len; b++) {
+        aes_cmac_start(&ctx);
+        ck_assert_int_eq(aes_cmac_update(&ctx, msg, a), 0);
+        ck_assert_int_eq(aes_cmac_update(&ctx, msg + a, b - a), 0);
+        ck_assert_int_eq(aes_cmac_update(&ctx, msg + b, len - b), 0);
+        ck_assert_int_eq(aes_cmac_final(&ctx, mac), 0);
+        ck_assert(memcmp(mac, vectors[i].mac, sizeof(mac)) == 0);
+      }
+    }
+  }
+
+  aes_cmac_destroy(&ctx);
+  aes_destroy(&aes);
+}
+
+END_TEST
+
 static Suite *aes_suite(void) {
   Suite *s;
   TCase *tc;
@@ -151,6 +226,8 @@ static Suite *aes_suite(void) {
   tcase_add_loop_test(tc, test_encryption, 0, sizeof(enc_data) / sizeof(struct enc_test_data));
   tcase_add_loop_test(tc, test_decryption, 0, sizeof(dec_data) / sizeof(struct dec_test_data));
   tcase_add_loop_test(tc, test_mac, 0, sizeof(mac_data) / sizeof(struct mac_test_data));
+  tcase_add_loop_test(tc, test_session, 0, sizeof(enc_data) / sizeof(struct enc_test_data));
+  tcase_add_test(tc, test_cmac_parts);
   suite_add_tcase(s, tc);
 
   return s;
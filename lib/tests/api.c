@@ -163,6 +163,85 @@ START_TEST(test_get_set_cardid) {
 }
 END_TEST
 
+START_TEST(test_batch) {
+  ykpiv_rc res;
+  uint32_t serial = 0, batch_serial = 0;
+  ykpiv_cardid cardid = {0};
+
+  res = ykpiv_get_serial(g_state, &serial);
+  ck_assert_int_eq(res, YKPIV_OK);
+
+  res = ykpiv_end_batch(g_state);
+  ck_assert_int_eq(res, YKPIV_ARGUMENT_ERROR);
+
+  res = ykpiv_begin_batch(g_state, 0);
+  ck_assert_int_eq(res, YKPIV_OK);
+  res = ykpiv_begin_batch(g_state, 0);
+  ck_assert_int_eq(res, YKPIV_OK);
+  res = ykpiv_get_serial(g_state, &batch_serial);
+  ck_assert_int_eq(res, YKPIV_OK);
+  ck_assert_uint_eq(batch_serial, serial);
+  res = ykpiv_end_batch(g_state);
+  ck_assert_int_eq(res, YKPIV_OK);
+  res = ykpiv_util_get_cardid(g_state, &cardid);
+  ck_assert_int_eq(res, YKPIV_OK);
+  res = ykpiv_end_batch(g_state);
+  ck_assert_int_eq(res, YKPIV_OK);
+
+  // A batch that has reached its hold time releases and re-acquires the card
+  res = ykpiv_begin_batch(g_state, 1);
+  ck_assert_int_eq(res, YKPIV_OK);
+  for(int i = 0; i < 3; i++) {
+    res = ykpiv_util_get_cardid(g_state, &cardid);
+    ck_assert_int_eq(res, YKPIV_OK);
+  }
+  res = ykpiv_end_batch(g_state);
+  ck_assert_int_eq(res, YKPIV_OK);
+
+  res = ykpiv_end_batch(g_state);
+  ck_assert_int_eq(res, YKPIV_ARGUMENT_ERROR);
+}
+END_TEST
+
+START_TEST(test_stats) {
+  ykpiv_rc res;
+  ykpiv_stats stats;
+  ykpiv_cardid cardid = {0};
+  const ykpiv_ins_stats *get_data = NULL;
+
+  res = ykpiv_get_stats(g_state, &stats, true);
+  ck_assert_int_eq(res, YKPIV_OK);
+  res = ykpiv_util_get_cardid(g_state, &cardid);
+  ck_assert_int_eq(res, YKPIV_OK);
+  res = ykpiv_util_get_cardid(g_state, &cardid);
+  ck_assert_int_eq(res, YKPIV_OK);
+
+  res = ykpiv_get_stats(g_state, &stats, false);
+  ck_assert_int_eq(res, YKPIV_OK);
+  for(size_t i = 0; i < stats.n_ins; i++) {
+    if(stats.ins[i].ins == YKPIV_INS_GET_DATA) {
+      get_data = stats.ins + i;
+    }
+  }
+  ck_assert_ptr_nonnull(get_data);
+  ck_assert_uint_eq(get_data->commands, 2);
+  ck_assert_uint_ge(get_data->apdus, get_data->commands);
+  ck_assert_uint_gt(get_data->bytes_received, 0);
+  ck_assert_uint_le(get_data->transmit_us, get_data->total_us);
+  uint64_t counted = 0;
+  for(size_t i = 0; i < YKPIV_STATS_BUCKETS; i++) {
+    counted += get_data->latency[i];
+  }
+  ck_assert_uint_eq(counted, get_data->commands);
+
+  res = ykpiv_get_stats(g_state, &stats, true);
+  ck_assert_int_eq(res, YKPIV_OK);
+  res = ykpiv_get_stats(g_state, &stats, false);
+  ck_assert_int_eq(res, YKPIV_OK);
+  ck_assert_uint_eq(stats.n_ins, 0);
+}
+END_TEST
+
 START_TEST(test_list_readers) {
   ykpiv_rc res;
   char reader_buf[2048] = {0};
@@ -196,6 +275,23 @@ START_TEST(test_read_write_list_delete_cert) {
     ck_assert_int_eq(res, YKPIV_OK);
   }
 
+  {
+    unsigned char data[YKPIV_OBJ_MAX_SIZE] = {0};
+    unsigned long data_len = sizeof(data);
+    unsigned char buf[YKPIV_OBJ_MAX_SIZE] = {0};
+    unsigned char *view = NULL;
+    unsigned long view_len = 0;
+
+    res = ykpiv_fetch_object(g_state, YKPIV_OBJ_AUTHENTICATION, data, &data_len);
+    ck_assert_int_eq(res, YKPIV_OK);
+
+    res = ykpiv_fetch_object_view(g_state, YKPIV_OBJ_AUTHENTICATION, buf, sizeof(buf), &view, &view_len);
+    ck_assert_int_eq(res, YKPIV_OK);
+    ck_assert(view > buf && view < buf + sizeof(buf));
+    ck_assert_int_eq(view_len, data_len);
+    ck_assert_mem_eq(view, data, data_len);
+  }
+
   {
     ykpiv_key *keys = NULL;
     size_t data_len;
@@ -209,6 +305,31 @@ START_TEST(test_read_write_list_delete_cert) {
     ck_assert_int_eq(res, YKPIV_OK);
   }
 
+  {
+    ykpiv_key_info *keys = NULL;
+    size_t key_count = 0;
+    res = ykpiv_util_list_keys_ex(g_state, YKPIV_LIST_KEYS_CERTS, &keys, &key_count);
+    ck_assert_int_eq(res, YKPIV_OK);
+    ck_assert_ptr_nonnull(keys);
+    for (size_t i = 0; i < key_count; i++) {
+      if (keys[i].slot == YKPIV_KEY_AUTHENTICATION && keys[i].cert) {
+        ck_assert_int_eq(keys[i].cert_len, sizeof(g_cert));
+        ck_assert_mem_eq(keys[i].cert, g_cert, sizeof(g_cert));
+      }
+    }
+    res = ykpiv_util_free(g_state, keys);
+    ck_assert_int_eq(res, YKPIV_OK);
+
+    res = ykpiv_util_list_keys_ex(g_state, 0, &keys, &key_count);
+    ck_assert_int_eq(res, YKPIV_OK);
+    for (size_t i = 0; i < key_count; i++) {
+      ck_assert_ptr_null(keys[i].cert);
+      ck_assert_int_eq(keys[i].cert_len, 0);
+    }
+    res = ykpiv_util_free(g_state, keys);
+    ck_assert_int_eq(res, YKPIV_OK);
+  }
+
   {
     res = ykpiv_util_delete_cert(g_state, YKPIV_KEY_AUTHENTICATION);
     ck_assert_int_eq(res, YKPIV_OK);
@@ -492,6 +613,159 @@ START_TEST(test_import_key) {
 }
 END_TEST
 
+START_TEST(test_pool) {
+  ykpiv_rc res;
+  ykpiv_pool *pool = NULL;
+  char wanted[sizeof(g_state->reader) + 1] = {0};
+  size_t devices = 0, healthy = 0;
+
+  // Key imported by test_import_key
+  import_key(0x9a, YKPIV_PINPOLICY_DEFAULT);
+
+  snprintf(wanted, sizeof(wanted), "@%s", g_state->reader);
+  res = ykpiv_pool_init(&pool, wanted, true);
+  ck_assert_int_eq(res, YKPIV_OK);
+  res = ykpiv_pool_get_status(pool, &devices, &healthy);
+  ck_assert_int_eq(res, YKPIV_OK);
+  ck_assert_uint_eq(devices, 1);
+  ck_assert_uint_eq(healthy, 1);
+
+  res = ykpiv_pool_verify(pool, "123456", NULL);
+  ck_assert_int_eq(res, YKPIV_OK);
+
+  {
+    BIO *bio = NULL;
+    X509 *cert = NULL;
+    RSA *rsa = NULL;
+    EVP_PKEY *pub_key = NULL;
+    unsigned char signature[2048] = {0};
+    unsigned char signinput[512] = {0};
+    unsigned char data[32] = {0};
+    size_t sig_len;
+
+    bio = BIO_new_mem_buf(certificate_pem, strlen(certificate_pem));
+    cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+    ck_assert_ptr_nonnull(cert);
+    BIO_free(bio);
+    pub_key = X509_get_pubkey(cert);
+    ck_assert_ptr_nonnull(pub_key);
+    rsa = EVP_PKEY_get1_RSA(pub_key);
+    ck_assert_ptr_nonnull(rsa);
+    EVP_PKEY_free(pub_key);
+
+    for(int i = 0; i < 4; i++) {
+      ck_assert_int_gt(RAND_bytes(data, sizeof(data)), 0);
+      ck_assert_int_ne(RSA_padding_add_PKCS1_type_1(signinput, sizeof(signinput), data, sizeof(data)), 0);
+      sig_len = sizeof(signature);
+      res = ykpiv_pool_sign_data(pool, signinput, sizeof(signinput), signature, &sig_len, YKPIV_ALGO_RSA4096, 0x9a);
+      ck_assert_int_eq(res, YKPIV_OK);
+      ck_assert_int_eq(RSA_public_decrypt(sig_len, signature, signinput, rsa, RSA_PKCS1_PADDING), sizeof(data));
+      ck_assert_mem_eq(signinput, data, sizeof(data));
+    }
+
+    RSA_free(rsa);
+    X509_free(cert);
+  }
+
+  res = ykpiv_pool_done(pool);
+  ck_assert_int_eq(res, YKPIV_OK);
+}
+END_TEST
+
+static void sign_async_cb(void *ctx, ykpiv_rc res, unsigned char *out, size_t out_len) {
+  ck_assert_int_eq(res, YKPIV_OK);
+  ck_assert_uint_eq(out_len, 512);
+  ck_assert_ptr_nonnull(out);
+  (*(int *)ctx)++;
+}
+
+START_TEST(test_sign_async) {
+  ykpiv_rc res;
+  ykpiv_queue *queue = NULL;
+  unsigned char signinput[512] = {0};
+  unsigned char signature[3][512] = {0};
+  unsigned char data[32] = {0};
+  size_t completed;
+  int done = 0;
+
+  // Key imported by test_import_key
+  res = ykpiv_verify(g_state, "123456", NULL);
+  ck_assert_int_eq(res, YKPIV_OK);
+
+  ck_assert_int_gt(RAND_bytes(data, sizeof(data)), 0);
+  ck_assert_int_ne(RSA_padding_add_PKCS1_type_1(signinput, sizeof(signinput), data, sizeof(data)), 0);
+
+  res = ykpiv_queue_init(&queue);
+  ck_assert_int_eq(res, YKPIV_OK);
+  ck_assert_int_ge(ykpiv_queue_get_fd(queue), 0);
+
+  for(int i = 0; i < 3; i++) {
+    res = ykpiv_sign_data_async(g_state, queue, signinput, sizeof(signinput), signature[i], sizeof(signature[i]),
+                                YKPIV_ALGO_RSA4096, 0x9a, sign_async_cb, &done);
+    ck_assert_int_eq(res, YKPIV_OK);
+  }
+  while(done < 3) {
+    res = ykpiv_queue_poll(queue, 1000, &completed);
+    ck_assert_int_eq(res, YKPIV_OK);
+  }
+  ck_assert_mem_eq(signature[0], signature[1], sizeof(signature[0]));
+  ck_assert_mem_eq(signature[0], signature[2], sizeof(signature[0]));
+
+  res = ykpiv_queue_poll(queue, 0, &completed);
+  ck_assert_int_eq(res, YKPIV_OK);
+  ck_assert_uint_eq(completed, 0);
+
+  res = ykpiv_queue_done(queue);
+  ck_assert_int_eq(res, YKPIV_OK);
+}
+END_TEST
+
+START_TEST(test_sign_batch) {
+  ykpiv_rc res;
+  unsigned char signinput[512] = {0};
+  unsigned char signature[4][512] = {0};
+  unsigned char expected[512] = {0};
+  unsigned char data[32] = {0};
+  size_t expected_len = sizeof(expected);
+  const unsigned char *in[4];
+  size_t in_len[4];
+  unsigned char *out[4];
+  size_t out_len[4];
+
+  // Key imported by test_import_key
+  res = ykpiv_verify(g_state, "123456", NULL);
+  ck_assert_int_eq(res, YKPIV_OK);
+
+  ck_assert_int_gt(RAND_bytes(data, sizeof(data)), 0);
+  ck_assert_int_ne(RSA_padding_add_PKCS1_type_1(signinput, sizeof(signinput), data, sizeof(data)), 0);
+  res = ykpiv_sign_data(g_state, signinput, sizeof(signinput), expected, &expected_len, YKPIV_ALGO_RSA4096, 0x9a);
+  ck_assert_int_eq(res, YKPIV_OK);
+
+  for(int i = 0; i < 4; i++) {
+    in[i] = signinput;
+    in_len[i] = sizeof(signinput);
+    out[i] = signature[i];
+    out_len[i] = sizeof(signature[i]);
+  }
+  res = ykpiv_sign_data_batch(g_state, 0x9a, YKPIV_ALGO_RSA4096, in, in_len, 4, out, out_len);
+  ck_assert_int_eq(res, YKPIV_OK);
+  for(int i = 0; i < 4; i++) {
+    ck_assert_uint_eq(out_len[i], expected_len);
+    ck_assert_mem_eq(signature[i], expected, expected_len);
+  }
+
+  // A bad key fails the first signature and reports none
+  for(int i = 0; i < 4; i++) {
+    out_len[i] = sizeof(signature[i]);
+  }
+  res = ykpiv_sign_data_batch(g_state, 0x9d, YKPIV_ALGO_RSA4096, in, in_len, 4, out, out_len);
+  ck_assert_int_ne(res, YKPIV_OK);
+  for(int i = 0; i < 4; i++) {
+    ck_assert_uint_eq(out_len[i], 0);
+  }
+}
+END_TEST
+
 START_TEST(test_pin_policy_always) {
   ykpiv_rc res;
 
@@ -1095,8 +1369,13 @@ static Suite *test_suite(void) {
   tcase_add_test(tc, test_devicemodel);
   tcase_add_test(tc, test_get_set_cardid);
   tcase_add_test(tc, test_list_readers);
+  tcase_add_test(tc, test_batch);
+  tcase_add_test(tc, test_stats);
   tcase_add_test(tc, test_read_write_list_delete_cert);
   tcase_add_test(tc, test_import_key);
+  tcase_add_test(tc, test_pool);
+  tcase_add_test(tc, test_sign_async);
+  tcase_add_test(tc, test_sign_batch);
   tcase_add_test(tc, test_pin_policy_always);
   tcase_add_test(tc, test_generate_key);
   tcase_add_test(tc, test_pin_cache);
@@ -30,6 +30,7 @@
 
 #include "ykpiv.h"
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -70,6 +71,73 @@ START_TEST(test_strerror) {
 }
 END_TEST
 
+START_TEST(test_certdata_auto) {
+  uint8_t cert[2000];
+  uint8_t certdata[YKPIV_OBJ_MAX_SIZE] = {0};
+  size_t certdata_len = sizeof(certdata);
+  uint8_t out[sizeof(cert)] = {0};
+  size_t out_len = sizeof(out);
+
+  for (size_t i = 0; i < sizeof(cert); i++) {
+    cert[i] = (uint8_t)(i % 16);
+  }
+
+  ck_assert_int_eq(ykpiv_util_write_certdata(cert, sizeof(cert), YKPIV_CERTINFO_AUTO, certdata, &certdata_len), YKPIV_OK);
+#ifdef USE_CERT_COMPRESS
+  ck_assert_int_lt(certdata_len, sizeof(cert));
+#else
+  ck_assert_int_gt(certdata_len, sizeof(cert));
+#endif
+  ck_assert_int_eq(ykpiv_util_get_certdata(certdata, certdata_len, out, &out_len), YKPIV_OK);
+  ck_assert_int_eq(out_len, sizeof(cert));
+  ck_assert_mem_eq(out, cert, sizeof(cert));
+
+  // Small certificates don't get compressed
+  certdata_len = sizeof(certdata);
+  ck_assert_int_eq(ykpiv_util_write_certdata(cert, 100, YKPIV_CERTINFO_AUTO, certdata, &certdata_len), YKPIV_OK);
+  ck_assert_int_eq(certdata_len, 1 + 1 + 100 + 3 + 2);
+}
+END_TEST
+
+static size_t trace_lines;
+static bool trace_found;
+
+static void trace_out(const char *line) {
+  trace_lines++;
+  if (strstr(line, "Found TAG_CERT with length %zu")) {
+    trace_found = true;
+  }
+}
+
+START_TEST(test_trace) {
+  uint8_t cert[100] = {0x30};
+  uint8_t certdata[YKPIV_OBJ_MAX_SIZE] = {0};
+  size_t certdata_len = sizeof(certdata);
+  uint8_t out[sizeof(cert)] = {0};
+  size_t out_len = sizeof(out);
+
+  ck_assert_int_eq(ykpiv_trace_enable(16), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_util_write_certdata(cert, sizeof(cert), YKPIV_CERTINFO_UNCOMPRESSED, certdata, &certdata_len), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_util_get_certdata(certdata, certdata_len, out, &out_len), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_trace_enable(0), YKPIV_OK);
+
+  // Messages are recorded regardless of verbosity, and not formatted
+  ck_assert_int_eq(ykpiv_trace_dump(trace_out), YKPIV_OK);
+  ck_assert(trace_found);
+  ck_assert_int_le(trace_lines, 16);
+}
+END_TEST
+
+START_TEST(test_reader_matches) {
+  ck_assert(ykpiv_reader_matches("Yubico YubiKey OTP+FIDO+CCID 00 00", "yubikey"));
+  ck_assert(ykpiv_reader_matches("Yubico YubiKey OTP+FIDO+CCID 00 00", "CCID 00 00"));
+  ck_assert(!ykpiv_reader_matches("Yubico YubiKey OTP+FIDO+CCID 00 00", "CCID 00 01"));
+  ck_assert(!ykpiv_reader_matches("Yubico", "Yubico YubiKey"));
+  ck_assert(ykpiv_reader_matches("Other Reader", "*"));
+  ck_assert(ykpiv_reader_matches("Other Reader", NULL));
+}
+END_TEST
+
 static Suite *basic_suite(void) {
   Suite *s;
   TCase *tc;
@@ -78,6 +146,9 @@ static Suite *basic_suite(void) {
   tc = tcase_create("basic");
   tcase_add_test(tc, test_version_string);
   tcase_add_test(tc, test_strerror);
+  tcase_add_test(tc, test_certdata_auto);
+  tcase_add_test(tc, test_trace);
+  tcase_add_test(tc, test_reader_matches);
   suite_add_tcase(s, tc);
 
   return s;
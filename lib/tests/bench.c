@@ -0,0 +1,356 @@
+/*
+ * Copyright (c) 2025 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+// Benchmark of a YubiKey through libykpiv, printed as JSON. Overwrites the key in slot 82
+// and the object of that slot, run it against a token set aside for testing. With --virtual it runs
+// against the software card of the tests instead, which measures the overhead of the library itself.
+
+#include "ykpiv.h"
+#include "virtual_card.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#define BENCH_SLOT YKPIV_KEY_RETIRED1
+#define BENCH_OBJECT YKPIV_OBJ_RETIRED1
+#define BENCH_DEFAULT_RUNS 20
+#define BENCH_DEFAULT_PIN "123456"
+#define BENCH_DEFAULT_KEY "010203040506070801020304050607080102030405060708"
+
+typedef struct {
+  const char *pin;
+  unsigned char mgm_key[32];
+  size_t mgm_len;
+  size_t runs;
+  double *samples;
+  const char *transport;
+  bool first;
+} bench_ctx;
+
+typedef ykpiv_rc (*bench_fn)(ykpiv_state *state, void *arg);
+
+static const struct {
+  const char *name;
+  uint8_t algorithm;
+  size_t in_len; // Input that is signed, and deciphered for RSA
+} algorithms[] = {
+  {"RSA1024", YKPIV_ALGO_RSA1024, 128},
+  {"RSA2048", YKPIV_ALGO_RSA2048, 256},
+  {"RSA3072", YKPIV_ALGO_RSA3072, 384},
+  {"RSA4096", YKPIV_ALGO_RSA4096, 512},
+  {"ECCP256", YKPIV_ALGO_ECCP256, 32},
+  {"ECCP384", YKPIV_ALGO_ECCP384, 48},
+  {"ED25519", YKPIV_ALGO_ED25519, 64},
+  {"X25519", YKPIV_ALGO_X25519, 0},
+};
+
+static const size_t object_sizes[] = {16, 256, 1024, 2048, 3000};
+
+static double now_ms(void) {
+#ifdef _WIN32
+  LARGE_INTEGER freq, now;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (double)now.QuadPart * 1000.0 / (double)freq.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+#endif
+}
+
+static int compare_samples(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *sorted, size_t n, size_t p) {
+  size_t i = (n * p + 99) / 100;
+  return sorted[i ? i - 1 : 0];
+}
+
+// Times runs of fn and prints one result, skipped if the first run fails
+static void bench(ykpiv_state *state, bench_ctx *ctx, const char *op, const char *algorithm, size_t size,
+                  bench_fn fn, void *arg) {
+  ykpiv_stats stats;
+  uint64_t total_us = 0, transmit_us = 0;
+  double total = 0;
+  ykpiv_rc rc = YKPIV_OK;
+
+  ykpiv_get_stats(state, &stats, true);
+  for (size_t i = 0; i < ctx->runs; i++) {
+    double start = now_ms();
+    if ((rc = fn(state, arg)) != YKPIV_OK) {
+      break;
+    }
+    ctx->samples[i] = now_ms() - start;
+    total += ctx->samples[i];
+  }
+  ykpiv_get_stats(state, &stats, false);
+  for (size_t i = 0; i < stats.n_ins; i++) {
+    total_us += stats.ins[i].total_us;
+    transmit_us += stats.ins[i].transmit_us;
+  }
+
+  printf("%s\n    {\"operation\": \"%s\", \"transport\": \"%s\"", ctx->first ? "" : ",", op, ctx->transport);
+  ctx->first = false;
+  if (algorithm) {
+    printf(", \"algorithm\": \"%s\"", algorithm);
+  }
+  if (size) {
+    printf(", \"size\": %zu", size);
+  }
+  if (rc != YKPIV_OK) {
+    fprintf(stderr, "%s %s failed: %s\n", op, algorithm ? algorithm : "", ykpiv_strerror(rc));
+    printf(", \"error\": \"%s\"}", ykpiv_strerror(rc));
+    return;
+  }
+  qsort(ctx->samples, ctx->runs, sizeof(double), compare_samples);
+  printf(", \"runs\": %zu, \"ops_per_sec\": %.2f, \"p50_ms\": %.3f, \"p99_ms\": %.3f, \"transmit_share\": %.3f}",
+         ctx->runs, total > 0 ? ctx->runs * 1000.0 / total : 0, percentile(ctx->samples, ctx->runs, 50),
+         percentile(ctx->samples, ctx->runs, 99), total_us ? (double)transmit_us / (double)total_us : 0);
+}
+
+typedef struct {
+  uint8_t algorithm;
+  unsigned char in[512];
+  size_t in_len;
+} crypto_arg;
+
+static ykpiv_rc bench_sign(ykpiv_state *state, void *arg) {
+  crypto_arg *a = arg;
+  unsigned char out[1024];
+  size_t out_len = sizeof(out);
+  return ykpiv_sign_data(state, a->in, a->in_len, out, &out_len, a->algorithm, BENCH_SLOT);
+}
+
+static ykpiv_rc bench_decipher(ykpiv_state *state, void *arg) {
+  crypto_arg *a = arg;
+  unsigned char out[1024];
+  size_t out_len = sizeof(out);
+  return ykpiv_decipher_data(state, a->in, a->in_len, out, &out_len, a->algorithm, BENCH_SLOT);
+}
+
+typedef struct {
+  unsigned char data[3072];
+  size_t len;
+} object_arg;
+
+static ykpiv_rc bench_save(ykpiv_state *state, void *arg) {
+  object_arg *a = arg;
+  return ykpiv_save_object(state, BENCH_OBJECT, a->data, a->len);
+}
+
+static ykpiv_rc bench_fetch(ykpiv_state *state, void *arg) {
+  object_arg *a = arg;
+  unsigned char data[3072];
+  unsigned long len = sizeof(data);
+  ykpiv_rc rc = ykpiv_fetch_object(state, BENCH_OBJECT, data, &len);
+  return rc == YKPIV_OK && len != a->len ? YKPIV_GENERIC_ERROR : rc;
+}
+
+static ykpiv_rc bench_verify(ykpiv_state *state, void *arg) {
+  const char *pin = arg;
+  return ykpiv_verify(state, pin, NULL);
+}
+
+static bool bench_connect(ykpiv_state *state, bench_ctx *ctx, const char *reader, bool scp11,
+                          const ykpiv_transport *transport) {
+  ykpiv_rc rc;
+  ykpiv_disconnect(state);
+  if (transport) {
+    rc = ykpiv_connect_with_transport(state, transport);
+  } else {
+    rc = ykpiv_connect_ex(state, reader, scp11);
+  }
+  if (rc != YKPIV_OK) {
+    fprintf(stderr, "Failed to connect%s: %s\n", scp11 ? " with SCP11" : "", ykpiv_strerror(rc));
+    return false;
+  }
+  if ((rc = ykpiv_authenticate2(state, ctx->mgm_key, ctx->mgm_len)) != YKPIV_OK) {
+    fprintf(stderr, "Failed to authenticate: %s\n", ykpiv_strerror(rc));
+    return false;
+  }
+  if ((rc = ykpiv_verify(state, ctx->pin, NULL)) != YKPIV_OK) {
+    fprintf(stderr, "Failed to verify the PIN: %s\n", ykpiv_strerror(rc));
+    return false;
+  }
+  ctx->transport = transport ? "virtual" : scp11 ? "scp11" : "plaintext";
+  return true;
+}
+
+static void bench_algorithms(ykpiv_state *state, bench_ctx *ctx, bool all) {
+  for (size_t i = 0; i < sizeof(algorithms) / sizeof(algorithms[0]); i++) {
+    crypto_arg arg = {algorithms[i].algorithm, {0}, algorithms[i].in_len};
+    uint8_t *mod = NULL, *exp = NULL, *point = NULL;
+    size_t mod_len = 0, exp_len = 0, point_len = 0;
+
+    // Over SCP11 only compare one algorithm of each kind
+    if (!all && arg.algorithm != YKPIV_ALGO_RSA2048 && arg.algorithm != YKPIV_ALGO_ECCP256) {
+      continue;
+    }
+    ykpiv_rc rc = ykpiv_util_generate_key(state, BENCH_SLOT, arg.algorithm, YKPIV_PINPOLICY_NEVER,
+                                          YKPIV_TOUCHPOLICY_NEVER, &mod, &mod_len, &exp, &exp_len,
+                                          &point, &point_len);
+    if (rc != YKPIV_OK) {
+      fprintf(stderr, "Skipping %s: %s\n", algorithms[i].name, ykpiv_strerror(rc));
+      continue;
+    }
+
+    memset(arg.in, 0x5a, arg.in_len);
+    if (YKPIV_IS_RSA(arg.algorithm)) {
+      arg.in[0] = 0; // Anything below the modulus can be signed and deciphered as raw RSA
+    }
+    if (arg.algorithm != YKPIV_ALGO_X25519) {
+      bench(state, ctx, "sign", algorithms[i].name, 0, bench_sign, &arg);
+    }
+    if (YKPIV_IS_EC(arg.algorithm) || arg.algorithm == YKPIV_ALGO_X25519) {
+      // Key agreement with the public key of the slot itself
+      if (point && point_len <= sizeof(arg.in)) {
+        memcpy(arg.in, point, point_len);
+        arg.in_len = point_len;
+        bench(state, ctx, "decipher", algorithms[i].name, 0, bench_decipher, &arg);
+      }
+    } else if (YKPIV_IS_RSA(arg.algorithm)) {
+      bench(state, ctx, "decipher", algorithms[i].name, 0, bench_decipher, &arg);
+    }
+    ykpiv_util_free(state, mod);
+    ykpiv_util_free(state, exp);
+    ykpiv_util_free(state, point);
+  }
+}
+
+static void bench_objects(ykpiv_state *state, bench_ctx *ctx) {
+  object_arg arg;
+  for (size_t i = 0; i < sizeof(object_sizes) / sizeof(object_sizes[0]); i++) {
+    arg.len = object_sizes[i];
+    memset(arg.data, 0x5a, arg.len);
+    bench(state, ctx, "save_object", NULL, arg.len, bench_save, &arg);
+    bench(state, ctx, "fetch_object", NULL, arg.len, bench_fetch, &arg);
+  }
+  ykpiv_save_object(state, BENCH_OBJECT, NULL, 0);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-r reader] [-n runs] [-p pin] [-k management key] [--no-scp11] [--virtual]\n", name);
+  fprintf(stderr, "Overwrites the key in slot 82, set YKPIV_ENV_HWTESTS_CONFIRMED=1 to run without --virtual.\n");
+}
+
+int main(int argc, char *argv[]) {
+  bench_ctx ctx = {BENCH_DEFAULT_PIN, {0}, sizeof(ctx.mgm_key), BENCH_DEFAULT_RUNS, NULL, "plaintext", true};
+  const char *reader = NULL;
+  const char *key = BENCH_DEFAULT_KEY;
+  bool scp11 = true;
+  virtual_card *card = NULL;
+  ykpiv_transport transport;
+  ykpiv_state *state = NULL;
+  char version[32] = {0};
+  uint32_t serial = 0;
+  int ret = EXIT_FAILURE;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--no-scp11")) {
+      scp11 = false;
+    } else if (!strcmp(argv[i], "--virtual") && !card) {
+      if (!(card = virtual_card_new(1))) {
+        return EXIT_FAILURE;
+      }
+      virtual_card_transport(card, &transport);
+      scp11 = false; // Not implemented by the virtual card
+    } else if (i + 1 < argc && !strcmp(argv[i], "-r")) {
+      reader = argv[++i];
+    } else if (i + 1 < argc && !strcmp(argv[i], "-n")) {
+      ctx.runs = strtoul(argv[++i], NULL, 10);
+    } else if (i + 1 < argc && !strcmp(argv[i], "-p")) {
+      ctx.pin = argv[++i];
+    } else if (i + 1 < argc && !strcmp(argv[i], "-k")) {
+      key = argv[++i];
+    } else {
+      usage(argv[0]);
+      goto out;
+    }
+  }
+  const char *confirmed = getenv("YKPIV_ENV_HWTESTS_CONFIRMED");
+  if (!card && (!confirmed || confirmed[0] != '1')) {
+    usage(argv[0]);
+    return 77; // Skipped, as for the hardware tests
+  }
+  if (ctx.runs == 0 || ykpiv_hex_decode(key, strlen(key), ctx.mgm_key, &ctx.mgm_len) != YKPIV_OK) {
+    usage(argv[0]);
+    goto out;
+  }
+  if (!(ctx.samples = calloc(ctx.runs, sizeof(double)))) {
+    goto out;
+  }
+
+  if (ykpiv_init(&state, false) != YKPIV_OK || !bench_connect(state, &ctx, reader, false, card ? &transport : NULL)) {
+    goto out;
+  }
+  ykpiv_get_version(state, version, sizeof(version));
+  ykpiv_get_serial(state, &serial);
+
+  printf("{\n  \"version\": \"%s\",\n  \"serial\": %u,\n", version, serial);
+  if (reader) {
+    printf("  \"reader\": \"%s\",\n", reader);
+  }
+  printf("  \"results\": [");
+
+  bench(state, &ctx, "verify", NULL, 0, bench_verify, (void *)ctx.pin);
+  bench_algorithms(state, &ctx, true);
+  bench_objects(state, &ctx);
+
+  if (scp11) {
+    if (bench_connect(state, &ctx, reader, true, NULL)) {
+      bench(state, &ctx, "verify", NULL, 0, bench_verify, (void *)ctx.pin);
+      bench_algorithms(state, &ctx, false);
+      bench_objects(state, &ctx);
+    } else {
+      fprintf(stderr, "Skipping SCP11, it requires firmware 5.7 or later\n");
+    }
+  }
+  printf("\n  ]\n}\n");
+  ret = EXIT_SUCCESS;
+
+out:
+  if (state) {
+    ykpiv_disconnect(state);
+    ykpiv_done(state);
+  }
+  free(ctx.samples);
+  virtual_card_free(card);
+  return ret;
+}
@@ -0,0 +1,674 @@
+/*
+ * Copyright (c) 2025 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "ykpiv.h"
+#include "virtual_card.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/sha.h>
+#include <openssl/x509.h>
+
+#include <check.h>
+
+#ifndef _WIN32
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#endif
+
+static virtual_card *g_card;
+static ykpiv_state *g_state;
+
+static void setup(void) {
+  ykpiv_transport transport;
+  g_card = virtual_card_new(12345678);
+  ck_assert_ptr_nonnull(g_card);
+  ck_assert_int_eq(ykpiv_init(&g_state, getenv("YKPIV_TEST_VERBOSE") ? 1 : 0), YKPIV_OK);
+  virtual_card_transport(g_card, &transport);
+  ck_assert_int_eq(ykpiv_connect_with_transport(g_state, &transport), YKPIV_OK);
+}
+
+static void teardown(void) {
+  ck_assert_int_eq(ykpiv_done(g_state), YKPIV_OK);
+  virtual_card_free(g_card);
+}
+
+START_TEST(test_connect) {
+  char version[16];
+  uint32_t serial = 0;
+
+  ck_assert_int_eq(ykpiv_get_version(g_state, version, sizeof(version)), YKPIV_OK);
+  ck_assert_str_eq(version, "5.7.2");
+  ck_assert_int_eq(ykpiv_get_serial(g_state, &serial), YKPIV_OK);
+  ck_assert_uint_eq(serial, 12345678);
+  ck_assert_int_eq(ykpiv_util_devicemodel(g_state), DEVTYPE_YK5);
+}
+END_TEST
+
+START_TEST(test_device_info) {
+  ykpiv_device_info info;
+  ykpiv_stats stats;
+
+  // Everything was read when connecting
+  ck_assert_int_eq(ykpiv_get_stats(g_state, &stats, true), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_get_device_info(g_state, &info), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_get_stats(g_state, &stats, false), YKPIV_OK);
+  ck_assert_uint_eq(stats.transactions, 0);
+  ck_assert_uint_eq(stats.n_ins, 0);
+  ck_assert_uint_eq(info.model, DEVTYPE_YK5);
+  ck_assert_uint_eq(info.major, 5);
+  ck_assert_uint_eq(info.minor, 7);
+  ck_assert_uint_eq(info.patch, 2);
+  ck_assert_uint_eq(info.serial, 12345678);
+  ck_assert_int_eq(ykpiv_get_device_info(g_state, NULL), YKPIV_ARGUMENT_ERROR);
+}
+END_TEST
+
+START_TEST(test_verify) {
+  int tries = 0;
+
+  ck_assert_int_eq(ykpiv_verify(g_state, "654321", &tries), YKPIV_WRONG_PIN);
+  ck_assert_int_eq(tries, 2);
+  ck_assert_int_eq(ykpiv_verify(g_state, "123456", &tries), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_get_pin_retries(g_state, &tries), YKPIV_OK);
+  ck_assert_int_eq(tries, 3);
+  ck_assert_int_eq(ykpiv_change_pin(g_state, "123456", 6, "abcdef", 6, &tries), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_verify(g_state, "abcdef", &tries), YKPIV_OK);
+}
+END_TEST
+
+START_TEST(test_cached_retries) {
+  int tries = 0;
+  ykpiv_stats stats;
+
+  ck_assert_int_eq(ykpiv_change_pin(g_state, "654321", 6, "abcdef", 6, &tries), YKPIV_WRONG_PIN);
+  ck_assert_int_eq(tries, 2);
+
+  // Served from the response to the change, without using the card
+  ck_assert_int_eq(ykpiv_get_stats(g_state, &stats, true), YKPIV_OK);
+  tries = YKPIV_RETRIES_MAX;
+  ck_assert_int_eq(ykpiv_get_pin_retries(g_state, &tries), YKPIV_OK);
+  ck_assert_int_eq(tries, 2);
+  ck_assert_int_eq(ykpiv_get_stats(g_state, &stats, false), YKPIV_OK);
+  ck_assert_uint_eq(stats.transactions, 0);
+
+  ck_assert_int_eq(ykpiv_unblock_pin(g_state, "12345678", 8, "abcdef", 6, &tries), YKPIV_OK);
+  tries = YKPIV_RETRIES_MAX;
+  ck_assert_int_eq(ykpiv_get_pin_retries(g_state, &tries), YKPIV_OK);
+  ck_assert_int_lt(tries, 0);
+
+  // The next check of the application selection queries the counter again
+  ck_assert_int_eq(ykpiv_change_pin(g_state, "abcdef", 6, "123456", 6, &tries), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_verify_select(g_state, NULL, 0, &tries, true), YKPIV_WRONG_PIN);
+  ck_assert_int_eq(tries, 3);
+  tries = YKPIV_RETRIES_MAX;
+  ck_assert_int_eq(ykpiv_get_pin_retries(g_state, &tries), YKPIV_OK);
+  ck_assert_int_eq(tries, 3);
+}
+END_TEST
+
+START_TEST(test_generate_sign) {
+  uint8_t *point = NULL;
+  size_t point_len = 0;
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  unsigned char sig[256];
+  size_t sig_len = sizeof(sig);
+
+  // Generating requires the management key
+  ck_assert_int_ne(ykpiv_util_generate_key(g_state, YKPIV_KEY_AUTHENTICATION, YKPIV_ALGO_ECCP256,
+                                           YKPIV_PINPOLICY_DEFAULT, YKPIV_TOUCHPOLICY_DEFAULT, NULL, NULL, NULL, NULL,
+                                           &point, &point_len), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_authenticate2(g_state, NULL, 0), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_util_generate_key(g_state, YKPIV_KEY_AUTHENTICATION, YKPIV_ALGO_ECCP256,
+                                           YKPIV_PINPOLICY_DEFAULT, YKPIV_TOUCHPOLICY_DEFAULT, NULL, NULL, NULL, NULL,
+                                           &point, &point_len), YKPIV_OK);
+  ck_assert_uint_eq(point_len, 65);
+
+  SHA256((const unsigned char *)"virtual", 7, digest);
+  ck_assert_int_eq(ykpiv_sign_data(g_state, digest, sizeof(digest), sig, &sig_len, YKPIV_ALGO_ECCP256,
+                                   YKPIV_KEY_AUTHENTICATION), YKPIV_AUTHENTICATION_ERROR);
+  ck_assert_int_eq(ykpiv_verify(g_state, "123456", NULL), YKPIV_OK);
+  sig_len = sizeof(sig);
+  ck_assert_int_eq(ykpiv_sign_data(g_state, digest, sizeof(digest), sig, &sig_len, YKPIV_ALGO_ECCP256,
+                                   YKPIV_KEY_AUTHENTICATION), YKPIV_OK);
+
+  EC_KEY *ec = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+  EC_POINT *pub = EC_POINT_new(EC_KEY_get0_group(ec));
+  const unsigned char *p = sig;
+  ECDSA_SIG *ecdsa = d2i_ECDSA_SIG(NULL, &p, (long)sig_len);
+  ck_assert_ptr_nonnull(ecdsa);
+  ck_assert_int_eq(EC_POINT_oct2point(EC_KEY_get0_group(ec), pub, point, point_len, NULL), 1);
+  ck_assert_int_eq(EC_KEY_set_public_key(ec, pub), 1);
+  ck_assert_int_eq(ECDSA_do_verify(digest, sizeof(digest), ecdsa, ec), 1);
+  ECDSA_SIG_free(ecdsa);
+  EC_POINT_free(pub);
+  EC_KEY_free(ec);
+  ykpiv_util_free(g_state, point);
+}
+END_TEST
+
+START_TEST(test_sign_with_pin) {
+  uint8_t *point = NULL;
+  size_t point_len = 0;
+  unsigned char digest[SHA256_DIGEST_LENGTH] = {0};
+  unsigned char sig[256];
+  size_t sig_len = sizeof(sig);
+  ykpiv_stats stats;
+  int tries = 0;
+
+  // The signature key has PIN policy always
+  ck_assert_int_eq(ykpiv_authenticate2(g_state, NULL, 0), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_util_generate_key(g_state, YKPIV_KEY_SIGNATURE, YKPIV_ALGO_ECCP256,
+                                           YKPIV_PINPOLICY_DEFAULT, YKPIV_TOUCHPOLICY_DEFAULT, NULL, NULL, NULL, NULL,
+                                           &point, &point_len), YKPIV_OK);
+  ykpiv_util_free(g_state, point);
+  ck_assert_int_eq(ykpiv_verify(g_state, "123456", NULL), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_sign_data(g_state, digest, sizeof(digest), sig, &sig_len, YKPIV_ALGO_ECCP256,
+                                   YKPIV_KEY_SIGNATURE), YKPIV_OK);
+  sig_len = sizeof(sig);
+  ck_assert_int_eq(ykpiv_sign_data(g_state, digest, sizeof(digest), sig, &sig_len, YKPIV_ALGO_ECCP256,
+                                   YKPIV_KEY_SIGNATURE), YKPIV_AUTHENTICATION_ERROR);
+
+  sig_len = sizeof(sig);
+  ck_assert_int_eq(ykpiv_sign_data_with_pin(g_state, "654321", 6, digest, sizeof(digest), sig, &sig_len,
+                                            YKPIV_ALGO_ECCP256, YKPIV_KEY_SIGNATURE, &tries), YKPIV_WRONG_PIN);
+  ck_assert_int_eq(tries, 2);
+
+  ck_assert_int_eq(ykpiv_get_stats(g_state, &stats, true), YKPIV_OK);
+  for (int i = 0; i < 2; i++) {
+    sig_len = sizeof(sig);
+    ck_assert_int_eq(ykpiv_sign_data_with_pin(g_state, "123456xx", 6, digest, sizeof(digest), sig, &sig_len,
+                                              YKPIV_ALGO_ECCP256, YKPIV_KEY_SIGNATURE, &tries), YKPIV_OK);
+    ck_assert_uint_gt(sig_len, 0);
+  }
+  // One transaction per signature
+  ck_assert_int_eq(ykpiv_get_stats(g_state, &stats, false), YKPIV_OK);
+  ck_assert_uint_eq(stats.transactions, 2);
+}
+END_TEST
+
+START_TEST(test_metadata_attest) {
+  unsigned char data[2048];
+  size_t data_len = sizeof(data);
+  ykpiv_metadata metadata = {0};
+  uint8_t *mod = NULL, *exp = NULL;
+  size_t mod_len = 0, exp_len = 0;
+
+  ck_assert_int_eq(ykpiv_get_metadata(g_state, YKPIV_KEY_SIGNATURE, data, &data_len), YKPIV_KEY_ERROR);
+  ck_assert_int_eq(ykpiv_authenticate2(g_state, NULL, 0), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_util_generate_key(g_state, YKPIV_KEY_SIGNATURE, YKPIV_ALGO_RSA2048, YKPIV_PINPOLICY_DEFAULT,
+                                           YKPIV_TOUCHPOLICY_DEFAULT, &mod, &mod_len, &exp, &exp_len, NULL, NULL),
+                   YKPIV_OK);
+  ck_assert_uint_eq(mod_len, 256);
+
+  data_len = sizeof(data);
+  ck_assert_int_eq(ykpiv_get_metadata(g_state, YKPIV_KEY_SIGNATURE, data, &data_len), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_util_parse_metadata(data, data_len, &metadata), YKPIV_OK);
+  ck_assert_uint_eq(metadata.algorithm, YKPIV_ALGO_RSA2048);
+  ck_assert_uint_eq(metadata.pin_policy, YKPIV_PINPOLICY_ALWAYS);
+  ck_assert_uint_eq(metadata.origin, YKPIV_METADATA_ORIGIN_GENERATED);
+
+  data_len = sizeof(data);
+  ck_assert_int_eq(ykpiv_attest(g_state, YKPIV_KEY_SIGNATURE, data, &data_len), YKPIV_OK);
+  const unsigned char *p = data;
+  X509 *x509 = d2i_X509(NULL, &p, (long)data_len);
+  ck_assert_ptr_nonnull(x509);
+  const BIGNUM *n = NULL;
+  RSA_get0_key(EVP_PKEY_get0_RSA(X509_get0_pubkey(x509)), &n, NULL, NULL);
+  BIGNUM *expected = BN_bin2bn(mod, (int)mod_len, NULL);
+  ck_assert_int_eq(BN_cmp(n, expected), 0);
+  BN_free(expected);
+  X509_free(x509);
+  ykpiv_util_free(g_state, mod);
+  ykpiv_util_free(g_state, exp);
+}
+END_TEST
+
+START_TEST(test_objects) {
+  unsigned char data[3000], read[3072];
+  unsigned long read_len = sizeof(read);
+
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (unsigned char)i;
+  }
+  ck_assert_int_eq(ykpiv_save_object(g_state, YKPIV_OBJ_RETIRED1, data, sizeof(data)), YKPIV_AUTHENTICATION_ERROR);
+  ck_assert_int_eq(ykpiv_authenticate2(g_state, NULL, 0), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_save_object(g_state, YKPIV_OBJ_RETIRED1, data, sizeof(data)), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_fetch_object(g_state, YKPIV_OBJ_RETIRED1, read, &read_len), YKPIV_OK);
+  ck_assert_uint_eq(read_len, sizeof(data));
+  ck_assert_mem_eq(read, data, sizeof(data));
+
+  ck_assert_int_eq(ykpiv_save_object(g_state, YKPIV_OBJ_RETIRED1, NULL, 0), YKPIV_OK);
+  read_len = sizeof(read);
+  ck_assert_int_eq(ykpiv_fetch_object(g_state, YKPIV_OBJ_RETIRED1, read, &read_len), YKPIV_INVALID_OBJECT);
+}
+END_TEST
+
+START_TEST(test_util_objects) {
+  ykpiv_cardid set_id = {{0}}, get_id = {{0}};
+  ykpiv_container containers[3] = {{{0}}}, *read_containers = NULL;
+  size_t n_containers = 0;
+  unsigned char cert[1500];
+  uint8_t *read_cert = NULL;
+  size_t read_len = 0;
+
+  ck_assert_int_eq(ykpiv_authenticate2(g_state, NULL, 0), YKPIV_OK);
+
+  for (size_t i = 0; i < sizeof(set_id.data); i++) {
+    set_id.data[i] = (uint8_t)(0xa0 + i);
+  }
+  ck_assert_int_eq(ykpiv_util_set_cardid(g_state, &set_id), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_util_get_cardid(g_state, &get_id), YKPIV_OK);
+  ck_assert_mem_eq(get_id.data, set_id.data, sizeof(set_id.data));
+
+  for (size_t i = 0; i < 3; i++) {
+    containers[i].slot = (uint8_t)(YKPIV_KEY_RETIRED1 + i);
+    containers[i].key_spec = 2;
+  }
+  ck_assert_int_eq(ykpiv_util_write_mscmap(g_state, containers, 3), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_util_read_mscmap(g_state, &read_containers, &n_containers), YKPIV_OK);
+  ck_assert_uint_eq(n_containers, 3);
+  ck_assert_mem_eq(read_containers, containers, sizeof(containers));
+  ykpiv_util_free(g_state, read_containers);
+
+  // Not a certificate, but stored and read back with the same TLV encoding
+  for (size_t i = 0; i < sizeof(cert); i++) {
+    cert[i] = (unsigned char)(i * 7);
+  }
+  ck_assert_int_eq(ykpiv_util_write_cert(g_state, YKPIV_KEY_AUTHENTICATION, cert, sizeof(cert),
+                                         YKPIV_CERTINFO_UNCOMPRESSED), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_util_read_cert(g_state, YKPIV_KEY_AUTHENTICATION, &read_cert, &read_len), YKPIV_OK);
+  ck_assert_uint_eq(read_len, sizeof(cert));
+  ck_assert_mem_eq(read_cert, cert, sizeof(cert));
+  ykpiv_util_free(g_state, read_cert);
+}
+END_TEST
+
+typedef struct {
+  unsigned char data[8192];
+  size_t len;
+  size_t chunks;
+} stream_sink;
+
+static ykpiv_rc collect_chunk(void *chunk_data, const unsigned char *data, size_t len) {
+  stream_sink *sink = (stream_sink *) chunk_data;
+  ck_assert_uint_le(sink->len + len, sizeof(sink->data));
+  memcpy(sink->data + sink->len, data, len);
+  sink->len += len;
+  sink->chunks++;
+  return YKPIV_OK;
+}
+
+START_TEST(test_stream) {
+  static unsigned char data[6000];
+  static stream_sink sink;
+  uint8_t *roots = NULL;
+  size_t roots_len = 0;
+
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (unsigned char)(i * 13);
+  }
+  ck_assert_int_eq(ykpiv_authenticate2(g_state, NULL, 0), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_save_object(g_state, YKPIV_OBJ_RETIRED1, data, 3000), YKPIV_OK);
+
+  memset(&sink, 0, sizeof(sink));
+  ck_assert_int_eq(ykpiv_fetch_object_stream(g_state, YKPIV_OBJ_RETIRED1, collect_chunk, &sink), YKPIV_OK);
+  ck_assert_uint_eq(sink.len, 3000);
+  ck_assert_mem_eq(sink.data, data, 3000);
+  ck_assert_int_eq(ykpiv_fetch_object_stream(g_state, YKPIV_OBJ_RETIRED2, collect_chunk, &sink), YKPIV_INVALID_OBJECT);
+
+  // Spread over several objects
+  ck_assert_int_eq(ykpiv_util_write_msroots(g_state, data, sizeof(data)), YKPIV_OK);
+  memset(&sink, 0, sizeof(sink));
+  ck_assert_int_eq(ykpiv_util_read_msroots_cb(g_state, collect_chunk, &sink), YKPIV_OK);
+  ck_assert_uint_eq(sink.len, sizeof(data));
+  ck_assert_mem_eq(sink.data, data, sizeof(data));
+  ck_assert_uint_ge(sink.chunks, 2);
+
+  ck_assert_int_eq(ykpiv_util_read_msroots(g_state, &roots, &roots_len), YKPIV_OK);
+  ck_assert_uint_eq(roots_len, sizeof(data));
+  ck_assert_mem_eq(roots, data, sizeof(data));
+  ykpiv_util_free(g_state, roots);
+}
+END_TEST
+
+#ifndef _WIN32
+START_TEST(test_broker) {
+  char path[64], reader[80], exact[81];
+  ykpiv_state *clients[2] = {NULL, NULL};
+  ykpiv_device_info info;
+  struct stat st;
+  unsigned char data[2000], read[2100];
+  unsigned long read_len;
+  int status = 0;
+
+  snprintf(path, sizeof(path), "/tmp/ykpiv-test-%d.sock", (int)getpid());
+  snprintf(reader, sizeof(reader), "%s%s", YKPIV_BROKER_READER_PREFIX, path);
+  snprintf(exact, sizeof(exact), "@%s", reader);
+  pid_t pid = fork();
+  ck_assert_int_ge(pid, 0);
+  if (pid == 0) {
+    _exit(ykpiv_broker_serve(g_state, path, NULL) == YKPIV_OK ? 0 : 1);
+  }
+
+  for (size_t i = 0; i < 2; i++) {
+    ck_assert_int_eq(ykpiv_init(&clients[i], getenv("YKPIV_TEST_VERBOSE") ? 1 : 0), YKPIV_OK);
+    ykpiv_rc rc = YKPIV_PCSC_ERROR;
+    for (int tries = 0; tries < 200 && rc == YKPIV_PCSC_ERROR; tries++) {
+      // As ykcs11 connects, with the '@' to only match the exact name
+      if ((rc = ykpiv_connect(clients[i], i ? exact : reader)) == YKPIV_PCSC_ERROR) {
+        usleep(10000);
+      }
+    }
+    ck_assert_int_eq(rc, YKPIV_OK);
+    ck_assert_int_eq(ykpiv_get_device_info(clients[i], &info), YKPIV_OK);
+    ck_assert_uint_eq(info.serial, 12345678);
+    ck_assert_int_eq(ykpiv_validate(clients[i], reader), YKPIV_OK);
+  }
+  ck_assert_int_eq(stat(path, &st), 0);
+  ck_assert_int_eq(st.st_mode & 0777, 0600);
+
+  // Both clients see the same card
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (unsigned char)(i * 7);
+  }
+  ck_assert_int_eq(ykpiv_authenticate2(clients[0], NULL, 0), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_save_object(clients[0], YKPIV_OBJ_RETIRED3, data, sizeof(data)), YKPIV_OK);
+  read_len = sizeof(read);
+  ck_assert_int_eq(ykpiv_fetch_object(clients[1], YKPIV_OBJ_RETIRED3, read, &read_len), YKPIV_OK);
+  ck_assert_uint_eq(read_len, sizeof(data));
+  ck_assert_mem_eq(read, data, sizeof(data));
+
+  // A batch keeps the card between transactions
+  ck_assert_int_eq(ykpiv_begin_batch(clients[1], 0), YKPIV_OK);
+  read_len = sizeof(read);
+  ck_assert_int_eq(ykpiv_fetch_object(clients[1], YKPIV_OBJ_RETIRED3, read, &read_len), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_end_batch(clients[1]), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_verify(clients[0], "123456", NULL), YKPIV_OK);
+
+  for (size_t i = 0; i < 2; i++) {
+    ck_assert_int_eq(ykpiv_done(clients[i]), YKPIV_OK);
+  }
+  kill(pid, SIGTERM);
+  ck_assert_int_eq(waitpid(pid, &status, 0), pid);
+  unlink(path);
+}
+END_TEST
+#endif
+
+START_TEST(test_arena) {
+  ykpiv_arena *arena = NULL;
+  ykpiv_allocator allocator;
+  ykpiv_arena_stats stats;
+  uint8_t *point = NULL, *cert = NULL;
+  size_t point_len = 0, cert_len = 0, block_allocations = 0;
+  unsigned char data[1500];
+
+  memset(data, 0x30, sizeof(data));
+  ck_assert_int_eq(ykpiv_arena_init(&arena, 4096), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_arena_get_allocator(arena, &allocator), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_util_set_allocator(g_state, &allocator), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_authenticate2(g_state, NULL, 0), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_util_generate_key(g_state, YKPIV_KEY_AUTHENTICATION, YKPIV_ALGO_ECCP256,
+                                           YKPIV_PINPOLICY_DEFAULT, YKPIV_TOUCHPOLICY_DEFAULT, NULL, NULL, NULL, NULL,
+                                           &point, &point_len), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_util_write_cert(g_state, YKPIV_KEY_AUTHENTICATION, data, sizeof(data),
+                                         YKPIV_CERTINFO_UNCOMPRESSED), YKPIV_OK);
+
+  // The last allocation is given back when freed
+  ck_assert_int_eq(ykpiv_arena_get_stats(arena, &stats), YKPIV_OK);
+  ck_assert_uint_gt(stats.bytes, 0);
+  ck_assert_int_eq(ykpiv_util_free(g_state, point), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_arena_get_stats(arena, &stats), YKPIV_OK);
+  ck_assert_uint_eq(stats.bytes, 0);
+
+  for (int i = 0; i < 3; i++) {
+    ykpiv_key_info *keys = NULL;
+    size_t n_keys = 0;
+    ck_assert_int_eq(ykpiv_util_list_keys_ex(g_state, YKPIV_LIST_KEYS_CERTS, &keys, &n_keys), YKPIV_OK);
+    ck_assert_uint_eq(n_keys, 1);
+    ck_assert_uint_eq(keys[0].cert_len, sizeof(data));
+    ck_assert_int_eq(ykpiv_util_read_cert(g_state, YKPIV_KEY_AUTHENTICATION, &cert, &cert_len), YKPIV_OK);
+    ck_assert_uint_eq(cert_len, sizeof(data));
+    ck_assert_mem_eq(cert, data, sizeof(data));
+    ck_assert_int_eq(ykpiv_arena_get_stats(arena, &stats), YKPIV_OK);
+    ck_assert_uint_ge(stats.peak_bytes, stats.bytes);
+    if (i == 0) {
+      block_allocations = stats.block_allocations;
+    } else {
+      ck_assert_uint_eq(stats.block_allocations, block_allocations);
+    }
+    ck_assert_int_eq(ykpiv_arena_reset(arena), YKPIV_OK);
+  }
+  ck_assert_int_eq(ykpiv_arena_get_stats(arena, &stats), YKPIV_OK);
+  ck_assert_uint_eq(stats.bytes, 0);
+  ck_assert_uint_eq(stats.resets, 3);
+
+  ck_assert_int_eq(ykpiv_util_set_allocator(g_state, NULL), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_arena_done(arena), YKPIV_OK);
+}
+END_TEST
+
+START_TEST(test_workspace) {
+  static unsigned char workspace[YKPIV_WORKSPACE_SIZE];
+  unsigned char zero[YKPIV_WORKSPACE_SIZE] = {0};
+  unsigned char digest[SHA256_DIGEST_LENGTH] = {0};
+  unsigned char sig[256], data[2000], read[YKPIV_OBJ_MAX_SIZE];
+  unsigned long read_len = sizeof(read);
+  size_t sig_len = sizeof(sig);
+  uint8_t *point = NULL;
+  size_t point_len = 0;
+
+  memset(workspace, 0xa5, sizeof(workspace));
+  memset(data, 0x42, sizeof(data));
+  ck_assert_int_eq(ykpiv_set_workspace(g_state, workspace, YKPIV_OBJ_MAX_SIZE - 1), YKPIV_SIZE_ERROR);
+  ck_assert_int_eq(ykpiv_set_workspace(g_state, workspace, sizeof(workspace)), YKPIV_OK);
+  ck_assert_mem_eq(workspace, zero, sizeof(workspace));
+
+  ck_assert_int_eq(ykpiv_authenticate2(g_state, NULL, 0), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_util_generate_key(g_state, YKPIV_KEY_KEYMGM, YKPIV_ALGO_ECCP256,
+                                           YKPIV_PINPOLICY_DEFAULT, YKPIV_TOUCHPOLICY_DEFAULT, NULL, NULL, NULL, NULL,
+                                           &point, &point_len), YKPIV_OK);
+  ykpiv_util_free(g_state, point);
+  ck_assert_int_eq(ykpiv_verify(g_state, "123456", NULL), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_sign_data(g_state, digest, sizeof(digest), sig, &sig_len, YKPIV_ALGO_ECCP256,
+                                   YKPIV_KEY_KEYMGM), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_save_object(g_state, YKPIV_OBJ_RETIRED2, data, sizeof(data)), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_fetch_object(g_state, YKPIV_OBJ_RETIRED2, read, &read_len), YKPIV_OK);
+  ck_assert_mem_eq(read, data, sizeof(data));
+  // Everything borrowed has been wiped
+  ck_assert_mem_eq(workspace, zero, sizeof(workspace));
+
+  // With a single buffer, the rest is allocated
+  ck_assert_int_eq(ykpiv_set_workspace(g_state, workspace, YKPIV_OBJ_MAX_SIZE), YKPIV_OK);
+  sig_len = sizeof(sig);
+  ck_assert_int_eq(ykpiv_sign_data(g_state, digest, sizeof(digest), sig, &sig_len, YKPIV_ALGO_ECCP256,
+                                   YKPIV_KEY_KEYMGM), YKPIV_OK);
+  ck_assert_mem_eq(workspace, zero, sizeof(workspace));
+  ck_assert_int_eq(ykpiv_set_workspace(g_state, NULL, 0), YKPIV_OK);
+}
+END_TEST
+
+START_TEST(test_stats) {
+  ykpiv_stats stats;
+  unsigned char data[16] = {0}, read[64];
+  unsigned long read_len = sizeof(read);
+  const ykpiv_ins_stats *put_data = NULL;
+
+  ck_assert_int_eq(ykpiv_authenticate2(g_state, NULL, 0), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_get_stats(g_state, &stats, true), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_save_object(g_state, YKPIV_OBJ_RETIRED2, data, sizeof(data)), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_fetch_object(g_state, YKPIV_OBJ_RETIRED2, read, &read_len), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_get_stats(g_state, &stats, false), YKPIV_OK);
+  for (size_t i = 0; i < stats.n_ins; i++) {
+    if (stats.ins[i].ins == YKPIV_INS_PUT_DATA) {
+      put_data = stats.ins + i;
+    }
+  }
+  ck_assert_ptr_nonnull(put_data);
+  ck_assert_uint_eq(put_data->commands, 1);
+  ck_assert_uint_eq(put_data->errors, 0);
+  ck_assert_uint_ge(stats.transactions, 2);
+}
+END_TEST
+
+static uint64_t count_ins(const ykpiv_stats *stats, unsigned char ins) {
+  for (size_t i = 0; i < stats->n_ins; i++) {
+    if (stats->ins[i].ins == ins) {
+      return stats->ins[i].commands;
+    }
+  }
+  return 0;
+}
+
+START_TEST(test_mgm_cache) {
+  ykpiv_stats stats;
+  ykpiv_mgm mgm = {0}, derived = {0}, cached = {0};
+  const uint8_t pin[] = "123456";
+  unsigned char admin[] = {0x80, 0x12, 0x82, 0x10,
+                           1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+  int tries = 0;
+
+  mgm.len = 24; // All zero, so a random key is generated
+  ck_assert_int_eq(ykpiv_util_set_mgm_cache(g_state, true), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_verify(g_state, (const char *)pin, &tries), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_authenticate2(g_state, NULL, 0), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_util_set_protected_mgm(g_state, &mgm), YKPIV_OK);
+
+  ck_assert_int_eq(ykpiv_authenticate_protected(g_state), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_get_stats(g_state, &stats, true), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_authenticate_protected(g_state), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_util_get_protected_mgm(g_state, &cached), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_get_stats(g_state, &stats, false), YKPIV_OK);
+  ck_assert_uint_eq(count_ins(&stats, YKPIV_INS_GET_DATA), 0);
+  ck_assert_uint_eq(cached.len, mgm.len);
+  ck_assert_mem_eq(cached.data, mgm.data, mgm.len);
+
+  // Switch to a key derived from the PIN, with a salt in the admin data object
+  ck_assert_int_eq(ykpiv_save_object(g_state, 0x5fff00, admin, sizeof(admin)), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_util_get_derived_mgm(g_state, pin, sizeof(pin) - 1, &derived), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_set_mgmkey3(g_state, derived.data, derived.len, YKPIV_ALGO_3DES, YKPIV_TOUCHPOLICY_DEFAULT), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_authenticate_protected(g_state), YKPIV_AUTHENTICATION_ERROR);
+
+  ck_assert_int_eq(ykpiv_authenticate_derived(g_state, pin, sizeof(pin) - 1), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_get_stats(g_state, &stats, true), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_authenticate_derived(g_state, pin, sizeof(pin) - 1), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_get_stats(g_state, &stats, false), YKPIV_OK);
+  ck_assert_uint_eq(count_ins(&stats, YKPIV_INS_GET_DATA), 0);
+
+  // A wrong PIN still derives a key from the cached salt, which the card rejects
+  ck_assert_int_eq(ykpiv_authenticate_derived(g_state, (const uint8_t *)"654321", 6), YKPIV_AUTHENTICATION_ERROR);
+  ck_assert_int_eq(ykpiv_authenticate_derived(g_state, pin, sizeof(pin) - 1), YKPIV_OK);
+
+  ck_assert_int_eq(ykpiv_util_set_mgm_cache(g_state, false), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_get_stats(g_state, &stats, true), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_authenticate_derived(g_state, pin, sizeof(pin) - 1), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_get_stats(g_state, &stats, false), YKPIV_OK);
+  ck_assert_uint_eq(count_ins(&stats, YKPIV_INS_GET_DATA), 1);
+}
+END_TEST
+
+static bool trace_pin_seen;
+static bool trace_verify_seen;
+
+static void trace_secrets_out(const char *line) {
+  if (strstr(line, "APDU INS 20 ")) {
+    trace_verify_seen = true;
+  }
+  if (strstr(line, "313233343536")) {
+    trace_pin_seen = true;
+  }
+}
+
+START_TEST(test_trace_secrets) {
+  ck_assert_int_eq(ykpiv_trace_enable(64), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_verify(g_state, "123456", NULL), YKPIV_OK);
+  ck_assert_int_eq(ykpiv_trace_enable(0), YKPIV_OK);
+
+  // The VERIFY is recorded, but not the PIN it carries
+  ck_assert_int_eq(ykpiv_trace_dump(trace_secrets_out), YKPIV_OK);
+  ck_assert(trace_verify_seen);
+  ck_assert(!trace_pin_seen);
+}
+END_TEST
+
+static Suite *test_suite(void) {
+  Suite *s;
+  TCase *tc;
+
+  s = suite_create("libykpiv virtual card");
+  tc = tcase_create("virtual");
+  tcase_add_checked_fixture(tc, setup, teardown);
+  // RSA key generation in software can be slow on CI machines
+  tcase_set_timeout(tc, 60);
+  tcase_add_test(tc, test_connect);
+  tcase_add_test(tc, test_device_info);
+  tcase_add_test(tc, test_verify);
+  tcase_add_test(tc, test_cached_retries);
+  tcase_add_test(tc, test_generate_sign);
+  tcase_add_test(tc, test_sign_with_pin);
+  tcase_add_test(tc, test_metadata_attest);
+  tcase_add_test(tc, test_objects);
+  tcase_add_test(tc, test_util_objects);
+  tcase_add_test(tc, test_stream);
+#ifndef _WIN32
+  tcase_add_test(tc, test_broker);
+#endif
+  tcase_add_test(tc, test_arena);
+  tcase_add_test(tc, test_workspace);
+  tcase_add_test(tc, test_stats);
+  tcase_add_test(tc, test_mgm_cache);
+  tcase_add_test(tc, test_trace_secrets);
+  suite_add_tcase(s, tc);
+
+  return s;
+}
+
+int main(void)
+{
+  int number_failed;
+  Suite *s;
+  SRunner *sr;
+
+  s = test_suite();
+  sr = srunner_create(s);
+  srunner_run_all(sr, CK_VERBOSE);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,948 @@
+/*
+ * Copyright (c) 2025 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "virtual_card.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+#define VCARD_BUF_MAX 8192
+#define VCARD_OBJ_MAX 3072
+#define VCARD_MAX_OBJECTS 64
+#define VCARD_PIN_LEN 8
+#define VCARD_TRIES 3
+
+static const unsigned char piv_aid[] = {0xa0, 0x00, 0x00, 0x03, 0x08};
+static const unsigned char yubico_aid[] = {0xa0, 0x00, 0x00, 0x05, 0x27};
+static const unsigned char default_pin[] = "123456";
+static const unsigned char default_puk[] = "12345678";
+static const unsigned char default_mgm_key[] = {
+  0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x01, 0x02, 0x03, 0x04,
+  0x05, 0x06, 0x07, 0x08, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+};
+
+typedef struct {
+  uint32_t id;
+  size_t len;
+  unsigned char *data; // As sent after the tag list, starting with tag 0x53
+} vcard_object;
+
+typedef struct {
+  EVP_PKEY *pkey;
+  uint8_t algorithm;
+  uint8_t pin_policy;
+  uint8_t touch_policy;
+  uint8_t origin;
+} vcard_key;
+
+typedef struct {
+  unsigned char value[VCARD_PIN_LEN]; // Padded with 0xff
+  uint8_t tries;
+  uint8_t retries;
+  bool is_default;
+} vcard_pin;
+
+struct virtual_card {
+  uint32_t serial;
+  vcard_pin pin;
+  vcard_pin puk;
+  bool pin_verified;
+  bool pin_fresh; // Verified by the previous command, for keys with PIN policy always
+  uint8_t mgm_algorithm;
+  unsigned char mgm_key[32];
+  size_t mgm_len;
+  bool mgm_default;
+  bool mgm_authenticated;
+  unsigned char witness[16];
+  size_t witness_len;
+  unsigned char challenge[16];
+  size_t challenge_len;
+  vcard_key keys[256];
+  vcard_object objects[VCARD_MAX_OBJECTS];
+  size_t n_objects;
+  unsigned char chain[VCARD_BUF_MAX];
+  size_t chain_len;
+  unsigned char resp[VCARD_BUF_MAX];
+  size_t resp_len;
+  size_t resp_pos;
+  uint16_t resp_sw;
+};
+
+static size_t put_length(unsigned char *p, size_t len) {
+  if (len < 0x80) {
+    p[0] = (unsigned char)len;
+    return 1;
+  } else if (len < 0x100) {
+    p[0] = 0x81;
+    p[1] = (unsigned char)len;
+    return 2;
+  }
+  p[0] = 0x82;
+  p[1] = (unsigned char)(len >> 8);
+  p[2] = (unsigned char)len;
+  return 3;
+}
+
+static size_t put_tlv(unsigned char *p, uint8_t tag, const unsigned char *value, size_t len) {
+  size_t n = 1;
+  p[0] = tag;
+  n += put_length(p + 1, len);
+  if (value && p + n != value) {
+    memmove(p + n, value, len);
+  }
+  return n + len;
+}
+
+// Reads one TLV with a single byte tag, advancing *p past it
+static bool get_tlv(const unsigned char **p, const unsigned char *end, uint8_t *tag, const unsigned char **value,
+                    size_t *len) {
+  const unsigned char *q = *p;
+  if (end - q < 2) {
+    return false;
+  }
+  *tag = *q++;
+  if (*q < 0x80) {
+    *len = *q++;
+  } else if (*q == 0x81 && end - q >= 2) {
+    *len = q[1];
+    q += 2;
+  } else if (*q == 0x82 && end - q >= 3) {
+    *len = ((size_t)q[1] << 8) | q[2];
+    q += 3;
+  } else {
+    return false;
+  }
+  if ((size_t)(end - q) < *len) {
+    return false;
+  }
+  *value = q;
+  *p = q + *len;
+  return true;
+}
+
+static void set_pin(vcard_pin *pin, const unsigned char *value, size_t len, bool is_default) {
+  memset(pin->value, 0xff, sizeof(pin->value));
+  memcpy(pin->value, value, len);
+  pin->tries = pin->retries;
+  pin->is_default = is_default;
+}
+
+// Returns the status word of checking a padded PIN
+static uint16_t check_pin(vcard_pin *pin, const unsigned char *value) {
+  if (pin->tries == 0) {
+    return SW_ERR_AUTH_BLOCKED;
+  }
+  if (memcmp(pin->value, value, VCARD_PIN_LEN)) {
+    pin->tries--;
+    return pin->tries ? SW_ERR_VERIFY_FAIL_NO_RETRY | pin->tries : SW_ERR_AUTH_BLOCKED;
+  }
+  pin->tries = pin->retries;
+  return SW_SUCCESS;
+}
+
+static void clear_keys(virtual_card *card) {
+  for (size_t i = 0; i < sizeof(card->keys) / sizeof(card->keys[0]); i++) {
+    EVP_PKEY_free(card->keys[i].pkey);
+    memset(&card->keys[i], 0, sizeof(card->keys[i]));
+  }
+  for (size_t i = 0; i < card->n_objects; i++) {
+    free(card->objects[i].data);
+  }
+  card->n_objects = 0;
+}
+
+static EVP_PKEY *generate_pkey(uint8_t algorithm) {
+  EVP_PKEY_CTX *ctx = NULL;
+  EVP_PKEY *pkey = NULL;
+  int bits = 0, nid = 0, type;
+
+  switch (algorithm) {
+    case YKPIV_ALGO_RSA1024: bits = 1024; type = EVP_PKEY_RSA; break;
+    case YKPIV_ALGO_RSA2048: bits = 2048; type = EVP_PKEY_RSA; break;
+    case YKPIV_ALGO_RSA3072: bits = 3072; type = EVP_PKEY_RSA; break;
+    case YKPIV_ALGO_RSA4096: bits = 4096; type = EVP_PKEY_RSA; break;
+    case YKPIV_ALGO_ECCP256: nid = NID_X9_62_prime256v1; type = EVP_PKEY_EC; break;
+    case YKPIV_ALGO_ECCP384: nid = NID_secp384r1; type = EVP_PKEY_EC; break;
+    case YKPIV_ALGO_ED25519: type = EVP_PKEY_ED25519; break;
+    case YKPIV_ALGO_X25519: type = EVP_PKEY_X25519; break;
+    default: return NULL;
+  }
+  if (!(ctx = EVP_PKEY_CTX_new_id(type, NULL)) || EVP_PKEY_keygen_init(ctx) <= 0) {
+    goto out;
+  }
+  if (bits && EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, bits) <= 0) {
+    goto out;
+  }
+  if (nid && EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, nid) <= 0) {
+    goto out;
+  }
+  if (EVP_PKEY_keygen(ctx, &pkey) <= 0) {
+    pkey = NULL;
+  }
+
+out:
+  EVP_PKEY_CTX_free(ctx);
+  return pkey;
+}
+
+// Encodes the public key as returned by GENERATE ASYMMETRIC, without the outer 7f49 tag
+static size_t encode_public_key(const vcard_key *key, unsigned char *out) {
+  unsigned char buf[1024];
+  size_t len = 0;
+
+  if (YKPIV_IS_RSA(key->algorithm)) {
+    const BIGNUM *n, *e;
+    RSA_get0_key(EVP_PKEY_get0_RSA(key->pkey), &n, &e, NULL);
+    int n_len = BN_bn2bin(n, buf);
+    len = put_tlv(out, 0x81, buf, n_len);
+    int e_len = BN_bn2bin(e, buf);
+    len += put_tlv(out + len, 0x82, buf, e_len);
+  } else if (YKPIV_IS_EC(key->algorithm)) {
+    const EC_KEY *ec = EVP_PKEY_get0_EC_KEY(key->pkey);
+    size_t point_len = EC_POINT_point2oct(EC_KEY_get0_group(ec), EC_KEY_get0_public_key(ec),
+                                          POINT_CONVERSION_UNCOMPRESSED, buf, sizeof(buf), NULL);
+    len = put_tlv(out, 0x86, buf, point_len);
+  } else {
+    size_t point_len = sizeof(buf);
+    if (EVP_PKEY_get_raw_public_key(key->pkey, buf, &point_len) <= 0) {
+      return 0;
+    }
+    len = put_tlv(out, 0x86, buf, point_len);
+  }
+  return len;
+}
+
+static uint8_t default_pin_policy(uint8_t slot) {
+  switch (slot) {
+    case YKPIV_KEY_SIGNATURE:
+      return YKPIV_PINPOLICY_ALWAYS;
+    case YKPIV_KEY_CARDAUTH:
+    case YKPIV_KEY_ATTESTATION:
+      return YKPIV_PINPOLICY_NEVER;
+    default:
+      return YKPIV_PINPOLICY_ONCE;
+  }
+}
+
+static bool is_key_slot(uint8_t slot) {
+  return slot == YKPIV_KEY_AUTHENTICATION || slot == YKPIV_KEY_SIGNATURE || slot == YKPIV_KEY_KEYMGM ||
+         slot == YKPIV_KEY_CARDAUTH || (slot >= YKPIV_KEY_RETIRED1 && slot <= YKPIV_KEY_RETIRED20) ||
+         slot == YKPIV_KEY_ATTESTATION;
+}
+
+static void reset_card(virtual_card *card) {
+  clear_keys(card);
+  card->pin.retries = card->puk.retries = VCARD_TRIES;
+  set_pin(&card->pin, default_pin, sizeof(default_pin) - 1, true);
+  set_pin(&card->puk, default_puk, sizeof(default_puk) - 1, true);
+  card->pin_verified = card->pin_fresh = false;
+  card->mgm_algorithm = YKPIV_ALGO_AES192;
+  memcpy(card->mgm_key, default_mgm_key, sizeof(default_mgm_key));
+  card->mgm_len = sizeof(default_mgm_key);
+  card->mgm_default = true;
+  card->mgm_authenticated = false;
+  card->witness_len = card->challenge_len = 0;
+
+  // The attestation key is installed at manufacturing
+  vcard_key *f9 = &card->keys[YKPIV_KEY_ATTESTATION];
+  f9->pkey = generate_pkey(YKPIV_ALGO_ECCP256);
+  f9->algorithm = YKPIV_ALGO_ECCP256;
+  f9->pin_policy = YKPIV_PINPOLICY_NEVER;
+  f9->touch_policy = YKPIV_TOUCHPOLICY_NEVER;
+  f9->origin = YKPIV_METADATA_ORIGIN_IMPORTED;
+}
+
+static bool mgm_crypt(virtual_card *card, const unsigned char *in, size_t len, unsigned char *out, int encrypt) {
+  const EVP_CIPHER *cipher;
+  int out_len = 0, final_len = 0;
+  bool ok = false;
+
+  switch (card->mgm_algorithm) {
+    case YKPIV_ALGO_3DES: cipher = EVP_des_ede3_ecb(); break;
+    case YKPIV_ALGO_AES128: cipher = EVP_aes_128_ecb(); break;
+    case YKPIV_ALGO_AES192: cipher = EVP_aes_192_ecb(); break;
+    case YKPIV_ALGO_AES256: cipher = EVP_aes_256_ecb(); break;
+    default: return false;
+  }
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+  if (ctx && EVP_CipherInit_ex(ctx, cipher, NULL, card->mgm_key, NULL, encrypt) == 1 &&
+      EVP_CIPHER_CTX_set_padding(ctx, 0) == 1 && EVP_CipherUpdate(ctx, out, &out_len, in, (int)len) == 1 &&
+      EVP_CipherFinal_ex(ctx, out + out_len, &final_len) == 1) {
+    ok = (size_t)(out_len + final_len) == len;
+  }
+  EVP_CIPHER_CTX_free(ctx);
+  return ok;
+}
+
+static size_t mgm_block_size(const virtual_card *card) {
+  return card->mgm_algorithm == YKPIV_ALGO_3DES ? 8 : 16;
+}
+
+static vcard_object *find_object(virtual_card *card, uint32_t id) {
+  for (size_t i = 0; i < card->n_objects; i++) {
+    if (card->objects[i].id == id) {
+      return card->objects + i;
+    }
+  }
+  return NULL;
+}
+
+static uint16_t get_data(virtual_card *card, const unsigned char *data, size_t len) {
+  uint8_t tag;
+  const unsigned char *id, *end = data + len;
+  size_t id_len;
+
+  if (!get_tlv(&data, end, &tag, &id, &id_len) || tag != 0x5c || id_len == 0 || id_len > 3) {
+    return SW_ERR_INCORRECT_PARAM;
+  }
+  uint32_t object_id = 0;
+  for (size_t i = 0; i < id_len; i++) {
+    object_id = (object_id << 8) | id[i];
+  }
+  vcard_object *object = find_object(card, object_id);
+  if (!object) {
+    return SW_ERR_FILE_NOT_FOUND;
+  }
+  memcpy(card->resp, object->data, object->len);
+  card->resp_len = object->len;
+  return SW_SUCCESS;
+}
+
+static uint16_t put_data(virtual_card *card, const unsigned char *data, size_t len) {
+  uint8_t tag;
+  const unsigned char *id, *end = data + len;
+  size_t id_len;
+
+  if (!card->mgm_authenticated) {
+    return SW_ERR_SECURITY_STATUS;
+  }
+  if (!get_tlv(&data, end, &tag, &id, &id_len) || tag != 0x5c || id_len == 0 || id_len > 3) {
+    return SW_ERR_INCORRECT_PARAM;
+  }
+  uint32_t object_id = 0;
+  for (size_t i = 0; i < id_len; i++) {
+    object_id = (object_id << 8) | id[i];
+  }
+  size_t value_len = (size_t)(end - data);
+  if (value_len > VCARD_OBJ_MAX) {
+    return SW_ERR_NO_SPACE;
+  }
+  vcard_object *object = find_object(card, object_id);
+  if (value_len <= 2) { // An empty 0x53 tag deletes the object
+    if (object) {
+      free(object->data);
+      *object = card->objects[--card->n_objects];
+    }
+    return SW_SUCCESS;
+  }
+  if (!object) {
+    if (card->n_objects == VCARD_MAX_OBJECTS) {
+      return SW_ERR_NO_SPACE;
+    }
+    object = card->objects + card->n_objects++;
+    object->id = object_id;
+    object->data = NULL;
+  }
+  unsigned char *copy = malloc(value_len);
+  if (!copy) {
+    return SW_ERR_MEMORY_ERROR;
+  }
+  memcpy(copy, data, value_len);
+  free(object->data);
+  object->data = copy;
+  object->len = value_len;
+  return SW_SUCCESS;
+}
+
+static uint16_t verify(virtual_card *card, uint8_t p1, uint8_t p2, const unsigned char *data, size_t len) {
+  if (p2 != 0x80) {
+    return SW_ERR_REFERENCE_NOT_FOUND;
+  }
+  if (p1 == 0xff) {
+    card->pin_verified = false;
+    return SW_SUCCESS;
+  }
+  if (len == 0) {
+    if (card->pin_verified) {
+      return SW_SUCCESS;
+    }
+    return card->pin.tries ? SW_ERR_VERIFY_FAIL_NO_RETRY | card->pin.tries : SW_ERR_AUTH_BLOCKED;
+  }
+  if (len != VCARD_PIN_LEN) {
+    return SW_ERR_WRONG_LENGTH;
+  }
+  uint16_t sw = check_pin(&card->pin, data);
+  card->pin_verified = card->pin_fresh = sw == SW_SUCCESS;
+  return sw;
+}
+
+static uint16_t change_reference(virtual_card *card, uint8_t ins, uint8_t p2, const unsigned char *data, size_t len) {
+  if (len != 2 * VCARD_PIN_LEN) {
+    return SW_ERR_WRONG_LENGTH;
+  }
+  if (ins == YKPIV_INS_RESET_RETRY) {
+    if (p2 != 0x80) {
+      return SW_ERR_REFERENCE_NOT_FOUND;
+    }
+    uint16_t sw = check_pin(&card->puk, data);
+    if (sw == SW_SUCCESS) {
+      memcpy(card->pin.value, data + VCARD_PIN_LEN, VCARD_PIN_LEN);
+      card->pin.tries = card->pin.retries;
+      card->pin.is_default = false;
+    }
+    return sw;
+  }
+  vcard_pin *pin = p2 == 0x80 ? &card->pin : p2 == 0x81 ? &card->puk : NULL;
+  if (!pin) {
+    return SW_ERR_REFERENCE_NOT_FOUND;
+  }
+  uint16_t sw = check_pin(pin, data);
+  if (sw == SW_SUCCESS) {
+    memcpy(pin->value, data + VCARD_PIN_LEN, VCARD_PIN_LEN);
+    pin->is_default = false;
+  }
+  return sw;
+}
+
+static uint16_t generate(virtual_card *card, uint8_t slot, const unsigned char *data, size_t len) {
+  const unsigned char *end = data + len, *value, *inner;
+  size_t value_len;
+  uint8_t tag;
+  vcard_key key = {NULL, 0, default_pin_policy(slot), YKPIV_TOUCHPOLICY_NEVER, YKPIV_METADATA_ORIGIN_GENERATED};
+
+  if (!card->mgm_authenticated) {
+    return SW_ERR_SECURITY_STATUS;
+  }
+  if (!is_key_slot(slot) || slot == YKPIV_KEY_ATTESTATION) {
+    return SW_ERR_INCORRECT_SLOT;
+  }
+  if (!get_tlv(&data, end, &tag, &inner, &value_len) || tag != 0xac) {
+    return SW_ERR_INCORRECT_PARAM;
+  }
+  end = inner + value_len;
+  while (inner < end) {
+    if (!get_tlv(&inner, end, &tag, &value, &value_len) || value_len != 1) {
+      return SW_ERR_INCORRECT_PARAM;
+    }
+    if (tag == YKPIV_ALGO_TAG) {
+      key.algorithm = value[0];
+    } else if (tag == YKPIV_PINPOLICY_TAG) {
+      key.pin_policy = value[0];
+    } else if (tag == YKPIV_TOUCHPOLICY_TAG) {
+      key.touch_policy = value[0];
+    }
+  }
+  if (key.pin_policy == YKPIV_PINPOLICY_DEFAULT) {
+    key.pin_policy = default_pin_policy(slot);
+  }
+  if (key.touch_policy == YKPIV_TOUCHPOLICY_DEFAULT) {
+    key.touch_policy = YKPIV_TOUCHPOLICY_NEVER;
+  }
+  if (!(key.pkey = generate_pkey(key.algorithm))) {
+    return SW_ERR_INCORRECT_PARAM;
+  }
+  EVP_PKEY_free(card->keys[slot].pkey);
+  card->keys[slot] = key;
+
+  size_t pub_len = encode_public_key(&key, card->resp + 5);
+  card->resp[0] = 0x7f;
+  card->resp[1] = 0x49;
+  size_t n = put_length(card->resp + 2, pub_len);
+  memmove(card->resp + 2 + n, card->resp + 5, pub_len);
+  card->resp_len = 2 + n + pub_len;
+  return SW_SUCCESS;
+}
+
+static EVP_PKEY *peer_key(const vcard_key *key, const unsigned char *point, size_t len) {
+  if (key->algorithm == YKPIV_ALGO_X25519) {
+    return EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL, point, len);
+  }
+  const EC_KEY *own = EVP_PKEY_get0_EC_KEY(key->pkey);
+  EC_KEY *ec = EC_KEY_new();
+  EC_POINT *pub = NULL;
+  EVP_PKEY *pkey = NULL;
+  if (!ec || EC_KEY_set_group(ec, EC_KEY_get0_group(own)) != 1 || !(pub = EC_POINT_new(EC_KEY_get0_group(own))) ||
+      EC_POINT_oct2point(EC_KEY_get0_group(own), pub, point, len, NULL) != 1 || EC_KEY_set_public_key(ec, pub) != 1 ||
+      !(pkey = EVP_PKEY_new()) || EVP_PKEY_set1_EC_KEY(pkey, ec) != 1) {
+    EVP_PKEY_free(pkey);
+    pkey = NULL;
+  }
+  EC_POINT_free(pub);
+  EC_KEY_free(ec);
+  return pkey;
+}
+
+// Signs or decrypts in, or derives a shared secret with the point in, into out
+static bool private_key_operation(const vcard_key *key, bool derive, const unsigned char *in, size_t in_len,
+                                  unsigned char *out, size_t *out_len) {
+  EVP_PKEY_CTX *ctx = NULL;
+  EVP_PKEY *peer = NULL;
+  bool ok = false;
+
+  if (key->algorithm == YKPIV_ALGO_ED25519) {
+    EVP_MD_CTX *md = EVP_MD_CTX_new();
+    ok = md && EVP_DigestSignInit(md, NULL, NULL, NULL, key->pkey) == 1 &&
+         EVP_DigestSign(md, out, out_len, in, in_len) == 1;
+    EVP_MD_CTX_free(md);
+    return ok;
+  }
+  if (!(ctx = EVP_PKEY_CTX_new(key->pkey, NULL))) {
+    return false;
+  }
+  if (derive) {
+    ok = (peer = peer_key(key, in, in_len)) && EVP_PKEY_derive_init(ctx) == 1 && EVP_PKEY_derive_set_peer(ctx, peer) == 1 &&
+         EVP_PKEY_derive(ctx, out, out_len) == 1;
+  } else if (YKPIV_IS_RSA(key->algorithm)) {
+    // Signing and decryption are both the raw private key operation
+    ok = in_len == (size_t)EVP_PKEY_size(key->pkey) && EVP_PKEY_decrypt_init(ctx) == 1 &&
+         EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_NO_PADDING) == 1 && EVP_PKEY_decrypt(ctx, out, out_len, in, in_len) == 1;
+  } else if (YKPIV_IS_EC(key->algorithm)) {
+    ok = EVP_PKEY_sign_init(ctx) == 1 && EVP_PKEY_sign(ctx, out, out_len, in, in_len) == 1;
+  }
+  EVP_PKEY_free(peer);
+  EVP_PKEY_CTX_free(ctx);
+  return ok;
+}
+
+static uint16_t authenticate_mgm(virtual_card *card, uint8_t algorithm, const unsigned char *data, size_t len) {
+  const unsigned char *end = data + len, *value, *witness = NULL, *challenge = NULL, *response = NULL;
+  size_t value_len, witness_len = 0, challenge_len = 0, response_len = 0, bs = mgm_block_size(card);
+  unsigned char buf[64];
+  uint8_t tag;
+
+  if (algorithm != card->mgm_algorithm) {
+    return SW_ERR_INCORRECT_PARAM;
+  }
+  while (data < end) {
+    if (!get_tlv(&data, end, &tag, &value, &value_len)) {
+      return SW_ERR_INCORRECT_PARAM;
+    }
+    if (tag == 0x80) {
+      witness = value;
+      witness_len = value_len;
+    } else if (tag == 0x81) {
+      challenge = value;
+      challenge_len = value_len;
+    } else if (tag == 0x82) {
+      response = value;
+      response_len = value_len;
+    }
+  }
+
+  if (witness && witness_len == 0) {
+    // Mutual authentication, step 1: send an encrypted witness
+    card->mgm_authenticated = false;
+    card->challenge_len = 0;
+    if (RAND_bytes(card->witness, (int)bs) != 1 || !mgm_crypt(card, card->witness, bs, buf, 1)) {
+      return SW_ERR_COMMAND_ABORTED;
+    }
+    card->witness_len = bs;
+    card->resp_len = put_tlv(card->resp + 2, 0x80, buf, bs);
+  } else if (witness && challenge) {
+    // Step 2: check the decrypted witness and encrypt the host's challenge
+    bool ok = card->witness_len == bs && witness_len == bs && !memcmp(witness, card->witness, bs);
+    card->witness_len = 0;
+    if (!ok || challenge_len != bs) {
+      return SW_ERR_SECURITY_STATUS;
+    }
+    if (!mgm_crypt(card, challenge, bs, buf, 1)) {
+      return SW_ERR_COMMAND_ABORTED;
+    }
+    card->mgm_authenticated = true;
+    card->resp_len = put_tlv(card->resp + 2, 0x82, buf, bs);
+  } else if (challenge && challenge_len == 0) {
+    // External authentication: send a challenge for the host to encrypt
+    card->mgm_authenticated = false;
+    card->witness_len = 0;
+    if (RAND_bytes(card->challenge, (int)bs) != 1) {
+      return SW_ERR_COMMAND_ABORTED;
+    }
+    card->challenge_len = bs;
+    card->resp_len = put_tlv(card->resp + 2, 0x81, card->challenge, bs);
+  } else if (response) {
+    bool ok = card->challenge_len == bs && response_len == bs && mgm_crypt(card, card->challenge, bs, buf, 1) &&
+              !memcmp(buf, response, bs);
+    card->challenge_len = 0;
+    if (!ok) {
+      return SW_ERR_SECURITY_STATUS;
+    }
+    card->mgm_authenticated = true;
+    return SW_SUCCESS;
+  } else {
+    return SW_ERR_INCORRECT_PARAM;
+  }
+  card->resp[0] = 0x7c;
+  card->resp[1] = (unsigned char)card->resp_len;
+  card->resp_len += 2;
+  return SW_SUCCESS;
+}
+
+static uint16_t authenticate(virtual_card *card, uint8_t algorithm, uint8_t slot, const unsigned char *data, size_t len) {
+  const unsigned char *end = data + len, *value, *inner = NULL, *input = NULL;
+  size_t value_len, input_len = 0;
+  bool derive = false;
+  bool pin_fresh = card->pin_fresh;
+  uint8_t tag;
+
+  card->pin_fresh = false;
+  if (!get_tlv(&data, end, &tag, &inner, &value_len) || tag != 0x7c) {
+    return SW_ERR_INCORRECT_PARAM;
+  }
+  if (slot == YKPIV_KEY_CARDMGM) {
+    return authenticate_mgm(card, algorithm, inner, value_len);
+  }
+  end = inner + value_len;
+  while (inner < end) {
+    if (!get_tlv(&inner, end, &tag, &value, &value_len)) {
+      return SW_ERR_INCORRECT_PARAM;
+    }
+    if (tag == 0x81 || tag == 0x85) {
+      input = value;
+      input_len = value_len;
+      derive = tag == 0x85;
+    }
+  }
+
+  vcard_key *key = &card->keys[slot];
+  if (!is_key_slot(slot)) {
+    return SW_ERR_INCORRECT_SLOT;
+  }
+  if (!key->pkey) {
+    return SW_ERR_REFERENCE_NOT_FOUND;
+  }
+  if (key->algorithm != algorithm || !input) {
+    return SW_ERR_INCORRECT_PARAM;
+  }
+  if ((key->pin_policy == YKPIV_PINPOLICY_ONCE && !card->pin_verified) ||
+      (key->pin_policy == YKPIV_PINPOLICY_ALWAYS && !pin_fresh)) {
+    return SW_ERR_SECURITY_STATUS;
+  }
+
+  unsigned char out[1024];
+  size_t out_len = sizeof(out);
+  if (!private_key_operation(key, derive, input, input_len, out, &out_len)) {
+    return SW_ERR_INCORRECT_PARAM;
+  }
+  size_t n = put_tlv(card->resp + 8, 0x82, out, out_len);
+  card->resp[0] = 0x7c;
+  size_t hdr = 1 + put_length(card->resp + 1, n);
+  memmove(card->resp + hdr, card->resp + 8, n);
+  card->resp_len = hdr + n;
+  return SW_SUCCESS;
+}
+
+static uint16_t get_metadata(virtual_card *card, uint8_t slot) {
+  unsigned char *p = card->resp;
+  unsigned char value[2];
+
+  if (slot == 0x80 || slot == 0x81) {
+    vcard_pin *pin = slot == 0x80 ? &card->pin : &card->puk;
+    value[0] = 0xff;
+    p += put_tlv(p, YKPIV_METADATA_ALGORITHM_TAG, value, 1);
+    value[0] = pin->is_default;
+    p += put_tlv(p, 0x05, value, 1);
+    value[0] = pin->retries;
+    value[1] = pin->tries;
+    p += put_tlv(p, 0x06, value, 2);
+  } else if (slot == YKPIV_KEY_CARDMGM) {
+    p += put_tlv(p, YKPIV_METADATA_ALGORITHM_TAG, &card->mgm_algorithm, 1);
+    value[0] = 0;
+    value[1] = YKPIV_TOUCHPOLICY_NEVER;
+    p += put_tlv(p, YKPIV_METADATA_POLICY_TAG, value, 2);
+    value[0] = card->mgm_default;
+    p += put_tlv(p, 0x05, value, 1);
+  } else if (is_key_slot(slot)) {
+    const vcard_key *key = &card->keys[slot];
+    unsigned char pub[1024];
+    if (!key->pkey) {
+      return SW_ERR_REFERENCE_NOT_FOUND;
+    }
+    p += put_tlv(p, YKPIV_METADATA_ALGORITHM_TAG, &key->algorithm, 1);
+    value[0] = key->pin_policy;
+    value[1] = key->touch_policy;
+    p += put_tlv(p, YKPIV_METADATA_POLICY_TAG, value, 2);
+    p += put_tlv(p, YKPIV_METADATA_ORIGIN_TAG, &key->origin, 1);
+    size_t pub_len = encode_public_key(key, pub);
+    p += put_tlv(p, YKPIV_METADATA_PUBKEY_TAG, pub, pub_len);
+  } else {
+    return SW_ERR_INCORRECT_SLOT;
+  }
+  card->resp_len = (size_t)(p - card->resp);
+  return SW_SUCCESS;
+}
+
+static uint16_t attest(virtual_card *card, uint8_t slot) {
+  const vcard_key *key = &card->keys[slot];
+  const vcard_key *f9 = &card->keys[YKPIV_KEY_ATTESTATION];
+  char cn[64];
+  uint16_t sw = SW_ERR_COMMAND_ABORTED;
+
+  if (!is_key_slot(slot) || !key->pkey) {
+    return SW_ERR_REFERENCE_NOT_FOUND;
+  }
+  if (key->origin != YKPIV_METADATA_ORIGIN_GENERATED) {
+    return SW_ERR_INCORRECT_PARAM;
+  }
+
+  X509 *x509 = X509_new();
+  X509_NAME *subject = X509_NAME_new();
+  X509_NAME *issuer = X509_NAME_new();
+  snprintf(cn, sizeof(cn), "YubiKey PIV Attestation %02x", slot);
+  if (!x509 || !subject || !issuer || X509_set_version(x509, 2) != 1 ||
+      ASN1_INTEGER_set(X509_get_serialNumber(x509), (long)card->serial) != 1 ||
+      !X509_gmtime_adj(X509_get_notBefore(x509), 0) || !X509_gmtime_adj(X509_get_notAfter(x509), 365L * 24 * 3600) ||
+      X509_NAME_add_entry_by_txt(subject, "CN", MBSTRING_ASC, (const unsigned char *)cn, -1, -1, 0) != 1 ||
+      X509_NAME_add_entry_by_txt(issuer, "CN", MBSTRING_ASC, (const unsigned char *)"Virtual PIV Attestation", -1, -1,
+                                 0) != 1 ||
+      X509_set_subject_name(x509, subject) != 1 || X509_set_issuer_name(x509, issuer) != 1 ||
+      X509_set_pubkey(x509, key->pkey) != 1 || X509_sign(x509, f9->pkey, EVP_sha256()) <= 0) {
+    goto out;
+  }
+  int len = i2d_X509(x509, NULL);
+  if (len <= 0 || len > VCARD_BUF_MAX) {
+    goto out;
+  }
+  unsigned char *p = card->resp;
+  card->resp_len = (size_t)i2d_X509(x509, &p);
+  sw = SW_SUCCESS;
+
+out:
+  X509_NAME_free(issuer);
+  X509_NAME_free(subject);
+  X509_free(x509);
+  return sw;
+}
+
+static uint16_t set_mgm_key(virtual_card *card, uint8_t p1, const unsigned char *data, size_t len) {
+  if (!card->mgm_authenticated) {
+    return SW_ERR_SECURITY_STATUS;
+  }
+  if (p1 != 0xff || len < 3 || data[1] != YKPIV_KEY_CARDMGM || data[2] != len - 3 || data[2] > sizeof(card->mgm_key)) {
+    return SW_ERR_INCORRECT_PARAM;
+  }
+  size_t key_len = data[2];
+  if (!((data[0] == YKPIV_ALGO_3DES && key_len == 24) || (data[0] == YKPIV_ALGO_AES128 && key_len == 16) ||
+        (data[0] == YKPIV_ALGO_AES192 && key_len == 24) || (data[0] == YKPIV_ALGO_AES256 && key_len == 32))) {
+    return SW_ERR_INCORRECT_PARAM;
+  }
+  card->mgm_algorithm = data[0];
+  memcpy(card->mgm_key, data + 3, key_len);
+  card->mgm_len = key_len;
+  card->mgm_default = false;
+  return SW_SUCCESS;
+}
+
+static uint16_t process(virtual_card *card, uint8_t ins, uint8_t p1, uint8_t p2, const unsigned char *data, size_t len) {
+  if (ins != YKPIV_INS_AUTHENTICATE && ins != YKPIV_INS_VERIFY) {
+    card->pin_fresh = false;
+  }
+  switch (ins) {
+    case YKPIV_INS_SELECT_APPLICATION:
+      if (p1 != 0x04) {
+        return SW_ERR_INCORRECT_PARAM;
+      }
+      card->pin_verified = false;
+      card->mgm_authenticated = false;
+      // Selecting one of the Yubico applications just deselects PIV, which is what the library uses it for
+      if (len >= sizeof(yubico_aid) && !memcmp(data, yubico_aid, sizeof(yubico_aid))) {
+        return SW_SUCCESS;
+      }
+      if (len < sizeof(piv_aid) || memcmp(data, piv_aid, sizeof(piv_aid))) {
+        return SW_ERR_FILE_NOT_FOUND;
+      }
+      {
+        static const unsigned char apt[] = {0x61, 0x11, 0x4f, 0x06, 0x00, 0x00, 0x10, 0x00, 0x01, 0x00,
+                                            0x79, 0x07, 0x4f, 0x05, 0xa0, 0x00, 0x00, 0x03, 0x08};
+        memcpy(card->resp, apt, sizeof(apt));
+        card->resp_len = sizeof(apt);
+      }
+      return SW_SUCCESS;
+    case YKPIV_INS_GET_VERSION:
+      card->resp[0] = 5;
+      card->resp[1] = 7;
+      card->resp[2] = 2;
+      card->resp_len = 3;
+      return SW_SUCCESS;
+    case YKPIV_INS_GET_SERIAL:
+      card->resp[0] = (unsigned char)(card->serial >> 24);
+      card->resp[1] = (unsigned char)(card->serial >> 16);
+      card->resp[2] = (unsigned char)(card->serial >> 8);
+      card->resp[3] = (unsigned char)card->serial;
+      card->resp_len = 4;
+      return SW_SUCCESS;
+    case YKPIV_INS_VERIFY:
+      return verify(card, p1, p2, data, len);
+    case YKPIV_INS_CHANGE_REFERENCE:
+    case YKPIV_INS_RESET_RETRY:
+      return change_reference(card, ins, p2, data, len);
+    case YKPIV_INS_GET_DATA:
+      return get_data(card, data, len);
+    case YKPIV_INS_PUT_DATA:
+      return put_data(card, data, len);
+    case YKPIV_INS_GENERATE_ASYMMETRIC:
+      return generate(card, p2, data, len);
+    case YKPIV_INS_AUTHENTICATE:
+      return authenticate(card, p1, p2, data, len);
+    case YKPIV_INS_GET_METADATA:
+      return get_metadata(card, p2);
+    case YKPIV_INS_ATTEST:
+      return attest(card, p1);
+    case YKPIV_INS_SET_MGMKEY:
+      return set_mgm_key(card, p1, data, len);
+    case YKPIV_INS_SET_PIN_RETRIES:
+      if (!card->mgm_authenticated || !card->pin_verified) {
+        return SW_ERR_SECURITY_STATUS;
+      }
+      if (p1 == 0 || p2 == 0) {
+        return SW_ERR_INCORRECT_PARAM;
+      }
+      card->pin.retries = p1;
+      card->puk.retries = p2;
+      set_pin(&card->pin, default_pin, sizeof(default_pin) - 1, true);
+      set_pin(&card->puk, default_puk, sizeof(default_puk) - 1, true);
+      return SW_SUCCESS;
+    case YKPIV_INS_RESET:
+      if (card->pin.tries || card->puk.tries) {
+        return SW_ERR_CONDITIONS_OF_USE;
+      }
+      reset_card(card);
+      return SW_SUCCESS;
+    default:
+      return SW_ERR_NOT_SUPPORTED;
+  }
+}
+
+// Sends as much of the pending response as the command allows, with 61xx if more remains
+static void reply(virtual_card *card, bool extended, unsigned char *recv, size_t *recv_len) {
+  size_t max = *recv_len - 2;
+  size_t remaining = card->resp_len - card->resp_pos;
+  if (!extended && max > 256) {
+    max = 256;
+  }
+  size_t n = remaining < max ? remaining : max;
+  memcpy(recv, card->resp + card->resp_pos, n);
+  card->resp_pos += n;
+  remaining -= n;
+  uint16_t sw = remaining ? 0x6100 | (remaining > 0xff ? 0 : remaining) : card->resp_sw;
+  recv[n] = (unsigned char)(sw >> 8);
+  recv[n + 1] = (unsigned char)sw;
+  *recv_len = n + 2;
+}
+
+static ykpiv_rc transmit(void *ctx, const unsigned char *send, size_t send_len, unsigned char *recv, size_t *recv_len) {
+  virtual_card *card = ctx;
+  const unsigned char *data = send + 5;
+  size_t lc = 0;
+  bool extended = false;
+
+  if (*recv_len < 2) {
+    return YKPIV_SIZE_ERROR;
+  }
+  if (send_len < 4) {
+    card->resp_len = card->resp_pos = 0;
+    card->resp_sw = SW_ERR_WRONG_LENGTH;
+    reply(card, false, recv, recv_len);
+    return YKPIV_OK;
+  }
+  if (send_len > 5 && send[4] == 0 && send_len >= 7) {
+    extended = true;
+    if (send_len > 7) {
+      lc = ((size_t)send[5] << 8) | send[6];
+      data = send + 7;
+    }
+  } else if (send_len > 5) {
+    lc = send[4];
+  }
+  if ((size_t)(data - send) + lc > send_len) {
+    card->resp_len = card->resp_pos = 0;
+    card->resp_sw = SW_ERR_WRONG_LENGTH;
+    reply(card, extended, recv, recv_len);
+    return YKPIV_OK;
+  }
+
+  uint8_t cla = send[0], ins = send[1];
+  if (ins == YKPIV_INS_GET_RESPONSE_APDU) {
+    reply(card, extended, recv, recv_len);
+    return YKPIV_OK;
+  }
+
+  card->resp_len = card->resp_pos = 0;
+  if (card->chain_len + lc > sizeof(card->chain)) {
+    card->chain_len = 0;
+    card->resp_sw = SW_ERR_WRONG_LENGTH;
+  } else if (cla & 0x10) {
+    memcpy(card->chain + card->chain_len, data, lc);
+    card->chain_len += lc;
+    card->resp_sw = SW_SUCCESS;
+  } else {
+    if (card->chain_len) {
+      memcpy(card->chain + card->chain_len, data, lc);
+      lc += card->chain_len;
+      data = card->chain;
+      card->chain_len = 0;
+    }
+    card->resp_sw = process(card, ins, send[2], send[3], data, lc);
+    if (card->resp_sw != SW_SUCCESS) {
+      card->resp_len = 0;
+    }
+  }
+  reply(card, extended, recv, recv_len);
+  return YKPIV_OK;
+}
+
+virtual_card *virtual_card_new(uint32_t serial) {
+  virtual_card *card = calloc(1, sizeof(virtual_card));
+  if (card) {
+    card->serial = serial;
+    reset_card(card);
+  }
+  return card;
+}
+
+void virtual_card_free(virtual_card *card) {
+  if (card) {
+    clear_keys(card);
+    OPENSSL_cleanse(card, sizeof(*card));
+    free(card);
+  }
+}
+
+void virtual_card_transport(virtual_card *card, ykpiv_transport *transport) {
+  memset(transport, 0, sizeof(*transport));
+  transport->ctx = card;
+  transport->transmit = transmit;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2025 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef VIRTUAL_CARD_H
+#define VIRTUAL_CARD_H
+
+#include "ykpiv.h"
+
+// Software implementation of the PIV application of a YubiKey 5.7, to exercise libykpiv without hardware.
+// Implements SELECT, VERIFY, CHANGE REFERENCE, RESET RETRY, GET/PUT DATA, GENERATE ASYMMETRIC,
+// GENERAL AUTHENTICATE, GET METADATA, ATTEST, SET MGMKEY, GET VERSION and GET SERIAL, with command
+// chaining, GET RESPONSE and extended length APDUs. Key import and SCP11 are not implemented.
+// The PIN, PUK and management key start out with their default values.
+
+typedef struct virtual_card virtual_card;
+
+virtual_card *virtual_card_new(uint32_t serial);
+void virtual_card_free(virtual_card *card);
+
+// Transport for ykpiv_connect_with_transport(), valid until the card is freed
+void virtual_card_transport(virtual_card *card, ykpiv_transport *transport);
+
+#endif
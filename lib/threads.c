@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2025 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "threads.h"
+
+typedef struct {
+  yc_thread_fn fn;
+  void *arg;
+} yc_thread_start_t;
+
+typedef struct {
+  yc_share_fn fn;
+  void *arg;
+  size_t share;
+  size_t n_shares;
+  yc_thread thread;
+  bool started;
+} yc_share_t;
+
+#ifdef _WIN32
+
+bool yc_mutex_init(yc_mutex *mutex) {
+  InitializeCriticalSection(mutex);
+  return true;
+}
+
+void yc_mutex_destroy(yc_mutex *mutex) {
+  DeleteCriticalSection(mutex);
+}
+
+void yc_mutex_lock(yc_mutex *mutex) {
+  EnterCriticalSection(mutex);
+}
+
+void yc_mutex_unlock(yc_mutex *mutex) {
+  LeaveCriticalSection(mutex);
+}
+
+bool yc_cond_init(yc_cond *cond) {
+  InitializeConditionVariable(cond);
+  return true;
+}
+
+void yc_cond_destroy(yc_cond *cond) {
+  (void)cond; // Windows condition variables need no clean up
+}
+
+void yc_cond_wait(yc_cond *cond, yc_mutex *mutex) {
+  SleepConditionVariableCS(cond, mutex, INFINITE);
+}
+
+bool yc_cond_timedwait(yc_cond *cond, yc_mutex *mutex, uint32_t timeout_ms) {
+  return SleepConditionVariableCS(cond, mutex, timeout_ms) != 0;
+}
+
+void yc_cond_broadcast(yc_cond *cond) {
+  WakeAllConditionVariable(cond);
+}
+
+static DWORD WINAPI yc_thread_main(LPVOID param) {
+  yc_thread_start_t start = *(yc_thread_start_t *)param;
+  free(param);
+  start.fn(start.arg);
+  return 0;
+}
+
+bool yc_thread_start(yc_thread *thread, yc_thread_fn fn, void *arg) {
+  yc_thread_start_t *start = malloc(sizeof(yc_thread_start_t));
+  if(!start) {
+    return false;
+  }
+  start->fn = fn;
+  start->arg = arg;
+  if(!(*thread = CreateThread(NULL, 0, yc_thread_main, start, 0, NULL))) {
+    free(start);
+    return false;
+  }
+  return true;
+}
+
+void yc_thread_join(yc_thread thread) {
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+}
+
+size_t yc_cpu_count(void) {
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors ? info.dwNumberOfProcessors : 1;
+}
+
+#else
+
+bool yc_mutex_init(yc_mutex *mutex) {
+  return pthread_mutex_init(mutex, NULL) == 0;
+}
+
+void yc_mutex_destroy(yc_mutex *mutex) {
+  pthread_mutex_destroy(mutex);
+}
+
+void yc_mutex_lock(yc_mutex *mutex) {
+  pthread_mutex_lock(mutex);
+}
+
+void yc_mutex_unlock(yc_mutex *mutex) {
+  pthread_mutex_unlock(mutex);
+}
+
+bool yc_cond_init(yc_cond *cond) {
+  return pthread_cond_init(cond, NULL) == 0;
+}
+
+void yc_cond_destroy(yc_cond *cond) {
+  pthread_cond_destroy(cond);
+}
+
+void yc_cond_wait(yc_cond *cond, yc_mutex *mutex) {
+  pthread_cond_wait(cond, mutex);
+}
+
+bool yc_cond_timedwait(yc_cond *cond, yc_mutex *mutex, uint32_t timeout_ms) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += timeout_ms / 1000;
+  ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+  if(ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+  return pthread_cond_timedwait(cond, mutex, &ts) != ETIMEDOUT;
+}
+
+void yc_cond_broadcast(yc_cond *cond) {
+  pthread_cond_broadcast(cond);
+}
+
+static void *yc_thread_main(void *param) {
+  yc_thread_start_t start = *(yc_thread_start_t *)param;
+  free(param);
+  start.fn(start.arg);
+  return NULL;
+}
+
+bool yc_thread_start(yc_thread *thread, yc_thread_fn fn, void *arg) {
+  yc_thread_start_t *start = malloc(sizeof(yc_thread_start_t));
+  if(!start) {
+    return false;
+  }
+  start->fn = fn;
+  start->arg = arg;
+  if(pthread_create(thread, NULL, yc_thread_main, start)) {
+    free(start);
+    return false;
+  }
+  return true;
+}
+
+void yc_thread_join(yc_thread thread) {
+  pthread_join(thread, NULL);
+}
+
+size_t yc_cpu_count(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (size_t)n : 1;
+}
+
+#endif
+
+static void yc_share_main(void *param) {
+  yc_share_t *share = param;
+  share->fn(share->arg, share->share, share->n_shares);
+}
+
+void yc_run_shares(size_t n_shares, yc_share_fn fn, void *arg) {
+  yc_share_t *shares = calloc(n_shares, sizeof(yc_share_t));
+
+  for(size_t i = 1; i < n_shares; i++) {
+    if(shares) {
+      shares[i].fn = fn;
+      shares[i].arg = arg;
+      shares[i].share = i;
+      shares[i].n_shares = n_shares;
+      shares[i].started = yc_thread_start(&shares[i].thread, yc_share_main, shares + i);
+    }
+    if(!shares || !shares[i].started) {
+      fn(arg, i, n_shares);
+    }
+  }
+  if(n_shares) {
+    fn(arg, 0, n_shares);
+  }
+
+  for(size_t i = 1; shares && i < n_shares; i++) {
+    if(shares[i].started) {
+      yc_thread_join(shares[i].thread);
+    }
+  }
+  free(shares);
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2025 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef YKPIV_THREADS_H
+#define YKPIV_THREADS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+typedef CRITICAL_SECTION yc_mutex;
+typedef CONDITION_VARIABLE yc_cond;
+typedef HANDLE yc_thread;
+#else
+#include <pthread.h>
+typedef pthread_mutex_t yc_mutex;
+typedef pthread_cond_t yc_cond;
+typedef pthread_t yc_thread;
+#endif
+
+#ifdef _MSC_VER
+#define YKPIV_THREAD_LOCAL __declspec(thread)
+#else
+#define YKPIV_THREAD_LOCAL _Thread_local
+#endif
+
+typedef void (*yc_thread_fn)(void *arg);
+
+bool yc_mutex_init(yc_mutex *mutex);
+void yc_mutex_destroy(yc_mutex *mutex);
+void yc_mutex_lock(yc_mutex *mutex);
+void yc_mutex_unlock(yc_mutex *mutex);
+
+bool yc_cond_init(yc_cond *cond);
+void yc_cond_destroy(yc_cond *cond);
+void yc_cond_wait(yc_cond *cond, yc_mutex *mutex);
+// Returns false on timeout
+bool yc_cond_timedwait(yc_cond *cond, yc_mutex *mutex, uint32_t timeout_ms);
+void yc_cond_broadcast(yc_cond *cond);
+
+bool yc_thread_start(yc_thread *thread, yc_thread_fn fn, void *arg);
+void yc_thread_join(yc_thread thread);
+
+typedef void (*yc_share_fn)(void *arg, size_t share, size_t n_shares);
+
+// Number of processors online, at least 1
+size_t yc_cpu_count(void);
+// Runs fn once for each share, each on a thread of its own. The calling thread takes the first share, and any share
+// whose thread couldn't be started. Returns once all shares have run.
+void yc_run_shares(size_t n_shares, yc_share_fn fn, void *arg);
+
+#endif
@@ -0,0 +1,420 @@
+/*
+ * Copyright (c) 2025 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+// Debug events are recorded into a ring buffer owned by the recording thread, so recording takes
+// no locks and does no formatting. Rings are only formatted when dumped. Rings of exited threads
+// are kept, and reused by new threads, so a dump also shows what finished threads did last.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include "ykpiv.h"
+#include "threads.h"
+#include "trace.h"
+
+#ifdef _MSC_VER
+#define trace_cas_ptr(ptr, old, new) (InterlockedCompareExchangePointer((PVOID volatile *)(ptr), (new), (old)) == (old))
+#define trace_cas_long(ptr, old, new) (InterlockedCompareExchange((ptr), (new), (old)) == (old))
+#define trace_fetch_add(ptr) ((uint32_t)InterlockedIncrement((ptr)) - 1)
+#define trace_store(ptr, val) (InterlockedExchange64((volatile LONG64 *)(ptr), (LONG64)(val)))
+#define trace_load(ptr) ((uint64_t)InterlockedCompareExchange64((volatile LONG64 *)(ptr), 0, 0))
+#else
+#define trace_cas_ptr(ptr, old, new) __sync_bool_compare_and_swap((ptr), (old), (new))
+#define trace_cas_long(ptr, old, new) __sync_bool_compare_and_swap((ptr), (old), (new))
+#define trace_fetch_add(ptr) ((uint32_t)__sync_fetch_and_add((ptr), 1))
+#define trace_store(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+#define trace_load(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#endif
+
+typedef struct {
+  uint64_t seq;          // Position in the ring plus one, 0 while the event is written
+  uint64_t time_us;
+  const char *file;
+  const char *func;
+  const char *fmt;       // NULL for APDUs
+  uint32_t line;
+  uint32_t len;          // Payload length, or length sent for APDUs
+  uint32_t recv_len;
+  uint16_t sw;
+  uint8_t lvl;
+  uint8_t slice_len;
+  uint8_t slice[YC_TRACE_SLICE];
+} yc_trace_event;
+
+typedef struct yc_trace_ring {
+  struct yc_trace_ring *next;
+  volatile long in_use;
+  uint32_t thread;
+  uint64_t head;         // Events written
+  size_t size;
+  yc_trace_event events[];
+} yc_trace_ring;
+
+volatile size_t yc_trace_events = 0;
+
+static yc_trace_ring *volatile trace_rings = NULL;
+static volatile long trace_threads = 0;
+static YKPIV_THREAD_LOCAL yc_trace_ring *trace_ring = NULL;
+
+static void trace_release(void *ring) {
+  if(ring) {
+    ((yc_trace_ring *)ring)->in_use = 0;
+  }
+}
+
+#ifdef _WIN32
+static INIT_ONCE trace_once = INIT_ONCE_STATIC_INIT;
+static DWORD trace_key = FLS_OUT_OF_INDEXES;
+
+static void NTAPI trace_thread_exit(PVOID ring) {
+  trace_release(ring);
+}
+
+static BOOL CALLBACK trace_init_key(PINIT_ONCE once, PVOID param, PVOID *ctx) {
+  (void)once;
+  (void)param;
+  (void)ctx;
+  trace_key = FlsAlloc(trace_thread_exit);
+  return TRUE;
+}
+
+static void trace_set_exit(yc_trace_ring *ring) {
+  InitOnceExecuteOnce(&trace_once, trace_init_key, NULL, NULL);
+  if(trace_key != FLS_OUT_OF_INDEXES) {
+    FlsSetValue(trace_key, ring);
+  }
+}
+
+static uint64_t trace_now_us(void) {
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+  if(!freq.QuadPart) {
+    QueryPerformanceFrequency(&freq);
+  }
+  QueryPerformanceCounter(&now);
+  return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000 + (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+}
+#else
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static bool trace_key_ok = false;
+
+static void trace_init_key(void) {
+  trace_key_ok = pthread_key_create(&trace_key, trace_release) == 0;
+}
+
+static void trace_set_exit(yc_trace_ring *ring) {
+  pthread_once(&trace_once, trace_init_key);
+  if(trace_key_ok) {
+    pthread_setspecific(trace_key, ring);
+  }
+}
+
+static uint64_t trace_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+#endif
+
+// Claim a ring left by an exited thread, or add a new one
+static yc_trace_ring *trace_claim(void) {
+  size_t size = yc_trace_events;
+  yc_trace_ring *ring;
+
+  for(ring = trace_rings; ring; ring = ring->next) {
+    if(ring->in_use == 0 && trace_cas_long(&ring->in_use, 0, 1)) {
+      break;
+    }
+  }
+  if(!ring) {
+    if((ring = calloc(1, sizeof(yc_trace_ring) + size * sizeof(yc_trace_event))) == NULL) {
+      return NULL;
+    }
+    ring->in_use = 1;
+    ring->size = size;
+    yc_trace_ring *head;
+    do {
+      head = trace_rings;
+      ring->next = head;
+    } while(!trace_cas_ptr(&trace_rings, head, ring));
+  }
+  ring->thread = trace_fetch_add(&trace_threads) + 1;
+  trace_set_exit(ring);
+  return ring;
+}
+
+static yc_trace_event *trace_begin(void) {
+  if(!trace_ring && (trace_ring = trace_claim()) == NULL) {
+    return NULL;
+  }
+  yc_trace_event *ev = &trace_ring->events[trace_ring->head % trace_ring->size];
+  trace_store(&ev->seq, 0);
+  ev->time_us = trace_now_us();
+  return ev;
+}
+
+static void trace_end(yc_trace_event *ev) {
+  trace_store(&ev->seq, trace_ring->head + 1);
+  trace_store(&trace_ring->head, trace_ring->head + 1);
+}
+
+static void trace_slice(yc_trace_event *ev, const uint8_t *data, size_t len) {
+  ev->slice_len = (uint8_t)(len < YC_TRACE_SLICE ? len : YC_TRACE_SLICE);
+  if(data) {
+    memcpy(ev->slice, data, ev->slice_len);
+  } else {
+    ev->slice_len = 0;
+  }
+}
+
+void yc_trace_debug(const char *file, int line, const char *func, int lvl, const char *fmt,
+                    const uint8_t *data, size_t len) {
+  yc_trace_event *ev = trace_begin();
+  if(ev) {
+    ev->file = file;
+    ev->line = (uint32_t)line;
+    ev->func = func;
+    ev->fmt = fmt;
+    ev->lvl = (uint8_t)lvl;
+    ev->len = (uint32_t)len;
+    ev->recv_len = 0;
+    ev->sw = 0;
+    trace_slice(ev, data, len);
+    trace_end(ev);
+  }
+}
+
+size_t yc_trace_apdu_keep(const uint8_t *send, size_t send_len) {
+  if(send_len <= 5) {
+    return send_len;
+  }
+  switch(send[1]) {
+    case YKPIV_INS_VERIFY:
+    case YKPIV_INS_CHANGE_REFERENCE:
+    case YKPIV_INS_RESET_RETRY:
+    case YKPIV_INS_AUTHENTICATE:
+    case YKPIV_INS_IMPORT_KEY:
+    case YKPIV_INS_SET_MGMKEY:
+      // Extended length APDUs encode Lc in three bytes, starting with 00
+      return send[4] == 0 && send_len >= 7 ? 7 : 5;
+    default:
+      return send_len;
+  }
+}
+
+void yc_trace_apdu(const char *file, int line, const char *func, const uint8_t *send, size_t send_len,
+                   size_t recv_len, int sw) {
+  yc_trace_event *ev = trace_begin();
+  if(ev) {
+    ev->file = file;
+    ev->line = (uint32_t)line;
+    ev->func = func;
+    ev->fmt = NULL;
+    ev->lvl = 1;
+    ev->len = (uint32_t)send_len;
+    ev->recv_len = (uint32_t)recv_len;
+    ev->sw = (uint16_t)sw;
+    trace_slice(ev, send, send ? yc_trace_apdu_keep(send, send_len) : 0);
+    trace_end(ev);
+  }
+}
+
+// Formatting only uses these helpers, and no locks or allocation, so a dump can run in a signal handler
+
+typedef struct {
+  char buf[1024];
+  size_t len;
+} trace_line;
+
+static void trace_str(trace_line *l, const char *s) {
+  while(s && *s && l->len < sizeof(l->buf) - 1) {
+    l->buf[l->len++] = *s++;
+  }
+}
+
+static void trace_dec(trace_line *l, uint64_t n) {
+  char tmp[24];
+  size_t i = sizeof(tmp);
+  tmp[--i] = 0;
+  do {
+    tmp[--i] = (char)('0' + n % 10);
+    n /= 10;
+  } while(n);
+  trace_str(l, tmp + i);
+}
+
+static void trace_hex(trace_line *l, const uint8_t *p, size_t n) {
+  static const char digits[] = "0123456789abcdef";
+  for(size_t i = 0; i < n && l->len < sizeof(l->buf) - 3; i++) {
+    l->buf[l->len++] = digits[p[i] >> 4];
+    l->buf[l->len++] = digits[p[i] & 0xf];
+  }
+}
+
+static void trace_format(trace_line *l, const yc_trace_ring *ring, const yc_trace_event *ev) {
+  const char *name = ev->file ? strrchr(ev->file, '/') : NULL;
+#ifdef _WIN32
+  const char *bslash = ev->file ? strrchr(ev->file, '\\') : NULL;
+  if(bslash > name) {
+    name = bslash;
+  }
+#endif
+  uint8_t sw[2] = {ev->sw >> 8, ev->sw & 0xff};
+
+  l->len = 0;
+  trace_str(l, "TRC ");
+  trace_dec(l, ring->thread);
+  trace_str(l, " ");
+  trace_dec(l, ev->time_us);
+  trace_str(l, "us ");
+  trace_str(l, name ? name + 1 : ev->file);
+  trace_str(l, ":");
+  trace_dec(l, ev->line);
+  trace_str(l, " (");
+  trace_str(l, ev->func);
+  trace_str(l, "): ");
+  if(ev->fmt) {
+    trace_str(l, ev->fmt);
+    if(ev->slice_len) {
+      if(l->len && l->buf[l->len - 1] == '@') {
+        l->len--; // Overwrite the marker
+      }
+      trace_hex(l, ev->slice, ev->slice_len);
+      trace_str(l, ev->slice_len < ev->len ? ".. (" : " (");
+      trace_dec(l, ev->len);
+      trace_str(l, ")");
+    }
+  } else {
+    trace_str(l, "APDU INS ");
+    trace_hex(l, ev->slice + 1, ev->slice_len > 1 ? 1 : 0);
+    trace_str(l, " sent ");
+    trace_dec(l, ev->len);
+    trace_str(l, " received ");
+    trace_dec(l, ev->recv_len);
+    trace_str(l, " SW ");
+    trace_hex(l, sw, 2);
+    trace_str(l, " ");
+    trace_hex(l, ev->slice, ev->slice_len);
+    if(ev->slice_len < ev->len) {
+      trace_str(l, "..");
+    }
+  }
+  l->buf[l->len] = 0;
+}
+
+static void trace_dump(void (*out)(const char *)) {
+  trace_line l;
+  for(const yc_trace_ring *ring = trace_rings; ring; ring = ring->next) {
+    uint64_t head = trace_load(&ring->head);
+    uint64_t first = head > ring->size ? head - ring->size : 0;
+    for(uint64_t i = first; i < head; i++) {
+      const yc_trace_event *ev = &ring->events[i % ring->size];
+      // Skip events overwritten, or being written, while dumping
+      if(trace_load(&ev->seq) != i + 1) {
+        continue;
+      }
+      trace_format(&l, ring, ev);
+      if(trace_load(&ev->seq) == i + 1) {
+        out(l.buf);
+      }
+    }
+  }
+}
+
+static void trace_stderr(const char *line) {
+  fprintf(stderr, "%s\n", line);
+}
+
+ykpiv_rc ykpiv_trace_enable(size_t events) {
+  if(events > 1000000) {
+    return YKPIV_ARGUMENT_ERROR;
+  }
+  // Rings keep the size they were created with
+  yc_trace_events = events;
+  return YKPIV_OK;
+}
+
+ykpiv_rc ykpiv_trace_dump(void (*out)(const char *line)) {
+  trace_dump(out ? out : trace_stderr);
+  return YKPIV_OK;
+}
+
+#ifndef _WIN32
+static void trace_write(const char *line) {
+  size_t len = strlen(line);
+  while(len) {
+    ssize_t n = write(STDERR_FILENO, line, len);
+    if(n <= 0) {
+      return;
+    }
+    line += n;
+    len -= n;
+  }
+  (void)!write(STDERR_FILENO, "\n", 1);
+}
+
+static void trace_signal(int sig) {
+  (void)sig;
+  trace_dump(trace_write);
+}
+#endif
+
+void yc_trace_init_env(void) {
+  const char *env = getenv("YKPIV_TRACE");
+  if(!env || yc_trace_enabled()) {
+    return;
+  }
+  long events = atol(env);
+  if(ykpiv_trace_enable(events > 0 ? (size_t)events : YC_TRACE_DEFAULT_EVENTS) != YKPIV_OK) {
+    return;
+  }
+#ifndef _WIN32
+  // Don't take over SIGUSR2 from an application that uses it
+  struct sigaction sa, old;
+  if(sigaction(SIGUSR2, NULL, &old) == 0 && old.sa_handler == SIG_DFL && !(old.sa_flags & SA_SIGINFO)) {
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = trace_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR2, &sa, NULL);
+  }
+#endif
+}
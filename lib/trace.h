@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2025 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef YKPIV_TRACE_H
+#define YKPIV_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bytes of a payload kept with each event
+#define YC_TRACE_SLICE 32
+
+// Events recorded per thread when enabled through YKPIV_TRACE without a number
+#define YC_TRACE_DEFAULT_EVENTS 1024
+
+extern volatile size_t yc_trace_events;
+
+#define yc_trace_enabled() (yc_trace_events != 0)
+
+// Record a debug message. Only pointers to the (literal) strings are kept, a payload is kept if data is set.
+void yc_trace_debug(const char *file, int line, const char *func, int lvl, const char *fmt,
+                    const uint8_t *data, size_t len);
+// Number of leading bytes of a command APDU that may be logged. Commands carrying PINs, PUKs, management key
+// challenges and responses or key material only have their header and Lc logged.
+size_t yc_trace_apdu_keep(const uint8_t *send, size_t send_len);
+// Record an exchanged APDU with its status word, as much of it as yc_trace_apdu_keep() allows
+void yc_trace_apdu(const char *file, int line, const char *func, const uint8_t *send, size_t send_len,
+                   size_t recv_len, int sw);
+// Enable tracing from the YKPIV_TRACE environment variable, and dump on SIGUSR2 where supported
+void yc_trace_init_env(void);
+
+#endif
@@ -82,6 +82,11 @@ const uint8_t CCC_TMPL[] = {
 #define CCC_ID_OFFS 9
 
 static ykpiv_rc _read_certificate(ykpiv_state *state, uint8_t slot, uint8_t *buf, size_t *buf_len);
+static ykpiv_rc _parse_certdata(uint8_t *buf, size_t buf_len, uint8_t **cert, size_t *cert_len, uint8_t *compress);
+static size_t _certdata_size(uint8_t *cert, size_t cert_len, uint8_t compress_info);
+#ifdef USE_CERT_COMPRESS
+static ykpiv_rc _inflate_certificate(uint8_t *in, size_t in_len, uint8_t *out, size_t *out_len);
+#endif
 static ykpiv_rc _write_certificate(ykpiv_state *state, uint8_t slot, uint8_t *data, size_t data_len, uint8_t certinfo);
 
 static ykpiv_rc _read_metadata(ykpiv_state *state, uint8_t tag, uint8_t* data, size_t* pcb_data);
@@ -93,15 +98,25 @@ static size_t _obj_size_max(ykpiv_state *state) {
   return (state && state->model == DEVTYPE_NEOr3) ? CB_OBJ_MAX_NEO : CB_OBJ_MAX;
 }
 
-static unsigned long get_length_size(unsigned long length) {
-  if (length < 0x80) {
-    return 1;
-  }
-  else if (length < 0x100) {
-    return 2;
-  }
-  else {
-    return 3;
+// Buffers returned to the caller, and freed with ykpiv_util_free()
+static const ykpiv_allocator *_util_allocator(ykpiv_state *state) {
+  return state->util_allocator.pfn_alloc ? &state->util_allocator : &state->allocator;
+}
+
+static void *_util_alloc(ykpiv_state *state, size_t size) {
+  const ykpiv_allocator *allocator = _util_allocator(state);
+  return allocator->pfn_alloc(allocator->alloc_data, size);
+}
+
+static void *_util_realloc(ykpiv_state *state, void *address, size_t size) {
+  const ykpiv_allocator *allocator = _util_allocator(state);
+  return allocator->pfn_realloc(allocator->alloc_data, address, size);
+}
+
+static void _util_free(ykpiv_state *state, void *data) {
+  const ykpiv_allocator *allocator = _util_allocator(state);
+  if (data) {
+    allocator->pfn_free(allocator->alloc_data, data);
   }
 }
 
@@ -112,10 +127,10 @@ static unsigned long get_length_size(unsigned long length) {
 ykpiv_rc ykpiv_util_get_cardid(ykpiv_state *state, ykpiv_cardid *cardid) {
   ykpiv_rc res = YKPIV_OK;
   uint8_t buf[CB_OBJ_MAX] = {0};
-  unsigned long len = sizeof(buf);
-  uint8_t *p_temp = NULL;
-  size_t offs, cb_temp = 0;
-  uint8_t tag = 0;
+  uint8_t *obj = NULL;
+  unsigned long len = 0;
+  tlv_reader reader;
+  tlv_view tlv = {0};
 
   if (!cardid) return YKPIV_ARGUMENT_ERROR;
    uint8_t scp11 = state->scp11_state.security_level;
@@ -123,33 +138,23 @@ ykpiv_rc ykpiv_util_get_cardid(ykpiv_state *state, ykpiv_cardid *cardid) {
   if (YKPIV_OK != (res = _ykpiv_begin_transaction(state))) return res;
   if (YKPIV_OK != (res = _ykpiv_ensure_application_selected(state, scp11))) goto Cleanup;
 
-  if ((res = _ykpiv_fetch_object(state, YKPIV_OBJ_CHUID, buf, &len)) == YKPIV_OK) {
-    p_temp = buf;
-
-    while (p_temp < (buf + len)) {
-      tag = *p_temp++;
+  if ((res = _ykpiv_fetch_object_view(state, YKPIV_OBJ_CHUID, buf, sizeof(buf), &obj, &len)) == YKPIV_OK) {
+    tlv_reader_init(&reader, obj, len);
 
-      offs = _ykpiv_get_length(p_temp, buf + len, &cb_temp);
-      if (!offs) {
-        res = YKPIV_PARSE_ERROR;
+    if (tlv_find(&reader, TAG_CHUID_UUID, &tlv)) {
+      /* found card uuid */
+      if (tlv.length < YKPIV_CARDID_SIZE) {
+        res = YKPIV_SIZE_ERROR;
         goto Cleanup;
       }
 
-      p_temp += offs;
-
-      if (tag == TAG_CHUID_UUID) {
-        /* found card uuid */
-        if (cb_temp < YKPIV_CARDID_SIZE || p_temp + YKPIV_CARDID_SIZE > buf + len) {
-          res = YKPIV_SIZE_ERROR;
-          goto Cleanup;
-        }
-
-        res = YKPIV_OK;
-        memcpy(cardid->data, p_temp, YKPIV_CARDID_SIZE);
-        goto Cleanup;
-      }
+      memcpy(cardid->data, tlv.value, YKPIV_CARDID_SIZE);
+      goto Cleanup;
+    }
 
-      p_temp += cb_temp;
+    if (reader.error) {
+      res = YKPIV_PARSE_ERROR;
+      goto Cleanup;
     }
 
     /* not found, not malformed */
@@ -254,12 +259,42 @@ Cleanup:
 }
 
 ykpiv_devmodel ykpiv_util_devicemodel(ykpiv_state *state) {
-  if (!state || !state->context || (state->context == (SCARDCONTEXT)-1)) {
+  if (!state) {
+    return DEVTYPE_UNKNOWN;
+  }
+  if (!state->transport.transmit && (!state->context || (state->context == (SCARDCONTEXT)-1))) {
     return DEVTYPE_UNKNOWN;
   }
   return state->model;
 }
 
+static const uint8_t KEY_SLOTS[] = {
+  YKPIV_KEY_AUTHENTICATION,
+  YKPIV_KEY_SIGNATURE,
+  YKPIV_KEY_KEYMGM,
+  YKPIV_KEY_RETIRED1,
+  YKPIV_KEY_RETIRED2,
+  YKPIV_KEY_RETIRED3,
+  YKPIV_KEY_RETIRED4,
+  YKPIV_KEY_RETIRED5,
+  YKPIV_KEY_RETIRED6,
+  YKPIV_KEY_RETIRED7,
+  YKPIV_KEY_RETIRED8,
+  YKPIV_KEY_RETIRED9,
+  YKPIV_KEY_RETIRED10,
+  YKPIV_KEY_RETIRED11,
+  YKPIV_KEY_RETIRED12,
+  YKPIV_KEY_RETIRED13,
+  YKPIV_KEY_RETIRED14,
+  YKPIV_KEY_RETIRED15,
+  YKPIV_KEY_RETIRED16,
+  YKPIV_KEY_RETIRED17,
+  YKPIV_KEY_RETIRED18,
+  YKPIV_KEY_RETIRED19,
+  YKPIV_KEY_RETIRED20,
+  YKPIV_KEY_CARDAUTH
+};
+
 ykpiv_rc ykpiv_util_list_keys(ykpiv_state *state, uint8_t *key_count, ykpiv_key **data, size_t *data_len) {
   ykpiv_rc res = YKPIV_OK;
   ykpiv_key *pKey = NULL;
@@ -274,33 +309,6 @@ ykpiv_rc ykpiv_util_list_keys(ykpiv_state *state, uint8_t *key_count, ykpiv_key
 
   const size_t CB_PAGE = 4096;
 
-  const uint8_t SLOTS[] = {
-    YKPIV_KEY_AUTHENTICATION,
-    YKPIV_KEY_SIGNATURE,
-    YKPIV_KEY_KEYMGM,
-    YKPIV_KEY_RETIRED1,
-    YKPIV_KEY_RETIRED2,
-    YKPIV_KEY_RETIRED3,
-    YKPIV_KEY_RETIRED4,
-    YKPIV_KEY_RETIRED5,
-    YKPIV_KEY_RETIRED6,
-    YKPIV_KEY_RETIRED7,
-    YKPIV_KEY_RETIRED8,
-    YKPIV_KEY_RETIRED9,
-    YKPIV_KEY_RETIRED10,
-    YKPIV_KEY_RETIRED11,
-    YKPIV_KEY_RETIRED12,
-    YKPIV_KEY_RETIRED13,
-    YKPIV_KEY_RETIRED14,
-    YKPIV_KEY_RETIRED15,
-    YKPIV_KEY_RETIRED16,
-    YKPIV_KEY_RETIRED17,
-    YKPIV_KEY_RETIRED18,
-    YKPIV_KEY_RETIRED19,
-    YKPIV_KEY_RETIRED20,
-    YKPIV_KEY_CARDAUTH
-  };
-
   if ((NULL == data) || (NULL == data_len) || (NULL == key_count)) { return YKPIV_ARGUMENT_ERROR; }
 
   uint8_t scp11 = state->scp11_state.security_level;
@@ -313,16 +321,16 @@ ykpiv_rc ykpiv_util_list_keys(ykpiv_state *state, uint8_t *key_count, ykpiv_key
   *data_len = 0;
 
   // allocate initial page of buffer
-  if (NULL == (pData = _ykpiv_alloc(state, CB_PAGE))) {
+  if (NULL == (pData = _util_alloc(state, CB_PAGE))) {
     res = YKPIV_MEMORY_ERROR;
     goto Cleanup;
   }
 
   cbData = CB_PAGE;
 
-  for (i = 0; i < sizeof(SLOTS); i++) {
+  for (i = 0; i < sizeof(KEY_SLOTS); i++) {
     cbBuf = sizeof(buf);
-    res = _read_certificate(state, SLOTS[i], buf, &cbBuf);
+    res = _read_certificate(state, KEY_SLOTS[i], buf, &cbBuf);
 
     if ((res == YKPIV_OK) && (cbBuf > 0)) {
       // add current slot to result, grow result buffer if necessary
@@ -330,7 +338,7 @@ ykpiv_rc ykpiv_util_list_keys(ykpiv_state *state, uint8_t *key_count, ykpiv_key
       cbRealloc = (sizeof(ykpiv_key) + cbBuf - 1) > (cbData - offset) ? MAX((sizeof(ykpiv_key) + cbBuf - 1) - (cbData - offset), CB_PAGE) : 0;
 
       if (0 != cbRealloc) {
-        if (!(pTemp = _ykpiv_realloc(state, pData, cbData + cbRealloc))) {
+        if (!(pTemp = _util_realloc(state, pData, cbData + cbRealloc))) {
           /* realloc failed, pData will be freed in cleanup */
           res = YKPIV_MEMORY_ERROR;
           goto Cleanup;
@@ -348,7 +356,7 @@ ykpiv_rc ykpiv_util_list_keys(ykpiv_state *state, uint8_t *key_count, ykpiv_key
 
       pKey = (ykpiv_key*)(pData + offset);
 
-      pKey->slot = SLOTS[i];
+      pKey->slot = KEY_SLOTS[i];
       pKey->cert_len = (uint16_t)cbBuf;
       memcpy(pKey->cert, buf, cbBuf);
 
@@ -368,27 +376,136 @@ ykpiv_rc ykpiv_util_list_keys(ykpiv_state *state, uint8_t *key_count, ykpiv_key
 
 Cleanup:
 
-  if (pData) { _ykpiv_free(state, pData); }
+  if (pData) { _util_free(state, pData); }
 
   _ykpiv_end_transaction(state);
   return res;
 }
 
+ykpiv_rc ykpiv_util_list_keys_ex(ykpiv_state *state, uint32_t flags, ykpiv_key_info **keys, size_t *key_count) {
+  ykpiv_rc res = YKPIV_OK;
+  ykpiv_key_info *pKeys = NULL;
+  uint8_t *pCerts = NULL;
+  size_t cbCerts = 0;
+  size_t offset = 0;
+  size_t count = 0;
+  size_t i = 0;
+  bool metadata = true;
+
+  if ((NULL == state) || (NULL == keys) || (NULL == key_count)) { return YKPIV_ARGUMENT_ERROR; }
+
+  *keys = NULL;
+  *key_count = 0;
+
+  // Allocate the result once, certificates are packed after the array of keys
+  if (flags & YKPIV_LIST_KEYS_CERTS) {
+    cbCerts = sizeof(KEY_SLOTS) * CB_BUF_MAX;
+  }
+  if (NULL == (pKeys = _util_alloc(state, sizeof(KEY_SLOTS) * sizeof(ykpiv_key_info) + cbCerts))) {
+    return YKPIV_MEMORY_ERROR;
+  }
+  memset(pKeys, 0, sizeof(KEY_SLOTS) * sizeof(ykpiv_key_info));
+  pCerts = (uint8_t*)(pKeys + sizeof(KEY_SLOTS));
+
+  uint8_t scp11 = state->scp11_state.security_level;
+  if (YKPIV_OK != (res = _ykpiv_begin_transaction(state))) goto Cleanup;
+  if (YKPIV_OK != (res = _ykpiv_ensure_application_selected(state, scp11))) goto EndTransaction;
+
+  for (i = 0; i < sizeof(KEY_SLOTS); i++) {
+    ykpiv_key_info *pKey = pKeys + count;
+    bool present = false;
+
+    if (metadata) {
+      uint8_t data[YKPIV_OBJ_MAX_SIZE] = {0};
+      unsigned long cbData = sizeof(data);
+      ykpiv_metadata md = {0};
+
+      res = _ykpiv_get_metadata(state, KEY_SLOTS[i], data, &cbData);
+      if (YKPIV_OK == res) {
+        if (YKPIV_OK != (res = ykpiv_util_parse_metadata(data, cbData, &md))) {
+          goto EndTransaction;
+        }
+        pKey->algorithm = md.algorithm;
+        pKey->pin_policy = md.pin_policy;
+        pKey->touch_policy = md.touch_policy;
+        pKey->origin = md.origin;
+        present = true;
+      } else if (YKPIV_NOT_SUPPORTED == res && 0 == i) {
+        // Older firmware, fall back to looking for certificates
+        DBG("Metadata not supported, listing keys with a certificate");
+        metadata = false;
+      } else if (YKPIV_KEY_ERROR != res) {
+        goto EndTransaction;
+      }
+    }
+
+    if (!metadata || (present && (flags & YKPIV_LIST_KEYS_CERTS))) {
+      uint8_t buf[CB_BUF_MAX] = {0};
+      size_t cbBuf = (flags & YKPIV_LIST_KEYS_CERTS) ? cbCerts - offset : sizeof(buf);
+      uint8_t *pBuf = (flags & YKPIV_LIST_KEYS_CERTS) ? pCerts + offset : buf;
+
+      if (YKPIV_OK == _read_certificate(state, KEY_SLOTS[i], pBuf, &cbBuf) && cbBuf > 0) {
+        if (flags & YKPIV_LIST_KEYS_CERTS) {
+          pKey->cert = pBuf;
+          pKey->cert_len = cbBuf;
+          offset += cbBuf;
+        }
+        present = true;
+      }
+    }
+
+    if (present) {
+      pKey->slot = KEY_SLOTS[i];
+      count++;
+    }
+  }
+
+  *keys = pKeys;
+  *key_count = count;
+  pKeys = NULL;
+  res = YKPIV_OK;
+
+EndTransaction:
+  _ykpiv_end_transaction(state);
+
+Cleanup:
+  if (pKeys) { _util_free(state, pKeys); }
+  return res;
+}
+
 ykpiv_rc ykpiv_util_free(ykpiv_state *state, void *data) {
   if (!data) return YKPIV_OK;
   if (!state || (!(state->allocator.pfn_free))) return YKPIV_ARGUMENT_ERROR;
 
-  _ykpiv_free(state, data);
+  _util_free(state, data);
 
   return YKPIV_OK;
 }
 
+ykpiv_rc ykpiv_util_set_allocator(ykpiv_state *state, const ykpiv_allocator *allocator) {
+  if (!state) return YKPIV_ARGUMENT_ERROR;
+  if (allocator && (!allocator->pfn_alloc || !allocator->pfn_realloc || !allocator->pfn_free)) return YKPIV_ARGUMENT_ERROR;
+
+  if (allocator) {
+    state->util_allocator = *allocator;
+  } else {
+    memset(&state->util_allocator, 0, sizeof(state->util_allocator));
+  }
+  return YKPIV_OK;
+}
+
 ykpiv_rc ykpiv_util_read_cert(ykpiv_state *state, uint8_t slot, uint8_t **data, size_t *data_len) {
   ykpiv_rc res = YKPIV_OK;
-  uint8_t buf[CB_BUF_MAX] = {0};
-  size_t cbBuf = sizeof(buf);
+  uint8_t buf[YKPIV_OBJ_MAX_SIZE];
+  uint8_t *payload = NULL;
+  unsigned long payload_len = 0;
+  uint8_t *cert = NULL;
+  size_t cert_len = 0;
+  uint8_t compress_info = YKPIV_CERTINFO_UNCOMPRESSED;
+  int object_id = (int)ykpiv_util_slot_object(slot);
 
   if ((NULL == data )|| (NULL == data_len)) return YKPIV_ARGUMENT_ERROR;
+  if (-1 == object_id) return YKPIV_INVALID_OBJECT;
 
   uint8_t scp11 = state->scp11_state.security_level;
   if (YKPIV_OK != (res = _ykpiv_begin_transaction(state))) return res;
@@ -397,24 +514,39 @@ ykpiv_rc ykpiv_util_read_cert(ykpiv_state *state, uint8_t slot, uint8_t **data,
   *data = 0;
   *data_len = 0;
 
-  if (YKPIV_OK == (res = _read_certificate(state, slot, buf, &cbBuf))) {
+  if (YKPIV_OK != (res = _ykpiv_fetch_object_view(state, object_id, buf, sizeof(buf), &payload, &payload_len))) goto Cleanup;
+  if (YKPIV_OK != (res = _parse_certdata(payload, payload_len, &cert, &cert_len, &compress_info))) goto Cleanup;
 
-    /* handle those who write empty certificate blobs to PIV objects */
-    if (cbBuf == 0) {
-      *data = NULL;
-      *data_len = 0;
-      goto Cleanup;
-    }
+  /* handle those who write empty certificate blobs to PIV objects */
+  if (cert_len == 0) {
+    goto Cleanup;
+  }
 
-    if (!(*data = _ykpiv_alloc(state, cbBuf))) {
-      res = YKPIV_MEMORY_ERROR;
+  // Allocate the result up front and decompress straight into it
+  size_t cbData = _certdata_size(cert, cert_len, compress_info);
+  if (cbData == 0) {
+    DBG("Invalid compressed certificate");
+    res = YKPIV_INVALID_OBJECT;
+    goto Cleanup;
+  }
+  if (!(*data = _util_alloc(state, cbData))) {
+    res = YKPIV_MEMORY_ERROR;
+    goto Cleanup;
+  }
+
+#ifdef USE_CERT_COMPRESS
+  if (compress_info == YKPIV_CERTINFO_GZIP) {
+    if (YKPIV_OK != (res = _inflate_certificate(cert, cert_len, *data, &cbData))) {
+      _util_free(state, *data);
+      *data = NULL;
       goto Cleanup;
     }
-
-    memcpy(*data, buf, cbBuf);
-
-    *data_len = cbBuf;
+  } else
+#endif
+  {
+    memcpy(*data, cert, cbData);
   }
+  *data_len = cbData;
 
 Cleanup:
 
@@ -504,9 +636,10 @@ Cleanup:
 ykpiv_rc ykpiv_util_read_mscmap(ykpiv_state *state, ykpiv_container **containers, size_t *n_containers) {
   ykpiv_rc res = YKPIV_OK;
   uint8_t buf[CB_BUF_MAX] = {0};
-  unsigned long cbBuf = sizeof(buf);
-  size_t offs, len = 0;
-  uint8_t *ptr = NULL;
+  uint8_t *obj = NULL;
+  unsigned long cbBuf = 0;
+  tlv_reader reader;
+  tlv_view tlv = {0};
 
   if ((NULL == containers) || (NULL == n_containers)) { res = YKPIV_ARGUMENT_ERROR; goto Cleanup; }
 
@@ -517,32 +650,20 @@ ykpiv_rc ykpiv_util_read_mscmap(ykpiv_state *state, ykpiv_container **containers
   *containers = 0;
   *n_containers = 0;
 
-  if (YKPIV_OK == (res = _ykpiv_fetch_object(state, YKPIV_OBJ_MSCMAP, buf, &cbBuf))) {
-    ptr = buf;
-
-    /* check that object contents are at least large enough to read the header */
-    if (cbBuf < CB_OBJ_TAG_MIN) {
-      res = YKPIV_OK;
-      goto Cleanup;
-    }
-
-    if (*ptr++ == TAG_MSCMAP) {
-      offs = _ykpiv_get_length(ptr, buf + cbBuf, &len);
-      if(!offs) {
-        res = YKPIV_OK;
-        goto Cleanup;
-      }
-      ptr += offs;
+  if (YKPIV_OK == (res = _ykpiv_fetch_object_view(state, YKPIV_OBJ_MSCMAP, buf, sizeof(buf), &obj, &cbBuf))) {
+    tlv_reader_init(&reader, obj, cbBuf);
 
-      if (NULL == (*containers = _ykpiv_alloc(state, len))) {
+    /* an object too short or malformed to hold the header is treated as empty */
+    if (tlv_next(&reader, &tlv) && tlv.tag == TAG_MSCMAP) {
+      if (NULL == (*containers = _util_alloc(state, tlv.length))) {
         res = YKPIV_MEMORY_ERROR;
         goto Cleanup;
       }
 
       /* should check if container map isn't corrupt */
 
-      memcpy(*containers, ptr, len);
-      *n_containers = len / sizeof(ykpiv_container);
+      memcpy(*containers, tlv.value, tlv.length);
+      *n_containers = tlv.length / sizeof(ykpiv_container);
     }
   }
 
@@ -555,8 +676,7 @@ Cleanup:
 ykpiv_rc ykpiv_util_write_mscmap(ykpiv_state *state, ykpiv_container *containers, size_t n_containers) {
   ykpiv_rc res = YKPIV_OK;
   uint8_t buf[CB_OBJ_MAX] = {0};
-  size_t offset = 0;
-  size_t req_len = 0;
+  tlv_writer writer;
   size_t data_len = n_containers * sizeof(ykpiv_container);
   uint8_t scp11 = state->scp11_state.security_level;
 
@@ -582,20 +702,14 @@ ykpiv_rc ykpiv_util_write_mscmap(ykpiv_state *state, ykpiv_container *containers
   // encode object data for storage
 
   // calculate the required length of the encoded object
-  req_len = 1 /* data tag */ + (unsigned long)_ykpiv_set_length(buf, data_len) + data_len;
-
-  if (req_len > _obj_size_max(state)) {
+  tlv_writer_init(&writer, buf, _obj_size_max(state));
+  if (!tlv_put(&writer, TAG_MSCMAP, containers, data_len)) {
     res = YKPIV_SIZE_ERROR;
     goto Cleanup;
   }
 
-  buf[offset++] = TAG_MSCMAP;
-  offset += _ykpiv_set_length(buf + offset, data_len);
-  memcpy(buf + offset, (uint8_t*)containers, data_len);
-  offset += data_len;
-
   // write onto device
-  res = _ykpiv_save_object(state, YKPIV_OBJ_MSCMAP, buf, offset);
+  res = _ykpiv_save_object(state, YKPIV_OBJ_MSCMAP, buf, (size_t)(writer.ptr - buf));
 
 Cleanup:
 
@@ -606,11 +720,11 @@ Cleanup:
 ykpiv_rc ykpiv_util_read_msroots(ykpiv_state *state, uint8_t **data, size_t *data_len) {
   ykpiv_rc res = YKPIV_OK;
   uint8_t buf[CB_BUF_MAX] = {0};
-  unsigned long cbBuf = sizeof(buf);
-  size_t offs, len = 0;
-  uint8_t *ptr = NULL;
+  uint8_t *obj = NULL;
+  unsigned long cbBuf = 0;
+  tlv_reader reader;
+  tlv_view tlv = {0};
   int object_id = 0;
-  uint8_t tag = 0;
   uint8_t *pData = NULL;
   uint8_t *pTemp = NULL;
   size_t cbData = 0;
@@ -628,42 +742,27 @@ ykpiv_rc ykpiv_util_read_msroots(ykpiv_state *state, uint8_t **data, size_t *dat
 
   // allocate first page
   cbData = _obj_size_max(state);
-  if (NULL == (pData = _ykpiv_alloc(state, cbData))) { res = YKPIV_MEMORY_ERROR; goto Cleanup; }
+  if (NULL == (pData = _util_alloc(state, cbData))) { res = YKPIV_MEMORY_ERROR; goto Cleanup; }
 
   for (object_id = YKPIV_OBJ_MSROOTS1; object_id <= YKPIV_OBJ_MSROOTS5; object_id++) {
-    cbBuf = sizeof(buf);
-
-    if (YKPIV_OK != (res = _ykpiv_fetch_object(state, object_id, buf, &cbBuf))) {
+    if (YKPIV_OK != (res = _ykpiv_fetch_object_view(state, object_id, buf, sizeof(buf), &obj, &cbBuf))) {
       goto Cleanup;
     }
 
-    ptr = buf;
-
-    if (cbBuf < CB_OBJ_TAG_MIN) {
-      res = YKPIV_OK;
-      goto Cleanup;
-    }
+    tlv_reader_init(&reader, obj, cbBuf);
 
-    tag = *ptr++;
-
-    if (((TAG_MSROOTS_MID != tag) && (TAG_MSROOTS_END != tag)) ||
-        ((YKPIV_OBJ_MSROOTS5 == object_id) && (TAG_MSROOTS_END != tag))) {
+    if (!tlv_next(&reader, &tlv) ||
+        ((TAG_MSROOTS_MID != tlv.tag) && (TAG_MSROOTS_END != tlv.tag)) ||
+        ((YKPIV_OBJ_MSROOTS5 == object_id) && (TAG_MSROOTS_END != tlv.tag))) {
       // the current object doesn't contain a valid part of a msroots file
       res = YKPIV_OK; // treat condition as object isn't found
       goto Cleanup;
     }
 
-    offs = _ykpiv_get_length(ptr, buf + cbBuf, &len);
-    if(!offs) {
-      res = YKPIV_OK;
-      goto Cleanup;
-    }
-    ptr += offs;
-
-    cbRealloc = len > (cbData - offset) ? len - (cbData - offset) : 0;
+    cbRealloc = tlv.length > (cbData - offset) ? tlv.length - (cbData - offset) : 0;
 
     if (0 != cbRealloc) {
-      if (!(pTemp = _ykpiv_realloc(state, pData, cbData + cbRealloc))) {
+      if (!(pTemp = _util_realloc(state, pData, cbData + cbRealloc))) {
         /* realloc failed, pData will be freed in cleanup */
         res = YKPIV_MEMORY_ERROR;
         goto Cleanup;
@@ -674,10 +773,10 @@ ykpiv_rc ykpiv_util_read_msroots(ykpiv_state *state, uint8_t **data, size_t *dat
 
     cbData += cbRealloc;
 
-    memcpy(pData + offset, ptr, len);
-    offset += len;
+    memcpy(pData + offset, tlv.value, tlv.length);
+    offset += tlv.length;
 
-    if (TAG_MSROOTS_END == tag) {
+    if (TAG_MSROOTS_END == tlv.tag) {
       break;
     }
   }
@@ -691,7 +790,68 @@ ykpiv_rc ykpiv_util_read_msroots(ykpiv_state *state, uint8_t **data, size_t *dat
 
 Cleanup:
 
-  if (pData) { _ykpiv_free(state, pData); }
+  if (pData) { _util_free(state, pData); }
+
+  _ykpiv_end_transaction(state);
+  return res;
+}
+
+typedef struct {
+  tlv_stream part;
+  bool last_object;
+  bool invalid; // The object doesn't hold a valid part, nothing more is read
+  ykpiv_pfn_chunk pfn_chunk;
+  void *chunk_data;
+} _msroots_stream;
+
+static ykpiv_rc _msroots_chunk(void *chunk_data, const unsigned char *data, size_t len) {
+  _msroots_stream *msroots = (_msroots_stream *) chunk_data;
+  if (msroots->invalid || !tlv_stream_header(&msroots->part, &data, &len)) {
+    msroots->invalid |= msroots->part.error;
+    return YKPIV_OK;
+  }
+  if (((TAG_MSROOTS_MID != msroots->part.tag) && (TAG_MSROOTS_END != msroots->part.tag)) ||
+      (msroots->last_object && (TAG_MSROOTS_END != msroots->part.tag))) {
+    msroots->invalid = true;
+    return YKPIV_OK;
+  }
+  size_t value_len = 0;
+  const unsigned char *value = tlv_stream_value(&msroots->part, &data, &len, &value_len);
+  return value_len ? msroots->pfn_chunk(msroots->chunk_data, value, value_len) : YKPIV_OK;
+}
+
+ykpiv_rc ykpiv_util_read_msroots_cb(ykpiv_state *state, ykpiv_pfn_chunk pfn_chunk, void *chunk_data) {
+  ykpiv_rc res = YKPIV_OK;
+  _msroots_stream msroots = {{{0}}};
+
+  if (!pfn_chunk) return YKPIV_ARGUMENT_ERROR;
+
+  uint8_t scp11 = state->scp11_state.security_level;
+  if (YKPIV_OK != (res = _ykpiv_begin_transaction(state))) return res;
+  if (YKPIV_OK != (res = _ykpiv_ensure_application_selected(state, scp11))) goto Cleanup;
+
+  msroots.pfn_chunk = pfn_chunk;
+  msroots.chunk_data = chunk_data;
+
+  for (int object_id = YKPIV_OBJ_MSROOTS1; object_id <= YKPIV_OBJ_MSROOTS5; object_id++) {
+    tlv_stream_init(&msroots.part);
+    msroots.last_object = YKPIV_OBJ_MSROOTS5 == object_id;
+
+    if (YKPIV_OK != (res = _ykpiv_fetch_object_stream(state, object_id, _msroots_chunk, &msroots))) {
+      goto Cleanup;
+    }
+
+    // the current object doesn't contain a valid part of a msroots file
+    if (msroots.invalid || !msroots.part.complete || msroots.part.remaining) {
+      break;
+    }
+
+    if (TAG_MSROOTS_END == msroots.part.tag) {
+      break;
+    }
+  }
+
+Cleanup:
 
   _ykpiv_end_transaction(state);
   return res;
@@ -921,7 +1081,7 @@ ykpiv_rc ykpiv_util_generate_key(ykpiv_state *state, uint8_t slot, uint8_t algor
     data_ptr += offs;
 
     cb_modulus = len;
-    if (NULL == (ptr_modulus = _ykpiv_alloc(state, cb_modulus))) {
+    if (NULL == (ptr_modulus = _util_alloc(state, cb_modulus))) {
       DBG("Failed to allocate memory for modulus.");
       res = YKPIV_MEMORY_ERROR;
       goto Cleanup;
@@ -947,7 +1107,7 @@ ykpiv_rc ykpiv_util_generate_key(ykpiv_state *state, uint8_t slot, uint8_t algor
     data_ptr += offs;
 
     cb_exp = len;
-    if (NULL == (ptr_exp = _ykpiv_alloc(state, cb_exp))) {
+    if (NULL == (ptr_exp = _util_alloc(state, cb_exp))) {
       DBG("Failed to allocate memory for public exponent.");
       res = YKPIV_MEMORY_ERROR;
       goto Cleanup;
@@ -989,7 +1149,7 @@ ykpiv_rc ykpiv_util_generate_key(ykpiv_state *state, uint8_t slot, uint8_t algor
     }
 
     cb_point = len;
-    if (NULL == (ptr_point = _ykpiv_alloc(state, cb_point))) {
+    if (NULL == (ptr_point = _util_alloc(state, cb_point))) {
       DBG("Failed to allocate memory for public point.");
       res = YKPIV_MEMORY_ERROR;
       goto Cleanup;
@@ -1011,9 +1171,9 @@ ykpiv_rc ykpiv_util_generate_key(ykpiv_state *state, uint8_t slot, uint8_t algor
 
 Cleanup:
 
-  if (ptr_modulus) { _ykpiv_free(state, ptr_modulus); }
-  if (ptr_exp) { _ykpiv_free(state, ptr_exp); }
-  if (ptr_point) { _ykpiv_free(state, ptr_point); }
+  if (ptr_modulus) { _util_free(state, ptr_modulus); }
+  if (ptr_exp) { _util_free(state, ptr_exp); }
+  if (ptr_point) { _util_free(state, ptr_point); }
 
   _ykpiv_end_transaction(state);
   return res;
@@ -1140,6 +1300,31 @@ Cleanup:
   return res;
 }
 
+ykpiv_rc ykpiv_util_set_mgm_cache(ykpiv_state *state, bool enable) {
+  if (NULL == state) return YKPIV_ARGUMENT_ERROR;
+#if DISABLE_MGM_KEY_CACHE
+  if (enable) return YKPIV_NOT_SUPPORTED;
+#endif
+  state->mgm_cache.enabled = false;
+  _ykpiv_clear_mgm_cache(state);
+  state->mgm_cache.enabled = enable;
+  return YKPIV_OK;
+}
+
+/*
+** Returns true if values cached for the connected card can be used or stored, dropping those of another card.
+*/
+static bool _mgm_cache_usable(ykpiv_state *state) {
+  if (!state->mgm_cache.enabled || 0 == state->serial) {
+    return false;
+  }
+  if (state->mgm_cache.serial != state->serial) {
+    _ykpiv_clear_mgm_cache(state);
+    state->mgm_cache.serial = state->serial;
+  }
+  return true;
+}
+
 ykpiv_rc ykpiv_util_get_derived_mgm(ykpiv_state *state, const uint8_t *pin, const size_t pin_len, ykpiv_mgm *mgm) {
   ykpiv_rc res = YKPIV_OK;
   pkcs5_rc p5rc = PKCS5_OK;
@@ -1147,34 +1332,64 @@ ykpiv_rc ykpiv_util_get_derived_mgm(ykpiv_state *state, const uint8_t *pin, cons
   size_t   cb_data = sizeof(data);
   uint8_t  *p_item = NULL;
   size_t   cb_item = 0;
+  uint8_t  salt[CB_ADMIN_SALT] = { 0 };
+  ykpiv_mgm_cache *cache = NULL;
 
   if (NULL == state) return YKPIV_ARGUMENT_ERROR;
   if ((NULL == pin) || (0 == pin_len) || (NULL == mgm)) return YKPIV_ARGUMENT_ERROR;
 
-  uint8_t scp11 = state->scp11_state.security_level;
-  if (YKPIV_OK != (res = _ykpiv_begin_transaction(state))) return res;
-  if (YKPIV_OK != (res = _ykpiv_ensure_application_selected(state, scp11))) goto Cleanup;
+  if (_mgm_cache_usable(state)) {
+    cache = &state->mgm_cache;
+    if (cache->has_derived && cache->pin_len == pin_len && !memcmp(cache->pin, pin, pin_len)) {
+      DBG("using cached derived mgm key for card #%u", state->serial);
+      memcpy(mgm, &cache->derived, sizeof(*mgm));
+      return YKPIV_OK;
+    }
+  }
 
-  /* recover management key */
-  if (YKPIV_OK == (res = _read_metadata(state, TAG_ADMIN, data, &cb_data))) {
-    if (YKPIV_OK == (res = _get_metadata_item(data, cb_data, TAG_ADMIN_SALT, &p_item, &cb_item))) {
+  if (cache && cache->has_salt) {
+    memcpy(salt, cache->salt, sizeof(salt));
+  }
+  else {
+    uint8_t scp11 = state->scp11_state.security_level;
+    if (YKPIV_OK != (res = _ykpiv_begin_transaction(state))) return res;
+    if (YKPIV_OK == (res = _ykpiv_ensure_application_selected(state, scp11)) &&
+        YKPIV_OK == (res = _read_metadata(state, TAG_ADMIN, data, &cb_data)) &&
+        YKPIV_OK == (res = _get_metadata_item(data, cb_data, TAG_ADMIN_SALT, &p_item, &cb_item))) {
       if (cb_item != CB_ADMIN_SALT) {
         DBG("derived mgm salt exists, but is incorrect size = %lu", (unsigned long)cb_item);
         res = YKPIV_GENERIC_ERROR;
-        goto Cleanup;
       }
-      mgm->len = DES_LEN_3DES;
-      if (PKCS5_OK != (p5rc = pkcs5_pbkdf2_sha1(pin, pin_len, p_item, cb_item, ITER_MGM_PBKDF2, mgm->data, mgm->len))) {
-        DBG("pbkdf2 failure, err = %d", p5rc);
-        res = YKPIV_GENERIC_ERROR;
-        goto Cleanup;
+      else {
+        memcpy(salt, p_item, cb_item);
       }
     }
+    _ykpiv_end_transaction(state);
+    if (YKPIV_OK != res) goto Cleanup;
+  }
+
+  /* recover management key */
+  mgm->len = DES_LEN_3DES;
+  if (PKCS5_OK != (p5rc = pkcs5_pbkdf2_sha1(pin, pin_len, salt, sizeof(salt), ITER_MGM_PBKDF2, mgm->data, mgm->len))) {
+    DBG("pbkdf2 failure, err = %d", p5rc);
+    res = YKPIV_GENERIC_ERROR;
+    goto Cleanup;
+  }
+
+  if (cache) {
+    memcpy(cache->salt, salt, sizeof(salt));
+    cache->has_salt = true;
+    if (pin_len <= sizeof(cache->pin)) {
+      memcpy(cache->pin, pin, pin_len);
+      cache->pin_len = pin_len;
+      memcpy(&cache->derived, mgm, sizeof(*mgm));
+      cache->has_derived = true;
+    }
   }
 
 Cleanup:
 
-  _ykpiv_end_transaction(state);
+  yc_memzero(salt, sizeof(salt));
   return res;
 }
 
@@ -1189,6 +1404,12 @@ ykpiv_rc ykpiv_util_get_protected_mgm(ykpiv_state *state, ykpiv_mgm *mgm) {
   if (NULL == mgm) return YKPIV_ARGUMENT_ERROR;
   uint8_t scp11 = state->scp11_state.security_level;
 
+  if (_mgm_cache_usable(state) && state->mgm_cache.has_protected) {
+    DBG("using cached protected mgm key for card #%u", state->serial);
+    memcpy(mgm, &state->mgm_cache.protected_mgm, sizeof(*mgm));
+    return YKPIV_OK;
+  }
+
   if (YKPIV_OK != (res = _ykpiv_begin_transaction(state))) return res;
   if (YKPIV_OK != (res = _ykpiv_ensure_application_selected(state, scp11))) goto Cleanup;
 
@@ -1211,6 +1432,11 @@ ykpiv_rc ykpiv_util_get_protected_mgm(ykpiv_state *state, ykpiv_mgm *mgm) {
   mgm->len = cb_item;
   memcpy(mgm->data, p_item, cb_item);
 
+  if (_mgm_cache_usable(state)) {
+    memcpy(&state->mgm_cache.protected_mgm, mgm, sizeof(*mgm));
+    state->mgm_cache.has_protected = true;
+  }
+
 Cleanup:
 
   yc_memzero(data, sizeof(data));
@@ -1220,6 +1446,59 @@ Cleanup:
 
 }
 
+ykpiv_rc ykpiv_authenticate_derived(ykpiv_state *state, const uint8_t *pin, size_t pin_len) {
+  ykpiv_rc res = YKPIV_OK;
+  ykpiv_mgm mgm = { 0 };
+
+  if (NULL == state) return YKPIV_ARGUMENT_ERROR;
+  if ((NULL == pin) || (0 == pin_len)) return YKPIV_ARGUMENT_ERROR;
+
+  if (YKPIV_OK != (res = _ykpiv_begin_transaction(state))) return res;
+
+  bool cached = _mgm_cache_usable(state) && state->mgm_cache.has_salt;
+  if (YKPIV_OK != (res = ykpiv_util_get_derived_mgm(state, pin, pin_len, &mgm))) goto Cleanup;
+  res = ykpiv_authenticate2(state, mgm.data, mgm.len);
+  if (YKPIV_AUTHENTICATION_ERROR == res && cached) {
+    /* the salt may have been changed through another state, try again with the one on the card */
+    DBG("cached derived mgm key of card #%u rejected, reading the salt again", state->serial);
+    _ykpiv_clear_mgm_cache(state);
+    if (YKPIV_OK != (res = ykpiv_util_get_derived_mgm(state, pin, pin_len, &mgm))) goto Cleanup;
+    res = ykpiv_authenticate2(state, mgm.data, mgm.len);
+  }
+
+Cleanup:
+
+  yc_memzero(&mgm, sizeof(mgm));
+  _ykpiv_end_transaction(state);
+  return res;
+}
+
+ykpiv_rc ykpiv_authenticate_protected(ykpiv_state *state) {
+  ykpiv_rc res = YKPIV_OK;
+  ykpiv_mgm mgm = { 0 };
+
+  if (NULL == state) return YKPIV_ARGUMENT_ERROR;
+
+  if (YKPIV_OK != (res = _ykpiv_begin_transaction(state))) return res;
+
+  bool cached = _mgm_cache_usable(state) && state->mgm_cache.has_protected;
+  if (YKPIV_OK != (res = ykpiv_util_get_protected_mgm(state, &mgm))) goto Cleanup;
+  res = ykpiv_authenticate2(state, mgm.data, mgm.len);
+  if (YKPIV_AUTHENTICATION_ERROR == res && cached) {
+    /* the key may have been changed through another state, try again with the one on the card */
+    DBG("cached protected mgm key of card #%u rejected, reading it again", state->serial);
+    _ykpiv_clear_mgm_cache(state);
+    if (YKPIV_OK != (res = ykpiv_util_get_protected_mgm(state, &mgm))) goto Cleanup;
+    res = ykpiv_authenticate2(state, mgm.data, mgm.len);
+  }
+
+Cleanup:
+
+  yc_memzero(&mgm, sizeof(mgm));
+  _ykpiv_end_transaction(state);
+  return res;
+}
+
 ykpiv_rc ykpiv_util_update_protected_mgm(ykpiv_state *state, ykpiv_mgm *mgm) {
   ykpiv_rc res = YKPIV_OK;
   uint8_t data[CB_BUF_MAX] = {0};
@@ -1394,7 +1673,11 @@ ykpiv_rc ykpiv_util_reset(ykpiv_state *state) {
   if(res != YKPIV_OK) {
     return res;
   }
-  return ykpiv_translate_sw_ex(__FUNCTION__, sw);
+  res = ykpiv_translate_sw_ex(__FUNCTION__, sw);
+  if(res == YKPIV_OK) {
+    _ykpiv_clear_mgm_cache(state);
+  }
+  return res;
 }
 
 uint32_t ykpiv_util_slot_object(uint8_t slot) {
@@ -1431,111 +1714,193 @@ uint32_t ykpiv_util_slot_object(uint8_t slot) {
   return (uint32_t)object_id;
 }
 
- ykpiv_rc ykpiv_util_get_certdata(uint8_t *buf, size_t buf_len, uint8_t* certdata, size_t *certdata_len) {
+ static ykpiv_rc _parse_certdata(uint8_t *buf, size_t buf_len, uint8_t **cert, size_t *cert_len, uint8_t *compress) {
    uint8_t compress_info = YKPIV_CERTINFO_UNCOMPRESSED;
    uint8_t *certptr = 0;
-   size_t cert_len = 0;
-   uint8_t *ptr = buf;
-
-   while (ptr < buf + buf_len) {
-     uint8_t tag = *ptr++;
-     size_t len = 0;
-     size_t offs = _ykpiv_get_length(ptr, buf + buf_len, &len);
-     if(!offs) {
-       DBG("Found invalid length for tag 0x%02x.", tag);
-       goto invalid_tlv;
-     }
-     ptr += offs; // move to after length bytes
-
-     switch (tag) {
+   size_t certptr_len = 0;
+   tlv_reader reader;
+   tlv_view tlv = {0};
+   bool valid = true;
+
+   tlv_reader_init(&reader, buf, buf_len);
+   while (valid && tlv_next(&reader, &tlv)) {
+     switch (tlv.tag) {
        case TAG_CERT:
-         certptr = ptr;
-         cert_len = len;
-         DBG("Found TAG_CERT with length %zu", cert_len);
+         certptr = (uint8_t *) tlv.value;
+         certptr_len = tlv.length;
+         DBG("Found TAG_CERT with length %zu", certptr_len);
          break;
        case TAG_CERT_COMPRESS:
-         if(len != 1) {
-           DBG("Found TAG_CERT_COMPRESS with invalid length %zu", len);
-           goto invalid_tlv;
+         if(tlv.length != 1) {
+           DBG("Found TAG_CERT_COMPRESS with invalid length %zu", tlv.length);
+           valid = false;
+           break;
          }
-         compress_info = *ptr;
-         DBG("Found TAG_CERT_COMPRESS with length %zu value 0x%02x", len, compress_info);
+         compress_info = *tlv.value;
+         DBG("Found TAG_CERT_COMPRESS with length %zu value 0x%02x", tlv.length, compress_info);
          break;
        case TAG_CERT_LRC: {
          // basically ignore it
-         DBG("Found TAG_CERT_LRC with length %zu", len);
+         DBG("Found TAG_CERT_LRC with length %zu", tlv.length);
          break;
        }
        default:
-         DBG("Unknown cert tag 0x%02x", tag);
-         goto invalid_tlv;
+         DBG("Unknown cert tag 0x%02x", tlv.tag);
+         valid = false;
          break;
      }
-     ptr += len; // move to after value bytes
+   }
+   if (reader.error) {
+     DBG("Found invalid length for tag 0x%02x.", *reader.ptr);
    }
 
-invalid_tlv:
-   if(certptr == 0 || cert_len == 0 || ptr != buf + buf_len || compress_info > YKPIV_CERTINFO_GZIP) {
+   if(!valid || reader.error || certptr == 0 || certptr_len == 0 || compress_info > YKPIV_CERTINFO_GZIP) {
      DBG("Invalid TLV encoding, treating as a raw certificate");
      certptr = buf;
-     cert_len = buf_len;
+     certptr_len = buf_len;
+     compress_info = YKPIV_CERTINFO_UNCOMPRESSED;
    }
 
+#ifndef USE_CERT_COMPRESS
    if (compress_info == YKPIV_CERTINFO_GZIP) {
+     DBG("Found compressed certificate. Decompressing certificate not supported");
+     return YKPIV_PARSE_ERROR;
+   }
+#endif
+
+   *cert = certptr;
+   *cert_len = certptr_len;
+   *compress = compress_info;
+   return YKPIV_OK;
+}
+
 #ifdef USE_CERT_COMPRESS
-     z_stream zs;
-     zs.zalloc = Z_NULL;
-     zs.zfree = Z_NULL;
-     zs.opaque = Z_NULL;
-     zs.avail_in = (uInt) cert_len;
-     zs.next_in = (Bytef *) certptr;
-     zs.avail_out = (uInt) *certdata_len;
-     zs.next_out = (Bytef *) certdata;
-
-     if (inflateInit2(&zs, MAX_WBITS | 16) != Z_OK) {
-       DBG("Failed to initialize certificate decompression");
-       *certdata_len = 0;
-       return YKPIV_INVALID_OBJECT;
-     }
+ static ykpiv_rc _inflate_certificate(uint8_t *in, size_t in_len, uint8_t *out, size_t *out_len) {
+   z_stream zs;
+   zs.zalloc = Z_NULL;
+   zs.zfree = Z_NULL;
+   zs.opaque = Z_NULL;
+   zs.avail_in = (uInt) in_len;
+   zs.next_in = (Bytef *) in;
+   zs.avail_out = (uInt) *out_len;
+   zs.next_out = (Bytef *) out;
+
+   if (inflateInit2(&zs, MAX_WBITS | 16) != Z_OK) {
+     DBG("Failed to initialize certificate decompression");
+     *out_len = 0;
+     return YKPIV_INVALID_OBJECT;
+   }
 
-     int res = inflate(&zs, Z_FINISH);
-     if (res != Z_STREAM_END) {
-       *certdata_len = 0;
-       if (res == Z_BUF_ERROR) {
-         DBG("Failed to decompress certificate. Allocated buffer is too small");
-         return YKPIV_SIZE_ERROR;
-       }
-       DBG("Failed to decompress certificate");
-       return YKPIV_INVALID_OBJECT;
+   int res = inflate(&zs, Z_FINISH);
+   if (res != Z_STREAM_END) {
+     inflateEnd(&zs);
+     *out_len = 0;
+     if (res == Z_BUF_ERROR) {
+       DBG("Failed to decompress certificate. Allocated buffer is too small");
+       return YKPIV_SIZE_ERROR;
      }
-     if (inflateEnd(&zs) != Z_OK) {
-       DBG("Failed to finish certificate decompression");
-       *certdata_len = 0;
-       return YKPIV_INVALID_OBJECT;
+     DBG("Failed to decompress certificate");
+     return YKPIV_INVALID_OBJECT;
+   }
+   if (inflateEnd(&zs) != Z_OK) {
+     DBG("Failed to finish certificate decompression");
+     *out_len = 0;
+     return YKPIV_INVALID_OBJECT;
+   }
+   *out_len = zs.total_out;
+   return YKPIV_OK;
+}
+
+ static ykpiv_rc _deflate_certificate(uint8_t *in, size_t in_len, uint8_t *out, size_t *out_len) {
+   z_stream zs;
+   zs.zalloc = Z_NULL;
+   zs.zfree = Z_NULL;
+   zs.opaque = Z_NULL;
+   zs.avail_in = (uInt) in_len;
+   zs.next_in = (Bytef *) in;
+   zs.avail_out = (uInt) *out_len;
+   zs.next_out = (Bytef *) out;
+
+   if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, MAX_WBITS | 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+     DBG("Failed to initialize certificate compression");
+     return YKPIV_GENERIC_ERROR;
+   }
+   int res = deflate(&zs, Z_FINISH);
+   deflateEnd(&zs);
+   if (res != Z_STREAM_END) {
+     DBG("Failed to compress certificate");
+     return YKPIV_SIZE_ERROR;
+   }
+   *out_len = zs.total_out;
+   return YKPIV_OK;
+}
+#endif
+
+// Size of a certificate once decompressed, for compressed ones this is the gzip trailer
+ static size_t _certdata_size(uint8_t *cert, size_t cert_len, uint8_t compress_info) {
+   if (compress_info == YKPIV_CERTINFO_GZIP) {
+     if (cert_len < 18) {
+       return 0;
      }
-     *certdata_len = zs.total_out;
-#else
-     DBG("Found compressed certificate. Decompressing certificate not supported");
+     size_t size = cert[cert_len - 4] | (cert[cert_len - 3] << 8) | (cert[cert_len - 2] << 16) | ((size_t)cert[cert_len - 1] << 24);
+     return size <= CB_CERT_INFLATED_MAX ? size : 0;
+   }
+   return cert_len;
+}
+
+ ykpiv_rc ykpiv_util_get_certdata(uint8_t *buf, size_t buf_len, uint8_t* certdata, size_t *certdata_len) {
+   uint8_t compress_info = YKPIV_CERTINFO_UNCOMPRESSED;
+   uint8_t *certptr = 0;
+   size_t cert_len = 0;
+   ykpiv_rc res;
+
+   if ((res = _parse_certdata(buf, buf_len, &certptr, &cert_len, &compress_info)) != YKPIV_OK) {
      *certdata_len = 0;
-     return YKPIV_PARSE_ERROR;
+     return res;
+   }
+
+#ifdef USE_CERT_COMPRESS
+   if (compress_info == YKPIV_CERTINFO_GZIP) {
+     return _inflate_certificate(certptr, cert_len, certdata, certdata_len);
+   }
 #endif
-   } else {
-     if (*certdata_len < cert_len) {
-       DBG("Buffer too small");
-       *certdata_len = 0;
-       return YKPIV_SIZE_ERROR;
-     }
-     memmove(certdata, certptr, cert_len);
-     *certdata_len = cert_len;
+   if (*certdata_len < cert_len) {
+     DBG("Buffer too small");
+     *certdata_len = 0;
+     return YKPIV_SIZE_ERROR;
    }
+   memmove(certdata, certptr, cert_len);
+   *certdata_len = cert_len;
    return YKPIV_OK;
 }
 
+// Number of PUT DATA commands needed to store a certificate of the given length
+ static size_t _cert_apdus(size_t cert_len) {
+   size_t obj_len = 1 + tlv_length_size(cert_len) + cert_len + 3 + 2;
+   size_t put_len = 5 /* object id */ + 1 + tlv_length_size(obj_len) + obj_len;
+   return (put_len + 0xfe) / 0xff;
+}
+
  ykpiv_rc ykpiv_util_write_certdata(uint8_t *rawdata, size_t rawdata_len, uint8_t compress_info, uint8_t* certdata, size_t *certdata_len) {
   size_t offset = 0;
   size_t buf_len = 0;
 
-  unsigned long len_bytes = get_length_size((unsigned long)rawdata_len);
+  if (compress_info == YKPIV_CERTINFO_AUTO) {
+    compress_info = YKPIV_CERTINFO_UNCOMPRESSED;
+#ifdef USE_CERT_COMPRESS
+    // Compress when that saves a command on the card link, or is needed to fit
+    uint8_t gz[CB_OBJ_MAX];
+    size_t gz_len = sizeof(gz);
+    size_t plain_len = 1 + tlv_length_size(rawdata_len) + rawdata_len + 3 + 2;
+    if (_deflate_certificate(rawdata, rawdata_len, gz, &gz_len) == YKPIV_OK &&
+        (_cert_apdus(gz_len) < _cert_apdus(rawdata_len) || (plain_len > *certdata_len && gz_len < rawdata_len))) {
+      DBG("Compressed certificate from %zu to %zu bytes", rawdata_len, gz_len);
+      return ykpiv_util_write_certdata(gz, gz_len, YKPIV_CERTINFO_GZIP, certdata, certdata_len);
+    }
+#endif
+  }
+
+  size_t len_bytes = tlv_length_size(rawdata_len);
 
    // calculate the required length of the encoded object
    buf_len = 1 /* cert tag */ + 3 /* compression tag + data*/ + 2 /* lrc */;
@@ -1567,24 +1932,28 @@ invalid_tlv:
 
   if (-1 == object_id) return YKPIV_INVALID_OBJECT;
 
-   unsigned char data[YKPIV_OBJ_MAX_SIZE] = {0};
-   unsigned long data_len = sizeof (data);
+  unsigned char *data = NULL;
+  unsigned char *payload = NULL;
+  unsigned long payload_len = 0;
 
-  if (YKPIV_OK == (res = _ykpiv_fetch_object(state, object_id, data, &data_len))) {
-    if ((res = ykpiv_util_get_certdata(data, data_len, buf, buf_len)) != YKPIV_OK) {
+  if (!(data = _ykpiv_scratch_get(state, YKPIV_OBJ_MAX_SIZE))) return YKPIV_MEMORY_ERROR;
+
+  if (YKPIV_OK == (res = _ykpiv_fetch_object_view(state, object_id, data, YKPIV_OBJ_MAX_SIZE, &payload, &payload_len))) {
+    if ((res = ykpiv_util_get_certdata(payload, payload_len, buf, buf_len)) != YKPIV_OK) {
       DBG("Failed to get certificate data");
-      return res;
     }
   } else {
     *buf_len = 0;
   }
 
+  // Only the object and its status word were received when it was found
+  _ykpiv_scratch_put(state, data, payload ? (size_t)(payload - data) + payload_len + 2 : YKPIV_OBJ_MAX_SIZE);
   return res;
 }
 
 static ykpiv_rc _write_certificate(ykpiv_state *state, uint8_t slot, uint8_t *data, size_t data_len, uint8_t certinfo) {
   uint8_t buf[CB_OBJ_MAX] = {0};
-  size_t buf_len = sizeof(buf);
+  size_t buf_len = _obj_size_max(state);
   int object_id = (int)ykpiv_util_slot_object(slot);
 
 
@@ -1630,72 +1999,65 @@ static ykpiv_rc _write_certificate(ykpiv_state *state, uint8_t slot, uint8_t *da
 ** If the item is not found, this function returns YKPIV_GENERIC_ERROR.
 */
 static ykpiv_rc _get_metadata_item(uint8_t *data, size_t cb_data, uint8_t tag, uint8_t **pp_item, size_t *pcb_item) {
-  uint8_t *p_temp = data;
-  size_t  offs, cb_temp = 0;
-  uint8_t tag_temp = 0;
-  bool found = false;
+  tlv_reader reader;
+  tlv_view tlv = {0};
 
   if (!data || !pp_item || !pcb_item) return YKPIV_ARGUMENT_ERROR;
 
   *pp_item = NULL;
   *pcb_item = 0;
 
-  while (p_temp < (data + cb_data)) {
-    tag_temp = *p_temp++;
-
-    offs = _ykpiv_get_length(p_temp, data + cb_data, &cb_temp);
-    if (!offs) {
-      return YKPIV_PARSE_ERROR;
-    }
-
-    p_temp += offs;
-
-    if (tag_temp == tag) {
-      // found tag
-      found = true;
-      break;
-    }
-
-    p_temp += cb_temp;
-  }
-
-  if (found) {
-    *pp_item = p_temp;
-    *pcb_item = cb_temp;
+  tlv_reader_init(&reader, data, cb_data);
+  if (tlv_find(&reader, tag, &tlv)) {
+    *pp_item = (uint8_t *) tlv.value;
+    *pcb_item = tlv.length;
+    return YKPIV_OK;
   }
 
-  return found ? YKPIV_OK : YKPIV_GENERIC_ERROR;
+  return reader.error ? YKPIV_PARSE_ERROR : YKPIV_GENERIC_ERROR;
 }
 
 ykpiv_rc ykpiv_util_parse_metadata(uint8_t *data, size_t data_len, ykpiv_metadata *metadata) {
-  uint8_t *p = 0;
-  size_t cb = 0;
+  tlv_reader reader;
+  tlv_view tlv = {0};
   uint32_t cnt = 0;
 
-  ykpiv_rc rc = _get_metadata_item(data, data_len, YKPIV_METADATA_ALGORITHM_TAG, &p, &cb);
-  if(rc == YKPIV_OK && cb == 1) {
-    metadata->algorithm = p[0];
-    cnt++;
-  }
-
-  rc = _get_metadata_item(data, data_len, YKPIV_METADATA_POLICY_TAG, &p, &cb);
-  if(rc == YKPIV_OK && cb == 2) {
-    metadata->pin_policy = p[0];
-    metadata->touch_policy = p[1];
-    cnt++;
-  }
-
-  rc = _get_metadata_item(data, data_len, YKPIV_METADATA_ORIGIN_TAG, &p, &cb);
-  if(rc == YKPIV_OK && cb == 1) {
-    metadata->origin = p[0];
-    cnt++;
-  }
-
-  rc = _get_metadata_item(data, data_len, YKPIV_METADATA_PUBKEY_TAG, &p, &cb);
-  if(rc == YKPIV_OK && cb > 0 && cb <= sizeof(metadata->pubkey)) {
-    metadata->pubkey_len = cb;
-    memcpy(metadata->pubkey, p, cb);
-    cnt++;
+  // Items are picked up in a single pass, the first occurrence of each tag is used
+  uint8_t seen = 0;
+  tlv_reader_init(&reader, data, data_len);
+  while (tlv_next(&reader, &tlv)) {
+    if (tlv.tag >= 8 || (seen & (1u << tlv.tag))) {
+      continue;
+    }
+    seen |= 1u << tlv.tag;
+    switch (tlv.tag) {
+      case YKPIV_METADATA_ALGORITHM_TAG:
+        if (tlv.length == 1) {
+          metadata->algorithm = tlv.value[0];
+          cnt++;
+        }
+        break;
+      case YKPIV_METADATA_POLICY_TAG:
+        if (tlv.length == 2) {
+          metadata->pin_policy = tlv.value[0];
+          metadata->touch_policy = tlv.value[1];
+          cnt++;
+        }
+        break;
+      case YKPIV_METADATA_ORIGIN_TAG:
+        if (tlv.length == 1) {
+          metadata->origin = tlv.value[0];
+          cnt++;
+        }
+        break;
+      case YKPIV_METADATA_PUBKEY_TAG:
+        if (tlv.length > 0 && tlv.length <= sizeof(metadata->pubkey)) {
+          metadata->pubkey_len = tlv.length;
+          memcpy(metadata->pubkey, tlv.value, tlv.length);
+          cnt++;
+        }
+        break;
+    }
   }
 
   return cnt ? YKPIV_OK : YKPIV_PARSE_ERROR;
@@ -1802,9 +2164,10 @@ static ykpiv_rc _set_metadata_item(uint8_t *data, size_t *pcb_data, size_t cb_da
 */
 static ykpiv_rc _read_metadata(ykpiv_state *state, uint8_t tag, uint8_t* data, size_t* pcb_data) {
   ykpiv_rc res = YKPIV_OK;
-  uint8_t *p_temp = NULL;
-  unsigned long cb_temp = 0;
-  size_t offs;
+  uint8_t *obj = NULL;
+  unsigned long cb_obj = 0;
+  tlv_reader reader;
+  tlv_view tlv = {0};
   int obj_id = 0;
 
   if (!data || !pcb_data || (CB_BUF_MAX > *pcb_data)) return YKPIV_ARGUMENT_ERROR;
@@ -1815,28 +2178,20 @@ static ykpiv_rc _read_metadata(ykpiv_state *state, uint8_t tag, uint8_t* data, s
   default: return YKPIV_INVALID_OBJECT;
   }
 
-  cb_temp = (unsigned long)*pcb_data;
+  size_t cb_data = *pcb_data;
   *pcb_data = 0;
 
-  if (YKPIV_OK != (res = _ykpiv_fetch_object(state, obj_id, data, &cb_temp))) {
+  if (YKPIV_OK != (res = _ykpiv_fetch_object_view(state, obj_id, data, (unsigned long)cb_data, &obj, &cb_obj))) {
     return res;
   }
 
-  if (cb_temp < CB_OBJ_TAG_MIN) return YKPIV_PARSE_ERROR;
+  tlv_reader_init(&reader, obj, cb_obj);
 
-  p_temp = data;
+  if (!tlv_expect(&reader, tag, &tlv)) return YKPIV_PARSE_ERROR;
 
-  if (tag != *p_temp++) return YKPIV_PARSE_ERROR;
-
-  offs = _ykpiv_get_length(p_temp, data + cb_temp, pcb_data);
-  if (!offs) {
-    *pcb_data = 0;
-    return YKPIV_PARSE_ERROR;
-  }
-
-  p_temp += offs;
-
-  memmove(data, p_temp, *pcb_data);
+  // Callers edit the items in place, so they are moved to the start of the buffer once
+  memmove(data, tlv.value, tlv.length);
+  *pcb_data = tlv.length;
 
   return YKPIV_OK;
 }
@@ -1853,7 +2208,7 @@ static ykpiv_rc _read_metadata(ykpiv_state *state, uint8_t tag, uint8_t* data, s
 static ykpiv_rc _write_metadata(ykpiv_state *state, uint8_t tag, uint8_t *data, size_t cb_data) {
   ykpiv_rc res = YKPIV_OK;
   uint8_t buf[CB_OBJ_MAX] = { 0 };
-  uint8_t *pTemp = buf;
+  tlv_writer writer;
   int obj_id = 0;
 
   if (cb_data > (_obj_size_max(state) - CB_OBJ_TAG_MAX)) {
@@ -1866,18 +2221,18 @@ static ykpiv_rc _write_metadata(ykpiv_state *state, uint8_t tag, uint8_t *data,
   default: return YKPIV_INVALID_OBJECT;
   }
 
+  // Cached management keys may no longer match once the object is written
+  _ykpiv_clear_mgm_cache(state);
+
   if (!data || (0 == cb_data)) {
     // deleting metadata
     res = _ykpiv_save_object(state, obj_id, NULL, 0);
   }
   else {
-    *pTemp++ = tag;
-    pTemp += _ykpiv_set_length(pTemp, cb_data);
-
-    memcpy(pTemp, data, cb_data);
-    pTemp += cb_data;
+    tlv_writer_init(&writer, buf, sizeof(buf));
+    tlv_put(&writer, tag, data, cb_data);
 
-    res = _ykpiv_save_object(state, obj_id, buf, (size_t)(pTemp - buf));
+    res = _ykpiv_save_object(state, obj_id, buf, (size_t)(writer.ptr - buf));
   }
 
   return res;
@@ -35,11 +35,17 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <ctype.h>
+#include <time.h>
 
 #include "internal.h"
 #include "ykpiv.h"
 #include "scp11_util.h"
 #include "ecdh.h"
+#include "trace.h"
+#include "broker.h"
+#ifdef USE_CCID
+#include "ccid.h"
+#endif
 #include "../common/util.h"
 #include "../aes_cmac/aes.h"
 
@@ -202,46 +208,81 @@ void _ykpiv_free(ykpiv_state *state, void *data) {
   state->allocator.pfn_free(state->allocator.alloc_data, data);
 }
 
-size_t _ykpiv_get_length_size(size_t length) {
-  if(length < 0x80) {
-    return 1;
-  } else if(length < 0x100) {
-    return 2;
-  } else {
-    return 3;
+#define YKPIV_SCRATCH_MAX (sizeof(((ykpiv_state*)0)->scratch_busy) * 8)
+
+static void _ykpiv_scratch_release(ykpiv_state *state) {
+  if (state->scratch) {
+    yc_memzero(state->scratch, (size_t)state->scratch_count * YKPIV_OBJ_MAX_SIZE);
+    if (state->scratch_owned) {
+      _ykpiv_free(state, state->scratch);
+    }
   }
+  state->scratch = NULL;
+  state->scratch_count = 0;
+  state->scratch_busy = 0;
+  state->scratch_owned = false;
 }
 
-size_t _ykpiv_set_length(unsigned char *buffer, size_t length) {
-  if(length < 0x80) {
-    *buffer++ = (unsigned char)length;
-    return 1;
-  } else if(length < 0x100) {
-    *buffer++ = 0x81;
-    *buffer++ = (unsigned char)length;
-    return 2;
+// Borrows a zeroed buffer from the workspace of the state, or allocates one if none is free or size is too large
+unsigned char *_ykpiv_scratch_get(ykpiv_state *state, size_t size) {
+  if (!state->scratch && size <= YKPIV_OBJ_MAX_SIZE) {
+    if ((state->scratch = _ykpiv_alloc(state, YKPIV_WORKSPACE_SIZE))) {
+      state->scratch_count = YKPIV_WORKSPACE_SIZE / YKPIV_OBJ_MAX_SIZE;
+      state->scratch_owned = true;
+    }
+  }
+  if (size <= YKPIV_OBJ_MAX_SIZE) {
+    for (uint32_t i = 0; i < state->scratch_count; i++) {
+      if (!(state->scratch_busy & (1u << i))) {
+        state->scratch_busy |= 1u << i;
+        return state->scratch + (size_t)i * YKPIV_OBJ_MAX_SIZE;
+      }
+    }
+    DBG3("Workspace exhausted, allocating a buffer");
+  }
+  return _ykpiv_alloc(state, size ? size : 1);
+}
+
+// Gives back a buffer from _ykpiv_scratch_get, wiping the first used bytes which are all that was written to
+void _ykpiv_scratch_put(ykpiv_state *state, unsigned char *buf, size_t used) {
+  if (!buf) {
+    return;
+  }
+  if (state->scratch && buf >= state->scratch && buf < state->scratch + (size_t)state->scratch_count * YKPIV_OBJ_MAX_SIZE) {
+    size_t i = (size_t)(buf - state->scratch) / YKPIV_OBJ_MAX_SIZE;
+    yc_memzero(buf, used < YKPIV_OBJ_MAX_SIZE ? used : YKPIV_OBJ_MAX_SIZE);
+    state->scratch_busy &= ~(1u << i);
   } else {
-    *buffer++ = 0x82;
-    *buffer++ = (length >> 8) & 0xff;
-    *buffer++ = length & 0xff;
-    return 3;
+    yc_memzero(buf, used);
+    _ykpiv_free(state, buf);
   }
 }
 
-size_t _ykpiv_get_length(const unsigned char *buffer, const unsigned char* end, size_t *len) {
-  if(buffer + 1 <= end && buffer[0] < 0x80) {
-    *len = buffer[0];
-    return buffer + 1 + *len <= end ? 1 : 0;
-  } else if(buffer + 2 <= end && buffer[0] == 0x81) {
-    *len = buffer[1];
-    return buffer + 2 + *len <= end ? 2 : 0;
-  } else if(buffer + 3 <= end && buffer[0] == 0x82) {
-    size_t tmp = buffer[1];
-    *len = (tmp << 8) + buffer[2];
-    return buffer + 3 + *len <= end ? 3 : 0;
+ykpiv_rc ykpiv_set_workspace(ykpiv_state *state, void *workspace, size_t size) {
+  if (!state) return YKPIV_ARGUMENT_ERROR;
+  if (workspace && size < YKPIV_OBJ_MAX_SIZE) return YKPIV_SIZE_ERROR;
+  if (state->scratch_busy) return YKPIV_GENERIC_ERROR;
+
+  _ykpiv_scratch_release(state);
+  if (workspace) {
+    size_t count = size / YKPIV_OBJ_MAX_SIZE;
+    state->scratch = workspace;
+    state->scratch_count = (uint32_t)(count < YKPIV_SCRATCH_MAX ? count : YKPIV_SCRATCH_MAX);
+    memset(state->scratch, 0, (size_t)state->scratch_count * YKPIV_OBJ_MAX_SIZE);
   }
-  *len = 0;
-  return 0;
+  return YKPIV_OK;
+}
+
+size_t _ykpiv_get_length_size(size_t length) {
+  return tlv_length_size(length);
+}
+
+size_t _ykpiv_set_length(unsigned char *buffer, size_t length) {
+  return tlv_put_length(buffer, length);
+}
+
+size_t _ykpiv_get_length(const unsigned char *buffer, const unsigned char* end, size_t *len) {
+  return tlv_get_length(buffer, end, len);
 }
 
 static unsigned char *set_object(int object_id, unsigned char *buffer) {
@@ -282,32 +323,46 @@ void _ykpiv_set_debug(void (*dbg)(const char *)) {
 }
 
 void _ykpiv_debug(const char *file, int line, const char *func, int lvl, const char *format, ...) {
+  bool marker = format[0] && format[strlen(format) - 1] == '@'; // Format ends with marker, expect two extra args
+  if(yc_trace_enabled()) {
+    const uint8_t *p = NULL;
+    size_t n = 0;
+    if(marker && !strchr(format, '%')) { // Only the payload follows the format
+      va_list args;
+      va_start(args, format);
+      p = va_arg(args, const uint8_t *);
+      n = va_arg(args, size_t);
+      va_end(args);
+    }
+    yc_trace_debug(file, line, func, lvl, format, p, n);
+  }
   if(lvl <= ykpiv_verbose) {
+    static const char digits[] = "0123456789abcdef";
     char buf[8192];
 #ifdef _WIN32
     const char *name = strrchr(file, '\\');
 #else
     const char *name = strrchr(file, '/');
 #endif
-    if(snprintf(buf, sizeof(buf), "DBG %s:%d (%s): ", name ? name + 1 : file, line, func) < 0) {
-      buf[0] = 0;
-    }
-    size_t len = strlen(buf);
+    int rc = snprintf(buf, sizeof(buf), "DBG %s:%d (%s): ", name ? name + 1 : file, line, func);
+    size_t len = rc < 0 ? 0 : (size_t)rc < sizeof(buf) ? (size_t)rc : sizeof(buf) - 1;
+    buf[len] = 0;
     va_list args;
     va_start(args, format);
-    if(vsnprintf(buf + len, sizeof(buf) - len, format, args) < 0) {
-      buf[len] = 0;
-    }
-    if(format[0] && format[strlen(format) - 1] == '@') { // Format ends with marker, expect two extra args
-      len = strlen(buf) - 1; // Overwrite the marker
-      uint8_t *p = va_arg(args, uint8_t *);
+    rc = vsnprintf(buf + len, sizeof(buf) - len, format, args);
+    len += rc < 0 ? 0 : (size_t)rc < sizeof(buf) - len ? (size_t)rc : sizeof(buf) - len - 1;
+    buf[len] = 0;
+    if(marker) {
+      if(len) {
+        len--; // Overwrite the marker
+      }
+      const uint8_t *p = va_arg(args, const uint8_t *);
       size_t n = va_arg(args, size_t);
-      for(size_t i = 0; i < n; i++) {
-        if(snprintf(buf + len, sizeof(buf) - len, "%02x", p[i]) < 0) {
-          buf[len] = 0;
-        }
-        len = strlen(buf);
+      for(size_t i = 0; i < n && len + 2 < sizeof(buf); i++) {
+        buf[len++] = digits[p[i] >> 4];
+        buf[len++] = digits[p[i] & 0xf];
       }
+      buf[len] = 0;
       if(snprintf(buf + len, sizeof(buf) - len, " (%zu)", n) < 0) {
         buf[len] = 0;
       }
@@ -332,6 +387,7 @@ ykpiv_rc ykpiv_init_with_allocator(ykpiv_state **state, int verbose, const ykpiv
   }
 
   ykpiv_verbose = verbose;
+  yc_trace_init_env();
 
   memset(s, 0, sizeof(ykpiv_state));
   s->allocator = *allocator;
@@ -345,10 +401,16 @@ ykpiv_rc ykpiv_init(ykpiv_state **state, int verbose) {
 }
 
 static ykpiv_rc _ykpiv_done(ykpiv_state *state, bool disconnect) {
+  _ykpiv_stop_worker(state);
   if (disconnect)
     ykpiv_disconnect(state);
+  else
+    scp11_session_destroy(&state->scp11_state);
+  _ykpiv_free(state, state->watch);
   _cache_pin(state, NULL, 0);
   _cache_mgm_key(state, NULL, 0);
+  _ykpiv_clear_mgm_cache(state);
+  _ykpiv_scratch_release(state);
   _ykpiv_free(state, state);
   return YKPIV_OK;
 }
@@ -362,6 +424,13 @@ ykpiv_rc ykpiv_done(ykpiv_state *state) {
 }
 
 ykpiv_rc ykpiv_disconnect(ykpiv_state *state) {
+  if(state->transport.transmit) {
+    DBG("Disconnect transport of card #%u.", state->serial);
+    if(state->transport.close) {
+      state->transport.close(state->transport.ctx);
+    }
+    memset(&state->transport, 0, sizeof(state->transport));
+  }
   if(state->card) {
     DBG("Disconnect card #%u.", state->serial);
     pcsc_long rc = SCardDisconnect(state->card, SCARD_RESET_CARD);
@@ -380,48 +449,26 @@ ykpiv_rc ykpiv_disconnect(ykpiv_state *state) {
   state->ver.major = 0;
   state->ver.minor = 0;
   state->ver.patch = 0;
+  state->max_ext_len = 0;
+  state->batch_depth = 0;
+  state->batch_selected = false;
+  scp11_session_destroy(&state->scp11_state);
+  _ykpiv_clear_mgm_cache(state);
 
   return YKPIV_OK;
 }
 
-typedef struct {
-    uint8_t tag;
-    size_t length;
-    uint8_t *value;
-} _tlv;
-
-static uint8_t next_tlv(uint8_t *ptr, uint8_t *end, _tlv *tlv) {
-  if(ptr + 1 > end) {
-    DBG("Tag offset is not within range");
-    return 0;
-  }
-  tlv->tag = *ptr;
-  size_t len = _ykpiv_get_length(ptr + 1, end, &tlv->length);
-  if(len == 0) {
-    DBG("Length index not within data range");
-    return 0;
-  }
-  if (ptr + 1 + len + tlv->length > end) {
-    DBG("Tag value too long for available data");
-    return 0;
-  }
-  tlv->value = ptr + 1 + len;
-  return tlv->tag;
-}
-
-
-static ykpiv_rc skip_next_tlv(uint8_t **ptr, uint8_t *end, uint8_t expected_tag, const char *tag_str) {
-  _tlv tlv = {0};
-  if(next_tlv(*ptr, end, &tlv) != expected_tag) {
+static ykpiv_rc skip_next_tlv(tlv_reader *reader, uint8_t expected_tag, const char *tag_str) {
+  tlv_view tlv = {0};
+  if(!tlv_expect(reader, expected_tag, &tlv)) {
     DBG("Failed to parse data. Expected tag for %s was %x, found %x", tag_str, expected_tag, tlv.tag);
     return YKPIV_PARSE_ERROR;
   }
-  *ptr = tlv.value + tlv.length;
   return YKPIV_OK;
 }
 
-static uint8_t *
-get_pubkey_offset(uint8_t *cert_ptr, uint8_t *cert_end, size_t pubkey_len, uint8_t *algo, size_t algo_len) {
+static const uint8_t *
+get_pubkey_offset(tlv_reader *cert, size_t pubkey_len, uint8_t *algo, size_t algo_len) {
   //DER structure:
   //subjectPublicKeyInfo SubjectPublicKeyInfo SEQUENCE (2 elem)
   //    algorithm AlgorithmIdentifier SEQUENCE (2 elem)
@@ -430,36 +477,38 @@ get_pubkey_offset(uint8_t *cert_ptr, uint8_t *cert_end, size_t pubkey_len, uint8
   //    subjectPublicKey BIT STRING (520 bit)
 
   //subjectPublicKeyInfo SubjectPublicKeyInfo SEQUENCE (2 elem)
-  _tlv pubkey_info = {0};
-  if (next_tlv(cert_ptr, cert_end, &pubkey_info) != 0x30) {
+  tlv_view pubkey_info = {0};
+  if (!tlv_expect(cert, 0x30, &pubkey_info)) {
     DBG("Failed to parse certificate. Expected tag for subjectPublicKeyInfo SEQUENCE was 0x30, found %x",
         pubkey_info.tag);
-    return 0;
+    return NULL;
   }
+  tlv_reader info;
+  tlv_reader_enter(&info, &pubkey_info);
 
   //    algorithm AlgorithmIdentifier SEQUENCE (2 elem)
   //        algorithm OBJECT IDENTIFIER 1.2.840.10045.2.1 ecPublicKey (ANSI X9.62 public key type)
   //        parameters ANY OBJECT IDENTIFIER 1.2.840.10045.3.1.7 prime256v1 (ANSI X9.62 named elliptic curve)
-  _tlv algo_oid = {0};
-  if (next_tlv(pubkey_info.value, cert_end, &algo_oid) != 0x30) {
+  tlv_view algo_oid = {0};
+  if (!tlv_expect(&info, 0x30, &algo_oid)) {
     DBG("Failed to parse certificate. Expected tag for subjectPublicKeyInfo.algorithm SEQUENCE was 0x30, found %x",
         algo_oid.tag);
     return NULL;
   }
   if (algo_oid.length != algo_len) {
     DBG("Failed to parse certificate. Unexpected length of public key algorithm data");
-    return 0;
+    return NULL;
   }
   if (memcmp(algo, algo_oid.value, algo_len) != 0) {
     DBG("Failed to parse certificate. Unexpected public key algorithm data");
-    return 0;
+    return NULL;
   }
 
   //    subjectPublicKey BIT STRING (520 bit)
-  _tlv pubkey = {0};
-  if (next_tlv(algo_oid.value + algo_oid.length, cert_end, &pubkey) != 0x03) {
-    DBG("Failed to parse certificate. Expected tag for subjectPublicKeyInfo.algorithm SEQUENCE was 0x30, found %x",
-        algo_oid.tag);
+  tlv_view pubkey = {0};
+  if (!tlv_expect(&info, 0x03, &pubkey) || pubkey.length == 0) {
+    DBG("Failed to parse certificate. Expected tag for subjectPublicKeyInfo.subjectPublicKey BIT STRING was 0x03, found %x",
+        pubkey.tag);
     return NULL;
   }
   if (*pubkey.value == 0) {
@@ -468,7 +517,7 @@ get_pubkey_offset(uint8_t *cert_ptr, uint8_t *cert_end, size_t pubkey_len, uint8
   }
   if (pubkey.length != pubkey_len) {
     DBG("Failed to parse certificate. Unexpected length of public key data");
-    return 0;
+    return NULL;
   }
 
   return pubkey.value;
@@ -514,38 +563,38 @@ scp11_get_sd_pubkey(ykpiv_state *state, uint8_t *pubkey, size_t *pubkey_len, uin
 
   // Find the last certificate in the chain
   // Good resources about parsing certificate data: https://lapo.it/asn1js and https://letsencrypt.org/docs/a-warm-welcome-to-asn1-and-der/
-  uint8_t *ptr = certchain;
-  uint8_t *end = certchain + certchain_len;
-  size_t len = 0;
+  tlv_reader chain;
+  tlv_view cert = {0};
+  tlv_reader_init(&chain, certchain, certchain_len);
   do {
-    ptr += len; // skip the previous certificate
-    if (*ptr != 0x30) {
+    if (!tlv_expect(&chain, 0x30, &cert)) {
       DBG("Failed to parse data as certificate chain. Data does not start with a SEQUENCE in DER format");
       *pubkey_len = 0;
       return YKPIV_PARSE_ERROR;
     }
-    ptr++; // skip the next 0x30 tag
-    ptr += _ykpiv_get_length(ptr, end, &len); // skip the length bytes
-  } while (ptr + len < end); // if we haven't reached the end of the data, skip to the next certificate
+  } while (tlv_more(&chain)); // if we haven't reached the end of the data, skip to the next certificate
 
   // Now we go into the TBScertificate data
-  if (*ptr != 0x30) {
+  tlv_reader reader;
+  tlv_view tbs = {0};
+  tlv_reader_enter(&reader, &cert);
+  if (!tlv_expect(&reader, 0x30, &tbs)) {
     DBG("Failed to parse data as certificate. Data does not start with a SEQUENCE in DER format");
     return YKPIV_PARSE_ERROR;
   }
-  ptr++; // skip the 0x30 tag starting the TBSCertificate
-  ptr += _ykpiv_get_length(ptr, end, &len); // skip the length bytes for the TBSCertificate
+  tlv_reader_enter(&reader, &tbs);
 
-  if(*ptr == 0xa0) { // If certificate version is present, skip it
-    if ((rc = skip_next_tlv(&ptr, end, 0xa0, "Certificate Version")) != YKPIV_OK) { return rc; }
+  if(tbs.length > 0 && *tbs.value == 0xa0) { // If certificate version is present, skip it
+    if ((rc = skip_next_tlv(&reader, 0xa0, "Certificate Version")) != YKPIV_OK) { return rc; }
   }
-  if ((rc = skip_next_tlv(&ptr, end, 0x02, "SerialNumber")) != YKPIV_OK) { return rc; }
-  if ((rc = skip_next_tlv(&ptr, end, 0x30, "Signature Algorithm SEQUENCE")) != YKPIV_OK) { return rc; }
-  if ((rc = skip_next_tlv(&ptr, end, 0x30, "Issuer SEQUENCE")) != YKPIV_OK) { return rc; }
-  if ((rc = skip_next_tlv(&ptr, end, 0x30, "Validity SEQUENCE")) != YKPIV_OK) { return rc; }
-  if ((rc = skip_next_tlv(&ptr, end, 0x30, "Subject SEQUENCE")) != YKPIV_OK) { return rc; }
+  if ((rc = skip_next_tlv(&reader, 0x02, "SerialNumber")) != YKPIV_OK) { return rc; }
+  if ((rc = skip_next_tlv(&reader, 0x30, "Signature Algorithm SEQUENCE")) != YKPIV_OK) { return rc; }
+  if ((rc = skip_next_tlv(&reader, 0x30, "Issuer SEQUENCE")) != YKPIV_OK) { return rc; }
+  if ((rc = skip_next_tlv(&reader, 0x30, "Validity SEQUENCE")) != YKPIV_OK) { return rc; }
+  if ((rc = skip_next_tlv(&reader, 0x30, "Subject SEQUENCE")) != YKPIV_OK) { return rc; }
 
-  if ((ptr = get_pubkey_offset(ptr, end, *pubkey_len, algo, algo_len)) == 0) {
+  const uint8_t *ptr = get_pubkey_offset(&reader, *pubkey_len, algo, algo_len);
+  if (ptr == NULL) {
     DBG("Failed to find public key in certificate data");
     return YKPIV_PARSE_ERROR;
   }
@@ -675,32 +724,11 @@ sc_verify_cleanup:
   return rc;
  }
 
-static ykpiv_rc scp11_open_secure_channel(ykpiv_state *state) {
-  ykpiv_rc rc;
-
-  //DER encode:
-  // 0x06 tag for OID followed by the length the OID (7 bytes) followed by the OID representing EC PublicKey
-  // 0x06 tag for OID followed by the length the OID (8 bytes) followed by the OID representing prime256v1 curve
-  uint8_t sd_pubkey_algo[] = {0x06, 0x07, 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x02, 0x01,
-                              0x06, 0x08, 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x03, 0x01, 0x07};
-  uint8_t oce_privkey[32] = {0};
-  size_t oce_privkey_len = sizeof(oce_privkey);
-  uint8_t oce_pubkey[65] = {0};
-  size_t oce_pubkey_len = sizeof(oce_pubkey);
-  uint8_t sd_pubkey[65] = {0};
-  size_t sd_pubkey_len = sizeof(sd_pubkey);
-  uint8_t data[1024] = {0};
-  size_t data_len = sizeof(data);
-
-  if ((rc = scp11_get_sd_pubkey(state, sd_pubkey, &sd_pubkey_len, sd_pubkey_algo, sizeof(sd_pubkey_algo))) != YKPIV_OK) {
-    DBG("Failed to get SD public key (PK.SD.ECKA)");
-    return rc;
-  }
-
-  // Select the PIV application
+static ykpiv_rc scp11_select_piv(ykpiv_state *state) {
   unsigned char select_templ[] = {0x00, YKPIV_INS_SELECT_APPLICATION, 0x04, 0x00};
   unsigned long recv_len;
   int sw = 0;
+  ykpiv_rc rc;
   if ((rc = _ykpiv_transfer_data(state, select_templ, piv_aid, sizeof(piv_aid), NULL, &recv_len, &sw)) != YKPIV_OK) {
     return rc;
   }
@@ -708,6 +736,31 @@ static ykpiv_rc scp11_open_secure_channel(ykpiv_state *state) {
     DBG("Failed selecting application");
     return rc;
   }
+  return YKPIV_OK;
+}
+
+// SCP11 requires firmware 5.7.1 or later, where the PIV application returns the serial number
+static uint32_t scp11_get_serial(ykpiv_state *state) {
+  unsigned char templ[] = {0x00, YKPIV_INS_GET_SERIAL, 0x00, 0x00};
+  unsigned char data[16] = {0};
+  unsigned long recv_len = sizeof(data);
+  int sw = 0;
+  if (_ykpiv_transfer_data(state, templ, NULL, 0, data, &recv_len, &sw) != YKPIV_OK ||
+      ykpiv_translate_sw_ex(__FUNCTION__, sw) != YKPIV_OK || recv_len != 4) {
+    return 0;
+  }
+  return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+// Opens the channel with the PIV application selected, using the public key of the security domain
+static ykpiv_rc scp11_handshake(ykpiv_state *state, uint8_t *sd_pubkey, size_t sd_pubkey_len) {
+  ykpiv_rc rc;
+  uint8_t oce_privkey[32] = {0};
+  size_t oce_privkey_len = sizeof(oce_privkey);
+  uint8_t oce_pubkey[65] = {0};
+  size_t oce_pubkey_len = sizeof(oce_pubkey);
+  uint8_t data[1024] = {0};
+  size_t data_len = sizeof(data);
 
   if (!ecdh_generate_keypair(ecdh_curve_p256(), oce_privkey, sizeof(oce_privkey), oce_pubkey, sizeof(oce_pubkey))) {
     DBG("Failed to generate the OCE ephemeral keypair");
@@ -742,13 +795,19 @@ static ykpiv_rc scp11_open_secure_channel(ykpiv_state *state) {
   if ((rc = scp11_verify_channel(session_keys, receipt, data, data_len, sde_pubkey, sde_pubkey_len)) !=
       YKPIV_OK) {
     DBG("Failed to verify SCP11 session");
+    yc_memzero(session_keys, sizeof(session_keys));
+    return rc;
+  }
+
+  rc = scp11_session_init(&state->scp11_state, session_keys + SCP11_SESSION_KEY_LEN,
+                          session_keys + (SCP11_SESSION_KEY_LEN * 2), session_keys + (SCP11_SESSION_KEY_LEN * 3));
+  yc_memzero(session_keys, sizeof(session_keys));
+  if (rc != YKPIV_OK) {
+    DBG("Failed to set up SCP11 session keys");
     return rc;
   }
 
   state->scp11_state.security_level = SCP11_KEY_USAGE;
-  memcpy(state->scp11_state.senc, session_keys + SCP11_SESSION_KEY_LEN, SCP11_SESSION_KEY_LEN);
-  memcpy(state->scp11_state.smac, session_keys + (SCP11_SESSION_KEY_LEN * 2), SCP11_SESSION_KEY_LEN);
-  memcpy(state->scp11_state.srmac, session_keys + (SCP11_SESSION_KEY_LEN * 3), SCP11_SESSION_KEY_LEN);
   memcpy(state->scp11_state.mac_chain, receipt, SCP11_MAC_LEN);
   state->scp11_state.enc_counter = 1;
 
@@ -757,6 +816,61 @@ static ykpiv_rc scp11_open_secure_channel(ykpiv_state *state) {
   return YKPIV_OK;
 }
 
+static ykpiv_rc scp11_open_secure_channel(ykpiv_state *state) {
+  ykpiv_rc rc;
+
+  //DER encode:
+  // 0x06 tag for OID followed by the length the OID (7 bytes) followed by the OID representing EC PublicKey
+  // 0x06 tag for OID followed by the length the OID (8 bytes) followed by the OID representing prime256v1 curve
+  uint8_t sd_pubkey_algo[] = {0x06, 0x07, 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x02, 0x01,
+                              0x06, 0x08, 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x03, 0x01, 0x07};
+  uint8_t sd_pubkey[SCP11_SD_PUBKEY_LEN] = {0};
+  size_t sd_pubkey_len = sizeof(sd_pubkey);
+
+  // The serial number of the YubiKey finds a cached public key, without selecting the security domain
+  if ((rc = scp11_select_piv(state)) != YKPIV_OK) {
+    return rc;
+  }
+  uint32_t serial = scp11_get_serial(state);
+  if (_ykpiv_sd_cache_get(serial, SCP11B_KVN, sd_pubkey)) {
+    if ((rc = scp11_handshake(state, sd_pubkey, sd_pubkey_len)) != YKPIV_AUTHENTICATION_ERROR) {
+      return rc;
+    }
+    DBG("Cached SD public key of card #%u was not accepted, reading it again", serial);
+    _ykpiv_sd_cache_drop(serial, SCP11B_KVN);
+  }
+
+  if ((rc = scp11_get_sd_pubkey(state, sd_pubkey, &sd_pubkey_len, sd_pubkey_algo, sizeof(sd_pubkey_algo))) != YKPIV_OK) {
+    DBG("Failed to get SD public key (PK.SD.ECKA)");
+    return rc;
+  }
+
+  // Select the PIV application
+  if ((rc = scp11_select_piv(state)) != YKPIV_OK) {
+    return rc;
+  }
+
+  if ((rc = scp11_handshake(state, sd_pubkey, sd_pubkey_len)) != YKPIV_OK) {
+    return rc;
+  }
+  _ykpiv_sd_cache_put(serial, SCP11B_KVN, sd_pubkey);
+  return YKPIV_OK;
+}
+
+static uint32_t _ykpiv_get_max_ext_len(ykpiv_state *state) {
+  const char sz_setting_ext[] = "Enable_Extended_APDU";
+
+  // The NEO only accepts short APDUs, YubiKey 4 and later also accept extended length
+  if (!is_version_compatible(state, 4, 0, 0)) {
+    return 0;
+  }
+  if (!setting_get_bool(sz_setting_ext, true).value) {
+    DBG("Extended length APDUs disabled by setting %s", sz_setting_ext);
+    return 0;
+  }
+  return is_version_compatible(state, 4, 3, 0) ? CB_EXT_DATA_MAX : CB_EXT_DATA_MAX_YK4;
+}
+
 ykpiv_rc _ykpiv_select_application(ykpiv_state *state, bool scp11) {
 
   ykpiv_rc res = YKPIV_OK;
@@ -795,6 +909,8 @@ ykpiv_rc _ykpiv_select_application(ykpiv_state *state, bool scp11) {
     return res;
   }
 
+  state->max_ext_len = _ykpiv_get_max_ext_len(state);
+
   res = _ykpiv_get_serial(state);
   if (res != YKPIV_OK) {
     DBG("Failed to retrieve serial number: '%s'", ykpiv_strerror(res));
@@ -811,6 +927,11 @@ ykpiv_rc _ykpiv_ensure_application_selected(ykpiv_state *state, bool scp11) {
     return YKPIV_ARGUMENT_ERROR;
   }
 
+  // Nothing else can have used the card since the batch confirmed the selection
+  if (state->batch_selected) {
+    return YKPIV_OK;
+  }
+
   res = _ykpiv_verify(state, NULL, 0, false, false);
 
   if ((YKPIV_OK != res) && (YKPIV_WRONG_PIN != res) && (YKPIV_PIN_LOCKED != res)) {
@@ -821,6 +942,7 @@ ykpiv_rc _ykpiv_ensure_application_selected(ykpiv_state *state, bool scp11) {
     res = YKPIV_OK;
   }
 
+  state->batch_selected = state->batch_depth && res == YKPIV_OK;
   return res;
 #else
   (void)state;
@@ -887,7 +1009,128 @@ ykpiv_rc ykpiv_connect_with_external_card(ykpiv_state *state, uintptr_t context,
   return _ykpiv_connect(state, context, card);
 }
 
+static ykpiv_rc _ykpiv_connect_transport(ykpiv_state *state, const ykpiv_transport *transport, const char *reader,
+                                         bool scp11) {
+  ykpiv_rc res;
+
+  ykpiv_disconnect(state);
+  scp11_session_destroy(&state->scp11_state);
+  state->transport = *transport;
+  state->protocol = SCARD_PROTOCOL_T1;
+  snprintf(state->reader, sizeof(state->reader), "%s", reader);
+
+  if (YKPIV_OK != (res = _ykpiv_begin_transaction(state))) {
+    memset(&state->transport, 0, sizeof(state->transport));
+    return res;
+  }
+  res = _ykpiv_select_application(state, scp11);
+  _ykpiv_end_transaction(state);
+  if (res != YKPIV_OK) {
+    memset(&state->transport, 0, sizeof(state->transport));
+    return res;
+  }
+
+  // There is no ATR to tell the model from
+  if (state->ver.major >= 5) {
+    state->model = DEVTYPE_YK5;
+  } else if (state->ver.major == 4) {
+    state->model = DEVTYPE_YK4;
+  } else {
+    state->model = DEVTYPE_NEOr3;
+  }
+  return YKPIV_OK;
+}
+
+ykpiv_rc ykpiv_connect_with_transport(ykpiv_state *state, const ykpiv_transport *transport) {
+  if (NULL == state || NULL == transport || NULL == transport->transmit) {
+    return YKPIV_ARGUMENT_ERROR;
+  }
+  return _ykpiv_connect_transport(state, transport, "Transport", false);
+}
+
+ykpiv_rc ykpiv_list_usb_readers(ykpiv_state *state, char *readers, size_t *len) {
+  if (NULL == state || NULL == readers || NULL == len) {
+    return YKPIV_ARGUMENT_ERROR;
+  }
+#ifdef USE_CCID
+  return _ykpiv_ccid_list_readers(readers, len);
+#else
+  DBG("Built without USB support");
+  return YKPIV_NOT_SUPPORTED;
+#endif
+}
+
+static ykpiv_rc _ykpiv_connect_usb(ykpiv_state *state, const char *wanted, bool scp11) {
+#ifdef USE_CCID
+  char reader_buf[2048] = {0};
+  size_t num_readers = sizeof(reader_buf);
+  const char *name = wanted + strlen(YKPIV_USB_READER_PREFIX);
+  char *reader_ptr;
+  uint32_t serial = 0;
+  ykpiv_transport transport;
+  ykpiv_rc res;
+
+  // Only digits select a serial number
+  if (*name && strspn(name, "0123456789") == strlen(name)) {
+    serial = (uint32_t)strtoul(name, NULL, 10);
+    wanted = NULL;
+  }
+  if ((res = _ykpiv_ccid_list_readers(reader_buf, &num_readers)) != YKPIV_OK) {
+    return res;
+  }
+  res = YKPIV_PCSC_ERROR;
+  for (reader_ptr = reader_buf; *reader_ptr != '\0'; reader_ptr += strlen(reader_ptr) + 1) {
+    if (!ykpiv_reader_matches(reader_ptr, wanted)) {
+      DBG("Skipping reader '%s' since it doesn't match '%s'.", reader_ptr, wanted);
+      continue;
+    }
+    if ((res = _ykpiv_ccid_open(reader_ptr, &transport)) != YKPIV_OK) {
+      DBG("Failed to open '%s', rc=%d", reader_ptr, res);
+      continue;
+    }
+    if ((res = _ykpiv_connect_transport(state, &transport, reader_ptr, scp11)) != YKPIV_OK) {
+      transport.close(transport.ctx);
+      continue;
+    }
+    if (serial && state->serial != serial) {
+      DBG("Skipping reader '%s' since it isn't serial %u.", reader_ptr, serial);
+      ykpiv_disconnect(state);
+      res = YKPIV_PCSC_ERROR;
+      continue;
+    }
+    DBG("Connected to '%s' over USB.", reader_ptr);
+    return YKPIV_OK;
+  }
+  DBG("No usable USB reader found matching '%s'.", name);
+  return res;
+#else
+  (void)state;
+  (void)scp11;
+  DBG("Built without USB support, can't connect to '%s'", wanted);
+  return YKPIV_NOT_SUPPORTED;
+#endif
+}
+
+static ykpiv_rc _ykpiv_connect_broker(ykpiv_state *state, const char *wanted, bool scp11) {
+  ykpiv_transport transport;
+  ykpiv_rc res;
+
+  if ((res = _ykpiv_broker_open(wanted + strlen(YKPIV_BROKER_READER_PREFIX), &transport)) != YKPIV_OK) {
+    return res;
+  }
+  if ((res = _ykpiv_connect_transport(state, &transport, wanted, scp11)) != YKPIV_OK) {
+    transport.close(transport.ctx);
+    return res;
+  }
+  DBG("Connected to '%s'.", wanted);
+  return YKPIV_OK;
+}
+
 ykpiv_rc ykpiv_validate(ykpiv_state *state, const char *wanted) {
+  if(state->transport.transmit) {
+    // A transport that lost its card fails its next transmit instead
+    return strcmp(wanted, state->reader) ? YKPIV_GENERIC_ERROR : YKPIV_OK;
+  }
   if(state->card) {
     DBG("Validate reader '%s'.", wanted);
     char reader[CB_BUF_MAX] = {0};
@@ -906,8 +1149,10 @@ ykpiv_rc ykpiv_validate(ykpiv_state *state, const char *wanted) {
       state->ver.major = 0;
       state->ver.minor = 0;
       state->ver.patch = 0;
+      state->max_ext_len = 0;
       _cache_pin(state, NULL, 0);
       _cache_mgm_key(state, NULL, 0);
+      _ykpiv_clear_mgm_cache(state);
       return pcsc_to_yrc(rc);
     }
     if (strcmp(wanted, reader)) {
@@ -921,8 +1166,10 @@ ykpiv_rc ykpiv_validate(ykpiv_state *state, const char *wanted) {
       state->ver.major = 0;
       state->ver.minor = 0;
       state->ver.patch = 0;
+      state->max_ext_len = 0;
       _cache_pin(state, NULL, 0);
       _cache_mgm_key(state, NULL, 0);
+      _ykpiv_clear_mgm_cache(state);
       return YKPIV_GENERIC_ERROR;
     }
     return YKPIV_OK;
@@ -930,6 +1177,22 @@ ykpiv_rc ykpiv_validate(ykpiv_state *state, const char *wanted) {
   return YKPIV_ARGUMENT_ERROR;
 }
 
+bool ykpiv_reader_matches(const char *reader, const char *wanted) {
+  if(!wanted || !strcmp(wanted, "*")) {
+    return true;
+  }
+  size_t wanted_len = strlen(wanted);
+  do {
+    if(strlen(reader) < wanted_len) {
+      break;
+    }
+    if(strncasecmp(reader, wanted, wanted_len) == 0) {
+      return true;
+    }
+  } while(*reader++);
+  return false;
+}
+
 ykpiv_rc ykpiv_connect(ykpiv_state *state, const char *wanted) {
   return ykpiv_connect_ex(state, wanted, false);
 }
@@ -942,6 +1205,14 @@ ykpiv_rc ykpiv_connect_ex(ykpiv_state *state, const char *wanted, bool scp11) {
   ykpiv_rc ret;
   SCARDHANDLE card = (SCARDHANDLE)-1;
 
+  if(wanted && !strncmp(wanted, YKPIV_USB_READER_PREFIX, strlen(YKPIV_USB_READER_PREFIX))) {
+    return _ykpiv_connect_usb(state, wanted, scp11);
+  }
+  // Brokers are only matched by their exact name, with or without the '@'
+  const char *exact = wanted && *wanted == '@' ? wanted + 1 : wanted;
+  if(exact && !strncmp(exact, YKPIV_BROKER_READER_PREFIX, strlen(YKPIV_BROKER_READER_PREFIX))) {
+    return _ykpiv_connect_broker(state, exact, scp11);
+  }
   if(wanted && *wanted == '@') {
     wanted++; // Skip the '@'
     DBG("Connect reader '%s'.", wanted);
@@ -972,23 +1243,9 @@ ykpiv_rc ykpiv_connect_ex(ykpiv_state *state, const char *wanted, bool scp11) {
     }
 
     for(reader_ptr = reader_buf; *reader_ptr != '\0'; reader_ptr += strlen(reader_ptr) + 1) {
-      if(wanted) {
-        char *ptr = reader_ptr;
-        bool found = false;
-        do {
-          if(strlen(ptr) < strlen(wanted)) {
-            break;
-          }
-          if(strncasecmp(ptr, wanted, strlen(wanted)) == 0) {
-            found = true;
-            break;
-          }
-        } while(*ptr++);
-
-        if(found == false) {
-          DBG("Skipping reader '%s' since it doesn't match '%s'.", reader_ptr, wanted);
-          continue;
-        }
+      if(!ykpiv_reader_matches(reader_ptr, wanted)) {
+        DBG("Skipping reader '%s' since it doesn't match '%s'.", reader_ptr, wanted);
+        continue;
       }
       DBG("Connect reader '%s' matching '%s'.", reader_ptr, wanted);
       rc = SCardConnect(state->context, reader_ptr, SCARD_SHARE_SHARED,
@@ -1012,7 +1269,7 @@ ykpiv_rc ykpiv_connect_ex(ykpiv_state *state, const char *wanted, bool scp11) {
 
   // at this point, card should not equal state->card, to allow _ykpiv_connect() to determine device type
   if (YKPIV_OK == _ykpiv_connect(state, state->context, card)) {
-    state->scp11_state.security_level = 0;
+    scp11_session_destroy(&state->scp11_state);
     /*
       * Select applet.  This is done here instead of in _ykpiv_connect() because
       * you may not want to select the applet when connecting to a card handle that
@@ -1064,12 +1321,286 @@ ykpiv_rc ykpiv_list_readers(ykpiv_state *state, char *readers, size_t *len) {
   return YKPIV_OK;
 }
 
+static const char pnp_notification[] = "\\\\?PnP?\\Notification";
+
+static void _ykpiv_sleep(uint32_t ms) {
+#ifdef _WIN32
+  Sleep(ms);
+#else
+  struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+  nanosleep(&ts, NULL);
+#endif
+}
+
+static ykpiv_rc _ykpiv_watch_readers(ykpiv_state *state) {
+  ykpiv_reader_watch *watch = state->watch;
+  pcsc_word names_len = sizeof(watch->names);
+  pcsc_long rc;
+
+  memset(watch->names, 0, sizeof(watch->names));
+  memset(watch->states, 0, sizeof(watch->states));
+  watch->n_states = 0;
+
+  rc = SCardListReaders(state->context, NULL, watch->names, &names_len);
+  if (rc != SCARD_S_SUCCESS && rc != SCARD_E_NO_READERS_AVAILABLE) {
+    DBG("SCardListReaders failed, rc=%lx", (long)rc);
+    return pcsc_to_yrc(rc);
+  }
+
+  for (char *reader = watch->names; *reader && watch->n_states < MAX_READERS; reader += strlen(reader) + 1) {
+    watch->states[watch->n_states++].szReader = reader;
+  }
+  if (watch->pnp) {
+    watch->states[watch->n_states++].szReader = pnp_notification;
+  }
+  if (watch->n_states == 0) {
+    return YKPIV_OK;
+  }
+
+  // Learn the current state, so that only later changes are reported
+  rc = SCardGetStatusChange(state->context, 0, watch->states, watch->n_states);
+  if (rc != SCARD_S_SUCCESS && rc != SCARD_E_TIMEOUT) {
+    DBG("SCardGetStatusChange failed, rc=%lx", (long)rc);
+    return pcsc_to_yrc(rc);
+  }
+  for (pcsc_word i = 0; i < watch->n_states; i++) {
+    watch->states[i].dwCurrentState = watch->states[i].dwEventState & ~SCARD_STATE_CHANGED;
+  }
+  if (watch->pnp && (watch->states[watch->n_states - 1].dwEventState & SCARD_STATE_UNKNOWN)) {
+    DBG("Reader notifications are not supported, listing readers instead");
+    watch->pnp = false;
+    watch->n_states--;
+  }
+  return YKPIV_OK;
+}
+
+ykpiv_rc ykpiv_wait_for_change(ykpiv_state *state, uint32_t timeout_ms, bool *changed) {
+  ykpiv_rc res;
+  pcsc_long rc;
+
+  if (!state || !changed) {
+    return YKPIV_ARGUMENT_ERROR;
+  }
+  *changed = false;
+
+  if(SCardIsValidContext(state->context) != SCARD_S_SUCCESS) {
+    rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &state->context);
+    if (rc != SCARD_S_SUCCESS) {
+      DBG("SCardEstablishContext failed, rc=%lx", (long)rc);
+      return pcsc_to_yrc(rc);
+    }
+    if (state->watch) {
+      // States recorded on a previous context are meaningless now
+      state->watch->pnp = true;
+      if ((res = _ykpiv_watch_readers(state)) != YKPIV_OK) {
+        return res;
+      }
+      *changed = true;
+      return YKPIV_OK;
+    }
+  }
+
+  if (!state->watch) {
+    if (!(state->watch = _ykpiv_alloc(state, sizeof(ykpiv_reader_watch)))) {
+      DBG("Failed to allocate memory for reader states");
+      return YKPIV_MEMORY_ERROR;
+    }
+    state->watch->pnp = true;
+    if ((res = _ykpiv_watch_readers(state)) != YKPIV_OK) {
+      _ykpiv_free(state, state->watch);
+      state->watch = NULL;
+      return res;
+    }
+  }
+
+  ykpiv_reader_watch *watch = state->watch;
+  if (!watch->pnp && timeout_ms > 1000) {
+    timeout_ms = 1000;
+  }
+
+  if (watch->n_states == 0) {
+    _ykpiv_sleep(timeout_ms);
+    rc = SCARD_E_TIMEOUT;
+  } else {
+    rc = SCardGetStatusChange(state->context, timeout_ms, watch->states, watch->n_states);
+  }
+  if (rc == SCARD_E_TIMEOUT || rc == SCARD_E_CANCELLED) {
+    if (!watch->pnp) {
+      // Without notifications, compare the reader list to find added readers
+      char names[sizeof(watch->names)] = {0};
+      pcsc_word names_len = sizeof(names);
+      rc = SCardListReaders(state->context, NULL, names, &names_len);
+      if (rc != SCARD_S_SUCCESS && rc != SCARD_E_NO_READERS_AVAILABLE) {
+        DBG("SCardListReaders failed, rc=%lx", (long)rc);
+        return pcsc_to_yrc(rc);
+      }
+      if (memcmp(names, watch->names, sizeof(names))) {
+        *changed = true;
+        return _ykpiv_watch_readers(state);
+      }
+    }
+    return YKPIV_OK;
+  }
+  if (rc != SCARD_S_SUCCESS) {
+    DBG("SCardGetStatusChange failed, rc=%lx", (long)rc);
+    return pcsc_to_yrc(rc);
+  }
+
+  bool readers_changed = false;
+  for (pcsc_word i = 0; i < watch->n_states; i++) {
+    if (watch->states[i].dwEventState & SCARD_STATE_CHANGED) {
+      DBG("Reader '%s' changed state from %lx to %lx", watch->states[i].szReader,
+          (unsigned long)watch->states[i].dwCurrentState, (unsigned long)watch->states[i].dwEventState);
+      *changed = true;
+      if (watch->states[i].szReader == pnp_notification ||
+          (watch->states[i].dwEventState & (SCARD_STATE_UNKNOWN | SCARD_STATE_IGNORE))) {
+        readers_changed = true;
+      }
+    }
+    watch->states[i].dwCurrentState = watch->states[i].dwEventState & ~SCARD_STATE_CHANGED;
+  }
+
+  if (readers_changed) {
+    return _ykpiv_watch_readers(state);
+  }
+  return YKPIV_OK;
+}
+
+ykpiv_rc ykpiv_cancel_wait(ykpiv_state *state) {
+  if (!state) {
+    return YKPIV_ARGUMENT_ERROR;
+  }
+  if (SCardIsValidContext(state->context) == SCARD_S_SUCCESS) {
+    pcsc_long rc = SCardCancel(state->context);
+    if (rc != SCARD_S_SUCCESS) {
+      DBG("SCardCancel failed, rc=%lx", (long)rc);
+      return pcsc_to_yrc(rc);
+    }
+  }
+  return YKPIV_OK;
+}
+
+static uint64_t _ykpiv_now_us(void) {
+#ifdef _WIN32
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+  if(!freq.QuadPart) {
+    QueryPerformanceFrequency(&freq);
+  }
+  QueryPerformanceCounter(&now);
+  return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000 + (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+#endif
+}
+
+static uint64_t _ykpiv_now_ms(void) {
+  return _ykpiv_now_us() / 1000;
+}
+
+static ykpiv_ins_stats *_ykpiv_ins_stats(ykpiv_state *state, unsigned char ins) {
+  ykpiv_stats *stats = &state->stats;
+  for(size_t i = 0; i < stats->n_ins; i++) {
+    if(stats->ins[i].ins == ins) {
+      return stats->ins + i;
+    }
+  }
+  if(stats->n_ins == YKPIV_STATS_MAX_INS) {
+    return NULL;
+  }
+  stats->ins[stats->n_ins].ins = ins;
+  return stats->ins + stats->n_ins++;
+}
+
+static void _ykpiv_stats_latency(ykpiv_ins_stats *stats, uint64_t us) {
+  size_t bucket = 0;
+  while(bucket < YKPIV_STATS_BUCKETS - 1 && (us >> (bucket + 1))) {
+    bucket++;
+  }
+  stats->latency[bucket]++;
+  stats->total_us += us;
+  if(us > stats->max_us) {
+    stats->max_us = us;
+  }
+}
+
+static void _ykpiv_stats_apdu(ykpiv_state *state, const unsigned char *send_data, pcsc_word send_len,
+    pcsc_word recv_len, uint64_t us) {
+  ykpiv_ins_stats *stats = state->stats_cur;
+  if(stats) {
+    stats->apdus++;
+    if(send_len > 1 && send_data[1] == YKPIV_INS_GET_RESPONSE_APDU) {
+      stats->get_responses++;
+    } else if(state->stats_apdus++) {
+      stats->chained++;
+    }
+    stats->bytes_sent += send_len;
+    stats->bytes_received += recv_len;
+    stats->transmit_us += us;
+  }
+}
+
+ykpiv_rc ykpiv_get_stats(ykpiv_state *state, ykpiv_stats *stats, bool reset) {
+  if(!state || !stats) {
+    return YKPIV_ARGUMENT_ERROR;
+  }
+  memcpy(stats, &state->stats, sizeof(ykpiv_stats));
+  if(reset) {
+    memset(&state->stats, 0, sizeof(ykpiv_stats));
+  }
+  return YKPIV_OK;
+}
+
+static void _ykpiv_release_transaction(ykpiv_state *state) {
+  if(state->transport.transmit) {
+    if(state->transport.end_transaction) {
+      state->transport.end_transaction(state->transport.ctx);
+    }
+    return;
+  }
+#if ENABLE_IMPLICIT_TRANSACTIONS
+  pcsc_long rc = SCardEndTransaction(state->card, SCARD_LEAVE_CARD);
+  if(rc != SCARD_S_SUCCESS) {
+    DBG("SCardEndTransaction on card #%u failed, rc=%lx", state->serial, (long)rc);
+    // Ending the transaction can only fail because it's already ended - it's ended now either way so we don't fail here
+  }
+#else
+  (void)state;
+#endif /* ENABLE_IMPLICIT_TRANSACTIONS */
+}
+
 ykpiv_rc _ykpiv_begin_transaction(ykpiv_state *state) {
+  if(_ykpiv_worker_busy(state)) {
+    DBG("Asynchronous requests are in progress on card #%u", state->serial);
+    return YKPIV_GENERIC_ERROR;
+  }
+  if(state->batch_depth) {
+    uint64_t now = _ykpiv_now_ms();
+    if(!state->batch_hold_ms || now - state->batch_since_ms < state->batch_hold_ms) {
+      state->stats.batched++;
+      return YKPIV_OK;
+    }
+    // Let other applications use the card before continuing the batch
+    DBG("Batch held card #%u for %llums, releasing it", state->serial, (unsigned long long)(now - state->batch_since_ms));
+    _ykpiv_release_transaction(state);
+    state->batch_since_ms = now;
+    state->batch_selected = false;
+  }
+  if(state->transport.transmit) {
+    state->stats.transactions++;
+    return state->transport.begin_transaction ? state->transport.begin_transaction(state->transport.ctx) : YKPIV_OK;
+  }
 #if ENABLE_IMPLICIT_TRANSACTIONS
   int retries = 0;
+  uint64_t start = _ykpiv_now_us();
   pcsc_long rc = SCardBeginTransaction(state->card);
+  state->stats.transactions++;
+  state->stats.transaction_wait_us += _ykpiv_now_us() - start;
   if (rc != SCARD_S_SUCCESS) {
     retries++;
+    state->stats.transaction_retries++;
     DBG("SCardBeginTransaction on card #%u failed, rc=%lx", state->serial, (long)rc);
     if (SCardIsValidContext(state->context) != SCARD_S_SUCCESS || (rc != SCARD_W_RESET_CARD && rc != SCARD_W_REMOVED_CARD)) {
       pcsc_long rc2 = SCardDisconnect(state->card, SCARD_RESET_CARD);
@@ -1114,6 +1645,7 @@ ykpiv_rc _ykpiv_begin_transaction(ykpiv_state *state) {
     state->ver.major = 0;
     state->ver.minor = 0;
     state->ver.patch = 0;
+    state->max_ext_len = 0;
     ykpiv_rc res;
     if ((res = _ykpiv_select_application(state, state->scp11_state.security_level)) != YKPIV_OK)
       return res;
@@ -1141,13 +1673,43 @@ ykpiv_rc _ykpiv_begin_transaction(ykpiv_state *state) {
 }
 
 ykpiv_rc _ykpiv_end_transaction(ykpiv_state *state) {
-#if ENABLE_IMPLICIT_TRANSACTIONS
-  pcsc_long rc = SCardEndTransaction(state->card, SCARD_LEAVE_CARD);
-  if(rc != SCARD_S_SUCCESS) {
-    DBG("SCardEndTransaction on card #%u failed, rc=%lx", state->serial, (long)rc);
-    // Ending the transaction can only fail because it's already ended - it's ended now either way so we don't fail here
+  // Batches keep the transaction until ykpiv_end_batch
+  if(!state->batch_depth) {
+    _ykpiv_release_transaction(state);
+  }
+  return YKPIV_OK;
+}
+
+ykpiv_rc ykpiv_begin_batch(ykpiv_state *state, uint32_t max_hold_ms) {
+  ykpiv_rc res;
+
+  if (NULL == state) return YKPIV_ARGUMENT_ERROR;
+
+  if(state->batch_depth) {
+    state->batch_depth++;
+    return YKPIV_OK;
+  }
+
+  if (YKPIV_OK != (res = _ykpiv_begin_transaction(state))) return res;
+  if (YKPIV_OK != (res = _ykpiv_ensure_application_selected(state, state->scp11_state.security_level))) {
+    _ykpiv_end_transaction(state);
+    return res;
+  }
+
+  state->batch_depth = 1;
+  state->batch_hold_ms = max_hold_ms;
+  state->batch_since_ms = _ykpiv_now_ms();
+  state->batch_selected = true;
+  return YKPIV_OK;
+}
+
+ykpiv_rc ykpiv_end_batch(ykpiv_state *state) {
+  if (NULL == state || !state->batch_depth) return YKPIV_ARGUMENT_ERROR;
+
+  if(--state->batch_depth == 0) {
+    state->batch_selected = false;
+    _ykpiv_release_transaction(state);
   }
-#endif /* ENABLE_IMPLICIT_TRANSACTIONS */
   return YKPIV_OK;
 }
 
@@ -1232,81 +1794,258 @@ static const SCARD_IO_REQUEST* _pci(pcsc_word protocol) {
 
 static ykpiv_rc _ykpiv_transmit(ykpiv_state *state, const unsigned char *send_data, pcsc_word send_len,
     unsigned char *recv_data, pcsc_word *recv_len, int *sw) {
-  DBG("> @", send_data, (size_t)send_len);
-  pcsc_long rc = SCardTransmit(state->card, _pci(state->protocol), send_data, send_len, NULL, recv_data, recv_len);
-  if(rc != SCARD_S_SUCCESS) {
-    DBG("SCardTransmit on card #%u failed, rc=%lx", state->serial, (long)rc);
+  // Debug messages are recorded in traces as well, so they leave out secrets sent and returned
+  size_t log_len = yc_trace_apdu_keep(send_data, send_len);
+  DBG("> @", send_data, log_len);
+  uint64_t start = _ykpiv_now_us();
+  ykpiv_rc res = YKPIV_OK;
+  if(state->transport.transmit) {
+    size_t len = *recv_len;
+    if((res = state->transport.transmit(state->transport.ctx, send_data, send_len, recv_data, &len)) != YKPIV_OK) {
+      DBG("Transport failed on card #%u, rc=%d", state->serial, res);
+    }
+    *recv_len = (pcsc_word)len;
+  } else {
+    pcsc_long rc = SCardTransmit(state->card, _pci(state->protocol), send_data, send_len, NULL, recv_data, recv_len);
+    if(rc != SCARD_S_SUCCESS) {
+      DBG("SCardTransmit on card #%u failed, rc=%lx", state->serial, (long)rc);
+      res = pcsc_to_yrc(rc);
+    }
+  }
+  _ykpiv_stats_apdu(state, send_data, send_len, res == YKPIV_OK ? *recv_len : 0, _ykpiv_now_us() - start);
+  if(res != YKPIV_OK) {
     *sw = 0;
-    return pcsc_to_yrc(rc);
+    return res;
+  }
+  if(log_len < send_len && *recv_len >= 2) {
+    DBG("< @", recv_data + *recv_len - 2, (size_t)2);
+  } else {
+    DBG("< @", recv_data, (size_t)*recv_len);
   }
-  DBG("< @", recv_data, (size_t)*recv_len);
   if(*recv_len >= 2) {
     *sw = (recv_data[*recv_len - 2] << 8) | recv_data[*recv_len - 1];
     *recv_len -= 2;
   } else {
     *sw = 0;
   }
+  if(yc_trace_enabled()) {
+    yc_trace_apdu(__FILE__, __LINE__, __func__, send_data, send_len, *recv_len, *sw);
+  }
   return YKPIV_OK;
 }
 
+ykpiv_rc _ykpiv_transmit_raw(ykpiv_state *state, const unsigned char *send_data, size_t send_len,
+    unsigned char *recv_data, size_t *recv_len) {
+  pcsc_word len = (pcsc_word)*recv_len;
+  int sw = 0;
+  ykpiv_rc res = _ykpiv_transmit(state, send_data, (pcsc_word)send_len, recv_data, &len, &sw);
+  // The status word is still in the buffer, right after the data
+  *recv_len = res == YKPIV_OK ? (size_t)len + (sw ? 2 : 0) : 0;
+  return res;
+}
+
 static ykpiv_rc scp11_prepare_transfer(ykpiv_scp11_state *state, APDU *apdu, const uint8_t *apdu_data, uint32_t apdu_data_len, size_t *apdu_len) {
   ykpiv_rc rc = YKPIV_OK;
-  uint8_t enc[YKPIV_OBJ_MAX_SIZE] = {0};
-  uint32_t enc_len = sizeof(enc);
+  uint32_t enc_len = sizeof(apdu->st.data) - 2 - SCP11_HALF_MAC_LEN;
 
-  if ((rc = scp11_encrypt_data(state->senc, state->enc_counter++, apdu_data, apdu_data_len, enc, &enc_len)) !=
-      YKPIV_OK) {
+  // Encrypted straight into the APDU, which is then MACed as it will be sent, without the MAC itself
+  if ((rc = scp11_encrypt_data_ex(&state->senc, state->enc_counter++, apdu_data, apdu_data_len, apdu->st.data + 2,
+                                  &enc_len)) != YKPIV_OK) {
     DBG("Failed to perform AES ECD encryption on APDU");
     return rc;
   }
 
-  uint8_t cla = apdu->st.cla | 0x04;
-  APDU maced_apdu = {cla, apdu->st.ins, apdu->st.p1, apdu->st.p2, 0};
-  maced_apdu.st.data[0] = (enc_len + SCP11_HALF_MAC_LEN) >> 8;
-  maced_apdu.st.data[1] = (enc_len + SCP11_HALF_MAC_LEN) & 0xff;
-  memcpy(maced_apdu.st.data + 2, enc, enc_len);
+  apdu->st.cla |= 0x04;
+  apdu->st.lc = 0;
+  apdu->st.data[0] = (enc_len + SCP11_HALF_MAC_LEN) >> 8;
+  apdu->st.data[1] = (enc_len + SCP11_HALF_MAC_LEN) & 0xff;
 
   uint8_t mac[SCP11_MAC_LEN] = {0};
-  if ((rc = scp11_mac_data(state->smac, state->mac_chain, maced_apdu.raw, 7 + enc_len, mac)) != YKPIV_OK) {
+  if ((rc = scp11_mac_data_ex(&state->smac_cmac, state->mac_chain, apdu->raw, 7 + enc_len, mac)) != YKPIV_OK) {
     DBG("Failed to calculate APDU mac value");
     return rc;
   }
 
-  apdu->st.cla = cla;
-  apdu->st.lc = 0;
-  apdu->st.data[0] = (enc_len + SCP11_HALF_MAC_LEN) >> 8;
-  apdu->st.data[1] = (enc_len + SCP11_HALF_MAC_LEN) & 0xff;
-  memcpy(apdu->st.data + 2, enc, enc_len);
-  memcpy(apdu->st.data + 2 + enc_len, mac, SCP11_HALF_MAC_LEN);
-  *apdu_len = enc_len + SCP11_HALF_MAC_LEN + 7;
-
-  memcpy(state->mac_chain, mac, SCP11_MAC_LEN);
-  return rc;
-}
+  memcpy(apdu->st.data + 2 + enc_len, mac, SCP11_HALF_MAC_LEN);
+  *apdu_len = enc_len + SCP11_HALF_MAC_LEN + 7;
+
+  memcpy(state->mac_chain, mac, SCP11_MAC_LEN);
+  return rc;
+}
+
+static ykpiv_rc
+scp11_decrypt_response(ykpiv_scp11_state *state, uint8_t *data, uint32_t data_len, uint8_t *dec, uint32_t *dec_len,
+                       int sw) {
+  if (data_len == 0) {
+    DBG("No response data to decrypt");
+    return YKPIV_OK;
+  }
+  ykpiv_rc rc = YKPIV_OK;
+  if ((rc = scp11_unmac_data_ex(&state->srmac_cmac, state->mac_chain, data, data_len, sw)) != YKPIV_OK) {
+    DBG("Failed to verify response MAC");
+    return rc;
+  }
+
+  if ((rc = scp11_decrypt_data_ex(&state->senc, state->enc_counter - 1, data, data_len - SCP11_HALF_MAC_LEN, dec,
+                                dec_len)) != YKPIV_OK) {
+    DBG("Failed to decrypt response");
+    return rc;
+  }
+
+  return rc;
+ }
+
+static ykpiv_rc _ykpiv_scp11_receive(ykpiv_state *state, const unsigned char *data, pcsc_word data_len,
+    unsigned char *out_data, unsigned long *out_len, int *sw) {
+  unsigned long max_out = *out_len;
+  ykpiv_rc res = YKPIV_OK;
+  size_t enc_max = data_len + 258;
+  size_t enc_len = data_len;
+  unsigned char *enc = NULL;
+  unsigned char *dec = NULL;
+  uint32_t dec_len = 0;
+
+  if (!(enc = _ykpiv_alloc(state, enc_max))) {
+    DBG("Failed to allocate memory for the encrypted response");
+    return YKPIV_MEMORY_ERROR;
+  }
+  memcpy(enc, data, data_len);
+
+  // The encrypted response and its R-MAC can be split over several GET RESPONSE chunks,
+  // collect all of them before verifying and decrypting.
+  while((*sw & 0xff00) == 0x6100) {
+    unsigned char apdu[] = {0, YKPIV_INS_GET_RESPONSE_APDU, 0, 0, *sw & 0xff};
+
+    DBG3("The card indicates there is %u bytes more encrypted data for us.", apdu[4] ? apdu[4] : 0x100);
+
+    if (enc_max - enc_len < 258) {
+      unsigned char *tmp = _ykpiv_realloc(state, enc, enc_max * 2);
+      if (!tmp) {
+        DBG("Failed to grow the encrypted response buffer to %zu bytes", enc_max * 2);
+        res = YKPIV_MEMORY_ERROR;
+        goto Cleanup;
+      }
+      enc = tmp;
+      enc_max *= 2;
+    }
+
+    pcsc_word recv_len = (pcsc_word)(enc_max - enc_len);
+    if ((res = _ykpiv_transmit(state, apdu, sizeof(apdu), enc + enc_len, &recv_len, sw)) != YKPIV_OK) {
+      goto Cleanup;
+    }
+    if (*sw != SW_SUCCESS && (*sw & 0xff00) != 0x6100) {
+      goto Cleanup;
+    }
+    enc_len += recv_len;
+  }
+
+  if (enc_len > UINT32_MAX) {
+    res = YKPIV_SIZE_ERROR;
+    goto Cleanup;
+  }
+
+  dec_len = (uint32_t)enc_len;
+  if (!(dec = _ykpiv_scratch_get(state, dec_len))) {
+    DBG("Failed to allocate memory for the decrypted response");
+    res = YKPIV_MEMORY_ERROR;
+    goto Cleanup;
+  }
+  uint64_t start = _ykpiv_now_us();
+  res = scp11_decrypt_response(&state->scp11_state, enc, (uint32_t)enc_len, dec, &dec_len, *sw);
+  state->stats.scp11_ops++;
+  state->stats.scp11_us += _ykpiv_now_us() - start;
+  if (res != YKPIV_OK) {
+    goto Cleanup;
+  }
+  if (dec_len > max_out) {
+    DBG("Output buffer to small, wanted to write %lu, max was %lu.", (unsigned long)dec_len, max_out);
+    res = YKPIV_SIZE_ERROR;
+    goto Cleanup;
+  }
+  memcpy(out_data, dec, dec_len);
+  *out_len = dec_len;
+
+Cleanup:
+  _ykpiv_scratch_put(state, dec, enc_len);
+  _ykpiv_free(state, enc);
+  return res;
+}
+
+static ykpiv_rc _ykpiv_transfer_extended(ykpiv_state *state,
+    const unsigned char *templ,
+    const unsigned char *in_data,
+    unsigned long in_len,
+    unsigned char *out_data,
+    unsigned long *out_len,
+    unsigned long max_out,
+    int *sw) {
+  ykpiv_rc res = YKPIV_OK;
+  unsigned char *apdu = NULL;
+  unsigned char *data = NULL;
+  unsigned char *recv_data = NULL;
+  pcsc_word recv_len = YKPIV_OBJ_MAX_SIZE;
+  pcsc_word apdu_len = 0;
+  size_t data_used = 0;
+
+  if(in_len + 9 > YKPIV_OBJ_MAX_SIZE) {
+    return YKPIV_SIZE_ERROR;
+  }
+  if(!(apdu = _ykpiv_scratch_get(state, YKPIV_OBJ_MAX_SIZE))) {
+    return YKPIV_MEMORY_ERROR;
+  }
+
+  memcpy(apdu, templ, 4);
+  apdu_len = 4;
+  apdu[apdu_len++] = 0; // Extended length marker
+  if(in_len) {
+    apdu[apdu_len++] = (in_len >> 8) & 0xff;
+    apdu[apdu_len++] = in_len & 0xff;
+    memcpy(apdu + apdu_len, in_data, in_len);
+    apdu_len += in_len;
+  }
+  // Le = 0x0000, the card returns as much as it has
+  apdu[apdu_len++] = 0;
+  apdu[apdu_len++] = 0;
+
+  // Receive straight into the caller's buffer when it holds at least as much as ours
+  if(out_data && max_out >= YKPIV_OBJ_MAX_SIZE) {
+    recv_data = out_data;
+    recv_len = (pcsc_word)max_out;
+  } else if(!(recv_data = data = _ykpiv_scratch_get(state, YKPIV_OBJ_MAX_SIZE))) {
+    res = YKPIV_MEMORY_ERROR;
+    goto Cleanup;
+  }
 
-static ykpiv_rc
-scp11_decrypt_response(ykpiv_scp11_state *state, uint8_t *data, uint32_t data_len, uint8_t *dec, uint32_t *dec_len,
-                       int sw) {
-  if (data_len == 0) {
-    DBG("No response data to decrypt");
-    return YKPIV_OK;
+  DBG("Going to send %u bytes in one extended length APDU.", apdu_len);
+  data_used = recv_len;
+  res = _ykpiv_transmit(state, apdu, apdu_len, recv_data, &recv_len, sw);
+  if(res != YKPIV_OK) {
+    goto Cleanup;
   }
-  ykpiv_rc rc = YKPIV_OK;
-  if ((rc = scp11_unmac_data(state->srmac, state->mac_chain, data, data_len, sw)) != YKPIV_OK) {
-    DBG("Failed to verify response MAC");
-    return rc;
+  data_used = recv_len + 2; // Including the status word
+  if (*sw != SW_SUCCESS && (*sw & 0xff00) != 0x6100) {
+    goto Cleanup;
   }
 
-  if ((rc = scp11_decrypt_data(state->senc, state->enc_counter - 1, data, data_len - SCP11_HALF_MAC_LEN, dec,
-                                dec_len)) != YKPIV_OK) {
-    DBG("Failed to decrypt response");
-    return rc;
+  if (out_data) {
+    if (recv_data != out_data) {
+      if (recv_len > max_out) {
+        DBG("Output buffer to small, wanted to write %lu, max was %lu.", (unsigned long)recv_len, max_out);
+        res = YKPIV_SIZE_ERROR;
+        goto Cleanup;
+      }
+      memcpy(out_data, data, recv_len);
+    }
+    *out_len = recv_len;
   }
 
-  return rc;
- }
+Cleanup:
+  _ykpiv_scratch_put(state, data, data_used);
+  _ykpiv_scratch_put(state, apdu, apdu_len);
+  return res;
+}
 
-ykpiv_rc _ykpiv_transfer_data(ykpiv_state *state,
+static ykpiv_rc _ykpiv_transfer(ykpiv_state *state,
     const unsigned char *templ,
     const unsigned char *in_data,
     unsigned long in_len,
@@ -1314,94 +2053,147 @@ ykpiv_rc _ykpiv_transfer_data(ykpiv_state *state,
     unsigned long *out_len,
     int *sw) {
   unsigned long max_out = *out_len;
+  APDU *apdu = NULL;
+  unsigned char *data = NULL;
+  size_t apdu_used = 0;
+  size_t data_used = 0;
+  bool done = false;
+  ykpiv_rc res = YKPIV_OK;
   *out_len = 0;
 
-  do {
-    APDU apdu = {templ[0], templ[1], templ[2], templ[3], 0xff};
-    unsigned char data[YKPIV_OBJ_MAX_SIZE] = {0};
+  if (state->max_ext_len && !state->scp11_state.security_level && in_len <= state->max_ext_len) {
+    // Support was settled from the version when the application was selected, so every status word goes to the caller
+    res = _ykpiv_transfer_extended(state, templ, in_data, in_len, out_data, out_len, max_out, sw);
+    if (res != YKPIV_OK || (*sw & 0xff00) != 0x6100) {
+      return res;
+    }
+    if (out_data) {
+      out_data += *out_len;
+    }
+    goto GetResponse;
+  }
 
+  // Both buffers are reused for each APDU of a chain, only the bytes sent and received are wiped afterwards
+  if (!(apdu = (APDU*)_ykpiv_scratch_get(state, sizeof(APDU))) ||
+      !(data = _ykpiv_scratch_get(state, YKPIV_OBJ_MAX_SIZE))) {
+    res = YKPIV_MEMORY_ERROR;
+    goto Cleanup;
+  }
 
-    ykpiv_rc res = YKPIV_OK;
+  do {
+    unsigned char *recv_data = data;
     pcsc_word apdu_len;
+
+    memcpy(apdu->raw, templ, 4);
+    apdu->st.lc = 0xff;
     if (state->scp11_state.security_level) {
-      size_t apdu_length;
-      if((res = scp11_prepare_transfer(&state->scp11_state, &apdu, in_data, in_len, &apdu_length)) != YKPIV_OK) {
-        return res;
+      size_t apdu_length = 0;
+      uint64_t start = _ykpiv_now_us();
+      apdu_used = sizeof(APDU);
+      res = scp11_prepare_transfer(&state->scp11_state, apdu, in_data, in_len, &apdu_length);
+      state->stats.scp11_ops++;
+      state->stats.scp11_us += _ykpiv_now_us() - start;
+      if(res != YKPIV_OK) {
+        goto Cleanup;
       }
       in_len = 0;
       apdu_len = apdu_length;
     } else {
       if(in_len > 0xff) {
-        apdu.st.cla |= 0x10;
+        apdu->st.cla |= 0x10;
       } else {
-        apdu.st.lc = (unsigned char)in_len;
+        apdu->st.lc = (unsigned char)in_len;
       }
 
-      apdu_len = apdu.st.lc + 5;
+      apdu_len = apdu->st.lc + 5;
 
-      if(apdu.st.lc) {
-        memcpy(apdu.st.data, in_data, apdu.st.lc);
-        in_data += apdu.st.lc;
-        in_len -= apdu.st.lc;
+      if(apdu->st.lc) {
+        memcpy(apdu->st.data, in_data, apdu->st.lc);
+        in_data += apdu->st.lc;
+        in_len -= apdu->st.lc;
 
         // Add Le for T=1
         if (state->protocol == SCARD_PROTOCOL_T1) {
-          apdu.st.data[apdu.st.lc] = 0;
+          apdu->st.data[apdu->st.lc] = 0;
           apdu_len++;
         }
       }
     }
+    if (apdu_len > apdu_used) {
+      apdu_used = apdu_len;
+    }
+
+    // Plaintext responses go straight into the caller's buffer when it holds at least as much as ours
+    if (out_data && !state->scp11_state.security_level && max_out - *out_len >= YKPIV_OBJ_MAX_SIZE) {
+      recv_data = out_data;
+    }
 
   Retry:
     DBG("Going to send %u bytes in this go.", apdu_len);
-    pcsc_word recv_len = sizeof(data);
-    if((res = _ykpiv_transmit(state, apdu.raw, apdu_len, data, &recv_len, sw)) != YKPIV_OK) {
-      return res;
+    pcsc_word recv_len = recv_data == data ? YKPIV_OBJ_MAX_SIZE : (pcsc_word)(max_out - *out_len);
+    if((res = _ykpiv_transmit(state, apdu->raw, apdu_len, recv_data, &recv_len, sw)) != YKPIV_OK) {
+      data_used = YKPIV_OBJ_MAX_SIZE;
+      goto Cleanup;
+    }
+    if (recv_data == data && recv_len + 2 > data_used) {
+      data_used = recv_len + 2; // Including the status word
     }
     // Case 2S.3 — Process aborted; Ne not accepted, Na indicated
     if((*sw & 0xff00) == 0x6c00) {
-      apdu.st.lc = *sw & 0xff;
-      DBG3("The card indicates we must retry with Le = %u.", apdu.st.lc);
+      apdu->st.lc = *sw & 0xff;
+      DBG3("The card indicates we must retry with Le = %u.", apdu->st.lc);
       goto Retry;
     }
     if (*sw != SW_SUCCESS && (*sw & 0xff00) != 0x6100) {
-      return YKPIV_OK;
+      done = true;
+      goto Cleanup;
     }
 
     if (out_data) {
       if (state->scp11_state.security_level) {
-        uint8_t dec[2048] = {0};
-        uint32_t dec_len = sizeof(dec);
-        if ((res = scp11_decrypt_response(&state->scp11_state, data, recv_len, dec, &dec_len, *sw)) != YKPIV_OK) {
-          return res;
-        }
-        if (*out_len + dec_len > max_out) {
-          DBG("Output buffer to small, wanted to write %lu, max was %lu.", *out_len + dec_len, max_out);
-          return YKPIV_SIZE_ERROR;
+        unsigned long dec_len = max_out - *out_len;
+        if ((res = _ykpiv_scp11_receive(state, data, recv_len, out_data, &dec_len, sw)) != YKPIV_OK) {
+          goto Cleanup;
         }
-        memcpy(out_data, dec, dec_len);
         out_data += dec_len;
         *out_len += dec_len;
       } else {
-        if (*out_len + recv_len > max_out) {
-          DBG("Output buffer to small, wanted to write %lu, max was %lu.", *out_len + recv_len, max_out);
-          return YKPIV_SIZE_ERROR;
+        if (recv_data == data) {
+          if (*out_len + recv_len > max_out) {
+            DBG("Output buffer to small, wanted to write %lu, max was %lu.", *out_len + recv_len, max_out);
+            res = YKPIV_SIZE_ERROR;
+            goto Cleanup;
+          }
+          memcpy(out_data, data, recv_len);
         }
-        memcpy(out_data, data, recv_len);
         out_data += recv_len;
         *out_len += recv_len;
       }
     }
 
   } while (in_len);
+
+Cleanup:
+  _ykpiv_scratch_put(state, data, data_used);
+  _ykpiv_scratch_put(state, (unsigned char*)apdu, apdu_used);
+  if (res != YKPIV_OK || done) {
+    return res;
+  }
+
+GetResponse:
   while((*sw & 0xff00) == 0x6100) {
-    unsigned char apdu[] = {0, YKPIV_INS_GET_RESPONSE_APDU, 0, 0, *sw & 0xff};
-    unsigned char data[258] = {0};
+    unsigned char get_response[] = {0, YKPIV_INS_GET_RESPONSE_APDU, 0, 0, *sw & 0xff};
+    unsigned char buf[258];
+    unsigned char *recv_data = buf;
+    pcsc_word recv_len = sizeof(buf);
 
-    DBG3("The card indicates there is %u bytes more data for us.", apdu[4] ? apdu[4] : 0x100);
+    DBG3("The card indicates there is %u bytes more data for us.", get_response[4] ? get_response[4] : 0x100);
 
-    pcsc_word recv_len = sizeof(data);
-    ykpiv_rc res = _ykpiv_transmit(state, apdu, sizeof(apdu), data, &recv_len, sw);
+    if (out_data && !state->scp11_state.security_level && max_out - *out_len >= sizeof(buf)) {
+      recv_data = out_data;
+      recv_len = (pcsc_word)(max_out - *out_len);
+    }
+    res = _ykpiv_transmit(state, get_response, sizeof(get_response), recv_data, &recv_len, sw);
     if (res != YKPIV_OK) {
       return res;
     } else if (*sw != SW_SUCCESS && (*sw & 0xff00) != 0x6100) {
@@ -1409,23 +2201,44 @@ ykpiv_rc _ykpiv_transfer_data(ykpiv_state *state,
     }
 
     if (out_data) {
-      if (state->scp11_state.security_level) {
-        DBG("Reading response in chunks is not supported through encrypted sessions");
-        return YKPIV_NOT_SUPPORTED;
-      } else {
+      if (recv_data == buf) {
         if (*out_len + recv_len > max_out) {
           DBG("Output buffer to small, wanted to write %lu, max was %lu.", *out_len + recv_len, max_out);
           return YKPIV_SIZE_ERROR;
         }
-        memcpy(out_data, data, recv_len);
-        out_data += recv_len;
-        *out_len += recv_len;
+        memcpy(out_data, buf, recv_len);
       }
+      out_data += recv_len;
+      *out_len += recv_len;
     }
   }
   return YKPIV_OK;
 }
 
+ykpiv_rc _ykpiv_transfer_data(ykpiv_state *state,
+    const unsigned char *templ,
+    const unsigned char *in_data,
+    unsigned long in_len,
+    unsigned char *out_data,
+    unsigned long *out_len,
+    int *sw) {
+  // Round trips of the command, including chaining and GET RESPONSE, are accounted to its INS
+  ykpiv_ins_stats *stats = _ykpiv_ins_stats(state, templ[1]);
+  state->stats_cur = stats;
+  state->stats_apdus = 0;
+  uint64_t start = _ykpiv_now_us();
+  ykpiv_rc res = _ykpiv_transfer(state, templ, in_data, in_len, out_data, out_len, sw);
+  if(stats) {
+    stats->commands++;
+    if(res != YKPIV_OK) {
+      stats->errors++;
+    }
+    _ykpiv_stats_latency(stats, _ykpiv_now_us() - start);
+  }
+  state->stats_cur = NULL;
+  return res;
+}
+
 ykpiv_rc ykpiv_transfer_data(ykpiv_state *state, const unsigned char *templ,
     const unsigned char *in_data, long in_len,
     unsigned char *out_data, unsigned long *out_len, int *sw) {
@@ -1440,12 +2253,93 @@ ykpiv_rc ykpiv_transfer_data(ykpiv_state *state, const unsigned char *templ,
   return res;
 }
 
+static ykpiv_rc _ykpiv_stream(ykpiv_state *state,
+    const unsigned char *templ,
+    const unsigned char *in_data,
+    unsigned long in_len,
+    ykpiv_pfn_chunk pfn_chunk,
+    void *chunk_data,
+    int *sw) {
+  ykpiv_rc res;
+
+  if (state->scp11_state.security_level || state->max_ext_len || in_len > 0xff) {
+    // The response is decrypted, or received in one go, as a whole
+    unsigned char *data = NULL;
+    unsigned long recv_len = YKPIV_OBJ_MAX_SIZE;
+    if (!(data = _ykpiv_scratch_get(state, YKPIV_OBJ_MAX_SIZE))) {
+      return YKPIV_MEMORY_ERROR;
+    }
+    res = _ykpiv_transfer(state, templ, in_data, in_len, data, &recv_len, sw);
+    if (res == YKPIV_OK && *sw == SW_SUCCESS && recv_len) {
+      res = pfn_chunk(chunk_data, data, recv_len);
+    }
+    _ykpiv_scratch_put(state, data, res == YKPIV_OK ? recv_len + 2 : YKPIV_OBJ_MAX_SIZE);
+    return res;
+  }
+
+  unsigned char apdu[5 + 0xff + 1];
+  unsigned char buf[258];
+  pcsc_word apdu_len = 5 + in_len;
+  pcsc_word recv_len = sizeof(buf);
+
+  memcpy(apdu, templ, 4);
+  apdu[4] = (unsigned char)in_len;
+  memcpy(apdu + 5, in_data, in_len);
+  // Add Le for T=1
+  if (in_len && state->protocol == SCARD_PROTOCOL_T1) {
+    apdu[apdu_len++] = 0;
+  }
+
+  DBG("Going to send %u bytes and stream the response.", apdu_len);
+  res = _ykpiv_transmit(state, apdu, apdu_len, buf, &recv_len, sw);
+  while (res == YKPIV_OK && (*sw == SW_SUCCESS || (*sw & 0xff00) == 0x6100)) {
+    if (recv_len && (res = pfn_chunk(chunk_data, buf, recv_len)) != YKPIV_OK) {
+      break;
+    }
+    if ((*sw & 0xff00) != 0x6100) {
+      break;
+    }
+    unsigned char get_response[] = {0, YKPIV_INS_GET_RESPONSE_APDU, 0, 0, *sw & 0xff};
+    DBG3("The card indicates there is %u bytes more data for us.", get_response[4] ? get_response[4] : 0x100);
+    recv_len = sizeof(buf);
+    res = _ykpiv_transmit(state, get_response, sizeof(get_response), buf, &recv_len, sw);
+  }
+
+  yc_memzero(apdu, sizeof(apdu));
+  yc_memzero(buf, sizeof(buf));
+  return res;
+}
+
+// Variant of _ykpiv_transfer_data() that passes each part of the response to pfn_chunk instead of collecting it
+static ykpiv_rc _ykpiv_transfer_stream(ykpiv_state *state,
+    const unsigned char *templ,
+    const unsigned char *in_data,
+    unsigned long in_len,
+    ykpiv_pfn_chunk pfn_chunk,
+    void *chunk_data,
+    int *sw) {
+  ykpiv_ins_stats *stats = _ykpiv_ins_stats(state, templ[1]);
+  state->stats_cur = stats;
+  state->stats_apdus = 0;
+  uint64_t start = _ykpiv_now_us();
+  ykpiv_rc res = _ykpiv_stream(state, templ, in_data, in_len, pfn_chunk, chunk_data, sw);
+  if(stats) {
+    stats->commands++;
+    if(res != YKPIV_OK) {
+      stats->errors++;
+    }
+    _ykpiv_stats_latency(stats, _ykpiv_now_us() - start);
+  }
+  state->stats_cur = NULL;
+  return res;
+}
+
 ykpiv_rc _ykpiv_send_apdu(ykpiv_state *state, APDU *apdu,
     unsigned char *data, unsigned long *recv_len, int *sw) {
   return _ykpiv_transfer_data(state, apdu->raw, apdu->st.data, apdu->st.lc, data, recv_len, sw);
 }
 
-static ykpiv_rc _ykpiv_get_metadata(ykpiv_state *state, const unsigned char key, unsigned char *data, unsigned long *data_len) {
+ykpiv_rc _ykpiv_get_metadata(ykpiv_state *state, const unsigned char key, unsigned char *data, unsigned long *data_len) {
   ykpiv_rc res;
   unsigned char templ[] = {0, YKPIV_INS_GET_METADATA, 0, key};
   int sw = 0;
@@ -1674,6 +2568,7 @@ ykpiv_rc ykpiv_set_mgmkey3(ykpiv_state *state, const unsigned char *new_key, siz
   res = ykpiv_translate_sw_ex(__FUNCTION__, sw);
   if (res == YKPIV_OK) {
     _cache_mgm_key(state, new_key, len);
+    _ykpiv_clear_mgm_cache(state);
     goto Cleanup;
   }
 
@@ -1718,11 +2613,13 @@ static ykpiv_rc _general_authenticate(ykpiv_state *state,
     const unsigned char *sign_in, size_t in_len,
     unsigned char *out, size_t *out_len,
     unsigned char algorithm, unsigned char key, bool decipher) {
-  unsigned char indata[YKPIV_OBJ_MAX_SIZE] = {0};
-  unsigned char *dataptr = indata;
-  unsigned char data[YKPIV_OBJ_MAX_SIZE] = {0};
+  unsigned char *indata = NULL;
+  unsigned char *dataptr = NULL;
+  unsigned char *data = NULL;
   unsigned char templ[] = {0, YKPIV_INS_AUTHENTICATE, algorithm, key};
-  unsigned long recv_len = sizeof(data);
+  unsigned long recv_len = YKPIV_OBJ_MAX_SIZE;
+  size_t indata_used = YKPIV_OBJ_MAX_SIZE;
+  size_t data_used = YKPIV_OBJ_MAX_SIZE;
   size_t key_len = 0;
   int sw = 0;
   size_t bytes, offs;
@@ -1783,6 +2680,11 @@ static ykpiv_rc _general_authenticate(ykpiv_state *state,
   }
 
   bytes = _ykpiv_get_length_size(in_len);
+  if(!(indata = _ykpiv_scratch_get(state, YKPIV_OBJ_MAX_SIZE)) || !(data = _ykpiv_scratch_get(state, YKPIV_OBJ_MAX_SIZE))) {
+    res = YKPIV_MEMORY_ERROR;
+    goto Cleanup;
+  }
+  dataptr = indata;
 
   *dataptr++ = 0x7c;
   dataptr += _ykpiv_set_length(dataptr, in_len + bytes + 3);
@@ -1790,24 +2692,28 @@ static ykpiv_rc _general_authenticate(ykpiv_state *state,
   *dataptr++ = 0x00;
   *dataptr++ = !YKPIV_IS_RSA(algorithm) && decipher ? 0x85 : 0x81;
   dataptr += _ykpiv_set_length(dataptr, in_len);
-  if(dataptr - indata + in_len > sizeof(indata)) {
-    return YKPIV_SIZE_ERROR;
+  if(dataptr - indata + in_len > YKPIV_OBJ_MAX_SIZE) {
+    res = YKPIV_SIZE_ERROR;
+    goto Cleanup;
   }
   memcpy(dataptr, sign_in, in_len);
   dataptr += in_len;
+  indata_used = dataptr - indata;
 
   if((res = _ykpiv_transfer_data(state, templ, indata, (unsigned long)(dataptr - indata), data, &recv_len, &sw)) != YKPIV_OK) {
-    return res;
+    goto Cleanup;
   }
+  data_used = recv_len + 2;
   res = ykpiv_translate_sw_ex(__FUNCTION__, sw);
   if(res != YKPIV_OK) {
     DBG("Sign command failed");
-    return res;
+    goto Cleanup;
   }
   /* skip the first 7c tag */
   if(data[0] != 0x7c) {
     DBG("Failed parsing signature reply.");
-    return YKPIV_PARSE_ERROR;
+    res = YKPIV_PARSE_ERROR;
+    goto Cleanup;
   }
   dataptr = data + 1;
   offs = _ykpiv_get_length(dataptr, data + recv_len, &len);
@@ -1815,18 +2721,24 @@ static ykpiv_rc _general_authenticate(ykpiv_state *state,
   /* skip the 82 tag */
   if(!offs || *dataptr != 0x82) {
     DBG("Failed parsing signature reply.");
-    return YKPIV_PARSE_ERROR;
+    res = YKPIV_PARSE_ERROR;
+    goto Cleanup;
   }
   dataptr++;
   offs = _ykpiv_get_length(dataptr, data + recv_len, &len);
   dataptr += offs;
   if(!offs || len > *out_len) {
     DBG("Wrong size on output buffer.");
-    return YKPIV_PARSE_ERROR;
+    res = YKPIV_PARSE_ERROR;
+    goto Cleanup;
   }
   *out_len = len;
   memcpy(out, dataptr, len);
-  return YKPIV_OK;
+
+Cleanup:
+  _ykpiv_scratch_put(state, data, data_used);
+  _ykpiv_scratch_put(state, indata, indata_used);
+  return res;
 }
 
 ykpiv_rc ykpiv_sign_data(ykpiv_state *state,
@@ -1848,6 +2760,33 @@ ykpiv_rc ykpiv_sign_data(ykpiv_state *state,
   return res;
 }
 
+ykpiv_rc ykpiv_sign_data_batch(ykpiv_state *state, unsigned char key, unsigned char algorithm,
+    const unsigned char *const *sign_in, const size_t *in_len, size_t n,
+    unsigned char **sign_out, size_t *out_len) {
+  ykpiv_rc res = YKPIV_OK;
+  size_t i = 0;
+
+  if (NULL == state || (n && (!sign_in || !in_len || !sign_out || !out_len))) return YKPIV_ARGUMENT_ERROR;
+
+  if (YKPIV_OK != (res = _ykpiv_begin_transaction(state))) return res;
+  /* don't attempt to reselect in crypt operations to avoid problems with PIN_ALWAYS */
+
+  for(i = 0; i < n; i++) {
+    if (YKPIV_OK != (res = _general_authenticate(state, sign_in[i], in_len[i], sign_out[i], out_len + i,
+                                                 algorithm, key, false))) {
+      DBG("Signing %zu of %zu failed", i + 1, n);
+      break;
+    }
+  }
+  // Signatures not produced are marked as empty
+  for(; i < n; i++) {
+    out_len[i] = 0;
+  }
+
+  _ykpiv_end_transaction(state);
+  return res;
+}
+
 ykpiv_rc ykpiv_decipher_data(ykpiv_state *state, const unsigned char *in,
     size_t in_len, unsigned char *out, size_t *out_len,
     unsigned char algorithm, unsigned char key) {
@@ -2027,6 +2966,30 @@ Cleanup:
   return res;
 }
 
+ykpiv_rc ykpiv_get_device_info(ykpiv_state *state, ykpiv_device_info *info) {
+  ykpiv_rc res = YKPIV_OK;
+
+  if (!state || !info) return YKPIV_ARGUMENT_ERROR;
+
+  // Both are read when selecting the application, only ask the card if that failed
+  if (!(state->ver.major || state->ver.minor || state->ver.patch) || !state->serial) {
+    uint8_t scp11 = state->scp11_state.security_level;
+    if ((res = _ykpiv_begin_transaction(state)) != YKPIV_OK) return res;
+    if ((res = _ykpiv_ensure_application_selected(state, scp11)) == YKPIV_OK &&
+        (res = _ykpiv_get_version(state)) == YKPIV_OK) {
+      res = _ykpiv_get_serial(state);
+    }
+    _ykpiv_end_transaction(state);
+  }
+
+  info->model = ykpiv_util_devicemodel(state);
+  info->major = state->ver.major;
+  info->minor = state->ver.minor;
+  info->patch = state->ver.patch;
+  info->serial = state->serial;
+  return res;
+}
+
 static ykpiv_rc _cache_pin(ykpiv_state *state, const char *pin, size_t len) {
 #if DISABLE_PIN_CACHE
   // Some embedded applications of this library may not want to keep the PIN
@@ -2084,6 +3047,12 @@ static ykpiv_rc _cache_mgm_key(ykpiv_state *state, unsigned const char *key, siz
 #endif
 }
 
+void _ykpiv_clear_mgm_cache(ykpiv_state *state) {
+  bool enabled = state->mgm_cache.enabled;
+  yc_memzero(&state->mgm_cache, sizeof(state->mgm_cache));
+  state->mgm_cache.enabled = enabled;
+}
+
 static ykpiv_rc _verify_pin_apdu(char *pin, size_t *p_pin_len, bool verify_spin, APDU *apdu) {
   if (p_pin_len && (*p_pin_len > CB_PIN_MAX)) {
     return YKPIV_SIZE_ERROR;
@@ -2234,6 +3203,25 @@ ykpiv_rc ykpiv_verify_select(ykpiv_state *state, const char *pin, const size_t p
   return _ykpiv_verify_select(state, (char*)pin, &temp_pin_len, tries, force_select, false, false);
 }
 
+ykpiv_rc ykpiv_sign_data_with_pin(ykpiv_state *state, const char *pin, size_t pin_len,
+    const unsigned char *sign_in, size_t in_len, unsigned char *sign_out,
+    size_t *out_len, unsigned char algorithm, unsigned char key, int *tries) {
+  ykpiv_rc res = YKPIV_OK;
+  size_t len = pin_len;
+
+  if (NULL == state || NULL == pin || 0 == pin_len) return YKPIV_ARGUMENT_ERROR;
+
+  if (YKPIV_OK != (res = _ykpiv_begin_transaction(state))) return res;
+  /* as for ykpiv_sign_data, no reselection between the VERIFY and the signature */
+  res = _ykpiv_verify(state, (char*)pin, &len, false, false);
+  if (tries) *tries = state->tries;
+  if (YKPIV_OK == res) {
+    res = _general_authenticate(state, sign_in, in_len, sign_out, out_len, algorithm, key, false);
+  }
+  _ykpiv_end_transaction(state);
+  return res;
+}
+
 ykpiv_rc ykpiv_get_pin_retries(ykpiv_state *state, int *tries) {
   ykpiv_rc res;
 
@@ -2290,6 +3278,9 @@ ykpiv_rc ykpiv_set_pin_retries(ykpiv_state *state, int pin_tries, int puk_tries)
   if (res == YKPIV_OK) {
     res = ykpiv_translate_sw_ex(__FUNCTION__, sw);
   }
+  if (res == YKPIV_OK) {
+    state->tries = pin_tries;
+  }
 
 Cleanup:
   _ykpiv_end_transaction(state);
@@ -2331,11 +3322,17 @@ static ykpiv_rc _ykpiv_change_pin(ykpiv_state *state, int action, const char * c
     return res;
   }
   res = ykpiv_translate_sw_ex(__FUNCTION__, sw);
+  // Keep the PIN attempts served by ykpiv_get_pin_retries() current, a wrong PUK doesn't affect them
+  if(res == YKPIV_OK && action != CHREF_ACT_CHANGE_PUK) {
+    state->tries = -1; // The counter is back at its maximum, which is only known after the next query
+  }
   if(res != YKPIV_OK) {
     if((sw >> 8) == 0x63) {
       if (tries) *tries = sw & 0xf;
+      if (action == CHREF_ACT_CHANGE_PIN) state->tries = sw & 0xf;
       return YKPIV_WRONG_PIN;
     } else {
+      if (action == CHREF_ACT_CHANGE_PIN && sw == SW_ERR_AUTH_BLOCKED) state->tries = 0;
       DBG("Failed changing pin");
     }
   }
@@ -2400,35 +3397,128 @@ Cleanup:
   return res;
 }
 
+ykpiv_rc ykpiv_fetch_object_view(ykpiv_state *state, int object_id, unsigned char *buf, unsigned long buf_len,
+    unsigned char **data, unsigned long *len) {
+  ykpiv_rc res;
+  uint8_t scp11 = state->scp11_state.security_level;
+  if (YKPIV_OK != (res = _ykpiv_begin_transaction(state))) return res;
+  if (YKPIV_OK != (res = _ykpiv_ensure_application_selected(state, scp11))) goto Cleanup;
+
+  res = _ykpiv_fetch_object_view(state, object_id, buf, buf_len, data, len);
+
+Cleanup:
+  _ykpiv_end_transaction(state);
+  return res;
+}
+
+ykpiv_rc ykpiv_fetch_object_stream(ykpiv_state *state, int object_id, ykpiv_pfn_chunk pfn_chunk, void *chunk_data) {
+  ykpiv_rc res;
+  if (!pfn_chunk) return YKPIV_ARGUMENT_ERROR;
+  uint8_t scp11 = state->scp11_state.security_level;
+  if (YKPIV_OK != (res = _ykpiv_begin_transaction(state))) return res;
+  if (YKPIV_OK != (res = _ykpiv_ensure_application_selected(state, scp11))) goto Cleanup;
+
+  res = _ykpiv_fetch_object_stream(state, object_id, pfn_chunk, chunk_data);
+
+Cleanup:
+  _ykpiv_end_transaction(state);
+  return res;
+}
+
+typedef struct {
+  tlv_stream obj;
+  ykpiv_pfn_chunk pfn_chunk;
+  void *chunk_data;
+} _fetch_stream;
+
+static ykpiv_rc _fetch_stream_chunk(void *chunk_data, const unsigned char *data, size_t len) {
+  _fetch_stream *fetch = (_fetch_stream *) chunk_data;
+  if (!tlv_stream_header(&fetch->obj, &data, &len)) {
+    return fetch->obj.error ? YKPIV_PARSE_ERROR : YKPIV_OK;
+  }
+  size_t value_len = 0;
+  const unsigned char *value = tlv_stream_value(&fetch->obj, &data, &len, &value_len);
+  if (len) {
+    DBG("Invalid length indicated in object, %zu bytes more than the indicated length %zu.", len, fetch->obj.length);
+    return YKPIV_SIZE_ERROR;
+  }
+  return value_len ? fetch->pfn_chunk(fetch->chunk_data, value, value_len) : YKPIV_OK;
+}
+
+ykpiv_rc _ykpiv_fetch_object_stream(ykpiv_state *state, int object_id, ykpiv_pfn_chunk pfn_chunk, void *chunk_data) {
+  int sw = 0;
+  unsigned char indata[5] = {0};
+  unsigned char *inptr = indata;
+  unsigned char templ[] = {0, YKPIV_INS_GET_DATA, 0x3f, 0xff};
+  _fetch_stream fetch = {{{0}}};
+  ykpiv_rc res;
+
+  inptr = set_object(object_id, inptr);
+  if(inptr == NULL) {
+    return YKPIV_INVALID_OBJECT;
+  }
+
+  tlv_stream_init(&fetch.obj);
+  fetch.pfn_chunk = pfn_chunk;
+  fetch.chunk_data = chunk_data;
+  if((res = _ykpiv_transfer_stream(state, templ, indata, (unsigned long)(inptr - indata), _fetch_stream_chunk, &fetch, &sw))
+      != YKPIV_OK) {
+    return res;
+  }
+  res = ykpiv_translate_sw_ex(__FUNCTION__, sw);
+  if(res != YKPIV_OK) {
+    DBG("Failed to get data for object %x", object_id);
+  } else if(!fetch.obj.complete) {
+    res = YKPIV_PARSE_ERROR;
+  } else if(fetch.obj.remaining) {
+    DBG("Invalid length indicated in object, %zu bytes missing of the indicated length %zu.", fetch.obj.remaining, fetch.obj.length);
+    res = YKPIV_SIZE_ERROR;
+  }
+  return res;
+}
+
 ykpiv_rc _ykpiv_fetch_object(ykpiv_state *state, int object_id,
     unsigned char *data, unsigned long *len) {
+  unsigned char *payload = NULL;
+  ykpiv_rc res = _ykpiv_fetch_object_view(state, object_id, data, *len, &payload, len);
+  if(res == YKPIV_OK) {
+    memmove(data, payload, *len);
+  }
+  return res;
+}
+
+ykpiv_rc _ykpiv_fetch_object_view(ykpiv_state *state, int object_id, unsigned char *buf, unsigned long buf_len,
+    unsigned char **data, unsigned long *len) {
   int sw = 0;
   unsigned char indata[5] = {0};
   unsigned char *inptr = indata;
   unsigned char templ[] = {0, YKPIV_INS_GET_DATA, 0x3f, 0xff};
+  unsigned long recv_len = buf_len;
   ykpiv_rc res;
 
+  *len = 0;
+
   inptr = set_object(object_id, inptr);
   if(inptr == NULL) {
     return YKPIV_INVALID_OBJECT;
   }
 
-  if((res = _ykpiv_transfer_data(state, templ, indata, (unsigned long)(inptr - indata), data, len, &sw))
+  if((res = _ykpiv_transfer_data(state, templ, indata, (unsigned long)(inptr - indata), buf, &recv_len, &sw))
       != YKPIV_OK) {
     return res;
   }
   res = ykpiv_translate_sw_ex(__FUNCTION__, sw);
   if(res == YKPIV_OK) {
     size_t outlen = 0;
-    size_t offs = _ykpiv_get_length(data + 1, data + *len, &outlen);
+    size_t offs = _ykpiv_get_length(buf + 1, buf + recv_len, &outlen);
     if(!offs) {
       return YKPIV_PARSE_ERROR;
     }
-    if(outlen + offs + 1 != *len) {
-      DBG("Invalid length indicated in object, total objlen is %lu, indicated length is %lu.", *len, (unsigned long)outlen);
+    if(outlen + offs + 1 != recv_len) {
+      DBG("Invalid length indicated in object, total objlen is %lu, indicated length is %lu.", recv_len, (unsigned long)outlen);
       return YKPIV_SIZE_ERROR;
     }
-    memmove(data, data + 1 + offs, outlen);
+    *data = buf + 1 + offs;
     *len = (unsigned long)outlen;
   } else {
     DBG("Failed to get data for object %x", object_id);
@@ -2455,31 +3545,39 @@ ykpiv_rc _ykpiv_save_object(
     int object_id,
     unsigned char *indata,
     size_t len) {
-  unsigned char data[CB_BUF_MAX] = {0};
-  unsigned char *dataptr = data;
+  unsigned char *data = NULL;
+  unsigned char *dataptr = NULL;
   unsigned char templ[] = {0, YKPIV_INS_PUT_DATA, 0x3f, 0xff};
   int sw = 0;
   ykpiv_rc res;
   unsigned long outlen = 0;
 
-  dataptr = set_object(object_id, dataptr);
+  if(!(data = _ykpiv_scratch_get(state, CB_BUF_MAX))) {
+    return YKPIV_MEMORY_ERROR;
+  }
+  dataptr = set_object(object_id, data);
   if(dataptr == NULL) {
-    return YKPIV_INVALID_OBJECT;
+    res = YKPIV_INVALID_OBJECT;
+    goto Cleanup;
   }
   *dataptr++ = 0x53;
   dataptr += _ykpiv_set_length(dataptr, len);
-  if(dataptr + len > data + sizeof(data)) {
-    return YKPIV_SIZE_ERROR;
+  if(dataptr + len > data + CB_BUF_MAX) {
+    res = YKPIV_SIZE_ERROR;
+    goto Cleanup;
   }
   if(indata)
     memcpy(dataptr, indata, len);
   dataptr += len;
 
   if((res = _ykpiv_transfer_data(state, templ, data, (unsigned long)(dataptr - data), NULL, &outlen,
-    &sw)) != YKPIV_OK) {
-    return res;
+    &sw)) == YKPIV_OK) {
+    res = ykpiv_translate_sw_ex(__FUNCTION__, sw);
   }
-  return ykpiv_translate_sw_ex(__FUNCTION__, sw);
+
+Cleanup:
+  _ykpiv_scratch_put(state, data, dataptr ? (size_t)(dataptr - data) : 0);
+  return res;
 }
 
 ykpiv_rc ykpiv_import_private_key(ykpiv_state *state, const unsigned char key, unsigned char algorithm,
@@ -93,6 +93,13 @@ extern "C"
   ykpiv_rc ykpiv_connect(ykpiv_state *state, const char *wanted);
   ykpiv_rc ykpiv_connect_ex(ykpiv_state *state, const char *wanted, bool scp11);
   ykpiv_rc ykpiv_list_readers(ykpiv_state *state, char *readers, size_t *len);
+
+  /**
+   * Whether ykpiv_connect() and ykpiv_pool_init() consider \p reader for \p wanted, that is whether \p reader
+   * contains \p wanted, ignoring case. NULL and "*" match every reader.
+   */
+  bool ykpiv_reader_matches(const char *reader, const char *wanted);
+
   ykpiv_rc ykpiv_disconnect(ykpiv_state *state);
   ykpiv_rc ykpiv_translate_sw(int sw);
   ykpiv_rc ykpiv_translate_sw_ex(const char *whence, int sw);
@@ -150,8 +157,13 @@ extern "C"
    *
    * **NOTE:** If PIN is already verified, calling ykpiv_get_pin_retries() will unverify the PIN.
    *
+   * If \p tries is YKPIV_RETRIES_MAX on input, the card is not queried. Instead the number last reported by the
+   * card is returned, as seen when connecting, checking the application selection, verifying or changing the PIN,
+   * unblocking it or setting the number of retries. It is negative if the PIN is verified, or the number is not
+   * known since the counter was reset.
+   *
    * @param state State handle from ykpiv_init()
-   * @param tries [out] Number of attempts remaining
+   * @param tries [in,out] Number of attempts remaining
    *
    * @return Error code
    */
@@ -194,6 +206,101 @@ extern "C"
    */
   ykpiv_rc ykpiv_done_with_external_card(ykpiv_state *state);
 
+  /**
+   * Exchanges APDUs with a card instead of PC/SC, for example with a software implementation of the PIV application.
+   */
+  typedef struct ykpiv_transport {
+    void *ctx;
+    /**
+     * Send one command APDU and receive the response, including the status word.
+     * \p recv_len holds the size of \p recv on input. Returns YKPIV_OK when a response was received.
+     */
+    ykpiv_rc (*transmit)(void *ctx, const unsigned char *send, size_t send_len, unsigned char *recv, size_t *recv_len);
+    /** Acquire exclusive use of the card, may be NULL */
+    ykpiv_rc (*begin_transaction)(void *ctx);
+    /** Release exclusive use of the card, may be NULL */
+    void (*end_transaction)(void *ctx);
+    /** Release \p ctx when the state disconnects, may be NULL */
+    void (*close)(void *ctx);
+  } ykpiv_transport;
+
+  /**
+   * Variant of ykpiv_connect() that sends all commands through \p transport.
+   *
+   * The PIV application is selected, as with ykpiv_connect(). The transport is used until ykpiv_disconnect(),
+   * and reconnecting to a card that was reset is left to it. On success the state owns \p transport and
+   * calls its close function when disconnecting, on failure the caller keeps it.
+   *
+   * @param state State handle
+   * @param transport Functions to use, copied into the state
+   *
+   * @return Error code
+   */
+  ykpiv_rc ykpiv_connect_with_transport(ykpiv_state *state, const ykpiv_transport *transport);
+
+  /**
+   * Reader names starting with this prefix are YubiKeys accessed directly over USB, without PC/SC.
+   *
+   * When passed to ykpiv_connect() or ykpiv_connect_ex(), the rest of the name is matched against the names from
+   * ykpiv_list_usb_readers() like other reader names, or against the serial number of the YubiKey if it only has
+   * digits. The CCID interface stays claimed until ykpiv_disconnect(), so pcscd must not be using the YubiKey.
+   * Only available when built with ENABLE_CCID, otherwise connecting returns YKPIV_NOT_SUPPORTED.
+   */
+#define YKPIV_USB_READER_PREFIX "usb:"
+
+  /**
+   * Lists the YubiKeys that can be accessed over USB, in the format of ykpiv_list_readers().
+   *
+   * @param state State handle
+   * @param readers Buffer for the reader names, each prefixed with YKPIV_USB_READER_PREFIX
+   * @param len Size of \p readers on input, length of the list on output
+   *
+   * @return Error code, YKPIV_NOT_SUPPORTED if built without ENABLE_CCID
+   */
+  ykpiv_rc ykpiv_list_usb_readers(ykpiv_state *state, char *readers, size_t *len);
+
+  /**
+   * Reader names starting with this prefix are cards shared by another process with ykpiv_broker_serve().
+   *
+   * When passed to ykpiv_connect() or ykpiv_connect_ex(), with or without a leading '@', the rest of the name is the
+   * path of the socket of the broker. Only available on Linux and MacOS, otherwise connecting returns
+   * YKPIV_NOT_SUPPORTED.
+   */
+#define YKPIV_BROKER_READER_PREFIX "broker:"
+
+  /**
+   * Shares the card connected to \p state with other processes, until \p stop is set.
+   *
+   * Listens on a Unix socket at \p path, and exchanges the APDUs of the states connected through
+   * YKPIV_BROKER_READER_PREFIX with the card as they are. A state that begins a transaction has the card to itself
+   * until it ends it, the others wait their turn. The PC/SC transaction is kept for up to 200ms while states are
+   * waiting, so that other applications don't reset or reselect the card in between. The socket is only accessible
+   * to the user running the broker, and connections from other users than that one and root are refused. A client
+   * that takes more than a second to send the rest of a request or to read its response is disconnected.
+   *
+   * @param state State handle, connected without SCP11
+   * @param path Path of the socket, a socket left at that path by an earlier broker is replaced
+   * @param stop Checked about every 250ms, may be NULL to serve until an error
+   *
+   * @return Error code, YKPIV_NOT_SUPPORTED on Windows
+   */
+  ykpiv_rc ykpiv_broker_serve(ykpiv_state *state, const char *path, const volatile int *stop);
+
+  /**
+   * Sets the file used to keep the public keys of the security domains of YubiKeys between processes.
+   *
+   * Opening an SCP11 channel reads the certificates of the security domain to find its public key. The key is
+   * cached for the process by serial number and key version, so later channels to the same YubiKey skip
+   * selecting the security domain and reading the certificates. A cached key that the YubiKey doesn't accept is
+   * dropped and read again. When a file is set, keys already in it are added to the cache, and new keys are written
+   * to it. The file defaults to the value of the environment variable YKPIV_SD_CACHE.
+   *
+   * @param path File to use, or NULL to only cache keys in memory
+   *
+   * @return Error code
+   */
+  ykpiv_rc ykpiv_set_sd_cache_file(const char *path);
+
   /**
    * Variant of ykpiv_verify() that optionally selects the PIV applet first.
    *
@@ -222,6 +329,397 @@ extern "C"
    */
   ykpiv_rc ykpiv_get_serial(ykpiv_state *state, uint32_t* p_serial);
 
+  typedef struct {
+    uint32_t model; // One of the DEVTYPE_* values, as returned by ykpiv_util_devicemodel()
+    uint8_t major;
+    uint8_t minor;
+    uint8_t patch;
+    uint32_t serial; // 0 if the serial number couldn't be read
+  } ykpiv_device_info;
+
+  /**
+   * Get the model, firmware version and serial number of the card
+   *
+   * These are read once when the card is connected, so this normally doesn't exchange any APDUs with the card.
+   *
+   * @param state [in] State handle
+   * @param info [out] Device information
+   *
+   * @return ykpiv_rc error code
+   *
+   */
+  ykpiv_rc ykpiv_get_device_info(ykpiv_state *state, ykpiv_device_info *info);
+
+  /**
+   * Variant of ykpiv_fetch_object() that does not copy the object payload.
+   *
+   * The object is read into \p buf and \p data is set to point at the payload inside it,
+   * past the 0x53 TLV header.
+   *
+   * @param state State handle
+   * @param object_id Object to read
+   * @param buf Buffer to receive the object into
+   * @param buf_len Size of \p buf
+   * @param data [out] Start of the payload within \p buf
+   * @param len [out] Length of the payload
+   *
+   * @return Error code
+   */
+  ykpiv_rc ykpiv_fetch_object_view(ykpiv_state *state, int object_id, unsigned char *buf, unsigned long buf_len,
+                                   unsigned char **data, unsigned long *len);
+
+  /**
+   * Receives the next part of data read with ykpiv_fetch_object_stream() or ykpiv_util_read_msroots_cb().
+   *
+   * Returning anything but YKPIV_OK stops the read, and the error is returned to the caller.
+   */
+  typedef ykpiv_rc (*ykpiv_pfn_chunk)(void *chunk_data, const unsigned char *data, size_t len);
+
+  /**
+   * Variant of ykpiv_fetch_object() that passes the object payload to a callback as it is received.
+   *
+   * Without SCP11 and extended length APDUs, each response from the YubiKey is handed over as soon as it arrives,
+   * so the payload is never held in memory as a whole. Otherwise the object is received at once and handed over
+   * as a single part.
+   *
+   * Parts already handed over are not taken back if the read fails later on.
+   *
+   * @param state State handle
+   * @param object_id Object to read
+   * @param pfn_chunk Callback receiving the parts of the payload, past the 0x53 TLV header
+   * @param chunk_data Passed to \p pfn_chunk
+   *
+   * @return Error code
+   */
+  ykpiv_rc ykpiv_fetch_object_stream(ykpiv_state *state, int object_id, ykpiv_pfn_chunk pfn_chunk, void *chunk_data);
+
+  /**
+   * Wait for readers to be added or removed, or for cards to be inserted or removed.
+   *
+   * The first call records the current state of all readers, later calls report changes since the previous call.
+   * Where PC/SC does not support reader notifications, each call waits at most one second and may return early
+   * without a change.
+   *
+   * @param state State handle, only used for waiting
+   * @param timeout_ms Time to wait in milliseconds, 0 to check without waiting
+   * @param changed [out] Whether any reader or card changed
+   *
+   * @return Error code
+   */
+  ykpiv_rc ykpiv_wait_for_change(ykpiv_state *state, uint32_t timeout_ms, bool *changed);
+
+  /**
+   * Make a ykpiv_wait_for_change() blocked in another thread return without a change.
+   *
+   * @param state State handle passed to ykpiv_wait_for_change()
+   *
+   * @return Error code
+   */
+  ykpiv_rc ykpiv_cancel_wait(ykpiv_state *state);
+
+  /**
+   * Memory to borrow command and response buffers from, instead of the stack.
+   *
+   * By default a state allocates its workspace with its allocator the first time it talks to a card, and keeps
+   * it until ykpiv_done(). Buffers are wiped when they are given back. Calls that need more buffers than the
+   * workspace holds allocate the rest for the duration of the call.
+   *
+   * @param state State handle
+   * @param workspace Memory to use, at least YKPIV_OBJ_MAX_SIZE bytes and preferably \p YKPIV_WORKSPACE_SIZE, or
+   *                  NULL to allocate it again when needed. It must stay valid until the state is done or another
+   *                  workspace is set, and must not be shared with another state.
+   * @param size Size of \p workspace in bytes
+   *
+   * @return Error code
+   */
+  ykpiv_rc ykpiv_set_workspace(ykpiv_state *state, void *workspace, size_t size);
+
+  /**
+   * A set of YubiKeys holding the same keys, used interchangeably for private key operations.
+   *
+   * Each device is used by one request at a time. Requests go to the idle device that has served the fewest
+   * requests, preferring the device last used by the calling thread. Devices that fail are skipped and
+   * reconnected later, and the request is retried on another device.
+   *
+   * The pool functions can be called from multiple threads, except for ykpiv_pool_done().
+   */
+  typedef struct ykpiv_pool ykpiv_pool;
+
+  /**
+   * Connect to every reader matching \p wanted.
+   *
+   * @param pool [out] Pool handle
+   * @param wanted Reader name to match, as for ykpiv_connect(), or NULL for all readers
+   * @param verbose Debug level for the underlying state handles
+   *
+   * @return Error code, YKPIV_PCSC_ERROR if no matching reader could be connected
+   */
+  ykpiv_rc ykpiv_pool_init(ykpiv_pool **pool, const char *wanted, int verbose);
+
+  /**
+   * Disconnect all devices and free the pool. No other calls may be in progress on the pool.
+   *
+   * @param pool Pool handle
+   *
+   * @return Error code
+   */
+  ykpiv_rc ykpiv_pool_done(ykpiv_pool *pool);
+
+  /**
+   * Verify the PIN on every connected device.
+   *
+   * Stops at the first device that rejects the PIN, so that a wrong PIN only uses up one attempt.
+   *
+   * @param pool Pool handle
+   * @param pin PIN to verify, kept by each device to re-verify after reconnecting. A device that rejects it
+   *            when re-verifying forgets it, and the request fails with YKPIV_WRONG_PIN or YKPIV_PIN_LOCKED.
+   * @param tries [out] Remaining attempts on the device that rejected the PIN, may be NULL
+   *
+   * @return Error code
+   */
+  ykpiv_rc ykpiv_pool_verify(ykpiv_pool *pool, const char *pin, int *tries);
+
+  /**
+   * Same as ykpiv_sign_data(), on the least loaded available device.
+   */
+  ykpiv_rc ykpiv_pool_sign_data(ykpiv_pool *pool, const unsigned char *sign_in,
+                                size_t in_len, unsigned char *sign_out, size_t *out_len,
+                                unsigned char algorithm, unsigned char key);
+
+  /**
+   * Same as ykpiv_decipher_data(), on the least loaded available device.
+   */
+  ykpiv_rc ykpiv_pool_decipher_data(ykpiv_pool *pool, const unsigned char *enc_in,
+                                    size_t in_len, unsigned char *enc_out, size_t *out_len,
+                                    unsigned char algorithm, unsigned char key);
+
+  /**
+   * Get the number of devices in the pool.
+   *
+   * @param pool Pool handle
+   * @param devices [out] Number of devices, may be NULL
+   * @param healthy [out] Number of devices that did not fail their last request, may be NULL
+   *
+   * @return Error code
+   */
+  ykpiv_rc ykpiv_pool_get_status(ykpiv_pool *pool, size_t *devices, size_t *healthy);
+
+  /**
+   * Hold the card for a sequence of calls.
+   *
+   * Until the matching ykpiv_end_batch(), calls on the state share one PC/SC transaction instead of
+   * starting their own, and skip checking that the PIV application is still selected, since no other
+   * application can use the card in the meantime. Batches can be nested.
+   *
+   * @param state State handle
+   * @param max_hold_ms Longest time to keep other applications out, in milliseconds, or 0 for no limit.
+   *        Once it has passed, the next call releases the card and acquires it again, reselecting
+   *        the application and re-authenticating if another application has reset the card.
+   *        Ignored for nested batches.
+   *
+   * @return Error code
+   */
+  ykpiv_rc ykpiv_begin_batch(ykpiv_state *state, uint32_t max_hold_ms);
+
+  /**
+   * End a batch started by ykpiv_begin_batch(), releasing the card when the outermost batch ends.
+   *
+   * @param state State handle
+   *
+   * @return Error code, YKPIV_ARGUMENT_ERROR if no batch was started
+   */
+  ykpiv_rc ykpiv_end_batch(ykpiv_state *state);
+
+  /**
+   * Record debug messages and exchanged APDUs of all verbosity levels into per-thread ring buffers.
+   *
+   * Recording doesn't format messages or take locks, so it can stay enabled in production. Tracing
+   * is also enabled by setting the environment variable YKPIV_TRACE to the number of events, in
+   * which case SIGUSR2 dumps the buffers to stderr where the application doesn't handle it. APDUs
+   * carrying PINs, PUKs, management key authentication or key material are recorded without their
+   * data.
+   *
+   * @param events Number of events kept per thread, or 0 to stop recording. Buffers already
+   *        created keep their size.
+   *
+   * @return Error code
+   */
+  ykpiv_rc ykpiv_trace_enable(size_t events);
+
+  /**
+   * Format the recorded events, oldest first for each thread. Async-signal-safe as long as \p out is.
+   *
+   * @param out Called with each line, or NULL to print to stderr
+   *
+   * @return Error code
+   */
+  ykpiv_rc ykpiv_trace_dump(void (*out)(const char *line));
+
+#define YKPIV_STATS_MAX_INS 32 // Distinct instructions counted per state
+#define YKPIV_STATS_BUCKETS 24 // Latency buckets, bucket 0 counts commands under 2us, bucket n from 2^n us
+
+  typedef struct {
+    uint8_t ins;
+    uint64_t commands;
+    uint64_t errors;         // Commands that failed in PC/SC, status words are not counted as errors
+    uint64_t apdus;          // Round trips, including the ones below
+    uint64_t chained;        // Additional command APDUs, from command chaining or retries with a corrected Le
+    uint64_t get_responses;  // GET RESPONSE APDUs
+    uint64_t bytes_sent;
+    uint64_t bytes_received; // Including status words
+    uint64_t total_us;       // Time spent on the commands
+    uint64_t transmit_us;    // Part of total_us spent in SCardTransmit
+    uint64_t max_us;
+    uint64_t latency[YKPIV_STATS_BUCKETS];
+  } ykpiv_ins_stats;
+
+  typedef struct {
+    uint64_t transactions;        // Calls to SCardBeginTransaction
+    uint64_t transaction_retries; // Transactions that had to reconnect to the card first
+    uint64_t transaction_wait_us; // Time spent waiting for the card in SCardBeginTransaction
+    uint64_t batched;             // Operations that used the transaction held by a batch instead
+    uint64_t scp11_ops;           // Commands and responses encrypted or decrypted for SCP11
+    uint64_t scp11_us;            // Time spent on them
+    size_t n_ins;
+    ykpiv_ins_stats ins[YKPIV_STATS_MAX_INS]; // Per instruction, in the order they were first sent
+  } ykpiv_stats;
+
+  /**
+   * Get the counters kept for the commands sent through a state.
+   *
+   * Counters are always kept, and cover all connections made with the state. They are not
+   * synchronized, call this from the thread using the state or while holding its lock.
+   *
+   * @param state State handle
+   * @param stats [out] Counters
+   * @param reset Whether to start counting again from zero
+   *
+   * @return Error code
+   */
+  ykpiv_rc ykpiv_get_stats(ykpiv_state *state, ykpiv_stats *stats, bool reset);
+
+  /**
+   * Verify the PIN and sign, back to back within one transaction.
+   *
+   * Meant for keys with PIN policy always, which need the PIN to be verified right before each signature.
+   *
+   * @param state State handle
+   * @param pin PIN to verify, not necessarily NUL-terminated
+   * @param pin_len Length of \p pin
+   * @param sign_in Data to sign, as for ykpiv_sign_data()
+   * @param in_len Length of \p sign_in
+   * @param sign_out Buffer for the signature
+   * @param out_len [in, out] Size of \p sign_out, set to the length of the signature
+   * @param algorithm Key algorithm
+   * @param key Key slot
+   * @param tries [out] Remaining PIN attempts, as for ykpiv_verify(), may be NULL
+   *
+   * @return Error code, YKPIV_WRONG_PIN or YKPIV_PIN_LOCKED if the PIN was not accepted, in which case nothing is signed
+   */
+  ykpiv_rc ykpiv_sign_data_with_pin(ykpiv_state *state, const char *pin, size_t pin_len,
+                                    const unsigned char *sign_in, size_t in_len, unsigned char *sign_out,
+                                    size_t *out_len, unsigned char algorithm, unsigned char key, int *tries);
+
+  /**
+   * Sign several inputs with the same key within one transaction.
+   *
+   * Keys with PIN policy always can only produce one signature per PIN verification, so the batch
+   * fails after the first signature.
+   *
+   * @param state State handle
+   * @param key Key slot
+   * @param algorithm Key algorithm
+   * @param sign_in Data to sign, as for ykpiv_sign_data()
+   * @param in_len Length of each of \p sign_in
+   * @param n Number of inputs
+   * @param sign_out Buffers for the signatures
+   * @param out_len [in, out] Size of each of \p sign_out, set to the length of each signature and to 0 for
+   *                signatures not produced because of an error
+   *
+   * @return Error code of the first signature that failed, the remaining inputs are not signed
+   */
+  ykpiv_rc ykpiv_sign_data_batch(ykpiv_state *state, unsigned char key, unsigned char algorithm,
+                                 const unsigned char *const *sign_in, const size_t *in_len, size_t n,
+                                 unsigned char **sign_out, size_t *out_len);
+
+  /**
+   * Completion queue for asynchronous requests.
+   *
+   * Requests are run in submission order by a worker thread per state handle, started by the first
+   * request on the state. Completed requests are collected on the queue they were submitted with, and their
+   * callbacks run in the thread calling ykpiv_queue_poll(). One queue can collect requests for any number of
+   * state handles.
+   *
+   * A state handle belongs to its worker while it has requests in progress. Until they have completed, other
+   * calls on it that use the card fail with YKPIV_GENERIC_ERROR, more requests can still be submitted.
+   * ykpiv_done() waits for them.
+   */
+  typedef struct ykpiv_queue ykpiv_queue;
+
+  /**
+   * Called by ykpiv_queue_poll() for each completed request.
+   *
+   * @param ctx Context passed with the request
+   * @param res Result of the request
+   * @param out Output buffer passed with the request
+   * @param out_len Number of bytes written to \p out
+   */
+  typedef void (*ykpiv_async_cb)(void *ctx, ykpiv_rc res, unsigned char *out, size_t out_len);
+
+  ykpiv_rc ykpiv_queue_init(ykpiv_queue **queue);
+
+  /**
+   * Free the queue. Must not be called before ykpiv_done() on all states with requests on the queue.
+   * Callbacks of completed requests that have not been polled are not called.
+   */
+  ykpiv_rc ykpiv_queue_done(ykpiv_queue *queue);
+
+  /**
+   * Run the callbacks of completed requests.
+   *
+   * @param queue Queue handle
+   * @param timeout_ms Time to wait for a request to complete if none has, 0 to return immediately
+   * @param completed [out] Number of callbacks run, may be NULL
+   *
+   * @return Error code
+   */
+  ykpiv_rc ykpiv_queue_poll(ykpiv_queue *queue, uint32_t timeout_ms, size_t *completed);
+
+  /**
+   * Get a descriptor for event loops, readable (or signalled, on Windows, where it is a HANDLE) while the
+   * queue has completed requests. It is reset by ykpiv_queue_poll().
+   */
+  intptr_t ykpiv_queue_get_fd(ykpiv_queue *queue);
+
+  /**
+   * Same as ykpiv_sign_data(), without waiting for the result.
+   *
+   * \p sign_in and \p sign_out must stay valid until the callback has run.
+   *
+   * @param state State handle
+   * @param queue Queue to complete the request on
+   * @param sign_in Data to sign
+   * @param in_len Length of \p sign_in
+   * @param sign_out Buffer for the signature
+   * @param out_len Size of \p sign_out
+   * @param algorithm Key algorithm
+   * @param key Key slot
+   * @param callback Function run by ykpiv_queue_poll() when the request has completed
+   * @param ctx Passed to \p callback
+   *
+   * @return Error code, the callback is only run if the request was submitted successfully
+   */
+  ykpiv_rc ykpiv_sign_data_async(ykpiv_state *state, ykpiv_queue *queue, const unsigned char *sign_in,
+                                 size_t in_len, unsigned char *sign_out, size_t out_len,
+                                 unsigned char algorithm, unsigned char key, ykpiv_async_cb callback, void *ctx);
+
+  /**
+   * Same as ykpiv_decipher_data(), without waiting for the result. See ykpiv_sign_data_async().
+   */
+  ykpiv_rc ykpiv_decipher_data_async(ykpiv_state *state, ykpiv_queue *queue, const unsigned char *enc_in,
+                                     size_t in_len, unsigned char *enc_out, size_t out_len,
+                                     unsigned char algorithm, unsigned char key, ykpiv_async_cb callback, void *ctx);
+
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -309,6 +807,16 @@ extern "C"
     uint8_t pubkey[1024];
   } ykpiv_metadata;
 
+  typedef struct _ykpiv_key_info {
+    uint8_t slot;
+    uint8_t algorithm;
+    uint8_t pin_policy;
+    uint8_t touch_policy;
+    uint8_t origin;
+    size_t cert_len;
+    uint8_t *cert;
+  } ykpiv_key_info;
+
   /**
    * Free allocated data
    *
@@ -321,6 +829,91 @@ extern "C"
    */
   ykpiv_rc ykpiv_util_free(ykpiv_state *state, void *data);
 
+  /**
+   * Use another allocator for the buffers returned by the \p ykpiv_util functions.
+   *
+   * Buffers returned before the allocator is changed must still be freed with \p ykpiv_util_free() before the change.
+   *
+   * @param state State handle
+   * @param allocator Allocator for returned buffers, for example from ykpiv_arena_get_allocator(), or NULL to use
+   *                  the allocator of \p state again
+   *
+   * @return Error code
+   */
+  ykpiv_rc ykpiv_util_set_allocator(ykpiv_state *state, const ykpiv_allocator *allocator);
+
+  /**
+   * Memory region that hands out buffers from large blocks and releases them all at once.
+   *
+   * Freeing a buffer only gives its memory back if it is the most recent allocation, everything else is kept
+   * until ykpiv_arena_reset(). Blocks are kept across resets, so repeating the same work in a loop with a reset
+   * in between only allocates memory during the first iteration.
+   *
+   * An arena must not be used from several threads at once.
+   */
+  typedef struct ykpiv_arena ykpiv_arena;
+
+  typedef struct ykpiv_arena_stats {
+    size_t allocations;       // Buffers handed out
+    size_t bytes;             // Bytes in use since the last reset, including headers
+    size_t peak_bytes;        // Highest value of bytes
+    size_t capacity;          // Bytes held in blocks
+    size_t blocks;            // Blocks held
+    size_t block_allocations; // Blocks allocated from the system
+    size_t resets;            // Calls to ykpiv_arena_reset()
+  } ykpiv_arena_stats;
+
+  /**
+   * Create an arena.
+   *
+   * @param arena [out] Arena handle
+   * @param block_size Size of the blocks to allocate, 0 for the default of 64 KiB. Larger buffers get a block of their own.
+   *
+   * @return Error code
+   */
+  ykpiv_rc ykpiv_arena_init(ykpiv_arena **arena, size_t block_size);
+
+  /**
+   * Wipe and free all memory of an arena. No allocator from ykpiv_arena_get_allocator() may be in use.
+   *
+   * @param arena Arena handle
+   *
+   * @return Error code
+   */
+  ykpiv_rc ykpiv_arena_done(ykpiv_arena *arena);
+
+  /**
+   * Release every buffer handed out by an arena at once, wiping its memory.
+   *
+   * @param arena Arena handle
+   *
+   * @return Error code
+   */
+  ykpiv_rc ykpiv_arena_reset(ykpiv_arena *arena);
+
+  /**
+   * Get an allocator handing out buffers from an arena.
+   *
+   * It is meant for ykpiv_util_set_allocator(). Since a reset releases everything in the arena, it shouldn't
+   * be passed to ykpiv_init_with_allocator() unless the arena outlives the state and is never reset meanwhile.
+   *
+   * @param arena Arena handle
+   * @param allocator [out] Allocator using \p arena
+   *
+   * @return Error code
+   */
+  ykpiv_rc ykpiv_arena_get_allocator(ykpiv_arena *arena, ykpiv_allocator *allocator);
+
+  /**
+   * Get the allocation counters of an arena.
+   *
+   * @param arena Arena handle
+   * @param stats [out] Counters
+   *
+   * @return Error code
+   */
+  ykpiv_rc ykpiv_arena_get_stats(ykpiv_arena *arena, ykpiv_arena_stats *stats);
+
   /**
    * Returns a list of all saved certificates.
    *
@@ -335,6 +928,24 @@ extern "C"
    */
   ykpiv_rc ykpiv_util_list_keys(ykpiv_state *state, uint8_t *key_count, ykpiv_key **data, size_t *data_len);
 
+  /**
+   * Returns a list of the keys present on the device, in one transaction.
+   *
+   * Keys are found using their metadata, together with their algorithm, policies and origin. On firmware
+   * without metadata support only slots with a certificate are listed, and these fields are 0.
+   * Certificates are only read if \p flags contains \p YKPIV_LIST_KEYS_CERTS, otherwise \p cert is NULL.
+   *
+   * \p keys should be freed with \p ykpiv_util_free() after use, this also frees the certificates.
+   *
+   * @param state     State handle
+   * @param flags     Zero or \p YKPIV_LIST_KEYS_CERTS
+   * @param keys      [out] Set to a dynamically allocated array of keys
+   * @param key_count [out] Number of keys returned
+   *
+   * @return Error code
+   */
+  ykpiv_rc ykpiv_util_list_keys_ex(ykpiv_state *state, uint32_t flags, ykpiv_key_info **keys, size_t *key_count);
+
   /**
    * Read a certificate stored in the given slot
    *
@@ -379,6 +990,8 @@ extern "C"
    *
    * \p certinfo should be \p YKPIV_CERTINFO_UNCOMPRESSED for uncompressed certificates, which is the most
    * common case, or \p YKPIV_CERTINFO_GZIP if the certificate in \p data is already compressed with gzip.
+   * With \p YKPIV_CERTINFO_AUTO an uncompressed certificate is stored compressed when that saves a
+   * command exchanged with the device, or is needed to fit. This requires compression support.
    *
    * @param state State handle
    * @param slot Slot to write to
@@ -474,6 +1087,53 @@ extern "C"
    */
   ykpiv_rc ykpiv_util_get_protected_mgm(ykpiv_state *state, ykpiv_mgm *mgm);
 
+  /**
+   * Enable or disable caching of derived and protected MGM keys
+   *
+   * When enabled, ykpiv_util_get_derived_mgm() keeps the salt read from the admin data and the key derived for the
+   * last PIN, and ykpiv_util_get_protected_mgm() keeps the key read from the protected data, so that later calls for
+   * the same card skip the object reads and the PBKDF2 computation. The cached protected key is then returned
+   * without the PIN being verified again.
+   *
+   * The cache is keyed by the serial number of the card and is zeroized on disconnect, reset, or when the
+   * management key, admin data or protected data are written through this state. Changes made by other
+   * applications are not detected, other than by ykpiv_authenticate_derived() and ykpiv_authenticate_protected().
+   *
+   * @param state  State handle
+   * @param enable Whether to cache MGM keys, disabling zeroizes the cache
+   *
+   * @return ykpiv_rc error code, YKPIV_NOT_SUPPORTED if built with DISABLE_MGM_KEY_CACHE
+   */
+  ykpiv_rc ykpiv_util_set_mgm_cache(ykpiv_state *state, bool enable);
+
+  /**
+   * Authenticate with the derived MGM key
+   *
+   * Gets the key with ykpiv_util_get_derived_mgm() and authenticates with it in one transaction. If a cached key
+   * is rejected, the cache is zeroized and the salt read again from the card.
+   *
+   * @param state   State handle
+   * @param pin     PIN used to derive mgm key
+   * @param pin_len Length of pin in bytes
+   *
+   * @return ykpiv_rc error code
+   */
+  ykpiv_rc ykpiv_authenticate_derived(ykpiv_state *state, const uint8_t *pin, size_t pin_len);
+
+  /**
+   * Authenticate with the protected MGM key
+   *
+   * Gets the key with ykpiv_util_get_protected_mgm() and authenticates with it in one transaction. If a cached key
+   * is rejected, the cache is zeroized and the key read again from the card.
+   *
+   * The user pin must be verified to call this function, unless the key is cached
+   *
+   * @param state State handle
+   *
+   * @return ykpiv_rc error code
+   */
+  ykpiv_rc ykpiv_authenticate_protected(ykpiv_state *state);
+
   /**
    * Update Protected MGM key. Should only be used when mgm_type is YKPIV_CONFIG_MGM_PROTECTED.
    *
@@ -609,6 +1269,19 @@ extern "C"
   ykpiv_rc ykpiv_util_read_mscmap(ykpiv_state *state, ykpiv_container **containers, size_t *n_containers);
   ykpiv_rc ykpiv_util_write_mscmap(ykpiv_state *state, ykpiv_container *containers, size_t n_containers);
   ykpiv_rc ykpiv_util_read_msroots(ykpiv_state  *state, uint8_t **data, size_t *data_len);
+
+  /**
+   * Variant of ykpiv_util_read_msroots() that passes the data to a callback as it is read, one object after another.
+   *
+   * Reading stops at the first object that doesn't hold a valid part of the data, which is not an error.
+   *
+   * @param state State handle
+   * @param pfn_chunk Callback receiving the parts of the data
+   * @param chunk_data Passed to \p pfn_chunk
+   *
+   * @return Error code
+   */
+  ykpiv_rc ykpiv_util_read_msroots_cb(ykpiv_state *state, ykpiv_pfn_chunk pfn_chunk, void *chunk_data);
   ykpiv_rc ykpiv_util_write_msroots(ykpiv_state *state, uint8_t *data, size_t data_len);
   ykpiv_rc ykpiv_util_parse_metadata(uint8_t *data, size_t data_len, ykpiv_metadata *metadata);
 
@@ -712,6 +1385,7 @@ extern "C"
 #define TAG_CERT_LRC          0xFE
 
 #define YKPIV_OBJ_MAX_SIZE 3072
+#define YKPIV_WORKSPACE_SIZE (6 * YKPIV_OBJ_MAX_SIZE) // Enough for the calls that need the most buffers
 
 #define YKPIV_INS_VERIFY 0x20
 #define YKPIV_INS_CHANGE_REFERENCE 0x24
@@ -785,6 +1459,8 @@ extern "C"
 #define YKPIV_METADATA_ORIGIN_GENERATED 0x01
 #define YKPIV_METADATA_ORIGIN_IMPORTED 0x02
 
+#define YKPIV_LIST_KEYS_CERTS 0x01 // Flag for ykpiv_util_list_keys_ex
+
 #define YKPIV_METADATA_PUBKEY_TAG 0x04 // RSA: DER-encoded sequence N, E; EC: Uncompressed EC point X, Y
 
 #define YKPIV_IS_EC(a) ((a == YKPIV_ALGO_ECCP256 || a == YKPIV_ALGO_ECCP384))
@@ -801,6 +1477,7 @@ extern "C"
 
 #define YKPIV_CERTINFO_UNCOMPRESSED 0
 #define YKPIV_CERTINFO_GZIP 1
+#define YKPIV_CERTINFO_AUTO 0xff // Only for writing, compresses when that is smaller on the card link
 
 #define YKPIV_OID_FIRMWARE_VERSION "1.3.6.1.4.1.41482.3.3"
 #define YKPIV_OID_SERIAL_NUMBER "1.3.6.1.4.1.41482.3.7"
@@ -129,3 +129,49 @@ if [[ "x$SUBJECT_9E" != "xSubjectDN:CN=YubicoTest,OU=YubicoTestUnit,O=yubico.com
     echo "Certificate subject incorrect." >/dev/stderr
     exit 1
 fi
+
+# Run several actions over one connection from a batch on stdin
+$BIN --batch=- <<BATCH
+# Generate a key in 9d and self-sign it
+-agenerate -s9d -AECCP256 -o key_9d.pub
+-averify -P123456 -s9d -S'/CN=YubicoTest/OU=YubicoBatch/O=yubico.com/' -aselfsign -i key_9d.pub -o cert_9d.pem
+-aimport-certificate -s9d -i cert_9d.pem
+BATCH
+
+SUBJECT_9D=$($BIN -astatus |grep "Slot 9d" -A 6 |grep "Subject DN" |tr -d "[:blank:]")
+if [[ "x$SUBJECT_9D" != "xSubjectDN:CN=YubicoTest,OU=YubicoBatch,O=yubico.com" ]]; then
+    echo "$SUBJECT_9D"
+    echo "Certificate subject incorrect." >/dev/stderr
+    exit 1
+fi
+
+# Sign several files at once with the key in 9d
+echo "first file" > sign_1.txt
+echo "second file" > sign_2.txt
+printf "sign_1.txt\nsign_2.txt\n" | $BIN -P123456 -averify-pin -asign-files -s9d -AECCP256 -HSHA256 -i -
+openssl dgst -sha256 -verify key_9d.pub -signature sign_1.txt.sig sign_1.txt
+openssl dgst -sha256 -verify key_9d.pub -signature sign_2.txt.sig sign_2.txt
+
+# The inventory lists the key in 9d with its certificate
+INVENTORY=$($BIN -ainventory --json --with-certificates)
+if [[ "$INVENTORY" != *'{"slot":"9d","algorithm":"ECCP256",'*'"origin":"generated","subject":"CN=YubicoTest, OU=YubicoBatch, O=yubico.com"'* ]]; then
+    echo "$INVENTORY"
+    echo "Inventory incorrect." >/dev/stderr
+    exit 1
+fi
+
+# Restore the certificate in 9d from an archive of all objects
+$BIN -aexport-objects -o objects.bin
+$BIN -adelete-certificate -s9d
+SUBJECT_9D=$($BIN -astatus |grep "Slot 9d" -A 6 |grep "Subject DN" |tr -d "[:blank:]")
+if [[ "x$SUBJECT_9D" != "x" ]]; then
+    echo "Certificate not deleted." >/dev/stderr
+    exit 1
+fi
+$BIN -aimport-objects -i objects.bin
+SUBJECT_9D=$($BIN -astatus |grep "Slot 9d" -A 6 |grep "Subject DN" |tr -d "[:blank:]")
+if [[ "x$SUBJECT_9D" != "xSubjectDN:CN=YubicoTest,OU=YubicoBatch,O=yubico.com" ]]; then
+    echo "$SUBJECT_9D"
+    echo "Certificate not restored." >/dev/stderr
+    exit 1
+fi
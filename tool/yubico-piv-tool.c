@@ -33,17 +33,24 @@
 #include <stdbool.h>
 #include <locale.h>
 #include <limits.h>
+#include <signal.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include "ykpiv.h"
+#include "threads.h"
 
 #ifdef _WIN32
 #include <windows.h>
 #include <openssl/applink.c>
+#define strncasecmp _strnicmp
 #else
 #include <unistd.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #endif
 
 #include "../common/openssl-compat.h"
@@ -71,6 +78,22 @@
 
 #define KEY_LEN 32
 
+// Longest time to keep other applications away from the key while running several actions
+#define ACTION_BATCH_HOLD_MS 5000
+
+// Most arguments on one line of a batch file, including the program name
+#define BATCH_MAX_ARGS 64
+
+// Upper bound for the threads used to hash files or to drive several YubiKeys
+#define MAX_THREADS 64
+
+// Files hashed in parallel are signed in chunks by the sign-files action
+#define SIGN_FILES_CHUNK 32
+#define SIGN_FILES_SUFFIX ".sig"
+
+// Replaced with the serial number of each YubiKey in file names with --parallel
+#define FLEET_SERIAL "{serial}"
+
 #define YKPIV_ATTESTATION_OID "1.3.6.1.4.1.41482.3"
 
 static enum file_mode key_file_mode(enum enum_key_format fmt, bool output) {
@@ -99,9 +122,42 @@ static enum file_mode data_file_mode(enum enum_format fmt, bool output) {
   return INPUT_TEXT;
 }
 
+// Set while the batch is read from stdin, where prompts and input files would read from as well
+static bool batch_on_stdin;
+
+static bool read_secret(const char *name, char *pwbuf, size_t pwbuflen, int verify, int stdin_input) {
+  if(batch_on_stdin) {
+    fprintf(stderr, "Can't ask for the %s with --batch=-, give it as an option instead.\n", name);
+    return false;
+  }
+  return read_pw(name, pwbuf, pwbuflen, verify, stdin_input);
+}
+
+// Set in the threads of run_fleet, which keep the output to stdout of each YubiKey until all are done
+static YKPIV_THREAD_LOCAL FILE **fleet_output;
+
+static FILE *open_stream(const char *file_name, enum file_mode mode) {
+  if(batch_on_stdin && !strcmp(file_name, "-") && (mode == INPUT_TEXT || mode == INPUT_BIN)) {
+    fprintf(stderr, "Can't read input from stdin with --batch=-, give an input file instead.\n");
+    return NULL;
+  }
+  if(fleet_output && !strcmp(file_name, "-") && (mode == OUTPUT_TEXT || mode == OUTPUT_BIN)) {
+    if(!*fleet_output && !(*fleet_output = tmpfile())) {
+      fprintf(stderr, "Failed creating a temporary file for the output.\n");
+    }
+    return *fleet_output;
+  }
+  return open_file(file_name, mode);
+}
+
+// Whether the file stands for stdout, and must stay open
+static bool is_stdout(FILE *file) {
+  return file == stdout || (fleet_output && file == *fleet_output);
+}
+
 static void print_version(ykpiv_state *state, const char *output_file_name) {
   char version[7] = {0};
-  FILE *output_file = open_file(output_file_name, OUTPUT_TEXT);
+  FILE *output_file = open_stream(output_file_name, OUTPUT_TEXT);
   if(!output_file) {
     return;
   }
@@ -112,36 +168,46 @@ static void print_version(ykpiv_state *state, const char *output_file_name) {
     fprintf(stderr, "Failed to retrieve application version.\n");
   }
 
-  if(output_file != stdout) {
+  if(!is_stdout(output_file)) {
     fclose(output_file);
   }
 }
 
+static bool add_rsa_padding(const unsigned char *in, size_t len, unsigned char *out, size_t *out_len,
+    unsigned char algorithm) {
+  size_t padlen = 0;
+  switch (algorithm) {
+    case YKPIV_ALGO_RSA1024:
+      padlen = 128;
+      break;
+    case YKPIV_ALGO_RSA2048:
+      padlen = 256;
+      break;
+    case YKPIV_ALGO_RSA3072:
+      padlen = 384;
+      break;
+    case YKPIV_ALGO_RSA4096:
+      padlen = 512;
+      break;
+    default:
+      fprintf(stderr, "Unknown RSA algorithm.\n");
+      return false;
+  }
+  if (padlen > *out_len || RSA_padding_add_PKCS1_type_1(out, padlen, in, len) == 0) {
+    fprintf(stderr, "Failed adding padding.\n");
+    return false;
+  }
+  *out_len = padlen;
+  return true;
+}
+
 static bool sign_data(ykpiv_state *state, const unsigned char *in, size_t len, unsigned char *out,
     size_t *out_len, unsigned char algorithm, int key) {
 
   unsigned char signinput[YKPIV_OBJ_MAX_SIZE] = {0};
   if(YKPIV_IS_RSA(algorithm)) {
-    size_t padlen = 0;
-    switch (algorithm) {
-      case YKPIV_ALGO_RSA1024:
-        padlen = 128;
-        break;
-      case YKPIV_ALGO_RSA2048:
-        padlen = 256;
-        break;
-      case YKPIV_ALGO_RSA3072:
-        padlen = 384;
-        break;
-      case YKPIV_ALGO_RSA4096:
-        padlen = 512;
-        break;
-      default:
-        fprintf(stderr, "Unknown RSA algorithm.\n");
-        return false;
-    }
-    if (RSA_padding_add_PKCS1_type_1(signinput, padlen, in, len) == 0) {
-      fprintf(stderr, "Failed adding padding.\n");
+    size_t padlen = sizeof(signinput);
+    if(!add_rsa_padding(in, len, signinput, &padlen, algorithm)) {
       return false;
     }
     in = signinput;
@@ -294,7 +360,7 @@ static bool generate_key(ykpiv_state *state, enum enum_slot slot,
 
   key = get_slot_hex(slot);
 
-  output_file = open_file(output_file_name, key_file_mode(key_format, true));
+  output_file = open_stream(output_file_name, key_file_mode(key_format, true));
   if(!output_file) {
     return false;
   }
@@ -396,7 +462,7 @@ static bool generate_key(ykpiv_state *state, enum enum_slot slot,
   }
 
 generate_out:
-  if (output_file != stdout) {
+  if (!is_stdout(output_file)) {
     fclose(output_file);
   }
   if (group) {
@@ -433,6 +499,9 @@ static bool reset(ykpiv_state *state, bool global) {
       fprintf(stderr, "Reset failed, are pincodes blocked?\n");
       return false;
     }
+  } else if (batch_on_stdin) {
+    fprintf(stderr, "Can't ask for confirmation of a global reset with --batch=-.\n");
+    return false;
   } else {
     fprintf(stderr,
             "ALL data, including PIV data, in the YubiKey will be deleted. The action cannot be reversed!\n\nType 'y' to proceed: ");
@@ -485,7 +554,7 @@ static bool import_key(ykpiv_state *state, enum enum_key_format key_format,
 
   key = get_slot_hex(slot);
 
-  input_file = open_file(input_file_name, key_file_mode(key_format, false));
+  input_file = open_stream(input_file_name, key_file_mode(key_format, false));
   if(!input_file) {
     return false;
   }
@@ -685,7 +754,7 @@ static bool import_cert(ykpiv_state *state, enum enum_key_format cert_format, in
   int compress = YKPIV_CERTINFO_UNCOMPRESSED;
   int cert_len = -1;
 
-  input_file = open_file(input_file_name, key_file_mode(cert_format, false));
+  input_file = open_stream(input_file_name, key_file_mode(cert_format, false));
   if(!input_file) {
     return false;
   }
@@ -789,6 +858,7 @@ static bool import_cert(ykpiv_state *state, enum enum_key_format cert_format, in
         fprintf(stderr, "Failed to encode X509 certificate\n");
         goto import_cert_out;
       }
+      compress = YKPIV_CERTINFO_AUTO;
     }
 
     if ((res = ykpiv_util_write_cert(state, get_slot_hex(slot), certdata, (size_t)cert_len, compress)) != YKPIV_OK) {
@@ -903,8 +973,8 @@ static bool request_certificate(ykpiv_state *state, enum enum_key_format key_for
 
   key = get_slot_hex(slot);
 
-  input_file = open_file(input_file_name, key_file_mode(key_format, false));
-  output_file = open_file(output_file_name, key_file_mode(key_format, true));
+  input_file = open_stream(input_file_name, key_file_mode(key_format, false));
+  output_file = open_stream(output_file_name, key_file_mode(key_format, true));
   if(!input_file || !output_file) {
     goto request_out;
   }
@@ -1123,7 +1193,7 @@ request_out:
   if(input_file && input_file != stdin) {
     fclose(input_file);
   }
-  if(output_file && output_file != stdout) {
+  if(output_file && !is_stdout(output_file)) {
     fclose(output_file);
   }
   EVP_PKEY_free(public_key);
@@ -1163,8 +1233,8 @@ static bool selfsign_certificate(ykpiv_state *state, enum enum_key_format key_fo
 
   int key = get_slot_hex(slot);
 
-  FILE *input_file = open_file(input_file_name, key_file_mode(key_format, false));
-  FILE *output_file = open_file(output_file_name, key_file_mode(key_format, true));
+  FILE *input_file = open_stream(input_file_name, key_file_mode(key_format, false));
+  FILE *output_file = open_stream(output_file_name, key_file_mode(key_format, true));
   if(!input_file || !output_file) {
     goto selfsign_out;
   }
@@ -1482,7 +1552,7 @@ selfsign_out:
   if(input_file && input_file != stdin) {
     fclose(input_file);
   }
-  if(output_file && output_file != stdout) {
+  if(output_file && !is_stdout(output_file)) {
     fclose(output_file);
   }
  #if (OPENSSL_VERSION_NUMBER < 0x10100000L) || defined(LIBRESSL_VERSION_NUMBER)
@@ -1610,7 +1680,7 @@ static bool read_certificate(ykpiv_state *state, enum enum_slot slot,
     return false;
   }
 
-  output_file = open_file(output_file_name, key_file_mode(key_format, true));
+  output_file = open_stream(output_file_name, key_file_mode(key_format, true));
   if (!output_file) {
     return false;
   }
@@ -1650,7 +1720,7 @@ static bool read_certificate(ykpiv_state *state, enum enum_slot slot,
   }
 
 read_cert_out:
-  if (output_file != stdout) {
+  if (!is_stdout(output_file)) {
     fclose(output_file);
   }
   if (x509) {
@@ -1676,7 +1746,7 @@ static bool sign_file(ykpiv_state *state, const char *input, const char *output,
 
   key = get_slot_hex(slot);
 
-  input_file = open_file(input, INPUT_BIN);
+  input_file = open_stream(input, INPUT_BIN);
   if(!input_file) {
     return false;
   }
@@ -1685,7 +1755,7 @@ static bool sign_file(ykpiv_state *state, const char *input, const char *output,
     fprintf(stderr, "Please paste the input...\n");
   }
 
-  output_file = open_file(output, OUTPUT_BIN);
+  output_file = open_stream(output, OUTPUT_BIN);
   if(!output_file) {
     if(input_file && input_file != stdin) {
       fclose(input_file);
@@ -1766,13 +1836,307 @@ out:
     fclose(input_file);
   }
 
-  if(output_file && output_file != stdout) {
+  if(output_file && !is_stdout(output_file)) {
     fclose(output_file);
   }
 
   return ret;
 }
 
+struct sign_job {
+  char *path;
+  unsigned char in[YKPIV_OBJ_MAX_SIZE]; // Input for the card, the padded digest or for Ed25519 the file itself
+  size_t in_len;
+  bool ok;
+};
+
+struct sign_jobs {
+  struct sign_job *jobs;
+  size_t n;
+  const EVP_MD *md;
+  unsigned char algo;
+};
+
+static bool digest_file(const char *path, EVP_MD_CTX *mdctx, unsigned char *msg, size_t *msg_len) {
+  bool ret = false;
+  size_t max_len = msg ? *msg_len : 0;
+  size_t len = 0;
+#ifndef _WIN32
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    fprintf(stderr, "Failed opening '%s'\n", path);
+    return false;
+  }
+  struct stat st;
+  if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    // Map regular files instead of copying them through a buffer
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data != MAP_FAILED) {
+      madvise(data, st.st_size, MADV_SEQUENTIAL);
+      len = st.st_size;
+      if(msg) {
+        if(len < max_len) {
+          memcpy(msg, data, len);
+          ret = true;
+        }
+      } else {
+        ret = EVP_DigestUpdate(mdctx, data, len) == 1;
+      }
+      munmap(data, st.st_size);
+      close(fd);
+      goto out;
+    }
+  }
+  FILE *input_file = fdopen(fd, "rb");
+  if(!input_file) {
+    close(fd);
+    fprintf(stderr, "Failed opening '%s'\n", path);
+    return false;
+  }
+#else
+  FILE *input_file = fopen(path, "rb");
+  if(!input_file) {
+    fprintf(stderr, "Failed opening '%s'\n", path);
+    return false;
+  }
+#endif
+  ret = true;
+  while(ret && !feof(input_file)) {
+    unsigned char buf[8192] = {0};
+    size_t n = fread(buf, 1, sizeof(buf), input_file);
+    if(ferror(input_file)) {
+      ret = false;
+    } else if(msg) {
+      if(len + n >= max_len) {
+        ret = false;
+      } else {
+        memcpy(msg + len, buf, n);
+      }
+    } else if(EVP_DigestUpdate(mdctx, buf, n) != 1) {
+      ret = false;
+    }
+    len += n;
+  }
+  fclose(input_file);
+#ifndef _WIN32
+out:
+#endif
+  if(!ret) {
+    fprintf(stderr, msg && len >= max_len ? "Cannot sign '%s'. File too big.\n" : "Failed hashing '%s'\n", path);
+  }
+  if(msg) {
+    *msg_len = len;
+  }
+  return ret;
+}
+
+static bool prepare_sign_job(struct sign_job *job, const EVP_MD *md, unsigned char algo) {
+  if(algo == YKPIV_ALGO_ED25519) {
+    job->in_len = sizeof(job->in);
+    return digest_file(job->path, NULL, job->in, &job->in_len);
+  }
+
+  unsigned char hashed[YKPIV_OBJ_MAX_SIZE] = {0};
+  unsigned int hash_len = 0;
+  EVP_MD_CTX *mdctx = EVP_MD_CTX_create();
+  bool ret = mdctx && EVP_DigestInit_ex(mdctx, md, NULL) == 1 && digest_file(job->path, mdctx, NULL, NULL) &&
+    EVP_DigestFinal_ex(mdctx, hashed, &hash_len) == 1;
+  EVP_MD_CTX_destroy(mdctx);
+  if(!ret) {
+    return false;
+  }
+
+  if(YKPIV_IS_RSA(algo)) {
+    if(!prepare_rsa_signature(hashed, hash_len, hashed, &hash_len, EVP_MD_type(md))) {
+      return false;
+    }
+    job->in_len = sizeof(job->in);
+    return add_rsa_padding(hashed, hash_len, job->in, &job->in_len, algo);
+  }
+
+  memcpy(job->in, hashed, hash_len);
+  job->in_len = hash_len;
+  return true;
+}
+
+static void hash_jobs(void *ctx, size_t thread, size_t n_threads) {
+  struct sign_jobs *jobs = ctx;
+  for(size_t i = thread; i < jobs->n; i += n_threads) {
+    jobs->jobs[i].ok = prepare_sign_job(&jobs->jobs[i], jobs->md, jobs->algo);
+  }
+}
+
+static bool write_signature(const char *path, const unsigned char *sig, size_t sig_len) {
+  size_t len = strlen(path) + sizeof(SIGN_FILES_SUFFIX);
+  char *name = malloc(len);
+  if(!name) {
+    return false;
+  }
+  snprintf(name, len, "%s%s", path, SIGN_FILES_SUFFIX);
+  FILE *output_file = open_stream(name, OUTPUT_BIN);
+  free(name);
+  if(!output_file) {
+    return false;
+  }
+  bool ret = fwrite(sig, 1, sig_len, output_file) == sig_len;
+  if(fclose(output_file) != 0) {
+    ret = false;
+  }
+  if(!ret) {
+    fprintf(stderr, "Failed writing signature for '%s'\n", path);
+  }
+  return ret;
+}
+
+static bool sign_files(ykpiv_state *state, const char *input, enum enum_slot slot,
+    enum enum_algorithm algorithm, enum enum_hash hash, int verbosity) {
+  struct sign_jobs jobs = {0};
+  size_t max_jobs = 0;
+  char line[4096] = {0};
+  bool ret = false;
+  int key = get_slot_hex(slot);
+  ykpiv_rc rc;
+
+  jobs.algo = get_piv_algorithm(algorithm);
+  if(jobs.algo == 0) {
+    return false;
+  }
+  if(jobs.algo == YKPIV_ALGO_X25519) {
+    fprintf(stderr, "Signing with X25519 key is not supported\n");
+    return false;
+  }
+  if(jobs.algo != YKPIV_ALGO_ED25519 && (jobs.md = get_hash(hash, NULL, NULL)) == NULL) {
+    return false;
+  }
+
+  FILE *input_file = open_stream(input, INPUT_TEXT);
+  if(!input_file) {
+    return false;
+  }
+  if(isatty(fileno(input_file))) {
+    fprintf(stderr, "Please enter the files to sign, one per line...\n");
+  }
+
+  while(fgets(line, sizeof(line), input_file)) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if(line[0] == '\0') {
+      continue;
+    }
+    if(jobs.n == max_jobs) {
+      size_t n = max_jobs ? max_jobs * 2 : 64;
+      struct sign_job *p = realloc(jobs.jobs, n * sizeof(*p));
+      if(!p) {
+        fprintf(stderr, "Failed allocating memory for %zu files\n", n);
+        goto out;
+      }
+      jobs.jobs = p;
+      max_jobs = n;
+    }
+    memset(&jobs.jobs[jobs.n], 0, sizeof(jobs.jobs[jobs.n]));
+    if((jobs.jobs[jobs.n].path = strdup(line)) == NULL) {
+      fprintf(stderr, "Failed allocating memory for '%s'\n", line);
+      goto out;
+    }
+    jobs.n++;
+  }
+  if(ferror(input_file)) {
+    fprintf(stderr, "Failed reading the list of files to sign\n");
+    goto out;
+  }
+
+  size_t n_threads = yc_cpu_count();
+  if(n_threads > MAX_THREADS) {
+    n_threads = MAX_THREADS;
+  }
+  if(n_threads > jobs.n) {
+    n_threads = jobs.n ? jobs.n : 1;
+  }
+  if(verbosity) {
+    fprintf(stderr, "Hashing %zu files using %zu threads.\n", jobs.n, n_threads);
+  }
+  yc_run_shares(n_threads, hash_jobs, &jobs);
+
+  for(size_t i = 0; i < jobs.n; i++) {
+    if(!jobs.jobs[i].ok) {
+      goto out;
+    }
+  }
+
+  // Send the digests to the card back to back, within one transaction
+  if((rc = ykpiv_begin_batch(state, ACTION_BATCH_HOLD_MS)) != YKPIV_OK) {
+    fprintf(stderr, "Failed to begin transaction: %s.\n", ykpiv_strerror(rc));
+    goto out;
+  }
+  ret = true;
+  for(size_t i = 0; ret && i < jobs.n; i += SIGN_FILES_CHUNK) {
+    const unsigned char *in[SIGN_FILES_CHUNK];
+    size_t in_len[SIGN_FILES_CHUNK];
+    unsigned char sigs[SIGN_FILES_CHUNK][1024];
+    unsigned char *out[SIGN_FILES_CHUNK];
+    size_t out_len[SIGN_FILES_CHUNK];
+    size_t n = jobs.n - i < SIGN_FILES_CHUNK ? jobs.n - i : SIGN_FILES_CHUNK;
+
+    for(size_t j = 0; j < n; j++) {
+      in[j] = jobs.jobs[i + j].in;
+      in_len[j] = jobs.jobs[i + j].in_len;
+      out[j] = sigs[j];
+      out_len[j] = sizeof(sigs[j]);
+    }
+    rc = ykpiv_sign_data_batch(state, key, jobs.algo, in, in_len, n, out, out_len);
+    for(size_t j = 0; j < n && out_len[j]; j++) {
+      if(!write_signature(jobs.jobs[i + j].path, out[j], out_len[j])) {
+        ret = false;
+        break;
+      }
+      if(verbosity) {
+        fprintf(stderr, "Signed '%s'.\n", jobs.jobs[i + j].path);
+      }
+    }
+    if(rc != YKPIV_OK) {
+      fprintf(stderr, "Failed signing data: %s.\n", ykpiv_strerror(rc));
+      ret = false;
+    }
+  }
+  ykpiv_end_batch(state);
+
+  if(ret) {
+    fprintf(stderr, "Successfully signed %zu files.\n", jobs.n);
+  }
+
+out:
+  if(input_file != stdin) {
+    fclose(input_file);
+  }
+  for(size_t i = 0; i < jobs.n; i++) {
+    free(jobs.jobs[i].path);
+  }
+  free(jobs.jobs);
+  return ret;
+}
+
+static const char *algorithm_name(unsigned char algorithm) {
+  switch(algorithm) {
+    case YKPIV_ALGO_RSA1024:
+      return "RSA1024";
+    case YKPIV_ALGO_RSA2048:
+      return "RSA2048";
+    case YKPIV_ALGO_RSA3072:
+      return "RSA3072";
+    case YKPIV_ALGO_RSA4096:
+      return "RSA4096";
+    case YKPIV_ALGO_ECCP256:
+      return "ECCP256";
+    case YKPIV_ALGO_ECCP384:
+      return "ECCP384";
+    case YKPIV_ALGO_ED25519:
+      return "ED25519";
+    case YKPIV_ALGO_X25519:
+      return "X25519";
+    default:
+      return "Unknown";
+  }
+}
+
 static void print_cert_info(ykpiv_state *state, enum enum_slot slot, const EVP_MD *md,
     FILE *output) {
   int object = (int)ykpiv_util_slot_object(get_slot_hex(slot));
@@ -1814,34 +2178,7 @@ static void print_cert_info(ykpiv_state *state, enum enum_slot slot, const EVP_M
     goto cert_out;
   }
   fprintf(output, "\n\tAlgorithm:\t");
-  switch(get_algorithm(key)) {
-    case YKPIV_ALGO_RSA1024:
-      fprintf(output, "RSA1024\n");
-      break;
-    case YKPIV_ALGO_RSA2048:
-      fprintf(output, "RSA2048\n");
-      break;
-    case YKPIV_ALGO_RSA3072:
-      fprintf(output, "RSA3072\n");
-      break;
-    case YKPIV_ALGO_RSA4096:
-      fprintf(output, "RSA4096\n");
-      break;
-    case YKPIV_ALGO_ECCP256:
-      fprintf(output, "ECCP256\n");
-      break;
-    case YKPIV_ALGO_ECCP384:
-      fprintf(output, "ECCP384\n");
-      break;
-    case YKPIV_ALGO_ED25519:
-      fprintf(output, "ED25519\n");
-      break;
-    case YKPIV_ALGO_X25519:
-      fprintf(output, "X25519\n");
-      break;
-    default:
-      fprintf(output, "Unknown\n");
-  }
+  fprintf(output, "%s\n", algorithm_name(get_algorithm(key)));
   EVP_PKEY_free(key);
 
   subj = X509_get_subject_name(x509);
@@ -1901,60 +2238,223 @@ cert_out:
   }
 }
 
-static bool status(ykpiv_state *state, enum enum_hash hash,
-                   enum enum_slot slot,
-                   const char *output_file_name) {
-  const EVP_MD *md;
-  unsigned char buf[YKPIV_OBJ_MAX_SIZE] = {0};
-  long unsigned len = sizeof(buf);
-  int i;
-  uint32_t serial = 0;
-  FILE *output_file = open_file(output_file_name, OUTPUT_TEXT);
-
-  if(!output_file) {
-    return false;
+static const char *pin_policy_name(unsigned char pin_policy) {
+  switch(pin_policy) {
+    case YKPIV_PINPOLICY_NEVER:
+      return "never";
+    case YKPIV_PINPOLICY_ONCE:
+      return "once";
+    case YKPIV_PINPOLICY_ALWAYS:
+      return "always";
+    case YKPIV_PINPOLICY_MATCH_ONCE:
+      return "matchonce";
+    case YKPIV_PINPOLICY_MATCH_ALWAYS:
+      return "matchalways";
+    default:
+      return "unknown";
   }
+}
 
-  md = get_hash(hash, NULL, NULL);
-  if(md == NULL) {
-    return false;
+static const char *touch_policy_name(unsigned char touch_policy) {
+  switch(touch_policy) {
+    case YKPIV_TOUCHPOLICY_NEVER:
+      return "never";
+    case YKPIV_TOUCHPOLICY_ALWAYS:
+      return "always";
+    case YKPIV_TOUCHPOLICY_CACHED:
+      return "cached";
+    default:
+      return "unknown";
   }
+}
 
-  fprintf(output_file, "Version:\t");
-  if (ykpiv_get_version(state, (char*)buf, (size_t)len) != YKPIV_OK) {
-    fprintf(output_file, "No data available\n");
-  } else {
-    fprintf(output_file, "%s\n", (char*)buf);
+static const char *origin_name(unsigned char origin) {
+  switch(origin) {
+    case YKPIV_METADATA_ORIGIN_GENERATED:
+      return "generated";
+    case YKPIV_METADATA_ORIGIN_IMPORTED:
+      return "imported";
+    default:
+      return "unknown";
   }
+}
 
-  fprintf(output_file, "Serial Number:\t");
-  if (ykpiv_get_serial(state, &serial) != YKPIV_OK) {
-    fprintf(output_file, "No data available\n");
-  } else {
-    fprintf(output_file, "%u\n", serial);
+static void print_json_string(BIO *bio, const char *str) {
+  BIO_printf(bio, "\"");
+  for(const unsigned char *p = (const unsigned char *)str; *p; p++) {
+    if(*p == '"' || *p == '\\') {
+      BIO_printf(bio, "\\%c", *p);
+    } else if(*p < 0x20) {
+      BIO_printf(bio, "\\u%04x", *p);
+    } else {
+      BIO_printf(bio, "%c", *p);
+    }
   }
+  BIO_printf(bio, "\"");
+}
 
-  fprintf(output_file, "CHUID:\t");
-  if(ykpiv_fetch_object(state, YKPIV_OBJ_CHUID, buf, &len) != YKPIV_OK) {
-    fprintf(output_file, "No data available\n");
-  } else {
-    dump_data(buf, len, output_file, false, format_arg_hex);
+static void print_inventory_cert(BIO *bio, const ykpiv_key_info *key, bool json) {
+  const unsigned char *ptr = key->cert;
+  X509 *x509 = d2i_X509(NULL, &ptr, key->cert_len);
+  char subject[1024] = "Parse error";
+  char not_after[64] = "Parse error";
+
+  if(x509) {
+    BIO *mem = BIO_new(BIO_s_mem());
+    if(mem && X509_NAME_print_ex(mem, X509_get_subject_name(x509), 0, XN_FLAG_COMPAT) >= 0) {
+      int len = BIO_read(mem, subject, sizeof(subject) - 1);
+      subject[len > 0 ? len : 0] = '\0';
+    }
+    BIO_free(mem);
+    mem = BIO_new(BIO_s_mem());
+    if(mem && ASN1_TIME_print(mem, X509_get_notAfter(x509)) == 1) {
+      int len = BIO_read(mem, not_after, sizeof(not_after) - 1);
+      not_after[len > 0 ? len : 0] = '\0';
+    }
+    BIO_free(mem);
+    X509_free(x509);
   }
 
-  len = sizeof(buf);
-  fprintf(output_file, "CCC:\t");
-  if(ykpiv_fetch_object(state, YKPIV_OBJ_CAPABILITY, buf, &len) != YKPIV_OK) {
-    fprintf(output_file, "No data available\n");
+  if(json) {
+    BIO_printf(bio, ",\"subject\":");
+    print_json_string(bio, subject);
+    BIO_printf(bio, ",\"not_after\":");
+    print_json_string(bio, not_after);
   } else {
-    dump_data(buf, len, output_file, false, format_arg_hex);
+    BIO_printf(bio, "\tSubject DN:\t%s\n\tNot after:\t%s\n", subject, not_after);
   }
+}
 
-  if (slot == slot__NULL)
-    for (i = 0; i < 24; i++) {
-      print_cert_info(state, i, md, output_file);
-    }
-  else
-    print_cert_info(state, slot, md, output_file);
+// The inventory is assembled in memory and written at once, so inventories of
+// several YubiKeys written to the same output don't interleave.
+static bool inventory(ykpiv_state *state, const char *output_file_name, bool json, bool certs) {
+  char version[16] = {0};
+  uint32_t serial = 0;
+  ykpiv_key_info *keys = NULL;
+  size_t key_count = 0;
+  bool ret = false;
+  BIO *bio = NULL;
+  ykpiv_rc rc;
+
+  FILE *output_file = open_stream(output_file_name, OUTPUT_TEXT);
+  if(!output_file) {
+    return false;
+  }
+
+  if((rc = ykpiv_get_version(state, version, sizeof(version))) != YKPIV_OK ||
+     (rc = ykpiv_get_serial(state, &serial)) != YKPIV_OK ||
+     (rc = ykpiv_util_list_keys_ex(state, certs ? YKPIV_LIST_KEYS_CERTS : 0, &keys, &key_count)) != YKPIV_OK) {
+    fprintf(stderr, "Failed to read inventory: %s.\n", ykpiv_strerror(rc));
+    goto out;
+  }
+
+  if((bio = BIO_new(BIO_s_mem())) == NULL) {
+    fprintf(stderr, "Failed allocating memory.\n");
+    goto out;
+  }
+  if(json) {
+    BIO_printf(bio, "{\"serial\":%u,\"version\":", serial);
+    print_json_string(bio, version);
+    BIO_printf(bio, ",\"keys\":[");
+  } else {
+    BIO_printf(bio, "Serial Number:\t%u\nVersion:\t%s\n", serial, version);
+  }
+  for(size_t i = 0; i < key_count; i++) {
+    const ykpiv_key_info *key = keys + i;
+    if(json) {
+      BIO_printf(bio, "%s{\"slot\":\"%02x\"", i ? "," : "", key->slot);
+      if(key->algorithm) {
+        BIO_printf(bio, ",\"algorithm\":\"%s\",\"pin_policy\":\"%s\",\"touch_policy\":\"%s\",\"origin\":\"%s\"",
+                   algorithm_name(key->algorithm), pin_policy_name(key->pin_policy),
+                   touch_policy_name(key->touch_policy), origin_name(key->origin));
+      }
+    } else {
+      BIO_printf(bio, "Slot %02x:\n", key->slot);
+      if(key->algorithm) {
+        BIO_printf(bio, "\tAlgorithm:\t%s\n\tPIN policy:\t%s\n\tTouch policy:\t%s\n\tOrigin:\t%s\n",
+                   algorithm_name(key->algorithm), pin_policy_name(key->pin_policy),
+                   touch_policy_name(key->touch_policy), origin_name(key->origin));
+      }
+    }
+    if(key->cert) {
+      print_inventory_cert(bio, key, json);
+    }
+    if(json) {
+      BIO_printf(bio, "}");
+    }
+  }
+  if(json) {
+    BIO_printf(bio, "]}\n");
+  }
+
+  char *data = NULL;
+  long len = BIO_get_mem_data(bio, &data);
+  ret = len > 0 && fwrite(data, 1, len, output_file) == (size_t)len;
+  fflush(output_file);
+
+out:
+  BIO_free(bio);
+  ykpiv_util_free(state, keys);
+  if(!is_stdout(output_file)) {
+    fclose(output_file);
+  }
+  return ret;
+}
+
+static bool status(ykpiv_state *state, enum enum_hash hash,
+                   enum enum_slot slot,
+                   const char *output_file_name) {
+  const EVP_MD *md;
+  unsigned char buf[YKPIV_OBJ_MAX_SIZE] = {0};
+  long unsigned len = sizeof(buf);
+  int i;
+  uint32_t serial = 0;
+  FILE *output_file = open_stream(output_file_name, OUTPUT_TEXT);
+
+  if(!output_file) {
+    return false;
+  }
+
+  md = get_hash(hash, NULL, NULL);
+  if(md == NULL) {
+    return false;
+  }
+
+  fprintf(output_file, "Version:\t");
+  if (ykpiv_get_version(state, (char*)buf, (size_t)len) != YKPIV_OK) {
+    fprintf(output_file, "No data available\n");
+  } else {
+    fprintf(output_file, "%s\n", (char*)buf);
+  }
+
+  fprintf(output_file, "Serial Number:\t");
+  if (ykpiv_get_serial(state, &serial) != YKPIV_OK) {
+    fprintf(output_file, "No data available\n");
+  } else {
+    fprintf(output_file, "%u\n", serial);
+  }
+
+  fprintf(output_file, "CHUID:\t");
+  if(ykpiv_fetch_object(state, YKPIV_OBJ_CHUID, buf, &len) != YKPIV_OK) {
+    fprintf(output_file, "No data available\n");
+  } else {
+    dump_data(buf, len, output_file, false, format_arg_hex);
+  }
+
+  len = sizeof(buf);
+  fprintf(output_file, "CCC:\t");
+  if(ykpiv_fetch_object(state, YKPIV_OBJ_CAPABILITY, buf, &len) != YKPIV_OK) {
+    fprintf(output_file, "No data available\n");
+  } else {
+    dump_data(buf, len, output_file, false, format_arg_hex);
+  }
+
+  if (slot == slot__NULL)
+    for (i = 0; i < 24; i++) {
+      print_cert_info(state, i, md, output_file);
+    }
+  else
+    print_cert_info(state, slot, md, output_file);
 
   {
     int tries;
@@ -1962,7 +2462,7 @@ static bool status(ykpiv_state *state, enum enum_hash hash,
     fprintf(output_file, "PIN tries left:\t%d\n", tries);
   }
 
-  if(output_file != stdout) {
+  if(!is_stdout(output_file)) {
     fclose(output_file);
   }
   return true;
@@ -1977,7 +2477,7 @@ static bool test_signature(ykpiv_state *state, enum enum_slot slot,
   unsigned int data_len;
   X509 *x509 = NULL;
   EVP_PKEY *pubkey = NULL;
-  FILE *input_file = open_file(input_file_name, key_file_mode(cert_format, false));
+  FILE *input_file = open_stream(input_file_name, key_file_mode(cert_format, false));
 
   if(!input_file) {
     fprintf(stderr, "Failed opening input file %s.\n", input_file_name);
@@ -2149,7 +2649,7 @@ static bool test_decipher(ykpiv_state *state, enum enum_slot slot,
   X509 *x509 = NULL;
   EVP_PKEY *pubkey = NULL;
   EC_KEY *tmpkey = NULL;
-  FILE *input_file = open_file(input_file_name, key_file_mode(cert_format, false));
+  FILE *input_file = open_stream(input_file_name, key_file_mode(cert_format, false));
 
   if(!input_file) {
     fprintf(stderr, "Failed opening input file %s.\n", input_file_name);
@@ -2310,6 +2810,28 @@ static bool list_readers(ykpiv_state *state) {
   return true;
 }
 
+static volatile int broker_stop;
+
+static void stop_broker(int sig) {
+  (void)sig;
+  broker_stop = 1;
+}
+
+static bool serve_broker(ykpiv_state *state, const char *socket_path) {
+  broker_stop = 0;
+  signal(SIGINT, stop_broker);
+  signal(SIGTERM, stop_broker);
+  fprintf(stderr, "Sharing the YubiKey on %s until interrupted.\n", socket_path);
+  ykpiv_rc rc = ykpiv_broker_serve(state, socket_path, &broker_stop);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  if(rc != YKPIV_OK) {
+    fprintf(stderr, "Failed sharing the YubiKey: %s.\n", ykpiv_strerror(rc));
+    return false;
+  }
+  return true;
+}
+
 static bool attest(ykpiv_state *state, enum enum_slot slot,
     enum enum_key_format key_format, const char *output_file_name) {
   unsigned char data[2048] = {0};
@@ -2317,7 +2839,7 @@ static bool attest(ykpiv_state *state, enum enum_slot slot,
   bool ret = false;
   X509 *x509 = NULL;
   int key;
-  FILE *output_file = open_file(output_file_name, key_file_mode(key_format, true));
+  FILE *output_file = open_stream(output_file_name, key_file_mode(key_format, true));
   if(!output_file) {
     return false;
   }
@@ -2350,7 +2872,7 @@ static bool attest(ykpiv_state *state, enum enum_slot slot,
   ret = true;
 
 attest_out:
-  if(output_file != stdout) {
+  if(!is_stdout(output_file)) {
     fclose(output_file);
   }
   if(x509) {
@@ -2367,7 +2889,7 @@ static bool write_object(ykpiv_state *state, int id,
   size_t len = sizeof(data);
   ykpiv_rc res;
 
-  input_file = open_file(input_file_name, data_file_mode(format, false));
+  input_file = open_stream(input_file_name, data_file_mode(format, false));
   if(!input_file) {
     return false;
   }
@@ -2406,7 +2928,7 @@ static bool read_object(ykpiv_state *state, int id, const char *output_file_name
   unsigned long len = sizeof(data);
   bool ret = false;
 
-  output_file = open_file(output_file_name, data_file_mode(format, true));
+  output_file = open_stream(output_file_name, data_file_mode(format, true));
   if(!output_file) {
     return false;
   }
@@ -2420,51 +2942,215 @@ static bool read_object(ykpiv_state *state, int id, const char *output_file_name
   ret = true;
 
 read_out:
-  if(output_file != stdout) {
+  if(!is_stdout(output_file)) {
     fclose(output_file);
   }
   return ret;
 }
 
-int main(int argc, char *argv[]) {
-  struct gengetopt_args_info args_info;
-  const uint8_t mgm_algo[] = {YKPIV_ALGO_3DES, YKPIV_ALGO_AES128, YKPIV_ALGO_AES192, YKPIV_ALGO_AES256};
-  ykpiv_state *state;
+// Objects moved by export-objects and import-objects, the msroots objects are 0x5fff11 to 0x5fff15
+static const int archive_objects[] = {
+  YKPIV_OBJ_CHUID, YKPIV_OBJ_CAPABILITY, YKPIV_OBJ_PRINTED, YKPIV_OBJ_DISCOVERY, YKPIV_OBJ_KEY_HISTORY,
+  0x5fff11, 0x5fff12, 0x5fff13, 0x5fff14, 0x5fff15,
+  YKPIV_OBJ_AUTHENTICATION, YKPIV_OBJ_SIGNATURE, YKPIV_OBJ_KEY_MANAGEMENT, YKPIV_OBJ_CARD_AUTH,
+  YKPIV_OBJ_RETIRED1, YKPIV_OBJ_RETIRED2, YKPIV_OBJ_RETIRED3, YKPIV_OBJ_RETIRED4, YKPIV_OBJ_RETIRED5,
+  YKPIV_OBJ_RETIRED6, YKPIV_OBJ_RETIRED7, YKPIV_OBJ_RETIRED8, YKPIV_OBJ_RETIRED9, YKPIV_OBJ_RETIRED10,
+  YKPIV_OBJ_RETIRED11, YKPIV_OBJ_RETIRED12, YKPIV_OBJ_RETIRED13, YKPIV_OBJ_RETIRED14, YKPIV_OBJ_RETIRED15,
+  YKPIV_OBJ_RETIRED16, YKPIV_OBJ_RETIRED17, YKPIV_OBJ_RETIRED18, YKPIV_OBJ_RETIRED19, YKPIV_OBJ_RETIRED20,
+};
+
+#define ARCHIVE_OBJECTS (sizeof(archive_objects) / sizeof(archive_objects[0]))
+#define ARCHIVE_MAGIC "YKPIVOBJ"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_HEADER_LEN (sizeof(ARCHIVE_MAGIC) - 1 + 1 + 4)
+#define ARCHIVE_RECORD_HEADER_LEN 5
+#define ARCHIVE_MAX_LEN (ARCHIVE_OBJECTS * (ARCHIVE_RECORD_HEADER_LEN + YKPIV_OBJ_MAX_SIZE))
+
+/*
+ * The archive is the magic, a version byte and the length of the records in four bytes, followed by
+ * the records compressed with zlib. Each record is the object id in three bytes and the length of
+ * the object in two, followed by the object as stored on the card.
+ */
+static bool export_objects(ykpiv_state *state, const char *output_file_name, int verbosity) {
+  unsigned char *raw = NULL, *archive = NULL;
+  size_t raw_len = 0, n_objects = 0;
+  uLongf compressed_len = compressBound(ARCHIVE_MAX_LEN);
+  FILE *output_file = NULL;
+  bool ret = false;
   ykpiv_rc rc;
-  int verbosity;
-  enum enum_action action;
-  unsigned int i;
-  int ret = EXIT_SUCCESS;
-  bool authed = false;
-  char pwbuf[128] = {0};
-  char *password;
 
-  if (setlocale(LC_ALL, "") == NULL) {
-    fprintf(stderr, "Warning, unable to reset locale\n");
+  if(!(raw = malloc(ARCHIVE_MAX_LEN)) || !(archive = malloc(ARCHIVE_HEADER_LEN + compressed_len))) {
+    fprintf(stderr, "Failed to allocate memory for the archive.\n");
+    goto export_out;
+  }
+
+  if((rc = ykpiv_begin_batch(state, ACTION_BATCH_HOLD_MS)) != YKPIV_OK) {
+    fprintf(stderr, "Failed to begin transaction: %s.\n", ykpiv_strerror(rc));
+    goto export_out;
+  }
+  for(size_t i = 0; i < ARCHIVE_OBJECTS; i++) {
+    unsigned char *rec = raw + raw_len;
+    unsigned long len = YKPIV_OBJ_MAX_SIZE;
+    rc = ykpiv_fetch_object(state, archive_objects[i], rec + ARCHIVE_RECORD_HEADER_LEN, &len);
+    if(rc == YKPIV_INVALID_OBJECT) {
+      continue;
+    } else if(rc == YKPIV_AUTHENTICATION_ERROR) {
+      fprintf(stderr, "Skipping object %x, which can only be read after verifying the PIN.\n", archive_objects[i]);
+      continue;
+    } else if(rc != YKPIV_OK) {
+      fprintf(stderr, "Failed fetching object %x: %s.\n", archive_objects[i], ykpiv_strerror(rc));
+      ykpiv_end_batch(state);
+      goto export_out;
+    }
+    rec[0] = (archive_objects[i] >> 16) & 0xff;
+    rec[1] = (archive_objects[i] >> 8) & 0xff;
+    rec[2] = archive_objects[i] & 0xff;
+    rec[3] = (len >> 8) & 0xff;
+    rec[4] = len & 0xff;
+    raw_len += ARCHIVE_RECORD_HEADER_LEN + len;
+    n_objects++;
+    if(verbosity) {
+      fprintf(stderr, "Exporting %lu bytes of object %x.\n", len, archive_objects[i]);
+    }
   }
+  ykpiv_end_batch(state);
 
-  if (argc < 2) {
-    fprintf(stderr, "No actions detected. Use '--help' or '-h' for command manpage\n");
-    return EXIT_FAILURE;
+  memcpy(archive, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC) - 1);
+  archive[sizeof(ARCHIVE_MAGIC) - 1] = ARCHIVE_VERSION;
+  for(size_t i = 0; i < 4; i++) {
+    archive[sizeof(ARCHIVE_MAGIC) + i] = (raw_len >> (24 - 8 * i)) & 0xff;
+  }
+  if(compress2(archive + ARCHIVE_HEADER_LEN, &compressed_len, raw, raw_len, Z_BEST_COMPRESSION) != Z_OK) {
+    fprintf(stderr, "Failed to compress the archive.\n");
+    goto export_out;
   }
 
-  if(cmdline_parser(argc, argv, &args_info) != 0) {
-    return EXIT_FAILURE;
+  output_file = open_stream(output_file_name, OUTPUT_BIN);
+  if(!output_file) {
+    goto export_out;
   }
+  if(fwrite(archive, ARCHIVE_HEADER_LEN + compressed_len, 1, output_file) != 1) {
+    fprintf(stderr, "Failed writing the archive.\n");
+    goto export_out;
+  }
+  fprintf(stderr, "Exported %zu objects.\n", n_objects);
+  ret = true;
 
-  verbosity = args_info.verbose_arg ? args_info.verbose_arg : (int)args_info.verbose_given;
-  password = args_info.password_arg;
+export_out:
+  if(output_file && !is_stdout(output_file)) {
+    fclose(output_file);
+  }
+  free(raw);
+  free(archive);
+  return ret;
+}
 
-  for(i = 0; i < args_info.action_given; i++) {
-    action = *(args_info.action_arg + i);
+static bool import_objects(ykpiv_state *state, const char *input_file_name, int verbosity) {
+  unsigned char *raw = NULL, *archive = NULL;
+  unsigned char current[YKPIV_OBJ_MAX_SIZE];
+  size_t archive_len = 0, n_written = 0, n_skipped = 0;
+  uLongf raw_len;
+  FILE *input_file = NULL;
+  bool ret = false;
+  ykpiv_rc rc;
+
+  if(!(archive = malloc(ARCHIVE_HEADER_LEN + compressBound(ARCHIVE_MAX_LEN) + 1))) {
+    fprintf(stderr, "Failed to allocate memory for the archive.\n");
+    goto import_out;
+  }
+  input_file = open_stream(input_file_name, INPUT_BIN);
+  if(!input_file) {
+    goto import_out;
+  }
+  archive_len = fread(archive, 1, ARCHIVE_HEADER_LEN + compressBound(ARCHIVE_MAX_LEN) + 1, input_file);
+  if(archive_len < ARCHIVE_HEADER_LEN || archive_len > ARCHIVE_HEADER_LEN + compressBound(ARCHIVE_MAX_LEN) ||
+     memcmp(archive, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC) - 1) || archive[sizeof(ARCHIVE_MAGIC) - 1] != ARCHIVE_VERSION) {
+    fprintf(stderr, "Input is not an object archive.\n");
+    goto import_out;
+  }
+  raw_len = 0;
+  for(size_t i = 0; i < 4; i++) {
+    raw_len = (raw_len << 8) | archive[sizeof(ARCHIVE_MAGIC) + i];
+  }
+  if(raw_len > ARCHIVE_MAX_LEN || !(raw = malloc(raw_len ? raw_len : 1))) {
+    fprintf(stderr, "Invalid length of the archive.\n");
+    goto import_out;
+  }
+  uLongf expected_len = raw_len;
+  if(uncompress(raw, &raw_len, archive + ARCHIVE_HEADER_LEN, archive_len - ARCHIVE_HEADER_LEN) != Z_OK ||
+     raw_len != expected_len) {
+    fprintf(stderr, "Failed to decompress the archive.\n");
+    goto import_out;
+  }
+
+  // Check every record before changing anything on the card
+  for(size_t offs = 0; offs < raw_len;) {
+    size_t len;
+    if(raw_len - offs < ARCHIVE_RECORD_HEADER_LEN ||
+       (len = ((size_t)raw[offs + 3] << 8) | raw[offs + 4]) > YKPIV_OBJ_MAX_SIZE ||
+       raw_len - offs - ARCHIVE_RECORD_HEADER_LEN < len) {
+      fprintf(stderr, "The archive is corrupt.\n");
+      goto import_out;
+    }
+    offs += ARCHIVE_RECORD_HEADER_LEN + len;
+  }
+
+  if((rc = ykpiv_begin_batch(state, ACTION_BATCH_HOLD_MS)) != YKPIV_OK) {
+    fprintf(stderr, "Failed to begin transaction: %s.\n", ykpiv_strerror(rc));
+    goto import_out;
+  }
+  ret = true;
+  for(size_t offs = 0; offs < raw_len;) {
+    int id = (raw[offs] << 16) | (raw[offs + 1] << 8) | raw[offs + 2];
+    size_t len = ((size_t)raw[offs + 3] << 8) | raw[offs + 4];
+    unsigned char *data = raw + offs + ARCHIVE_RECORD_HEADER_LEN;
+    unsigned long current_len = sizeof(current);
+    offs += ARCHIVE_RECORD_HEADER_LEN + len;
+
+    // The object is read to compare it anyway, so the contents are compared rather than digests of them
+    if(ykpiv_fetch_object(state, id, current, &current_len) == YKPIV_OK && current_len == len &&
+       !memcmp(current, data, len)) {
+      if(verbosity) {
+        fprintf(stderr, "Object %x is unchanged.\n", id);
+      }
+      n_skipped++;
+      continue;
+    }
+    if(verbosity) {
+      fprintf(stderr, "Writing %zu bytes of data to object %x.\n", len, id);
+    }
+    if((rc = ykpiv_save_object(state, id, data, len)) != YKPIV_OK) {
+      fprintf(stderr, "Failed writing object %x: %s.\n", id, ykpiv_strerror(rc));
+      ret = false;
+      break;
+    }
+    n_written++;
+  }
+  ykpiv_end_batch(state);
+  fprintf(stderr, "Imported %zu objects, %zu were unchanged.\n", n_written, n_skipped);
+
+import_out:
+  if(input_file && input_file != stdin) {
+    fclose(input_file);
+  }
+  free(raw);
+  free(archive);
+  return ret;
+}
+
+static bool check_actions(struct gengetopt_args_info *args_info) {
+  enum enum_action action;
+  unsigned int i;
+
+  for(i = 0; i < args_info->action_given; i++) {
+    action = *(args_info->action_arg + i);
     switch(action) {
       case action_arg_requestMINUS_certificate:
       case action_arg_selfsignMINUS_certificate:
-        if(!args_info.subject_arg) {
+        if(!args_info->subject_arg) {
           fprintf(stderr, "The '%s' action needs a subject (-S) to operate on.\n",
               cmdline_parser_action_values[action]);
-          cmdline_parser_free(&args_info);
-          return EXIT_FAILURE;
+          return false;
         }
         /* fall through */
       case action_arg_generate:
@@ -2476,36 +3162,40 @@ int main(int argc, char *argv[]) {
       case action_arg_testMINUS_decipher:
       case action_arg_attest:
       case action_arg_deleteMINUS_key:
-        if(args_info.slot_arg == slot__NULL) {
+      case action_arg_signMINUS_files:
+        if(args_info->slot_arg == slot__NULL) {
           fprintf(stderr, "The '%s' action needs a slot (-s) to operate on.\n",
               cmdline_parser_action_values[action]);
-          cmdline_parser_free(&args_info);
-          return EXIT_FAILURE;
+          return false;
         }
         break;
       case action_arg_moveMINUS_key:
-        if(args_info.slot_arg == slot__NULL || args_info.to_slot_arg == to_slot__NULL) {
+        if(args_info->slot_arg == slot__NULL || args_info->to_slot_arg == to_slot__NULL) {
           fprintf(stderr, "The '%s' action needs both a slot (-s) to operate on and a --to-slot to move the key to.\n",
                   cmdline_parser_action_values[action]);
-          cmdline_parser_free(&args_info);
-          return EXIT_FAILURE;
+          return false;
         }
         break;
       case action_arg_pinMINUS_retries:
-        if(!args_info.pin_retries_given || !args_info.puk_retries_given) {
+        if(!args_info->pin_retries_given || !args_info->puk_retries_given) {
           fprintf(stderr, "The '%s' action needs both --pin-retries and --puk-retries arguments.\n",
               cmdline_parser_action_values[action]);
-          cmdline_parser_free(&args_info);
-          return EXIT_FAILURE;
+          return false;
+        }
+        break;
+      case action_arg_broker:
+        if(!args_info->socket_given || args_info->parallel_given) {
+          fprintf(stderr, "The '%s' action needs the --socket argument, and can't be used with --parallel.\n",
+              cmdline_parser_action_values[action]);
+          return false;
         }
         break;
       case action_arg_writeMINUS_object:
       case action_arg_readMINUS_object:
-        if(!args_info.id_given) {
+        if(!args_info->id_given) {
           fprintf(stderr, "The '%s' action needs the --id argument.\n",
               cmdline_parser_action_values[action]);
-          cmdline_parser_free(&args_info);
-          return EXIT_FAILURE;
+          return false;
         }
         break;
       case action_arg_changeMINUS_pin:
@@ -2520,39 +3210,29 @@ int main(int argc, char *argv[]) {
       case action_arg_reset:
       case action_arg_status:
       case action_arg_listMINUS_readers:
+      case action_arg_exportMINUS_objects:
+      case action_arg_importMINUS_objects:
       case action__NULL:
       default:
         continue;
     }
   }
 
-  /* openssl setup.. */
-#if (OPENSSL_VERSION_NUMBER < 0x10100000L)
-  OpenSSL_add_all_algorithms();
-#else
-  OPENSSL_init_crypto(OPENSSL_INIT_LOAD_CONFIG, 0);
-#endif
-
-  if((rc = ykpiv_init(&state, verbosity)) != YKPIV_OK) {
-    fprintf(stderr, "Failed initializing library: %s.\n", ykpiv_strerror(rc));
-    cmdline_parser_free(&args_info);
-    return EXIT_FAILURE;
-  }
+  return true;
+}
 
-  if((rc = ykpiv_connect_ex(state, args_info.reader_arg, args_info.scp11_given)) != YKPIV_OK) {
-    fprintf(stderr, "Failed to connect to yubikey: %s.\n", ykpiv_strerror(rc));
-    if (rc == YKPIV_PCSC_SERVICE_ERROR) {
-      fprintf(stderr, "Try restarting the PCSC subsystem.\n");
-    } else if (rc == YKPIV_PCSC_ERROR) {
-      fprintf(stderr, "Try removing and reconnecting the device.\n");
-    }
-    ykpiv_done(state);
-    cmdline_parser_free(&args_info);
-    return EXIT_FAILURE;
-  }
+static int run_actions(ykpiv_state *state, struct gengetopt_args_info *args_info,
+                       struct gengetopt_args_info *key_info, bool *authed, int verbosity) {
+  const uint8_t mgm_algo[] = {YKPIV_ALGO_3DES, YKPIV_ALGO_AES128, YKPIV_ALGO_AES192, YKPIV_ALGO_AES256};
+  enum enum_action action;
+  unsigned int i;
+  int ret = EXIT_SUCCESS;
+  ykpiv_rc rc;
+  char pwbuf[128] = {0};
+  char *password = args_info->password_arg;
 
-  for(i = 0; i < args_info.action_given; i++) {
-    action = *(args_info.action_arg + i);
+  for(i = 0; i < args_info->action_given; i++) {
+    action = *(args_info->action_arg + i);
     if(verbosity) {
       fprintf(stderr, "Now processing for action '%s'.\n",
           cmdline_parser_action_values[action]);
@@ -2560,14 +3240,12 @@ int main(int argc, char *argv[]) {
     switch(action) {
       case action_arg_importMINUS_key:
       case action_arg_importMINUS_certificate:
-        if(args_info.key_format_arg == key_format_arg_PKCS12 && !password) {
+        if(args_info->key_format_arg == key_format_arg_PKCS12 && !password) {
           if(verbosity) {
             fprintf(stderr, "Asking for password since action '%s' needs it.\n", cmdline_parser_action_values[action]);
           }
-          if(!read_pw("Password", pwbuf, sizeof(pwbuf), false, args_info.stdin_input_flag)) {
+          if(!read_secret("Password", pwbuf, sizeof(pwbuf), false, args_info->stdin_input_flag)) {
             fprintf(stderr, "Failed to get password.\n");
-            ykpiv_done(state);
-            cmdline_parser_free(&args_info);
             return EXIT_FAILURE;
           }
           password = pwbuf;
@@ -2580,27 +3258,24 @@ int main(int argc, char *argv[]) {
       case action_arg_setMINUS_ccc:
       case action_arg_deleteMINUS_certificate:
       case action_arg_writeMINUS_object:
+      case action_arg_importMINUS_objects:
       case action_arg_moveMINUS_key:
       case action_arg_deleteMINUS_key:
-        if(!authed) {
+        if(!*authed) {
           if(verbosity) {
             fprintf(stderr, "Authenticating since action '%s' needs that.\n", cmdline_parser_action_values[action]);
           }
           ykpiv_config cfg = {0};
           if((rc = ykpiv_util_get_config(state, &cfg)) != YKPIV_OK) {
             fprintf(stderr, "Failed to get config metadata: %s.\n", ykpiv_strerror(rc));
-            ykpiv_done(state);
-            cmdline_parser_free(&args_info);
             return EXIT_FAILURE;
           }
           if(cfg.mgm_type != YKPIV_CONFIG_MGM_PROTECTED) {
             char keybuf[KEY_LEN * 2 + 2] = {0}; /* one extra byte for potential \n */
-            char *key_ptr = args_info.key_arg;
-            if(args_info.key_given && args_info.key_orig == NULL) {
-              if(!read_pw("management key", keybuf, sizeof(keybuf), false, args_info.stdin_input_flag)) {
+            char *key_ptr = key_info->key_arg;
+            if(key_info->key_given && key_info->key_orig == NULL) {
+              if(!read_secret("management key", keybuf, sizeof(keybuf), false, args_info->stdin_input_flag)) {
                 fprintf(stderr, "Failed to read management key from stdin,\n");
-                ykpiv_done(state);
-                cmdline_parser_free(&args_info);
                 return EXIT_FAILURE;
               }
               key_ptr = keybuf;
@@ -2608,21 +3283,17 @@ int main(int argc, char *argv[]) {
             cfg.mgm_len = sizeof(cfg.mgm_key);
             if((rc = ykpiv_hex_decode(key_ptr, strlen(key_ptr), cfg.mgm_key, &cfg.mgm_len)) != YKPIV_OK) {
               fprintf(stderr, "Failed decoding key: %s.\n", ykpiv_strerror(rc));
-              ykpiv_done(state);
-              cmdline_parser_free(&args_info);
               return EXIT_FAILURE;
             }
           }
           if((rc = ykpiv_authenticate2(state, cfg.mgm_key, cfg.mgm_len)) != YKPIV_OK) {
             fprintf(stderr, "Failed authentication with the application: %s.\n", ykpiv_strerror(rc));
-            ykpiv_done(state);
-            cmdline_parser_free(&args_info);
             return EXIT_FAILURE;
           }
           if(verbosity) {
             fprintf(stderr, "Successful application authentication.\n");
           }
-          authed = true;
+          *authed = true;
         } else {
           if(verbosity) {
             fprintf(stderr, "Skipping authentication for action '%s' since it's already done.\n", cmdline_parser_action_values[action]);
@@ -2645,6 +3316,10 @@ int main(int argc, char *argv[]) {
       case action_arg_listMINUS_readers:
       case action_arg_attest:
       case action_arg_readMINUS_object:
+      case action_arg_exportMINUS_objects:
+      case action_arg_signMINUS_files:
+      case action_arg_inventory:
+      case action_arg_broker:
       case action__NULL:
       default:
         if(verbosity) {
@@ -2653,11 +3328,11 @@ int main(int argc, char *argv[]) {
     }
     switch(action) {
       case action_arg_version:
-        print_version(state, args_info.output_arg);
+        print_version(state, args_info->output_arg);
         break;
       case action_arg_generate:
-        if(generate_key(state, args_info.slot_arg, args_info.algorithm_arg, args_info.output_arg, args_info.key_format_arg,
-              args_info.pin_policy_arg, args_info.touch_policy_arg) == false) {
+        if(generate_key(state, args_info->slot_arg, args_info->algorithm_arg, args_info->output_arg, args_info->key_format_arg,
+              args_info->pin_policy_arg, args_info->touch_policy_arg) == false) {
           ret = EXIT_FAILURE;
         } else {
           fprintf(stderr, "Successfully generated a new private key.\n");
@@ -2666,9 +3341,9 @@ int main(int argc, char *argv[]) {
       case action_arg_setMINUS_mgmMINUS_key:
         {
           char new_keybuf[KEY_LEN * 2 + 2] = {0}; /* one extra byte for potential \n */
-          char *new_mgm_key = args_info.new_key_arg;
+          char *new_mgm_key = args_info->new_key_arg;
           if(!new_mgm_key) {
-            if(!read_pw("new management key", new_keybuf, sizeof(new_keybuf), true, args_info.stdin_input_flag)) {
+            if(!read_secret("new management key", new_keybuf, sizeof(new_keybuf), true, args_info->stdin_input_flag)) {
               fprintf(stderr, "Failed to read management key from stdin,\n");
               ret = EXIT_FAILURE;
               break;
@@ -2679,10 +3354,10 @@ int main(int argc, char *argv[]) {
           if((rc = ykpiv_hex_decode(new_mgm_key, strlen(new_mgm_key), new_key.data, &new_key.len)) != YKPIV_OK) {
             fprintf(stderr, "Failed decoding new key: %s.\n", ykpiv_strerror(rc));
             ret = EXIT_FAILURE;
-          } else if((rc = ykpiv_set_mgmkey3(state, new_key.data, new_key.len, mgm_algo[args_info.new_key_algo_arg],
-                        get_touch_policy(args_info.touch_policy_arg))) != YKPIV_OK) {
+          } else if((rc = ykpiv_set_mgmkey3(state, new_key.data, new_key.len, mgm_algo[args_info->new_key_algo_arg],
+                        get_touch_policy(args_info->touch_policy_arg))) != YKPIV_OK) {
             fprintf(stderr, "Failed setting the new key: %s.\n", ykpiv_strerror(rc));
-            if(args_info.touch_policy_arg != touch_policy__NULL) {
+            if(args_info->touch_policy_arg != touch_policy__NULL) {
               fprintf(stderr, " Maybe this touch policy or algorithm is not supported on this key?");
             }
             fprintf(stderr, "\n");
@@ -2705,22 +3380,22 @@ int main(int argc, char *argv[]) {
         }
         break;
       case action_arg_reset:
-        if(!reset(state, args_info.global_given)) {
+        if(!reset(state, args_info->global_given)) {
           ret = EXIT_FAILURE;
         }
         break;
       case action_arg_pinMINUS_retries:
-        if(set_pin_retries(state, args_info.pin_retries_arg, args_info.puk_retries_arg, verbosity) == false) {
+        if(set_pin_retries(state, args_info->pin_retries_arg, args_info->puk_retries_arg, verbosity) == false) {
           fprintf(stderr, "Failed changing pin retries.\n");
           ret = EXIT_FAILURE;
         } else {
           fprintf(stderr, "Successfully changed pin retries to %d and puk retries to %d, both codes have been reset to default now.\n",
-              args_info.pin_retries_arg, args_info.puk_retries_arg);
+              args_info->pin_retries_arg, args_info->puk_retries_arg);
         }
         break;
       case action_arg_importMINUS_key:
-        if(import_key(state, args_info.key_format_arg, args_info.input_arg, args_info.slot_arg, password,
-              args_info.pin_policy_arg, args_info.touch_policy_arg) == false) {
+        if(import_key(state, args_info->key_format_arg, args_info->input_arg, args_info->slot_arg, password,
+              args_info->pin_policy_arg, args_info->touch_policy_arg) == false) {
           fprintf(stderr, "Unable to import private key\n");
           ret = EXIT_FAILURE;
         } else {
@@ -2728,7 +3403,7 @@ int main(int argc, char *argv[]) {
         }
         break;
       case action_arg_importMINUS_certificate:
-        if(import_cert(state, args_info.key_format_arg, args_info.compress_flag, args_info.input_arg, args_info.slot_arg, password) == false) {
+        if(import_cert(state, args_info->key_format_arg, args_info->compress_flag, args_info->input_arg, args_info->slot_arg, password) == false) {
           ret = EXIT_FAILURE;
         } else {
           fprintf(stderr, "Successfully imported a new certificate.\n");
@@ -2743,9 +3418,9 @@ int main(int argc, char *argv[]) {
         }
         break;
       case action_arg_requestMINUS_certificate:
-        if(request_certificate(state, args_info.key_format_arg, args_info.input_arg,
-              args_info.slot_arg, args_info.subject_arg, args_info.hash_arg,
-              args_info.output_arg, args_info.attestation_flag) == false) {
+        if(request_certificate(state, args_info->key_format_arg, args_info->input_arg,
+              args_info->slot_arg, args_info->subject_arg, args_info->hash_arg,
+              args_info->output_arg, args_info->attestation_flag) == false) {
           ret = EXIT_FAILURE;
         } else {
           fprintf(stderr, "Successfully generated a certificate request.\n");
@@ -2753,13 +3428,11 @@ int main(int argc, char *argv[]) {
         break;
       case action_arg_verifyMINUS_pin: {
         char pinbuf[8+2] = {0};
-        char *pin = args_info.pin_arg;
+        char *pin = args_info->pin_arg;
 
         if(!pin) {
-          if (!read_pw("PIN", pinbuf, sizeof(pinbuf), false, args_info.stdin_input_flag)) {
+          if (!read_secret("PIN", pinbuf, sizeof(pinbuf), false, args_info->stdin_input_flag)) {
             fprintf(stderr, "Failed to get PIN.\n");
-            ykpiv_done(state);
-            cmdline_parser_free(&args_info);
             return EXIT_FAILURE;
           }
           pin = pinbuf;
@@ -2784,25 +3457,21 @@ int main(int argc, char *argv[]) {
       case action_arg_unblockMINUS_pin: {
         char pinbuf[8+2] = {0};
         char new_pinbuf[8+2] = {0};
-        char *pin = args_info.pin_arg;
-        char *new_pin = args_info.new_pin_arg;
+        char *pin = args_info->pin_arg;
+        char *new_pin = args_info->new_pin_arg;
         const char *name = action == action_arg_changeMINUS_pin ? "pin" : "puk";
         const char *new_name = action == action_arg_changeMINUS_puk ? "new puk" : "new pin";
 
         if(!pin) {
-          if (!read_pw(name, pinbuf, sizeof(pinbuf), false, args_info.stdin_input_flag)) {
+          if (!read_secret(name, pinbuf, sizeof(pinbuf), false, args_info->stdin_input_flag)) {
             fprintf(stderr, "Failed to get %s.\n", name);
-            ykpiv_done(state);
-            cmdline_parser_free(&args_info);
             return EXIT_FAILURE;
           }
           pin = pinbuf;
         }
         if(!new_pin) {
-          if (!read_pw(new_name, new_pinbuf, sizeof(new_pinbuf), true, args_info.stdin_input_flag)) {
+          if (!read_secret(new_name, new_pinbuf, sizeof(new_pinbuf), true, args_info->stdin_input_flag)) {
             fprintf(stderr, "Failed to get %s.\n", new_name);
-            ykpiv_done(state);
-            cmdline_parser_free(&args_info);
             return EXIT_FAILURE;
           }
           new_pin = new_pinbuf;
@@ -2820,40 +3489,40 @@ int main(int argc, char *argv[]) {
         break;
       }
       case action_arg_selfsignMINUS_certificate:
-        if(selfsign_certificate(state, args_info.key_format_arg, args_info.input_arg,
-              args_info.slot_arg, args_info.subject_arg, args_info.hash_arg,
-              args_info.serial_given ? &args_info.serial_arg : NULL, args_info.valid_days_arg,
-              args_info.output_arg, args_info.attestation_flag) == false) {
+        if(selfsign_certificate(state, args_info->key_format_arg, args_info->input_arg,
+              args_info->slot_arg, args_info->subject_arg, args_info->hash_arg,
+              args_info->serial_given ? &args_info->serial_arg : NULL, args_info->valid_days_arg,
+              args_info->output_arg, args_info->attestation_flag) == false) {
           ret = EXIT_FAILURE;
         } else {
           fprintf(stderr, "Successfully generated a new self signed certificate.\n");
         }
         break;
       case action_arg_deleteMINUS_certificate:
-        if(delete_certificate(state, args_info.slot_arg) == false) {
+        if(delete_certificate(state, args_info->slot_arg) == false) {
           ret = EXIT_FAILURE;
         }
         break;
       case action_arg_readMINUS_certificate:
-        if(read_certificate(state, args_info.slot_arg, args_info.key_format_arg,
-              args_info.output_arg) == false) {
+        if(read_certificate(state, args_info->slot_arg, args_info->key_format_arg,
+              args_info->output_arg) == false) {
           ret = EXIT_FAILURE;
         }
         break;
       case action_arg_status:
-        if(status(state, args_info.hash_arg, args_info.slot_arg, args_info.output_arg) == false) {
+        if(status(state, args_info->hash_arg, args_info->slot_arg, args_info->output_arg) == false) {
           ret = EXIT_FAILURE;
         }
         break;
       case action_arg_testMINUS_signature:
-        if(test_signature(state, args_info.slot_arg, args_info.hash_arg,
-              args_info.input_arg, args_info.key_format_arg, verbosity) == false) {
+        if(test_signature(state, args_info->slot_arg, args_info->hash_arg,
+              args_info->input_arg, args_info->key_format_arg, verbosity) == false) {
           ret = EXIT_FAILURE;
         }
         break;
       case action_arg_testMINUS_decipher:
-        if(test_decipher(state, args_info.slot_arg, args_info.input_arg,
-              args_info.key_format_arg, verbosity) == false) {
+        if(test_decipher(state, args_info->slot_arg, args_info->input_arg,
+              args_info->key_format_arg, verbosity) == false) {
           ret = EXIT_FAILURE;
         }
         break;
@@ -2863,26 +3532,52 @@ int main(int argc, char *argv[]) {
         }
         break;
       case action_arg_writeMINUS_object:
-        if(write_object(state, args_info.id_arg, args_info.input_arg, verbosity,
-              args_info.format_arg) == false) {
+        if(write_object(state, args_info->id_arg, args_info->input_arg, verbosity,
+              args_info->format_arg) == false) {
           ret = EXIT_FAILURE;
         }
         break;
       case action_arg_readMINUS_object:
-        if(read_object(state, args_info.id_arg, args_info.output_arg,
-              args_info.format_arg) == false) {
+        if(read_object(state, args_info->id_arg, args_info->output_arg,
+              args_info->format_arg) == false) {
+          ret = EXIT_FAILURE;
+        }
+        break;
+      case action_arg_exportMINUS_objects:
+        if(export_objects(state, args_info->output_arg, verbosity) == false) {
+          ret = EXIT_FAILURE;
+        }
+        break;
+      case action_arg_importMINUS_objects:
+        if(import_objects(state, args_info->input_arg, verbosity) == false) {
           ret = EXIT_FAILURE;
         }
         break;
       case action_arg_attest:
-        if(attest(state, args_info.slot_arg, args_info.key_format_arg,
-              args_info.output_arg) == false) {
+        if(attest(state, args_info->slot_arg, args_info->key_format_arg,
+              args_info->output_arg) == false) {
+          ret = EXIT_FAILURE;
+        }
+        break;
+      case action_arg_inventory:
+        if(inventory(state, args_info->output_arg, args_info->json_flag, args_info->with_certificates_flag) == false) {
+          ret = EXIT_FAILURE;
+        }
+        break;
+      case action_arg_broker:
+        if(serve_broker(state, args_info->socket_arg) == false) {
+          ret = EXIT_FAILURE;
+        }
+        break;
+      case action_arg_signMINUS_files:
+        if(sign_files(state, args_info->input_arg, args_info->slot_arg, args_info->algorithm_arg,
+              args_info->hash_arg, verbosity) == false) {
           ret = EXIT_FAILURE;
         }
         break;
       case action_arg_moveMINUS_key: {
-        int from_slot = get_slot_hex(args_info.slot_arg);
-        int to_slot = get_slot_hex((enum enum_slot) args_info.to_slot_arg);
+        int from_slot = get_slot_hex(args_info->slot_arg);
+        int to_slot = get_slot_hex((enum enum_slot) args_info->to_slot_arg);
         if (move_key(state, from_slot, to_slot) == false) {
           ret = EXIT_FAILURE;
         } else {
@@ -2891,7 +3586,7 @@ int main(int argc, char *argv[]) {
         break;
       }
       case action_arg_deleteMINUS_key:
-        if(move_key(state, get_slot_hex(args_info.slot_arg), 0xFF) == false) {
+        if(move_key(state, get_slot_hex(args_info->slot_arg), 0xFF) == false) {
           ret = EXIT_FAILURE;
         } else {
           fprintf(stderr, "Successfully deleted key.\n");
@@ -2907,13 +3602,13 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  if(ret == EXIT_SUCCESS && args_info.sign_flag) {
-    if(args_info.slot_arg == slot__NULL) {
+  if(ret == EXIT_SUCCESS && args_info->sign_flag) {
+    if(args_info->slot_arg == slot__NULL) {
       fprintf(stderr, "The sign action needs a slot (-s) to operate on.\n");
       ret = EXIT_FAILURE;
     }
-    else if(sign_file(state, args_info.input_arg, args_info.output_arg,
-        args_info.slot_arg, args_info.algorithm_arg, args_info.hash_arg,
+    else if(sign_file(state, args_info->input_arg, args_info->output_arg,
+        args_info->slot_arg, args_info->algorithm_arg, args_info->hash_arg,
         verbosity)) {
       fprintf(stderr, "Signature successful!\n");
     } else {
@@ -2921,6 +3616,476 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  return ret;
+}
+
+// Split a batch line into arguments on whitespace, single or double quotes keep spaces in an argument
+static int split_line(char *line, char **argv, int max_args) {
+  int argc = 1; // argv[0] is the program name
+  char *p = line;
+  while(*p) {
+    while(*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+      p++;
+    }
+    if(*p == '\0' || *p == '#') {
+      break;
+    }
+    if(argc == max_args) {
+      return -1;
+    }
+    char *out = p;
+    argv[argc++] = out;
+    char quote = 0;
+    while(*p && (quote || (*p != ' ' && *p != '\t' && *p != '\r' && *p != '\n'))) {
+      if(quote && *p == quote) {
+        quote = 0;
+      } else if(!quote && (*p == '"' || *p == '\'')) {
+        quote = *p;
+      } else {
+        *out++ = *p;
+      }
+      p++;
+    }
+    if(quote) {
+      return -1;
+    }
+    if(*p) {
+      p++;
+    }
+    *out = '\0';
+  }
+  return argc;
+}
+
+// The generated parser keeps its state in globals, so batches on different YubiKeys take turns parsing
+#ifdef _WIN32
+static SRWLOCK parser_lock = SRWLOCK_INIT;
+#define lock_parser() AcquireSRWLockExclusive(&parser_lock)
+#define unlock_parser() ReleaseSRWLockExclusive(&parser_lock)
+#else
+static pthread_mutex_t parser_lock = PTHREAD_MUTEX_INITIALIZER;
+#define lock_parser() pthread_mutex_lock(&parser_lock)
+#define unlock_parser() pthread_mutex_unlock(&parser_lock)
+#endif
+
+// Make a file name specific to one YubiKey by replacing each {serial} with its serial number.
+// Output files without {serial} get the serial number prepended to the file name.
+static char *serial_file_name(const char *name, uint32_t serial, bool output) {
+  char num[16] = {0};
+  size_t num_len = snprintf(num, sizeof(num), "%u", serial);
+  size_t placeholders = 0;
+
+  if(!name || strcmp(name, "-") == 0) {
+    return NULL;
+  }
+  for(const char *p = strstr(name, FLEET_SERIAL); p; p = strstr(p + strlen(FLEET_SERIAL), FLEET_SERIAL)) {
+    placeholders++;
+  }
+  if(placeholders == 0 && !output) {
+    return NULL;
+  }
+
+  char *ret = malloc(strlen(name) + (placeholders ? placeholders : 1) * (num_len + 1) + 1);
+  if(!ret) {
+    return NULL;
+  }
+  if(placeholders == 0) {
+    const char *base = strrchr(name, '/');
+#ifdef _WIN32
+    const char *bslash = strrchr(name, '\\');
+    if(!base || (bslash && bslash > base)) {
+      base = bslash;
+    }
+#endif
+    size_t dir_len = base ? (size_t)(base - name) + 1 : 0;
+    sprintf(ret, "%.*s%s-%s", (int)dir_len, name, num, name + dir_len);
+    return ret;
+  }
+
+  char *out = ret;
+  const char *p = name;
+  for(const char *q = strstr(p, FLEET_SERIAL); q; q = strstr(p, FLEET_SERIAL)) {
+    memcpy(out, p, q - p);
+    out += q - p;
+    memcpy(out, num, num_len);
+    out += num_len;
+    p = q + strlen(FLEET_SERIAL);
+  }
+  strcpy(out, p);
+  return ret;
+}
+
+static int run_serial_actions(ykpiv_state *state, struct gengetopt_args_info *args_info,
+                              struct gengetopt_args_info *key_info, bool *authed, int verbosity, uint32_t serial) {
+  if(serial == 0) {
+    return run_actions(state, args_info, key_info, authed, verbosity);
+  }
+
+  // Only the file names differ, the copy shares everything else with args_info
+  struct gengetopt_args_info serial_info = *args_info;
+  char *input = serial_file_name(args_info->input_arg, serial, false);
+  char *output = serial_file_name(args_info->output_arg, serial, true);
+  if(input) {
+    serial_info.input_arg = input;
+  }
+  if(output) {
+    serial_info.output_arg = output;
+  }
+  int ret = run_actions(state, &serial_info, key_info == args_info ? &serial_info : key_info, authed, verbosity);
+  free(input);
+  free(output);
+  return ret;
+}
+
+static int run_batch(ykpiv_state *state, struct gengetopt_args_info *args_info, char *prog, bool *authed,
+                     int verbosity, uint32_t serial) {
+  char line[4096] = {0};
+  char *argv[BATCH_MAX_ARGS] = {prog};
+  unsigned int line_no = 0;
+  int ret = EXIT_SUCCESS;
+
+  FILE *batch_file = open_file(args_info->batch_arg, INPUT_TEXT);
+  if(!batch_file) {
+    return EXIT_FAILURE;
+  }
+
+  while(ret == EXIT_SUCCESS && fgets(line, sizeof(line), batch_file)) {
+    line_no++;
+    if(strlen(line) == sizeof(line) - 1 && line[sizeof(line) - 2] != '\n') {
+      fprintf(stderr, "Line %u of the batch is too long.\n", line_no);
+      ret = EXIT_FAILURE;
+      break;
+    }
+    int argc = split_line(line, argv, BATCH_MAX_ARGS);
+    if(argc < 0) {
+      fprintf(stderr, "Failed to parse line %u of the batch.\n", line_no);
+      ret = EXIT_FAILURE;
+      break;
+    }
+    if(argc == 1) {
+      continue;
+    }
+
+    struct gengetopt_args_info line_info;
+    struct cmdline_parser_params params;
+    cmdline_parser_params_init(&params);
+    params.initialize = 1;
+    params.override = 1;
+    lock_parser();
+    int parsed = cmdline_parser_ext(argc, argv, &line_info, &params);
+    unlock_parser();
+    if(parsed != 0) {
+      fprintf(stderr, "Failed to parse line %u of the batch.\n", line_no);
+      ret = EXIT_FAILURE;
+      break;
+    }
+    if(line_info.batch_given || line_info.reader_given || line_info.scp11_given) {
+      fprintf(stderr, "Line %u of the batch: --batch, --reader and --scp11 can only be given on the command line.\n", line_no);
+      ret = EXIT_FAILURE;
+    } else if(!check_actions(&line_info)) {
+      fprintf(stderr, "Line %u of the batch is invalid.\n", line_no);
+      ret = EXIT_FAILURE;
+    } else {
+      if(verbosity) {
+        fprintf(stderr, "Now processing line %u of the batch.\n", line_no);
+      }
+      // The management key is only needed once, take it from the command line unless the line has its own
+      ret = run_serial_actions(state, &line_info, line_info.key_given ? &line_info : args_info, authed,
+                               line_info.verbose_given ? (line_info.verbose_arg ? line_info.verbose_arg : (int)line_info.verbose_given) : verbosity,
+                               serial);
+      if(ret != EXIT_SUCCESS) {
+        fprintf(stderr, "Line %u of the batch failed.\n", line_no);
+      }
+    }
+    cmdline_parser_free(&line_info);
+  }
+
+  if(ret == EXIT_SUCCESS && ferror(batch_file)) {
+    fprintf(stderr, "Failed reading the batch.\n");
+    ret = EXIT_FAILURE;
+  }
+  if(batch_file != stdin) {
+    fclose(batch_file);
+  }
+  OPENSSL_cleanse(line, sizeof(line));
+  return ret;
+}
+
+struct fleet {
+  struct gengetopt_args_info *args_info;
+  char *prog;
+  const char **readers;
+  size_t n_readers;
+  int *results;
+  int verbosity;
+  FILE **outputs; // Output to stdout of each YubiKey
+};
+
+static int run_fleet_reader(struct fleet *fleet, const char *reader) {
+  struct gengetopt_args_info *args_info = fleet->args_info;
+  char wanted[2048] = {0};
+  ykpiv_state *state = NULL;
+  uint32_t serial = 0;
+  bool authed = false;
+  int ret = EXIT_FAILURE;
+  ykpiv_rc rc;
+
+  // Connect to exactly this reader
+  snprintf(wanted, sizeof(wanted), "@%s", reader);
+  if((rc = ykpiv_init(&state, fleet->verbosity)) != YKPIV_OK) {
+    fprintf(stderr, "%s: Failed initializing library: %s.\n", reader, ykpiv_strerror(rc));
+    return EXIT_FAILURE;
+  }
+  if((rc = ykpiv_connect_ex(state, wanted, args_info->scp11_given)) != YKPIV_OK) {
+    fprintf(stderr, "%s: Failed to connect to yubikey: %s.\n", reader, ykpiv_strerror(rc));
+    goto out;
+  }
+  if((rc = ykpiv_get_serial(state, &serial)) != YKPIV_OK || serial == 0) {
+    fprintf(stderr, "%s: Failed to read serial number: %s.\n", reader, ykpiv_strerror(rc));
+    goto out;
+  }
+  if((rc = ykpiv_begin_batch(state, ACTION_BATCH_HOLD_MS)) != YKPIV_OK) {
+    fprintf(stderr, "%s: Failed to begin transaction: %s.\n", reader, ykpiv_strerror(rc));
+    goto out;
+  }
+
+  ret = run_serial_actions(state, args_info, args_info, &authed, fleet->verbosity, serial);
+  if(ret == EXIT_SUCCESS && args_info->batch_given) {
+    ret = run_batch(state, args_info, fleet->prog, &authed, fleet->verbosity, serial);
+  }
+  ykpiv_end_batch(state);
+
+  fprintf(stderr, "%s (serial %u): %s.\n", reader, serial, ret == EXIT_SUCCESS ? "Done" : "Failed");
+
+out:
+  ykpiv_done(state);
+  return ret;
+}
+
+static void run_fleet_readers(void *ctx, size_t thread, size_t n_threads) {
+  struct fleet *fleet = ctx;
+  for(size_t i = thread; i < fleet->n_readers; i += n_threads) {
+    fleet_output = fleet->outputs + i;
+    fleet->results[i] = run_fleet_reader(fleet, fleet->readers[i]);
+    fleet_output = NULL;
+  }
+}
+
+// Prompt for the secrets shared by all YubiKeys once, before the threads would each ask for them
+static bool read_fleet_secrets(struct gengetopt_args_info *args_info) {
+  char buf[128] = {0};
+  bool pin_needed = false;
+  bool password_needed = false;
+
+  for(unsigned int i = 0; i < args_info->action_given; i++) {
+    enum enum_action action = args_info->action_arg[i];
+    if(action == action_arg_verifyMINUS_pin) {
+      pin_needed = true;
+    } else if((action == action_arg_importMINUS_key || action == action_arg_importMINUS_certificate) &&
+              args_info->key_format_arg == key_format_arg_PKCS12) {
+      password_needed = true;
+    }
+  }
+
+  if(args_info->key_given && args_info->key_orig == NULL) {
+    if(!read_secret("management key", buf, KEY_LEN * 2 + 2, false, args_info->stdin_input_flag)) {
+      fprintf(stderr, "Failed to read management key from stdin,\n");
+      return false;
+    }
+    free(args_info->key_arg);
+    args_info->key_arg = strdup(buf);
+    args_info->key_orig = strdup(buf);
+  }
+  if(pin_needed && !args_info->pin_arg) {
+    if(!read_secret("PIN", buf, 8 + 2, false, args_info->stdin_input_flag)) {
+      fprintf(stderr, "Failed to get PIN.\n");
+      return false;
+    }
+    args_info->pin_arg = strdup(buf);
+  }
+  if(password_needed && !args_info->password_arg) {
+    if(!read_secret("Password", buf, sizeof(buf), false, args_info->stdin_input_flag)) {
+      fprintf(stderr, "Failed to get password.\n");
+      return false;
+    }
+    args_info->password_arg = strdup(buf);
+  }
+  OPENSSL_cleanse(buf, sizeof(buf));
+
+  if((args_info->key_given && !args_info->key_arg) || (pin_needed && !args_info->pin_arg) ||
+     (password_needed && !args_info->password_arg)) {
+    fprintf(stderr, "Failed allocating memory.\n");
+    return false;
+  }
+  return true;
+}
+
+// Run the actions on every YubiKey in a matching reader, up to parallel_arg of them at a time
+static int run_fleet(struct gengetopt_args_info *args_info, char *prog, int verbosity) {
+  char readers[8192] = {0};
+  size_t len = sizeof(readers);
+  const char *reader_list[256] = {0};
+  int results[256] = {0};
+  FILE *outputs[256] = {0};
+  struct fleet fleet = {args_info, prog, reader_list, 0, results, verbosity, outputs};
+  ykpiv_state *state = NULL;
+  ykpiv_rc rc;
+
+  if(args_info->parallel_arg < 1) {
+    fprintf(stderr, "--parallel needs to be at least 1.\n");
+    return EXIT_FAILURE;
+  }
+  if(args_info->batch_given && strcmp(args_info->batch_arg, "-") == 0) {
+    fprintf(stderr, "The batch can't be read from stdin with --parallel.\n");
+    return EXIT_FAILURE;
+  }
+  if(!read_fleet_secrets(args_info)) {
+    return EXIT_FAILURE;
+  }
+
+  if((rc = ykpiv_init(&state, verbosity)) != YKPIV_OK) {
+    fprintf(stderr, "Failed initializing library: %s.\n", ykpiv_strerror(rc));
+    return EXIT_FAILURE;
+  }
+  rc = ykpiv_list_readers(state, readers, &len);
+  ykpiv_done(state);
+  if(rc != YKPIV_OK) {
+    fprintf(stderr, "Failed listing readers.\n");
+    return EXIT_FAILURE;
+  }
+
+  for(const char *reader = readers; *reader != '\0'; reader += strlen(reader) + 1) {
+    if(!ykpiv_reader_matches(reader, args_info->reader_arg)) {
+      continue;
+    }
+    if(fleet.n_readers == sizeof(reader_list) / sizeof(reader_list[0])) {
+      fprintf(stderr, "Too many matching readers.\n");
+      return EXIT_FAILURE;
+    }
+    reader_list[fleet.n_readers++] = reader;
+  }
+  if(fleet.n_readers == 0) {
+    fprintf(stderr, "No reader matching '%s' found.\n", args_info->reader_arg);
+    return EXIT_FAILURE;
+  }
+
+  size_t n_threads = (size_t)args_info->parallel_arg < fleet.n_readers ? (size_t)args_info->parallel_arg : fleet.n_readers;
+  if(verbosity) {
+    fprintf(stderr, "Running on %zu YubiKeys using %zu threads.\n", fleet.n_readers, n_threads);
+  }
+  yc_run_shares(n_threads, run_fleet_readers, &fleet);
+
+  // In reader order, so that the output of different YubiKeys doesn't interleave
+  for(size_t i = 0; i < fleet.n_readers; i++) {
+    if(outputs[i]) {
+      char buf[4096];
+      size_t n;
+      rewind(outputs[i]);
+      while((n = fread(buf, 1, sizeof(buf), outputs[i])) > 0) {
+        fwrite(buf, 1, n, stdout);
+      }
+      fclose(outputs[i]);
+    }
+  }
+  fflush(stdout);
+
+  size_t failed = 0;
+  for(size_t i = 0; i < fleet.n_readers; i++) {
+    if(results[i] != EXIT_SUCCESS) {
+      failed++;
+    }
+  }
+  if(failed) {
+    fprintf(stderr, "Failed on %zu of %zu YubiKeys.\n", failed, fleet.n_readers);
+    return EXIT_FAILURE;
+  }
+  fprintf(stderr, "Successfully ran on %zu YubiKeys.\n", fleet.n_readers);
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+  struct gengetopt_args_info args_info;
+  ykpiv_state *state;
+  ykpiv_rc rc;
+  int verbosity;
+  int ret = EXIT_SUCCESS;
+  bool authed = false;
+
+  if (setlocale(LC_ALL, "") == NULL) {
+    fprintf(stderr, "Warning, unable to reset locale\n");
+  }
+
+  if (argc < 2) {
+    fprintf(stderr, "No actions detected. Use '--help' or '-h' for command manpage\n");
+    return EXIT_FAILURE;
+  }
+
+  if(cmdline_parser(argc, argv, &args_info) != 0) {
+    return EXIT_FAILURE;
+  }
+
+  verbosity = args_info.verbose_arg ? args_info.verbose_arg : (int)args_info.verbose_given;
+
+  if(!check_actions(&args_info)) {
+    cmdline_parser_free(&args_info);
+    return EXIT_FAILURE;
+  }
+
+  /* openssl setup.. */
+#if (OPENSSL_VERSION_NUMBER < 0x10100000L)
+  OpenSSL_add_all_algorithms();
+#else
+  OPENSSL_init_crypto(OPENSSL_INIT_LOAD_CONFIG, 0);
+#endif
+
+  if(args_info.parallel_given) {
+    ret = run_fleet(&args_info, argv[0], verbosity);
+#if (OPENSSL_VERSION_NUMBER < 0x10100000L)
+    EVP_cleanup();
+#endif
+    cmdline_parser_free(&args_info);
+    return ret;
+  }
+
+  if((rc = ykpiv_init(&state, verbosity)) != YKPIV_OK) {
+    fprintf(stderr, "Failed initializing library: %s.\n", ykpiv_strerror(rc));
+    cmdline_parser_free(&args_info);
+    return EXIT_FAILURE;
+  }
+
+  if((rc = ykpiv_connect_ex(state, args_info.reader_arg, args_info.scp11_given)) != YKPIV_OK) {
+    fprintf(stderr, "Failed to connect to yubikey: %s.\n", ykpiv_strerror(rc));
+    if (rc == YKPIV_PCSC_SERVICE_ERROR) {
+      fprintf(stderr, "Try restarting the PCSC subsystem.\n");
+    } else if (rc == YKPIV_PCSC_ERROR) {
+      fprintf(stderr, "Try removing and reconnecting the device.\n");
+    }
+    ykpiv_done(state);
+    cmdline_parser_free(&args_info);
+    return EXIT_FAILURE;
+  }
+
+  batch_on_stdin = args_info.batch_given && strcmp(args_info.batch_arg, "-") == 0;
+
+  // Run multi-step flows (e.g. generate, request-certificate, import-certificate) without interruption
+  bool batch = args_info.batch_given || args_info.action_given > 1 || (args_info.action_given && args_info.sign_flag);
+  if(batch && (rc = ykpiv_begin_batch(state, ACTION_BATCH_HOLD_MS)) != YKPIV_OK) {
+    fprintf(stderr, "Failed to begin transaction: %s.\n", ykpiv_strerror(rc));
+    ykpiv_done(state);
+    cmdline_parser_free(&args_info);
+    return EXIT_FAILURE;
+  }
+
+  ret = run_actions(state, &args_info, &args_info, &authed, verbosity);
+
+  // Actions given on the command line run first, then the ones in the batch, all on the same connection
+  if(ret == EXIT_SUCCESS && args_info.batch_given) {
+    ret = run_batch(state, &args_info, argv[0], &authed, verbosity, 0);
+  }
+
+  if(batch) {
+    ykpiv_end_batch(state);
+  }
   ykpiv_done(state);
 #if (OPENSSL_VERSION_NUMBER < 0x10100000L)
   EVP_cleanup();
@@ -0,0 +1,473 @@
+/*
+ * Copyright (c) 2025 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "cache.h"
+#include "objects.h"
+#include "openssl_utils.h"
+#include "debug.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_ENV       "YKCS11_CACHE_DIR"
+#define SNAPSHOT_ENV    "YKCS11_FORK_SNAPSHOT"
+#define CACHE_MAGIC     "YKCS11C1"
+#define CACHE_MAX_BLOB  (YKPIV_OBJ_MAX_SIZE * 10)
+
+static CK_RV get_cache_path(ykcs11_slot_t *s, char *path, size_t len) {
+  const char *dir = getenv(CACHE_ENV);
+  char serial[sizeof(s->token_info.serialNumber) + 1] = {0};
+
+  if(dir == NULL || *dir == 0)
+    return CKR_FUNCTION_NOT_SUPPORTED;
+
+  // serialNumber is blank padded, and zero when the token doesn't expose a serial
+  for(size_t i = 0; i < sizeof(s->token_info.serialNumber) && s->token_info.serialNumber[i] != ' '; i++)
+    serial[i] = s->token_info.serialNumber[i];
+
+  if(*serial == 0 || !strcmp(serial, "0")) {
+    DBG("Token has no serial number, not using object cache");
+    return CKR_FUNCTION_NOT_SUPPORTED;
+  }
+
+  int actual = snprintf(path, len, "%s/ykcs11-%s-%u.%u.cache", dir, serial,
+                        s->token_info.firmwareVersion.major, s->token_info.firmwareVersion.minor);
+  if(actual < 0 || (size_t)actual >= len)
+    return CKR_BUFFER_TOO_SMALL;
+
+  return CKR_OK;
+}
+
+static CK_RV get_chuid(ykcs11_slot_t *s, CK_BYTE_PTR data, CK_ULONG_PTR len) {
+  unsigned long ulen = *len;
+  ykpiv_rc rc = ykpiv_fetch_object(s->piv_state, YKPIV_OBJ_CHUID, data, &ulen);
+  if(rc == YKPIV_GENERIC_ERROR) { // No CHUID on the token, use an empty value
+    *len = 0;
+    return CKR_OK;
+  }
+  if(rc != YKPIV_OK) {
+    DBG("Failed to fetch CHUID: %s", ykpiv_strerror(rc));
+    return CKR_DEVICE_ERROR;
+  }
+  *len = ulen;
+  return CKR_OK;
+}
+
+static CK_BBOOL write_blob(FILE *f, const CK_BYTE *data, CK_ULONG len) {
+  CK_BYTE hdr[4] = {(len >> 24) & 0xff, (len >> 16) & 0xff, (len >> 8) & 0xff, len & 0xff};
+  if(fwrite(hdr, 1, sizeof(hdr), f) != sizeof(hdr))
+    return CK_FALSE;
+  if(len && fwrite(data, 1, len, f) != len)
+    return CK_FALSE;
+  return CK_TRUE;
+}
+
+static CK_BBOOL read_blob(FILE *f, CK_BYTE_PTR data, CK_ULONG max, CK_ULONG_PTR len) {
+  CK_BYTE hdr[4] = {0};
+  if(fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr))
+    return CK_FALSE;
+  *len = ((CK_ULONG)hdr[0] << 24) | ((CK_ULONG)hdr[1] << 16) | ((CK_ULONG)hdr[2] << 8) | hdr[3];
+  if(*len > max)
+    return CK_FALSE;
+  if(*len && fread(data, 1, *len, f) != *len)
+    return CK_FALSE;
+  return CK_TRUE;
+}
+
+static void reset_slot(ykcs11_slot_t *s) {
+  for(size_t i = 0; i < sizeof(s->data) / sizeof(s->data[0]); i++) {
+    delete_data(s, i);
+  }
+  for(size_t i = 0; i < sizeof(s->certs) / sizeof(s->certs[0]); i++) {
+    delete_cert(s, i);
+  }
+  memset(s->origin, 0, sizeof(s->origin));
+  memset(s->pin_policy, 0, sizeof(s->pin_policy));
+  memset(s->touch_policy, 0, sizeof(s->touch_policy));
+  memset(s->objects, 0, sizeof(s->objects));
+  memset(s->loaded, 0, sizeof(s->loaded));
+  s->n_objects = 0;
+}
+
+// Reads what write_objects() wrote, the caller resets the slot on failure
+static CK_BBOOL read_objects(ykcs11_slot_t *s, FILE *f, CK_BYTE_PTR buf) {
+  CK_ULONG len;
+
+  if(!read_blob(f, buf, sizeof(s->objects), &len) || len % sizeof(piv_obj_id_t)) {
+    DBG("Invalid object list");
+    return CK_FALSE;
+  }
+
+  piv_obj_id_t *ids = (piv_obj_id_t *)buf;
+  for(CK_ULONG i = 0; i < len / sizeof(piv_obj_id_t); i++) {
+    if(ids[i] < PIV_DATA_OBJ_X509_PIV_AUTH || ids[i] >= PIV_SECRET_OBJ) {
+      DBG("Invalid object %u", ids[i]);
+      return CK_FALSE;
+    }
+    add_object(s, ids[i]);
+  }
+  sort_objects(s);
+
+  for(CK_BYTE sub_id = 1; sub_id < sizeof(s->data) / sizeof(s->data[0]); sub_id++) {
+    if(!read_blob(f, buf, CACHE_MAX_BLOB, &len))
+      return CK_FALSE;
+    if(len && store_data(s, sub_id, buf, len) != CKR_OK)
+      return CK_FALSE;
+  }
+
+  for(CK_BYTE sub_id = 1; sub_id < sizeof(s->certs) / sizeof(s->certs[0]); sub_id++) {
+    CK_BYTE policy[3] = {0};
+    if(fread(policy, 1, sizeof(policy), f) != sizeof(policy))
+      return CK_FALSE;
+    drop_attributes(s, sub_id);
+    s->origin[sub_id] = policy[0];
+    s->pin_policy[sub_id] = policy[1];
+    s->touch_policy[sub_id] = policy[2];
+    if(!read_blob(f, buf, CACHE_MAX_BLOB, &len))
+      return CK_FALSE;
+    if(len && do_store_cert(buf, len, &s->atst[sub_id]) != CKR_OK)
+      return CK_FALSE;
+    if(!read_blob(f, buf, CACHE_MAX_BLOB, &len))
+      return CK_FALSE;
+    if(len && do_store_raw_pubk(buf, len, &s->pkeys[sub_id]) != CKR_OK)
+      return CK_FALSE;
+    if(s->data[sub_id].len && is_present(s, find_cert_object(sub_id)) &&
+       do_store_cert(s->data[sub_id].data, s->data[sub_id].len, &s->certs[sub_id]) != CKR_OK)
+      return CK_FALSE;
+  }
+
+  memset(s->loaded, CK_TRUE, sizeof(s->loaded));
+  return CK_TRUE;
+}
+
+// Writes the objects of the slot, their data, key policies, attestations and public keys
+static CK_BBOOL write_objects(ykcs11_slot_t *s, FILE *f, CK_BYTE_PTR buf) {
+  CK_ULONG len;
+
+  // The ECDH secret object is never persisted
+  len = 0;
+  for(CK_ULONG i = 0; i < s->n_objects; i++) {
+    if(s->objects[i] != PIV_SECRET_OBJ)
+      ((piv_obj_id_t *)buf)[len++] = s->objects[i];
+  }
+  if(!write_blob(f, buf, len * sizeof(piv_obj_id_t)))
+    return CK_FALSE;
+
+  for(CK_BYTE sub_id = 1; sub_id < sizeof(s->data) / sizeof(s->data[0]); sub_id++) {
+    if(!write_blob(f, s->data[sub_id].data, s->data[sub_id].len))
+      return CK_FALSE;
+  }
+
+  for(CK_BYTE sub_id = 1; sub_id < sizeof(s->certs) / sizeof(s->certs[0]); sub_id++) {
+    CK_BYTE policy[3] = {s->origin[sub_id], s->pin_policy[sub_id], s->touch_policy[sub_id]};
+    if(fwrite(policy, 1, sizeof(policy), f) != sizeof(policy))
+      return CK_FALSE;
+    len = CACHE_MAX_BLOB;
+    if(s->atst[sub_id] == NULL)
+      len = 0;
+    else if(do_get_raw_cert(s->atst[sub_id], buf, &len) != CKR_OK)
+      return CK_FALSE;
+    if(!write_blob(f, buf, len))
+      return CK_FALSE;
+    len = CACHE_MAX_BLOB;
+    if(s->pkeys[sub_id] == NULL)
+      len = 0;
+    else if(do_get_raw_pubk(s->pkeys[sub_id], buf, &len) != CKR_OK)
+      return CK_FALSE;
+    if(!write_blob(f, buf, len))
+      return CK_FALSE;
+  }
+
+  return CK_TRUE;
+}
+
+CK_RV cache_load_slot(ykcs11_slot_t *s) {
+  char path[1024] = {0};
+  char magic[sizeof(CACHE_MAGIC) - 1] = {0};
+  CK_BYTE chuid[YKPIV_OBJ_MAX_SIZE] = {0};
+  CK_ULONG chuid_len = sizeof(chuid);
+  CK_BYTE_PTR buf = NULL;
+  CK_ULONG len;
+  CK_RV rv;
+  FILE *f = NULL;
+
+  if((rv = get_cache_path(s, path, sizeof(path))) != CKR_OK)
+    return rv;
+
+  if((f = fopen(path, "rb")) == NULL) {
+    DBG("No cached objects in %s", path);
+    return CKR_FUNCTION_FAILED;
+  }
+
+  if((buf = malloc(CACHE_MAX_BLOB)) == NULL) {
+    rv = CKR_HOST_MEMORY;
+    goto load_out;
+  }
+
+  rv = CKR_FUNCTION_FAILED;
+
+  if(fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, CACHE_MAGIC, sizeof(magic))) {
+    DBG("Invalid cache file %s", path);
+    goto load_out;
+  }
+
+  // Cheap staleness check, a re-provisioned or reset token gets a new (or no) CHUID
+  if((rv = get_chuid(s, chuid, &chuid_len)) != CKR_OK)
+    goto load_out;
+
+  rv = CKR_FUNCTION_FAILED;
+
+  if(!read_blob(f, buf, CACHE_MAX_BLOB, &len) || len != chuid_len || memcmp(buf, chuid, len)) {
+    DBG("Cache file %s is stale", path);
+    goto load_out;
+  }
+
+  if(!read_objects(s, f, buf)) {
+    DBG("Invalid cache file %s", path);
+    goto load_out;
+  }
+
+  DBG("Loaded %lu objects from cache file %s", s->n_objects, path);
+  rv = CKR_OK;
+
+load_out:
+  if(rv != CKR_OK)
+    reset_slot(s);
+  free(buf);
+  fclose(f);
+  return rv;
+}
+
+CK_RV cache_store_slot(ykcs11_slot_t *s) {
+  char path[1024] = {0};
+  char tmp[1100] = {0};
+  CK_BYTE chuid[YKPIV_OBJ_MAX_SIZE] = {0};
+  CK_ULONG chuid_len = sizeof(chuid);
+  CK_BYTE_PTR buf = NULL;
+  CK_RV rv;
+  FILE *f = NULL;
+
+  if((rv = get_cache_path(s, path, sizeof(path))) != CKR_OK)
+    return rv;
+
+  if((rv = get_chuid(s, chuid, &chuid_len)) != CKR_OK)
+    return rv;
+
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+
+#ifdef _WIN32
+  f = fopen(tmp, "wb");
+#else
+  // The cache only holds public objects, but keep it private to the user anyway
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if(fd >= 0 && (f = fdopen(fd, "wb")) == NULL)
+    close(fd);
+#endif
+  if(f == NULL) {
+    DBG("Failed to create cache file %s", tmp);
+    return CKR_FUNCTION_FAILED;
+  }
+
+  if((buf = malloc(CACHE_MAX_BLOB)) == NULL) {
+    rv = CKR_HOST_MEMORY;
+    goto store_out;
+  }
+
+  rv = CKR_FUNCTION_FAILED;
+
+  if(fwrite(CACHE_MAGIC, 1, sizeof(CACHE_MAGIC) - 1, f) != sizeof(CACHE_MAGIC) - 1)
+    goto store_out;
+
+  if(!write_blob(f, chuid, chuid_len))
+    goto store_out;
+
+  if(!write_objects(s, f, buf))
+    goto store_out;
+
+  rv = CKR_OK;
+
+store_out:
+  free(buf);
+  if(fclose(f) != 0)
+    rv = CKR_FUNCTION_FAILED;
+  if(rv == CKR_OK) {
+#ifdef _WIN32
+    remove(path);
+#endif
+    if(rename(tmp, path) != 0)
+      rv = CKR_FUNCTION_FAILED;
+  }
+  if(rv != CKR_OK) {
+    DBG("Failed to write cache file %s", path);
+    remove(tmp);
+  } else {
+    DBG("Stored %lu objects in cache file %s", s->n_objects, path);
+  }
+  return rv;
+}
+
+CK_RV cache_invalidate_slot(ykcs11_slot_t *s) {
+  char path[1024] = {0};
+  CK_RV rv;
+
+  cache_drop_snapshot(s);
+
+  if((rv = get_cache_path(s, path, sizeof(path))) != CKR_OK)
+    return rv;
+
+  if(remove(path) == 0)
+    DBG("Removed cache file %s", path);
+
+  return CKR_OK;
+}
+
+void cache_drop_snapshot(ykcs11_slot_t *s) {
+  free(s->snapshot);
+  s->snapshot = NULL;
+  s->snapshot_len = 0;
+}
+
+#ifdef _WIN32
+
+CK_RV cache_snapshot_slot(ykcs11_slot_t *s) {
+  (void)s;
+  return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV cache_adopt_snapshot(ykcs11_slot_t *s) {
+  (void)s;
+  return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+#else
+
+// The snapshot starts with the serial number and firmware version of the token it was taken of
+#define SNAPSHOT_HEADER_LEN (sizeof(((CK_TOKEN_INFO *)0)->serialNumber) + 2)
+
+CK_RV cache_snapshot_slot(ykcs11_slot_t *s) {
+  const char *env = getenv(SNAPSHOT_ENV);
+  CK_BYTE_PTR buf = NULL;
+  char *snapshot = NULL;
+  size_t snapshot_len = 0;
+  CK_RV rv = CKR_FUNCTION_FAILED;
+
+  if(env == NULL || !atoi(env))
+    return CKR_FUNCTION_NOT_SUPPORTED;
+
+  cache_drop_snapshot(s);
+
+  FILE *f = open_memstream(&snapshot, &snapshot_len);
+  if(f == NULL)
+    return CKR_HOST_MEMORY;
+
+  if((buf = malloc(CACHE_MAX_BLOB)) == NULL) {
+    rv = CKR_HOST_MEMORY;
+    goto snapshot_out;
+  }
+
+  CK_BYTE version[2] = {s->token_info.firmwareVersion.major, s->token_info.firmwareVersion.minor};
+  if(fwrite(s->token_info.serialNumber, 1, sizeof(s->token_info.serialNumber), f) != sizeof(s->token_info.serialNumber) ||
+     fwrite(version, 1, sizeof(version), f) != sizeof(version) || !write_objects(s, f, buf))
+    goto snapshot_out;
+
+  rv = CKR_OK;
+
+snapshot_out:
+  free(buf);
+  if(fclose(f) != 0)
+    rv = CKR_FUNCTION_FAILED;
+  if(rv == CKR_OK) {
+    s->snapshot = (CK_BYTE_PTR)snapshot;
+    s->snapshot_len = snapshot_len;
+    s->snapshot_pid = (uint64_t)getpid();
+    DBG("Took snapshot of %lu objects in %zu bytes", s->n_objects, snapshot_len);
+  } else {
+    DBG("Failed to take snapshot of objects");
+    free(snapshot);
+  }
+  return rv;
+}
+
+CK_RV cache_adopt_snapshot(ykcs11_slot_t *s) {
+  CK_BYTE_PTR buf = NULL;
+  CK_RV rv = CKR_FUNCTION_FAILED;
+
+  // Only forked children adopt the snapshot, the process that took it reads the token again
+  if(s->snapshot == NULL || s->snapshot_pid == (uint64_t)getpid())
+    return CKR_FUNCTION_NOT_SUPPORTED;
+
+  if(s->snapshot_len < SNAPSHOT_HEADER_LEN ||
+     memcmp(s->snapshot, s->token_info.serialNumber, sizeof(s->token_info.serialNumber)) ||
+     s->snapshot[sizeof(s->token_info.serialNumber)] != s->token_info.firmwareVersion.major ||
+     s->snapshot[sizeof(s->token_info.serialNumber) + 1] != s->token_info.firmwareVersion.minor) {
+    DBG("Snapshot was taken of another token");
+    cache_drop_snapshot(s);
+    return CKR_FUNCTION_FAILED;
+  }
+
+  FILE *f = fmemopen(s->snapshot + SNAPSHOT_HEADER_LEN, s->snapshot_len - SNAPSHOT_HEADER_LEN, "rb");
+  if(f == NULL)
+    return CKR_HOST_MEMORY;
+
+  if((buf = malloc(CACHE_MAX_BLOB)) == NULL) {
+    rv = CKR_HOST_MEMORY;
+    goto adopt_out;
+  }
+
+  if(!read_objects(s, f, buf)) {
+    DBG("Invalid snapshot");
+    goto adopt_out;
+  }
+
+  // Children of this process may adopt it in turn
+  s->snapshot_pid = (uint64_t)getpid();
+  DBG("Adopted snapshot of %lu objects", s->n_objects);
+  rv = CKR_OK;
+
+adopt_out:
+  if(rv != CKR_OK) {
+    reset_slot(s);
+    cache_drop_snapshot(s);
+  }
+  free(buf);
+  fclose(f);
+  return rv;
+}
+
+#endif
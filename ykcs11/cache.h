@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2025 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "ykcs11.h"
+
+// Persistent object cache, enabled by setting YKCS11_CACHE_DIR to an existing directory.
+// Entries are keyed by token serial and firmware version and validated against the CHUID.
+CK_RV cache_load_slot(ykcs11_slot_t *s);
+CK_RV cache_store_slot(ykcs11_slot_t *s);
+CK_RV cache_invalidate_slot(ykcs11_slot_t *s);
+
+// In-memory copy of the objects, enabled by setting YKCS11_FORK_SNAPSHOT. It is kept when the last session on the
+// slot closes, so that processes forked afterwards adopt it instead of reading the same objects from the token.
+CK_RV cache_snapshot_slot(ykcs11_slot_t *s);
+CK_RV cache_adopt_snapshot(ykcs11_slot_t *s);
+void cache_drop_snapshot(ykcs11_slot_t *s);
+
+#endif
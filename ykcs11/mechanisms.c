@@ -28,6 +28,7 @@
  *
  */
 
+#include <limits.h>
 #include <string.h>
 #include "mechanisms.h"
 #include "objects.h"
@@ -35,6 +36,7 @@
 #include "../common/util.h"
 #include "openssl_utils.h"
 #include "utils.h"
+#include "threads.h"
 #include "debug.h"
 
 // Supported mechanisms for key pair generation
@@ -263,7 +265,21 @@ CK_RV sign_mechanism_final(ykcs11_session_t *session, CK_BYTE_PTR sig, CK_ULONG_
   // Sign with PIV
   unsigned char sigbuf[512] = {0};
   size_t siglen = sizeof(sigbuf);
-  ykpiv_rc rcc = ykpiv_sign_data(session->slot->piv_state, session->op_info.buf, session->op_info.buf_len, sigbuf, &siglen, session->op_info.op.sign.algorithm, session->op_info.op.sign.piv_key);
+  ykpiv_rc rcc;
+  if(session->op_info.context_pin_len) {
+    int tries = 0;
+    rcc = ykpiv_sign_data_with_pin(session->slot->piv_state, (const char *)session->op_info.context_pin,
+                                   session->op_info.context_pin_len, session->op_info.buf, session->op_info.buf_len,
+                                   sigbuf, &siglen, session->op_info.op.sign.algorithm, session->op_info.op.sign.piv_key,
+                                   &tries);
+    OPENSSL_cleanse(session->op_info.context_pin, sizeof(session->op_info.context_pin));
+    session->op_info.context_pin_len = 0;
+    if(rcc == YKPIV_WRONG_PIN) {
+      DBG("Deferred context specific login failed, %d tries left", tries);
+    }
+  } else {
+    rcc = ykpiv_sign_data(session->slot->piv_state, session->op_info.buf, session->op_info.buf_len, sigbuf, &siglen, session->op_info.op.sign.algorithm, session->op_info.op.sign.piv_key);
+  }
   if(rcc == YKPIV_OK) {
     DBG("ykpiv_sign_data %lu bytes with key %x returned %zu bytes data", session->op_info.buf_len, session->op_info.op.sign.piv_key, siglen);
   } else {
@@ -293,13 +309,63 @@ CK_RV sign_mechanism_final(ykcs11_session_t *session, CK_BYTE_PTR sig, CK_ULONG_
   return rv;
 }
 
+CK_RV sign_mechanism_reset(ykcs11_session_t *session) {
+
+  // Re-use the digest context and key parameters set up by sign_mechanism_init for the next message
+  if(session->op_info.md_ctx) {
+    if(EVP_DigestInit_ex(session->op_info.md_ctx, EVP_MD_CTX_md(session->op_info.md_ctx), NULL) <= 0) {
+      DBG("EVP_DigestInit_ex failed");
+      return CKR_FUNCTION_FAILED;
+    }
+  }
+  session->op_info.buf_len = 0;
+  return CKR_OK;
+}
+
+// EdDSA needs the whole message at once, so its buffer grows instead of limiting the message size
+static CK_RV grow_op_buf(ykcs11_session_t *session, CK_ULONG len) {
+  CK_ULONG size = session->op_info.buf_size * 2;
+  if(size < len)
+    size = len;
+  CK_BYTE_PTR buf = malloc(size);
+  if(buf == NULL) {
+    DBG("Unable to allocate %lu byte operation buffer", size);
+    return CKR_HOST_MEMORY;
+  }
+  memcpy(buf, session->op_info.buf, session->op_info.buf_len);
+  OPENSSL_cleanse(session->op_info.buf, session->op_info.buf_size);
+  free(session->op_info.buf);
+  session->op_info.buf = buf;
+  session->op_info.buf_size = size;
+  return CKR_OK;
+}
+
+// Return to a regular sized buffer once the operation that needed a larger one is done
+static void shrink_op_buf(ykcs11_session_t *session) {
+  if(session->op_info.buf_size > YKCS11_OP_BUF_LEN) {
+    CK_BYTE_PTR buf = malloc(YKCS11_OP_BUF_LEN);
+    if(buf) {
+      OPENSSL_cleanse(session->op_info.buf, session->op_info.buf_size);
+      free(session->op_info.buf);
+      session->op_info.buf = buf;
+      session->op_info.buf_size = YKCS11_OP_BUF_LEN;
+    }
+  }
+}
+
 CK_RV sign_mechanism_cleanup(ykcs11_session_t *session) {
 
+  if (session->op_info.context_pin_len) {
+    OPENSSL_cleanse(session->op_info.context_pin, sizeof(session->op_info.context_pin));
+    session->op_info.context_pin_len = 0;
+  }
+
   if (session->op_info.md_ctx != NULL) {
     EVP_MD_CTX_destroy(session->op_info.md_ctx);
     session->op_info.md_ctx = NULL;
   }
   session->op_info.buf_len = 0;
+  shrink_op_buf(session);
   return CKR_OK;
 }
 
@@ -311,8 +377,18 @@ CK_RV verify_mechanism_cleanup(ykcs11_session_t *session) {
   } else if(session->op_info.op.verify.pkey_ctx != NULL) {
     EVP_PKEY_CTX_free(session->op_info.op.verify.pkey_ctx);
   }
+  if (session->op_info.op.verify.md_tmpl != NULL) {
+    EVP_MD_CTX_destroy(session->op_info.op.verify.md_tmpl);
+    session->op_info.op.verify.md_tmpl = NULL;
+  }
+  if (session->op_info.op.verify.key != NULL) {
+    EVP_PKEY_free(session->op_info.op.verify.key);
+    session->op_info.op.verify.key = NULL;
+  }
   session->op_info.op.verify.pkey_ctx = NULL;
+  session->op_info.op.verify.message = CK_FALSE;
   session->op_info.buf_len = 0;
+  shrink_op_buf(session);
   return CKR_OK;
 }
 
@@ -328,6 +404,9 @@ CK_RV verify_mechanism_init(ykcs11_session_t *session, ykcs11_pkey_t *key, CK_ME
   session->op_info.md_ctx = NULL;
   session->op_info.mechanism = mech->mechanism;
   session->op_info.op.verify.pkey_ctx = NULL;
+  session->op_info.op.verify.md_tmpl = NULL;
+  session->op_info.op.verify.message = CK_FALSE;
+  session->op_info.op.verify.key = NULL;
   bool is_eddsa = false;
 
   switch (session->op_info.mechanism) {
@@ -480,18 +559,23 @@ CK_RV verify_mechanism_init(ykcs11_session_t *session, ykcs11_pkey_t *key, CK_ME
     }
   }
 
+  // Keep the key around for operations that outlive a single verification
+  EVP_PKEY_up_ref(key);
+  session->op_info.op.verify.key = key;
+
   session->op_info.out_len = 0;
   session->op_info.buf_len = 0;
 
   return CKR_OK;
 }
 
-CK_RV verify_mechanism_final(ykcs11_session_t *session, CK_BYTE_PTR sig, CK_ULONG sig_len) {
+static CK_RV verify_final(CK_MECHANISM_TYPE mechanism, CK_ULONG padding, ykcs11_md_ctx_t *md_ctx, ykcs11_pkey_ctx_t *pkey_ctx,
+                          CK_BYTE_PTR data, CK_ULONG data_len, CK_BYTE_PTR sig, CK_ULONG sig_len) {
 
   int rc;
 #if (OPENSSL_VERSION_NUMBER >= 0x10100000L)
-  if (session->op_info.mechanism == CKM_EDDSA) {
-    rc = EVP_DigestVerify(session->op_info.md_ctx, sig, sig_len, session->op_info.buf, session->op_info.buf_len);
+  if (mechanism == CKM_EDDSA) {
+    rc = EVP_DigestVerify(md_ctx, sig, sig_len, data, data_len);
     if(rc <= 0) {
       DBG("EVP_PKEY_verify failed");
       return rc < 0 ? CKR_FUNCTION_FAILED : CKR_SIGNATURE_INVALID;
@@ -501,7 +585,7 @@ CK_RV verify_mechanism_final(ykcs11_session_t *session, CK_BYTE_PTR sig, CK_ULON
 #endif
 
   CK_BYTE der[1024] = {0};
-  if(!session->op_info.op.verify.padding) {
+  if(!padding) {
     if(sig_len > sizeof(der)) {
       DBG("do_apply_DER_encoding_to_ECSIG failed because signature was too large (%lu)", sig_len);
       return CKR_FUNCTION_FAILED;
@@ -516,14 +600,14 @@ CK_RV verify_mechanism_final(ykcs11_session_t *session, CK_BYTE_PTR sig, CK_ULON
     }
   }
 
-  if(session->op_info.md_ctx) {
-    rc = EVP_DigestVerifyFinal(session->op_info.md_ctx, sig, sig_len);
+  if(md_ctx) {
+    rc = EVP_DigestVerifyFinal(md_ctx, sig, sig_len);
     if(rc <= 0) {
       DBG("EVP_DigestVerifyFinal failed");
       return rc < 0 ? CKR_FUNCTION_FAILED : CKR_SIGNATURE_INVALID;
     }
   } else {
-    rc = EVP_PKEY_verify(session->op_info.op.verify.pkey_ctx, sig, sig_len, session->op_info.buf, session->op_info.buf_len);
+    rc = EVP_PKEY_verify(pkey_ctx, sig, sig_len, data, data_len);
     if(rc <= 0) {
       DBG("EVP_PKEY_verify failed");
       return rc < 0 ? CKR_FUNCTION_FAILED : CKR_SIGNATURE_INVALID;
@@ -533,6 +617,126 @@ CK_RV verify_mechanism_final(ykcs11_session_t *session, CK_BYTE_PTR sig, CK_ULON
   return CKR_OK;
 }
 
+CK_RV verify_mechanism_final(ykcs11_session_t *session, CK_BYTE_PTR sig, CK_ULONG sig_len) {
+  return verify_final(session->op_info.mechanism, session->op_info.op.verify.padding, session->op_info.md_ctx,
+                      session->op_info.op.verify.pkey_ctx, session->op_info.buf, session->op_info.buf_len, sig, sig_len);
+}
+
+CK_RV verify_mechanism_data(ykcs11_session_t *session, CK_BYTE_PTR data, CK_ULONG data_len, CK_BYTE_PTR sig, CK_ULONG sig_len) {
+
+  // Incremental digests still go through the digest context
+  if(session->op_info.md_ctx && session->op_info.mechanism != CKM_EDDSA) {
+    CK_RV rv = digest_mechanism_update(session, data, data_len);
+    if(rv != CKR_OK)
+      return rv;
+    return verify_mechanism_final(session, sig, sig_len);
+  }
+
+  // Raw and EdDSA verification take the whole message, straight from the caller
+  return verify_final(session->op_info.mechanism, session->op_info.op.verify.padding, session->op_info.md_ctx,
+                      session->op_info.op.verify.pkey_ctx, data, data_len, sig, sig_len);
+}
+
+// Set up the digest context of a message based verification for a new message
+static CK_RV verify_message_init(CK_MECHANISM_TYPE mechanism, ykcs11_md_ctx_t *md_ctx, ykcs11_md_ctx_t *md_tmpl, ykcs11_pkey_t *key) {
+  if (mechanism == CKM_EDDSA) {
+    if (EVP_DigestVerifyInit(md_ctx, NULL, NULL, NULL, key) <= 0) {
+      DBG("EVP_DigestVerifyInit failed");
+      return CKR_FUNCTION_FAILED;
+    }
+  } else if (EVP_MD_CTX_copy_ex(md_ctx, md_tmpl) <= 0) {
+    DBG("EVP_MD_CTX_copy_ex failed");
+    return CKR_FUNCTION_FAILED;
+  }
+  return CKR_OK;
+}
+
+CK_RV verify_mechanism_reset(ykcs11_session_t *session) {
+
+  session->op_info.buf_len = 0;
+
+  // The raw signature context holds no per-message state
+  if (session->op_info.md_ctx == NULL)
+    return CKR_OK;
+
+  // The first time round, keep the context set up by verify_mechanism_init as the template for every message
+  if (session->op_info.mechanism != CKM_EDDSA && session->op_info.op.verify.md_tmpl == NULL) {
+    ykcs11_md_ctx_t *md_ctx = EVP_MD_CTX_create();
+    if (md_ctx == NULL) {
+      DBG("EVP_MD_CTX_create failed");
+      return CKR_HOST_MEMORY;
+    }
+    session->op_info.op.verify.md_tmpl = session->op_info.md_ctx;
+    session->op_info.md_ctx = md_ctx;
+  }
+
+  return verify_message_init(session->op_info.mechanism, session->op_info.md_ctx,
+                             session->op_info.op.verify.md_tmpl, session->op_info.op.verify.key);
+}
+
+typedef struct {
+  ykcs11_session_t *session;
+  CK_ULONG         n;
+  CK_BYTE_PTR      *data;
+  CK_ULONG_PTR     data_len;
+  CK_BYTE_PTR      *sig;
+  CK_ULONG_PTR     sig_len;
+  CK_RV            *results;
+} verify_batch_t;
+
+static void verify_batch_worker(void *arg, size_t thread, size_t n_threads) {
+  verify_batch_t *batch = arg;
+  op_info_t *op_info = &batch->session->op_info;
+  ykcs11_md_ctx_t *md_ctx = NULL;
+  ykcs11_pkey_ctx_t *pkey_ctx = NULL;
+  CK_RV rv = CKR_OK;
+
+  // Every thread works on its own copy of the prepared contexts
+  if (op_info->md_ctx) {
+    if ((md_ctx = EVP_MD_CTX_create()) == NULL)
+      rv = CKR_HOST_MEMORY;
+  } else if ((pkey_ctx = EVP_PKEY_CTX_dup(op_info->op.verify.pkey_ctx)) == NULL) {
+    rv = CKR_HOST_MEMORY;
+  }
+
+  for (CK_ULONG i = thread; i < batch->n; i += n_threads) {
+    if (rv == CKR_OK && md_ctx) {
+      CK_RV rc = verify_message_init(op_info->mechanism, md_ctx, op_info->op.verify.md_tmpl, op_info->op.verify.key);
+      if (rc == CKR_OK && op_info->mechanism != CKM_EDDSA && EVP_DigestUpdate(md_ctx, batch->data[i], batch->data_len[i]) <= 0)
+        rc = CKR_FUNCTION_FAILED;
+      batch->results[i] = rc != CKR_OK ? rc : verify_final(op_info->mechanism, op_info->op.verify.padding, md_ctx, NULL,
+                                                          batch->data[i], batch->data_len[i], batch->sig[i], batch->sig_len[i]);
+    } else if (rv == CKR_OK) {
+      batch->results[i] = verify_final(op_info->mechanism, op_info->op.verify.padding, NULL, pkey_ctx,
+                                       batch->data[i], batch->data_len[i], batch->sig[i], batch->sig_len[i]);
+    } else {
+      batch->results[i] = rv;
+    }
+  }
+
+  EVP_MD_CTX_destroy(md_ctx);
+  EVP_PKEY_CTX_free(pkey_ctx);
+}
+
+CK_RV verify_mechanism_batch(ykcs11_session_t *session, CK_ULONG n, CK_BYTE_PTR *data, CK_ULONG_PTR data_len,
+                             CK_BYTE_PTR *sig, CK_ULONG_PTR sig_len, CK_RV *results, CK_ULONG n_threads) {
+
+  // Make sure the template digest context exists before the workers start copying it
+  CK_RV rv = verify_mechanism_reset(session);
+  if (rv != CKR_OK)
+    return rv;
+
+  if (n_threads > n)
+    n_threads = n;
+  if (n_threads == 0)
+    n_threads = 1;
+
+  verify_batch_t batch = {session, n, data, data_len, sig, sig_len, results};
+  DBG("Verifying %lu signatures using %lu threads", n, n_threads);
+  yc_run_shares(n_threads, verify_batch_worker, &batch);
+  return CKR_OK;
+}
+
 CK_RV check_generation_mechanism(CK_MECHANISM_PTR m) {
 
   CK_ULONG          i;
@@ -652,9 +856,15 @@ CK_RV digest_mechanism_update(ykcs11_session_t *session, CK_BYTE_PTR in, CK_ULON
       return CKR_FUNCTION_FAILED;
     }
   } else {
-    if(session->op_info.buf_len + in_len > sizeof(session->op_info.buf)) {
-      DBG("Too much data added to operation buffer, max is %zu bytes", sizeof(session->op_info.buf));
-      return CKR_DATA_LEN_RANGE;
+    if(session->op_info.buf_len + in_len > session->op_info.buf_size) {
+      // Other raw mechanisms take at most a key sized input
+      if(session->op_info.mechanism != CKM_EDDSA) {
+        DBG("Too much data added to operation buffer, max is %lu bytes", session->op_info.buf_size);
+        return CKR_DATA_LEN_RANGE;
+      }
+      CK_RV rv = grow_op_buf(session, session->op_info.buf_len + in_len);
+      if(rv != CKR_OK)
+        return rv;
     }
     memcpy(session->op_info.buf + session->op_info.buf_len, in, in_len);
     session->op_info.buf_len += in_len;
@@ -691,6 +901,8 @@ CK_RV decrypt_mechanism_init(ykcs11_session_t *session, ykcs11_pkey_t *key, CK_M
   session->op_info.mechanism = mech->mechanism;
   session->op_info.op.encrypt.algorithm = do_get_key_algorithm(key);
   session->op_info.op.encrypt.key = key;
+  session->op_info.op.encrypt.oaep_md = NULL;
+  session->op_info.op.encrypt.mgf1_md = NULL;
   session->op_info.op.encrypt.oaep_label = NULL;
   session->op_info.op.encrypt.oaep_label_len = 0;
 
@@ -728,6 +940,26 @@ CK_RV decrypt_mechanism_init(ykcs11_session_t *session, ykcs11_pkey_t *key, CK_M
   return CKR_OK;
 }
 
+CK_RV encrypt_mechanism_final(ykcs11_session_t *session, CK_BYTE_PTR data, CK_ULONG data_len, CK_BYTE_PTR enc, CK_ULONG_PTR enc_len) {
+  ykcs11_pkey_ctx_t *ctx;
+
+  CK_RV rv = get_enc_ctx(session->slot, session->op_info.op.encrypt.sub_id, session->op_info.op.encrypt.padding,
+                         session->op_info.op.encrypt.oaep_md, session->op_info.op.encrypt.mgf1_md,
+                         session->op_info.op.encrypt.oaep_label, session->op_info.op.encrypt.oaep_label_len, &ctx);
+  if (rv != CKR_OK) {
+    DBG("Unable to prepare encryption context");
+    return rv;
+  }
+
+  return do_rsa_encrypt(ctx, data, data_len, enc, enc_len);
+}
+
+CK_RV encrypt_mechanism_cleanup(ykcs11_session_t *session) {
+  free(session->op_info.op.encrypt.oaep_label);
+  session->op_info.op.encrypt.oaep_label = NULL;
+  return CKR_OK;
+}
+
 CK_RV decrypt_mechanism_final(ykcs11_session_t *session, CK_BYTE_PTR data, CK_ULONG_PTR data_len, CK_ULONG key_len) {
   ykpiv_rc piv_rv;
   CK_BYTE  dec[1024] = {0};
@@ -779,3 +1011,422 @@ CK_RV decrypt_mechanism_final(ykcs11_session_t *session, CK_BYTE_PTR data, CK_UL
   session->op_info.op.encrypt.oaep_label = NULL;
   return CKR_OK;
 }
+
+CK_RV check_secret_key_template(CK_ATTRIBUTE_PTR templ, CK_ULONG n, CK_ULONG_PTR value_len) {
+  CK_BBOOL key_type = CK_FALSE;
+
+  *value_len = 0;
+  for (CK_ULONG i = 0; i < n; i++) {
+    if (templ[i].pValue == NULL) {
+      DBG("Attribute %lx has no value", templ[i].type);
+      return CKR_ATTRIBUTE_VALUE_INVALID;
+    }
+    switch (templ[i].type) {
+      case CKA_CLASS:
+        if (templ[i].ulValueLen != sizeof(CK_OBJECT_CLASS) || *((CK_OBJECT_CLASS *) templ[i].pValue) != CKO_SECRET_KEY) {
+          DBG("Key class is unsupported");
+          return CKR_ATTRIBUTE_VALUE_INVALID;
+        }
+        break;
+
+      case CKA_KEY_TYPE:
+        if (templ[i].ulValueLen != sizeof(CK_KEY_TYPE) || *((CK_KEY_TYPE *) templ[i].pValue) != CKK_AES) {
+          DBG("Key type is unsupported");
+          return CKR_ATTRIBUTE_VALUE_INVALID;
+        }
+        key_type = CK_TRUE;
+        break;
+
+      case CKA_VALUE_LEN:
+        if (templ[i].ulValueLen != sizeof(CK_ULONG)) {
+          return CKR_ATTRIBUTE_VALUE_INVALID;
+        }
+        *value_len = *((CK_ULONG_PTR) templ[i].pValue);
+        break;
+
+      case CKA_TOKEN:
+        if (*((CK_BBOOL *) templ[i].pValue) != CK_FALSE) {
+          DBG("Secret key can only be a session object");
+          return CKR_ATTRIBUTE_VALUE_INVALID;
+        }
+        break;
+
+      case CKA_SENSITIVE:
+        if (*((CK_BBOOL *) templ[i].pValue) != CK_TRUE) {
+          DBG("Secret key is always sensitive");
+          return CKR_ATTRIBUTE_VALUE_INVALID;
+        }
+        break;
+
+      case CKA_EXTRACTABLE:
+        if (*((CK_BBOOL *) templ[i].pValue) != CK_FALSE) {
+          DBG("Secret key can't be extracted");
+          return CKR_ATTRIBUTE_VALUE_INVALID;
+        }
+        break;
+
+      default:
+        DBG("Secret key template contains the ignored attribute: %lx", templ[i].type);
+        break;
+    }
+  }
+
+  if (!key_type) {
+    DBG("Key type not specified");
+    return CKR_TEMPLATE_INCOMPLETE;
+  }
+
+  return CKR_OK;
+}
+
+CK_BBOOL is_cipher_mechanism(CK_MECHANISM_TYPE m) {
+  return m == CKM_AES_GCM || m == CKM_AES_CBC_PAD;
+}
+
+static const EVP_CIPHER *get_aes_cipher(CK_MECHANISM_TYPE m, CK_ULONG key_len) {
+  switch (key_len) {
+    case 16:
+      return m == CKM_AES_GCM ? EVP_aes_128_gcm() : EVP_aes_128_cbc();
+    case 24:
+      return m == CKM_AES_GCM ? EVP_aes_192_gcm() : EVP_aes_192_cbc();
+    case 32:
+      return m == CKM_AES_GCM ? EVP_aes_256_gcm() : EVP_aes_256_cbc();
+    default:
+      return NULL;
+  }
+}
+
+// Sets up the cipher with the key, the IV is set for each message
+static CK_RV cipher_setup(ykcs11_session_t *session, const ykcs11_secret_t *key, CK_MECHANISM_TYPE m, CK_BBOOL encrypt) {
+  if (key->type != CKK_AES) {
+    DBG("Mechanism %lu requires an AES key", m);
+    return CKR_KEY_TYPE_INCONSISTENT;
+  }
+
+  const EVP_CIPHER *cipher = get_aes_cipher(m, key->len);
+  if (cipher == NULL) {
+    DBG("Unsupported AES key length %lu", key->len);
+    return CKR_KEY_SIZE_RANGE;
+  }
+
+  ykcs11_cipher_ctx_t *ctx = EVP_CIPHER_CTX_new();
+  if (ctx == NULL) {
+    DBG("Unable to allocate cipher context");
+    return CKR_HOST_MEMORY;
+  }
+
+  if (EVP_CipherInit_ex(ctx, cipher, NULL, key->value, NULL, encrypt) != 1) {
+    DBG("Unable to initialize cipher");
+    EVP_CIPHER_CTX_free(ctx);
+    return CKR_FUNCTION_FAILED;
+  }
+
+  session->op_info.mechanism = m;
+  session->op_info.op.cipher.ctx = ctx;
+  session->op_info.op.cipher.encrypt = encrypt;
+  session->op_info.op.cipher.tag_len = 0;
+  session->op_info.buf_len = 0;
+  return CKR_OK;
+}
+
+static CK_BBOOL check_tag_bits(CK_ULONG tag_bits) {
+  return tag_bits >= 32 && tag_bits <= 128 && tag_bits % 8 == 0;
+}
+
+CK_RV cipher_mechanism_init(ykcs11_session_t *session, const ykcs11_secret_t *key, CK_MECHANISM_PTR mech, CK_BBOOL encrypt) {
+  CK_GCM_PARAMS *gcm = mech->pParameter;
+  int len;
+  CK_RV rv;
+
+  switch (mech->mechanism) {
+  case CKM_AES_CBC_PAD:
+    if (mech->pParameter == NULL || mech->ulParameterLen != 16) {
+      DBG("CBC needs a 16 byte IV");
+      return CKR_MECHANISM_PARAM_INVALID;
+    }
+    break;
+  case CKM_AES_GCM:
+    if (gcm == NULL || mech->ulParameterLen != sizeof(CK_GCM_PARAMS) || gcm->pIv == NULL || gcm->ulIvLen == 0 ||
+        gcm->ulIvLen > INT_MAX || gcm->ulAADLen > INT_MAX || (gcm->ulAADLen && gcm->pAAD == NULL) ||
+        !check_tag_bits(gcm->ulTagBits)) {
+      DBG("GCM params invalid");
+      return CKR_MECHANISM_PARAM_INVALID;
+    }
+    break;
+  default:
+    DBG("Unsupported mechanism");
+    return CKR_MECHANISM_INVALID;
+  }
+
+  if ((rv = cipher_setup(session, key, mech->mechanism, encrypt)) != CKR_OK) {
+    return rv;
+  }
+
+  ykcs11_cipher_ctx_t *ctx = session->op_info.op.cipher.ctx;
+  if (mech->mechanism == CKM_AES_CBC_PAD) {
+    if (EVP_CipherInit_ex(ctx, NULL, NULL, NULL, mech->pParameter, -1) != 1) {
+      DBG("Unable to set IV");
+      cipher_mechanism_cleanup(session);
+      return CKR_FUNCTION_FAILED;
+    }
+  } else {
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, (int)gcm->ulIvLen, NULL) != 1 ||
+        EVP_CipherInit_ex(ctx, NULL, NULL, NULL, gcm->pIv, -1) != 1 ||
+        (gcm->ulAADLen && EVP_CipherUpdate(ctx, NULL, &len, gcm->pAAD, (int)gcm->ulAADLen) != 1)) {
+      DBG("Unable to set IV or AAD");
+      cipher_mechanism_cleanup(session);
+      return CKR_MECHANISM_PARAM_INVALID;
+    }
+    session->op_info.op.cipher.tag_len = gcm->ulTagBits / 8;
+  }
+
+  return CKR_OK;
+}
+
+// Decrypts and checks the tag, the plaintext is cleared again if it doesn't match
+static CK_RV gcm_open(ykcs11_cipher_ctx_t *ctx, CK_BYTE_PTR in, CK_ULONG in_len, CK_BYTE_PTR tag, CK_ULONG tag_len,
+                      CK_BYTE_PTR out, CK_ULONG_PTR out_len) {
+  int len = 0, fin = 0;
+
+  if (in_len > INT_MAX) {
+    return CKR_ENCRYPTED_DATA_LEN_RANGE;
+  }
+
+  if (EVP_CipherUpdate(ctx, out, &len, in, (int)in_len) != 1 ||
+      EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, (int)tag_len, tag) != 1) {
+    DBG("GCM decryption failed");
+    return CKR_FUNCTION_FAILED;
+  }
+
+  if (EVP_CipherFinal_ex(ctx, out + len, &fin) != 1) {
+    DBG("GCM tag doesn't match");
+    OPENSSL_cleanse(out, in_len);
+    *out_len = 0;
+    return CKR_ENCRYPTED_DATA_INVALID;
+  }
+
+  *out_len = len + fin;
+  return CKR_OK;
+}
+
+CK_RV cipher_mechanism_data(ykcs11_session_t *session, CK_BYTE_PTR in, CK_ULONG in_len, CK_BYTE_PTR out, CK_ULONG_PTR out_len) {
+  cipher_info_t *c = &session->op_info.op.cipher;
+  CK_ULONG bound;
+  int len = 0, fin = 0;
+
+  if (c->encrypt) {
+    bound = c->tag_len ? in_len + c->tag_len : (in_len / 16 + 1) * 16;
+  } else if (c->tag_len) {
+    if (in_len < c->tag_len) {
+      DBG("Encrypted data is shorter than the tag");
+      return CKR_ENCRYPTED_DATA_LEN_RANGE;
+    }
+    bound = in_len - c->tag_len;
+  } else {
+    bound = in_len;
+  }
+
+  if (out == NULL) {
+    *out_len = bound;
+    return CKR_OK;
+  }
+
+  if (*out_len < bound) {
+    DBG("Buffer too small, %lu bytes needed", bound);
+    *out_len = bound;
+    return CKR_BUFFER_TOO_SMALL;
+  }
+
+  if (!c->encrypt && c->tag_len) {
+    return gcm_open(c->ctx, in, in_len - c->tag_len, in + in_len - c->tag_len, c->tag_len, out, out_len);
+  }
+
+  if (in_len > INT_MAX) {
+    return CKR_DATA_LEN_RANGE;
+  }
+
+  if (EVP_CipherUpdate(c->ctx, out, &len, in, (int)in_len) != 1) {
+    DBG("Cipher update failed");
+    return CKR_FUNCTION_FAILED;
+  }
+
+  if (EVP_CipherFinal_ex(c->ctx, out + len, &fin) != 1) {
+    DBG("Cipher final failed");
+    return c->encrypt ? CKR_FUNCTION_FAILED : CKR_ENCRYPTED_DATA_INVALID;
+  }
+
+  if (c->tag_len && EVP_CIPHER_CTX_ctrl(c->ctx, EVP_CTRL_GCM_GET_TAG, (int)c->tag_len, out + len + fin) != 1) {
+    DBG("Unable to get GCM tag");
+    return CKR_FUNCTION_FAILED;
+  }
+
+  *out_len = len + fin + c->tag_len;
+  return CKR_OK;
+}
+
+CK_RV cipher_mechanism_update(ykcs11_session_t *session, CK_BYTE_PTR in, CK_ULONG in_len, CK_BYTE_PTR out, CK_ULONG_PTR out_len) {
+  cipher_info_t *c = &session->op_info.op.cipher;
+  CK_RV rv;
+  int len = 0;
+
+  // GCM decryption only returns plaintext from cipher_mechanism_final, once the tag has been checked
+  if (!c->encrypt && c->tag_len) {
+    CK_ULONG buf_len = session->op_info.buf_len + in_len;
+    if (buf_len > session->op_info.buf_size && (rv = grow_op_buf(session, buf_len)) != CKR_OK) {
+      return rv;
+    }
+    memcpy(session->op_info.buf + session->op_info.buf_len, in, in_len);
+    session->op_info.buf_len = buf_len;
+    *out_len = 0;
+    return CKR_OK;
+  }
+
+  // CBC may return a block held back from the previous part
+  CK_ULONG bound = c->tag_len ? in_len : in_len + 16;
+
+  if (out == NULL) {
+    *out_len = bound;
+    return CKR_OK;
+  }
+
+  if (*out_len < bound) {
+    DBG("Buffer too small, %lu bytes needed", bound);
+    *out_len = bound;
+    return CKR_BUFFER_TOO_SMALL;
+  }
+
+  if (in_len > INT_MAX) {
+    return CKR_DATA_LEN_RANGE;
+  }
+
+  if (EVP_CipherUpdate(c->ctx, out, &len, in, (int)in_len) != 1) {
+    DBG("Cipher update failed");
+    return CKR_FUNCTION_FAILED;
+  }
+
+  *out_len = len;
+  return CKR_OK;
+}
+
+CK_RV cipher_mechanism_final(ykcs11_session_t *session, CK_BYTE_PTR out, CK_ULONG_PTR out_len) {
+  cipher_info_t *c = &session->op_info.op.cipher;
+  int len = 0;
+
+  if (!c->encrypt && c->tag_len) {
+    return cipher_mechanism_data(session, session->op_info.buf, session->op_info.buf_len, out, out_len);
+  }
+
+  CK_ULONG bound = c->tag_len ? c->tag_len : 16;
+
+  if (out == NULL) {
+    *out_len = bound;
+    return CKR_OK;
+  }
+
+  if (*out_len < bound) {
+    DBG("Buffer too small, %lu bytes needed", bound);
+    *out_len = bound;
+    return CKR_BUFFER_TOO_SMALL;
+  }
+
+  if (EVP_CipherFinal_ex(c->ctx, out, &len) != 1) {
+    DBG("Cipher final failed");
+    return c->encrypt ? CKR_FUNCTION_FAILED : CKR_ENCRYPTED_DATA_INVALID;
+  }
+
+  if (c->tag_len && EVP_CIPHER_CTX_ctrl(c->ctx, EVP_CTRL_GCM_GET_TAG, (int)c->tag_len, out + len) != 1) {
+    DBG("Unable to get GCM tag");
+    return CKR_FUNCTION_FAILED;
+  }
+
+  *out_len = len + c->tag_len;
+  return CKR_OK;
+}
+
+CK_RV cipher_message_init(ykcs11_session_t *session, const ykcs11_secret_t *key, CK_MECHANISM_PTR mech, CK_BBOOL encrypt) {
+  // The IV and tag are given for each message
+  if (mech->mechanism != CKM_AES_GCM) {
+    DBG("Unsupported mechanism");
+    return CKR_MECHANISM_INVALID;
+  }
+
+  return cipher_setup(session, key, mech->mechanism, encrypt);
+}
+
+CK_RV cipher_message_data(ykcs11_session_t *session, CK_VOID_PTR param, CK_ULONG param_len, CK_BYTE_PTR aad, CK_ULONG aad_len,
+                          CK_BYTE_PTR in, CK_ULONG in_len, CK_BYTE_PTR out, CK_ULONG_PTR out_len) {
+  cipher_info_t *c = &session->op_info.op.cipher;
+  CK_GCM_MESSAGE_PARAMS *gcm = param;
+  int len = 0, fin = 0;
+
+  if (gcm == NULL || param_len != sizeof(CK_GCM_MESSAGE_PARAMS) || gcm->pIv == NULL || gcm->ulIvLen == 0 ||
+      gcm->ulIvLen > INT_MAX || gcm->pTag == NULL || !check_tag_bits(gcm->ulTagBits) ||
+      aad_len > INT_MAX || (aad_len && aad == NULL)) {
+    DBG("GCM message params invalid");
+    return CKR_MECHANISM_PARAM_INVALID;
+  }
+
+  if (out == NULL) {
+    *out_len = in_len;
+    return CKR_OK;
+  }
+
+  if (*out_len < in_len) {
+    DBG("Buffer too small, %lu bytes needed", in_len);
+    *out_len = in_len;
+    return CKR_BUFFER_TOO_SMALL;
+  }
+
+  if (in_len > INT_MAX) {
+    return CKR_DATA_LEN_RANGE;
+  }
+
+  if (c->encrypt) {
+    if (gcm->ivGenerator == CKG_GENERATE_RANDOM) {
+      CK_ULONG fixed = gcm->ulIvFixedBits / 8;
+      if (gcm->ulIvFixedBits % 8 || fixed > gcm->ulIvLen) {
+        DBG("Fixed IV bits invalid");
+        return CKR_MECHANISM_PARAM_INVALID;
+      }
+      if (fixed < gcm->ulIvLen && RAND_bytes(gcm->pIv + fixed, (int)(gcm->ulIvLen - fixed)) != 1) {
+        DBG("Unable to generate IV");
+        return CKR_FUNCTION_FAILED;
+      }
+    } else if (gcm->ivGenerator != CKG_NO_GENERATE) {
+      DBG("Unsupported IV generator %lu", gcm->ivGenerator);
+      return CKR_MECHANISM_PARAM_INVALID;
+    }
+  }
+
+  if (EVP_CIPHER_CTX_ctrl(c->ctx, EVP_CTRL_GCM_SET_IVLEN, (int)gcm->ulIvLen, NULL) != 1 ||
+      EVP_CipherInit_ex(c->ctx, NULL, NULL, NULL, gcm->pIv, -1) != 1 ||
+      (aad_len && EVP_CipherUpdate(c->ctx, NULL, &len, aad, (int)aad_len) != 1)) {
+    DBG("Unable to set IV or AAD");
+    return CKR_FUNCTION_FAILED;
+  }
+
+  if (!c->encrypt) {
+    return gcm_open(c->ctx, in, in_len, gcm->pTag, gcm->ulTagBits / 8, out, out_len);
+  }
+
+  if (EVP_CipherUpdate(c->ctx, out, &len, in, (int)in_len) != 1 ||
+      EVP_CipherFinal_ex(c->ctx, out + len, &fin) != 1 ||
+      EVP_CIPHER_CTX_ctrl(c->ctx, EVP_CTRL_GCM_GET_TAG, (int)(gcm->ulTagBits / 8), gcm->pTag) != 1) {
+    DBG("GCM encryption failed");
+    return CKR_FUNCTION_FAILED;
+  }
+
+  *out_len = len + fin;
+  return CKR_OK;
+}
+
+CK_RV cipher_mechanism_cleanup(ykcs11_session_t *session) {
+  EVP_CIPHER_CTX_free(session->op_info.op.cipher.ctx);
+  session->op_info.op.cipher.ctx = NULL;
+  if (session->op_info.buf_len) {
+    OPENSSL_cleanse(session->op_info.buf, session->op_info.buf_len);
+  }
+  session->op_info.buf_len = 0;
+  shrink_op_buf(session);
+  return CKR_OK;
+}
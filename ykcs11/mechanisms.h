@@ -35,10 +35,15 @@
 
 CK_RV sign_mechanism_init(ykcs11_session_t *session, ykcs11_pkey_t *key, CK_MECHANISM_PTR mech);
 CK_RV sign_mechanism_final(ykcs11_session_t *session, CK_BYTE_PTR sig, CK_ULONG_PTR sig_len);
+CK_RV sign_mechanism_reset(ykcs11_session_t *session);
 CK_RV sign_mechanism_cleanup(ykcs11_session_t *session);
 
 CK_RV verify_mechanism_init(ykcs11_session_t *session, ykcs11_pkey_t *key, CK_MECHANISM_PTR mech);
 CK_RV verify_mechanism_final(ykcs11_session_t *session, CK_BYTE_PTR sig, CK_ULONG sig_len);
+CK_RV verify_mechanism_data(ykcs11_session_t *session, CK_BYTE_PTR data, CK_ULONG data_len, CK_BYTE_PTR sig, CK_ULONG sig_len);
+CK_RV verify_mechanism_reset(ykcs11_session_t *session);
+CK_RV verify_mechanism_batch(ykcs11_session_t *session, CK_ULONG n, CK_BYTE_PTR *data, CK_ULONG_PTR data_len,
+                             CK_BYTE_PTR *sig, CK_ULONG_PTR sig_len, CK_RV *results, CK_ULONG n_threads);
 CK_RV verify_mechanism_cleanup(ykcs11_session_t *session);
 
 CK_RV check_generation_mechanism(CK_MECHANISM_PTR m);
@@ -48,7 +53,22 @@ CK_RV digest_mechanism_init(ykcs11_session_t *session, CK_MECHANISM_PTR mech);
 CK_RV digest_mechanism_update(ykcs11_session_t *session, CK_BYTE_PTR in, CK_ULONG in_len);
 CK_RV digest_mechanism_final(ykcs11_session_t *session, CK_BYTE_PTR pDigest, CK_ULONG_PTR pDigestLength);
 
+CK_RV encrypt_mechanism_final(ykcs11_session_t *session, CK_BYTE_PTR data, CK_ULONG data_len, CK_BYTE_PTR enc, CK_ULONG_PTR enc_len);
+CK_RV encrypt_mechanism_cleanup(ykcs11_session_t *session);
+
 CK_RV decrypt_mechanism_init(ykcs11_session_t *session, ykcs11_pkey_t *key, CK_MECHANISM_PTR mech);
 CK_RV decrypt_mechanism_final(ykcs11_session_t *session, CK_BYTE_PTR dec, CK_ULONG_PTR dec_len, CK_ULONG key_len);
 
+CK_RV check_secret_key_template(CK_ATTRIBUTE_PTR templ, CK_ULONG n, CK_ULONG_PTR value_len);
+
+CK_BBOOL is_cipher_mechanism(CK_MECHANISM_TYPE m);
+CK_RV cipher_mechanism_init(ykcs11_session_t *session, const ykcs11_secret_t *key, CK_MECHANISM_PTR mech, CK_BBOOL encrypt);
+CK_RV cipher_mechanism_data(ykcs11_session_t *session, CK_BYTE_PTR in, CK_ULONG in_len, CK_BYTE_PTR out, CK_ULONG_PTR out_len);
+CK_RV cipher_mechanism_update(ykcs11_session_t *session, CK_BYTE_PTR in, CK_ULONG in_len, CK_BYTE_PTR out, CK_ULONG_PTR out_len);
+CK_RV cipher_mechanism_final(ykcs11_session_t *session, CK_BYTE_PTR out, CK_ULONG_PTR out_len);
+CK_RV cipher_message_init(ykcs11_session_t *session, const ykcs11_secret_t *key, CK_MECHANISM_PTR mech, CK_BBOOL encrypt);
+CK_RV cipher_message_data(ykcs11_session_t *session, CK_VOID_PTR param, CK_ULONG param_len, CK_BYTE_PTR aad, CK_ULONG aad_len,
+                          CK_BYTE_PTR in, CK_ULONG in_len, CK_BYTE_PTR out, CK_ULONG_PTR out_len);
+CK_RV cipher_mechanism_cleanup(ykcs11_session_t *session);
+
 #endif
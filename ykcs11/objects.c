@@ -402,10 +402,107 @@ static CK_RV get_doa(ykcs11_slot_t *s, piv_obj_id_t obj, CK_ATTRIBUTE_PTR templa
   return CKR_OK;
 }
 
+enum {
+  CERT_ATTR_VALUE,
+  CERT_ATTR_SUBJECT,
+  CERT_ATTR_ISSUER,
+  CERT_ATTR_SERIAL_NUMBER
+};
+
+enum {
+  PKEY_ATTR_MODULUS,
+  PKEY_ATTR_PUBLIC_EXPONENT,
+  PKEY_ATTR_EC_POINT,
+  PKEY_ATTR_EC_PARAMS
+};
+
+static void clear_attr_cache(ykcs11_attr_cache_t *c) {
+  free(c->data);
+  memset(c, 0, sizeof(*c));
+}
+
+/* Encode all cached attributes of a certificate or public key into one buffer */
+static CK_RV fill_attr_cache(ykcs11_attr_cache_t *c, ykcs11_x509_t *cert, ykcs11_pkey_t *key) {
+  CK_BYTE_PTR buf = malloc(YKCS11_ATTR_CACHE_LEN * YKPIV_OBJ_MAX_SIZE);
+  if (buf == NULL)
+    return CKR_HOST_MEMORY;
+
+  CK_ULONG offset = 0;
+  for (CK_ULONG i = 0; i < YKCS11_ATTR_CACHE_LEN; i++) {
+    CK_BYTE_PTR p = buf + offset;
+    c->len[i] = YKPIV_OBJ_MAX_SIZE;
+    if (cert) {
+      switch (i) {
+      case CERT_ATTR_VALUE:
+        c->rv[i] = do_get_raw_cert(cert, p, &c->len[i]);
+        break;
+      case CERT_ATTR_SUBJECT:
+        c->rv[i] = do_get_raw_name(X509_get_subject_name(cert), p, &c->len[i]);
+        break;
+      case CERT_ATTR_ISSUER:
+        c->rv[i] = do_get_raw_name(X509_get_issuer_name(cert), p, &c->len[i]);
+        break;
+      case CERT_ATTR_SERIAL_NUMBER:
+        c->rv[i] = do_get_raw_integer(X509_get_serialNumber(cert), p, &c->len[i]);
+        break;
+      }
+    } else {
+      switch (i) {
+      case PKEY_ATTR_MODULUS:
+        c->len[i] = do_get_key_size(key);
+        c->rv[i] = c->len[i] > YKPIV_OBJ_MAX_SIZE ? CKR_DATA_LEN_RANGE : do_get_modulus(key, p, c->len[i]);
+        break;
+      case PKEY_ATTR_PUBLIC_EXPONENT:
+        c->rv[i] = do_get_public_exponent(key, p, &c->len[i]);
+        break;
+      case PKEY_ATTR_EC_POINT:
+        c->rv[i] = do_get_public_key(key, p, &c->len[i]);
+        break;
+      case PKEY_ATTR_EC_PARAMS:
+        c->rv[i] = do_get_key_type(key) == CKK_EC ? do_get_curve_parameters(key, p, &c->len[i]) : CKR_ATTRIBUTE_TYPE_INVALID;
+        break;
+      }
+    }
+    if (c->rv[i] != CKR_OK)
+      c->len[i] = 0;
+    offset += c->len[i];
+  }
+
+  // Keep only what is used
+  CK_BYTE_PTR tmp = realloc(buf, offset + 1);
+  c->data = tmp ? tmp : buf;
+  return CKR_OK;
+}
+
+static CK_RV get_cached_attr(ykcs11_attr_cache_t *c, ykcs11_x509_t *cert, ykcs11_pkey_t *key,
+                             CK_ULONG i, CK_BYTE_PTR *data, CK_ULONG_PTR len) {
+  CK_RV rv;
+
+  if (c->data == NULL && (rv = fill_attr_cache(c, cert, key)) != CKR_OK)
+    return rv;
+
+  if (c->rv[i] != CKR_OK)
+    return c->rv[i];
+
+  *data = c->data;
+  for (CK_ULONG j = 0; j < i; j++)
+    *data += c->len[j];
+  *len = c->len[i];
+  return CKR_OK;
+}
+
+static CK_RV get_cert_attr(ykcs11_attr_cache_t *c, ykcs11_x509_t *cert, CK_ULONG i, CK_BYTE_PTR *data, CK_ULONG_PTR len) {
+  return cert ? get_cached_attr(c, cert, NULL, i, data, len) : CKR_FUNCTION_FAILED;
+}
+
+static CK_RV get_pkey_attr(ykcs11_attr_cache_t *c, ykcs11_pkey_t *key, CK_ULONG i, CK_BYTE_PTR *data, CK_ULONG_PTR len) {
+  return key ? get_cached_attr(c, NULL, key, i, data, len) : CKR_FUNCTION_FAILED;
+}
+
 /* Get certificate object attribute */
-static CK_RV _get_coa(ykcs11_x509_t **certs, piv_obj_id_t obj, CK_ATTRIBUTE_PTR template, CK_BBOOL token) {
+static CK_RV _get_coa(ykcs11_x509_t **certs, ykcs11_attr_cache_t *attrs, piv_obj_id_t obj, CK_ATTRIBUTE_PTR template, CK_BBOOL token) {
   CK_BYTE_PTR data;
-  CK_BYTE     b_tmp[YKPIV_OBJ_MAX_SIZE] = {0}; // Max cert value for ykpiv
+  CK_BYTE     b_tmp[1] = {0};
   CK_ULONG    ul_tmp;
   CK_ULONG    len = 0;
   CK_RV       rv;
@@ -441,34 +538,26 @@ static CK_RV _get_coa(ykcs11_x509_t **certs, piv_obj_id_t obj, CK_ATTRIBUTE_PTR
 
   case CKA_SUBJECT:
     DBG("SUBJECT");
-    len = sizeof(b_tmp);
-    if ((rv = do_get_raw_name(X509_get_subject_name(certs[piv_objects[obj].sub_id]), b_tmp, &len)) != CKR_OK)
+    if ((rv = get_cert_attr(&attrs[piv_objects[obj].sub_id], certs[piv_objects[obj].sub_id], CERT_ATTR_SUBJECT, &data, &len)) != CKR_OK)
       return rv;
-    data = b_tmp;
     break;
 
   case CKA_ISSUER:
     DBG("ISSUER");
-    len = sizeof(b_tmp);
-    if ((rv = do_get_raw_name(X509_get_issuer_name(certs[piv_objects[obj].sub_id]), b_tmp, &len)) != CKR_OK)
+    if ((rv = get_cert_attr(&attrs[piv_objects[obj].sub_id], certs[piv_objects[obj].sub_id], CERT_ATTR_ISSUER, &data, &len)) != CKR_OK)
       return rv;
-    data = b_tmp;
     break;
 
   case CKA_SERIAL_NUMBER:
     DBG("SERIAL_NUMBER");
-    len = sizeof(b_tmp);
-    if ((rv = do_get_raw_integer(X509_get_serialNumber(certs[piv_objects[obj].sub_id]), b_tmp, &len)) != CKR_OK)
+    if ((rv = get_cert_attr(&attrs[piv_objects[obj].sub_id], certs[piv_objects[obj].sub_id], CERT_ATTR_SERIAL_NUMBER, &data, &len)) != CKR_OK)
       return rv;
-    data = b_tmp;
     break;
 
   case CKA_VALUE:
     DBG("VALUE");
-    len = sizeof(b_tmp);
-    if ((rv = do_get_raw_cert(certs[piv_objects[obj].sub_id], b_tmp, &len)) != CKR_OK)
+    if ((rv = get_cert_attr(&attrs[piv_objects[obj].sub_id], certs[piv_objects[obj].sub_id], CERT_ATTR_VALUE, &data, &len)) != CKR_OK)
       return rv;
-    data = b_tmp;
     break;
 
   case CKA_CERTIFICATE_TYPE:
@@ -535,17 +624,17 @@ static CK_RV _get_coa(ykcs11_x509_t **certs, piv_obj_id_t obj, CK_ATTRIBUTE_PTR
 }
 
 static CK_RV get_coa(ykcs11_slot_t *s, piv_obj_id_t obj, CK_ATTRIBUTE_PTR template) {
-  return _get_coa(s->certs, obj, template, CK_TRUE);
+  return _get_coa(s->certs, s->cert_attrs, obj, template, CK_TRUE);
 }
 
 static CK_RV get_atst(ykcs11_slot_t *s, piv_obj_id_t obj, CK_ATTRIBUTE_PTR template) {
-  return _get_coa(s->atst, obj, template, CK_FALSE);
+  return _get_coa(s->atst, s->atst_attrs, obj, template, CK_FALSE);
 }
 
 /* Get private key object attribute */
 static CK_RV get_proa(ykcs11_slot_t *s, piv_obj_id_t obj, CK_ATTRIBUTE_PTR template) {
   CK_BYTE_PTR data;
-  CK_BYTE     b_tmp[1024] = {0};
+  CK_BYTE     b_tmp[1] = {0};
   CK_ULONG    ul_tmp = 0;
   CK_ULONG    len = 0;
   CK_RV       rv;
@@ -709,17 +798,12 @@ static CK_RV get_proa(ykcs11_slot_t *s, piv_obj_id_t obj, CK_ATTRIBUTE_PTR templ
 
   case CKA_MODULUS:
     DBG("MODULUS");
-    len = do_get_key_size(s->pkeys[piv_objects[obj].sub_id]);
-
-    if ((rv = do_get_modulus(s->pkeys[piv_objects[obj].sub_id], b_tmp, len)) != CKR_OK)
+    if ((rv = get_pkey_attr(&s->pkey_attrs[piv_objects[obj].sub_id], s->pkeys[piv_objects[obj].sub_id], PKEY_ATTR_MODULUS, &data, &len)) != CKR_OK)
       return rv;
-    data = b_tmp;
     break;
 
   case CKA_EC_POINT:
     DBG("EC_POINT");
-    len = sizeof(b_tmp);
-
     // Make sure that this is an EC key
     ul_tmp = do_get_key_type(s->pkeys[piv_objects[obj].sub_id]); // Getting the info from the pubk
     if (ul_tmp == CKK_VENDOR_DEFINED)
@@ -727,34 +811,29 @@ static CK_RV get_proa(ykcs11_slot_t *s, piv_obj_id_t obj, CK_ATTRIBUTE_PTR templ
     if (ul_tmp == CKK_RSA)
       return CKR_ATTRIBUTE_TYPE_INVALID;
 
-    if ((rv = do_get_public_key(s->pkeys[piv_objects[obj].sub_id], b_tmp, &len)) != CKR_OK)
+    if ((rv = get_pkey_attr(&s->pkey_attrs[piv_objects[obj].sub_id], s->pkeys[piv_objects[obj].sub_id], PKEY_ATTR_EC_POINT, &data, &len)) != CKR_OK)
       return rv;
-    data = b_tmp;
     break;
 
   case CKA_EC_PARAMS:
     // Here we want the curve parameters (DER encoded OID)
     DBG("EC_PARAMS");
-    len = sizeof(b_tmp);
-
     // Make sure that this is an EC key
     ul_tmp = do_get_key_type(s->pkeys[piv_objects[obj].sub_id]); // Getting the info from the pubk
     if (ul_tmp == CKK_VENDOR_DEFINED)
       return CKR_FUNCTION_FAILED;
     if (ul_tmp == CKK_EC) {
-      if ((rv = do_get_curve_parameters(s->pkeys[piv_objects[obj].sub_id], b_tmp, &len)) != CKR_OK)
+      if ((rv = get_pkey_attr(&s->pkey_attrs[piv_objects[obj].sub_id], s->pkeys[piv_objects[obj].sub_id], PKEY_ATTR_EC_PARAMS, &data, &len)) != CKR_OK)
         return rv;
     } else if (ul_tmp == CKK_EC_EDWARDS) {
       len = 14;
-      memcpy(b_tmp, ED25519, len);
+      data = (CK_BYTE_PTR) ED25519;
     } else if (ul_tmp == CKK_EC_MONTGOMERY) {
       len = 12;
-      memcpy(b_tmp, X25519, len);
+      data = (CK_BYTE_PTR) X25519;
     } else {
       return CKR_ATTRIBUTE_TYPE_INVALID;
     }
-
-    data = b_tmp;
     break;
 
   case CKA_MODULUS_BITS:
@@ -766,11 +845,8 @@ static CK_RV get_proa(ykcs11_slot_t *s, piv_obj_id_t obj, CK_ATTRIBUTE_PTR templ
 
   case CKA_PUBLIC_EXPONENT:
     DBG("PUBLIC EXPONENT");
-    len = sizeof(b_tmp);
-
-    if ((rv = do_get_public_exponent(s->pkeys[piv_objects[obj].sub_id], b_tmp, &len)) != CKR_OK)
+    if ((rv = get_pkey_attr(&s->pkey_attrs[piv_objects[obj].sub_id], s->pkeys[piv_objects[obj].sub_id], PKEY_ATTR_PUBLIC_EXPONENT, &data, &len)) != CKR_OK)
       return rv;
-    data = b_tmp;
     break;
 
   case CKA_ALWAYS_AUTHENTICATE:
@@ -843,7 +919,7 @@ static CK_RV get_proa(ykcs11_slot_t *s, piv_obj_id_t obj, CK_ATTRIBUTE_PTR templ
 /* Get public key object attribute */
 static CK_RV get_puoa(ykcs11_slot_t *s, piv_obj_id_t obj, CK_ATTRIBUTE_PTR template) {
   CK_BYTE_PTR data;
-  CK_BYTE     b_tmp[1024] = {0};
+  CK_BYTE     b_tmp[1] = {0};
   CK_ULONG    ul_tmp;
   CK_ULONG    len = 0;
   CK_RV       rv;
@@ -1028,8 +1104,6 @@ static CK_RV get_puoa(ykcs11_slot_t *s, piv_obj_id_t obj, CK_ATTRIBUTE_PTR templ
 
   case CKA_EC_POINT:
     DBG("EC_POINT");
-    len = sizeof(b_tmp);
-
     // Make sure that this is an EC key
     ul_tmp = do_get_key_type(s->pkeys[piv_objects[obj].sub_id]); // Getting the info from the pubk
     if (ul_tmp == CKK_VENDOR_DEFINED)
@@ -1037,43 +1111,35 @@ static CK_RV get_puoa(ykcs11_slot_t *s, piv_obj_id_t obj, CK_ATTRIBUTE_PTR templ
     if (ul_tmp == CKK_RSA)
       return CKR_ATTRIBUTE_TYPE_INVALID;
 
-    if ((rv = do_get_public_key(s->pkeys[piv_objects[obj].sub_id], b_tmp, &len)) != CKR_OK)
+    if ((rv = get_pkey_attr(&s->pkey_attrs[piv_objects[obj].sub_id], s->pkeys[piv_objects[obj].sub_id], PKEY_ATTR_EC_POINT, &data, &len)) != CKR_OK)
       return rv;
-    data = b_tmp;
     break;
 
   case CKA_EC_PARAMS:
     // Here we want the curve parameters (DER encoded OID)
     DBG("EC_PARAMS");
-    len = sizeof(b_tmp);
-
     // Make sure that this is an EC key
     ul_tmp = do_get_key_type(s->pkeys[piv_objects[obj].sub_id]); // Getting the info from the pubk
     if (ul_tmp == CKK_VENDOR_DEFINED)
       return CKR_FUNCTION_FAILED;
     if (ul_tmp == CKK_EC) {
-      if ((rv = do_get_curve_parameters(s->pkeys[piv_objects[obj].sub_id], b_tmp, &len)) != CKR_OK)
+      if ((rv = get_pkey_attr(&s->pkey_attrs[piv_objects[obj].sub_id], s->pkeys[piv_objects[obj].sub_id], PKEY_ATTR_EC_PARAMS, &data, &len)) != CKR_OK)
         return rv;
     } else if (ul_tmp == CKK_EC_EDWARDS) {
       len = 14;
-      memcpy(b_tmp, ED25519, len);
+      data = (CK_BYTE_PTR) ED25519;
     } else if (ul_tmp == CKK_EC_MONTGOMERY) {
       len = 12;
-      memcpy(b_tmp, X25519, len);
+      data = (CK_BYTE_PTR) X25519;
     } else {
       return CKR_ATTRIBUTE_TYPE_INVALID;
     }
-
-    data = b_tmp;
     break;
 
   case CKA_MODULUS:
     DBG("MODULUS");
-    len = do_get_key_size(s->pkeys[piv_objects[obj].sub_id]);
-
-    if ((rv = do_get_modulus(s->pkeys[piv_objects[obj].sub_id], b_tmp, len)) != CKR_OK)
+    if ((rv = get_pkey_attr(&s->pkey_attrs[piv_objects[obj].sub_id], s->pkeys[piv_objects[obj].sub_id], PKEY_ATTR_MODULUS, &data, &len)) != CKR_OK)
       return rv;
-    data = b_tmp;
     break;
 
   case CKA_MODULUS_BITS:
@@ -1085,11 +1151,8 @@ static CK_RV get_puoa(ykcs11_slot_t *s, piv_obj_id_t obj, CK_ATTRIBUTE_PTR templ
 
   case CKA_PUBLIC_EXPONENT:
     DBG("PUBLIC EXPONENT");
-    len = sizeof(b_tmp);
-
-    if ((rv = do_get_public_exponent(s->pkeys[piv_objects[obj].sub_id], b_tmp, &len)) != CKR_OK)
+    if ((rv = get_pkey_attr(&s->pkey_attrs[piv_objects[obj].sub_id], s->pkeys[piv_objects[obj].sub_id], PKEY_ATTR_PUBLIC_EXPONENT, &data, &len)) != CKR_OK)
       return rv;
-    data = b_tmp;
     break;
 
   case CKA_MODIFIABLE:
@@ -1260,6 +1323,89 @@ static CK_RV get_skoa(ykcs11_slot_t *s, piv_obj_id_t obj, CK_ATTRIBUTE_PTR templ
   return CKR_OK;
 }
 
+// Secret keys of a session never leave it, their value can't be read
+CK_RV get_secret_attribute(const ykcs11_secret_t *key, CK_ATTRIBUTE_PTR template) {
+  CK_BYTE_PTR data;
+  CK_BYTE     tmp;
+  CK_ULONG    ul_tmp;
+  CK_ULONG    len = 0;
+  DBG("For session secret key, get ");
+
+  switch (template->type) {
+  case CKA_CLASS:
+    DBG("CLASS");
+    len = sizeof(CK_ULONG);
+    ul_tmp = CKO_SECRET_KEY;
+    data = (CK_BYTE_PTR)&ul_tmp;
+    break;
+
+  case CKA_KEY_TYPE:
+    DBG("KEY_TYPE");
+    len = sizeof(CK_ULONG);
+    ul_tmp = key->type;
+    data = (CK_BYTE_PTR)&ul_tmp;
+    break;
+
+  case CKA_VALUE_LEN:
+    DBG("VALUE_LEN");
+    len = sizeof(CK_ULONG);
+    ul_tmp = key->len;
+    data = (CK_BYTE_PTR)&ul_tmp;
+    break;
+
+  case CKA_PRIVATE:
+  case CKA_SENSITIVE:
+  case CKA_ALWAYS_SENSITIVE:
+  case CKA_NEVER_EXTRACTABLE:
+  case CKA_ENCRYPT:
+  case CKA_DECRYPT:
+    DBG("%lx", template->type);
+    len = sizeof(CK_BBOOL);
+    tmp = CK_TRUE;
+    data = &tmp;
+    break;
+
+  case CKA_TOKEN:
+  case CKA_LOCAL:
+  case CKA_EXTRACTABLE:
+  case CKA_MODIFIABLE:
+  case CKA_DERIVE:
+  case CKA_SIGN:
+  case CKA_VERIFY:
+  case CKA_WRAP:
+  case CKA_UNWRAP:
+    DBG("%lx", template->type);
+    len = sizeof(CK_BBOOL);
+    tmp = CK_FALSE;
+    data = &tmp;
+    break;
+
+  case CKA_VALUE:
+    DBG("VALUE");
+    template->ulValueLen = CK_UNAVAILABLE_INFORMATION;
+    return CKR_ATTRIBUTE_SENSITIVE;
+
+  default:
+    DBG("UNKNOWN ATTRIBUTE %lx (%lu)", template[0].type, template[0].type);
+    return CKR_ATTRIBUTE_TYPE_INVALID;
+  }
+
+  /* Just get the length */
+  if (template->pValue == NULL) {
+    template->ulValueLen = len;
+    return CKR_OK;
+  }
+
+  /* Actually get the attribute */
+  if (template->ulValueLen < len)
+    return CKR_BUFFER_TOO_SMALL;
+
+  template->ulValueLen = len;
+  memcpy(template->pValue, data, len);
+
+  return CKR_OK;
+}
+
 CK_ULONG piv_2_ykpiv(piv_obj_id_t id) {
   switch(id) {
   case PIV_DATA_OBJ_CCC:
@@ -1482,8 +1628,86 @@ static int compare_piv_obj_id(const void *a, const void *b) {
   return (*(const piv_obj_id_t*)a - *(const piv_obj_id_t*)b);
 }
 
+static const CK_OBJECT_CLASS object_classes[YKCS11_OBJ_CLASSES] = {
+  CKO_DATA, CKO_CERTIFICATE, CKO_PUBLIC_KEY, CKO_PRIVATE_KEY, CKO_SECRET_KEY
+};
+
+static CK_ULONG get_class_index(piv_obj_id_t obj) {
+  if(piv_objects[obj].get_attribute == get_doa)
+    return 0;
+  if(piv_objects[obj].get_attribute == get_coa || piv_objects[obj].get_attribute == get_atst)
+    return 1;
+  if(piv_objects[obj].get_attribute == get_puoa)
+    return 2;
+  if(piv_objects[obj].get_attribute == get_proa)
+    return 3;
+  return 4; // get_skoa
+}
+
+static CK_ULONG get_index_key(piv_obj_id_t obj) {
+  return get_class_index(obj) * YKCS11_OBJ_SUB_IDS + piv_objects[obj].sub_id;
+}
+
+static void index_objects(ykcs11_slot_t *s) {
+  CK_ULONG pos[YKCS11_INDEX_LEN + 1] = {0};
+  for(CK_ULONG i = 0; i < s->n_objects; i++) {
+    pos[get_index_key(s->objects[i]) + 1]++;
+  }
+  for(CK_ULONG i = 0; i < YKCS11_INDEX_LEN; i++) {
+    pos[i + 1] += pos[i];
+  }
+  memcpy(s->index_pos, pos, sizeof(pos));
+  // Objects are sorted, so each group is sorted as well
+  for(CK_ULONG i = 0; i < s->n_objects; i++) {
+    s->index[pos[get_index_key(s->objects[i])]++] = s->objects[i];
+  }
+  s->n_indexed = s->n_objects;
+}
+
 void sort_objects(ykcs11_slot_t *s) {
   qsort(s->objects, s->n_objects, sizeof(piv_obj_id_t), compare_piv_obj_id);
+  index_objects(s);
+}
+
+CK_ULONG find_candidates(ykcs11_slot_t *s, CK_ATTRIBUTE_PTR templ, CK_ULONG n, piv_obj_id_t *objs) {
+  CK_ULONG cls = YKCS11_OBJ_CLASSES, id = YKCS11_OBJ_SUB_IDS;
+
+  // Pick out CKA_CLASS and CKA_ID, anything else is left to attribute_match
+  for(CK_ULONG i = 0; i < n; i++) {
+    if(templ[i].pValue == NULL) {
+      continue;
+    }
+    if(templ[i].type == CKA_CLASS && templ[i].ulValueLen == sizeof(CK_OBJECT_CLASS)) {
+      CK_ULONG c = 0;
+      while(c < YKCS11_OBJ_CLASSES && object_classes[c] != *(CK_OBJECT_CLASS *)templ[i].pValue)
+        c++;
+      if(c == YKCS11_OBJ_CLASSES || (cls != YKCS11_OBJ_CLASSES && cls != c))
+        return 0;
+      cls = c;
+    } else if(templ[i].type == CKA_ID && templ[i].ulValueLen == sizeof(CK_BYTE)) {
+      CK_BYTE b = *(CK_BYTE *)templ[i].pValue;
+      if(b >= YKCS11_OBJ_SUB_IDS || (id != YKCS11_OBJ_SUB_IDS && id != b))
+        return 0;
+      id = b;
+    }
+  }
+
+  if(s->n_indexed != s->n_objects || (cls == YKCS11_OBJ_CLASSES && id == YKCS11_OBJ_SUB_IDS)) {
+    memcpy(objs, s->objects, s->n_objects * sizeof(piv_obj_id_t));
+    return s->n_objects;
+  }
+
+  CK_ULONG n_objs = 0;
+  for(CK_ULONG c = 0; c < YKCS11_OBJ_CLASSES; c++) {
+    if(cls != YKCS11_OBJ_CLASSES && cls != c)
+      continue;
+    CK_ULONG first = c * YKCS11_OBJ_SUB_IDS + (id == YKCS11_OBJ_SUB_IDS ? 0 : id);
+    CK_ULONG last = id == YKCS11_OBJ_SUB_IDS ? (c + 1) * YKCS11_OBJ_SUB_IDS : first + 1;
+    for(CK_ULONG i = s->index_pos[first]; i < s->index_pos[last]; i++) {
+      objs[n_objs++] = s->index[i];
+    }
+  }
+  return n_objs;
 }
 
 CK_BBOOL is_present(ykcs11_slot_t *s, piv_obj_id_t id) {
@@ -1500,6 +1724,7 @@ CK_BBOOL add_object(ykcs11_slot_t *s, piv_obj_id_t id) {
       }
     }
     s->objects[s->n_objects++] = id;
+    s->n_indexed = 0; // Rebuilt by sort_objects
     DBG("Added object %u, slot contains %lu objects", id, s->n_objects);
     return true;
   }
@@ -1513,6 +1738,19 @@ CK_RV get_attribute(ykcs11_slot_t *s, piv_obj_id_t obj, CK_ATTRIBUTE_PTR templat
 
 CK_BBOOL attribute_match(ykcs11_slot_t *s, piv_obj_id_t obj, CK_ATTRIBUTE_PTR attribute) {
 
+  // These are the same for every object type and come straight from the object table
+  switch(attribute->pValue ? attribute->type : CKA_VENDOR_DEFINED) {
+    case CKA_CLASS:
+      return attribute->ulValueLen == sizeof(CK_OBJECT_CLASS) &&
+             *(CK_OBJECT_CLASS *)attribute->pValue == object_classes[get_class_index(obj)] ? CK_TRUE : CK_FALSE;
+    case CKA_ID:
+      return attribute->ulValueLen == sizeof(CK_BYTE) &&
+             *(CK_BYTE *)attribute->pValue == piv_objects[obj].sub_id ? CK_TRUE : CK_FALSE;
+    case CKA_LABEL:
+      return attribute->ulValueLen == strlen(piv_objects[obj].label) &&
+             memcmp(attribute->pValue, piv_objects[obj].label, attribute->ulValueLen) == 0 ? CK_TRUE : CK_FALSE;
+  }
+
   CK_BYTE data[4096] = {0};
   CK_ATTRIBUTE to_match = { attribute->type, data, sizeof(data) };
 
@@ -1603,10 +1841,62 @@ CK_RV get_data_len(ykcs11_slot_t *s, CK_BYTE sub_id, CK_ULONG_PTR len) {
   return CKR_OK;
 }
 
+static void clear_enc_ctx(ykcs11_enc_ctx_t *c) {
+  EVP_PKEY_CTX_free(c->ctx);
+  free(c->oaep_label);
+  memset(c, 0, sizeof(*c));
+}
+
+void drop_attributes(ykcs11_slot_t *s, CK_BYTE sub_id) {
+  clear_attr_cache(&s->cert_attrs[sub_id]);
+  clear_attr_cache(&s->atst_attrs[sub_id]);
+  clear_attr_cache(&s->pkey_attrs[sub_id]);
+  clear_enc_ctx(&s->enc_ctxs[sub_id]);
+}
+
+CK_RV get_enc_ctx(ykcs11_slot_t *s, CK_BYTE sub_id, CK_ULONG padding, const ykcs11_md_t *oaep_md, const ykcs11_md_t *mgf1_md,
+                  const unsigned char *oaep_label, CK_ULONG oaep_label_len, ykcs11_pkey_ctx_t **ctx) {
+  ykcs11_enc_ctx_t *c = &s->enc_ctxs[sub_id];
+
+  // Re-use the prepared context if nothing has changed since the last encryption with this key
+  if (c->ctx && c->key == s->pkeys[sub_id] && c->padding == padding && c->oaep_md == oaep_md && c->mgf1_md == mgf1_md &&
+      c->oaep_label_len == oaep_label_len && (c->oaep_label == NULL) == (oaep_label == NULL) &&
+      (oaep_label == NULL || memcmp(c->oaep_label, oaep_label, oaep_label_len) == 0)) {
+    *ctx = c->ctx;
+    return CKR_OK;
+  }
+
+  clear_enc_ctx(c);
+
+  if (oaep_label) {
+    if ((c->oaep_label = malloc(oaep_label_len ? oaep_label_len : 1)) == NULL) {
+      DBG("Unable to allocate memory for %lu byte OAEP label", oaep_label_len);
+      return CKR_HOST_MEMORY;
+    }
+    memcpy(c->oaep_label, oaep_label, oaep_label_len);
+  }
+
+  CK_RV rv = do_rsa_encrypt_init(s->pkeys[sub_id], padding, oaep_md, mgf1_md, oaep_label, oaep_label_len, &c->ctx);
+  if (rv != CKR_OK) {
+    clear_enc_ctx(c);
+    return rv;
+  }
+
+  c->key = s->pkeys[sub_id];
+  c->padding = padding;
+  c->oaep_md = oaep_md;
+  c->mgf1_md = mgf1_md;
+  c->oaep_label_len = oaep_label_len;
+  *ctx = c->ctx;
+  return CKR_OK;
+}
+
 CK_RV store_cert(ykcs11_slot_t *s, CK_BYTE sub_id, CK_BYTE_PTR data, CK_ULONG len, CK_BBOOL force_pubkey) {
 
   CK_RV rv;
 
+  drop_attributes(s, sub_id);
+
   // Store the certificate as an object
   rv = do_store_cert(data, len, &s->certs[sub_id]);
   if (rv != CKR_OK)
@@ -1625,6 +1915,8 @@ CK_RV store_cert(ykcs11_slot_t *s, CK_BYTE sub_id, CK_BYTE_PTR data, CK_ULONG le
 CK_RV delete_cert(ykcs11_slot_t *s, CK_BYTE sub_id) {
   CK_RV rv;
 
+  drop_attributes(s, sub_id);
+
   // Clear the object containing the certificate
   rv = do_delete_cert(&s->certs[sub_id]);
   if (rv != CKR_OK)
@@ -3078,6 +3370,14 @@ CK_RV check_pvtkey_template(gen_info_t *gen, CK_MECHANISM_PTR mechanism, CK_ATTR
         gen->pin_policy = b_tmp;
         break;
 
+      case CKA_YUBICO_SKIP_CERTIFICATE:
+        if (templ[i].ulValueLen != sizeof(CK_BBOOL)) {
+          DBG("Invalid length for CKA_YUBICO_SKIP_CERTIFICATE");
+          return CKR_ATTRIBUTE_VALUE_INVALID;
+        }
+        gen->skip_cert = *((CK_BBOOL *)templ[i].pValue) ? CK_TRUE : CK_FALSE;
+        break;
+
       case CKA_COPYABLE:
       case CKA_DESTROYABLE:
       case CKA_ENCRYPT:
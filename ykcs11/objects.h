@@ -46,14 +46,19 @@ piv_obj_id_t find_pvtk_object(CK_BYTE sub_id);
 piv_obj_id_t find_atst_object(CK_BYTE sub_id);
 
 CK_RV    get_attribute(ykcs11_slot_t *s, piv_obj_id_t obj, CK_ATTRIBUTE_PTR template);
+CK_RV    get_secret_attribute(const ykcs11_secret_t *key, CK_ATTRIBUTE_PTR template);
 CK_BBOOL attribute_match(ykcs11_slot_t *s, piv_obj_id_t obj, CK_ATTRIBUTE_PTR attribute);
 CK_BBOOL is_private_object(piv_obj_id_t obj);
 void sort_objects(ykcs11_slot_t *s);
+CK_ULONG find_candidates(ykcs11_slot_t *s, CK_ATTRIBUTE_PTR templ, CK_ULONG n, piv_obj_id_t *objs);
 
 CK_RV    store_data(ykcs11_slot_t *s, CK_BYTE sub_id, CK_BYTE_PTR data, CK_ULONG len);
 CK_RV    delete_data(ykcs11_slot_t *s, CK_BYTE sub_id);
 CK_RV    store_cert(ykcs11_slot_t *s, CK_BYTE sub_id, CK_BYTE_PTR data, CK_ULONG len, CK_BBOOL force_pubkey);
 CK_RV    delete_cert(ykcs11_slot_t *s, CK_BYTE sub_id);
+void     drop_attributes(ykcs11_slot_t *s, CK_BYTE sub_id);
+CK_RV    get_enc_ctx(ykcs11_slot_t *s, CK_BYTE sub_id, CK_ULONG padding, const ykcs11_md_t *oaep_md, const ykcs11_md_t *mgf1_md,
+                     const unsigned char *oaep_label, CK_ULONG oaep_label_len, ykcs11_pkey_ctx_t **ctx);
 CK_RV    get_data_len(ykcs11_slot_t *s, CK_BYTE sub_id, CK_ULONG_PTR len);
 
 CK_RV check_create_cert(CK_ATTRIBUTE_PTR templ, CK_ULONG n, CK_BYTE_PTR id,
@@ -33,6 +33,7 @@
 #include "ykpiv.h"
 #include "../common/util.h"
 #include "../common/openssl-compat.h"
+#include "../common/tlv.h"
 #include "debug.h"
 #include <string.h>
 
@@ -45,71 +46,81 @@ CK_RV do_rand_bytes(CK_BYTE_PTR data, CK_ULONG len) {
   return RAND_bytes(data, len) <= 0 ? CKR_FUNCTION_FAILED : CKR_OK;
 }
 
-CK_RV do_rsa_encrypt(ykcs11_pkey_t *key, int padding, const ykcs11_md_t* oaep_md, const ykcs11_md_t* oaep_mgf1, 
-                     unsigned char *oaep_label, CK_ULONG oaep_label_len,
-                     CK_BYTE_PTR data, CK_ULONG data_len, CK_BYTE_PTR enc, CK_ULONG_PTR enc_len) {
+CK_RV do_rsa_encrypt_init(ykcs11_pkey_t *key, int padding, const ykcs11_md_t* oaep_md, const ykcs11_md_t* oaep_mgf1,
+                          const unsigned char *oaep_label, CK_ULONG oaep_label_len, ykcs11_pkey_ctx_t **ctx) {
 
   if (!key || EVP_PKEY_base_id(key) != EVP_PKEY_RSA) { // EVP_PKEY_base_id doesn't handle NULL
     return CKR_KEY_TYPE_INCONSISTENT;
   }
 
   CK_RV rv;
-  ykcs11_pkey_ctx_t *ctx = EVP_PKEY_CTX_new(key, NULL);
-  if(ctx == NULL) {
+  unsigned char *label = NULL;
+  *ctx = EVP_PKEY_CTX_new(key, NULL);
+  if(*ctx == NULL) {
     return CKR_FUNCTION_FAILED;
   }
 
-  if(EVP_PKEY_encrypt_init(ctx) <= 0) {
+  if(EVP_PKEY_encrypt_init(*ctx) <= 0) {
     rv = CKR_FUNCTION_FAILED;
     goto rsa_enc_cleanup;
   }
 
   if(padding != RSA_NO_PADDING) {
-    if(EVP_PKEY_CTX_set_rsa_padding(ctx, padding) <= 0) {
+    if(EVP_PKEY_CTX_set_rsa_padding(*ctx, padding) <= 0) {
       rv = CKR_FUNCTION_FAILED;
       goto rsa_enc_cleanup;
     }
   }
 
-
   if(oaep_md != NULL) {
-    if(EVP_PKEY_CTX_set_rsa_oaep_md(ctx, oaep_md) <= 0) {
+    if(EVP_PKEY_CTX_set_rsa_oaep_md(*ctx, oaep_md) <= 0) {
       rv = CKR_FUNCTION_FAILED;
       goto rsa_enc_cleanup;
     }
   }
-  
+
   if (oaep_mgf1 != NULL) {
-    if(EVP_PKEY_CTX_set_rsa_mgf1_md(ctx, oaep_mgf1) <= 0) {
+    if(EVP_PKEY_CTX_set_rsa_mgf1_md(*ctx, oaep_mgf1) <= 0) {
       rv = CKR_FUNCTION_FAILED;
       goto rsa_enc_cleanup;
     }
   }
 
   if (oaep_label != NULL) {
-    if(EVP_PKEY_CTX_set0_rsa_oaep_label(ctx, oaep_label, oaep_label_len) <= 0) {
+    // The context takes ownership of its own copy of the label
+    if((label = OPENSSL_malloc(oaep_label_len ? oaep_label_len : 1)) == NULL) {
+      rv = CKR_HOST_MEMORY;
+      goto rsa_enc_cleanup;
+    }
+    memcpy(label, oaep_label, oaep_label_len);
+    if(EVP_PKEY_CTX_set0_rsa_oaep_label(*ctx, label, oaep_label_len) <= 0) {
+      OPENSSL_free(label);
       rv = CKR_FUNCTION_FAILED;
       goto rsa_enc_cleanup;
     }
   }
-   
-  size_t cbLen = *enc_len;
-  if(EVP_PKEY_encrypt(ctx, enc, &cbLen, data, data_len) <= 0) {
-    rv = CKR_FUNCTION_FAILED;
-    goto rsa_enc_cleanup;
-  }
 
-  *enc_len = cbLen;
   rv = CKR_OK;
 
 rsa_enc_cleanup:
   if(rv != CKR_OK) {
-    free(oaep_label);
+    EVP_PKEY_CTX_free(*ctx);
+    *ctx = NULL;
   }
-  EVP_PKEY_CTX_free(ctx);
   return rv;
 }
 
+CK_RV do_rsa_encrypt(ykcs11_pkey_ctx_t *ctx, CK_BYTE_PTR data, CK_ULONG data_len, CK_BYTE_PTR enc, CK_ULONG_PTR enc_len) {
+
+  size_t cbLen = *enc_len;
+  if(EVP_PKEY_encrypt(ctx, enc, &cbLen, data, data_len) <= 0) {
+    return CKR_FUNCTION_FAILED;
+  }
+
+  *enc_len = cbLen;
+  return CKR_OK;
+}
+
 CK_RV do_store_cert(CK_BYTE_PTR data, CK_ULONG len, ykcs11_x509_t **cert) {
 
   unsigned char certdata[YKPIV_OBJ_MAX_SIZE * 10] = {0};
@@ -212,50 +223,24 @@ create_rsa_cleanup:
 }
 
 CK_RV do_create_public_key(CK_BYTE_PTR in, CK_ULONG in_len, CK_ULONG algorithm, ykcs11_pkey_t **pkey) {
-  CK_BYTE_PTR eob = in + in_len;
-  unsigned long offs, len;
+  tlv_reader reader;
+  tlv_reader_init(&reader, in, in_len);
   if (YKPIV_IS_RSA(algorithm)) {
-    if(in >= eob)
-      return CKR_GENERAL_ERROR;
-
-    if (*in++ != 0x81)
-      return CKR_GENERAL_ERROR;
-
-    offs = get_length(in, eob, &len);
-    if(!offs)
-      return CKR_GENERAL_ERROR;
-
-    in += offs;
-
-    CK_BYTE_PTR mod = in;
-    CK_ULONG mod_len = len;
-
-    in += len;
-
-    if(in >= eob)
-      return CKR_GENERAL_ERROR;
-
-    if (*in++ != 0x82)
+    tlv_view mod, exp;
+    if (!tlv_expect(&reader, 0x81, &mod))
       return CKR_GENERAL_ERROR;
 
-    offs = get_length(in, eob, &len);
-    if(!offs)
+    if (!tlv_expect(&reader, 0x82, &exp))
       return CKR_GENERAL_ERROR;
 
-    in += offs;    
-    return do_create_rsa_key(mod, mod_len, in, len, pkey);
+    return do_create_rsa_key((CK_BYTE_PTR)mod.value, mod.length, (CK_BYTE_PTR)exp.value, exp.length, pkey);
   } else {
-    if(in >= eob)
-      return CKR_GENERAL_ERROR;
-
-    if(*in++ != 0x86)
-      return CKR_GENERAL_ERROR;
-
-    offs = get_length(in, eob, &len);
-    if(!offs)
+    tlv_view tlv;
+    if (!tlv_expect(&reader, 0x86, &tlv))
       return CKR_GENERAL_ERROR;
 
-    in += offs;
+    in = (CK_BYTE_PTR)tlv.value;
+    CK_ULONG len = tlv.length;
 
     if (YKPIV_IS_EC(algorithm)) {
       int curve_name = get_curve_name(algorithm);
@@ -585,6 +570,17 @@ CK_BBOOL do_check_public_exponent(CK_BYTE_PTR data, CK_ULONG len) {
   return ret;
 }
 
+CK_BBOOL do_check_ec_point(CK_BYTE algorithm, CK_BYTE_PTR data, CK_ULONG len) {
+  EC_GROUP *group = EC_GROUP_new_by_curve_name(get_curve_name(algorithm));
+  EC_POINT *point = group ? EC_POINT_new(group) : NULL;
+  // Decoding fails for points that aren't on the curve
+  CK_BBOOL ret = point && EC_POINT_oct2point(group, point, data, len, NULL) > 0 &&
+                 !EC_POINT_is_at_infinity(group, point) ? CK_TRUE : CK_FALSE;
+  EC_POINT_free(point);
+  EC_GROUP_free(group);
+  return ret;
+}
+
 CK_RV do_get_public_exponent(ykcs11_pkey_t *key, CK_BYTE_PTR data, CK_ULONG_PTR len) {
 
   const RSA *rsa = key ? EVP_PKEY_get0_RSA(key) : 0;
@@ -683,6 +679,44 @@ CK_RV do_get_curve_parameters(ykcs11_pkey_t *key, CK_BYTE_PTR data, CK_ULONG_PTR
   return CKR_OK;
 }
 
+CK_RV do_get_raw_pubk(ykcs11_pkey_t *key, CK_BYTE_PTR out, CK_ULONG_PTR out_len) {
+
+  CK_BYTE_PTR p;
+  int         len;
+
+  len = i2d_PUBKEY(key, NULL);
+
+  if (len < 0)
+    return CKR_FUNCTION_FAILED;
+
+  if ((CK_ULONG)len > *out_len)
+    return CKR_BUFFER_TOO_SMALL;
+
+  p = out;
+  if ((*out_len = (CK_ULONG) i2d_PUBKEY(key, &p)) == 0)
+    return CKR_FUNCTION_FAILED;
+
+  return CKR_OK;
+}
+
+CK_RV do_store_raw_pubk(CK_BYTE_PTR in, CK_ULONG in_len, ykcs11_pkey_t **key) {
+
+  const unsigned char *p = in; // Mandatory temp variable required by OpenSSL
+
+  if(*key) {
+    EVP_PKEY_free(*key);
+  }
+
+  *key = d2i_PUBKEY(NULL, &p, in_len);
+
+  if (*key == NULL) {
+    return CKR_FUNCTION_FAILED;
+  }
+
+  return CKR_OK;
+
+}
+
 CK_RV do_delete_pubk(EVP_PKEY **key) {
 
   EVP_PKEY_free(*key);
@@ -36,9 +36,9 @@
 
 CK_RV do_rand_seed(CK_BYTE_PTR data, CK_ULONG len);
 CK_RV do_rand_bytes(CK_BYTE_PTR data, CK_ULONG len);
-CK_RV do_rsa_encrypt(ykcs11_pkey_t *key, int padding, const ykcs11_md_t* oaep_md, const ykcs11_md_t* oaep_mgf1, 
-                     unsigned char *oaep_label, CK_ULONG oaep_label_len,
-                     CK_BYTE_PTR data, CK_ULONG data_len, CK_BYTE_PTR enc, CK_ULONG_PTR enc_len);
+CK_RV do_rsa_encrypt_init(ykcs11_pkey_t *key, int padding, const ykcs11_md_t* oaep_md, const ykcs11_md_t* oaep_mgf1,
+                          const unsigned char *oaep_label, CK_ULONG oaep_label_len, ykcs11_pkey_ctx_t **ctx);
+CK_RV do_rsa_encrypt(ykcs11_pkey_ctx_t *ctx, CK_BYTE_PTR data, CK_ULONG data_len, CK_BYTE_PTR enc, CK_ULONG_PTR enc_len);
 CK_RV do_store_cert(CK_BYTE_PTR data, CK_ULONG len, ykcs11_x509_t **cert);
 CK_RV do_generate_ec_key(int curve_name, ykcs11_pkey_t **pkey);
 CK_RV do_create_rsa_key(CK_BYTE_PTR mod, CK_ULONG mod_len, CK_BYTE_PTR exp, CK_ULONG exp_len, ykcs11_pkey_t **pkey);
@@ -60,10 +60,13 @@ CK_ULONG    do_get_key_size(ykcs11_pkey_t *key);
 CK_ULONG    do_get_signature_size(ykcs11_pkey_t *key);
 CK_BYTE     do_get_key_algorithm(ykcs11_pkey_t *key);
 CK_BBOOL    do_check_public_exponent(CK_BYTE_PTR data, CK_ULONG len);
+CK_BBOOL    do_check_ec_point(CK_BYTE algorithm, CK_BYTE_PTR data, CK_ULONG len);
 CK_RV       do_get_public_exponent(ykcs11_pkey_t *key, CK_BYTE_PTR data, CK_ULONG_PTR len);
 CK_RV       do_get_public_key(ykcs11_pkey_t *key, CK_BYTE_PTR data, CK_ULONG_PTR len);
 CK_RV       do_get_modulus(ykcs11_pkey_t *key, CK_BYTE_PTR data, CK_ULONG len);
 CK_RV       do_get_curve_parameters(ykcs11_pkey_t *key, CK_BYTE_PTR data, CK_ULONG_PTR len);
+CK_RV       do_get_raw_pubk(ykcs11_pkey_t *key, CK_BYTE_PTR out, CK_ULONG_PTR out_len);
+CK_RV       do_store_raw_pubk(CK_BYTE_PTR in, CK_ULONG in_len, ykcs11_pkey_t **key);
 CK_RV       do_delete_pubk(ykcs11_pkey_t **key);
 
 CK_RV do_apply_DER_encoding_to_ECSIG(CK_BYTE_PTR signature, CK_ULONG_PTR len, CK_ULONG buf_size);
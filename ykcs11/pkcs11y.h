@@ -32,6 +32,7 @@
 #define PKCS11Y_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef CRYPTOKI_EXPORTS
 #ifdef _WIN32
@@ -75,6 +76,8 @@ extern "C" {
 
 #define CKA_YUBICO_TOUCH_POLICY (CKA_YUBICO + 1)
 #define CKA_YUBICO_PIN_POLICY (CKA_YUBICO + 2)
+/* CK_BBOOL in the private key template of C_GenerateKeyPair, TRUE to not store a certificate for the new key */
+#define CKA_YUBICO_SKIP_CERTIFICATE (CKA_YUBICO + 3)
 
 /* Values for CKA_YUBICO_[TOUCH,PIN]_POLICY. Must match defines in ykpiv.h */
 #define YKPIV_TOUCHPOLICY_DEFAULT 0
@@ -86,6 +89,118 @@ extern "C" {
 #define YKPIV_PINPOLICY_ONCE 2
 #define YKPIV_PINPOLICY_ALWAYS 3
 
+/* Vendor interface, available through C_GetInterface */
+#define YUBICO_INTERFACE_NAME "Vendor Yubico"
+
+/* Verifies a batch of messages against the key of an active message-based verification operation.
+   pResults receives the result of each verification, the return value is CKR_OK if all signatures are valid. */
+typedef CK_DECLARE_FUNCTION_POINTER(CK_RV, CK_C_YUBICO_VerifyMessageBatch)(
+  CK_SESSION_HANDLE hSession,
+  CK_ULONG ulCount,
+  CK_BYTE_PTR CK_PTR ppData,
+  CK_ULONG_PTR pulDataLen,
+  CK_BYTE_PTR CK_PTR ppSignature,
+  CK_ULONG_PTR pulSignatureLen,
+  CK_RV CK_PTR pResults
+);
+
+/* Counters for the commands sent to a token. Must match ykpiv_stats in ykpiv.h */
+#define CK_YUBICO_STATS_MAX_INS 32
+#define CK_YUBICO_STATS_BUCKETS 24
+
+typedef struct CK_YUBICO_INS_STATISTICS {
+  CK_BYTE ins;
+  uint64_t commands;
+  uint64_t errors;
+  uint64_t apdus;
+  uint64_t chained;
+  uint64_t get_responses;
+  uint64_t bytes_sent;
+  uint64_t bytes_received;
+  uint64_t total_us;
+  uint64_t transmit_us;
+  uint64_t max_us;
+  uint64_t latency[CK_YUBICO_STATS_BUCKETS]; /* Bucket 0 counts commands under 2us, bucket n from 2^n us */
+} CK_YUBICO_INS_STATISTICS;
+
+typedef struct CK_YUBICO_SLOT_STATISTICS {
+  uint64_t transactions;
+  uint64_t transaction_retries;
+  uint64_t transaction_wait_us;
+  uint64_t batched;
+  uint64_t scp11_ops;
+  uint64_t scp11_us;
+  CK_ULONG ulInsCount;
+  CK_YUBICO_INS_STATISTICS ins[CK_YUBICO_STATS_MAX_INS];
+} CK_YUBICO_SLOT_STATISTICS;
+
+typedef CK_YUBICO_SLOT_STATISTICS CK_PTR CK_YUBICO_SLOT_STATISTICS_PTR;
+
+/* Gets the counters kept for the commands sent to the token in a slot, optionally starting again from zero.
+   Counting doesn't depend on debug output being enabled. */
+typedef CK_DECLARE_FUNCTION_POINTER(CK_RV, CK_C_YUBICO_GetSlotStatistics)(
+  CK_SLOT_ID slotID,
+  CK_YUBICO_SLOT_STATISTICS_PTR pStatistics,
+  CK_BBOOL bReset
+);
+
+/* Derives a batch of ECDH shared secrets with the private key hBaseKey, as CKM_ECDH1_DERIVE without a KDF would,
+   one for each peer public key. Instead of creating secret key objects, the secrets are written to ppSecret, each
+   of which holds at least the field size of the curve as given in pulSecretLen. pulSecretLen receives the length of
+   each secret and pResults the result of each derivation, the return value is CKR_OK if all succeeded. */
+typedef CK_DECLARE_FUNCTION_POINTER(CK_RV, CK_C_YUBICO_DeriveKeyBatch)(
+  CK_SESSION_HANDLE hSession,
+  CK_OBJECT_HANDLE hBaseKey,
+  CK_ULONG ulCount,
+  CK_BYTE_PTR CK_PTR ppPublicData,
+  CK_ULONG_PTR pulPublicDataLen,
+  CK_BYTE_PTR CK_PTR ppSecret,
+  CK_ULONG_PTR pulSecretLen,
+  CK_RV CK_PTR pResults
+);
+
+#define CK_YUBICO_GLOBAL_LOCK (~(CK_SLOT_ID)0)
+
+typedef struct CK_YUBICO_LOCK_STATISTICS {
+  uint64_t acquisitions;
+  uint64_t contended; /* Acquisitions that waited for another thread */
+  uint64_t wait_us;
+  uint64_t max_wait_us;
+  uint64_t hold_us;
+  uint64_t max_hold_us;
+  CK_UTF8CHAR max_wait_holder[32]; /* Function holding the lock during the longest wait, NUL terminated */
+  CK_UTF8CHAR max_hold_function[32]; /* Function that held the lock the longest, NUL terminated */
+} CK_YUBICO_LOCK_STATISTICS;
+
+typedef CK_YUBICO_LOCK_STATISTICS CK_PTR CK_YUBICO_LOCK_STATISTICS_PTR;
+
+/* Gets the time spent waiting for and holding the mutex of a slot, or the global mutex for CK_YUBICO_GLOBAL_LOCK,
+   optionally starting again from zero. Returns CKR_FUNCTION_NOT_SUPPORTED unless the environment variable
+   YKCS11_LOCK_STATS was set when calling C_Initialize. */
+typedef CK_DECLARE_FUNCTION_POINTER(CK_RV, CK_C_YUBICO_GetLockStatistics)(
+  CK_SLOT_ID slotID,
+  CK_YUBICO_LOCK_STATISTICS_PTR pStatistics,
+  CK_BBOOL bReset
+);
+
+/* Writes the objects created and destroyed on the slot of the session that are still queued, when the environment
+   variable YKCS11_WRITE_BEHIND_MS was set when calling C_Initialize. Returns the first error, including one from
+   flushing after the delay since the last call. The objects of a failed write are read from the token again. */
+typedef CK_DECLARE_FUNCTION_POINTER(CK_RV, CK_C_YUBICO_FlushWrites)(
+  CK_SESSION_HANDLE hSession
+);
+
+typedef struct CK_YUBICO_FUNCTION_LIST {
+  CK_VERSION version;
+  CK_C_YUBICO_VerifyMessageBatch C_YUBICO_VerifyMessageBatch;
+  CK_C_YUBICO_GetSlotStatistics C_YUBICO_GetSlotStatistics; /* Since version 1.1 */
+  CK_C_YUBICO_DeriveKeyBatch C_YUBICO_DeriveKeyBatch; /* Since version 1.2 */
+  CK_C_YUBICO_GetLockStatistics C_YUBICO_GetLockStatistics; /* Since version 1.3 */
+  CK_C_YUBICO_FlushWrites C_YUBICO_FlushWrites; /* Since version 1.4 */
+} CK_YUBICO_FUNCTION_LIST;
+
+typedef CK_YUBICO_FUNCTION_LIST CK_PTR CK_YUBICO_FUNCTION_LIST_PTR;
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,562 @@
+/*
+ * Copyright (c) 2025 Yubico AB
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+// Throughput of ykcs11 used from several threads, printed as JSON. Each thread signs, searches
+// objects and reads attributes in a loop, over its own sessions spread over the tokens. The module
+// is initialized with locking callbacks that count how long threads wait for its mutexes.
+
+#include "../ykcs11.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_THREADS 4
+#define BENCH_DEFAULT_SESSIONS 2
+#define BENCH_DEFAULT_ITERATIONS 50
+#define BENCH_DEFAULT_PIN "123456"
+#define BENCH_MAX_SESSIONS 64
+#define BENCH_MAX_TOKENS 16
+#define BENCH_MAX_MUTEXES 256
+
+typedef enum { BENCH_SIGN, BENCH_FIND, BENCH_ATTR, BENCH_OPS } bench_op;
+
+static const char *const op_names[BENCH_OPS] = {"sign", "find_objects", "get_attribute_value"};
+
+// C_Initialize creates the global mutex first, then the one for slot events, then one per slot
+typedef enum { LOCK_GLOBAL, LOCK_EVENT, LOCK_SLOT, LOCK_KINDS } lock_kind;
+
+static const char *const lock_names[LOCK_KINDS] = {"global", "event", "slot"};
+
+typedef struct {
+  pthread_mutex_t mutex;
+  lock_kind kind;
+  uint64_t acquisitions;
+  uint64_t contended;
+  uint64_t wait_ns;
+  uint64_t max_wait_ns;
+  uint64_t hold_ns;
+  uint64_t locked_at;
+} bench_mutex;
+
+typedef struct {
+  CK_SLOT_ID slot;
+  CK_SESSION_HANDLE login_session;
+  CK_BYTE key_id;
+  CK_KEY_TYPE key_type;
+} bench_token;
+
+typedef struct {
+  CK_FUNCTION_LIST_3_0_PTR funcs;
+  size_t threads;
+  size_t sessions;
+  size_t iterations;
+  bool ops[BENCH_OPS];
+  size_t n_tokens;
+  bench_token tokens[BENCH_MAX_TOKENS];
+  pthread_mutex_t start_mutex;
+  pthread_cond_t start_cond;
+  size_t ready;
+  bool go;
+} bench_ctx;
+
+typedef struct {
+  bench_ctx *ctx;
+  size_t id;
+  CK_SESSION_HANDLE sessions[BENCH_MAX_SESSIONS];
+  CK_OBJECT_HANDLE keys[BENCH_MAX_SESSIONS];
+  bench_token *tokens[BENCH_MAX_SESSIONS];
+  double *samples[BENCH_OPS];
+  size_t n_samples[BENCH_OPS];
+  CK_RV rv;
+  const char *failed;
+} bench_thread;
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bench_mutex *mutexes[BENCH_MAX_MUTEXES];
+static size_t n_mutexes;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static CK_RV bench_create_mutex(void **mutex) {
+  bench_mutex *m = calloc(1, sizeof(bench_mutex));
+  if (m == NULL) {
+    return CKR_HOST_MEMORY;
+  }
+  pthread_mutex_init(&m->mutex, NULL);
+  pthread_mutex_lock(&registry_mutex);
+  m->kind = n_mutexes < LOCK_SLOT ? (lock_kind)n_mutexes : LOCK_SLOT;
+  if (n_mutexes < BENCH_MAX_MUTEXES) {
+    mutexes[n_mutexes++] = m;
+  }
+  pthread_mutex_unlock(&registry_mutex);
+  *mutex = m;
+  return CKR_OK;
+}
+
+// Counters are kept once the benchmark is done, so the module destroying its mutexes doesn't free them
+static CK_RV bench_destroy_mutex(void *mutex) {
+  bench_mutex *m = mutex;
+  pthread_mutex_destroy(&m->mutex);
+  return CKR_OK;
+}
+
+static CK_RV bench_lock_mutex(void *mutex) {
+  bench_mutex *m = mutex;
+  uint64_t wait = 0;
+  bool contended = false;
+  int rc = pthread_mutex_trylock(&m->mutex);
+  if (rc == EBUSY) {
+    uint64_t start = now_ns();
+    rc = pthread_mutex_lock(&m->mutex);
+    wait = now_ns() - start;
+    contended = true;
+  }
+  if (rc != 0) {
+    return CKR_GENERAL_ERROR;
+  }
+  // Updated while holding the mutex itself
+  m->acquisitions++;
+  m->contended += contended;
+  m->wait_ns += wait;
+  if (wait > m->max_wait_ns) {
+    m->max_wait_ns = wait;
+  }
+  m->locked_at = now_ns();
+  return CKR_OK;
+}
+
+static CK_RV bench_unlock_mutex(void *mutex) {
+  bench_mutex *m = mutex;
+  m->hold_ns += now_ns() - m->locked_at;
+  return pthread_mutex_unlock(&m->mutex) ? CKR_MUTEX_NOT_LOCKED : CKR_OK;
+}
+
+static int compare_samples(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *sorted, size_t n, size_t p) {
+  size_t i = (n * p + 99) / 100;
+  return sorted[i ? i - 1 : 0];
+}
+
+static CK_MECHANISM_TYPE sign_mechanism(CK_KEY_TYPE key_type) {
+  switch (key_type) {
+    case CKK_RSA:
+      return CKM_RSA_PKCS;
+    case CKK_EC_EDWARDS:
+      return CKM_EDDSA;
+    default:
+      return CKM_ECDSA;
+  }
+}
+
+// Picks a signing key that needs neither a PIN for each use nor a touch
+static bool find_key(bench_ctx *ctx, bench_token *token) {
+  CK_OBJECT_CLASS class = CKO_PRIVATE_KEY;
+  CK_ATTRIBUTE template[] = {{CKA_CLASS, &class, sizeof(class)}};
+  CK_OBJECT_HANDLE objects[32];
+  CK_ULONG n = 0;
+  bool found = false;
+
+  if (ctx->funcs->C_FindObjectsInit(token->login_session, template, 1) != CKR_OK) {
+    return false;
+  }
+  ctx->funcs->C_FindObjects(token->login_session, objects, sizeof(objects) / sizeof(objects[0]), &n);
+  ctx->funcs->C_FindObjectsFinal(token->login_session);
+  for (CK_ULONG i = 0; i < n && !found; i++) {
+    CK_BBOOL sign = CK_FALSE, always = CK_TRUE;
+    CK_BYTE touch = 0, id = 0;
+    CK_KEY_TYPE key_type = 0;
+    CK_ATTRIBUTE attrs[] = {
+      {CKA_SIGN, &sign, sizeof(sign)},
+      {CKA_ALWAYS_AUTHENTICATE, &always, sizeof(always)},
+      {CKA_YUBICO_TOUCH_POLICY, &touch, sizeof(touch)},
+      {CKA_ID, &id, sizeof(id)},
+      {CKA_KEY_TYPE, &key_type, sizeof(key_type)},
+    };
+    if (ctx->funcs->C_GetAttributeValue(token->login_session, objects[i], attrs, 5) != CKR_OK) {
+      continue;
+    }
+    // The touch policy is only known with firmware 5.3 and later
+    if (sign && !always && (touch == YKPIV_TOUCHPOLICY_DEFAULT || touch == YKPIV_TOUCHPOLICY_NEVER)) {
+      token->key_id = id;
+      token->key_type = key_type;
+      found = true;
+    }
+  }
+  return found;
+}
+
+static CK_RV open_sessions(bench_thread *t) {
+  bench_ctx *ctx = t->ctx;
+  CK_RV rv;
+
+  for (size_t i = 0; i < ctx->sessions; i++) {
+    bench_token *token = &ctx->tokens[(t->id * ctx->sessions + i) % ctx->n_tokens];
+    CK_OBJECT_CLASS class = CKO_PRIVATE_KEY;
+    CK_ATTRIBUTE template[] = {{CKA_CLASS, &class, sizeof(class)}, {CKA_ID, &token->key_id, sizeof(token->key_id)}};
+    CK_ULONG n = 0;
+
+    t->tokens[i] = token;
+    if ((rv = ctx->funcs->C_OpenSession(token->slot, CKF_SERIAL_SESSION, NULL, NULL, &t->sessions[i])) != CKR_OK) {
+      t->failed = "C_OpenSession";
+      return rv;
+    }
+    if ((rv = ctx->funcs->C_FindObjectsInit(t->sessions[i], template, 2)) != CKR_OK ||
+        (rv = ctx->funcs->C_FindObjects(t->sessions[i], &t->keys[i], 1, &n)) != CKR_OK ||
+        (rv = ctx->funcs->C_FindObjectsFinal(t->sessions[i])) != CKR_OK || n != 1) {
+      t->failed = "C_FindObjects";
+      return rv == CKR_OK ? CKR_OBJECT_HANDLE_INVALID : rv;
+    }
+  }
+  return CKR_OK;
+}
+
+static CK_RV run_op(bench_thread *t, bench_op op, size_t i) {
+  CK_FUNCTION_LIST_3_0_PTR funcs = t->ctx->funcs;
+  CK_SESSION_HANDLE session = t->sessions[i];
+  CK_RV rv;
+
+  switch (op) {
+    case BENCH_SIGN: {
+      CK_MECHANISM mech = {sign_mechanism(t->tokens[i]->key_type), NULL, 0};
+      CK_BYTE data[32], sig[1024];
+      CK_ULONG sig_len = sizeof(sig);
+      memset(data, 0x5a, sizeof(data));
+      if ((rv = funcs->C_SignInit(session, &mech, t->keys[i])) != CKR_OK) {
+        return rv;
+      }
+      return funcs->C_Sign(session, data, sizeof(data), sig, &sig_len);
+    }
+    case BENCH_FIND: {
+      CK_OBJECT_CLASS class = CKO_CERTIFICATE;
+      CK_ATTRIBUTE template[] = {{CKA_CLASS, &class, sizeof(class)}};
+      CK_OBJECT_HANDLE objects[32];
+      CK_ULONG n = 0;
+      if ((rv = funcs->C_FindObjectsInit(session, template, 1)) != CKR_OK) {
+        return rv;
+      }
+      rv = funcs->C_FindObjects(session, objects, sizeof(objects) / sizeof(objects[0]), &n);
+      CK_RV rv2 = funcs->C_FindObjectsFinal(session);
+      return rv != CKR_OK ? rv : rv2;
+    }
+    default: {
+      CK_BYTE label[64], id = 0;
+      CK_ATTRIBUTE attrs[] = {{CKA_LABEL, label, sizeof(label)}, {CKA_ID, &id, sizeof(id)}};
+      return funcs->C_GetAttributeValue(session, t->keys[i], attrs, 2);
+    }
+  }
+}
+
+static void *bench_worker(void *arg) {
+  bench_thread *t = arg;
+  bench_ctx *ctx = t->ctx;
+
+  t->rv = open_sessions(t);
+  pthread_mutex_lock(&ctx->start_mutex);
+  ctx->ready++;
+  pthread_cond_broadcast(&ctx->start_cond);
+  while (!ctx->go) {
+    pthread_cond_wait(&ctx->start_cond, &ctx->start_mutex);
+  }
+  pthread_mutex_unlock(&ctx->start_mutex);
+
+  for (size_t n = 0; n < ctx->iterations && t->rv == CKR_OK; n++) {
+    size_t i = n % ctx->sessions;
+    for (bench_op op = 0; op < BENCH_OPS && t->rv == CKR_OK; op++) {
+      if (!ctx->ops[op]) {
+        continue;
+      }
+      uint64_t start = now_ns();
+      if ((t->rv = run_op(t, op, i)) != CKR_OK) {
+        t->failed = op_names[op];
+        break;
+      }
+      t->samples[op][t->n_samples[op]++] = (double)(now_ns() - start) / 1000000.0;
+    }
+  }
+  return NULL;
+}
+
+static void print_results(bench_ctx *ctx, bench_thread *threads, double wall_ms) {
+  bool first = true;
+
+  printf("{\n  \"threads\": %zu,\n  \"sessions\": %zu,\n  \"tokens\": %zu,\n  \"iterations\": %zu,\n", ctx->threads,
+         ctx->sessions, ctx->n_tokens, ctx->iterations);
+  printf("  \"wall_ms\": %.1f,\n  \"results\": [", wall_ms);
+  for (bench_op op = 0; op < BENCH_OPS; op++) {
+    size_t n = 0;
+    if (!ctx->ops[op]) {
+      continue;
+    }
+    for (size_t i = 0; i < ctx->threads; i++) {
+      n += threads[i].n_samples[op];
+    }
+    double *all = calloc(n ? n : 1, sizeof(double));
+    if (all == NULL) {
+      continue;
+    }
+    n = 0;
+    for (size_t i = 0; i < ctx->threads; i++) {
+      memcpy(all + n, threads[i].samples[op], threads[i].n_samples[op] * sizeof(double));
+      n += threads[i].n_samples[op];
+    }
+    qsort(all, n, sizeof(double), compare_samples);
+    printf("%s\n    {\"operation\": \"%s\", \"ops\": %zu", first ? "" : ",", op_names[op], n);
+    if (n) {
+      printf(", \"ops_per_sec\": %.2f, \"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f",
+             wall_ms > 0 ? n * 1000.0 / wall_ms : 0, percentile(all, n, 50), percentile(all, n, 90),
+             percentile(all, n, 99), all[n - 1]);
+    }
+    printf("}");
+    first = false;
+    free(all);
+  }
+  printf("\n  ],\n  \"locks\": [");
+
+  first = true;
+  for (lock_kind kind = 0; kind < LOCK_KINDS; kind++) {
+    uint64_t acquisitions = 0, contended = 0, wait_ns = 0, max_wait_ns = 0, hold_ns = 0;
+    for (size_t i = 0; i < n_mutexes; i++) {
+      if (mutexes[i]->kind == kind) {
+        acquisitions += mutexes[i]->acquisitions;
+        contended += mutexes[i]->contended;
+        wait_ns += mutexes[i]->wait_ns;
+        hold_ns += mutexes[i]->hold_ns;
+        if (mutexes[i]->max_wait_ns > max_wait_ns) {
+          max_wait_ns = mutexes[i]->max_wait_ns;
+        }
+      }
+    }
+    printf("%s\n    {\"lock\": \"%s\", \"acquisitions\": %llu, \"contended\": %llu, \"wait_ms\": %.3f, "
+           "\"max_wait_ms\": %.3f, \"hold_ms\": %.3f, \"wait_share\": %.3f}",
+           first ? "" : ",", lock_names[kind], (unsigned long long)acquisitions, (unsigned long long)contended,
+           wait_ns / 1000000.0, max_wait_ns / 1000000.0, hold_ns / 1000000.0,
+           wall_ms > 0 ? wait_ns / 1000000.0 / (wall_ms * ctx->threads) : 0);
+    first = false;
+  }
+  printf("\n  ]\n}\n");
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-t threads] [-s sessions per thread] [-k tokens] [-n iterations] [-p pin] "
+                  "[-o sign,find,attr]\n", name);
+  fprintf(stderr, "Signs with the first key of each token that needs neither touch nor a PIN for each use.\n");
+  fprintf(stderr, "Set YKCS11_MAX_SESSIONS when using more than 16 sessions, "
+                  "and YKPIV_ENV_HWTESTS_CONFIRMED=1 to run.\n");
+}
+
+static bool parse_ops(bench_ctx *ctx, char *list) {
+  memset(ctx->ops, 0, sizeof(ctx->ops));
+  for (char *op = strtok(list, ","); op; op = strtok(NULL, ",")) {
+    if (!strcmp(op, "sign")) {
+      ctx->ops[BENCH_SIGN] = true;
+    } else if (!strcmp(op, "find")) {
+      ctx->ops[BENCH_FIND] = true;
+    } else if (!strcmp(op, "attr")) {
+      ctx->ops[BENCH_ATTR] = true;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  bench_ctx ctx = {NULL, BENCH_DEFAULT_THREADS, BENCH_DEFAULT_SESSIONS, BENCH_DEFAULT_ITERATIONS, {true, true, true}};
+  CK_C_INITIALIZE_ARGS init_args = {bench_create_mutex, bench_destroy_mutex, bench_lock_mutex, bench_unlock_mutex,
+                                    CKF_OS_LOCKING_OK, NULL};
+  CK_INTERFACE_PTR interface;
+  CK_SLOT_ID slots[BENCH_MAX_TOKENS];
+  CK_ULONG n_slots = BENCH_MAX_TOKENS;
+  size_t max_tokens = BENCH_MAX_TOKENS;
+  const char *pin = BENCH_DEFAULT_PIN;
+  bench_thread *threads = NULL;
+  pthread_t *ids = NULL;
+  size_t started = 0;
+  uint64_t start = 0;
+  int ret = EXIT_FAILURE;
+  CK_RV rv;
+
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 < argc && !strcmp(argv[i], "-t")) {
+      ctx.threads = strtoul(argv[++i], NULL, 10);
+    } else if (i + 1 < argc && !strcmp(argv[i], "-s")) {
+      ctx.sessions = strtoul(argv[++i], NULL, 10);
+    } else if (i + 1 < argc && !strcmp(argv[i], "-k")) {
+      max_tokens = strtoul(argv[++i], NULL, 10);
+    } else if (i + 1 < argc && !strcmp(argv[i], "-n")) {
+      ctx.iterations = strtoul(argv[++i], NULL, 10);
+    } else if (i + 1 < argc && !strcmp(argv[i], "-p")) {
+      pin = argv[++i];
+    } else if (i + 1 < argc && !strcmp(argv[i], "-o") && parse_ops(&ctx, argv[i + 1])) {
+      i++;
+    } else {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  const char *confirmed = getenv("YKPIV_ENV_HWTESTS_CONFIRMED");
+  if (!confirmed || confirmed[0] != '1') {
+    usage(argv[0]);
+    return 77; // Skipped, as for the hardware tests
+  }
+  if (ctx.threads == 0 || ctx.sessions == 0 || ctx.sessions > BENCH_MAX_SESSIONS || ctx.iterations == 0 ||
+      max_tokens == 0) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (C_GetInterface(NULL, NULL, &interface, 0) != CKR_OK) {
+    return EXIT_FAILURE;
+  }
+  ctx.funcs = interface->pFunctionList;
+  if ((rv = ctx.funcs->C_Initialize(&init_args)) != CKR_OK) {
+    fprintf(stderr, "C_Initialize failed: 0x%lx\n", rv);
+    return EXIT_FAILURE;
+  }
+  if ((rv = ctx.funcs->C_GetSlotList(CK_TRUE, slots, &n_slots)) != CKR_OK || n_slots == 0) {
+    fprintf(stderr, "No tokens found: 0x%lx\n", rv);
+    goto out;
+  }
+
+  for (CK_ULONG i = 0; i < n_slots && ctx.n_tokens < max_tokens; i++) {
+    bench_token *token = &ctx.tokens[ctx.n_tokens];
+    token->slot = slots[i];
+    if ((rv = ctx.funcs->C_OpenSession(slots[i], CKF_SERIAL_SESSION, NULL, NULL, &token->login_session)) != CKR_OK) {
+      fprintf(stderr, "C_OpenSession on slot %lu failed: 0x%lx\n", slots[i], rv);
+      continue;
+    }
+    // Logging in applies to all sessions of the token, so this session stays open for the whole run
+    rv = ctx.funcs->C_Login(token->login_session, CKU_USER, (CK_UTF8CHAR_PTR)pin, strlen(pin));
+    if (rv != CKR_OK && rv != CKR_USER_ALREADY_LOGGED_IN) {
+      fprintf(stderr, "C_Login on slot %lu failed: 0x%lx\n", slots[i], rv);
+      ctx.funcs->C_CloseSession(token->login_session);
+      continue;
+    }
+    if (ctx.ops[BENCH_SIGN] || ctx.ops[BENCH_ATTR]) {
+      if (!find_key(&ctx, token)) {
+        fprintf(stderr, "Skipping slot %lu, it has no key to sign with\n", slots[i]);
+        ctx.funcs->C_CloseSession(token->login_session);
+        continue;
+      }
+    }
+    ctx.n_tokens++;
+  }
+  if (ctx.n_tokens == 0) {
+    goto out;
+  }
+
+  threads = calloc(ctx.threads, sizeof(bench_thread));
+  ids = calloc(ctx.threads, sizeof(pthread_t));
+  if (threads == NULL || ids == NULL) {
+    goto out;
+  }
+  pthread_mutex_init(&ctx.start_mutex, NULL);
+  pthread_cond_init(&ctx.start_cond, NULL);
+  for (size_t i = 0; i < ctx.threads; i++) {
+    threads[i].ctx = &ctx;
+    threads[i].id = i;
+    for (bench_op op = 0; op < BENCH_OPS; op++) {
+      if (ctx.ops[op] && !(threads[i].samples[op] = calloc(ctx.iterations, sizeof(double)))) {
+        goto join;
+      }
+    }
+    if (pthread_create(&ids[i], NULL, bench_worker, &threads[i])) {
+      goto join;
+    }
+    started++;
+  }
+
+  pthread_mutex_lock(&ctx.start_mutex);
+  while (ctx.ready < started) {
+    pthread_cond_wait(&ctx.start_cond, &ctx.start_mutex);
+  }
+  // Only count the locking of the timed loops
+  pthread_mutex_lock(&registry_mutex);
+  for (size_t i = 0; i < n_mutexes; i++) {
+    mutexes[i]->acquisitions = mutexes[i]->contended = 0;
+    mutexes[i]->wait_ns = mutexes[i]->max_wait_ns = mutexes[i]->hold_ns = 0;
+  }
+  pthread_mutex_unlock(&registry_mutex);
+  start = now_ns();
+  ctx.go = true;
+  pthread_cond_broadcast(&ctx.start_cond);
+  pthread_mutex_unlock(&ctx.start_mutex);
+
+join:
+  if (started < ctx.threads) {
+    // Let the threads that did start finish
+    pthread_mutex_lock(&ctx.start_mutex);
+    ctx.go = true;
+    pthread_cond_broadcast(&ctx.start_cond);
+    pthread_mutex_unlock(&ctx.start_mutex);
+  }
+  for (size_t i = 0; i < started; i++) {
+    pthread_join(ids[i], NULL);
+  }
+  if (started == ctx.threads) {
+    double wall_ms = (double)(now_ns() - start) / 1000000.0;
+    ret = EXIT_SUCCESS;
+    for (size_t i = 0; i < ctx.threads; i++) {
+      if (threads[i].rv != CKR_OK) {
+        fprintf(stderr, "Thread %zu: %s failed: 0x%lx\n", i, threads[i].failed, threads[i].rv);
+        ret = EXIT_FAILURE;
+      }
+    }
+    print_results(&ctx, threads, wall_ms);
+  }
+
+out:
+  ctx.funcs->C_Finalize(NULL);
+  if (threads) {
+    for (size_t i = 0; i < ctx.threads; i++) {
+      for (bench_op op = 0; op < BENCH_OPS; op++) {
+        free(threads[i].samples[op]);
+      }
+    }
+  }
+  free(threads);
+  free(ids);
+  for (size_t i = 0; i < n_mutexes; i++) {
+    free(mutexes[i]);
+  }
+  return ret;
+}
@@ -202,6 +202,7 @@ static void test_sign_edkey() {
 
 
   test_ed_sign_simple(funcs, session, pvtkey);
+  test_ed_verify_large(funcs, session, pvtkey, edkey);
 
   EVP_PKEY_free(edkey);
   destroy_test_objects(funcs, session, &pvtkey, 1);
@@ -79,6 +79,16 @@ static void get_versioned_functions(CK_BYTE major, CK_BYTE minor) {
   funcs = interface->pFunctionList;
 }
 
+static void test_vendor_interface() {
+  dprintf(0, "TEST START: test_vendor_interface()\n");
+  CK_INTERFACE_PTR interface;
+  asrt(C_GetInterface((CK_UTF8CHAR_PTR)YUBICO_INTERFACE_NAME,NULL,&interface,0), CKR_OK, "C_GetInterface vendor");
+  CK_YUBICO_FUNCTION_LIST_PTR yubico_funcs = interface->pFunctionList;
+  asrt(yubico_funcs->version.major, 1, "VENDOR_MAJ");
+  asrt(yubico_funcs->C_YUBICO_VerifyMessageBatch(0, 0, NULL, NULL, NULL, NULL, NULL), CKR_CRYPTOKI_NOT_INITIALIZED, "C_YUBICO_VerifyMessageBatch");
+  dprintf(0, "TEST END: test_vendor_interface()\n");
+}
+
 static void test_lib_info(CK_ULONG vmajor, CK_ULONG vminor) {
   dprintf(0, "TEST START: test_lib_info()\n");
 
@@ -105,7 +115,9 @@ static void test_lib_info(CK_ULONG vmajor, CK_ULONG vminor) {
 int main(void) {
   get_default_functions();
   test_lib_info(CRYPTOKI_VERSION_MAJOR, CRYPTOKI_VERSION_MINOR);
-  asrt(((CK_FUNCTION_LIST_3_0*)funcs)->C_SignMessage(0, NULL, 0, NULL, 0, NULL, NULL), CKR_FUNCTION_NOT_SUPPORTED, "C_SignMessage");
+  asrt(((CK_FUNCTION_LIST_3_0*)funcs)->C_SignMessage(0, NULL, 0, NULL, 0, NULL, NULL), CKR_CRYPTOKI_NOT_INITIALIZED, "C_SignMessage");
+  asrt(((CK_FUNCTION_LIST_3_0*)funcs)->C_VerifyMessage(0, NULL, 0, NULL, 0, NULL, 0), CKR_CRYPTOKI_NOT_INITIALIZED, "C_VerifyMessage");
+  test_vendor_interface();
 
   get_versioned_functions(CRYPTOKI_LEGACY_VERSION_MAJOR, CRYPTOKI_LEGACY_VERSION_MINOR);
   test_lib_info(CRYPTOKI_LEGACY_VERSION_MAJOR, CRYPTOKI_LEGACY_VERSION_MINOR);
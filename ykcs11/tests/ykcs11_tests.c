@@ -39,6 +39,7 @@
 #include <openssl/bn.h>
 #include <openssl/x509.h>
 #include <openssl/rand.h>
+#include <openssl/sha.h>
 
 #include "ykcs11_tests_util.h"
 
@@ -113,6 +114,21 @@ static void test_initalize() {
   dprintf(0, "TEST END: test_initalize()\n");
 }
 
+static void test_wait_for_slot_event() {
+  dprintf(0, "TEST START: test_wait_for_slot_event()\n");
+  CK_SLOT_ID slot;
+  CK_SLOT_ID slots[16];
+  CK_ULONG n_slots = 16;
+
+  asrt(funcs->C_Initialize(NULL), CKR_OK, "INITIALIZE");
+  asrt(funcs->C_WaitForSlotEvent(CKF_DONT_BLOCK, NULL, NULL), CKR_ARGUMENTS_BAD, "WaitForSlotEvent");
+  asrt(funcs->C_GetSlotList(CK_TRUE, slots, &n_slots), CKR_OK, "GetSlotList");
+  asrt(funcs->C_WaitForSlotEvent(CKF_DONT_BLOCK, &slot, NULL), CKR_NO_EVENT, "WaitForSlotEvent");
+  asrt(funcs->C_Finalize(NULL), CKR_OK, "FINALIZE");
+  asrt(funcs->C_WaitForSlotEvent(CKF_DONT_BLOCK, &slot, NULL), CKR_CRYPTOKI_NOT_INITIALIZED, "WaitForSlotEvent");
+  dprintf(0, "TEST END: test_wait_for_slot_event()\n");
+}
+
 static int test_token_info() {
   dprintf(0, "TEST START: test_token_info()\n");
 
@@ -205,13 +221,15 @@ static void test_mechanism_list_and_info() {
       CKM_SHA384,
       CKM_SHA512,
       CKM_EC_EDWARDS_KEY_PAIR_GEN,
-      CKM_EC_MONTGOMERY_KEY_PAIR_GEN};
+      CKM_EC_MONTGOMERY_KEY_PAIR_GEN,
+      CKM_AES_CBC_PAD,
+      CKM_AES_GCM};
 
   static const CK_MECHANISM_INFO token_mechanism_infos_3[] = { // KEEP ALIGNED WITH token_mechanisms
     {1024, 4096, CKF_HW | CKF_GENERATE_KEY_PAIR},
-    {1024, 4096, CKF_HW | CKF_ENCRYPT | CKF_DECRYPT | CKF_SIGN | CKF_VERIFY},
+    {1024, 4096, CKF_HW | CKF_ENCRYPT | CKF_DECRYPT | CKF_SIGN | CKF_VERIFY | CKF_UNWRAP},
     {1024, 4096, CKF_HW | CKF_SIGN | CKF_VERIFY},
-    {1024, 4096, CKF_HW | CKF_ENCRYPT | CKF_DECRYPT},
+    {1024, 4096, CKF_HW | CKF_ENCRYPT | CKF_DECRYPT | CKF_UNWRAP},
     {1024, 4096, CKF_HW | CKF_ENCRYPT | CKF_DECRYPT | CKF_SIGN | CKF_VERIFY},
     {1024, 4096, CKF_HW | CKF_SIGN | CKF_VERIFY},
     {1024, 4096, CKF_HW | CKF_SIGN | CKF_VERIFY},
@@ -234,14 +252,16 @@ static void test_mechanism_list_and_info() {
     {0, 0, CKF_DIGEST},
     {0, 0, CKF_DIGEST},
     {255, 255, CKF_HW | CKF_GENERATE_KEY_PAIR | CKF_EC_F_P | CKF_EC_NAMEDCURVE | CKF_EC_UNCOMPRESS},
-    {255, 255, CKF_HW | CKF_GENERATE_KEY_PAIR | CKF_EC_F_P | CKF_EC_NAMEDCURVE | CKF_EC_UNCOMPRESS}
+    {255, 255, CKF_HW | CKF_GENERATE_KEY_PAIR | CKF_EC_F_P | CKF_EC_NAMEDCURVE | CKF_EC_UNCOMPRESS},
+    {16, 32, CKF_ENCRYPT | CKF_DECRYPT},
+    {16, 32, CKF_ENCRYPT | CKF_DECRYPT | CKF_MESSAGE_ENCRYPT | CKF_MESSAGE_DECRYPT}
 };
 
   static const CK_MECHANISM_INFO token_mechanism_infos[] = { // KEEP ALIGNED WITH token_mechanisms
       {1024, 2048, CKF_HW | CKF_GENERATE_KEY_PAIR},
-      {1024, 2048, CKF_HW | CKF_ENCRYPT | CKF_DECRYPT | CKF_SIGN | CKF_VERIFY},
+      {1024, 2048, CKF_HW | CKF_ENCRYPT | CKF_DECRYPT | CKF_SIGN | CKF_VERIFY | CKF_UNWRAP},
       {1024, 2048, CKF_HW | CKF_SIGN | CKF_VERIFY},
-      {1024, 2048, CKF_HW | CKF_ENCRYPT | CKF_DECRYPT},
+      {1024, 2048, CKF_HW | CKF_ENCRYPT | CKF_DECRYPT | CKF_UNWRAP},
       {1024, 2048, CKF_HW | CKF_ENCRYPT | CKF_DECRYPT | CKF_SIGN | CKF_VERIFY},
       {1024, 2048, CKF_HW | CKF_SIGN | CKF_VERIFY},
       {1024, 2048, CKF_HW | CKF_SIGN | CKF_VERIFY},
@@ -264,7 +284,9 @@ static void test_mechanism_list_and_info() {
       {0, 0, CKF_DIGEST},
       {0, 0, CKF_DIGEST},
       {255, 255, CKF_HW | CKF_GENERATE_KEY_PAIR | CKF_EC_F_P | CKF_EC_NAMEDCURVE | CKF_EC_UNCOMPRESS},
-      {255, 255, CKF_HW | CKF_GENERATE_KEY_PAIR | CKF_EC_F_P | CKF_EC_NAMEDCURVE | CKF_EC_UNCOMPRESS}
+      {255, 255, CKF_HW | CKF_GENERATE_KEY_PAIR | CKF_EC_F_P | CKF_EC_NAMEDCURVE | CKF_EC_UNCOMPRESS},
+      {16, 32, CKF_ENCRYPT | CKF_DECRYPT},
+      {16, 32, CKF_ENCRYPT | CKF_DECRYPT | CKF_MESSAGE_ENCRYPT | CKF_MESSAGE_DECRYPT}
   };
 
   init_connection();
@@ -533,6 +555,74 @@ static void test_sign_eccp384() {
   dprintf(0, "TEST END: test_sign_eccp384()\n");
 }
 
+static void test_sign_message_ecdsa(EC_KEY *eck, CK_BYTE *data, CK_ULONG data_len, CK_BYTE *sig, CK_ULONG sig_len) {
+  CK_BYTE digest[SHA256_DIGEST_LENGTH] = {0};
+  SHA256(data, data_len, digest);
+  ECDSA_SIG *ecsig = ECDSA_SIG_new();
+  asrt(ecsig != NULL, 1, "ECDSA_SIG_new");
+  asrt(ECDSA_SIG_set0(ecsig, BN_bin2bn(sig, sig_len / 2, NULL), BN_bin2bn(sig + sig_len / 2, sig_len / 2, NULL)), 1, "ECDSA_SIG_set0");
+  asrt(ECDSA_do_verify(digest, sizeof(digest), ecsig, eck), 1, "ECDSA VERIFICATION");
+  ECDSA_SIG_free(ecsig);
+}
+
+static void test_sign_message() {
+  dprintf(0, "TEST START: test_sign_message()\n");
+  CK_BYTE     params[] = {0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07};
+  CK_OBJECT_HANDLE obj_pvtkey[N_SELECTED_KEYS]={0}, obj_cert[N_SELECTED_KEYS]={0};
+  CK_MECHANISM mech = {CKM_ECDSA_SHA256, NULL, 0};
+  CK_SESSION_HANDLE session;
+  CK_BYTE data[64] = {0};
+  CK_BYTE sig[64] = {0};
+  CK_ULONG sig_len;
+
+  init_connection();
+  asrt(funcs->C_OpenSession(0, CKF_SERIAL_SESSION | CKF_RW_SESSION, NULL, NULL, &session), CKR_OK, "OpenSession1");
+
+  EC_KEY *eck = import_ec_key(funcs, session, N_SELECTED_KEYS, NID_X9_62_prime256v1, 32, params, sizeof(params), obj_cert, obj_pvtkey);
+  if (eck == NULL)
+    exit(EXIT_FAILURE);
+
+  asrt(funcs->C_Login(session, CKU_USER, (CK_CHAR_PTR)"123456", 6), CKR_OK, "Login USER");
+  asrt(funcs->C_SignMessage(session, NULL, 0, data, sizeof(data), sig, &sig_len), CKR_OPERATION_NOT_INITIALIZED, "SignMessage uninitialized");
+  asrt(funcs->C_MessageSignInit(session, &mech, obj_pvtkey[0]), CKR_OK, "MessageSignInit");
+  asrt(funcs->C_SignInit(session, &mech, obj_pvtkey[0]), CKR_OPERATION_ACTIVE, "SignInit during MessageSign");
+
+  // Several independent messages with a single initialization
+  for (int i = 0; i < 4; i++) {
+    if (RAND_bytes(data, sizeof(data)) <= 0)
+      exit(EXIT_FAILURE);
+    asrt(funcs->C_Login(session, CKU_CONTEXT_SPECIFIC, (CK_CHAR_PTR)"123456", 6), CKR_OK, "Re-Login USER");
+    asrt(funcs->C_SignMessage(session, NULL, 0, data, sizeof(data), NULL, &sig_len), CKR_OK, "SignMessage size");
+    asrt(sig_len, 64, "Signature length");
+    asrt(funcs->C_SignMessage(session, NULL, 0, data, sizeof(data), sig, &sig_len), CKR_OK, "SignMessage");
+    test_sign_message_ecdsa(eck, data, sizeof(data), sig, sig_len);
+  }
+
+  // Multi-part messages
+  for (int i = 0; i < 2; i++) {
+    if (RAND_bytes(data, sizeof(data)) <= 0)
+      exit(EXIT_FAILURE);
+    asrt(funcs->C_Login(session, CKU_CONTEXT_SPECIFIC, (CK_CHAR_PTR)"123456", 6), CKR_OK, "Re-Login USER");
+    asrt(funcs->C_SignMessageBegin(session, NULL, 0), CKR_OK, "SignMessageBegin");
+    asrt(funcs->C_SignMessage(session, NULL, 0, data, sizeof(data), sig, &sig_len), CKR_OPERATION_ACTIVE, "SignMessage during multi-part");
+    asrt(funcs->C_SignMessageNext(session, NULL, 0, data, 20, NULL, NULL), CKR_OK, "SignMessageNext");
+    sig_len = sizeof(sig);
+    asrt(funcs->C_SignMessageNext(session, NULL, 0, data + 20, sizeof(data) - 20, sig, &sig_len), CKR_OK, "SignMessageNext last");
+    test_sign_message_ecdsa(eck, data, sizeof(data), sig, sig_len);
+  }
+
+  asrt(funcs->C_SignMessageNext(session, NULL, 0, data, sizeof(data), sig, &sig_len), CKR_OPERATION_NOT_INITIALIZED, "SignMessageNext not started");
+  asrt(funcs->C_MessageSignFinal(session), CKR_OK, "MessageSignFinal");
+  asrt(funcs->C_MessageSignFinal(session), CKR_OPERATION_NOT_INITIALIZED, "MessageSignFinal twice");
+  asrt(funcs->C_Logout(session), CKR_OK, "Logout USER");
+
+  EC_KEY_free(eck);
+  destroy_test_objects(funcs, session, obj_pvtkey, N_SELECTED_KEYS);
+  asrt(funcs->C_CloseSession(session), CKR_OK, "CloseSession");
+  asrt(funcs->C_Finalize(NULL), CKR_OK, "FINALIZE");
+  dprintf(0, "TEST END: test_sign_message()\n");
+}
+
 static void test_generate_rsa(CK_ULONG key_size, CK_BYTE n_keys) {
   CK_OBJECT_HANDLE obj_pvtkey[N_ALL_KEYS]={0}, obj_pubkey[N_ALL_KEYS]={0};
   CK_SESSION_HANDLE session;
@@ -936,6 +1026,7 @@ int main(void) {
   }
 
   test_initalize();
+  test_wait_for_slot_event();
   // Require YK4, YK5 or NEO to continue.  Skip if different model found.
   if (test_token_info() != 0) {
     exit(77);
@@ -958,6 +1049,7 @@ int main(void) {
   test_sign_eccp256();
   test_sign_eccp384();
   test_sign_rsakeys();
+  test_sign_message();
   test_decrypt_RSA();
   test_encrypt_RSA();
   test_key_attributes();
@@ -1005,6 +1005,38 @@ void test_ed_sign_simple(CK_FUNCTION_LIST_3_0_PTR funcs, CK_SESSION_HANDLE sessi
   asrt(funcs->C_Logout(session), CKR_OK, "Logout USER");
 }
 
+void test_ed_verify_large(CK_FUNCTION_LIST_3_0_PTR funcs, CK_SESSION_HANDLE session, CK_OBJECT_HANDLE pvtkey, EVP_PKEY *edkey) {
+
+  CK_MECHANISM mech = {CKM_EDDSA, NULL, 0};
+  CK_OBJECT_HANDLE pubkey = get_public_key_handle(funcs, session, pvtkey);
+
+  // Larger than the 4096 byte operation buffer
+  CK_BYTE data[10000] = {0};
+  if (RAND_bytes(data, sizeof(data)) <= 0)
+    exit(EXIT_FAILURE);
+
+  CK_BYTE sig[64] = {0};
+  size_t sig_len = sizeof(sig);
+  EVP_MD_CTX *md_ctx = EVP_MD_CTX_new();
+  if (md_ctx == NULL || EVP_DigestSignInit(md_ctx, NULL, NULL, NULL, edkey) <= 0 ||
+      EVP_DigestSign(md_ctx, sig, &sig_len, data, sizeof(data)) <= 0)
+    exit(EXIT_FAILURE);
+  EVP_MD_CTX_free(md_ctx);
+
+  asrt(funcs->C_VerifyInit(session, &mech, pubkey), CKR_OK, "VerifyInit");
+  asrt(funcs->C_Verify(session, data, sizeof(data), sig, sig_len), CKR_OK, "Verify");
+
+  asrt(funcs->C_VerifyInit(session, &mech, pubkey), CKR_OK, "VerifyInit");
+  for (CK_ULONG i = 0; i < sizeof(data); i += 1000) {
+    asrt(funcs->C_VerifyUpdate(session, data + i, 1000), CKR_OK, "VerifyUpdate");
+  }
+  asrt(funcs->C_VerifyFinal(session, sig, sig_len), CKR_OK, "VerifyFinal");
+
+  sig[0] ^= 1;
+  asrt(funcs->C_VerifyInit(session, &mech, pubkey), CKR_OK, "VerifyInit");
+  asrt(funcs->C_Verify(session, data, sizeof(data), sig, sig_len), CKR_SIGNATURE_INVALID, "Verify invalid");
+}
+
 void test_ec_ecdh_simple(CK_FUNCTION_LIST_3_0_PTR funcs, CK_SESSION_HANDLE session, CK_OBJECT_HANDLE_PTR obj_pvtkey,
                          CK_BYTE n_keys, int curve) {
                     
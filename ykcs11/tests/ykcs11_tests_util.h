@@ -71,6 +71,7 @@ void test_ec_ecdh_simple(CK_FUNCTION_LIST_3_0_PTR funcs, CK_SESSION_HANDLE sessi
                          CK_BYTE n_keys, int curve);
 
 void test_ed_sign_simple(CK_FUNCTION_LIST_3_0_PTR funcs, CK_SESSION_HANDLE session, CK_OBJECT_HANDLE obj_pvtkey);
+void test_ed_verify_large(CK_FUNCTION_LIST_3_0_PTR funcs, CK_SESSION_HANDLE session, CK_OBJECT_HANDLE obj_pvtkey, EVP_PKEY *edkey);
 
 void test_ec_sign_thorough(CK_FUNCTION_LIST_3_0_PTR funcs, CK_SESSION_HANDLE session, CK_OBJECT_HANDLE_PTR obj_pvtkey,
                            CK_MECHANISM_TYPE mech_type, EC_KEY *eck, CK_ULONG key_len);
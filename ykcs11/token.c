@@ -47,9 +47,9 @@ static const char *token_model = "YubiKey XXX";
 
 static const token_mechanism token_mechanisms[] = {
   CKM_RSA_PKCS_KEY_PAIR_GEN, {MIN_RSA_KEY_SIZE, MAX_RSA_KEY_SIZE, CKF_HW | CKF_GENERATE_KEY_PAIR},
-  CKM_RSA_PKCS, {MIN_RSA_KEY_SIZE, MAX_RSA_KEY_SIZE, CKF_HW | CKF_ENCRYPT | CKF_DECRYPT | CKF_SIGN | CKF_VERIFY},
+  CKM_RSA_PKCS, {MIN_RSA_KEY_SIZE, MAX_RSA_KEY_SIZE, CKF_HW | CKF_ENCRYPT | CKF_DECRYPT | CKF_SIGN | CKF_VERIFY | CKF_UNWRAP},
   CKM_RSA_PKCS_PSS, {MIN_RSA_KEY_SIZE, MAX_RSA_KEY_SIZE, CKF_HW | CKF_SIGN | CKF_VERIFY},
-  CKM_RSA_PKCS_OAEP, {MIN_RSA_KEY_SIZE, MAX_RSA_KEY_SIZE, CKF_HW | CKF_ENCRYPT | CKF_DECRYPT},
+  CKM_RSA_PKCS_OAEP, {MIN_RSA_KEY_SIZE, MAX_RSA_KEY_SIZE, CKF_HW | CKF_ENCRYPT | CKF_DECRYPT | CKF_UNWRAP},
   CKM_RSA_X_509, {MIN_RSA_KEY_SIZE, MAX_RSA_KEY_SIZE, CKF_HW | CKF_ENCRYPT | CKF_DECRYPT | CKF_SIGN | CKF_VERIFY},
   CKM_SHA1_RSA_PKCS, {MIN_RSA_KEY_SIZE, MAX_RSA_KEY_SIZE, CKF_HW | CKF_SIGN | CKF_VERIFY},
   CKM_SHA256_RSA_PKCS, {MIN_RSA_KEY_SIZE, MAX_RSA_KEY_SIZE, CKF_HW | CKF_SIGN | CKF_VERIFY},
@@ -73,7 +73,10 @@ static const token_mechanism token_mechanisms[] = {
   CKM_SHA384, {0, 0, CKF_DIGEST},
   CKM_SHA512, {0, 0, CKF_DIGEST},
   CKM_EC_EDWARDS_KEY_PAIR_GEN, {255, 255, CKF_HW | CKF_GENERATE_KEY_PAIR | CKF_EC_F_P | CKF_EC_NAMEDCURVE | CKF_EC_UNCOMPRESS},
-  CKM_EC_MONTGOMERY_KEY_PAIR_GEN, {255, 255, CKF_HW | CKF_GENERATE_KEY_PAIR | CKF_EC_F_P | CKF_EC_NAMEDCURVE | CKF_EC_UNCOMPRESS}
+  CKM_EC_MONTGOMERY_KEY_PAIR_GEN, {255, 255, CKF_HW | CKF_GENERATE_KEY_PAIR | CKF_EC_F_P | CKF_EC_NAMEDCURVE | CKF_EC_UNCOMPRESS},
+  // Done on the host, with secret keys unwrapped or derived into the session
+  CKM_AES_CBC_PAD, {16, 32, CKF_ENCRYPT | CKF_DECRYPT},
+  CKM_AES_GCM, {16, 32, CKF_ENCRYPT | CKF_DECRYPT | CKF_MESSAGE_ENCRYPT | CKF_MESSAGE_DECRYPT}
 };
 
 // The commented out objects below are either not supported (PIV_DATA_OBJ_BITGT) or requires authentication.
@@ -117,16 +120,14 @@ static const piv_obj_id_t token_objects[] = { // TODO: is there a way to get thi
     PIV_DATA_OBJ_PC_REF_DATA,     // Pairing code reference data
 };
 
-CK_RV get_token_model(ykpiv_state *state, CK_UTF8CHAR_PTR str, CK_ULONG len) {
+CK_RV get_token_model(const ykpiv_device_info *info, CK_UTF8CHAR_PTR str, CK_ULONG len) {
 
   if (strlen(token_model) > len)
     return CKR_BUFFER_TOO_SMALL;
 
-  ykpiv_devmodel model = ykpiv_util_devicemodel(state);
-
   uint8_t *ptr = str + memstrcpy(str, len, token_model) - 3;
 
-  switch(model) {
+  switch(info->model) {
     case DEVTYPE_NEOr3:
       memstrcpy(ptr, 3, "NEO");
       break;
@@ -141,34 +142,22 @@ CK_RV get_token_model(ykpiv_state *state, CK_UTF8CHAR_PTR str, CK_ULONG len) {
   return CKR_OK;
 }
 
-CK_RV get_token_version(ykpiv_state *state, CK_VERSION_PTR version) {
-
-  char buf[16] = {0};
-  ykpiv_rc rc;
+CK_RV get_token_version(const ykpiv_device_info *info, CK_VERSION_PTR version) {
 
   if (version == NULL)
     return CKR_ARGUMENTS_BAD;
 
-  if ((rc = ykpiv_get_version(state, buf, sizeof(buf))) != YKPIV_OK) {
-    version->major = 0;
-    version->minor = 0;
-    return yrc_to_rv(rc);
-  }
-
-  version->major = (buf[0] - '0');
-  version->minor = (buf[2] - '0') * 10 + (buf[4] - '0');
+  version->major = info->major;
+  version->minor = info->minor * 10 + info->patch;
 
   return CKR_OK;
 }
 
-CK_RV get_token_serial(ykpiv_state *state, CK_CHAR_PTR str, CK_ULONG len) {
+CK_RV get_token_serial(const ykpiv_device_info *info, CK_CHAR_PTR str, CK_ULONG len) {
 
-  uint32_t serial = 0;
   char buf[64] = {0};
 
-  ykpiv_rc rc = ykpiv_get_serial(state, &serial);
-
-  int actual = snprintf(buf, sizeof(buf), "%u", serial);
+  int actual = snprintf(buf, sizeof(buf), "%u", info->serial);
 
   if(actual < 0)
     return CKR_FUNCTION_FAILED;
@@ -178,17 +167,14 @@ CK_RV get_token_serial(ykpiv_state *state, CK_CHAR_PTR str, CK_ULONG len) {
 
   memstrcpy(str, len, buf);
 
-  return yrc_to_rv(rc);
+  return CKR_OK;
 }
 
-CK_RV get_token_label(ykpiv_state *state, CK_CHAR_PTR str, CK_ULONG len) {
+CK_RV get_token_label(const ykpiv_device_info *info, CK_CHAR_PTR str, CK_ULONG len) {
 
-  uint32_t serial = 0;
   char buf[64] = {0};
 
-  ykpiv_rc rc = ykpiv_get_serial(state, &serial);
-
-  int actual = snprintf(buf, sizeof(buf), "YubiKey PIV #%u", serial);
+  int actual = snprintf(buf, sizeof(buf), "YubiKey PIV #%u", info->serial);
 
   if(actual < 0)
     return CKR_FUNCTION_FAILED;
@@ -198,7 +184,7 @@ CK_RV get_token_label(ykpiv_state *state, CK_CHAR_PTR str, CK_ULONG len) {
 
   memstrcpy(str, len, buf);
 
-  return yrc_to_rv(rc);
+  return CKR_OK;
 }
 
 CK_RV get_token_mechanism_list(CK_MECHANISM_TYPE_PTR mec, CK_ULONG_PTR num) {
@@ -463,6 +449,15 @@ CK_RV token_generate_key(ykpiv_state *state, gen_info_t *gen, CK_BYTE key, CK_BY
     return yrc_to_rv(res);
   }
 
+  if(gen->skip_cert) {
+    if(is_version_compatible(state, 5, 3, 0)) {
+      // The public key is found through the metadata of the key instead
+      *cert_len = 0;
+      return CKR_OK;
+    }
+    DBG("Storing a certificate anyway, keys without one can only be found with firmware 5.3.0 or later");
+  }
+
   snprintf(label, sizeof(label), "YubiKey PIV Slot %x", key);
 
   // Create a new empty certificate for the key
@@ -495,10 +490,9 @@ CK_RV token_generate_key(ykpiv_state *state, gen_info_t *gen, CK_BYTE key, CK_BY
   return CKR_OK;
 }
 
-CK_RV token_import_cert(ykpiv_state *state, CK_ULONG cert_id, CK_BYTE_PTR in, CK_ULONG in_len) {
+CK_RV token_encode_cert(CK_BYTE_PTR in, CK_ULONG in_len, CK_BYTE_PTR out, CK_ULONG_PTR out_len) {
 
-  unsigned char certdata[YKPIV_OBJ_MAX_SIZE + 16] = {0};
-  size_t certdata_len = sizeof(certdata);
+  size_t certdata_len = *out_len;
   CK_ULONG cert_len;
   ykpiv_rc res;
   CK_RV rv;
@@ -509,10 +503,24 @@ CK_RV token_import_cert(ykpiv_state *state, CK_ULONG cert_id, CK_BYTE_PTR in, CK
     return rv;
   }
 
-  if ((res = ykpiv_util_write_certdata(in, cert_len, YKPIV_CERTINFO_UNCOMPRESSED, certdata, &certdata_len)) != YKPIV_OK) {
+  if ((res = ykpiv_util_write_certdata(in, cert_len, YKPIV_CERTINFO_AUTO, out, &certdata_len)) != YKPIV_OK) {
     return yrc_to_rv(res);
   }
 
+  *out_len = certdata_len;
+  return CKR_OK;
+}
+
+CK_RV token_import_cert(ykpiv_state *state, CK_ULONG cert_id, CK_BYTE_PTR in, CK_ULONG in_len) {
+
+  unsigned char certdata[YKPIV_OBJ_MAX_SIZE + 16] = {0};
+  CK_ULONG certdata_len = sizeof(certdata);
+  ykpiv_rc res;
+  CK_RV rv;
+
+  if ((rv = token_encode_cert(in, in_len, certdata, &certdata_len)) != CKR_OK)
+    return rv;
+
   // Store the certificate into the token
   if ((res = ykpiv_save_object(state, cert_id, certdata, certdata_len)) != YKPIV_OK)
     return yrc_to_rv(res);
@@ -34,10 +34,10 @@
 #include "obj_types.h"
 #include "ykpiv.h"
 
-CK_RV get_token_model(ykpiv_state *state, CK_UTF8CHAR_PTR str, CK_ULONG len);
-CK_RV get_token_serial(ykpiv_state *state, CK_CHAR_PTR str, CK_ULONG len);
-CK_RV get_token_version(ykpiv_state *state, CK_VERSION_PTR version);
-CK_RV get_token_label(ykpiv_state *state, CK_CHAR_PTR str, CK_ULONG len);
+CK_RV get_token_model(const ykpiv_device_info *info, CK_UTF8CHAR_PTR str, CK_ULONG len);
+CK_RV get_token_serial(const ykpiv_device_info *info, CK_CHAR_PTR str, CK_ULONG len);
+CK_RV get_token_version(const ykpiv_device_info *info, CK_VERSION_PTR version);
+CK_RV get_token_label(const ykpiv_device_info *info, CK_CHAR_PTR str, CK_ULONG len);
 
 CK_RV get_token_mechanism_list(CK_MECHANISM_TYPE_PTR mec, CK_ULONG_PTR num);
 CK_RV get_token_mechanism_info(CK_MECHANISM_TYPE mec, CK_MECHANISM_INFO_PTR info);
@@ -48,6 +48,7 @@ CK_RV token_change_pin(ykpiv_state *state, CK_USER_TYPE user_type, CK_UTF8CHAR_P
 
 CK_RV token_login(ykpiv_state *state, CK_USER_TYPE user, CK_UTF8CHAR_PTR pin, CK_ULONG pin_len);
 CK_RV token_generate_key(ykpiv_state *state, gen_info_t*, CK_BYTE key, CK_BYTE_PTR cert_data, CK_ULONG_PTR cert_len);
+CK_RV token_encode_cert(CK_BYTE_PTR in, CK_ULONG in_len, CK_BYTE_PTR out, CK_ULONG_PTR out_len);
 CK_RV token_import_cert(ykpiv_state *state, CK_ULONG cert_id, CK_BYTE_PTR in, CK_ULONG in_len);
 CK_RV token_delete_cert(ykpiv_state *state, CK_ULONG cert_id);
 
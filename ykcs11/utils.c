@@ -37,6 +37,7 @@
 #else
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
 #endif
 
 #include "utils.h"
@@ -136,6 +137,38 @@ CK_RV native_unlock_mutex(void *mutex) {
   return CKR_OK;
 }
 
+uint64_t get_time_us(void) {
+#ifdef _WIN32
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+  if(!freq.QuadPart) {
+    QueryPerformanceFrequency(&freq);
+  }
+  QueryPerformanceCounter(&now);
+  return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000 + (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+#endif
+}
+
+long atomic_add_long(volatile long *value, long delta) {
+#ifdef _WIN32
+  return InterlockedExchangeAdd(value, delta) + delta;
+#else
+  return __atomic_add_fetch(value, delta, __ATOMIC_ACQ_REL);
+#endif
+}
+
+long atomic_load_long(volatile long *value) {
+#ifdef _WIN32
+  return InterlockedCompareExchange(value, 0, 0);
+#else
+  return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+#endif
+}
+
 CK_RV get_pid(uint64_t *pid) {
 #ifdef _WIN32
   *pid = _getpid();
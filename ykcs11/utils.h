@@ -45,6 +45,10 @@ CK_RV native_destroy_mutex(void *mutex);
 CK_RV native_lock_mutex(void *mutex);
 CK_RV native_unlock_mutex(void *mutex);
 
+uint64_t get_time_us(void);
+long atomic_add_long(volatile long *value, long delta); // Returns the new value
+long atomic_load_long(volatile long *value);
+
 CK_RV get_pid(uint64_t *pid);
 CK_RV check_pid(uint64_t pid);
 
@@ -31,16 +31,20 @@
 #include "ykcs11.h"
 #include "ykcs11-config.h"
 #include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
 #include "ykpiv.h"
 #include <string.h>
 #include "obj_types.h"
 #include "objects.h"
 #include "utils.h"
+#include "threads.h"
 #include "mechanisms.h"
 #include "token.h"
 #include "openssl_types.h"
 #include "openssl_utils.h"
 #include "debug.h"
+#include "cache.h"
 
 #include <stdbool.h>
 
@@ -48,49 +52,180 @@
 #define YKCS11_LIBDESC      "PKCS#11 PIV Library (SP-800-73)"
 
 #define YKCS11_MAX_SLOTS       64
-#define YKCS11_MAX_SESSIONS    16
+#define YKCS11_DEFAULT_SESSIONS 16
+#define YKCS11_SESSION_BITS    16 // Low bits of a session handle hold the session index + 1
+#define YKCS11_SESSION_MASK    ((1UL << YKCS11_SESSION_BITS) - 1)
+#define YKCS11_READERS_LEN     2048
+#define YKCS11_EVENT_WAIT_MS   1000
+#define YKCS11_SLOT_MAP_SIZE   128 // Power of two, at least twice YKCS11_MAX_SLOTS
 
 static ykcs11_slot_t slots[YKCS11_MAX_SLOTS];
 static CK_ULONG      n_slots = 0;
+static CK_BYTE       slot_map[YKCS11_SLOT_MAP_SIZE]; // Hashed slot descriptions, slot index + 1
 
-static ykcs11_session_t sessions[YKCS11_MAX_SESSIONS];
+static ykcs11_session_t *sessions;
+static CK_ULONG         max_sessions;
+static CK_ULONG         free_session; // Index of the first free session + 1, or 0
+static CK_BYTE          *free_bufs;   // Released operation buffers, linked through their first bytes
 
 static CK_C_INITIALIZE_ARGS locking;
 static void *global_mutex;
+static ykcs11_lock_stats_t global_lock_stats;
+static void *event_mutex;
+static ykpiv_state *event_state;
+static ykpiv_state *list_state; // Protected by the global mutex
+static CK_BBOOL slots_listed;
+static CK_BBOOL slots_current; // Slots match the readers as of the last status query on list_state
+static CK_BBOOL finalizing;
 static uint64_t pid;
+static CK_BBOOL lazy_load;
+static CK_BBOOL defer_context_login;
+static CK_BBOOL prefetch;
+static CK_BBOOL generate_without_cert;
+static CK_ULONG verify_threads;
+static uint32_t coalesce_ms; // Longest time the PC/SC transaction of a slot is kept for waiting operations
+static CK_BBOOL lock_stats; // Count waiting for and holding the global and slot mutexes
+static uint64_t pin_retries_us; // Longest time C_GetTokenInfo serves the PIN attempts last seen by libykpiv, 0 for no limit
+static uint32_t write_behind_ms; // Delay before queued object writes are flushed, 0 to write objects right away
+static const char *broker_sockets; // Colon separated, the slots are these brokers instead of the PC/SC readers
 int verbose;
 
 static const CK_FUNCTION_LIST function_list;
 static const CK_FUNCTION_LIST_3_0 function_list_3;
+static const CK_YUBICO_FUNCTION_LIST yubico_function_list;
 
 static const CK_INTERFACE interfaces_list[] = {{(CK_CHAR_PTR) "PKCS 11",
                                                    (CK_VOID_PTR)&function_list_3, 0},
                                                {(CK_CHAR_PTR) "PKCS 11",
-                                                   (CK_VOID_PTR)&function_list, 0}};
+                                                   (CK_VOID_PTR)&function_list, 0},
+                                               {(CK_CHAR_PTR) YUBICO_INTERFACE_NAME,
+                                                   (CK_VOID_PTR)&yubico_function_list, 0}};
+
+
+static void lock_mutex(void *mutex, ykcs11_lock_stats_t *stats, const char *function) {
+  if(!lock_stats) {
+    locking.pfnLockMutex(mutex);
+    return;
+  }
+  CK_BBOOL contended = atomic_add_long(&stats->users, 1) > 1;
+  uint64_t start = get_time_us();
+  locking.pfnLockMutex(mutex);
+  uint64_t now = get_time_us();
+  uint64_t wait = now - start;
+  stats->acquisitions++;
+  if(contended) {
+    stats->contended++;
+  }
+  stats->wait_us += wait;
+  if(wait > stats->max_wait_us) {
+    stats->max_wait_us = wait;
+    stats->max_wait_holder = contended ? stats->last_holder : NULL;
+  }
+  stats->holder = function;
+  stats->acquired_us = now;
+}
+
+static void unlock_mutex(void *mutex, ykcs11_lock_stats_t *stats) {
+  if(lock_stats) {
+    uint64_t hold = get_time_us() - stats->acquired_us;
+    stats->hold_us += hold;
+    if(hold > stats->max_hold_us) {
+      stats->max_hold_us = hold;
+      stats->max_hold_function = stats->holder;
+    }
+    stats->last_holder = stats->holder;
+    stats->holder = NULL;
+    atomic_add_long(&stats->users, -1);
+  }
+  locking.pfnUnlockMutex(mutex);
+}
 
+#define lock_global() lock_mutex(global_mutex, &global_lock_stats, __func__)
+#define unlock_global() unlock_mutex(global_mutex, &global_lock_stats)
 
 static CK_SESSION_HANDLE get_session_handle(ykcs11_session_t *session) {
-  return (CK_SESSION_HANDLE)(session - sessions + 1);
+  return (CK_SESSION_HANDLE)((session->generation << YKCS11_SESSION_BITS) | (CK_ULONG)(session - sessions + 1));
 }
 
 static ykcs11_session_t* get_session(CK_SESSION_HANDLE handle) {
-  if(handle < 1 || handle > YKCS11_MAX_SESSIONS)
+  CK_ULONG index = handle & YKCS11_SESSION_MASK;
+  if(index < 1 || index > max_sessions)
+    return NULL;
+  ykcs11_session_t *session = sessions + index - 1;
+  // Handles of closed sessions are stale even if the session has been re-opened
+  if(get_session_handle(session) != handle)
     return NULL;
-  return sessions + handle - 1;
+  return session;
 }
 
+// Must be called with the global mutex held
 static ykcs11_session_t* get_free_session(void) {
-  for(int i = 0; i < YKCS11_MAX_SESSIONS; i++) {
-    if(sessions[i].slot == NULL) {
-      return sessions + i;
-    }
+  if(free_session == 0) {
+    return NULL;
   }
-  return NULL;
+  ykcs11_session_t *session = sessions + free_session - 1;
+  free_session = session->next_free;
+  session->next_free = 0;
+  return session;
+}
+
+static CK_RV get_op_buf(ykcs11_session_t *session) {
+  if(session->op_info.buf) {
+    return CKR_OK;
+  }
+  lock_global();
+  CK_BYTE *buf = free_bufs;
+  if(buf) {
+    memcpy(&free_bufs, buf, sizeof(free_bufs));
+  }
+  unlock_global();
+  if(buf == NULL && (buf = malloc(YKCS11_OP_BUF_LEN)) == NULL) {
+    DBG("Unable to allocate operation buffer");
+    return CKR_HOST_MEMORY;
+  }
+  session->op_info.buf = buf;
+  session->op_info.buf_size = YKCS11_OP_BUF_LEN;
+  return CKR_OK;
 }
 
+// Must be called with the global mutex held
 static void cleanup_session(ykcs11_session_t *session) {
   DBG("Cleaning up session %lu", get_session_handle(session));
+  CK_ULONG generation = session->generation + 1;
+  // Operation buffers may hold sensitive data, clear them before they are re-used
+  if(session->op_info.buf) {
+    OPENSSL_cleanse(session->op_info.buf, session->op_info.buf_size);
+    if(session->op_info.buf_size > YKCS11_OP_BUF_LEN) {
+      // Only buffers of the regular size are re-used
+      free(session->op_info.buf);
+    } else {
+      memcpy(session->op_info.buf, &free_bufs, sizeof(free_bufs));
+      free_bufs = session->op_info.buf;
+    }
+    // Released here only, the mechanism cleanups below must not shrink or clear it again
+    session->op_info.buf = NULL;
+    session->op_info.buf_size = 0;
+    session->op_info.buf_len = 0;
+  }
+  OPENSSL_cleanse(session->op_info.context_pin, sizeof(session->op_info.context_pin));
+  if(session->op_info.type == YKCS11_MESSAGE_SIGN) {
+    sign_mechanism_cleanup(session);
+  } else if(session->op_info.type == YKCS11_MESSAGE_VERIFY) {
+    verify_mechanism_cleanup(session);
+  } else if(session->op_info.type == YKCS11_MESSAGE_ENCRYPT || session->op_info.type == YKCS11_MESSAGE_DECRYPT ||
+            ((session->op_info.type == YKCS11_ENCRYPT || session->op_info.type == YKCS11_DECRYPT) &&
+             is_cipher_mechanism(session->op_info.mechanism))) {
+    cipher_mechanism_cleanup(session);
+  } else if(session->op_info.type == YKCS11_ENCRYPT || session->op_info.type == YKCS11_DECRYPT) {
+    encrypt_mechanism_cleanup(session);
+  }
+  OPENSSL_cleanse(session->keys, sizeof(session->keys));
+  free(session->find_obj.objects);
+  session->slot->n_sessions--;
   memset(session, 0, sizeof(*session));
+  session->generation = generation & (((CK_ULONG)-1) >> YKCS11_SESSION_BITS);
+  session->next_free = free_session;
+  free_session = (CK_ULONG)(session - sessions + 1);
 }
 
 static void cleanup_slot(ykcs11_slot_t *slot) {
@@ -106,10 +241,579 @@ static void cleanup_slot(ykcs11_slot_t *slot) {
   memset(slot->pin_policy, 0, sizeof(slot->pin_policy));
   memset(slot->touch_policy, 0, sizeof(slot->touch_policy));
   memset(slot->objects, 0, sizeof(slot->objects));
+  memset(slot->loaded, 0, sizeof(slot->loaded));
+  // Anything still queued is discarded, the callers flush first
+  for(size_t i = 0; i < sizeof(slot->pending) / sizeof(slot->pending[0]); i++) {
+    free(slot->pending[i].data);
+    slot->pending[i].data = NULL;
+    slot->pending[i].len = 0;
+  }
+  memset(slot->dirty, 0, sizeof(slot->dirty));
+  slot->pending_us = 0;
+  slot->write_rv = CKR_OK;
   slot->login_state = YKCS11_PUBLIC;
   slot->n_objects = 0;
 }
 
+static ykpiv_rc load_key_metadata(ykcs11_slot_t *slot, CK_BYTE sub_id) {
+  piv_obj_id_t pubk_id = find_pubk_object(sub_id);
+  piv_obj_id_t pvtk_id = find_pvtk_object(sub_id);
+  CK_ULONG key = piv_2_ykpiv(pvtk_id);
+  CK_BYTE data[YKPIV_OBJ_MAX_SIZE] = {0};
+  size_t len = sizeof(data);
+  ykpiv_rc rc;
+  CK_RV rv;
+
+  if((rc = ykpiv_get_metadata(slot->piv_state, key, data, &len)) == YKPIV_OK) {
+    DBG("Fetched %zu bytes metadata for object %u slot %lx", len, pvtk_id, key);
+    ykpiv_metadata md = {0};
+    if((rc = ykpiv_util_parse_metadata(data, len, &md)) == YKPIV_OK) {
+      slot->origin[sub_id] = md.origin;
+      slot->pin_policy[sub_id] = md.pin_policy;
+      slot->touch_policy[sub_id] = md.touch_policy;
+      if(md.pubkey_len) {
+        drop_attributes(slot, sub_id);
+        if((rv = do_create_public_key(md.pubkey, md.pubkey_len, md.algorithm, &slot->pkeys[sub_id])) == CKR_OK) {
+          add_object(slot, pvtk_id);
+          add_object(slot, pubk_id);
+        } else {
+          DBG("Failed to create public key for slot %lx, algorithm %u from metadata: %lu", key, md.algorithm, rv);
+        }
+      }
+    } else {
+      DBG("Failed to parse metadata for object %u slot %lx: %s", pvtk_id, key, ykpiv_strerror(rc));
+    }
+  } else {
+    DBG("Failed to fetch metadata for object %u slot %lx: %s", pvtk_id, key, ykpiv_strerror(rc));
+  }
+  return rc;
+}
+
+static void load_token_object(ykcs11_slot_t *slot, piv_obj_id_t obj_id) {
+  CK_RV rv;
+  ykpiv_rc rc = YKPIV_KEY_ERROR;
+  ykpiv_rc rcc;
+  CK_BYTE sub_id = get_sub_id(obj_id);
+  piv_obj_id_t cert_id = find_cert_object(sub_id);
+  piv_obj_id_t pubk_id = find_pubk_object(sub_id);
+  piv_obj_id_t pvtk_id = find_pvtk_object(sub_id);
+  piv_obj_id_t atst_id = find_atst_object(sub_id);
+  CK_BYTE data[YKPIV_OBJ_MAX_SIZE] = {0}; // Max cert value for ykpiv
+  size_t len;
+  if(pvtk_id != PIV_INVALID_OBJ && slot->pkeys[sub_id]) {
+    // Found by load_key_metadata(), which also set the origin and policies, so only the attestation is added now
+    CK_ULONG key = piv_2_ykpiv(pvtk_id);
+    rc = YKPIV_OK;
+    len = sizeof(data);
+    if(slot->origin[sub_id] != YKPIV_METADATA_ORIGIN_GENERATED) {
+      DBG("No attestation for object %u slot %lx, the key wasn't generated on the YubiKey", pvtk_id, key);
+    } else if((rcc = ykpiv_attest(slot->piv_state, key, data, &len)) == YKPIV_OK) {
+      DBG("Created attestation for object %u slot %lx", pvtk_id, key);
+      drop_attributes(slot, sub_id);
+      if((rv = do_store_cert(data, len, &slot->atst[sub_id])) == CKR_OK) {
+        if (atst_id != PIV_INVALID_OBJ)
+          add_object(slot, atst_id);
+      } else {
+        DBG("Failed to store attestation certificate object %u in session: %lu", atst_id, rv);
+      }
+    } else {
+      DBG("Failed to create attestation for object %u slot %lx: %s", pvtk_id, key, ykpiv_strerror(rcc));
+    }
+  } else if(pvtk_id != PIV_INVALID_OBJ) {
+    slot->origin[sub_id] = 0;
+    slot->pin_policy[sub_id] = 0;
+    slot->touch_policy[sub_id] = 0;
+    CK_ULONG key = piv_2_ykpiv(pvtk_id);
+    len = sizeof(data);
+    if((rc = ykpiv_attest(slot->piv_state, key, data, &len)) == YKPIV_OK) {
+      slot->origin[sub_id] = YKPIV_METADATA_ORIGIN_GENERATED;
+      DBG("Created attestation for object %u slot %lx", pvtk_id, key);
+      drop_attributes(slot, sub_id);
+      if((rv = do_store_cert(data, len, &slot->atst[sub_id])) == CKR_OK) {
+        if ((rv = do_parse_attestation(slot->atst[sub_id], &slot->pin_policy[sub_id], &slot->touch_policy[sub_id])) != CKR_OK) {
+          DBG("Failed to parse pin and touch policy from attestation for object %u slot %lx: %lu", pvtk_id, key, rv);
+        }
+        if (atst_id != PIV_INVALID_OBJ)
+          add_object(slot, atst_id);
+        if((rv = do_store_pubk(slot->atst[sub_id], &slot->pkeys[sub_id])) == CKR_OK) {
+          add_object(slot, pvtk_id);
+          add_object(slot, pubk_id);
+        } else {
+          DBG("Failed to store key objects %u and %u in session: %lu", pubk_id, pvtk_id, rv);
+        }
+      } else {
+        DBG("Failed to store attestation certificate object %u in session: %lu", atst_id, rv);
+      }
+    } else {
+      DBG("Failed to create attestation for object %u slot %lx: %s", pvtk_id, key, ykpiv_strerror(rc));
+      rc = load_key_metadata(slot, sub_id);
+    }
+  }
+  unsigned long ulen = sizeof(data);
+  rcc = ykpiv_fetch_object(slot->piv_state, piv_2_ykpiv(obj_id), data, &ulen);
+  if(rcc != YKPIV_OK) {
+    DBG("Failed to fetch object %u slot %lx: %s", obj_id, piv_2_ykpiv(obj_id), ykpiv_strerror(rcc));
+    return;
+  }
+  DBG("Fetched %lu bytes for object %u slot %lx", ulen, obj_id, piv_2_ykpiv(obj_id));
+  rv = store_data(slot, sub_id, data, ulen);
+  if (rv != CKR_OK) {
+    DBG("Failed to store data object %u in session: %lu", obj_id, rv);
+    return;
+  }
+  add_object(slot, obj_id);
+  if(cert_id != PIV_INVALID_OBJ) {
+    rv = store_cert(slot, sub_id, data, ulen, CK_FALSE); // Will only overwrite key if not set from attestation or metadata
+    if (rv != CKR_OK) {
+      DBG("Failed to store certificate object %u in session: %lu", cert_id, rv);
+      return; // Bail out, can't create key objects without the public key from the cert
+    }
+    add_object(slot, cert_id);
+    if(rc != YKPIV_OK && rc != YKPIV_KEY_ERROR) { // Failed to get attestation or metadata, fall back to assuming we have keys for cert objects
+      add_object(slot, pvtk_id);
+      add_object(slot, pubk_id);
+    }
+  }
+}
+
+// Read objects from the token that haven't been read yet, either for one sub_id or for all (sub_id 0)
+static void load_slot_objects(ykcs11_slot_t *slot, CK_BYTE sub_id) {
+  const piv_obj_id_t *obj_ids;
+  CK_ULONG num_ids;
+  CK_BBOOL complete = CK_TRUE;
+  CK_BBOOL loaded = CK_FALSE;
+  get_token_object_ids(&obj_ids, &num_ids);
+  for(CK_ULONG i = 0; i < num_ids; i++) {
+    CK_BYTE id = get_sub_id(obj_ids[i]);
+    if(!slot->loaded[id] && (sub_id == 0 || sub_id == id)) {
+      load_token_object(slot, obj_ids[i]);
+      slot->loaded[id] = CK_TRUE;
+      loaded = CK_TRUE;
+    }
+    complete &= slot->loaded[id];
+  }
+  if(loaded) {
+    sort_objects(slot);
+    if(complete) {
+      cache_store_slot(slot);
+      cache_snapshot_slot(slot);
+    }
+  }
+}
+
+// Only discover keys using metadata, everything else is read when first needed
+static void load_slot_metadata(ykcs11_slot_t *slot) {
+  const piv_obj_id_t *obj_ids;
+  CK_ULONG num_ids;
+  get_token_object_ids(&obj_ids, &num_ids);
+  for(CK_ULONG i = 0; i < num_ids; i++) {
+    CK_BYTE sub_id = get_sub_id(obj_ids[i]);
+    if(find_pvtk_object(sub_id) != PIV_INVALID_OBJ) {
+      ykpiv_rc rc = load_key_metadata(slot, sub_id);
+      if(rc == YKPIV_OK || rc == YKPIV_KEY_ERROR) // Key presence is known, defer the rest
+        continue;
+    }
+    load_token_object(slot, obj_ids[i]);
+    slot->loaded[sub_id] = CK_TRUE;
+  }
+  sort_objects(slot);
+}
+
+// Foreground operations are counted while they wait, so that the prefetch worker of the slot steps aside.
+// The card is always locked before the objects.
+static void lock_slot_for(ykcs11_slot_t *slot, const char *function) {
+  atomic_add_long(&slot->waiting, 1);
+  lock_mutex(slot->mutex, &slot->lock_stats, function);
+  atomic_add_long(&slot->waiting, -1);
+  locking.pfnLockMutex(slot->objects_mutex);
+}
+
+#define lock_slot(slot) lock_slot_for((slot), __func__)
+
+// Enough for reading the objects and login state of the slot, which are only changed with the card locked as well,
+// so that reads don't wait for operations on the card
+static void lock_objects(ykcs11_slot_t *slot) {
+  locking.pfnLockMutex(slot->objects_mutex);
+}
+
+static void unlock_objects(ykcs11_slot_t *slot) {
+  locking.pfnUnlockMutex(slot->objects_mutex);
+}
+
+// Secret keys only live in the session that created them, so are their handles
+static ykcs11_secret_t* get_session_key(ykcs11_session_t *session, CK_OBJECT_HANDLE handle) {
+  if(handle < YKCS11_SESSION_KEY_BASE || handle >= YKCS11_SESSION_KEY_BASE + YKCS11_SESSION_KEYS)
+    return NULL;
+  ykcs11_secret_t *key = session->keys + (handle - YKCS11_SESSION_KEY_BASE);
+  return key->type ? key : NULL;
+}
+
+static CK_RV add_session_key(ykcs11_session_t *session, CK_KEY_TYPE type, CK_BYTE_PTR value, CK_ULONG len, CK_OBJECT_HANDLE_PTR handle) {
+  for(CK_ULONG i = 0; i < YKCS11_SESSION_KEYS; i++) {
+    if(session->keys[i].type == 0) {
+      session->keys[i].type = type;
+      session->keys[i].len = len;
+      memcpy(session->keys[i].value, value, len);
+      *handle = YKCS11_SESSION_KEY_BASE + i;
+      return CKR_OK;
+    }
+  }
+  DBG("All %d secret keys of the session are in use", YKCS11_SESSION_KEYS);
+  return CKR_HOST_MEMORY;
+}
+
+static CK_BBOOL is_aes_key_len(CK_ULONG len) {
+  return len == 16 || len == 24 || len == 32;
+}
+
+// Secret keys are private objects, but operations with them don't use the card
+static CK_RV session_key_init(ykcs11_session_t *session, ykcs11_secret_t *key, CK_MECHANISM_PTR mech, CK_BBOOL encrypt, CK_BBOOL message) {
+  lock_objects(session->slot);
+  CK_BBOOL logged_in = session->slot->login_state != YKCS11_PUBLIC;
+  unlock_objects(session->slot);
+  if(!logged_in) {
+    DBG("Secret keys require login");
+    return CKR_USER_NOT_LOGGED_IN;
+  }
+  CK_RV rv = message ? cipher_message_init(session, key, mech, encrypt) : cipher_mechanism_init(session, key, mech, encrypt);
+  if(rv != CKR_OK) {
+    DBG("Failed to initialize %s operation", encrypt ? "encryption" : "decryption");
+    return rv;
+  }
+  if(message) {
+    session->op_info.type = encrypt ? YKCS11_MESSAGE_ENCRYPT : YKCS11_MESSAGE_DECRYPT;
+  } else {
+    session->op_info.type = encrypt ? YKCS11_ENCRYPT : YKCS11_DECRYPT;
+  }
+  return CKR_OK;
+}
+
+// Ends the operation, unless only the length was asked for or the buffer was too small
+static void end_cipher(ykcs11_session_t *session, CK_BYTE_PTR out, CK_RV rv) {
+  if(out != NULL && rv != CKR_BUFFER_TOO_SMALL) {
+    cipher_mechanism_cleanup(session);
+    session->op_info.type = YKCS11_NOOP;
+  }
+}
+
+typedef struct {
+  ykcs11_slot_t *slot;
+  yc_thread thread;
+  CK_BBOOL stop; // Protected by the slot mutex
+  yc_mutex mutex;
+  yc_cond idle;  // Signalled when the slot is unlocked with no foreground operation waiting
+} prefetch_t;
+
+// Must be called with the slot mutex held, or after taking the worker from the slot
+static void wake_prefetch(prefetch_t *p) {
+  yc_mutex_lock(&p->mutex);
+  yc_cond_broadcast(&p->idle);
+  yc_mutex_unlock(&p->mutex);
+}
+
+// Operations waiting for the slot reuse the PC/SC transaction and application selection of the one before, which
+// are released once none are waiting. libykpiv lets other processes in after coalesce_ms even if more are waiting.
+static void unlock_card(ykcs11_slot_t *slot) {
+  if(coalesce_ms && slot->piv_state) {
+    if(atomic_load_long(&slot->waiting)) {
+      if(!slot->coalescing && ykpiv_begin_batch(slot->piv_state, coalesce_ms) == YKPIV_OK) {
+        slot->coalescing = CK_TRUE;
+      }
+    } else if(slot->coalescing) {
+      ykpiv_end_batch(slot->piv_state);
+      slot->coalescing = CK_FALSE;
+    }
+  }
+  if(slot->prefetch && !atomic_load_long(&slot->waiting)) {
+    wake_prefetch(slot->prefetch);
+  }
+  unlock_mutex(slot->mutex, &slot->lock_stats);
+}
+
+static void unlock_slot(ykcs11_slot_t *slot) {
+  unlock_objects(slot);
+  unlock_card(slot);
+}
+
+// Must be called with only the objects locked, which are unlocked while waiting for the card if reading is needed
+static void load_slot_objects_shared(ykcs11_slot_t *slot, CK_BYTE sub_id) {
+  CK_BBOOL loaded = CK_TRUE;
+  for(CK_BYTE id = 1; id < YKCS11_OBJ_SUB_IDS; id++) {
+    if(sub_id == 0 || sub_id == id) {
+      loaded &= slot->loaded[id];
+    }
+  }
+  if(!loaded) {
+    unlock_objects(slot);
+    lock_slot(slot);
+    load_slot_objects(slot, sub_id);
+    unlock_card(slot);
+  }
+}
+
+// Reads the objects not loaded yet one sub_id at a time, the keys in 9a, 9c, 9d and 9e first
+static void prefetch_worker(void *arg) {
+  prefetch_t *p = arg;
+  ykcs11_slot_t *slot = p->slot;
+  for(CK_BYTE sub_id = 1; sub_id < YKCS11_OBJ_SUB_IDS; sub_id++) {
+    // Woken by unlock_card() once the last waiting operation is done, the timeout is only a safety net
+    yc_mutex_lock(&p->mutex);
+    while(atomic_load_long(&slot->waiting)) {
+      yc_cond_timedwait(&p->idle, &p->mutex, 100);
+    }
+    yc_mutex_unlock(&p->mutex);
+    lock_mutex(slot->mutex, &slot->lock_stats, __func__);
+    lock_objects(slot);
+    if(p->stop) {
+      unlock_slot(slot);
+      return;
+    }
+    if(!slot->loaded[sub_id]) {
+      DBG("Prefetching objects with sub_id %u on slot %td", sub_id, slot - slots);
+      load_slot_objects(slot, sub_id);
+    }
+    unlock_slot(slot);
+  }
+  DBG("Prefetched all objects on slot %td", slot - slots);
+}
+
+// Must be called with the slot mutex held
+static void start_prefetch(ykcs11_slot_t *slot) {
+  if(slot->prefetch) {
+    return;
+  }
+  prefetch_t *p = calloc(1, sizeof(prefetch_t));
+  if(p == NULL) {
+    DBG("Unable to allocate prefetch worker");
+    return;
+  }
+  p->slot = slot;
+  if(!yc_mutex_init(&p->mutex)) {
+    free(p);
+    return;
+  }
+  if(!yc_cond_init(&p->idle)) {
+    yc_mutex_destroy(&p->mutex);
+    free(p);
+    return;
+  }
+  if(!yc_thread_start(&p->thread, prefetch_worker, p)) {
+    DBG("Unable to start prefetch worker");
+    yc_cond_destroy(&p->idle);
+    yc_mutex_destroy(&p->mutex);
+    free(p);
+    return;
+  }
+  slot->prefetch = p;
+}
+
+// Must be called without the slot mutex held, as the worker may be waiting for it
+static void stop_prefetch(ykcs11_slot_t *slot) {
+  lock_slot(slot);
+  prefetch_t *p = slot->prefetch;
+  slot->prefetch = NULL;
+  if(p) {
+    p->stop = CK_TRUE;
+  }
+  unlock_slot(slot);
+  if(p) {
+    wake_prefetch(p);
+    yc_thread_join(p->thread);
+    yc_cond_destroy(&p->idle);
+    yc_mutex_destroy(&p->mutex);
+    free(p);
+  }
+}
+
+// Writes the queued objects to the token in one transaction. A failed write is dropped and the objects of its sub_id
+// are read from the token again when next needed, so that the slot doesn't show what isn't there. Returns the first
+// error, including one from a background flush since the last call. Must be called with the slot mutex held.
+static CK_RV flush_writes(ykcs11_slot_t *slot) {
+  CK_RV rv = slot->write_rv;
+  CK_BBOOL failed = CK_FALSE;
+  slot->write_rv = CKR_OK;
+  if(!slot->pending_us)
+    return rv;
+  slot->pending_us = 0;
+
+  CK_BBOOL batched = ykpiv_begin_batch(slot->piv_state, 0) == YKPIV_OK;
+  for(CK_BYTE sub_id = 1; sub_id < YKCS11_OBJ_SUB_IDS; sub_id++) {
+    if(!slot->dirty[sub_id])
+      continue;
+    ykcs11_data_t *write = slot->pending + sub_id;
+    CK_ULONG obj = piv_2_ykpiv(find_data_object(sub_id));
+    ykpiv_rc rc = ykpiv_save_object(slot->piv_state, obj, write->data, write->len);
+    if(rc == YKPIV_OK) {
+      DBG("Wrote %lu bytes to object %lx", write->len, obj);
+    } else {
+      DBG("Failed to write object %lx: %s", obj, ykpiv_strerror(rc));
+      if(rv == CKR_OK)
+        rv = yrc_to_rv(rc);
+      CK_ULONG j = 0;
+      for(CK_ULONG i = 0; i < slot->n_objects; i++) {
+        if(get_sub_id(slot->objects[i]) != sub_id)
+          slot->objects[j++] = slot->objects[i];
+      }
+      slot->n_objects = j;
+      delete_data(slot, sub_id);
+      if(sub_id < sizeof(slot->certs) / sizeof(slot->certs[0]))
+        delete_cert(slot, sub_id);
+      slot->loaded[sub_id] = CK_FALSE;
+      failed = CK_TRUE;
+    }
+    free(write->data);
+    write->data = NULL;
+    write->len = 0;
+    slot->dirty[sub_id] = CK_FALSE;
+  }
+  if(batched)
+    ykpiv_end_batch(slot->piv_state);
+
+  if(failed) {
+    sort_objects(slot);
+    cache_invalidate_slot(slot);
+  }
+  return rv;
+}
+
+typedef struct {
+  ykcs11_slot_t *slot;
+  yc_thread thread;
+  CK_BBOOL stop;   // Set with the slot mutex held
+  yc_mutex mutex;
+  yc_cond wake;    // Signalled when a write is queued with none pending, and to stop
+  uint64_t due_us; // When the oldest queued write is to be flushed, 0 with nothing queued, protected by mutex
+} writer_t;
+
+static void wake_writer(writer_t *p, uint64_t due_us) {
+  yc_mutex_lock(&p->mutex);
+  p->due_us = due_us;
+  yc_cond_broadcast(&p->wake);
+  yc_mutex_unlock(&p->mutex);
+}
+
+// Flushes the queued writes once the oldest has waited write_behind_ms, and sleeps while nothing is queued
+static void write_worker(void *arg) {
+  writer_t *p = arg;
+  ykcs11_slot_t *slot = p->slot;
+  for(;;) {
+    yc_mutex_lock(&p->mutex);
+    while(!p->stop) {
+      uint64_t now = get_time_us();
+      if(p->due_us && now >= p->due_us) {
+        break;
+      }
+      if(p->due_us) {
+        yc_cond_timedwait(&p->wake, &p->mutex, (uint32_t)((p->due_us - now) / 1000) + 1);
+      } else {
+        yc_cond_wait(&p->wake, &p->mutex);
+      }
+    }
+    p->due_us = 0;
+    yc_mutex_unlock(&p->mutex);
+
+    lock_mutex(slot->mutex, &slot->lock_stats, __func__);
+    lock_objects(slot);
+    if(p->stop) {
+      unlock_slot(slot);
+      return;
+    }
+    // The writes may have been flushed and queued again meanwhile, so the slot has the final say
+    if(slot->pending_us) {
+      uint64_t due = slot->pending_us + (uint64_t)write_behind_ms * 1000;
+      if(get_time_us() >= due) {
+        DBG("Flushing queued writes on slot %td", slot - slots);
+        slot->write_rv = flush_writes(slot);
+      } else {
+        wake_writer(p, due);
+      }
+    }
+    unlock_slot(slot);
+  }
+}
+
+// Must be called with the slot mutex held
+static void start_writer(ykcs11_slot_t *slot) {
+  if(slot->writer) {
+    return;
+  }
+  writer_t *p = calloc(1, sizeof(writer_t));
+  if(p == NULL) {
+    DBG("Unable to allocate write worker, queued writes are flushed on close");
+    return;
+  }
+  p->slot = slot;
+  if(!yc_mutex_init(&p->mutex)) {
+    free(p);
+    return;
+  }
+  if(!yc_cond_init(&p->wake)) {
+    yc_mutex_destroy(&p->mutex);
+    free(p);
+    return;
+  }
+  if(!yc_thread_start(&p->thread, write_worker, p)) {
+    DBG("Unable to start write worker, queued writes are flushed on close");
+    yc_cond_destroy(&p->wake);
+    yc_mutex_destroy(&p->mutex);
+    free(p);
+    return;
+  }
+  slot->writer = p;
+}
+
+// Must be called without the slot mutex held, as the worker may be waiting for it
+static void stop_writer(ykcs11_slot_t *slot) {
+  lock_slot(slot);
+  writer_t *p = slot->writer;
+  slot->writer = NULL;
+  if(p) {
+    p->stop = CK_TRUE;
+  }
+  unlock_slot(slot);
+  if(p) {
+    wake_writer(p, 0);
+    yc_thread_join(p->thread);
+    yc_cond_destroy(&p->wake);
+    yc_mutex_destroy(&p->mutex);
+    free(p);
+  }
+}
+
+// Replaces any write queued for the object of sub_id, empty contents delete the object. The slot keeps the queued
+// contents, so the object isn't read from the token anymore. Must be called with the slot mutex held.
+static CK_RV queue_write(ykcs11_slot_t *slot, CK_BYTE sub_id, CK_BYTE_PTR data, CK_ULONG len) {
+  CK_BYTE_PTR copy = NULL;
+  if(len) {
+    if((copy = malloc(len)) == NULL) {
+      DBG("Unable to allocate queued write");
+      return CKR_HOST_MEMORY;
+    }
+    memcpy(copy, data, len);
+  }
+  free(slot->pending[sub_id].data);
+  slot->pending[sub_id].data = copy;
+  slot->pending[sub_id].len = len;
+  slot->dirty[sub_id] = CK_TRUE;
+  slot->loaded[sub_id] = CK_TRUE;
+  start_writer(slot);
+  // Measured from the oldest write, so that a steady stream of writes doesn't postpone flushing
+  if(!slot->pending_us) {
+    slot->pending_us = get_time_us();
+    if(slot->writer)
+      wake_writer(slot->writer, slot->pending_us + (uint64_t)write_behind_ms * 1000);
+  }
+  DBG("Queued %lu bytes for object %lx", len, piv_2_ykpiv(find_data_object(sub_id)));
+  return CKR_OK;
+}
+
+static void print_lock_stats(const char *name, const ykcs11_lock_stats_t *stats) {
+  fprintf(stderr, "ykcs11: %s mutex: %" PRIu64 " acquisitions, %" PRIu64 " contended, waited %" PRIu64 " us (max %" PRIu64
+          " us behind %s), held %" PRIu64 " us (max %" PRIu64 " us by %s)\n", name, stats->acquisitions, stats->contended,
+          stats->wait_us, stats->max_wait_us, stats->max_wait_holder ? stats->max_wait_holder : "-", stats->hold_us,
+          stats->max_hold_us, stats->max_hold_function ? stats->max_hold_function : "-");
+}
+
 /* General Purpose */
 
 CK_DEFINE_FUNCTION(CK_RV, C_Initialize)(
@@ -122,6 +826,30 @@ CK_DEFINE_FUNCTION(CK_RV, C_Initialize)(
   const char *dbg = getenv("YKCS11_DBG");
   verbose = dbg ? atoi(dbg) : 0;
 #endif
+  const char *lazy = getenv("YKCS11_LAZY_LOAD");
+  lazy_load = (lazy && atoi(lazy)) ? CK_TRUE : CK_FALSE;
+  const char *defer = getenv("YKCS11_DEFER_CONTEXT_LOGIN");
+  defer_context_login = (defer && atoi(defer)) ? CK_TRUE : CK_FALSE;
+  const char *pre = getenv("YKCS11_PREFETCH");
+  prefetch = (pre && atoi(pre)) ? CK_TRUE : CK_FALSE;
+  const char *nocert = getenv("YKCS11_GENERATE_WITHOUT_CERT");
+  generate_without_cert = (nocert && atoi(nocert)) ? CK_TRUE : CK_FALSE;
+  const char *max = getenv("YKCS11_MAX_SESSIONS");
+  long n_sessions = max ? atol(max) : 0;
+  const char *threads = getenv("YKCS11_VERIFY_THREADS");
+  long n_threads = threads ? atol(threads) : 0;
+  verify_threads = n_threads > 0 ? (CK_ULONG)n_threads : (CK_ULONG)yc_cpu_count();
+  const char *coalesce = getenv("YKCS11_COALESCE_MS");
+  long n_coalesce = coalesce ? atol(coalesce) : 0;
+  coalesce_ms = n_coalesce > 0 ? (uint32_t)n_coalesce : 0;
+  const char *retries = getenv("YKCS11_PIN_RETRIES_MS");
+  long n_retries = retries ? atol(retries) : 0;
+  pin_retries_us = n_retries > 0 ? (uint64_t)n_retries * 1000 : 0;
+  const char *write_behind = getenv("YKCS11_WRITE_BEHIND_MS");
+  long n_write_behind = write_behind ? atol(write_behind) : 0;
+  write_behind_ms = n_write_behind > 0 ? (uint32_t)n_write_behind : 0;
+  const char *broker = getenv("YKCS11_BROKER");
+  broker_sockets = (broker && *broker) ? broker : NULL;
 
   DIN;
   CK_RV rv;
@@ -181,6 +909,20 @@ CK_DEFINE_FUNCTION(CK_RV, C_Initialize)(
     }
   }
 
+  // The prefetch workers share the slots with the threads of the application, which requires real locking
+  if(prefetch && (locking.pfnLockMutex == noop_mutex_fn ||
+                  (pInitArgs && (((CK_C_INITIALIZE_ARGS_PTR)pInitArgs)->flags & CKF_LIBRARY_CANT_CREATE_OS_THREADS)))) {
+    DBG("Prefetching disabled, threads or locking are not available");
+    prefetch = CK_FALSE;
+  }
+
+  // So do the workers flushing queued writes
+  if(write_behind_ms && (locking.pfnLockMutex == noop_mutex_fn ||
+                         (pInitArgs && (((CK_C_INITIALIZE_ARGS_PTR)pInitArgs)->flags & CKF_LIBRARY_CANT_CREATE_OS_THREADS)))) {
+    DBG("Write-behind disabled, threads or locking are not available");
+    write_behind_ms = 0;
+  }
+
   // Set up pid to disallow further re-init by this process, and to allow our potential children to re-init
   if ((rv = get_pid(&pid)) != CKR_OK) {
     DBG("Library can't be initialized");
@@ -193,6 +935,30 @@ CK_DEFINE_FUNCTION(CK_RV, C_Initialize)(
     pid = 0;
     goto init_out;
   }
+  const char *stats = getenv("YKCS11_LOCK_STATS");
+  lock_stats = (stats && atoi(stats)) ? CK_TRUE : CK_FALSE;
+  memset(&global_lock_stats, 0, sizeof(global_lock_stats));
+
+  // Same for slot event tracking, the PC/SC context can't be shared with the parent
+  if((rv = locking.pfnCreateMutex(&event_mutex)) != CKR_OK) {
+    DBG("Unable to create event mutex");
+    pid = 0;
+    goto init_out;
+  }
+  if(ykpiv_init(&event_state, verbose) != YKPIV_OK) {
+    DBG("Unable to initialize libykpiv for slot events");
+    rv = CKR_HOST_MEMORY;
+    pid = 0;
+    goto init_out;
+  }
+  if(ykpiv_init(&list_state, verbose) != YKPIV_OK) {
+    DBG("Unable to initialize libykpiv for slot listing");
+    rv = CKR_HOST_MEMORY;
+    pid = 0;
+    goto init_out;
+  }
+  finalizing = CK_FALSE;
+  slots_current = CK_FALSE;
 
   // Re-use inherited per-slot mutex if available (slots are shared with parent)
   for(int i = 0; i < YKCS11_MAX_SLOTS; i++) {
@@ -203,7 +969,34 @@ CK_DEFINE_FUNCTION(CK_RV, C_Initialize)(
         goto init_out;
       }
     }
+    if(slots[i].objects_mutex == NULL) {
+      if((rv = locking.pfnCreateMutex(&slots[i].objects_mutex)) != CKR_OK) {
+        DBG("Unable to create objects mutex for slot %d", i);
+        pid = 0;
+        goto init_out;
+      }
+    }
+  }
+
+  // Re-use inherited session table if available (sessions are shared with parent)
+  if(sessions == NULL) {
+    if(n_sessions < 1 || n_sessions > (long)YKCS11_SESSION_MASK) {
+      n_sessions = YKCS11_DEFAULT_SESSIONS;
+    }
+    if((sessions = calloc(n_sessions, sizeof(ykcs11_session_t))) == NULL) {
+      DBG("Unable to allocate %ld sessions", n_sessions);
+      rv = CKR_HOST_MEMORY;
+      pid = 0;
+      goto init_out;
+    }
+    max_sessions = n_sessions;
+    free_session = 0;
+    for(CK_ULONG i = max_sessions; i > 0; i--) {
+      sessions[i - 1].next_free = free_session;
+      free_session = i;
+    }
   }
+  DBG("Allowing %lu sessions", max_sessions);
   rv = CKR_OK;
 
 init_out:
@@ -231,25 +1024,74 @@ CK_DEFINE_FUNCTION(CK_RV, C_Finalize)(
     goto fin_out;
   }
 
+  // Wake up C_WaitForSlotEvent and wait for it to return
+  lock_global();
+  finalizing = CK_TRUE;
+  unlock_global();
+  ykpiv_cancel_wait(event_state);
+  locking.pfnLockMutex(event_mutex);
+  ykpiv_done(event_state);
+  event_state = NULL;
+  locking.pfnUnlockMutex(event_mutex);
+  locking.pfnDestroyMutex(event_mutex);
+  event_mutex = NULL;
+
+  // Stop the prefetch workers before the sessions and slots they use go away
+  for(int i = 0; i < YKCS11_MAX_SLOTS; i++) {
+    if(slots[i].prefetch)
+      stop_prefetch(slots + i);
+    if(slots[i].writer)
+      stop_writer(slots + i);
+  }
+
   // Clean up all sessions
-  for(int i = 0; i < YKCS11_MAX_SESSIONS; i++) {
+  for(CK_ULONG i = 0; i < max_sessions; i++) {
     if(sessions[i].slot)
       cleanup_session(sessions + i);
   }
+  free(sessions);
+  sessions = NULL;
+  max_sessions = 0;
+  free_session = 0;
+  while(free_bufs) {
+    CK_BYTE *buf = free_bufs;
+    memcpy(&free_bufs, buf, sizeof(free_bufs));
+    free(buf);
+  }
+
+  if(lock_stats) {
+    print_lock_stats("global", &global_lock_stats);
+    for(CK_ULONG i = 0; i < n_slots; i++) {
+      char name[32];
+      snprintf(name, sizeof(name), "slot %lu", i);
+      print_lock_stats(name, &slots[i].lock_stats);
+    }
+  }
 
   // Close all slot states (will reset cards)
   for(int i = 0; i < YKCS11_MAX_SLOTS; i++) {
-    if(slots[i].n_objects) {
+    if(slots[i].pending_us && flush_writes(slots + i) != CKR_OK) {
+      DBG("Failed to flush queued writes on slot %d", i);
+    }
+    if(slots[i].n_objects || slots[i].pending_us) {
       cleanup_slot(slots + i);
     }
+    cache_drop_snapshot(slots + i);
     if(slots[i].piv_state) {
       ykpiv_done(slots[i].piv_state);
     }
     locking.pfnDestroyMutex(slots[i].mutex);
+    locking.pfnDestroyMutex(slots[i].objects_mutex);
   }
 
   memset(&slots, 0, sizeof(slots));
+  memset(&slot_map, 0, sizeof(slot_map));
   n_slots = 0;
+  slots_listed = CK_FALSE;
+  slots_current = CK_FALSE;
+
+  ykpiv_done(list_state);
+  list_state = NULL;
 
   locking.pfnDestroyMutex(global_mutex);
   global_mutex = NULL;
@@ -334,47 +1176,70 @@ funclist_out:
 
 /* Slot and token management */
 
-CK_DEFINE_FUNCTION(CK_RV, C_GetSlotList)(
-  CK_BBOOL tokenPresent,
-  CK_SLOT_ID_PTR pSlotList,
-  CK_ULONG_PTR pulCount
-)
-{
-  DIN;
-  char readers[2048] = {0};
-  size_t len = sizeof(readers);
-  ykpiv_rc rc;
-  CK_RV rv;
+static CK_ULONG slot_hash(const CK_UTF8CHAR *description) {
+  // FNV-1a over the ' ' padded description
+  uint32_t h = 2166136261u;
+  for(size_t i = 0; i < sizeof(((CK_SLOT_INFO *)0)->slotDescription); i++) {
+    h = (h ^ description[i]) * 16777619u;
+  }
+  return h & (YKCS11_SLOT_MAP_SIZE - 1);
+}
 
-  if (!pid) {
-    DBG("libykpiv is not initialized or already finalized");
-    rv = CKR_CRYPTOKI_NOT_INITIALIZED;
-    goto slotlist_out;
+// Must be called with the global mutex held
+static ykcs11_slot_t *find_slot(const CK_UTF8CHAR *description) {
+  for(CK_ULONG i = slot_hash(description); slot_map[i]; i = (i + 1) & (YKCS11_SLOT_MAP_SIZE - 1)) {
+    ykcs11_slot_t *slot = slots + slot_map[i] - 1;
+    if(!memcmp(description, slot->slot_info.slotDescription, sizeof(slot->slot_info.slotDescription))) {
+      return slot;
+    }
   }
+  return NULL;
+}
 
-  if(pulCount == NULL) {
-    DBG("GetSlotList called with pulCount = NULL");
-    rv = CKR_ARGUMENTS_BAD;
-    goto slotlist_out;
+// Must be called with the global mutex held
+static void map_slot(CK_ULONG index) {
+  CK_ULONG i = slot_hash(slots[index].slot_info.slotDescription);
+  while(slot_map[i]) {
+    i = (i + 1) & (YKCS11_SLOT_MAP_SIZE - 1);
   }
+  slot_map[i] = (CK_BYTE)(index + 1);
+}
 
-  ykpiv_state *piv_state;
-  if ((rc = ykpiv_init(&piv_state, verbose)) != YKPIV_OK) {
-    DBG("Unable to initialize libykpiv: %s", ykpiv_strerror(rc));
-    rv = CKR_FUNCTION_FAILED;
-    goto slotlist_out;
+// Must be called with the global mutex held
+static CK_RV list_readers(char *readers, size_t *len) {
+  ykpiv_rc rc;
+
+  if (broker_sockets) {
+    size_t used = 0;
+    for (const char *path = broker_sockets; *path; ) {
+      size_t path_len = strcspn(path, ":");
+      size_t name_len = strlen(YKPIV_BROKER_READER_PREFIX) + path_len + 1;
+      if (path_len) {
+        if (used + name_len + 1 > *len) {
+          DBG("Too many brokers in YKCS11_BROKER");
+          return CKR_DEVICE_ERROR;
+        }
+        snprintf(readers + used, name_len, "%s%.*s", YKPIV_BROKER_READER_PREFIX, (int)path_len, path);
+        used += name_len;
+      }
+      path += path_len + (path[path_len] == ':');
+    }
+    readers[used++] = 0;
+    *len = used;
+    return CKR_OK;
   }
 
-  if ((rc = ykpiv_list_readers(piv_state, readers, &len)) != YKPIV_OK) {
+  if ((rc = ykpiv_list_readers(list_state, readers, len)) != YKPIV_OK) {
     DBG("Unable to list readers: %s", ykpiv_strerror(rc));
-    ykpiv_done(piv_state);
-    rv = CKR_DEVICE_ERROR;
-    goto slotlist_out;
+    return CKR_DEVICE_ERROR;
   }
 
-  ykpiv_done(piv_state);
+  return CKR_OK;
+}
 
-  locking.pfnLockMutex(global_mutex);
+// Must be called with the global mutex held
+static CK_RV update_slots(const char *readers) {
+  ykpiv_rc rc;
 
   // Mark existing slots as candidates for disconnect
   bool mark[YKCS11_MAX_SLOTS] = { false };
@@ -382,7 +1247,7 @@ CK_DEFINE_FUNCTION(CK_RV, C_GetSlotList)(
     mark[i] = true;
   }
 
-  for(char *reader = readers; *reader; reader += strlen(reader) + 1) {
+  for(const char *reader = readers; *reader; reader += strlen(reader) + 1) {
 
     ykcs11_slot_t *slot = slots + n_slots;
 
@@ -398,12 +1263,10 @@ CK_DEFINE_FUNCTION(CK_RV, C_GetSlotList)(
     slot->slot_info.flags = CKF_HW_SLOT | CKF_REMOVABLE_DEVICE;
 
     // Find existing slot, if any
-    for(CK_ULONG i = 0; i < n_slots; i++) {
-      if(!memcmp(slot->slot_info.slotDescription, slots[i].slot_info.slotDescription, sizeof(slot->slot_info.slotDescription))) {
-        slot = slots + i;
-        mark[i] = false; // Un-mark for disconnect
-        break;
-      }
+    ykcs11_slot_t *existing = find_slot(slot->slot_info.slotDescription);
+    if(existing) {
+      slot = existing;
+      mark[slot - slots] = false; // Un-mark for disconnect
     }
 
     // Initialize piv_state and increase slot count if this is a new slot
@@ -415,11 +1278,9 @@ CK_DEFINE_FUNCTION(CK_RV, C_GetSlotList)(
       DBG("Initializing slot %td for '%s'", slot-slots, reader);
       if((rc = ykpiv_init(&slot->piv_state, verbose)) != YKPIV_OK) {
         DBG("Unable to initialize libykpiv: %s", ykpiv_strerror(rc));
-        locking.pfnUnlockMutex(global_mutex);
-        rv = CKR_FUNCTION_FAILED;
-        goto slotlist_out;
+        return CKR_FUNCTION_FAILED;
       }
-      n_slots++;
+      map_slot(n_slots++);
     }
 
     // Try to connect if unconnected (both new and existing slots)
@@ -427,24 +1288,36 @@ CK_DEFINE_FUNCTION(CK_RV, C_GetSlotList)(
 
       DBG("Failed to validate %s: %s", reader, ykpiv_strerror(rc));
 
+      // Losing the connection is an event, whether or not a token is found again below
+      if(slot->slot_info.flags & CKF_TOKEN_PRESENT) {
+        slot->event = CK_TRUE;
+      }
+
       slot->login_state = YKCS11_PUBLIC;
       slot->slot_info.flags &= ~CKF_TOKEN_PRESENT;
+      slot->coalescing = CK_FALSE;
 
-      char buf[sizeof(readers) + 1] = {0};
+      char buf[YKCS11_READERS_LEN + 1] = {0};
       snprintf(buf, sizeof(buf), "@%s", reader);
 
       if ((rc = ykpiv_connect(slot->piv_state, buf)) == YKPIV_OK) {
 
         DBG("Connected slot %td to '%s'", slot-slots, reader);
 
+        // Tokens found by the first enumeration were already there, not inserted
+        if(slots_listed) {
+          slot->event = CK_TRUE;
+        }
+
         slot->slot_info.flags |= CKF_TOKEN_PRESENT;
+        slot->tries_us = get_time_us(); // Selecting the application reads the PIN attempts
         slot->token_info.flags = CKF_RNG | CKF_LOGIN_REQUIRED | CKF_USER_PIN_INITIALIZED | CKF_TOKEN_INITIALIZED;
 
         slot->token_info.ulMinPinLen = YKPIV_MIN_PIN_LEN;
         slot->token_info.ulMaxPinLen = YKPIV_MAX_MGM_KEY_LEN;
 
-        slot->token_info.ulMaxRwSessionCount = YKCS11_MAX_SESSIONS;
-        slot->token_info.ulMaxSessionCount = YKCS11_MAX_SESSIONS;
+        slot->token_info.ulMaxRwSessionCount = max_sessions;
+        slot->token_info.ulMaxSessionCount = max_sessions;
 
         slot->token_info.ulTotalPublicMemory = CK_UNAVAILABLE_INFORMATION;
         slot->token_info.ulFreePublicMemory = CK_UNAVAILABLE_INFORMATION;
@@ -457,10 +1330,14 @@ CK_DEFINE_FUNCTION(CK_RV, C_GetSlotList)(
         memstrcpy(slot->token_info.manufacturerID, sizeof(slot->token_info.manufacturerID), YKCS11_MANUFACTURER);
         memset(slot->token_info.utcTime, ' ', sizeof(slot->token_info.utcTime));
 
-        get_token_model(slot->piv_state, slot->token_info.model, sizeof(slot->token_info.model));
-        get_token_serial(slot->piv_state, slot->token_info.serialNumber, sizeof(slot->token_info.serialNumber));
-        get_token_version(slot->piv_state, &slot->token_info.firmwareVersion);
-        get_token_label(slot->piv_state, slot->token_info.label, sizeof(slot->token_info.label));
+        ykpiv_device_info device_info = {0};
+        if((rc = ykpiv_get_device_info(slot->piv_state, &device_info)) != YKPIV_OK) {
+          DBG("Unable to get device info for slot %td: %s", slot - slots, ykpiv_strerror(rc));
+        }
+        get_token_model(&device_info, slot->token_info.model, sizeof(slot->token_info.model));
+        get_token_serial(&device_info, slot->token_info.serialNumber, sizeof(slot->token_info.serialNumber));
+        get_token_version(&device_info, &slot->token_info.firmwareVersion);
+        get_token_label(&device_info, slot->token_info.label, sizeof(slot->token_info.label));
       } else {
         DBG("Unable to connect slot %td to '%s': %s", slot - slots, reader, ykpiv_strerror(rc));
       }
@@ -472,30 +1349,110 @@ CK_DEFINE_FUNCTION(CK_RV, C_GetSlotList)(
     if(mark[i] && (slots[i].slot_info.flags & CKF_TOKEN_PRESENT)) {
       DBG("Disconnecting slot %lu", i);
       ykpiv_disconnect(slots[i].piv_state);
+      slots[i].coalescing = CK_FALSE; // Disconnecting ends the batch
       slots[i].slot_info.flags &= ~CKF_TOKEN_PRESENT;
+      slots[i].event = CK_TRUE;
     }
   }
 
-  // Count and return slots with or without tokens as requested
-  CK_ULONG count = 0;
-  for (CK_ULONG i = 0; i < n_slots; i++) {
-    if(!tokenPresent || (slots[i].slot_info.flags & CKF_TOKEN_PRESENT)) {
-      if(pSlotList) {
-        if(count >= *pulCount) {
-          DBG("Buffer too small: needed %lu, provided %lu", count, *pulCount);
-          locking.pfnUnlockMutex(global_mutex);
-          rv = CKR_BUFFER_TOO_SMALL;
-          goto slotlist_out;
-        }
-        pSlotList[count] = i;
-      }
-      count++;
-    }
-  }
+  slots_listed = CK_TRUE;
+  return CKR_OK;
+}
 
-  *pulCount = count;
+// Must be called with the global mutex held
+static CK_RV refresh_slots(void) {
+  char readers[YKCS11_READERS_LEN] = {0};
+  size_t len = sizeof(readers);
+  bool changed = false;
+  ykpiv_rc rc;
+  CK_RV rv;
 
-  locking.pfnUnlockMutex(global_mutex);
+  // A status query with no timeout is enough to tell if the readers or their cards changed.
+  // Brokers don't report changes, a token that went away fails its next command instead.
+  if (broker_sockets) {
+    rc = YKPIV_OK;
+  } else if ((rc = ykpiv_wait_for_change(list_state, 0, &changed)) != YKPIV_OK) {
+    DBG("Unable to query reader status: %s", ykpiv_strerror(rc));
+    slots_current = CK_FALSE;
+  }
+
+  if (slots_current && !changed) {
+    return CKR_OK;
+  }
+
+  if ((rv = list_readers(readers, &len)) != CKR_OK) {
+    return rv;
+  }
+
+  if ((rv = update_slots(readers)) != CKR_OK) {
+    return rv;
+  }
+
+  slots_current = rc == YKPIV_OK;
+  return CKR_OK;
+}
+
+
+// Must be called with the global mutex held
+static CK_BBOOL take_slot_event(CK_SLOT_ID_PTR pSlot) {
+  for(CK_ULONG i = 0; i < n_slots; i++) {
+    if(slots[i].event) {
+      slots[i].event = CK_FALSE;
+      *pSlot = i;
+      return CK_TRUE;
+    }
+  }
+  return CK_FALSE;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_GetSlotList)(
+  CK_BBOOL tokenPresent,
+  CK_SLOT_ID_PTR pSlotList,
+  CK_ULONG_PTR pulCount
+)
+{
+  DIN;
+  CK_RV rv;
+
+  if (!pid) {
+    DBG("libykpiv is not initialized or already finalized");
+    rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+    goto slotlist_out;
+  }
+
+  if(pulCount == NULL) {
+    DBG("GetSlotList called with pulCount = NULL");
+    rv = CKR_ARGUMENTS_BAD;
+    goto slotlist_out;
+  }
+
+  lock_global();
+
+  if ((rv = refresh_slots()) != CKR_OK) {
+    unlock_global();
+    goto slotlist_out;
+  }
+
+  // Count and return slots with or without tokens as requested
+  CK_ULONG count = 0;
+  for (CK_ULONG i = 0; i < n_slots; i++) {
+    if(!tokenPresent || (slots[i].slot_info.flags & CKF_TOKEN_PRESENT)) {
+      if(pSlotList) {
+        if(count >= *pulCount) {
+          DBG("Buffer too small: needed %lu, provided %lu", count, *pulCount);
+          unlock_global();
+          rv = CKR_BUFFER_TOO_SMALL;
+          goto slotlist_out;
+        }
+        pSlotList[count] = i;
+      }
+      count++;
+    }
+  }
+
+  *pulCount = count;
+
+  unlock_global();
 
   DBG("token present is %d", tokenPresent);
   DBG("number of slots is %lu", *pulCount);
@@ -526,18 +1483,18 @@ CK_DEFINE_FUNCTION(CK_RV, C_GetSlotInfo)(
     goto slotinfo_out;
   }
 
-  locking.pfnLockMutex(global_mutex);
+  lock_global();
 
   if (slotID >= n_slots) {
     DBG("Invalid slot ID %lu", slotID);
-    locking.pfnUnlockMutex(global_mutex);
+    unlock_global();
     rv = CKR_SLOT_ID_INVALID;
     goto slotinfo_out;
   }
 
   memcpy(pInfo, &slots[slotID].slot_info, sizeof(CK_SLOT_INFO));
 
-  locking.pfnUnlockMutex(global_mutex);
+  unlock_global();
   rv = CKR_OK;
 
 slotinfo_out:  
@@ -565,26 +1522,54 @@ CK_DEFINE_FUNCTION(CK_RV, C_GetTokenInfo)(
     goto tokeninfo_out;
   }
 
-  locking.pfnLockMutex(global_mutex);
+  lock_global();
 
   if (slotID >= n_slots) {
     DBG("Invalid slot ID %lu", slotID);
-    locking.pfnUnlockMutex(global_mutex);
+    unlock_global();
     rv = CKR_SLOT_ID_INVALID;
     goto tokeninfo_out;
   }
 
   if(!(slots[slotID].slot_info.flags & CKF_TOKEN_PRESENT)) {
     DBG("A token is not present in slot %lu", slotID);
-    locking.pfnUnlockMutex(global_mutex);
+    unlock_global();
     rv = CKR_TOKEN_NOT_PRESENT;
     goto tokeninfo_out;
   }
 
   memcpy(pInfo, &slots[slotID].token_info, sizeof(CK_TOKEN_INFO));
 
+  for(CK_ULONG i = 0; i < max_sessions; i++) {
+    if(sessions[i].slot) {
+      if(sessions[i].info.flags & CKF_RW_SESSION) {
+        pInfo->ulRwSessionCount++;
+      }
+      else {
+        pInfo->ulSessionCount++;
+      }
+    }
+  }
+
+  ykcs11_slot_t *slot = slots + slotID;
+
+  unlock_global();
+
+  // libykpiv keeps the number of PIN attempts from every response reporting it, the card is only asked again if
+  // that may have happened too long ago
+  if(pin_retries_us) {
+    uint64_t now = get_time_us();
+    lock_slot(slot);
+    if(now - slot->tries_us > pin_retries_us) {
+      int tries = 0;
+      ykpiv_verify(slot->piv_state, NULL, &tries);
+      slot->tries_us = now;
+    }
+    unlock_slot(slot);
+  }
+
   int tries = YKPIV_RETRIES_MAX;
-  ykpiv_get_pin_retries(slots[slotID].piv_state, &tries);
+  ykpiv_get_pin_retries(slot->piv_state, &tries);
 
   switch(tries) {
     case 0:
@@ -600,18 +1585,6 @@ CK_DEFINE_FUNCTION(CK_RV, C_GetTokenInfo)(
       break;
   }
 
-  for(int i = 0; i < YKCS11_MAX_SESSIONS; i++) {
-    if(sessions[i].slot) {
-      if(sessions[i].info.flags & CKF_RW_SESSION) {
-        pInfo->ulRwSessionCount++;
-      }
-      else {
-        pInfo->ulSessionCount++;
-      }
-    }
-  }
-
-  locking.pfnUnlockMutex(global_mutex);
   rv = CKR_OK;
 
 tokeninfo_out:  
@@ -626,9 +1599,66 @@ CK_DEFINE_FUNCTION(CK_RV, C_WaitForSlotEvent)(
 )
 {
   DIN;
-  DBG("TODO!!!");
+  CK_RV rv;
+  ykpiv_rc rc;
+
+  if (!pid) {
+    DBG("libykpiv is not initialized or already finalized");
+    rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+    goto wait_out;
+  }
+
+  if (pSlot == NULL || pReserved != NULL) {
+    DBG("Wrong/Missing parameter");
+    rv = CKR_ARGUMENTS_BAD;
+    goto wait_out;
+  }
+
+  locking.pfnLockMutex(event_mutex);
+
+  // Check for changes without blocking first, this also records the reader states on the first call
+  bool changed = false;
+  if ((rc = ykpiv_wait_for_change(event_state, 0, &changed)) != YKPIV_OK) {
+    DBG("Unable to check for slot events: %s", ykpiv_strerror(rc));
+    locking.pfnUnlockMutex(event_mutex);
+    rv = CKR_DEVICE_ERROR;
+    goto wait_out;
+  }
+  changed = changed || !slots_listed;
+
+  for(;;) {
+    // Re-read the slots only when PC/SC reported a change
+    lock_global();
+    if (finalizing) {
+      DBG("Library finalized while waiting for slot events");
+      rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+    } else if (changed && (rv = refresh_slots()) != CKR_OK) {
+      DBG("Unable to update slots");
+    } else if (take_slot_event(pSlot)) {
+      DBG("Slot %lu has an event", *pSlot);
+      rv = CKR_OK;
+    } else {
+      rv = CKR_NO_EVENT;
+    }
+    unlock_global();
+
+    if (rv != CKR_NO_EVENT || (flags & CKF_DONT_BLOCK)) {
+      break;
+    }
+
+    // Wait in slices so that C_Finalize is noticed even if its cancellation is missed
+    if ((rc = ykpiv_wait_for_change(event_state, YKCS11_EVENT_WAIT_MS, &changed)) != YKPIV_OK) {
+      DBG("Unable to wait for slot events: %s", ykpiv_strerror(rc));
+      rv = CKR_DEVICE_ERROR;
+      break;
+    }
+  }
+
+  locking.pfnUnlockMutex(event_mutex);
+
+wait_out:
   DOUT;
-  return CKR_FUNCTION_NOT_SUPPORTED;
+  return rv;
 }
 
 CK_DEFINE_FUNCTION(CK_RV, C_GetMechanismList)(
@@ -652,23 +1682,23 @@ CK_DEFINE_FUNCTION(CK_RV, C_GetMechanismList)(
     goto mechlist_out;
   }
 
-  locking.pfnLockMutex(global_mutex);
+  lock_global();
 
   if (slotID >= n_slots) {
     DBG("Invalid slot ID %lu", slotID);
-    locking.pfnUnlockMutex(global_mutex);
+    unlock_global();
     rv = CKR_SLOT_ID_INVALID;
     goto mechlist_out;
   }
 
   if(!(slots[slotID].slot_info.flags & CKF_TOKEN_PRESENT)) {
     DBG("A token is not present in slot %lu", slotID);
-    locking.pfnUnlockMutex(global_mutex);
+    unlock_global();
     rv = CKR_TOKEN_NOT_PRESENT;
     goto mechlist_out;
   }
 
-  locking.pfnUnlockMutex(global_mutex);
+  unlock_global();
 
   if ((rv = get_token_mechanism_list(pMechanismList, pulCount)) != CKR_OK) {
     DBG("Unable to retrieve mechanism list");
@@ -703,25 +1733,25 @@ CK_DEFINE_FUNCTION(CK_RV, C_GetMechanismInfo)(
     goto mechinfo_out;
   }
 
-  locking.pfnLockMutex(global_mutex);
+  lock_global();
 
   if (slotID >= n_slots) {
     DBG("Invalid slot ID %lu", slotID);
-    locking.pfnUnlockMutex(global_mutex);
+    unlock_global();
     rv = CKR_SLOT_ID_INVALID;
     goto mechinfo_out;
   }
 
   if(!(slots[slotID].slot_info.flags & CKF_TOKEN_PRESENT)) {
     DBG("A token is not present in slot %lu", slotID);
-    locking.pfnUnlockMutex(global_mutex);
+    unlock_global();
     rv = CKR_TOKEN_NOT_PRESENT;
     goto mechinfo_out;
   }
 
   if ((rv = get_token_mechanism_info(type, pInfo)) != CKR_OK) {
     DBG("Unable to retrieve mechanism information");
-    locking.pfnUnlockMutex(global_mutex);
+    unlock_global();
     goto mechinfo_out;
   }
 
@@ -731,7 +1761,7 @@ CK_DEFINE_FUNCTION(CK_RV, C_GetMechanismInfo)(
     }
   }
 
-  locking.pfnUnlockMutex(global_mutex);
+  unlock_global();
 
   rv = CKR_OK;
 
@@ -756,32 +1786,32 @@ CK_DEFINE_FUNCTION(CK_RV, C_InitToken)(
     goto inittoken_out;
   }
 
-  locking.pfnLockMutex(global_mutex);
+  lock_global();
 
   if (slotID >= n_slots) {
     DBG("Invalid slot ID %lu", slotID);
-    locking.pfnUnlockMutex(global_mutex);
+    unlock_global();
     rv = CKR_SLOT_ID_INVALID;
     goto inittoken_out;
   }
 
   if(!(slots[slotID].slot_info.flags & CKF_TOKEN_PRESENT)) {
     DBG("A token is not present in slot %lu", slotID);
-    locking.pfnUnlockMutex(global_mutex);
+    unlock_global();
     rv = CKR_TOKEN_NOT_PRESENT;
     goto inittoken_out;
   }
 
-  for(int i = 0; i < YKCS11_MAX_SESSIONS; i++) {
+  for(CK_ULONG i = 0; i < max_sessions; i++) {
     ykcs11_session_t *session = sessions + i;
     if(session->slot && session->info.slotID == slotID) {
-      locking.pfnUnlockMutex(global_mutex);
+      unlock_global();
       rv = CKR_SESSION_EXISTS;
       goto inittoken_out;
     }
   }
 
-  locking.pfnUnlockMutex(global_mutex);
+  unlock_global();
 
   CK_BYTE mgm_key[32] = {0};
   size_t len = sizeof(mgm_key);
@@ -802,12 +1832,12 @@ CK_DEFINE_FUNCTION(CK_RV, C_InitToken)(
   int tries = 0;
   ykcs11_slot_t *slot = slots + slotID;
 
-  locking.pfnLockMutex(slot->mutex);
+  lock_slot(slot);
 
   // Verify existing mgm key (SO_PIN)
   if((rc = ykpiv_authenticate2(slot->piv_state, mgm_key, len)) != YKPIV_OK) {
     DBG("ykpiv_authenticate2 failed %s", ykpiv_strerror(rc));
-    locking.pfnUnlockMutex(slot->mutex);
+    unlock_slot(slot);
     rv = rc == YKPIV_AUTHENTICATION_ERROR ? CKR_PIN_INCORRECT : CKR_DEVICE_ERROR;
     goto inittoken_out;
   }
@@ -825,7 +1855,7 @@ CK_DEFINE_FUNCTION(CK_RV, C_InitToken)(
   // Reset PIV (requires PIN and PUK to be blocked)
   if((rc = ykpiv_util_reset(slot->piv_state)) != YKPIV_OK) {
     DBG("ykpiv_util_reset failed %s", ykpiv_strerror(rc));
-    locking.pfnUnlockMutex(slot->mutex);
+    unlock_slot(slot);
     rv = CKR_DEVICE_ERROR;
     goto inittoken_out;
   }
@@ -833,7 +1863,7 @@ CK_DEFINE_FUNCTION(CK_RV, C_InitToken)(
   // Authenticate with default mgm key (SO PIN)
   if((rc = ykpiv_authenticate2(slot->piv_state, NULL, 0)) != YKPIV_OK) {
     DBG("ykpiv_authenticate2 failed %s", ykpiv_strerror(rc));
-    locking.pfnUnlockMutex(slot->mutex);
+    unlock_slot(slot);
     rv = rc == YKPIV_AUTHENTICATION_ERROR ? CKR_PIN_INCORRECT : CKR_DEVICE_ERROR;
     goto inittoken_out;
   }
@@ -841,12 +1871,12 @@ CK_DEFINE_FUNCTION(CK_RV, C_InitToken)(
   // Set new mgm key (SO PIN) with the same algorithm and touch policy the old one had
   if((rc = ykpiv_set_mgmkey3(slot->piv_state, mgm_key, len, YKPIV_ALGO_AUTO, YKPIV_TOUCHPOLICY_AUTO)) != YKPIV_OK) {
     DBG("ykpiv_set_mgmkey3 failed %s", ykpiv_strerror(rc));
-    locking.pfnUnlockMutex(slot->mutex);
+    unlock_slot(slot);
     rv = CKR_DEVICE_ERROR;
     goto inittoken_out;
   }
 
-  locking.pfnUnlockMutex(slot->mutex);
+  unlock_slot(slot);
   rv = CKR_OK;
 
 inittoken_out:
@@ -897,18 +1927,18 @@ CK_DEFINE_FUNCTION(CK_RV, C_SetPIN)(
     goto setpin_out;
   }
 
-  locking.pfnLockMutex(session->slot->mutex);
+  lock_slot(session->slot);
 
   CK_USER_TYPE user_type = session->slot->login_state == YKCS11_SO ? CKU_SO : CKU_USER;
 
   rv = token_change_pin(session->slot->piv_state, user_type, pOldPin, ulOldLen, pNewPin, ulNewLen);
   if (rv != CKR_OK) {
     DBG("Pin change failed %lx", rv);
-    locking.pfnUnlockMutex(session->slot->mutex);
+    unlock_slot(session->slot);
     goto setpin_out;
   }
 
-  locking.pfnUnlockMutex(session->slot->mutex);
+  unlock_slot(session->slot);
   rv = CKR_OK;
 
 setpin_out:
@@ -945,18 +1975,18 @@ CK_DEFINE_FUNCTION(CK_RV, C_OpenSession)(
     goto opensession_out;
   }
 
-  locking.pfnLockMutex(global_mutex);
+  lock_global();
 
   if (slotID >= n_slots) {
     DBG("Invalid slot ID %lu", slotID);
-    locking.pfnUnlockMutex(global_mutex);
+    unlock_global();
     rv = CKR_SLOT_ID_INVALID;
     goto opensession_out;
   }
 
   if(!(slots[slotID].slot_info.flags & CKF_TOKEN_PRESENT)) {
     DBG("A token is not present in slot %lu", slotID);
-    locking.pfnUnlockMutex(global_mutex);
+    unlock_global();
     rv = CKR_TOKEN_NOT_PRESENT;
     goto opensession_out;
   }
@@ -964,7 +1994,7 @@ CK_DEFINE_FUNCTION(CK_RV, C_OpenSession)(
   ykcs11_session_t* session = get_free_session();
   if (session == NULL) {
     DBG("The maximum number of open session have already been reached");
-    locking.pfnUnlockMutex(global_mutex);
+    unlock_global();
     rv = CKR_SESSION_COUNT;
     goto opensession_out;
   }
@@ -972,103 +2002,25 @@ CK_DEFINE_FUNCTION(CK_RV, C_OpenSession)(
   session->info.slotID = slotID;
   session->info.flags = flags;
   session->slot = slots + slotID;
+  session->slot->n_sessions++;
 
-  locking.pfnUnlockMutex(global_mutex);
-  locking.pfnLockMutex(session->slot->mutex);
-
-  if(session->slot->n_objects == 0) {
-    const piv_obj_id_t *obj_ids;
-    CK_ULONG num_ids;
-    get_token_object_ids(&obj_ids, &num_ids);
-    for(CK_ULONG i = 0; i < num_ids; i++) {
-      ykpiv_rc rc = YKPIV_KEY_ERROR;
-      CK_BYTE sub_id = get_sub_id(obj_ids[i]);
-      piv_obj_id_t cert_id = find_cert_object(sub_id);
-      piv_obj_id_t pubk_id = find_pubk_object(sub_id);
-      piv_obj_id_t pvtk_id = find_pvtk_object(sub_id);
-      piv_obj_id_t atst_id = find_atst_object(sub_id);
-      CK_BYTE data[YKPIV_OBJ_MAX_SIZE] = {0}; // Max cert value for ykpiv
-      size_t len;
-      if(pvtk_id != PIV_INVALID_OBJ) {
-        session->slot->origin[sub_id] = 0;
-        session->slot->pin_policy[sub_id] = 0;
-        session->slot->touch_policy[sub_id] = 0;
-        CK_ULONG slot = piv_2_ykpiv(pvtk_id);
-        len = sizeof(data);
-        if((rc = ykpiv_attest(session->slot->piv_state, slot, data, &len)) == YKPIV_OK) {
-          session->slot->origin[sub_id] = YKPIV_METADATA_ORIGIN_GENERATED;
-          DBG("Created attestation for object %u slot %lx", pvtk_id, slot);
-          if((rv = do_store_cert(data, len, &session->slot->atst[sub_id])) == CKR_OK) {
-            if ((rv = do_parse_attestation(session->slot->atst[sub_id], &session->slot->pin_policy[sub_id], &session->slot->touch_policy[sub_id])) != CKR_OK) {
-              DBG("Failed to parse pin and touch policy from attestation for object %u slot %lx: %lu", pvtk_id, slot, rv);
-            }
-            if (atst_id != PIV_INVALID_OBJ)
-              add_object(session->slot, atst_id);
-            if((rv = do_store_pubk(session->slot->atst[sub_id], &session->slot->pkeys[sub_id])) == CKR_OK) {
-              add_object(session->slot, pvtk_id);
-              add_object(session->slot, pubk_id);
-            } else {
-              DBG("Failed to store key objects %u and %u in session: %lu", pubk_id, pvtk_id, rv);
-            }
-          } else {
-            DBG("Failed to store attestation certificate object %u in session: %lu", atst_id, rv);
-          }
-        } else {
-          DBG("Failed to create attestation for object %u slot %lx: %s", pvtk_id, slot, ykpiv_strerror(rc));
-          len = sizeof(data);
-          if((rc = ykpiv_get_metadata(session->slot->piv_state, slot, data, &len)) == YKPIV_OK) {
-            DBG("Fetched %zu bytes metadata for object %u slot %lx", len, pvtk_id, slot);
-            ykpiv_metadata md = {0};
-            if((rc = ykpiv_util_parse_metadata(data, len, &md)) == YKPIV_OK) {
-              session->slot->origin[sub_id] = md.origin;
-              session->slot->pin_policy[sub_id] = md.pin_policy;
-              session->slot->touch_policy[sub_id] = md.touch_policy;
-              if(md.pubkey_len) {
-                if((rv = do_create_public_key(md.pubkey, md.pubkey_len, md.algorithm, &session->slot->pkeys[sub_id])) == CKR_OK) {
-                  add_object(session->slot, pvtk_id);
-                  add_object(session->slot, pubk_id);
-                } else {
-                  DBG("Failed to create public key for slot %lx, algorithm %u from metadata: %lu", slot, md.algorithm, rv);
-                }
-              }
-            } else {
-              DBG("Failed to parse metadata for object %u slot %lx: %s", pvtk_id, slot, ykpiv_strerror(rc));
-            }
-          } else {
-            DBG("Failed to fetch metadata for object %u slot %lx: %s", pvtk_id, slot, ykpiv_strerror(rc));
-          }
-        }
-      }
-      unsigned long ulen = sizeof(data);
-      ykpiv_rc rcc = ykpiv_fetch_object(session->slot->piv_state, piv_2_ykpiv(obj_ids[i]), data, &ulen);
-      if(rcc != YKPIV_OK) {
-        DBG("Failed to fetch object %u slot %lx: %s", obj_ids[i], piv_2_ykpiv(obj_ids[i]), ykpiv_strerror(rcc));
-        continue;
-      }
-      DBG("Fetched %lu bytes for object %u slot %lx", ulen, obj_ids[i], piv_2_ykpiv(obj_ids[i]));
-      rv = store_data(session->slot, sub_id, data, ulen);
-      if (rv != CKR_OK) {
-        DBG("Failed to store data object %u in session: %lu", obj_ids[i], rv);
-        continue;
-      }
-      add_object(session->slot, obj_ids[i]);
-      if(cert_id != PIV_INVALID_OBJ) {
-        rv = store_cert(session->slot, sub_id, data, ulen, CK_FALSE); // Will only overwrite key if not set from attestation or metadata
-        if (rv != CKR_OK) {
-          DBG("Failed to store certificate object %u in session: %lu", cert_id, rv);
-          continue; // Bail out, can't create key objects without the public key from the cert
-        }
-        add_object(session->slot, cert_id);
-        if(rc != YKPIV_OK && rc != YKPIV_KEY_ERROR) { // Failed to get attestation or metadata, fall back to assuming we have keys for cert objects
-          add_object(session->slot, pvtk_id);
-          add_object(session->slot, pubk_id);
-        }
-      }
+  unlock_global();
+  lock_slot(session->slot);
+
+  if(session->slot->n_objects == 0 && cache_adopt_snapshot(session->slot) != CKR_OK) {
+    if(cache_load_slot(session->slot) == CKR_OK) {
+      cache_snapshot_slot(session->slot);
+    } else if(lazy_load || prefetch) {
+      load_slot_metadata(session->slot);
+    } else {
+      load_slot_objects(session->slot, 0);
     }
-    sort_objects(session->slot);
+  }
+  if(prefetch) {
+    start_prefetch(session->slot);
   }
 
-  locking.pfnUnlockMutex(session->slot->mutex);
+  unlock_slot(session->slot);
 
   *phSession = get_session_handle(session);
   rv = CKR_OK;
@@ -1100,27 +2052,34 @@ CK_DEFINE_FUNCTION(CK_RV, C_CloseSession)(
   }
 
   ykcs11_slot_t *slot = session->slot;
-  int other_sessions = 0;
 
-  locking.pfnLockMutex(global_mutex);
-
-  cleanup_session(session);
+  lock_global();
 
-  for(int i = 0; i < YKCS11_MAX_SESSIONS; i++) {
-    session = sessions + i;
-    if(session->slot == slot) {
-      other_sessions++;
-    }
+  if (session->slot != slot) {
+    DBG("Session was closed by another thread");
+    unlock_global();
+    rv = CKR_SESSION_HANDLE_INVALID;
+    goto closesession_out;
   }
 
-  locking.pfnUnlockMutex(global_mutex);
+  cleanup_session(session);
+  CK_ULONG other_sessions = slot->n_sessions;
 
+  unlock_global();
+
+  rv = CKR_OK;
   if(other_sessions == 0) {
-    locking.pfnLockMutex(slot->mutex);
+    stop_prefetch(slot);
+    stop_writer(slot);
+    lock_slot(slot);
+    rv = flush_writes(slot);
     cleanup_slot(slot);
-    locking.pfnUnlockMutex(slot->mutex);
+    unlock_slot(slot);
+  } else if(write_behind_ms) {
+    lock_slot(slot);
+    rv = flush_writes(slot);
+    unlock_slot(slot);
   }
-  rv = CKR_OK;
 
 closesession_out:
   DOUT;
@@ -1140,18 +2099,18 @@ CK_DEFINE_FUNCTION(CK_RV, C_CloseAllSessions)(
     goto closeallsessions_out;
   }
 
-  locking.pfnLockMutex(global_mutex);
+  lock_global();
 
   if (slotID >= n_slots) {
     DBG("Invalid slot ID %lu", slotID);
-    locking.pfnUnlockMutex(global_mutex);
+    unlock_global();
     rv = CKR_SLOT_ID_INVALID;
     goto closeallsessions_out;
   }
 
   int cleaned_sessions = 0;
 
-  for(int i = 0; i < YKCS11_MAX_SESSIONS; i++) {
+  for(CK_ULONG i = 0; i < max_sessions; i++) {
     ykcs11_session_t *session = sessions + i;
     if(session->slot && session->info.slotID == slotID) {
       cleanup_session(session);
@@ -1159,14 +2118,17 @@ CK_DEFINE_FUNCTION(CK_RV, C_CloseAllSessions)(
     }
   }
 
-  locking.pfnUnlockMutex(global_mutex);
+  unlock_global();
 
+  rv = CKR_OK;
   if(cleaned_sessions > 0) {
-    locking.pfnLockMutex(slots[slotID].mutex);
+    stop_prefetch(slots + slotID);
+    stop_writer(slots + slotID);
+    lock_slot(slots + slotID);
+    rv = flush_writes(slots + slotID);
     cleanup_slot(slots + slotID);
-    locking.pfnUnlockMutex(slots[slotID].mutex);
+    unlock_slot(slots + slotID);
   }
-  rv = CKR_OK;
 
 closeallsessions_out:
   DOUT;
@@ -1203,7 +2165,7 @@ CK_DEFINE_FUNCTION(CK_RV, C_GetSessionInfo)(
 
   memcpy(pInfo, &session->info, sizeof(CK_SESSION_INFO));
 
-  locking.pfnLockMutex(session->slot->mutex);
+  lock_objects(session->slot);
   
   switch(session->slot->login_state) {
     case YKCS11_PUBLIC:
@@ -1218,7 +2180,7 @@ CK_DEFINE_FUNCTION(CK_RV, C_GetSessionInfo)(
       break;
   }
 
-  locking.pfnUnlockMutex(session->slot->mutex);
+  unlock_objects(session->slot);
   rv = CKR_OK;
 
 sessioninfo_out:  
@@ -1287,19 +2249,20 @@ CK_DEFINE_FUNCTION(CK_RV, C_Login)(
 
   switch (userType) {
   case CKU_CONTEXT_SPECIFIC:
-    if (session->op_info.type != YKCS11_SIGN && session->op_info.type != YKCS11_DECRYPT) {
+    if (session->op_info.type != YKCS11_SIGN && session->op_info.type != YKCS11_MESSAGE_SIGN &&
+        session->op_info.type != YKCS11_DECRYPT) {
       DBG("No sign or decrypt operation in progress. Context specific user is forbidden.");
       rv = CKR_USER_TYPE_INVALID;
       goto login_out;
     }
     // Fall through
   case CKU_USER:
-    locking.pfnLockMutex(session->slot->mutex);
+    lock_slot(session->slot);
 
     // We allow multiple logins for CKU_CONTEXT_SPECIFIC (we allow it regardless of CKA_ALWAYS_AUTHENTICATE because it's based on hardcoded tables and might be wrong)
     if (session->slot->login_state == YKCS11_USER && userType == CKU_USER) {
       DBG("Tried to log-in USER to a USER session");
-      locking.pfnUnlockMutex(session->slot->mutex);
+      unlock_slot(session->slot);
       rv = CKR_USER_ALREADY_LOGGED_IN;
       goto login_out;
     }
@@ -1307,45 +2270,55 @@ CK_DEFINE_FUNCTION(CK_RV, C_Login)(
     // We allow multiple logins for CKU_CONTEXT_SPECIFIC (we allow it regardless of CKA_ALWAYS_AUTHENTICATE because it's based on hardcoded tables and might be wrong)
     if (session->slot->login_state == YKCS11_SO && userType == CKU_USER) {
       DBG("Tried to log-in USER to a SO session");
-      locking.pfnUnlockMutex(session->slot->mutex);
+      unlock_slot(session->slot);
       rv = CKR_USER_ANOTHER_ALREADY_LOGGED_IN;
       goto login_out;
     }
 
+    // Kept until C_Sign, which verifies it and signs without releasing the card in between
+    if (userType == CKU_CONTEXT_SPECIFIC && defer_context_login && session->op_info.type == YKCS11_SIGN &&
+        pPin && ulPinLen >= YKPIV_MIN_PIN_LEN && ulPinLen <= YKPIV_MAX_PIN_LEN) {
+      DBG("Deferring context specific login to the signature");
+      memcpy(session->op_info.context_pin, pPin, ulPinLen);
+      session->op_info.context_pin_len = ulPinLen;
+      unlock_slot(session->slot);
+      break;
+    }
+
     rv = token_login(session->slot->piv_state, CKU_USER, pPin, ulPinLen);
     if (rv != CKR_OK) {
       DBG("Unable to login as regular user");
-      locking.pfnUnlockMutex(session->slot->mutex);
+      unlock_slot(session->slot);
       goto login_out;
     }
 
     // This allows contect-specific login while already logged in as SO, allowing creation of objects AND signing in one session
     if(session->slot->login_state == YKCS11_PUBLIC)
       session->slot->login_state = YKCS11_USER;
-    locking.pfnUnlockMutex(session->slot->mutex);
+    unlock_slot(session->slot);
     break;
 
   case CKU_SO:
-    locking.pfnLockMutex(session->slot->mutex);
+    lock_slot(session->slot);
 
     if (session->slot->login_state == YKCS11_USER) {
       DBG("Tried to log-in SO to a USER session");
-      locking.pfnUnlockMutex(session->slot->mutex);
+      unlock_slot(session->slot);
       rv = CKR_USER_ANOTHER_ALREADY_LOGGED_IN;
       goto login_out;
     }
 
     if (session->slot->login_state == YKCS11_SO) {
       DBG("Tried to log-in SO to a SO session");
-      locking.pfnUnlockMutex(session->slot->mutex);
+      unlock_slot(session->slot);
       rv = CKR_USER_ALREADY_LOGGED_IN;
       goto login_out;
     }
 
-    for(CK_ULONG i = 0; i < YKCS11_MAX_SESSIONS; i++) {
+    for(CK_ULONG i = 0; i < max_sessions; i++) {
       if (sessions[i].slot == session->slot && !(sessions[i].info.flags & CKF_RW_SESSION)) {
         DBG("Tried to log-in SO with existing RO sessions");
-        locking.pfnUnlockMutex(session->slot->mutex);
+        unlock_slot(session->slot);
         rv = CKR_SESSION_READ_ONLY_EXISTS;
         goto login_out;
       }
@@ -1354,12 +2327,12 @@ CK_DEFINE_FUNCTION(CK_RV, C_Login)(
     rv = token_login(session->slot->piv_state, CKU_SO, pPin, ulPinLen);
     if (rv != CKR_OK) {
       DBG("Unable to login as SO");
-      locking.pfnUnlockMutex(session->slot->mutex);
+      unlock_slot(session->slot);
       goto login_out;
     }
 
     session->slot->login_state = YKCS11_SO;
-    locking.pfnUnlockMutex(session->slot->mutex);
+    unlock_slot(session->slot);
     break;
 
   default:
@@ -1396,17 +2369,18 @@ CK_DEFINE_FUNCTION(CK_RV, C_Logout)(
     goto logout_out;
   }
 
-  locking.pfnLockMutex(session->slot->mutex);
+  lock_slot(session->slot);
 
   if (session->slot->login_state == YKCS11_PUBLIC) {
-    locking.pfnUnlockMutex(session->slot->mutex);
+    unlock_slot(session->slot);
     rv = CKR_USER_NOT_LOGGED_IN;
     goto logout_out;
   }
 
+  // Queued writes need the SO to be logged in
+  rv = flush_writes(session->slot);
   session->slot->login_state = YKCS11_PUBLIC;
-  locking.pfnUnlockMutex(session->slot->mutex);
-  rv = CKR_OK;
+  unlock_slot(session->slot);
 
 logout_out:  
   DOUT;
@@ -1493,33 +2467,40 @@ CK_DEFINE_FUNCTION(CK_RV, C_CreateObject)(
     pubk_id = find_pubk_object(id);
     pvtk_id = find_pvtk_object(id);
 
-    locking.pfnLockMutex(session->slot->mutex);
+    lock_slot(session->slot);
 
     if (session->slot->login_state != YKCS11_SO) {
       DBG("Authentication as SO required to import objects");
-      locking.pfnUnlockMutex(session->slot->mutex);
+      unlock_slot(session->slot);
       rv = CKR_USER_TYPE_INVALID;
       goto create_out;
     }
 
-    rv = token_import_cert(session->slot->piv_state, piv_2_ykpiv(cert_id), value, value_len);
+    if (write_behind_ms) {
+      CK_BYTE certdata[YKPIV_OBJ_MAX_SIZE + 16];
+      CK_ULONG certdata_len = sizeof(certdata);
+      if ((rv = token_encode_cert(value, value_len, certdata, &certdata_len)) == CKR_OK)
+        rv = queue_write(session->slot, id, certdata, certdata_len);
+    } else {
+      rv = token_import_cert(session->slot->piv_state, piv_2_ykpiv(cert_id), value, value_len);
+    }
     if (rv != CKR_OK) {
       DBG("Unable to import certificate");
-      locking.pfnUnlockMutex(session->slot->mutex);
+      unlock_slot(session->slot);
       goto create_out;
     }
 
     rv = store_data(session->slot, id, value, value_len);
     if (rv != CKR_OK) {
       DBG("Unable to store data in session");
-      locking.pfnUnlockMutex(session->slot->mutex);
+      unlock_slot(session->slot);
       goto create_out;
     }
 
     rv = store_cert(session->slot, id, value, value_len, CK_TRUE);
     if (rv != CKR_OK) {
       DBG("Unable to store certificate in session");
-      locking.pfnUnlockMutex(session->slot->mutex);
+      unlock_slot(session->slot);
       goto create_out;
     }
 
@@ -1537,8 +2518,9 @@ CK_DEFINE_FUNCTION(CK_RV, C_CreateObject)(
     // No attestation can be created for imported objects
 
     sort_objects(session->slot);
+    cache_invalidate_slot(session->slot);
 
-    locking.pfnUnlockMutex(session->slot->mutex);
+    unlock_slot(session->slot);
 
     *phObject = (CK_OBJECT_HANDLE)cert_id;
     break;
@@ -1598,11 +2580,11 @@ CK_DEFINE_FUNCTION(CK_RV, C_CreateObject)(
     pubk_id = find_pubk_object(id);
     CK_ULONG slot = piv_2_ykpiv(pvtk_id);
 
-    locking.pfnLockMutex(session->slot->mutex);
+    lock_slot(session->slot);
 
     if (session->slot->login_state != YKCS11_SO) {
       DBG("Authentication as SO required to import objects");
-      locking.pfnUnlockMutex(session->slot->mutex);
+      unlock_slot(session->slot);
       rv = CKR_USER_TYPE_INVALID;
       goto create_out;
     }
@@ -1617,7 +2599,7 @@ CK_DEFINE_FUNCTION(CK_RV, C_CreateObject)(
                                pin_policy, touch_policy);
     if (rc != YKPIV_OK) {
       DBG("Unable to import private key: %s", ykpiv_strerror(rc));
-      locking.pfnUnlockMutex(session->slot->mutex);
+      unlock_slot(session->slot);
       rv = CKR_DEVICE_ERROR;
       goto create_out;
     }
@@ -1626,6 +2608,8 @@ CK_DEFINE_FUNCTION(CK_RV, C_CreateObject)(
     session->slot->pin_policy[id] = pin_policy;
     session->slot->touch_policy[id] = touch_policy;
 
+    // The cached attributes and encryption context belong to the replaced key and attestation
+    drop_attributes(session->slot, id);
     do_delete_cert(session->slot->atst + id);
     do_store_pubk(session->slot->certs[id], session->slot->pkeys + id);
 
@@ -1639,6 +2623,7 @@ CK_DEFINE_FUNCTION(CK_RV, C_CreateObject)(
         session->slot->pin_policy[id] = md.pin_policy;
         session->slot->touch_policy[id] = md.touch_policy;
         if(md.pubkey_len) {
+          drop_attributes(session->slot, id);
           if((rv = do_create_public_key(md.pubkey, md.pubkey_len, md.algorithm, &session->slot->pkeys[id])) == CKR_OK) {
             add_object(session->slot, pubk_id);
           } else {
@@ -1657,8 +2642,9 @@ CK_DEFINE_FUNCTION(CK_RV, C_CreateObject)(
     // No attestation can be created for imported objects
 
     sort_objects(session->slot);
+    cache_invalidate_slot(session->slot);
 
-    locking.pfnUnlockMutex(session->slot->mutex);
+    unlock_slot(session->slot);
     *phObject = (CK_OBJECT_HANDLE)pvtk_id;
     break;
 
@@ -1711,6 +2697,13 @@ CK_DEFINE_FUNCTION(CK_RV, C_DestroyObject)(
     goto destroy_out;
   }
 
+  ykcs11_secret_t *key = get_session_key(session, hObject);
+  if (key != NULL) {
+    OPENSSL_cleanse(key, sizeof(*key));
+    rv = CKR_OK;
+    goto destroy_out;
+  }
+
   // Silently ignore valid but not-present handles for compatibility with applications
   CK_BYTE id = get_sub_id(hObject);
   if(id == 0 && hObject != PIV_SECRET_OBJ) {
@@ -1719,25 +2712,29 @@ CK_DEFINE_FUNCTION(CK_RV, C_DestroyObject)(
     goto destroy_out;
   }
 
-  locking.pfnLockMutex(session->slot->mutex);
+  lock_slot(session->slot);
 
   if(id) {
     // SO must be logged in
     if (session->slot->login_state != YKCS11_SO) {
       DBG("Authentication as SO required to delete objects");
-      locking.pfnUnlockMutex(session->slot->mutex);
+      unlock_slot(session->slot);
       rv = CKR_USER_TYPE_INVALID;
       goto destroy_out;
     }
 
     DBG("Deleting object %lx from token", piv_2_ykpiv(find_data_object(id)));
  
-    rv = token_delete_cert(session->slot->piv_state, piv_2_ykpiv(find_data_object(id)));
+    if (write_behind_ms)
+      rv = queue_write(session->slot, id, NULL, 0);
+    else
+      rv = token_delete_cert(session->slot->piv_state, piv_2_ykpiv(find_data_object(id)));
     if (rv != CKR_OK) {
       DBG("Unable to delete object %lx from token", piv_2_ykpiv(find_data_object(id)));
-      locking.pfnUnlockMutex(session->slot->mutex);
+      unlock_slot(session->slot);
       goto destroy_out;
     }
+    cache_invalidate_slot(session->slot);
   }
 
   // Remove the related objects from the session
@@ -1750,24 +2747,25 @@ CK_DEFINE_FUNCTION(CK_RV, C_DestroyObject)(
       session->slot->objects[j++] = session->slot->objects[i];
   }
   session->slot->n_objects = j;
+  sort_objects(session->slot);
 
   DBG("%lu slot objects after destroying object %lu", session->slot->n_objects, hObject);
 
   rv = delete_data(session->slot, id);
   if (rv != CKR_OK) {
     DBG("Unable to delete data from slot");
-    locking.pfnUnlockMutex(session->slot->mutex);
+    unlock_slot(session->slot);
     goto destroy_out;
   }
 
   rv = delete_cert(session->slot, id);
   if (rv != CKR_OK) {
     DBG("Unable to delete certificate from slot");
-    locking.pfnUnlockMutex(session->slot->mutex);
+    unlock_slot(session->slot);
     goto destroy_out;
   }
 
-  locking.pfnUnlockMutex(session->slot->mutex);
+  unlock_slot(session->slot);
   rv = CKR_OK;
 
 destroy_out:
@@ -1803,18 +2801,25 @@ CK_DEFINE_FUNCTION(CK_RV, C_GetObjectSize)(
     goto getobj_out;
   }
 
-  locking.pfnLockMutex(session->slot->mutex);
+  ykcs11_secret_t *key = get_session_key(session, hObject);
+  if (key != NULL) {
+    *pulSize = key->len;
+    rv = CKR_OK;
+    goto getobj_out;
+  }
+
+  lock_objects(session->slot);
 
   if (!is_present(session->slot, hObject)) {
     DBG("Object handle is invalid");
-    locking.pfnUnlockMutex(session->slot->mutex);
+    unlock_objects(session->slot);
     rv = CKR_OBJECT_HANDLE_INVALID;
     goto getobj_out;
   }
 
   rv = get_data_len(session->slot, get_sub_id(hObject), pulSize);
 
-  locking.pfnUnlockMutex(session->slot->mutex);
+  unlock_objects(session->slot);
 
 getobj_out:
   DOUT;
@@ -1852,11 +2857,30 @@ CK_DEFINE_FUNCTION(CK_RV, C_GetAttributeValue)(
     goto getattr_out;
   }
 
-  locking.pfnLockMutex(session->slot->mutex);
+  ykcs11_secret_t *key = get_session_key(session, hObject);
+  if (key != NULL) {
+    rv_final = CKR_OK;
+    for (i = 0; i < ulCount; i++) {
+      rv = get_secret_attribute(key, pTemplate + i);
+      if (rv != CKR_OK) {
+        DBG("Unable to get attribute 0x%lx of object %lu", (pTemplate + i)->type, hObject);
+        (pTemplate + i)->ulValueLen = CK_UNAVAILABLE_INFORMATION;
+        rv_final = rv;
+      }
+    }
+    goto getattr_out;
+  }
+
+  lock_objects(session->slot);
+
+  CK_BYTE sub_id = get_sub_id(hObject);
+  if (sub_id && !is_present(session->slot, hObject)) {
+    load_slot_objects_shared(session->slot, sub_id);
+  }
 
   if (!is_present(session->slot, hObject)) {
     DBG("Object handle is invalid");
-    locking.pfnUnlockMutex(session->slot->mutex);
+    unlock_objects(session->slot);
     rv_final = CKR_OBJECT_HANDLE_INVALID;
     goto getattr_out;
   }
@@ -1874,7 +2898,7 @@ CK_DEFINE_FUNCTION(CK_RV, C_GetAttributeValue)(
     }
   }
 
-  locking.pfnUnlockMutex(session->slot->mutex);
+  unlock_objects(session->slot);
 
 getattr_out:
   DOUT;
@@ -1929,41 +2953,64 @@ CK_DEFINE_FUNCTION(CK_RV, C_FindObjectsInit)(
     goto findinit_out;
   }
 
+  if (session->find_obj.objects == NULL &&
+      (session->find_obj.objects = calloc(PIV_OBJ_COUNT, sizeof(piv_obj_id_t))) == NULL) {
+    DBG("Unable to allocate search results");
+    rv = CKR_HOST_MEMORY;
+    goto findinit_out;
+  }
+
   session->find_obj.active = CK_TRUE;
   session->find_obj.n_objects = 0;
   session->find_obj.idx = 0;
 
   DBG("Initialized search with %lu parameters", ulCount);
 
-  locking.pfnLockMutex(session->slot->mutex);
+  lock_objects(session->slot);
 
-  // Match parameters
-  for (CK_ULONG i = 0; i < session->slot->n_objects; i++) {
+  // Key objects are always known, anything else may not have been read from the token yet
+  bool keys_only = false;
+  for (CK_ULONG j = 0; j < ulCount; j++) {
+    if (pTemplate[j].type == CKA_CLASS && pTemplate[j].pValue && pTemplate[j].ulValueLen == sizeof(CK_OBJECT_CLASS)) {
+      CK_OBJECT_CLASS cls = *(CK_OBJECT_CLASS *)pTemplate[j].pValue;
+      keys_only = (cls == CKO_PRIVATE_KEY || cls == CKO_PUBLIC_KEY || cls == CKO_SECRET_KEY);
+    }
+  }
+  if (!keys_only) {
+    load_slot_objects_shared(session->slot, 0);
+  }
+
+  // Narrow down the search using the slot index, then match the remaining parameters
+  CK_ULONG n_candidates = find_candidates(session->slot, pTemplate, ulCount, session->find_obj.objects);
+  DBG("%lu candidate object(s) from the slot index", n_candidates);
+
+  for (CK_ULONG i = 0; i < n_candidates; i++) {
+    piv_obj_id_t obj = session->find_obj.objects[i];
 
     // Strip away private objects if needed
     if (session->slot->login_state == YKCS11_PUBLIC) {
-      if (is_private_object(session->slot->objects[i]) == CK_TRUE) {
-        DBG("Removing private object %u", session->slot->objects[i]);
+      if (is_private_object(obj) == CK_TRUE) {
+        DBG("Removing private object %u", obj);
         continue;
       }
     }
   
     bool keep = true;
     for (CK_ULONG j = 0; j < ulCount; j++) {
-      if (attribute_match(session->slot, session->slot->objects[i], pTemplate + j) == CK_FALSE) {
-        DBG("Removing object %u", session->slot->objects[i]);
+      if (attribute_match(session->slot, obj, pTemplate + j) == CK_FALSE) {
+        DBG("Removing object %u", obj);
         keep = false;
         break;
       }
     }
 
     if(keep) {
-      DBG("Keeping object %u", session->slot->objects[i]);
-      session->find_obj.objects[session->find_obj.n_objects++] = session->slot->objects[i];
+      DBG("Keeping object %u", obj);
+      session->find_obj.objects[session->find_obj.n_objects++] = obj;
     }
   }
 
-  locking.pfnUnlockMutex(session->slot->mutex);
+  unlock_objects(session->slot);
 
   DBG("%lu object(s) left after attribute matching", session->find_obj.n_objects);
   rv = CKR_OK;
@@ -2089,11 +3136,21 @@ CK_DEFINE_FUNCTION(CK_RV, C_EncryptInit)(
     goto encinit_out;
   }
 
+  if ((rv = get_op_buf(session)) != CKR_OK) {
+    goto encinit_out;
+  }
+
   if (pMechanism == NULL) {
     rv = CKR_ARGUMENTS_BAD;
     goto encinit_out;
   }
 
+  ykcs11_secret_t *key = get_session_key(session, hKey);
+  if (key != NULL) {
+    rv = session_key_init(session, key, pMechanism, CK_TRUE, CK_FALSE);
+    goto encinit_out;
+  }
+
   if (hKey < PIV_PUBK_OBJ_PIV_AUTH || hKey > PIV_PUBK_OBJ_ATTESTATION) {
     DBG("Key handle %lu is not a public key", hKey);
     rv = CKR_KEY_HANDLE_INVALID;
@@ -2102,25 +3159,27 @@ CK_DEFINE_FUNCTION(CK_RV, C_EncryptInit)(
 
   CK_BYTE id = get_sub_id(hKey);
 
-  locking.pfnLockMutex(session->slot->mutex);
+  lock_slot(session->slot);
 
   if (!is_present(session->slot, hKey)) {
     DBG("Key handle is invalid");
-    locking.pfnUnlockMutex(session->slot->mutex);
+    unlock_slot(session->slot);
     rv = CKR_OBJECT_HANDLE_INVALID;
     goto encinit_out;
   }
 
   session->op_info.op.encrypt.piv_key = piv_2_ykpiv(find_pvtk_object(id));
+  session->op_info.op.encrypt.sub_id = id;
 
   rv = decrypt_mechanism_init(session, session->slot->pkeys[id], pMechanism);
   if(rv != CKR_OK) {
     DBG("Failed to initialize encryption operation");
-    locking.pfnUnlockMutex(session->slot->mutex);
+    encrypt_mechanism_cleanup(session);
+    unlock_slot(session->slot);
     goto encinit_out;
   }
 
-  locking.pfnUnlockMutex(session->slot->mutex);
+  unlock_slot(session->slot);
 
   session->op_info.buf_len = 0;
   session->op_info.type = YKCS11_ENCRYPT;
@@ -2156,6 +3215,18 @@ CK_DEFINE_FUNCTION(CK_RV, C_Encrypt)(
     return CKR_SESSION_HANDLE_INVALID;
   }
 
+  if (session->op_info.type == YKCS11_ENCRYPT && is_cipher_mechanism(session->op_info.mechanism)) {
+    if (pData == NULL || pulEncryptedDataLen == NULL) {
+      DBG("Invalid parameters");
+      rv = CKR_ARGUMENTS_BAD;
+    } else {
+      rv = cipher_mechanism_data(session, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
+    }
+    end_cipher(session, pEncryptedData, rv);
+    DOUT;
+    return rv;
+  }
+
   if (pData == NULL || pulEncryptedDataLen == NULL) {
     DBG("Invalid parameters");
     rv = CKR_ARGUMENTS_BAD;
@@ -2170,12 +3241,10 @@ CK_DEFINE_FUNCTION(CK_RV, C_Encrypt)(
 
   DBG("Using public key for slot %x for encryption", session->op_info.op.encrypt.piv_key);
 
-  rv = do_rsa_encrypt(session->op_info.op.encrypt.key,
-                      session->op_info.op.encrypt.padding,
-                      session->op_info.op.encrypt.oaep_md, session->op_info.op.encrypt.mgf1_md,
-                      session->op_info.op.encrypt.oaep_label, session->op_info.op.encrypt.oaep_label_len,
-                      pData, ulDataLen,
-                      pEncryptedData, pulEncryptedDataLen);
+  // The prepared encryption context is shared by all sessions on the slot
+  lock_slot(session->slot);
+  rv = encrypt_mechanism_final(session, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
+  unlock_slot(session->slot);
   if(rv != CKR_OK) {
     DBG("Encryption operation failed");
     goto enc_out;
@@ -2186,6 +3255,9 @@ CK_DEFINE_FUNCTION(CK_RV, C_Encrypt)(
 
 enc_out:
   if(pEncryptedData) {
+    if(session->op_info.type == YKCS11_ENCRYPT) {
+      encrypt_mechanism_cleanup(session);
+    }
     session->op_info.type = YKCS11_NOOP;
     session->op_info.buf_len = 0;
   }
@@ -2230,8 +3302,17 @@ CK_DEFINE_FUNCTION(CK_RV, C_EncryptUpdate)(
     goto encupdate_out;
   }
 
-  if(session->op_info.buf_len + ulPartLen > sizeof(session->op_info.buf)) {
-    DBG("Too much data added to operation buffer, max is %zu bytes", sizeof(session->op_info.buf));
+  if (is_cipher_mechanism(session->op_info.mechanism)) {
+    rv = cipher_mechanism_update(session, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen);
+    if (rv != CKR_OK && rv != CKR_BUFFER_TOO_SMALL) {
+      cipher_mechanism_cleanup(session);
+      session->op_info.type = YKCS11_NOOP;
+    }
+    goto encupdate_out;
+  }
+
+  if(session->op_info.buf_len + ulPartLen > YKCS11_OP_BUF_LEN) {
+    DBG("Too much data added to operation buffer, max is %d bytes", YKCS11_OP_BUF_LEN);
     rv = CKR_DATA_LEN_RANGE;
     goto encupdate_out;
   }
@@ -2270,6 +3351,18 @@ CK_DEFINE_FUNCTION(CK_RV, C_EncryptFinal)(
     return CKR_SESSION_HANDLE_INVALID;
   }
 
+  if (session->op_info.type == YKCS11_ENCRYPT && is_cipher_mechanism(session->op_info.mechanism)) {
+    if (pulLastEncryptedPartLen == NULL) {
+      DBG("Invalid parameters");
+      rv = CKR_ARGUMENTS_BAD;
+    } else {
+      rv = cipher_mechanism_final(session, pLastEncryptedPart, pulLastEncryptedPartLen);
+    }
+    end_cipher(session, pLastEncryptedPart, rv);
+    DOUT;
+    return rv;
+  }
+
   if (pulLastEncryptedPartLen == NULL) {
     DBG("Invalid parameters");
     rv = CKR_ARGUMENTS_BAD;  
@@ -2284,14 +3377,10 @@ CK_DEFINE_FUNCTION(CK_RV, C_EncryptFinal)(
 
   DBG("Using slot %x for encryption", session->op_info.op.encrypt.piv_key);
 
-  rv = do_rsa_encrypt(session->op_info.op.encrypt.key,
-                      session->op_info.op.encrypt.padding,
-                      session->op_info.op.encrypt.oaep_md, session->op_info.op.encrypt.mgf1_md,
-                      session->op_info.op.encrypt.oaep_label, session->op_info.op.encrypt.oaep_label_len,
-                      session->op_info.buf,
-                      session->op_info.buf_len,
-                      pLastEncryptedPart,
-                      pulLastEncryptedPartLen);
+  lock_slot(session->slot);
+  rv = encrypt_mechanism_final(session, session->op_info.buf, session->op_info.buf_len,
+                               pLastEncryptedPart, pulLastEncryptedPartLen);
+  unlock_slot(session->slot);
   if(rv != CKR_OK) {
     DBG("Encryption operation failed");
     goto encfinal_out;
@@ -2302,6 +3391,9 @@ CK_DEFINE_FUNCTION(CK_RV, C_EncryptFinal)(
   
 encfinal_out:  
   if(pLastEncryptedPart) {
+    if(session->op_info.type == YKCS11_ENCRYPT) {
+      encrypt_mechanism_cleanup(session);
+    }
     session->op_info.type = YKCS11_NOOP;
     session->op_info.buf_len = 0;
   }
@@ -2338,11 +3430,21 @@ CK_DEFINE_FUNCTION(CK_RV, C_DecryptInit)(
     goto decinit_out;
   }
 
+  if ((rv = get_op_buf(session)) != CKR_OK) {
+    goto decinit_out;
+  }
+
   if (pMechanism == NULL) {
     rv = CKR_ARGUMENTS_BAD;
     goto decinit_out;
   }
 
+  ykcs11_secret_t *key = get_session_key(session, hKey);
+  if (key != NULL) {
+    rv = session_key_init(session, key, pMechanism, CK_FALSE, CK_FALSE);
+    goto decinit_out;
+  }
+
   if (hKey < PIV_PVTK_OBJ_PIV_AUTH || hKey > PIV_PVTK_OBJ_ATTESTATION) {
     DBG("Key handle %lu is not a private key", hKey);
     rv = CKR_KEY_HANDLE_INVALID;
@@ -2351,11 +3453,11 @@ CK_DEFINE_FUNCTION(CK_RV, C_DecryptInit)(
 
   CK_BYTE id = get_sub_id(hKey);
 
-  locking.pfnLockMutex(session->slot->mutex);
+  lock_slot(session->slot);
 
   if (!is_present(session->slot, hKey)) {
     DBG("Key handle is invalid");
-    locking.pfnUnlockMutex(session->slot->mutex);
+    unlock_slot(session->slot);
     rv = CKR_OBJECT_HANDLE_INVALID;
     goto decinit_out;
   }
@@ -2363,7 +3465,7 @@ CK_DEFINE_FUNCTION(CK_RV, C_DecryptInit)(
   // This allows decrypting when logged in as SO and then doing a context-specific login as USER
   if (session->slot->login_state == YKCS11_PUBLIC) {
     DBG("User is not logged in");
-    locking.pfnUnlockMutex(session->slot->mutex);
+    unlock_slot(session->slot);
     rv = CKR_USER_NOT_LOGGED_IN;
     goto decinit_out;
   }
@@ -2373,11 +3475,11 @@ CK_DEFINE_FUNCTION(CK_RV, C_DecryptInit)(
   rv = decrypt_mechanism_init(session, session->slot->pkeys[id], pMechanism);
   if(rv != CKR_OK) {
     DBG("Failed to initialize decryption operation");
-    locking.pfnUnlockMutex(session->slot->mutex);
+    unlock_slot(session->slot);
     goto decinit_out;
   }
 
-  locking.pfnUnlockMutex(session->slot->mutex);
+  unlock_slot(session->slot);
   
   session->op_info.buf_len = 0;
   session->op_info.type = YKCS11_DECRYPT;
@@ -2413,6 +3515,18 @@ CK_DEFINE_FUNCTION(CK_RV, C_Decrypt)(
     return CKR_SESSION_HANDLE_INVALID;
   }
 
+  if (session->op_info.type == YKCS11_DECRYPT && is_cipher_mechanism(session->op_info.mechanism)) {
+    if (pEncryptedData == NULL || pulDataLen == NULL) {
+      DBG("Invalid parameters");
+      rv = CKR_ARGUMENTS_BAD;
+    } else {
+      rv = cipher_mechanism_data(session, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen);
+    }
+    end_cipher(session, pData, rv);
+    DOUT;
+    return rv;
+  }
+
   if (pEncryptedData == NULL || pulDataLen == NULL) {
     DBG("Invalid parameters");
     rv = CKR_ARGUMENTS_BAD;
@@ -2444,8 +3558,8 @@ CK_DEFINE_FUNCTION(CK_RV, C_Decrypt)(
 
   DBG("Using slot %x to decrypt %lu bytes", session->op_info.op.encrypt.piv_key, ulEncryptedDataLen);
 
-  if(ulEncryptedDataLen > sizeof(session->op_info.buf)) {
-    DBG("Too much data added to operation buffer, max is %zu bytes", sizeof(session->op_info.buf));
+  if(ulEncryptedDataLen > YKCS11_OP_BUF_LEN) {
+    DBG("Too much data added to operation buffer, max is %d bytes", YKCS11_OP_BUF_LEN);
     rv = CKR_DATA_LEN_RANGE;
     goto decrypt_out;
   }
@@ -2453,19 +3567,22 @@ CK_DEFINE_FUNCTION(CK_RV, C_Decrypt)(
   session->op_info.buf_len = ulEncryptedDataLen;
   memcpy(session->op_info.buf, pEncryptedData, ulEncryptedDataLen);
 
-  locking.pfnLockMutex(session->slot->mutex);
+  lock_slot(session->slot);
 
   // This allows decrypting when logged in as SO and then doing a context-specific login as USER
   if (session->slot->login_state == YKCS11_PUBLIC) {
     DBG("User is not logged in");
     rv = CKR_USER_NOT_LOGGED_IN;
-    locking.pfnUnlockMutex(session->slot->mutex);
+    unlock_slot(session->slot);
     goto decrypt_out;
   }
 
+  // Only the card is used from here on
+  unlock_objects(session->slot);
+
   rv = decrypt_mechanism_final(session, pData, pulDataLen, key_len);
 
-  locking.pfnUnlockMutex(session->slot->mutex);
+  unlock_card(session->slot);
 
   DBG("Got %lu bytes back", *pulDataLen);
 
@@ -2512,10 +3629,19 @@ CK_DEFINE_FUNCTION(CK_RV, C_DecryptUpdate)(
     goto decrypt_out;
   }
 
+  if (is_cipher_mechanism(session->op_info.mechanism)) {
+    rv = cipher_mechanism_update(session, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen);
+    if (rv != CKR_OK && rv != CKR_BUFFER_TOO_SMALL) {
+      cipher_mechanism_cleanup(session);
+      session->op_info.type = YKCS11_NOOP;
+    }
+    goto decrypt_out;
+  }
+
   DBG("Adding %lu bytes to be decrypted", ulEncryptedPartLen);
 
-  if(session->op_info.buf_len + ulEncryptedPartLen > sizeof(session->op_info.buf)) {
-    DBG("Too much data added to operation buffer, max is %zu bytes", sizeof(session->op_info.buf));
+  if(session->op_info.buf_len + ulEncryptedPartLen > YKCS11_OP_BUF_LEN) {
+    DBG("Too much data added to operation buffer, max is %d bytes", YKCS11_OP_BUF_LEN);
     rv = CKR_DATA_LEN_RANGE;
     goto decrypt_out;
   }
@@ -2554,6 +3680,18 @@ CK_DEFINE_FUNCTION(CK_RV, C_DecryptFinal)(
     return CKR_SESSION_HANDLE_INVALID;
   }
 
+  if (session->op_info.type == YKCS11_DECRYPT && is_cipher_mechanism(session->op_info.mechanism)) {
+    if (pulLastPartLen == NULL) {
+      DBG("Invalid parameters");
+      rv = CKR_ARGUMENTS_BAD;
+    } else {
+      rv = cipher_mechanism_final(session, pLastPart, pulLastPartLen);
+    }
+    end_cipher(session, pLastPart, rv);
+    DOUT;
+    return rv;
+  }
+
   if (pulLastPartLen == NULL) {
     DBG("Invalid parameters");
     rv = CKR_ARGUMENTS_BAD;
@@ -2585,19 +3723,22 @@ CK_DEFINE_FUNCTION(CK_RV, C_DecryptFinal)(
 
   DBG("Using slot %x to decrypt %lu bytes", session->op_info.op.encrypt.piv_key, session->op_info.buf_len);
 
-  locking.pfnLockMutex(session->slot->mutex);
+  lock_slot(session->slot);
 
     // This allows decrypting when logged in as SO and then doing a context-specific login as USER
   if (session->slot->login_state == YKCS11_PUBLIC) {
     DBG("User is not logged in");
     rv = CKR_USER_NOT_LOGGED_IN;
-    locking.pfnUnlockMutex(session->slot->mutex);
+    unlock_slot(session->slot);
     goto decrypt_out;
   }
 
+  // Only the card is used from here on
+  unlock_objects(session->slot);
+
   rv = decrypt_mechanism_final(session, pLastPart, pulLastPartLen, key_len);
 
-  locking.pfnUnlockMutex(session->slot->mutex);
+  unlock_card(session->slot);
 
   DBG("Got %lu bytes back", *pulLastPartLen);
 
@@ -2636,6 +3777,10 @@ CK_DEFINE_FUNCTION(CK_RV, C_DigestInit)(
     goto digest_out;
   }
 
+  if ((rv = get_op_buf(session)) != CKR_OK) {
+    goto digest_out;
+  }
+
   if (pMechanism == NULL) {
     DBG("Wrong/Missing parameter");
     rv = CKR_ARGUMENTS_BAD;
@@ -2837,6 +3982,48 @@ digest_out:
   return rv;
 }
 
+static CK_RV sign_init(ykcs11_session_t *session, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey) {
+
+  if (pMechanism == NULL) {
+    DBG("Mechanism not specified");
+    return CKR_ARGUMENTS_BAD;
+  }
+
+  if (hKey < PIV_PVTK_OBJ_PIV_AUTH || hKey > PIV_PVTK_OBJ_ATTESTATION) {
+    DBG("Key handle %lu is not a private key", hKey);
+    return CKR_KEY_HANDLE_INVALID;
+  }
+
+  CK_BYTE id = get_sub_id(hKey);
+
+  lock_slot(session->slot);
+
+  if (!is_present(session->slot, hKey)) {
+    DBG("Key handle %lu is invalid", hKey);
+    unlock_slot(session->slot);
+    return CKR_OBJECT_HANDLE_INVALID;
+  }
+
+  // This allows signing when logged in as SO and then doing a context-specific login to sign
+  if (session->slot->login_state == YKCS11_PUBLIC) {
+    DBG("User is not logged in");
+    unlock_slot(session->slot);
+    return CKR_USER_NOT_LOGGED_IN;
+  }
+
+  session->op_info.op.sign.piv_key = piv_2_ykpiv(hKey);
+  session->op_info.op.sign.message = CK_FALSE;
+
+  CK_RV rv = sign_mechanism_init(session, session->slot->pkeys[id], pMechanism);
+  if (rv != CKR_OK) {
+    DBG("Unable to initialize signing operation");
+    sign_mechanism_cleanup(session);
+  }
+
+  unlock_slot(session->slot);
+  return rv;
+}
+
 CK_DEFINE_FUNCTION(CK_RV, C_SignInit)(
   CK_SESSION_HANDLE hSession,
   CK_MECHANISM_PTR pMechanism,
@@ -2866,49 +4053,14 @@ CK_DEFINE_FUNCTION(CK_RV, C_SignInit)(
     goto signinit_out;
   }
 
-  if (pMechanism == NULL) {
-    DBG("Mechanism not specified");
-    rv = CKR_ARGUMENTS_BAD;
-    goto signinit_out;
-  }
-
-  if (hKey < PIV_PVTK_OBJ_PIV_AUTH || hKey > PIV_PVTK_OBJ_ATTESTATION) {
-    DBG("Key handle %lu is not a private key", hKey);
-    rv = CKR_KEY_HANDLE_INVALID;
-    goto signinit_out;
-  }
-
-  CK_BYTE id = get_sub_id(hKey);
-
-  locking.pfnLockMutex(session->slot->mutex);
-
-  if (!is_present(session->slot, hKey)) {
-    DBG("Key handle %lu is invalid", hKey);
-    locking.pfnUnlockMutex(session->slot->mutex);
-    rv = CKR_OBJECT_HANDLE_INVALID;
-    goto signinit_out;
-  }
-
-  // This allows signing when logged in as SO and then doing a context-specific login to sign
-  if (session->slot->login_state == YKCS11_PUBLIC) {
-    DBG("User is not logged in");
-    locking.pfnUnlockMutex(session->slot->mutex);
-    rv = CKR_USER_NOT_LOGGED_IN;
+  if ((rv = get_op_buf(session)) != CKR_OK) {
     goto signinit_out;
   }
 
-  session->op_info.op.sign.piv_key = piv_2_ykpiv(hKey);
-
-  rv = sign_mechanism_init(session, session->slot->pkeys[id], pMechanism);
-  if (rv != CKR_OK) {
-    DBG("Unable to initialize signing operation");
-    sign_mechanism_cleanup(session);
-    locking.pfnUnlockMutex(session->slot->mutex);
+  if ((rv = sign_init(session, pMechanism, hKey)) != CKR_OK) {
     goto signinit_out;
   }
 
-  locking.pfnUnlockMutex(session->slot->mutex);
-
   session->op_info.type = YKCS11_SIGN;
   rv = CKR_OK;
 
@@ -2968,29 +4120,32 @@ CK_DEFINE_FUNCTION(CK_RV, C_Sign)(
     return CKR_BUFFER_TOO_SMALL;
   }
 
-  locking.pfnLockMutex(session->slot->mutex);
+  lock_slot(session->slot);
 
   // This allows signing when logged in as SO and then doing a context-specific login to sign
   if (session->slot->login_state == YKCS11_PUBLIC) {
     DBG("User is not logged in");
     rv = CKR_USER_NOT_LOGGED_IN;
-    locking.pfnUnlockMutex(session->slot->mutex);
+    unlock_slot(session->slot);
     goto sign_out;
   }
 
+  // Only the card is used from here on
+  unlock_objects(session->slot);
+
   if ((rv = digest_mechanism_update(session, pData, ulDataLen)) != CKR_OK) {
     DBG("digest_mechanism_update failed");
-    locking.pfnUnlockMutex(session->slot->mutex);
+    unlock_card(session->slot);
     goto sign_out;
   }
 
   if((rv = sign_mechanism_final(session, pSignature, pulSignatureLen)) != CKR_OK) {
     DBG("sign_mechanism_final failed");
-    locking.pfnUnlockMutex(session->slot->mutex);
+    unlock_card(session->slot);
     goto sign_out;
   }
 
-  locking.pfnUnlockMutex(session->slot->mutex);
+  unlock_card(session->slot);
 
   DBG("The signature is %lu bytes", *pulSignatureLen);
   rv = CKR_OK;
@@ -3102,23 +4257,26 @@ CK_DEFINE_FUNCTION(CK_RV, C_SignFinal)(
     return CKR_BUFFER_TOO_SMALL;
   }
 
-  locking.pfnLockMutex(session->slot->mutex);
+  lock_slot(session->slot);
 
   // This allows signing when logged in as SO and then doing a context-specific login to sign
   if (session->slot->login_state == YKCS11_PUBLIC) {
     DBG("User is not logged in");
     rv = CKR_USER_NOT_LOGGED_IN;
-    locking.pfnUnlockMutex(session->slot->mutex);
+    unlock_slot(session->slot);
     goto sign_out;
   }
 
+  // Only the card is used from here on
+  unlock_objects(session->slot);
+
   if((rv = sign_mechanism_final(session, pSignature, pulSignatureLen)) != CKR_OK) {
     DBG("sign_mechanism_final failed");
-    locking.pfnUnlockMutex(session->slot->mutex);
+    unlock_card(session->slot);
     goto sign_out;
   }
 
-  locking.pfnUnlockMutex(session->slot->mutex);
+  unlock_card(session->slot);
 
   DBG("The signature is %lu bytes", *pulSignatureLen);
   rv = CKR_OK;
@@ -3156,6 +4314,38 @@ CK_DEFINE_FUNCTION(CK_RV, C_SignRecover)(
   return CKR_FUNCTION_NOT_SUPPORTED;
 }
 
+static CK_RV verify_init(ykcs11_session_t *session, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey) {
+
+  if (hKey < PIV_PUBK_OBJ_PIV_AUTH || hKey > PIV_PUBK_OBJ_ATTESTATION) {
+    DBG("Key handle %lu is not a public key", hKey);
+    return CKR_KEY_HANDLE_INVALID;
+  }
+
+  if (pMechanism == NULL) {
+    DBG("Mechanism not specified");
+    return CKR_ARGUMENTS_BAD;
+  }
+
+  CK_BYTE id = get_sub_id(hKey);
+
+  lock_slot(session->slot);
+
+  if (!is_present(session->slot, hKey)) {
+    DBG("Key handle %lu is invalid", hKey);
+    unlock_slot(session->slot);
+    return CKR_OBJECT_HANDLE_INVALID;
+  }
+
+  CK_RV rv = verify_mechanism_init(session, session->slot->pkeys[id], pMechanism);
+  if (rv != CKR_OK) {
+    DBG("Unable to initialize verification operation");
+    verify_mechanism_cleanup(session);
+  }
+
+  unlock_slot(session->slot);
+  return rv;
+}
+
 CK_DEFINE_FUNCTION(CK_RV, C_VerifyInit)(
   CK_SESSION_HANDLE hSession,
   CK_MECHANISM_PTR pMechanism,
@@ -3185,39 +4375,14 @@ CK_DEFINE_FUNCTION(CK_RV, C_VerifyInit)(
     goto verifyinit_out;
   }
 
-  if (hKey < PIV_PUBK_OBJ_PIV_AUTH || hKey > PIV_PUBK_OBJ_ATTESTATION) {
-    DBG("Key handle %lu is not a public key", hKey);
-    rv = CKR_KEY_HANDLE_INVALID;
-    goto verifyinit_out;
-  }
-
-  if (pMechanism == NULL) {
-    DBG("Mechanism not specified");
-    rv = CKR_ARGUMENTS_BAD;
+  if ((rv = get_op_buf(session)) != CKR_OK) {
     goto verifyinit_out;
   }
 
-  CK_BYTE id = get_sub_id(hKey);
-
-  locking.pfnLockMutex(session->slot->mutex);
-
-  if (!is_present(session->slot, hKey)) {
-    DBG("Key handle %lu is invalid", hKey);
-    locking.pfnUnlockMutex(session->slot->mutex);
-    rv = CKR_OBJECT_HANDLE_INVALID;
-    goto verifyinit_out;
-  }
-  
-  rv = verify_mechanism_init(session, session->slot->pkeys[id], pMechanism);
-  if (rv != CKR_OK) {
-    DBG("Unable to initialize verification operation");
-    verify_mechanism_cleanup(session);
-    locking.pfnUnlockMutex(session->slot->mutex);
+  if ((rv = verify_init(session, pMechanism, hKey)) != CKR_OK) {
     goto verifyinit_out;
   }
 
-  locking.pfnUnlockMutex(session->slot->mutex);
-
   session->op_info.type = YKCS11_VERIFY;
   rv = CKR_OK;
 
@@ -3263,13 +4428,7 @@ CK_DEFINE_FUNCTION(CK_RV, C_Verify)(
     goto verify_out;
   }
 
-  rv = digest_mechanism_update(session, pData, ulDataLen);
-  if (rv != CKR_OK) {
-    DBG("Failed to update verification operation");
-    goto verify_out;
-  }
-
-  rv = verify_mechanism_final(session, pSignature, ulSignatureLen);
+  rv = verify_mechanism_data(session, pData, ulDataLen, pSignature, ulSignatureLen);
   if (rv != CKR_OK) {
     DBG("Unable to verify signature");
     goto verify_out;
@@ -3483,6 +4642,41 @@ CK_DEFINE_FUNCTION(CK_RV, C_GenerateKey)(
   return CKR_FUNCTION_NOT_SUPPORTED;
 }
 
+// Replaces the objects of a key generated without a placeholder certificate with those found from its metadata.
+// The attestation is only read from the token when other objects are needed. Must be called with the slot mutex held.
+static CK_RV expose_generated_key(ykcs11_slot_t *slot, CK_BYTE sub_id) {
+  CK_RV rv;
+  ykpiv_rc rc;
+
+  // A certificate left from the previous key would no longer match
+  if (!slot->loaded[sub_id] || is_present(slot, find_cert_object(sub_id))) {
+    if ((rv = token_delete_cert(slot->piv_state, piv_2_ykpiv(find_data_object(sub_id)))) != CKR_OK) {
+      DBG("Unable to delete the previous certificate for sub_id %u", sub_id);
+      return rv;
+    }
+  }
+
+  CK_ULONG j = 0;
+  for (CK_ULONG i = 0; i < slot->n_objects; i++) {
+    if(get_sub_id(slot->objects[i]) != sub_id)
+      slot->objects[j++] = slot->objects[i];
+  }
+  slot->n_objects = j;
+  delete_data(slot, sub_id);
+  if ((rv = delete_cert(slot, sub_id)) != CKR_OK) {
+    return rv;
+  }
+  slot->loaded[sub_id] = CK_FALSE;
+
+  if ((rc = load_key_metadata(slot, sub_id)) != YKPIV_OK) {
+    sort_objects(slot);
+    return yrc_to_rv(rc);
+  }
+  sort_objects(slot);
+  cache_invalidate_slot(slot);
+  return CKR_OK;
+}
+
 CK_DEFINE_FUNCTION(CK_RV, C_GenerateKeyPair)(
   CK_SESSION_HANDLE hSession,
   CK_MECHANISM_PTR pMechanism,
@@ -3546,6 +4740,7 @@ CK_DEFINE_FUNCTION(CK_RV, C_GenerateKeyPair)(
   }
 
   gen_info_t gen = {0};
+  gen.skip_cert = generate_without_cert;
 
   // Check the template for the public key
   if ((rv = check_pubkey_template(&gen, pMechanism, pPublicKeyTemplate, ulPublicKeyAttributeCount)) != CKR_OK) {
@@ -3581,33 +4776,52 @@ CK_DEFINE_FUNCTION(CK_RV, C_GenerateKeyPair)(
 
   DBG("Generating key with algorithm %u in object %u and %u in slot %lx", gen.algorithm, pvtk_id, pubk_id, slot);
 
-  locking.pfnLockMutex(session->slot->mutex);
+  lock_slot(session->slot);
 
   if (session->slot->login_state != YKCS11_SO) {
     DBG("Authentication as SO required to generate keys");
-    locking.pfnUnlockMutex(session->slot->mutex);
+    unlock_slot(session->slot);
     rv = CKR_USER_TYPE_INVALID;
     goto genkp_out;
   }
 
+  // A queued write could otherwise replace the certificate of the new key
+  if ((rv = flush_writes(session->slot)) != CKR_OK) {
+    DBG("Unable to flush queued writes");
+    unlock_slot(session->slot);
+    goto genkp_out;
+  }
+
   cert_len = sizeof(cert_data);
   if ((rv = token_generate_key(session->slot->piv_state, &gen, slot, cert_data, &cert_len)) != CKR_OK) {
     DBG("Unable to generate key pair");
-    locking.pfnUnlockMutex(session->slot->mutex);
+    unlock_slot(session->slot);
+    goto genkp_out;
+  }
+
+  if (cert_len == 0) {
+    rv = expose_generated_key(session->slot, gen.key_id);
+    unlock_slot(session->slot);
+    if (rv != CKR_OK) {
+      DBG("Unable to find generated key pair");
+      goto genkp_out;
+    }
+    *phPrivateKey = (CK_OBJECT_HANDLE)pvtk_id;
+    *phPublicKey  = (CK_OBJECT_HANDLE)pubk_id;
     goto genkp_out;
   }
 
   rv = store_data(session->slot, gen.key_id, cert_data, cert_len);
   if (rv != CKR_OK) {
     DBG("Unable to store data in session");
-    locking.pfnUnlockMutex(session->slot->mutex);
+    unlock_slot(session->slot);
     goto genkp_out;
   }
 
   rv = store_cert(session->slot, gen.key_id, cert_data, cert_len, CK_TRUE);
   if (rv != CKR_OK) {
     DBG("Unable to store certificate in session");
-    locking.pfnUnlockMutex(session->slot->mutex);
+    unlock_slot(session->slot);
     goto genkp_out;
   }
 
@@ -3630,6 +4844,7 @@ CK_DEFINE_FUNCTION(CK_RV, C_GenerateKeyPair)(
     ykpiv_rc rc = ykpiv_attest(session->slot->piv_state, slot, data, &len);
     if(rc == YKPIV_OK) {
       DBG("Created attestation for slot %lx", slot);
+      drop_attributes(session->slot, gen.key_id);
       if((rv = do_store_cert(data, len, session->slot->atst + gen.key_id)) == CKR_OK) {
         if ((rv = do_parse_attestation(session->slot->atst[gen.key_id], session->slot->pin_policy + gen.key_id, session->slot->touch_policy + gen.key_id)) != CKR_OK) {
           DBG("Failed to parse pin and touch policy from attestation for object %u slot %lx: %lu", gen.key_id, slot, rv);
@@ -3658,8 +4873,9 @@ CK_DEFINE_FUNCTION(CK_RV, C_GenerateKeyPair)(
   }
 
   sort_objects(session->slot);
+  cache_invalidate_slot(session->slot);
 
-  locking.pfnUnlockMutex(session->slot->mutex);
+  unlock_slot(session->slot);
 
   *phPrivateKey = (CK_OBJECT_HANDLE)pvtk_id;
   *phPublicKey  = (CK_OBJECT_HANDLE)pubk_id;
@@ -3697,9 +4913,169 @@ CK_DEFINE_FUNCTION(CK_RV, C_UnwrapKey)(
 )
 {
   DIN;
-  DBG("TODO!!!");
+  CK_RV rv;
+  CK_BYTE value[YKCS11_SECRET_MAX_LEN];
+  CK_ULONG value_len = sizeof(value);
+  CK_ULONG key_len;
+
+  if (!pid) {
+    DBG("libykpiv is not initialized or already finalized");
+    rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+    goto unwrap_out;
+  }
+
+  ykcs11_session_t* session = get_session(hSession);
+
+  if (session == NULL || session->slot == NULL) {
+    DBG("Session is not open");
+    rv = CKR_SESSION_HANDLE_INVALID;
+    goto unwrap_out;
+  }
+
+  if (pMechanism == NULL || pWrappedKey == NULL || phKey == NULL || (pTemplate == NULL && ulAttributeCount != 0)) {
+    DBG("Invalid parameters");
+    rv = CKR_ARGUMENTS_BAD;
+    goto unwrap_out;
+  }
+
+  if (session->op_info.type != YKCS11_NOOP) {
+    DBG("Other operation in process");
+    rv = CKR_OPERATION_ACTIVE;
+    goto unwrap_out;
+  }
+
+  if (pMechanism->mechanism != CKM_RSA_PKCS && pMechanism->mechanism != CKM_RSA_PKCS_OAEP) {
+    DBG("Mechanism %lu can't unwrap keys", pMechanism->mechanism);
+    rv = CKR_MECHANISM_INVALID;
+    goto unwrap_out;
+  }
+
+  if (hUnwrappingKey < PIV_PVTK_OBJ_PIV_AUTH || hUnwrappingKey > PIV_PVTK_OBJ_ATTESTATION) {
+    DBG("Key handle %lu is not a private key", hUnwrappingKey);
+    rv = CKR_UNWRAPPING_KEY_HANDLE_INVALID;
+    goto unwrap_out;
+  }
+
+  if ((rv = check_secret_key_template(pTemplate, ulAttributeCount, &key_len)) != CKR_OK) {
+    goto unwrap_out;
+  }
+
+  if ((rv = get_op_buf(session)) != CKR_OK) {
+    goto unwrap_out;
+  }
+
+  if (ulWrappedKeyLen > session->op_info.buf_size) {
+    DBG("Wrapped key is too large");
+    rv = CKR_WRAPPED_KEY_LEN_RANGE;
+    goto unwrap_out;
+  }
+
+  CK_BYTE id = get_sub_id(hUnwrappingKey);
+
+  lock_slot(session->slot);
+
+  if (!is_present(session->slot, hUnwrappingKey)) {
+    DBG("Key handle is invalid");
+    unlock_slot(session->slot);
+    rv = CKR_UNWRAPPING_KEY_HANDLE_INVALID;
+    goto unwrap_out;
+  }
+
+  if (session->slot->login_state == YKCS11_PUBLIC) {
+    DBG("User is not logged in");
+    unlock_slot(session->slot);
+    rv = CKR_USER_NOT_LOGGED_IN;
+    goto unwrap_out;
+  }
+
+  session->op_info.op.encrypt.piv_key = piv_2_ykpiv(hUnwrappingKey);
+
+  rv = decrypt_mechanism_init(session, session->slot->pkeys[id], pMechanism);
+  if (rv != CKR_OK) {
+    DBG("Failed to initialize unwrapping operation");
+    encrypt_mechanism_cleanup(session);
+    unlock_slot(session->slot);
+    if (rv == CKR_KEY_TYPE_INCONSISTENT)
+      rv = CKR_UNWRAPPING_KEY_TYPE_INCONSISTENT;
+    goto unwrap_out;
+  }
+
+  CK_ULONG key_bits = do_get_key_bits(session->slot->pkeys[id]);
+  memcpy(session->op_info.buf, pWrappedKey, ulWrappedKeyLen);
+  session->op_info.buf_len = ulWrappedKeyLen;
+
+  // Only the card is used from here on
+  unlock_objects(session->slot);
+
+  DBG("Using slot %x to unwrap %lu bytes", session->op_info.op.encrypt.piv_key, ulWrappedKeyLen);
+  rv = decrypt_mechanism_final(session, value, &value_len, key_bits);
+
+  unlock_card(session->slot);
+
+  encrypt_mechanism_cleanup(session);
+  OPENSSL_cleanse(session->op_info.buf, session->op_info.buf_size);
+  session->op_info.buf_len = 0;
+
+  if (rv == CKR_FUNCTION_FAILED || rv == CKR_BUFFER_TOO_SMALL) {
+    DBG("Wrapped key could not be decrypted");
+    rv = CKR_WRAPPED_KEY_INVALID;
+    goto unwrap_out;
+  }
+  if (rv != CKR_OK) {
+    goto unwrap_out;
+  }
+
+  if (!is_aes_key_len(value_len)) {
+    DBG("Unwrapped key has an invalid length %lu", value_len);
+    rv = CKR_WRAPPED_KEY_INVALID;
+    goto unwrap_out;
+  }
+
+  if (key_len != 0 && key_len != value_len) {
+    DBG("Unwrapped key is %lu bytes, template says %lu", value_len, key_len);
+    rv = CKR_TEMPLATE_INCONSISTENT;
+    goto unwrap_out;
+  }
+
+  rv = add_session_key(session, CKK_AES, value, value_len, phKey);
+
+unwrap_out:
+  OPENSSL_cleanse(value, sizeof(value));
   DOUT;
-  return CKR_FUNCTION_NOT_SUPPORTED;
+  return rv;
+}
+
+// Length of the peer public key taken by ECDH with a key of this algorithm, and of the shared secret
+static CK_BBOOL get_derive_lengths(CK_BYTE algo, CK_ULONG *peer_len, CK_ULONG *secret_len) {
+  switch(algo) {
+    case YKPIV_ALGO_ECCP256:
+      *peer_len = 65;
+      *secret_len = 32;
+      return CK_TRUE;
+    case YKPIV_ALGO_ECCP384:
+      *peer_len = 97;
+      *secret_len = 48;
+      return CK_TRUE;
+    case YKPIV_ALGO_X25519:
+      *peer_len = 32;
+      *secret_len = 32;
+      return CK_TRUE;
+    default:
+      return CK_FALSE;
+  }
+}
+
+// Rejects peer keys the YubiKey would refuse before sending them
+static CK_RV check_derive_peer(CK_BYTE algo, CK_ULONG peer_len, CK_BYTE_PTR data, CK_ULONG len) {
+  if (data == NULL || len != peer_len) {
+    DBG("Peer public key has the wrong length");
+    return CKR_MECHANISM_PARAM_INVALID;
+  }
+  if (YKPIV_IS_EC(algo) && !do_check_ec_point(algo, data, len)) {
+    DBG("Peer public key is not a point on the curve");
+    return CKR_MECHANISM_PARAM_INVALID;
+  }
+  return CKR_OK;
 }
 
 CK_DEFINE_FUNCTION(CK_RV, C_DeriveKey)(
@@ -3726,18 +5102,11 @@ CK_DEFINE_FUNCTION(CK_RV, C_DeriveKey)(
 
   CK_BYTE id = get_sub_id(hBaseKey);
   CK_BYTE algo = do_get_key_algorithm(session->slot->pkeys[id]);
-  CK_ULONG size;
+  CK_ULONG size, secret_len;
 
-  switch(algo) {
-    case YKPIV_ALGO_ECCP256:
-      size = 65;
-      break;
-    case YKPIV_ALGO_ECCP384:
-      size = 97;
-      break;
-    default:
-      DBG("Key handle %lu is not an ECDH private key", hBaseKey);
-      return CKR_KEY_TYPE_INCONSISTENT;
+  if (!get_derive_lengths(algo, &size, &secret_len)) {
+    DBG("Key handle %lu is not an ECDH private key", hBaseKey);
+    return CKR_KEY_TYPE_INCONSISTENT;
   }
 
   if (pMechanism->mechanism != CKM_ECDH1_DERIVE) {
@@ -3752,16 +5121,48 @@ CK_DEFINE_FUNCTION(CK_RV, C_DeriveKey)(
 
   CK_ECDH1_DERIVE_PARAMS *params = pMechanism->pParameter;
 
-  if (params->kdf != CKD_NULL || params->ulSharedDataLen != 0 || params->pPublicData == NULL || params->ulPublicDataLen != size) {
+  if (params->kdf != CKD_NULL || params->ulSharedDataLen != 0) {
     DBG("Key derivation parameters invalid");
     return CKR_MECHANISM_PARAM_INVALID;
   }
 
+  CK_RV prv = check_derive_peer(algo, size, params->pPublicData, params->ulPublicDataLen);
+  if (prv != CKR_OK) {
+    DOUT;
+    return prv;
+  }
+
+  // AES keys stay in the session for bulk encryption on the host, other secrets become the token object
+  CK_BBOOL aes = CK_FALSE;
+  CK_ULONG key_len = 0;
   for(CK_ULONG i = 0; i < ulAttributeCount; i++) {
-    CK_RV rv = validate_derive_key_attribute(pTemplate[i].type, pTemplate[i].pValue);
-    if(rv != CKR_OK) {
+    if(pTemplate[i].type == CKA_KEY_TYPE && pTemplate[i].pValue != NULL && pTemplate[i].ulValueLen == sizeof(CK_KEY_TYPE) &&
+       *((CK_KEY_TYPE *) pTemplate[i].pValue) == CKK_AES) {
+      aes = CK_TRUE;
+    }
+  }
+
+  if(aes) {
+    prv = check_secret_key_template(pTemplate, ulAttributeCount, &key_len);
+    if(prv != CKR_OK) {
       DOUT;
-      return rv;
+      return prv;
+    }
+    // The leading bytes of the shared secret are used, as with CKD_NULL there is no KDF
+    if(key_len == 0)
+      key_len = secret_len;
+    if(!is_aes_key_len(key_len) || key_len > secret_len) {
+      DBG("AES key length %lu can't be derived from a %lu byte shared secret", key_len, secret_len);
+      DOUT;
+      return CKR_TEMPLATE_INCONSISTENT;
+    }
+  } else {
+    for(CK_ULONG i = 0; i < ulAttributeCount; i++) {
+      CK_RV rv = validate_derive_key_attribute(pTemplate[i].type, pTemplate[i].pValue);
+      if(rv != CKR_OK) {
+        DOUT;
+        return rv;
+      }
     }
   }
 
@@ -3769,25 +5170,33 @@ CK_DEFINE_FUNCTION(CK_RV, C_DeriveKey)(
   unsigned char buf[128];
   size_t len = sizeof(buf);
 
-  locking.pfnLockMutex(session->slot->mutex);
+  lock_slot(session->slot);
 
   DBG("Deriving ECDH shared secret into object %u using slot %lx", PIV_SECRET_OBJ, slot);
   ykpiv_rc rc = ykpiv_decipher_data(session->slot->piv_state, params->pPublicData, params->ulPublicDataLen, buf, &len, algo, slot);
 
   if(rc != YKPIV_OK) {
     DBG("Failed to derive key in slot %lx: %s", slot, ykpiv_strerror(rc));
-    locking.pfnUnlockMutex(session->slot->mutex);
+    unlock_slot(session->slot);
     DOUT;
     return CKR_FUNCTION_FAILED;
   }
 
+  if(aes) {
+    unlock_slot(session->slot);
+    prv = len < key_len ? CKR_FUNCTION_FAILED : add_session_key(session, CKK_AES, buf, key_len, phKey);
+    OPENSSL_cleanse(buf, sizeof(buf));
+    DOUT;
+    return prv;
+  }
+
   *phKey = PIV_SECRET_OBJ;
 
   store_data(session->slot, 0, buf, len);
   add_object(session->slot, *phKey);
   sort_objects(session->slot);
 
-  locking.pfnUnlockMutex(session->slot->mutex);
+  unlock_slot(session->slot);
   
   DOUT;
   return CKR_OK;
@@ -4006,17 +5415,103 @@ CK_DEFINE_FUNCTION(CK_RV, C_SessionCancel)
   return CKR_FUNCTION_NOT_SUPPORTED;
 }
 
-CK_DEFINE_FUNCTION(CK_RV, C_MessageEncryptInit)
-(CK_SESSION_HANDLE hSession,  /* the session's handle */
- CK_MECHANISM_PTR pMechanism, /* the encryption mechanism */
- CK_OBJECT_HANDLE hKey        /* handle of encryption key */
-) {
-  DIN;
-  DOUT;
-  return CKR_FUNCTION_NOT_SUPPORTED;
-}
-
-CK_DEFINE_FUNCTION(CK_RV, C_EncryptMessage)
+// Message-based encryption and decryption are only done with secret keys of the session
+static CK_RV message_cipher_init(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey, CK_BBOOL encrypt) {
+  if (!pid) {
+    DBG("libykpiv is not initialized or already finalized");
+    return CKR_CRYPTOKI_NOT_INITIALIZED;
+  }
+
+  ykcs11_session_t* session = get_session(hSession);
+
+  if (session == NULL || session->slot == NULL) {
+    DBG("Session is not open");
+    return CKR_SESSION_HANDLE_INVALID;
+  }
+
+  if (pMechanism == NULL) {
+    return CKR_ARGUMENTS_BAD;
+  }
+
+  if (session->op_info.type != YKCS11_NOOP) {
+    DBG("Other operation in process");
+    return CKR_OPERATION_ACTIVE;
+  }
+
+  ykcs11_secret_t *key = get_session_key(session, hKey);
+  if (key == NULL) {
+    DBG("Key handle %lu is not a secret key of the session", hKey);
+    return CKR_KEY_HANDLE_INVALID;
+  }
+
+  return session_key_init(session, key, pMechanism, encrypt, CK_TRUE);
+}
+
+static CK_RV message_cipher(CK_SESSION_HANDLE hSession, CK_BBOOL encrypt, CK_VOID_PTR pParameter, CK_ULONG ulParameterLen,
+                            CK_BYTE_PTR pAssociatedData, CK_ULONG ulAssociatedDataLen,
+                            CK_BYTE_PTR pIn, CK_ULONG ulInLen, CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen) {
+  if (!pid) {
+    DBG("libykpiv is not initialized or already finalized");
+    return CKR_CRYPTOKI_NOT_INITIALIZED;
+  }
+
+  ykcs11_session_t* session = get_session(hSession);
+
+  if (session == NULL || session->slot == NULL) {
+    DBG("Session is not open");
+    return CKR_SESSION_HANDLE_INVALID;
+  }
+
+  if (session->op_info.type != (encrypt ? YKCS11_MESSAGE_ENCRYPT : YKCS11_MESSAGE_DECRYPT)) {
+    DBG("Message %s operation not initialized", encrypt ? "encryption" : "decryption");
+    return CKR_OPERATION_NOT_INITIALIZED;
+  }
+
+  if ((pIn == NULL && ulInLen != 0) || pulOutLen == NULL) {
+    DBG("Invalid parameters");
+    return CKR_ARGUMENTS_BAD;
+  }
+
+  // Each message is independent, failing one leaves the operation active for the next
+  return cipher_message_data(session, pParameter, ulParameterLen, pAssociatedData, ulAssociatedDataLen,
+                             pIn, ulInLen, pOut, pulOutLen);
+}
+
+static CK_RV message_cipher_final(CK_SESSION_HANDLE hSession, CK_BBOOL encrypt) {
+  if (!pid) {
+    DBG("libykpiv is not initialized or already finalized");
+    return CKR_CRYPTOKI_NOT_INITIALIZED;
+  }
+
+  ykcs11_session_t* session = get_session(hSession);
+
+  if (session == NULL || session->slot == NULL) {
+    DBG("Session is not open");
+    return CKR_SESSION_HANDLE_INVALID;
+  }
+
+  if (session->op_info.type != (encrypt ? YKCS11_MESSAGE_ENCRYPT : YKCS11_MESSAGE_DECRYPT)) {
+    DBG("Message %s operation not initialized", encrypt ? "encryption" : "decryption");
+    return CKR_OPERATION_NOT_INITIALIZED;
+  }
+
+  cipher_mechanism_cleanup(session);
+  session->op_info.type = YKCS11_NOOP;
+  return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_MessageEncryptInit)
+(CK_SESSION_HANDLE hSession,  /* the session's handle */
+ CK_MECHANISM_PTR pMechanism, /* the encryption mechanism */
+ CK_OBJECT_HANDLE hKey        /* handle of encryption key */
+) {
+  DIN;
+  CK_RV rv = message_cipher_init(hSession, pMechanism, hKey, CK_TRUE);
+  DOUT;
+  return rv;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_EncryptMessage)
 (CK_SESSION_HANDLE hSession,   /* the session's handle */
  CK_VOID_PTR pParameter,       /* message specific parameter */
  CK_ULONG ulParameterLen,      /* length of message specific parameter */
@@ -4028,8 +5523,10 @@ CK_DEFINE_FUNCTION(CK_RV, C_EncryptMessage)
  CK_ULONG_PTR pulCiphertextLen /* gets cipher text length */
 ) {
   DIN;
+  CK_RV rv = message_cipher(hSession, CK_TRUE, pParameter, ulParameterLen, pAssociatedData, ulAssociatedDataLen,
+                            pPlaintext, ulPlaintextLen, pCiphertext, pulCiphertextLen);
   DOUT;
-  return CKR_FUNCTION_NOT_SUPPORTED;
+  return rv;
 }
 
 CK_DEFINE_FUNCTION(CK_RV, C_EncryptMessageBegin)
@@ -4063,8 +5560,9 @@ CK_DEFINE_FUNCTION(CK_RV, C_MessageEncryptFinal)
 (CK_SESSION_HANDLE hSession /* the session's handle */
 ) {
   DIN;
+  CK_RV rv = message_cipher_final(hSession, CK_TRUE);
   DOUT;
-  return CKR_FUNCTION_NOT_SUPPORTED;
+  return rv;
 }
 
 CK_DEFINE_FUNCTION(CK_RV, C_MessageDecryptInit)
@@ -4073,8 +5571,9 @@ CK_DEFINE_FUNCTION(CK_RV, C_MessageDecryptInit)
  CK_OBJECT_HANDLE hKey        /* handle of decryption key */
 ) {
   DIN;
+  CK_RV rv = message_cipher_init(hSession, pMechanism, hKey, CK_FALSE);
   DOUT;
-  return CKR_FUNCTION_NOT_SUPPORTED;
+  return rv;
 }
 
 CK_DEFINE_FUNCTION(CK_RV, C_DecryptMessage)
@@ -4089,8 +5588,10 @@ CK_DEFINE_FUNCTION(CK_RV, C_DecryptMessage)
  CK_ULONG_PTR pulPlaintextLen  /* gets plain text length */
 ) {
   DIN;
+  CK_RV rv = message_cipher(hSession, CK_FALSE, pParameter, ulParameterLen, pAssociatedData, ulAssociatedDataLen,
+                            pCiphertext, ulCiphertextLen, pPlaintext, pulPlaintextLen);
   DOUT;
-  return CKR_FUNCTION_NOT_SUPPORTED;
+  return rv;
 }
 
 CK_DEFINE_FUNCTION(CK_RV, C_DecryptMessageBegin)
@@ -4124,8 +5625,9 @@ CK_DEFINE_FUNCTION(CK_RV, C_MessageDecryptFinal)
 (CK_SESSION_HANDLE hSession /* the session's handle */
 ) {
   DIN;
+  CK_RV rv = message_cipher_final(hSession, CK_FALSE);
   DOUT;
-  return CKR_FUNCTION_NOT_SUPPORTED;
+  return rv;
 }
 
 CK_DEFINE_FUNCTION(CK_RV, C_MessageSignInit)
@@ -4134,8 +5636,43 @@ CK_DEFINE_FUNCTION(CK_RV, C_MessageSignInit)
  CK_OBJECT_HANDLE hKey        /* handle of signing key */
 ) {
   DIN;
+  CK_RV rv;
+
+  if (!pid) {
+    DBG("libykpiv is not initialized or already finalized");
+    rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+    goto msigninit_out;
+  }
+
+  ykcs11_session_t* session = get_session(hSession);
+
+  if (session == NULL || session->slot == NULL) {
+    DBG("Session is not open");
+    rv = CKR_SESSION_HANDLE_INVALID;
+    goto msigninit_out;
+  }
+
+  if (session->op_info.type != YKCS11_NOOP) {
+    DBG("Other operation in process");
+    rv = CKR_OPERATION_ACTIVE;
+    goto msigninit_out;
+  }
+
+  if ((rv = get_op_buf(session)) != CKR_OK) {
+    goto msigninit_out;
+  }
+
+  // The mechanism and key are set up once here and re-used for every message until C_MessageSignFinal
+  if ((rv = sign_init(session, pMechanism, hKey)) != CKR_OK) {
+    goto msigninit_out;
+  }
+
+  session->op_info.type = YKCS11_MESSAGE_SIGN;
+  rv = CKR_OK;
+
+msigninit_out:
   DOUT;
-  return CKR_FUNCTION_NOT_SUPPORTED;
+  return rv;
 }
 
 CK_DEFINE_FUNCTION(CK_RV, C_SignMessage)
@@ -4148,8 +5685,94 @@ CK_DEFINE_FUNCTION(CK_RV, C_SignMessage)
  CK_ULONG_PTR pulSignatureLen /* gets signature length */
 ) {
   DIN;
+  CK_RV rv;
+
+  if (!pid) {
+    DBG("libykpiv is not initialized or already finalized");
+    rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+    goto msign_out;
+  }
+
+  ykcs11_session_t* session = get_session(hSession);
+
+  if (session == NULL || session->slot == NULL) {
+    DBG("Session is not open");
+    rv = CKR_SESSION_HANDLE_INVALID;
+    goto msign_out;
+  }
+
+  if (session->op_info.type != YKCS11_MESSAGE_SIGN) {
+    DBG("Message signature operation not initialized");
+    rv = CKR_OPERATION_NOT_INITIALIZED;
+    goto msign_out;
+  }
+
+  if (session->op_info.op.sign.message) {
+    DBG("Multi-part message signature in process");
+    rv = CKR_OPERATION_ACTIVE;
+    goto msign_out;
+  }
+
+  // None of the supported mechanisms take per-message parameters
+  if (pParameter != NULL || ulParameterLen != 0 || pData == NULL || pulSignatureLen == NULL) {
+    DBG("Invalid parameters");
+    rv = CKR_ARGUMENTS_BAD;
+    goto msign_out;
+  }
+
+  if (pSignature == NULL) {
+    // Just return the size of the signature
+    *pulSignatureLen = session->op_info.out_len;
+    DBG("The signature requires %lu bytes", *pulSignatureLen);
+    rv = CKR_OK;
+    goto msign_out;
+  }
+
+  if (*pulSignatureLen < session->op_info.out_len) {
+    DBG("The signature requires %lu bytes, got %lu", session->op_info.out_len, *pulSignatureLen);
+    rv = CKR_BUFFER_TOO_SMALL;
+    goto msign_out;
+  }
+
+  lock_slot(session->slot);
+
+  // This allows signing when logged in as SO and then doing a context-specific login to sign
+  if (session->slot->login_state == YKCS11_PUBLIC) {
+    DBG("User is not logged in");
+    rv = CKR_USER_NOT_LOGGED_IN;
+    unlock_slot(session->slot);
+    goto msign_out;
+  }
+
+  // Only the card is used from here on
+  unlock_objects(session->slot);
+
+  if ((rv = sign_mechanism_reset(session)) != CKR_OK) {
+    DBG("sign_mechanism_reset failed");
+    unlock_card(session->slot);
+    goto msign_out;
+  }
+
+  if ((rv = digest_mechanism_update(session, pData, ulDataLen)) != CKR_OK) {
+    DBG("digest_mechanism_update failed");
+    unlock_card(session->slot);
+    goto msign_out;
+  }
+
+  if((rv = sign_mechanism_final(session, pSignature, pulSignatureLen)) != CKR_OK) {
+    DBG("sign_mechanism_final failed");
+    unlock_card(session->slot);
+    goto msign_out;
+  }
+
+  unlock_card(session->slot);
+
+  DBG("The signature is %lu bytes", *pulSignatureLen);
+  rv = CKR_OK;
+
+msign_out:
   DOUT;
-  return CKR_FUNCTION_NOT_SUPPORTED;
+  return rv;
 }
 
 CK_DEFINE_FUNCTION(CK_RV, C_SignMessageBegin)
@@ -4158,8 +5781,51 @@ CK_DEFINE_FUNCTION(CK_RV, C_SignMessageBegin)
  CK_ULONG ulParameterLen     /* length of message specific parameter */
 ) {
   DIN;
+  CK_RV rv;
+
+  if (!pid) {
+    DBG("libykpiv is not initialized or already finalized");
+    rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+    goto msign_out;
+  }
+
+  ykcs11_session_t* session = get_session(hSession);
+
+  if (session == NULL || session->slot == NULL) {
+    DBG("Session is not open");
+    rv = CKR_SESSION_HANDLE_INVALID;
+    goto msign_out;
+  }
+
+  if (session->op_info.type != YKCS11_MESSAGE_SIGN) {
+    DBG("Message signature operation not initialized");
+    rv = CKR_OPERATION_NOT_INITIALIZED;
+    goto msign_out;
+  }
+
+  if (session->op_info.op.sign.message) {
+    DBG("Multi-part message signature in process");
+    rv = CKR_OPERATION_ACTIVE;
+    goto msign_out;
+  }
+
+  if (pParameter != NULL || ulParameterLen != 0) {
+    DBG("Invalid parameters");
+    rv = CKR_ARGUMENTS_BAD;
+    goto msign_out;
+  }
+
+  if ((rv = sign_mechanism_reset(session)) != CKR_OK) {
+    DBG("sign_mechanism_reset failed");
+    goto msign_out;
+  }
+
+  session->op_info.op.sign.message = CK_TRUE;
+  rv = CKR_OK;
+
+msign_out:
   DOUT;
-  return CKR_FUNCTION_NOT_SUPPORTED;
+  return rv;
 }
 
 CK_DEFINE_FUNCTION(CK_RV, C_SignMessageNext)
@@ -4172,55 +5838,176 @@ CK_DEFINE_FUNCTION(CK_RV, C_SignMessageNext)
  CK_ULONG_PTR pulSignatureLen /* gets signature length */
 ) {
   DIN;
-  DOUT;
-  return CKR_FUNCTION_NOT_SUPPORTED;
-}
+  CK_RV rv;
 
-CK_DEFINE_FUNCTION(CK_RV, C_MessageSignFinal)
-(CK_SESSION_HANDLE hSession /* the session's handle */
-) {
-  DIN;
-  DOUT;
-  return CKR_FUNCTION_NOT_SUPPORTED;
-}
+  if (!pid) {
+    DBG("libykpiv is not initialized or already finalized");
+    DOUT;
+    return CKR_CRYPTOKI_NOT_INITIALIZED;
+  }
 
-CK_DEFINE_FUNCTION(CK_RV, C_MessageVerifyInit)
-(CK_SESSION_HANDLE hSession,  /* the session's handle */
- CK_MECHANISM_PTR pMechanism, /* the signing mechanism */
- CK_OBJECT_HANDLE hKey        /* handle of signing key */
-) {
-  DIN;
-  DOUT;
-  return CKR_FUNCTION_NOT_SUPPORTED;
-}
+  ykcs11_session_t* session = get_session(hSession);
 
-CK_DEFINE_FUNCTION(CK_RV, C_VerifyMessage)
-(CK_SESSION_HANDLE hSession, /* the session's handle */
- CK_VOID_PTR pParameter,     /* message specific parameter */
- CK_ULONG ulParameterLen,    /* length of message specific parameter */
- CK_BYTE_PTR pData,          /* data to sign */
- CK_ULONG ulDataLen,         /* data to sign length */
- CK_BYTE_PTR pSignature,     /* signature */
- CK_ULONG ulSignatureLen     /* signature length */
-) {
-  DIN;
-  DOUT;
-  return CKR_FUNCTION_NOT_SUPPORTED;
-}
+  if (session == NULL || session->slot == NULL) {
+    DBG("Session is not open");
+    DOUT;
+    return CKR_SESSION_HANDLE_INVALID;
+  }
 
-CK_DEFINE_FUNCTION(CK_RV, C_VerifyMessageBegin)
-(CK_SESSION_HANDLE hSession, /* the session's handle */
- CK_VOID_PTR pParameter,     /* message specific parameter */
- CK_ULONG ulParameterLen     /* length of message specific parameter */
-) {
-  DIN;
-  DOUT;
-  return CKR_FUNCTION_NOT_SUPPORTED;
-}
+  if (session->op_info.type != YKCS11_MESSAGE_SIGN || !session->op_info.op.sign.message) {
+    DBG("Multi-part message signature not started");
+    DOUT;
+    return CKR_OPERATION_NOT_INITIALIZED;
+  }
 
-CK_DEFINE_FUNCTION(CK_RV, C_VerifyMessageNext)
-(CK_SESSION_HANDLE hSession, /* the session's handle */
- CK_VOID_PTR pParameter,     /* message specific parameter */
+  if (pParameter != NULL || ulParameterLen != 0 || pData == NULL) {
+    DBG("Invalid parameters");
+    rv = CKR_ARGUMENTS_BAD;
+    goto msign_out;
+  }
+
+  if (pulSignatureLen == NULL) {
+    // Not the last part of the message
+    if ((rv = digest_mechanism_update(session, pData, ulDataLen)) != CKR_OK) {
+      DBG("digest_mechanism_update failed");
+      goto msign_out;
+    }
+    DOUT;
+    return CKR_OK;
+  }
+
+  if (pSignature == NULL) {
+    // Just return the size of the signature, the data is consumed by the call that gets the signature
+    *pulSignatureLen = session->op_info.out_len;
+    DBG("The signature requires %lu bytes", *pulSignatureLen);
+    DOUT;
+    return CKR_OK;
+  }
+
+  if (*pulSignatureLen < session->op_info.out_len) {
+    DBG("The signature requires %lu bytes, got %lu", session->op_info.out_len, *pulSignatureLen);
+    DOUT;
+    return CKR_BUFFER_TOO_SMALL;
+  }
+
+  lock_slot(session->slot);
+
+  // This allows signing when logged in as SO and then doing a context-specific login to sign
+  if (session->slot->login_state == YKCS11_PUBLIC) {
+    DBG("User is not logged in");
+    rv = CKR_USER_NOT_LOGGED_IN;
+    unlock_slot(session->slot);
+    goto msign_out;
+  }
+
+  // Only the card is used from here on
+  unlock_objects(session->slot);
+
+  if ((rv = digest_mechanism_update(session, pData, ulDataLen)) != CKR_OK) {
+    DBG("digest_mechanism_update failed");
+    unlock_card(session->slot);
+    goto msign_out;
+  }
+
+  if((rv = sign_mechanism_final(session, pSignature, pulSignatureLen)) != CKR_OK) {
+    DBG("sign_mechanism_final failed");
+    unlock_card(session->slot);
+    goto msign_out;
+  }
+
+  unlock_card(session->slot);
+
+  DBG("The signature is %lu bytes", *pulSignatureLen);
+  rv = CKR_OK;
+
+msign_out:
+  // The message ends here, but the message-based signing operation stays active
+  session->op_info.op.sign.message = CK_FALSE;
+  DOUT;
+  return rv;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_MessageSignFinal)
+(CK_SESSION_HANDLE hSession /* the session's handle */
+) {
+  DIN;
+
+  if (!pid) {
+    DBG("libykpiv is not initialized or already finalized");
+    DOUT;
+    return CKR_CRYPTOKI_NOT_INITIALIZED;
+  }
+
+  ykcs11_session_t* session = get_session(hSession);
+
+  if (session == NULL || session->slot == NULL) {
+    DBG("Session is not open");
+    DOUT;
+    return CKR_SESSION_HANDLE_INVALID;
+  }
+
+  if (session->op_info.type != YKCS11_MESSAGE_SIGN) {
+    DBG("Message signature operation not initialized");
+    DOUT;
+    return CKR_OPERATION_NOT_INITIALIZED;
+  }
+
+  session->op_info.type = YKCS11_NOOP;
+  session->op_info.op.sign.message = CK_FALSE;
+  sign_mechanism_cleanup(session);
+
+  DOUT;
+  return CKR_OK;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_MessageVerifyInit)
+(CK_SESSION_HANDLE hSession,  /* the session's handle */
+ CK_MECHANISM_PTR pMechanism, /* the signing mechanism */
+ CK_OBJECT_HANDLE hKey        /* handle of signing key */
+) {
+  DIN;
+  CK_RV rv;
+
+  if (!pid) {
+    DBG("libykpiv is not initialized or already finalized");
+    rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+    goto mverifyinit_out;
+  }
+
+  ykcs11_session_t* session = get_session(hSession);
+
+  if (session == NULL || session->slot == NULL) {
+    DBG("Session is not open");
+    rv = CKR_SESSION_HANDLE_INVALID;
+    goto mverifyinit_out;
+  }
+
+  if (session->op_info.type != YKCS11_NOOP) {
+    DBG("Other operation in process");
+    rv = CKR_OPERATION_ACTIVE;
+    goto mverifyinit_out;
+  }
+
+  if ((rv = get_op_buf(session)) != CKR_OK) {
+    goto mverifyinit_out;
+  }
+
+  // The mechanism and key are set up once here and re-used for every message until C_MessageVerifyFinal
+  if ((rv = verify_init(session, pMechanism, hKey)) != CKR_OK) {
+    goto mverifyinit_out;
+  }
+
+  session->op_info.type = YKCS11_MESSAGE_VERIFY;
+  rv = CKR_OK;
+
+mverifyinit_out:
+  DOUT;
+  return rv;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_VerifyMessage)
+(CK_SESSION_HANDLE hSession, /* the session's handle */
+ CK_VOID_PTR pParameter,     /* message specific parameter */
  CK_ULONG ulParameterLen,    /* length of message specific parameter */
  CK_BYTE_PTR pData,          /* data to sign */
  CK_ULONG ulDataLen,         /* data to sign length */
@@ -4228,18 +6015,620 @@ CK_DEFINE_FUNCTION(CK_RV, C_VerifyMessageNext)
  CK_ULONG ulSignatureLen     /* signature length */
 ) {
   DIN;
+  CK_RV rv;
+
+  if (!pid) {
+    DBG("libykpiv is not initialized or already finalized");
+    rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+    goto mverify_out;
+  }
+
+  ykcs11_session_t* session = get_session(hSession);
+
+  if (session == NULL || session->slot == NULL) {
+    DBG("Session is not open");
+    rv = CKR_SESSION_HANDLE_INVALID;
+    goto mverify_out;
+  }
+
+  if (session->op_info.type != YKCS11_MESSAGE_VERIFY) {
+    DBG("Message verification operation not initialized");
+    rv = CKR_OPERATION_NOT_INITIALIZED;
+    goto mverify_out;
+  }
+
+  if (session->op_info.op.verify.message) {
+    DBG("Multi-part message verification in process");
+    rv = CKR_OPERATION_ACTIVE;
+    goto mverify_out;
+  }
+
+  // None of the supported mechanisms take per-message parameters
+  if (pParameter != NULL || ulParameterLen != 0 || pData == NULL || pSignature == NULL) {
+    DBG("Invalid parameters");
+    rv = CKR_ARGUMENTS_BAD;
+    goto mverify_out;
+  }
+
+  if ((rv = verify_mechanism_reset(session)) != CKR_OK) {
+    DBG("verify_mechanism_reset failed");
+    goto mverify_out;
+  }
+
+  if ((rv = verify_mechanism_data(session, pData, ulDataLen, pSignature, ulSignatureLen)) != CKR_OK) {
+    DBG("Unable to verify signature");
+    goto mverify_out;
+  }
+
+  DBG("Signature successfully verified");
+  rv = CKR_OK;
+
+mverify_out:
+  DOUT;
+  return rv;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_VerifyMessageBegin)
+(CK_SESSION_HANDLE hSession, /* the session's handle */
+ CK_VOID_PTR pParameter,     /* message specific parameter */
+ CK_ULONG ulParameterLen     /* length of message specific parameter */
+) {
+  DIN;
+  CK_RV rv;
+
+  if (!pid) {
+    DBG("libykpiv is not initialized or already finalized");
+    rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+    goto mverify_out;
+  }
+
+  ykcs11_session_t* session = get_session(hSession);
+
+  if (session == NULL || session->slot == NULL) {
+    DBG("Session is not open");
+    rv = CKR_SESSION_HANDLE_INVALID;
+    goto mverify_out;
+  }
+
+  if (session->op_info.type != YKCS11_MESSAGE_VERIFY) {
+    DBG("Message verification operation not initialized");
+    rv = CKR_OPERATION_NOT_INITIALIZED;
+    goto mverify_out;
+  }
+
+  if (session->op_info.op.verify.message) {
+    DBG("Multi-part message verification in process");
+    rv = CKR_OPERATION_ACTIVE;
+    goto mverify_out;
+  }
+
+  if (pParameter != NULL || ulParameterLen != 0) {
+    DBG("Invalid parameters");
+    rv = CKR_ARGUMENTS_BAD;
+    goto mverify_out;
+  }
+
+  if ((rv = verify_mechanism_reset(session)) != CKR_OK) {
+    DBG("verify_mechanism_reset failed");
+    goto mverify_out;
+  }
+
+  session->op_info.op.verify.message = CK_TRUE;
+  rv = CKR_OK;
+
+mverify_out:
   DOUT;
-  return CKR_FUNCTION_NOT_SUPPORTED;
+  return rv;
+}
+
+CK_DEFINE_FUNCTION(CK_RV, C_VerifyMessageNext)
+(CK_SESSION_HANDLE hSession, /* the session's handle */
+ CK_VOID_PTR pParameter,     /* message specific parameter */
+ CK_ULONG ulParameterLen,    /* length of message specific parameter */
+ CK_BYTE_PTR pData,          /* data to sign */
+ CK_ULONG ulDataLen,         /* data to sign length */
+ CK_BYTE_PTR pSignature,     /* signature */
+ CK_ULONG ulSignatureLen     /* signature length */
+) {
+  DIN;
+  CK_RV rv;
+
+  if (!pid) {
+    DBG("libykpiv is not initialized or already finalized");
+    DOUT;
+    return CKR_CRYPTOKI_NOT_INITIALIZED;
+  }
+
+  ykcs11_session_t* session = get_session(hSession);
+
+  if (session == NULL || session->slot == NULL) {
+    DBG("Session is not open");
+    DOUT;
+    return CKR_SESSION_HANDLE_INVALID;
+  }
+
+  if (session->op_info.type != YKCS11_MESSAGE_VERIFY || !session->op_info.op.verify.message) {
+    DBG("Multi-part message verification not started");
+    DOUT;
+    return CKR_OPERATION_NOT_INITIALIZED;
+  }
+
+  if (pParameter != NULL || ulParameterLen != 0 || pData == NULL) {
+    DBG("Invalid parameters");
+    rv = CKR_ARGUMENTS_BAD;
+    goto mverify_out;
+  }
+
+  if ((rv = digest_mechanism_update(session, pData, ulDataLen)) != CKR_OK) {
+    DBG("digest_mechanism_update failed");
+    goto mverify_out;
+  }
+
+  if (pSignature == NULL) {
+    // Not the last part of the message
+    DOUT;
+    return CKR_OK;
+  }
+
+  if ((rv = verify_mechanism_final(session, pSignature, ulSignatureLen)) != CKR_OK) {
+    DBG("Unable to verify signature");
+    goto mverify_out;
+  }
+
+  DBG("Signature successfully verified");
+  rv = CKR_OK;
+
+mverify_out:
+  // The message ends here, but the message-based verification operation stays active
+  session->op_info.op.verify.message = CK_FALSE;
+  DOUT;
+  return rv;
 }
 
 CK_DEFINE_FUNCTION(CK_RV, C_MessageVerifyFinal)
 (CK_SESSION_HANDLE hSession /* the session's handle */
 ) {
   DIN;
+
+  if (!pid) {
+    DBG("libykpiv is not initialized or already finalized");
+    DOUT;
+    return CKR_CRYPTOKI_NOT_INITIALIZED;
+  }
+
+  ykcs11_session_t* session = get_session(hSession);
+
+  if (session == NULL || session->slot == NULL) {
+    DBG("Session is not open");
+    DOUT;
+    return CKR_SESSION_HANDLE_INVALID;
+  }
+
+  if (session->op_info.type != YKCS11_MESSAGE_VERIFY) {
+    DBG("Message verification operation not initialized");
+    DOUT;
+    return CKR_OPERATION_NOT_INITIALIZED;
+  }
+
+  session->op_info.type = YKCS11_NOOP;
+  verify_mechanism_cleanup(session);
+
   DOUT;
-  return CKR_FUNCTION_NOT_SUPPORTED;
+  return CKR_OK;
+}
+
+static CK_RV C_YUBICO_VerifyMessageBatch(
+  CK_SESSION_HANDLE hSession,
+  CK_ULONG ulCount,
+  CK_BYTE_PTR CK_PTR ppData,
+  CK_ULONG_PTR pulDataLen,
+  CK_BYTE_PTR CK_PTR ppSignature,
+  CK_ULONG_PTR pulSignatureLen,
+  CK_RV CK_PTR pResults
+) {
+  DIN;
+  CK_RV rv;
+
+  if (!pid) {
+    DBG("libykpiv is not initialized or already finalized");
+    rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+    goto mverify_out;
+  }
+
+  ykcs11_session_t* session = get_session(hSession);
+
+  if (session == NULL || session->slot == NULL) {
+    DBG("Session is not open");
+    rv = CKR_SESSION_HANDLE_INVALID;
+    goto mverify_out;
+  }
+
+  if (session->op_info.type != YKCS11_MESSAGE_VERIFY) {
+    DBG("Message verification operation not initialized");
+    rv = CKR_OPERATION_NOT_INITIALIZED;
+    goto mverify_out;
+  }
+
+  if (session->op_info.op.verify.message) {
+    DBG("Multi-part message verification in process");
+    rv = CKR_OPERATION_ACTIVE;
+    goto mverify_out;
+  }
+
+  if (ppData == NULL || pulDataLen == NULL || ppSignature == NULL || pulSignatureLen == NULL || pResults == NULL) {
+    DBG("Invalid parameters");
+    rv = CKR_ARGUMENTS_BAD;
+    goto mverify_out;
+  }
+
+  for (CK_ULONG i = 0; i < ulCount; i++) {
+    if (ppData[i] == NULL || ppSignature[i] == NULL) {
+      DBG("Invalid parameters for message %lu", i);
+      rv = CKR_ARGUMENTS_BAD;
+      goto mverify_out;
+    }
+  }
+
+  // Only spread the work when each thread gets enough signatures to make up for starting it
+  CK_ULONG n_threads = (ulCount + YKCS11_VERIFY_BATCH_MIN - 1) / YKCS11_VERIFY_BATCH_MIN;
+  if (n_threads > verify_threads) {
+    n_threads = verify_threads;
+  }
+
+  // Verification only uses the public key held by the operation, so the slot is not locked here
+  if ((rv = verify_mechanism_batch(session, ulCount, ppData, pulDataLen, ppSignature, pulSignatureLen,
+                                   pResults, n_threads)) != CKR_OK) {
+    DBG("verify_mechanism_batch failed");
+    goto mverify_out;
+  }
+
+  for (CK_ULONG i = 0; i < ulCount; i++) {
+    if (pResults[i] != CKR_OK) {
+      DBG("Signature %lu failed verification", i);
+      rv = pResults[i];
+      goto mverify_out;
+    }
+  }
+
+  DBG("All %lu signatures successfully verified", ulCount);
+  rv = CKR_OK;
+
+mverify_out:
+  DOUT;
+  return rv;
+}
+
+typedef struct {
+  CK_RV *result;
+  CK_ULONG_PTR secret_len;
+  CK_ULONG *pending;
+} derive_request_t;
+
+static void derive_done(void *ctx, ykpiv_rc res, unsigned char *out, size_t out_len) {
+  derive_request_t *req = ctx;
+  (void)out;
+  if (res == YKPIV_OK) {
+    *req->secret_len = out_len;
+    *req->result = CKR_OK;
+  } else {
+    DBG("Failed to derive key: %s", ykpiv_strerror(res));
+    *req->result = CKR_FUNCTION_FAILED;
+  }
+  (*req->pending)--;
+}
+
+static CK_RV C_YUBICO_DeriveKeyBatch(
+  CK_SESSION_HANDLE hSession,
+  CK_OBJECT_HANDLE hBaseKey,
+  CK_ULONG ulCount,
+  CK_BYTE_PTR CK_PTR ppPublicData,
+  CK_ULONG_PTR pulPublicDataLen,
+  CK_BYTE_PTR CK_PTR ppSecret,
+  CK_ULONG_PTR pulSecretLen,
+  CK_RV CK_PTR pResults
+) {
+  DIN;
+  CK_RV rv;
+  ykpiv_queue *queue = NULL;
+  derive_request_t *reqs = NULL;
+  CK_ULONG pending = 0;
+
+  if (!pid) {
+    DBG("libykpiv is not initialized or already finalized");
+    rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+    goto derive_out;
+  }
+
+  ykcs11_session_t* session = get_session(hSession);
+
+  if (session == NULL || session->slot == NULL) {
+    DBG("Session is not open");
+    rv = CKR_SESSION_HANDLE_INVALID;
+    goto derive_out;
+  }
+
+  if (hBaseKey < PIV_PVTK_OBJ_PIV_AUTH || hBaseKey > PIV_PVTK_OBJ_ATTESTATION) {
+    DBG("Key handle %lu is not a private key", hBaseKey);
+    rv = CKR_KEY_HANDLE_INVALID;
+    goto derive_out;
+  }
+
+  if (ppPublicData == NULL || pulPublicDataLen == NULL || ppSecret == NULL || pulSecretLen == NULL || pResults == NULL) {
+    DBG("Invalid parameters");
+    rv = CKR_ARGUMENTS_BAD;
+    goto derive_out;
+  }
+
+  CK_BYTE algo = do_get_key_algorithm(session->slot->pkeys[get_sub_id(hBaseKey)]);
+  CK_ULONG peer_len, secret_len;
+
+  if (!get_derive_lengths(algo, &peer_len, &secret_len)) {
+    DBG("Key handle %lu is not an ECDH private key", hBaseKey);
+    rv = CKR_KEY_TYPE_INCONSISTENT;
+    goto derive_out;
+  }
+
+  if ((reqs = calloc(ulCount ? ulCount : 1, sizeof(derive_request_t))) == NULL) {
+    DBG("Unable to allocate derive requests");
+    rv = CKR_HOST_MEMORY;
+    goto derive_out;
+  }
+
+  if (ykpiv_queue_init(&queue) != YKPIV_OK) {
+    DBG("Unable to create request queue");
+    rv = CKR_HOST_MEMORY;
+    goto derive_out;
+  }
+
+  CK_BYTE slot = piv_2_ykpiv(hBaseKey);
+
+  lock_slot(session->slot);
+  unlock_objects(session->slot);
+
+  // All derivations share one transaction, the requests are run by the worker of the state while the next
+  // peer keys are checked here
+  CK_BBOOL batched = ykpiv_begin_batch(session->slot->piv_state, coalesce_ms) == YKPIV_OK;
+  DBG("Deriving %lu ECDH shared secrets using slot %x", ulCount, slot);
+
+  for (CK_ULONG i = 0; i < ulCount; i++) {
+    if ((pResults[i] = check_derive_peer(algo, peer_len, ppPublicData[i], pulPublicDataLen[i])) != CKR_OK) {
+      DBG("Peer public key %lu is invalid", i);
+      continue;
+    }
+    if (ppSecret[i] == NULL || pulSecretLen[i] < secret_len) {
+      DBG("Buffer for shared secret %lu is too small", i);
+      pResults[i] = ppSecret[i] == NULL ? CKR_ARGUMENTS_BAD : CKR_BUFFER_TOO_SMALL;
+      continue;
+    }
+    reqs[i].result = pResults + i;
+    reqs[i].secret_len = pulSecretLen + i;
+    reqs[i].pending = &pending;
+    pending++;
+    ykpiv_rc rc = ykpiv_decipher_data_async(session->slot->piv_state, queue, ppPublicData[i], pulPublicDataLen[i],
+                                            ppSecret[i], pulSecretLen[i], algo, slot, derive_done, reqs + i);
+    if (rc != YKPIV_OK) {
+      DBG("Unable to submit derivation %lu: %s", i, ykpiv_strerror(rc));
+      pending--;
+      pResults[i] = CKR_FUNCTION_FAILED;
+      continue;
+    }
+    ykpiv_queue_poll(queue, 0, NULL);
+  }
+
+  while (pending) {
+    ykpiv_queue_poll(queue, 1000, NULL);
+  }
+
+  if (batched) {
+    ykpiv_end_batch(session->slot->piv_state);
+  }
+
+  unlock_card(session->slot);
+
+  rv = CKR_OK;
+  for (CK_ULONG i = 0; i < ulCount; i++) {
+    if (pResults[i] != CKR_OK) {
+      DBG("Derivation %lu failed", i);
+      rv = pResults[i];
+      break;
+    }
+  }
+
+derive_out:
+  if (queue) {
+    ykpiv_queue_done(queue);
+  }
+  free(reqs);
+  DOUT;
+  return rv;
+}
+
+#if CK_YUBICO_STATS_MAX_INS != YKPIV_STATS_MAX_INS || CK_YUBICO_STATS_BUCKETS != YKPIV_STATS_BUCKETS
+#error "CK_YUBICO_SLOT_STATISTICS doesn't match ykpiv_stats"
+#endif
+
+static CK_RV C_YUBICO_GetSlotStatistics(
+  CK_SLOT_ID slotID,
+  CK_YUBICO_SLOT_STATISTICS_PTR pStatistics,
+  CK_BBOOL bReset
+) {
+  DIN;
+  CK_RV rv;
+  ykpiv_stats stats;
+
+  if (!pid) {
+    DBG("libykpiv is not initialized or already finalized");
+    rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+    goto slotstats_out;
+  }
+
+  if (pStatistics == NULL) {
+    DBG("Wrong/Missing parameter");
+    rv = CKR_ARGUMENTS_BAD;
+    goto slotstats_out;
+  }
+
+  lock_global();
+
+  if (slotID >= n_slots) {
+    DBG("Invalid slot ID %lu", slotID);
+    unlock_global();
+    rv = CKR_SLOT_ID_INVALID;
+    goto slotstats_out;
+  }
+
+  unlock_global();
+
+  // The counters are updated by whoever uses the state, which holds the slot mutex
+  lock_slot(slots + slotID);
+  ykpiv_get_stats(slots[slotID].piv_state, &stats, bReset);
+  unlock_slot(slots + slotID);
+
+  pStatistics->transactions = stats.transactions;
+  pStatistics->transaction_retries = stats.transaction_retries;
+  pStatistics->transaction_wait_us = stats.transaction_wait_us;
+  pStatistics->batched = stats.batched;
+  pStatistics->scp11_ops = stats.scp11_ops;
+  pStatistics->scp11_us = stats.scp11_us;
+  pStatistics->ulInsCount = stats.n_ins;
+  for (size_t i = 0; i < CK_YUBICO_STATS_MAX_INS; i++) {
+    CK_YUBICO_INS_STATISTICS *out = pStatistics->ins + i;
+    const ykpiv_ins_stats *in = stats.ins + i;
+    out->ins = in->ins;
+    out->commands = in->commands;
+    out->errors = in->errors;
+    out->apdus = in->apdus;
+    out->chained = in->chained;
+    out->get_responses = in->get_responses;
+    out->bytes_sent = in->bytes_sent;
+    out->bytes_received = in->bytes_received;
+    out->total_us = in->total_us;
+    out->transmit_us = in->transmit_us;
+    out->max_us = in->max_us;
+    memcpy(out->latency, in->latency, sizeof(out->latency));
+  }
+  rv = CKR_OK;
+
+slotstats_out:
+  DOUT;
+  return rv;
+}
+
+static void copy_lock_stats(CK_YUBICO_LOCK_STATISTICS_PTR out, ykcs11_lock_stats_t *stats, CK_BBOOL reset) {
+  out->acquisitions = stats->acquisitions;
+  out->contended = stats->contended;
+  out->wait_us = stats->wait_us;
+  out->max_wait_us = stats->max_wait_us;
+  out->hold_us = stats->hold_us;
+  out->max_hold_us = stats->max_hold_us;
+  memset(out->max_wait_holder, 0, sizeof(out->max_wait_holder));
+  memset(out->max_hold_function, 0, sizeof(out->max_hold_function));
+  if(stats->max_wait_holder) {
+    strncpy((char *)out->max_wait_holder, stats->max_wait_holder, sizeof(out->max_wait_holder) - 1);
+  }
+  if(stats->max_hold_function) {
+    strncpy((char *)out->max_hold_function, stats->max_hold_function, sizeof(out->max_hold_function) - 1);
+  }
+  if(reset) {
+    stats->acquisitions = stats->contended = 0;
+    stats->wait_us = stats->max_wait_us = stats->hold_us = stats->max_hold_us = 0;
+    stats->max_wait_holder = stats->max_hold_function = NULL;
+  }
 }
 
+static CK_RV C_YUBICO_GetLockStatistics(
+  CK_SLOT_ID slotID,
+  CK_YUBICO_LOCK_STATISTICS_PTR pStatistics,
+  CK_BBOOL bReset
+) {
+  DIN;
+  CK_RV rv;
+
+  if (!pid) {
+    DBG("libykpiv is not initialized or already finalized");
+    rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+    goto lockstats_out;
+  }
+
+  if (pStatistics == NULL) {
+    DBG("Wrong/Missing parameter");
+    rv = CKR_ARGUMENTS_BAD;
+    goto lockstats_out;
+  }
+
+  if (!lock_stats) {
+    DBG("Lock statistics are not enabled, set YKCS11_LOCK_STATS");
+    rv = CKR_FUNCTION_NOT_SUPPORTED;
+    goto lockstats_out;
+  }
+
+  // The counters are only updated by the holder of the mutex they belong to, which isn't counted here
+  locking.pfnLockMutex(global_mutex);
+
+  if (slotID == CK_YUBICO_GLOBAL_LOCK) {
+    copy_lock_stats(pStatistics, &global_lock_stats, bReset);
+    locking.pfnUnlockMutex(global_mutex);
+    rv = CKR_OK;
+    goto lockstats_out;
+  }
+
+  if (slotID >= n_slots) {
+    DBG("Invalid slot ID %lu", slotID);
+    locking.pfnUnlockMutex(global_mutex);
+    rv = CKR_SLOT_ID_INVALID;
+    goto lockstats_out;
+  }
+
+  locking.pfnUnlockMutex(global_mutex);
+
+  locking.pfnLockMutex(slots[slotID].mutex);
+  copy_lock_stats(pStatistics, &slots[slotID].lock_stats, bReset);
+  locking.pfnUnlockMutex(slots[slotID].mutex);
+  rv = CKR_OK;
+
+lockstats_out:
+  DOUT;
+  return rv;
+}
+
+static CK_RV C_YUBICO_FlushWrites(
+  CK_SESSION_HANDLE hSession
+) {
+  DIN;
+  CK_RV rv;
+
+  if (!pid) {
+    DBG("libykpiv is not initialized or already finalized");
+    rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+    goto flush_out;
+  }
+
+  ykcs11_session_t* session = get_session(hSession);
+
+  if (session == NULL || session->slot == NULL) {
+    DBG("Session is not open");
+    rv = CKR_SESSION_HANDLE_INVALID;
+    goto flush_out;
+  }
+
+  lock_slot(session->slot);
+  rv = flush_writes(session->slot);
+  unlock_slot(session->slot);
+
+flush_out:
+  DOUT;
+  return rv;
+}
+
+static const CK_YUBICO_FUNCTION_LIST yubico_function_list = {
+  {1, 4},
+  C_YUBICO_VerifyMessageBatch,
+  C_YUBICO_GetSlotStatistics,
+  C_YUBICO_DeriveKeyBatch,
+  C_YUBICO_GetLockStatistics,
+  C_YUBICO_FlushWrites,
+};
+
 static const CK_FUNCTION_LIST function_list = {
   {CRYPTOKI_LEGACY_VERSION_MAJOR, CRYPTOKI_LEGACY_VERSION_MINOR},
   C_Initialize,
@@ -47,21 +47,83 @@ typedef struct {
   CK_BYTE_PTR     data;
 } ykcs11_data_t;
 
+#define YKCS11_ATTR_CACHE_LEN 4
+
+typedef struct {
+  CK_BYTE_PTR     data;   // Encoded attribute values back to back, NULL until first read
+  CK_ULONG        len[YKCS11_ATTR_CACHE_LEN];
+  CK_RV           rv[YKCS11_ATTR_CACHE_LEN];
+} ykcs11_attr_cache_t;
+
+typedef struct {
+  ykcs11_pkey_ctx_t *ctx;           // Encryption context with the parameters below applied, NULL if not prepared
+  ykcs11_pkey_t     *key;           // Public key the context was prepared for
+  CK_ULONG          padding;
+  const ykcs11_md_t *oaep_md;
+  const ykcs11_md_t *mgf1_md;
+  unsigned char     *oaep_label;
+  CK_ULONG          oaep_label_len;
+} ykcs11_enc_ctx_t;
+
+#define YKCS11_OBJ_CLASSES 5  // Data, certificate, public key, private key and secret key objects
+#define YKCS11_OBJ_SUB_IDS  38 // Object sub ids 0-37
+#define YKCS11_INDEX_LEN    (YKCS11_OBJ_CLASSES * YKCS11_OBJ_SUB_IDS)
+
+// Updated with the lock held, except users, when YKCS11_LOCK_STATS is set
+typedef struct {
+  volatile long users;           // Threads holding or waiting for the lock
+  const char    *holder;         // Function holding the lock
+  const char    *last_holder;    // Function that released the lock last
+  uint64_t      acquired_us;
+  uint64_t      acquisitions;
+  uint64_t      contended;       // Acquisitions that had to wait for another thread
+  uint64_t      wait_us;
+  uint64_t      max_wait_us;
+  uint64_t      hold_us;
+  uint64_t      max_hold_us;
+  const char    *max_wait_holder; // Function that held the lock during the longest wait
+  const char    *max_hold_function;
+} ykcs11_lock_stats_t;
+
 typedef struct {
-  void* mutex;
+  void* mutex;                // Held while using the card, see lock_slot
+  void* objects_mutex;        // Held while using the fields below, and locked after mutex by those changing them
+  ykcs11_lock_stats_t lock_stats;
   CK_SLOT_INFO   slot_info;
   CK_TOKEN_INFO  token_info;
   ykpiv_state    *piv_state;
   ykcs11_login_state_t login_state;
   CK_ULONG       n_objects;   // TOTAL number of objects in the token
   piv_obj_id_t   objects[PIV_OBJ_COUNT]; // List of objects in the token
+  CK_ULONG       n_indexed;   // Number of objects in the index, the index is only used when equal to n_objects
+  piv_obj_id_t   index[PIV_OBJ_COUNT]; // Objects grouped by class and CKA_ID, built by sort_objects
+  CK_ULONG       index_pos[YKCS11_INDEX_LEN + 1]; // Start of each class and CKA_ID group in index
   ykcs11_data_t  data[38];    // Raw data, stored by sub_id 1-37
+  CK_BBOOL       loaded[38];  // Objects read from the token, stored by sub_id 1-37
   ykcs11_x509_t  *certs[26];  // Certificates, stored by sub_id 1-25
   ykcs11_x509_t  *atst[26];   // Attestations, stored by sub_id 1-25
   ykcs11_pkey_t  *pkeys[26];  // Public keys, stored by sub_id 1-25
+  ykcs11_attr_cache_t cert_attrs[26]; // Encoded certificate attributes, stored by sub_id 1-25
+  ykcs11_attr_cache_t atst_attrs[26]; // Encoded attestation attributes, stored by sub_id 1-25
+  ykcs11_attr_cache_t pkey_attrs[26]; // Encoded public key attributes, stored by sub_id 1-25
+  ykcs11_enc_ctx_t enc_ctxs[26]; // Prepared encryption contexts, stored by sub_id 1-25
   CK_BYTE        origin[26];   // Origin of key, stored by sub_id 1-25
   CK_BYTE        pin_policy[26]; // Pin policy for key, stored by sub_id 1-25
   CK_BYTE        touch_policy[26]; // Touch policy for key, stored by sub_id 1-25
+  CK_BBOOL       event;       // Token inserted or removed, not yet reported by C_WaitForSlotEvent
+  CK_ULONG       n_sessions;  // Number of open sessions on the slot
+  void           *prefetch;   // Background reading of the objects not loaded yet, see start_prefetch
+  volatile long  waiting;     // Foreground operations waiting for the slot mutex, see lock_slot
+  CK_BBOOL       coalescing;  // PC/SC transaction kept for the waiting operations, see unlock_slot
+  uint64_t       tries_us;    // When the card was last asked for the PIN attempts, see C_GetTokenInfo
+  CK_BYTE        *snapshot;   // Serialized objects for forked processes, see cache_snapshot_slot
+  size_t         snapshot_len;
+  uint64_t       snapshot_pid; // Process that took or adopted the snapshot
+  ykcs11_data_t  pending[38]; // Contents not written to the token yet, stored by sub_id 1-37, see queue_write
+  CK_BBOOL       dirty[38];   // Objects with a queued write, the object is deleted if its contents are empty
+  uint64_t       pending_us;  // When the oldest queued write was made, 0 if there are none
+  CK_RV          write_rv;    // First error of a background flush, reported by the next flush_writes
+  void           *writer;     // Background flushing of the queued writes, see start_writer
 } ykcs11_slot_t;
 
 typedef enum {
@@ -70,14 +132,25 @@ typedef enum {
   YKCS11_SIGN,
   YKCS11_VERIFY,
   YKCS11_ENCRYPT,
-  YKCS11_DECRYPT
+  YKCS11_DECRYPT,
+  YKCS11_MESSAGE_SIGN,
+  YKCS11_MESSAGE_VERIFY,
+  YKCS11_MESSAGE_ENCRYPT,
+  YKCS11_MESSAGE_DECRYPT
 } ykcs11_op_type_t;
 
+#define YKCS11_OP_BUF_LEN 4096
+#define YKCS11_VERIFY_BATCH_MIN 16 // Minimum number of signatures per thread in a batch verification
+#define YKCS11_SESSION_KEYS 16 // Secret keys per session, created by C_UnwrapKey and C_DeriveKey
+#define YKCS11_SESSION_KEY_BASE 0x10000 // Handle of the first secret key of a session, above the PIV objects
+#define YKCS11_SECRET_MAX_LEN 64
+
 typedef struct {
   CK_BYTE  algorithm;      // PIV Key algorithm
   CK_BYTE  key_id;         // Key id
   CK_BYTE  touch_policy;   // Touch policy
   CK_BYTE  pin_policy;     // PIN policy
+  CK_BBOOL skip_cert;      // Don't store a placeholder certificate for the key
 } gen_info_t;
 
 typedef struct {
@@ -88,17 +161,22 @@ typedef struct {
   const ykcs11_md_t *pss_md;
   const ykcs11_md_t *mgf1_md;
   CK_ULONG          pss_slen;
+  CK_BBOOL          message;   // Multi-part message started by C_SignMessageBegin
 } sign_info_t;
 
 typedef struct {
   CK_ULONG          padding;   // RSA padding, 0 for EC
   ykcs11_pkey_ctx_t *pkey_ctx; // Signature context
+  ykcs11_pkey_t     *key;      // Public key, referenced for the duration of the operation
+  ykcs11_md_ctx_t   *md_tmpl;  // Initialized digest context copied for each message, if any
+  CK_BBOOL          message;   // Multi-part message started by C_VerifyMessageBegin
 } verify_info_t;
 
 typedef struct {
   CK_ULONG          padding;   // RSA padding, 0 for EC
   ykcs11_pkey_t     *key;      // Public key
   CK_BYTE           piv_key;   // PIV Key id
+  CK_BYTE           sub_id;    // Object sub id of the key
   CK_BYTE           algorithm; // PIV Key algorithm
   const ykcs11_md_t *oaep_md;
   const ykcs11_md_t *mgf1_md;
@@ -106,10 +184,17 @@ typedef struct {
   CK_ULONG          oaep_label_len;
 } encrypt_info_t;
 
+typedef struct {
+  ykcs11_cipher_ctx_t *ctx;  // Set up with the key, and for single messages with the IV
+  CK_BBOOL          encrypt;
+  CK_ULONG          tag_len; // GCM tag length in bytes, 0 for CBC
+} cipher_info_t;
+
 typedef union {
   sign_info_t    sign;
   verify_info_t  verify;
   encrypt_info_t encrypt; // Used for both encrypt and decrypt
+  cipher_info_t  cipher;  // Used for both encrypt and decrypt with a session secret key
 } op_t;
 
 typedef struct {
@@ -119,21 +204,33 @@ typedef struct {
   ykcs11_md_ctx_t  *md_ctx;  // Digest context
   CK_ULONG         out_len;  // Required out length in bytes
   CK_ULONG         buf_len;  // Current buf length in bytes
-  CK_BYTE          buf[4096];
+  CK_ULONG         buf_size; // Allocated buf size, more than YKCS11_OP_BUF_LEN while an EdDSA operation needs it
+  CK_BYTE          *buf;     // YKCS11_OP_BUF_LEN bytes, allocated by the first operation on the session
+  CK_BYTE          context_pin[YKPIV_MAX_PIN_LEN]; // Context specific PIN, verified together with the signature
+  CK_ULONG         context_pin_len;
 } op_info_t;
 
 typedef struct {
   CK_BBOOL        active;     
   CK_ULONG        idx;
   CK_ULONG        n_objects;
-  piv_obj_id_t    objects[PIV_OBJ_COUNT];
+  piv_obj_id_t    *objects;   // PIV_OBJ_COUNT entries, allocated by the first search on the session
 } ykcs11_find_t;
 
+typedef struct {
+  CK_KEY_TYPE     type;        // CKK_AES, 0 for an unused entry
+  CK_ULONG        len;
+  CK_BYTE         value[YKCS11_SECRET_MAX_LEN];
+} ykcs11_secret_t;
+
 typedef struct {
   CK_SESSION_INFO info;        // slotid, state, flags, deviceerror
   ykcs11_slot_t   *slot;       // slot for open session, or NULL 
   ykcs11_find_t   find_obj;    // Active find operation (if any)
   op_info_t       op_info;
+  ykcs11_secret_t keys[YKCS11_SESSION_KEYS]; // Secret keys only kept in host memory, see get_session_key
+  CK_ULONG        generation;  // Incremented when the session is closed, part of the handle
+  CK_ULONG        next_free;   // Index of the next free session + 1, or 0
 } ykcs11_session_t;
 
 typedef struct {